@@ -0,0 +1,298 @@
+# Copyright (c) 2003-2019 by Mike Jarvis
+#
+# TreeCorr is free software: redistribution and use in source and binary forms,
+# with or without modification, are permitted provided that the following
+# conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions, and the disclaimer given in the accompanying LICENSE
+#    file.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions, and the disclaimer given in the documentation
+#    and/or other materials provided with the distribution.
+
+# Time the main parts of the C++ layer on synthetic catalogs and write the results as JSON,
+# so the timings can be compared between versions.
+#
+# Run using:
+#   python benchmark.py [--nobj 100000] [--threads 1,2,4] [--output bench.json]
+#
+# Each timing is the best of --repeat runs after one untimed run, which builds any fields
+# the run needs.  The benchmarks are:
+#
+#   build    Building an NField for each split_method (BuildCell and the Field constructor)
+#   corr2    process for each kind of two-point correlation with several bin types and
+#            metrics, which covers process11 for each (D1,D2,B,M) combination listed below
+#   corr3    NNNCorrelation.process, both with the tree (process111) and with brute=True,
+#            which does everything in directProcess111
+#   kmeans   kmeans_refine_centers (KMeansRun) with each of alt=False and alt=True
+#   assign   kmeans_assign_patches (KMeansAssign)
+#
+# The inputs are:
+#
+#   uniform  Uniform points in a flat square
+#   cluster  Most points in Gaussian clumps of various sizes in a flat square
+#   survey   Points on the sphere in an ra, dec window with holes cut out for bright stars,
+#            and with random distances for the 3d and Rperp tests
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import sys
+import time
+
+import numpy as np
+import treecorr
+
+# Flat inputs are in a square of this size, so the mean spacing is L/sqrt(nobj).
+L = 100.
+
+def make_uniform(nobj, rng):
+    x = rng.uniform(0, L, nobj)
+    y = rng.uniform(0, L, nobj)
+    return dict(x=x, y=y)
+
+def make_cluster(nobj, rng):
+    # 20% background, the rest in clumps with sizes from 0.1 to 3.
+    nclump = max(nobj // 1000, 1)
+    nback = nobj // 5
+    cx = rng.uniform(0, L, nclump)
+    cy = rng.uniform(0, L, nclump)
+    cs = 10**rng.uniform(-1, np.log10(3.), nclump)
+    k = rng.integers(0, nclump, nobj - nback)
+    x = np.concatenate([rng.uniform(0, L, nback), cx[k] + rng.normal(0, cs[k])])
+    y = np.concatenate([rng.uniform(0, L, nback), cy[k] + rng.normal(0, cs[k])])
+    x = np.mod(x, L)
+    y = np.mod(y, L)
+    return dict(x=x, y=y)
+
+def make_survey(nobj, rng):
+    # A window from ra = 0..60 deg, dec = -60..-30 deg, uniform on the sphere,
+    # minus circular holes, which cover about 5% of the area.
+    ra_max = 60.
+    dec_min, dec_max = -60., -30.
+    nhole = 200
+    hra = rng.uniform(0, ra_max, nhole)
+    hdec = rng.uniform(dec_min, dec_max, nhole)
+    hrad = rng.uniform(0.1, 0.5, nhole)
+    ra = np.empty(0)
+    dec = np.empty(0)
+    while len(ra) < nobj:
+        n = int((nobj - len(ra)) * 1.1) + 100
+        r = rng.uniform(0, ra_max, n)
+        sd = rng.uniform(np.sin(np.radians(dec_min)), np.sin(np.radians(dec_max)), n)
+        d = np.degrees(np.arcsin(sd))
+        keep = np.ones(n, dtype=bool)
+        for i in range(nhole):
+            dra = (r - hra[i]) * np.cos(np.radians(hdec[i]))
+            keep &= dra**2 + (d - hdec[i])**2 > hrad[i]**2
+        ra = np.concatenate([ra, r[keep]])
+        dec = np.concatenate([dec, d[keep]])
+    ra = ra[:nobj]
+    dec = dec[:nobj]
+    r = rng.uniform(500, 1000, nobj)
+    return dict(ra=ra, dec=dec, r=r)
+
+inputs = {
+    'uniform': make_uniform,
+    'cluster': make_cluster,
+    'survey': make_survey,
+}
+
+def make_cat(pos, rng, use_r=False):
+    nobj = len(pos['x'] if 'x' in pos else pos['ra'])
+    kwargs = dict(w=rng.uniform(0.5, 1.5, nobj), k=rng.normal(0, 0.1, nobj),
+                  g1=rng.normal(0, 0.2, nobj), g2=rng.normal(0, 0.2, nobj))
+    if 'x' in pos:
+        return treecorr.Catalog(x=pos['x'], y=pos['y'], **kwargs)
+    elif use_r:
+        return treecorr.Catalog(ra=pos['ra'], dec=pos['dec'], r=pos['r'],
+                                ra_units='deg', dec_units='deg', **kwargs)
+    else:
+        return treecorr.Catalog(ra=pos['ra'], dec=pos['dec'],
+                                ra_units='deg', dec_units='deg', **kwargs)
+
+# Separations to use for each geometry.  The survey window is about 40 x 30 degrees.
+flat_config = dict(min_sep=0.1, max_sep=10., nbins=20)
+sphere_config = dict(min_sep=1., max_sep=100., nbins=20, sep_units='arcmin')
+rperp_config = dict(min_sep=0.5, max_sep=20., nbins=20)
+
+# name, class, bin_type, metric, coords, config
+corr2_tests = [
+    ('nn', treecorr.NNCorrelation, 'Log', 'Euclidean', 'flat', flat_config),
+    ('nn', treecorr.NNCorrelation, 'Linear', 'Euclidean', 'flat', dict(flat_config, min_sep=0.)),
+    ('nn', treecorr.NNCorrelation, 'TwoD', 'Euclidean', 'flat', dict(max_sep=5., nbins=20)),
+    ('nk', treecorr.NKCorrelation, 'Log', 'Euclidean', 'flat', flat_config),
+    ('kk', treecorr.KKCorrelation, 'Log', 'Euclidean', 'flat', flat_config),
+    ('ng', treecorr.NGCorrelation, 'Log', 'Euclidean', 'flat', flat_config),
+    ('kg', treecorr.KGCorrelation, 'Log', 'Euclidean', 'flat', flat_config),
+    ('gg', treecorr.GGCorrelation, 'Log', 'Euclidean', 'flat', flat_config),
+    ('nn', treecorr.NNCorrelation, 'Log', 'Euclidean', 'spherical', sphere_config),
+    ('nn', treecorr.NNCorrelation, 'Log', 'Arc', 'spherical', sphere_config),
+    ('gg', treecorr.GGCorrelation, 'Log', 'Euclidean', 'spherical', sphere_config),
+    ('nn', treecorr.NNCorrelation, 'Log', 'Euclidean', '3d', rperp_config),
+    ('nn', treecorr.NNCorrelation, 'Log', 'Rperp', '3d', rperp_config),
+    ('gg', treecorr.GGCorrelation, 'Log', 'Rperp', '3d', rperp_config),
+]
+
+def time_it(f, repeat):
+    f()
+    times = []
+    for i in range(repeat):
+        t0 = time.perf_counter()
+        f()
+        times.append(time.perf_counter() - t0)
+    return times
+
+class Runner(object):
+    def __init__(self, args):
+        self.args = args
+        self.results = []
+
+    def record(self, bench, input_name, nobj, nthreads, params, times):
+        result = dict(benchmark=bench, input=input_name, nobj=nobj, nthreads=nthreads,
+                      params=params, time=min(times), times=times)
+        self.results.append(result)
+        print('%-7s %-8s %9d %3d  %-50s %9.4f' % (bench, input_name, nobj, nthreads,
+              ' '.join('%s=%s'%kv for kv in sorted(params.items())), min(times)),
+              file=sys.stderr)
+
+    def run_build(self, input_name, cat, nthreads):
+        treecorr.set_omp_threads(nthreads)
+        for sm in ['mean', 'median', 'middle', 'random']:
+            # Build the field directly, since cat.getNField caches the result.  The cells are
+            # only built when they are first used, so get nTopLevelNodes to build them here.
+            f = lambda: treecorr.NField(cat, split_method=sm,
+                                        rng=np.random.RandomState(1234)).nTopLevelNodes
+            times = time_it(f, self.args.repeat)
+            self.record('build', input_name, cat.ntot, nthreads, dict(split_method=sm), times)
+
+    def run_corr2(self, input_name, cats, nthreads):
+        for name, cls, bin_type, metric, coords, config in corr2_tests:
+            if coords not in cats: continue
+            cat = cats[coords]
+            corr = cls(config, bin_type=bin_type)
+            f = lambda: corr.process(cat, metric=metric, num_threads=nthreads)
+            times = time_it(f, self.args.repeat)
+            params = dict(corr=name, bin_type=bin_type, metric=metric, coords=coords)
+            self.record('corr2', input_name, cat.ntot, nthreads, params, times)
+
+    def run_corr3(self, input_name, cat, nthreads):
+        # Three-point is much slower, so use a subset of the objects.
+        rng = np.random.default_rng(self.args.seed)
+        for brute, frac in [(False, 20), (True, 200)]:
+            n3 = max(cat.ntot // frac, 10)
+            use = rng.choice(cat.ntot, n3, replace=False)
+            if cat.ra is None:
+                cat3 = treecorr.Catalog(x=cat.x[use], y=cat.y[use], w=cat.w[use])
+                config = dict(min_sep=1., max_sep=10., nbins=5)
+            else:
+                cat3 = treecorr.Catalog(ra=cat.ra[use], dec=cat.dec[use], w=cat.w[use],
+                                        ra_units='rad', dec_units='rad')
+                config = dict(min_sep=10., max_sep=100., nbins=5, sep_units='arcmin')
+            nnn = treecorr.NNNCorrelation(config, brute=brute)
+            f = lambda: nnn.process(cat3, num_threads=nthreads)
+            times = time_it(f, self.args.repeat)
+            self.record('corr3', input_name, n3, nthreads, dict(brute=brute), times)
+
+    def run_kmeans(self, input_name, cat, nthreads):
+        treecorr.set_omp_threads(nthreads)
+        field = cat.getNField()
+        rng = np.random.RandomState(self.args.seed)
+        init_centers = field.kmeans_initialize_centers(self.args.npatch, rng=rng)
+        for alt in [False, True]:
+            # Use tol=0, so it always does max_iter iterations.
+            f = lambda: field.kmeans_refine_centers(init_centers.copy(), max_iter=20, tol=0.,
+                                                    alt=alt)
+            times = time_it(f, self.args.repeat)
+            params = dict(npatch=self.args.npatch, alt=alt, max_iter=20)
+            self.record('kmeans', input_name, cat.ntot, nthreads, params, times)
+
+        f = lambda: field.kmeans_assign_patches(init_centers)
+        times = time_it(f, self.args.repeat)
+        params = dict(npatch=self.args.npatch)
+        self.record('assign', input_name, cat.ntot, nthreads, params, times)
+
+    def run(self):
+        args = self.args
+        for input_name in args.inputs:
+            rng = np.random.default_rng(args.seed)
+            pos = inputs[input_name](args.nobj, rng)
+            cats = {}
+            if 'x' in pos:
+                cats['flat'] = make_cat(pos, np.random.default_rng(args.seed))
+            else:
+                cats['spherical'] = make_cat(pos, np.random.default_rng(args.seed))
+                cats['3d'] = make_cat(pos, np.random.default_rng(args.seed), use_r=True)
+            main_cat = cats['flat'] if 'flat' in cats else cats['spherical']
+
+            for nthreads in args.threads:
+                if 'build' in args.benchmarks:
+                    self.run_build(input_name, main_cat, nthreads)
+                if 'corr2' in args.benchmarks:
+                    self.run_corr2(input_name, cats, nthreads)
+                if 'corr3' in args.benchmarks:
+                    self.run_corr3(input_name, main_cat, nthreads)
+                if 'kmeans' in args.benchmarks:
+                    self.run_kmeans(input_name, main_cat, nthreads)
+
+    def output(self):
+        out = dict(
+            treecorr_version=treecorr.__version__,
+            numpy_version=np.__version__,
+            python_version=platform.python_version(),
+            platform=platform.platform(),
+            processor=platform.processor(),
+            ncpu=os.cpu_count(),
+            date=datetime.datetime.now().isoformat(),
+            args=vars(self.args),
+            results=self.results,
+        )
+        if self.args.output:
+            with open(self.args.output, 'w') as fout:
+                json.dump(out, fout, indent=1)
+        else:
+            json.dump(out, sys.stdout, indent=1)
+            print()
+
+def parse_args():
+    ncpu = os.cpu_count() or 1
+    default_threads = sorted(set([2**i for i in range(ncpu.bit_length()) if 2**i <= ncpu] +
+                                 [ncpu]))
+    all_benchmarks = ['build', 'corr2', 'corr3', 'kmeans']
+    parser = argparse.ArgumentParser(description='Time the TreeCorr C++ layer.')
+    parser.add_argument('--nobj', type=int, default=100000,
+                        help='Number of objects in each input catalog (default: 100000)')
+    parser.add_argument('--threads', default=','.join(str(t) for t in default_threads),
+                        help='Comma-separated thread counts (default: powers of 2 up to ncpu)')
+    parser.add_argument('--inputs', default=','.join(inputs),
+                        help='Comma-separated inputs from %s (default: all)'%', '.join(inputs))
+    parser.add_argument('--benchmarks', default=','.join(all_benchmarks),
+                        help='Comma-separated benchmarks from %s (default: all)'%(
+                             ', '.join(all_benchmarks)))
+    parser.add_argument('--npatch', type=int, default=50,
+                        help='Number of patches for the kmeans benchmarks (default: 50)')
+    parser.add_argument('--repeat', type=int, default=3,
+                        help='Number of timed runs of each benchmark (default: 3)')
+    parser.add_argument('--seed', type=int, default=8675309,
+                        help='Random number seed for the inputs (default: 8675309)')
+    parser.add_argument('--output', default=None,
+                        help='JSON file to write (default: write to stdout)')
+    args = parser.parse_args()
+    args.threads = [int(t) for t in args.threads.split(',')]
+    args.inputs = args.inputs.split(',')
+    args.benchmarks = args.benchmarks.split(',')
+    for name in args.inputs:
+        if name not in inputs:
+            parser.error('Invalid input %s'%name)
+    for name in args.benchmarks:
+        if name not in all_benchmarks:
+            parser.error('Invalid benchmark %s'%name)
+    return args
+
+if __name__ == '__main__':
+    runner = Runner(parse_args())
+    runner.run()
+    runner.output()
@@ -0,0 +1,97 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_Affinity_H
+#define TreeCorr_Affinity_H
+
+#include <vector>
+#include <atomic>
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
+
+// How the OpenMP threads are pinned to the cpus.  (cf. SetThreadAffinity)
+// Compact puts thread t on the t-th allowed cpu, so consecutive threads share a socket.
+// Spread goes round robin over the sockets.
+enum AffinityPolicy { AffinityNone, AffinityCompact, AffinitySpread };
+
+// In Affinity.cpp.
+AffinityPolicy GetAffinityPolicy();
+// Pin the threads of the OpenMP pool according to the policy.  Returns false if this isn't
+// possible here (which is only on Linux with OpenMP).
+bool SetAffinityPolicy(AffinityPolicy policy);
+// Pin them again with the current policy, e.g. after changing the number of threads.
+void ApplyAffinityPolicy();
+
+// This hands out the items 0..n-1 of a parallel loop to the threads.  Each thread first takes
+// the items in its own contiguous block, in order, and then helps with the other blocks,
+// starting with the next thread's.
+//
+// When the threads are pinned, the top-level cells of a Field are built this way, so the
+// memory of each cell's tree is first touched, and so placed on the NUMA node of, the thread
+// that owns it.  Processing them the same way then means that each thread mostly traverses
+// the trees in its local memory.
+//
+// Use it inside an omp for over n iterations (with any schedule), calling next once per
+// iteration.  Since there are exactly n calls, each one gets an item.  If the threads aren't
+// pinned, it is off, and the loop should just use its own index.
+class OwnerSchedule
+{
+public:
+    OwnerSchedule(long n) : _n(n), _nthreads(NThreads()), _next(_nthreads)
+    {
+        for (int t=0; t<_nthreads; ++t) _next[t].i = begin(t);
+    }
+
+    bool on() const { return _nthreads > 0; }
+
+    // The next item for the current thread, or -1 if there are none left.
+    long next()
+    {
+#ifdef _OPENMP
+        const int t = omp_get_thread_num() % _nthreads;
+#else
+        const int t = 0;
+#endif
+        for (int k=0; k<_nthreads; ++k) {
+            const int u = (t + k) % _nthreads;
+            const long end = begin(u+1);
+            if (_next[u].i.load(std::memory_order_relaxed) >= end) continue;
+            const long i = _next[u].i++;
+            if (i < end) return i;
+        }
+        return -1;
+    }
+
+private:
+    static int NThreads()
+    {
+#ifdef _OPENMP
+        if (GetAffinityPolicy() != AffinityNone) return omp_get_max_threads();
+#endif
+        return 0;
+    }
+
+    long begin(int t) const { return _n * t / _nthreads; }
+
+    // Padded to a cache line each, so the threads don't contend for them.
+    struct Counter { std::atomic<long> i; char pad[64 - sizeof(std::atomic<long>)]; };
+
+    const long _n;
+    const int _nthreads;
+    std::vector<Counter> _next;
+};
+
+#endif
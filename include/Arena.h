@@ -0,0 +1,100 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_Arena_H
+#define TreeCorr_Arena_H
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#include "dbg.h"
+
+// An Arena is a simple bump allocator.  Memory is handed out sequentially from a few large
+// blocks, and it is only ever released all at once when the Arena itself is destroyed.
+// This is used for building the Cell trees, where otherwise every Cell, CellData, and
+// leaf index list would be a separate small heap allocation.  With an Arena, building a tree
+// costs just one or a few allocations, and tearing it down is essentially free.
+//
+// Note: Nothing allocated from an Arena has its destructor called.  So it should only be
+// used for objects that don't own any other memory outside of the Arena.
+//
+// Also note: An Arena is not thread safe.  Use a separate Arena for each thread.
+class Arena
+{
+public:
+    // blocksize is the size of each block to allocate.  If a single allocation is larger
+    // than this, it gets its own block.
+    explicit Arena(size_t blocksize=1<<20) :
+        _blocksize(blocksize), _next(0), _end(0), _nbytes(0) {}
+
+    ~Arena()
+    {
+        for (size_t i=0; i<_blocks.size(); ++i) ::operator delete(_blocks[i]);
+    }
+
+    void* allocate(size_t n)
+    {
+        // Keep everything aligned suitably for any type.
+        const size_t align = alignof(std::max_align_t);
+        n = (n + align - 1) & ~(align - 1);
+        if (_next + n > _end) newBlock(n);
+        void* p = _next;
+        _next += n;
+        _nbytes += n;
+        return p;
+    }
+
+    // The total number of bytes handed out so far.
+    size_t getNBytes() const { return _nbytes; }
+    int getNBlocks() const { return int(_blocks.size()); }
+
+private:
+
+    void newBlock(size_t n)
+    {
+        size_t size = n > _blocksize ? n : _blocksize;
+        xdbg<<"Arena: new block of size "<<size<<std::endl;
+        _next = static_cast<char*>(::operator new(size));
+        _end = _next + size;
+        _blocks.push_back(_next);
+    }
+
+    // Arenas are not copyable.
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+    size_t _blocksize;
+    char* _next;
+    char* _end;
+    size_t _nbytes;
+    std::vector<char*> _blocks;
+};
+
+// These let us write new (arena) T(...) and new (arena) T[n].  If arena is null, they
+// fall back to the normal heap allocation, so the result may be deleted normally.
+inline void* operator new(size_t n, Arena* arena)
+{ return arena ? arena->allocate(n) : ::operator new(n); }
+
+inline void* operator new[](size_t n, Arena* arena)
+{ return arena ? arena->allocate(n) : ::operator new[](n); }
+
+// These are only used if a constructor throws.
+inline void operator delete(void* p, Arena* arena)
+{ if (!arena) ::operator delete(p); }
+
+inline void operator delete[](void* p, Arena* arena)
+{ if (!arena) ::operator delete[](p); }
+
+#endif
@@ -19,6 +19,60 @@
 #include "BinType_C.h"
 #include <limits>
 #include <cmath>
+#include <vector>
+#include <algorithm>
+
+// The Edges bin type uses an explicit, increasing list of nbins+1 bin edges in r.
+// BinEdges keeps a copy of them along with a lookup table in log(r), whose cells are at most
+// 1/3 of the width (in log(r)) of the narrowest bin.  So even if rounding in log(r) puts r
+// into a neighboring cell, the bin for r is within one of the table entry, and two
+// branch-free comparisons with the edges fix it up.
+// If the narrowest bin is so narrow that the table would need more than MAX_LUT entries,
+// lookup does a binary search of the edges instead.
+struct BinEdges
+{
+    static const int MAX_LUT = 1<<16;
+
+    BinEdges(const double* e, int n) : edges(e, e+n+1), nbins(n), nlut(0), invdlogr(0.)
+    {
+        logminsep = std::log(edges[0]);
+        const double logrange = std::log(edges[nbins]) - logminsep;
+        double minwidth = logrange;
+        for (int k=0; k<nbins; ++k)
+            minwidth = std::min(minwidth, std::log(edges[k+1] / edges[k]));
+        const double n_d = std::ceil(3. * logrange / minwidth);
+        if (n_d > MAX_LUT) return;
+        nlut = int(n_d);
+        invdlogr = nlut / logrange;
+        lut.resize(nlut);
+        int k = 0;
+        for (int j=0; j<nlut; ++j) {
+            const double r = std::exp(logminsep + j / invdlogr);
+            while (k < nbins-1 && r >= edges[k+1]) ++k;
+            lut[j] = k;
+        }
+    }
+
+    // Returns the index of the bin for r, which may be -1 or nbins if r is out of range.
+    int lookup(double r, double logr) const
+    {
+        if (nlut == 0)
+            return int(std::upper_bound(edges.begin(), edges.end(), r) - edges.begin()) - 1;
+        int j = int((logr - logminsep) * invdlogr);
+        j = std::max(0, std::min(j, nlut-1));
+        int k = lut[j];
+        k += (r >= edges[k+1]);
+        k -= (r < edges[k]);
+        return k;
+    }
+
+    std::vector<double> edges;
+    std::vector<int> lut;
+    int nbins;
+    int nlut;
+    double logminsep;
+    double invdlogr;
+};
 
 
 template <int M>
@@ -72,7 +126,8 @@ struct BinTypeHelper<Log>
     template <int C>
     static int calculateBinK(const Position<C>& p1, const Position<C>& p2,
                              double r, double logr, double binsize,
-                             double minsep, double maxsep, double logminsep)
+                             double minsep, double maxsep, double logminsep,
+                             const BinEdges* edges)
     { return int((logr - logminsep) / binsize); }
 
     // Check if we can stop recursing the tree and drop the given pair of cells
@@ -82,7 +137,7 @@ struct BinTypeHelper<Log>
                           const Position<C>& p1, const Position<C>& p2,
                           double binsize, double b, double bsq,
                           double minsep, double maxsep, double logminsep,
-                          int& ik, double& r, double& logr)
+                          const BinEdges* edges, int& ik, double& r, double& logr)
     {
         xdbg<<"singleBin: "<<rsq<<"  "<<s1ps2<<std::endl;
 
@@ -172,7 +227,8 @@ struct BinTypeHelper<Linear>
     template <int C>
     static int calculateBinK(const Position<C>& p1, const Position<C>& p2,
                              double r, double logr, double binsize,
-                             double minsep, double maxsep, double logminsep)
+                             double minsep, double maxsep, double logminsep,
+                             const BinEdges* edges)
     { return int((r - minsep) / binsize); }
 
     template <int C>
@@ -180,7 +236,7 @@ struct BinTypeHelper<Linear>
                           const Position<C>& p1, const Position<C>& p2,
                           double binsize, double b, double bsq,
                           double minsep, double maxsep, double logminsep,
-                          int& ik, double& r, double& logr)
+                          const BinEdges* edges, int& ik, double& r, double& logr)
     {
         xdbg<<"singleBin: "<<rsq<<"  "<<s1ps2<<std::endl;
 
@@ -270,7 +326,8 @@ struct BinTypeHelper<TwoD>
     template <int C>
     static int calculateBinK(const Position<C>& p1, const Position<C>& p2,
                              double r, double logr, double binsize,
-                             double minsep, double maxsep, double logminsep)
+                             double minsep, double maxsep, double logminsep,
+                             const BinEdges* edges)
     {
         // Binning is separately in i,j, but then we combine into a single index as k=j*n+i.
         double dx = p2.getX() - p1.getX();
@@ -290,7 +347,7 @@ struct BinTypeHelper<TwoD>
                           const Position<C>& p1, const Position<C>& p2,
                           double binsize, double b, double bsq,
                           double minsep, double maxsep, double logminsep,
-                          int& k, double& r, double& logr)
+                          const BinEdges* edges, int& k, double& r, double& logr)
     {
         xdbg<<"singleBin: "<<rsq<<"  "<<s1ps2<<std::endl;
 
@@ -341,12 +398,84 @@ struct BinTypeHelper<TwoD>
 
         int n = int(2*maxsep / binsize+0.5);
         k = j*n + i;
+        r = sqrt(rsq);
         logr = 0.5*std::log(rsq);
         xdbg<<"Single bin returning true: "<<dx<<','<<dy<<','<<s1ps2<<','<<binsize<<std::endl;
         return true;
     }
 };
 
+// The edges and lookup table are in the BinEdges object, which is given to calculateBinK and
+// singleBin.  The rest is like Log binning, where b is relative to r.  The python layer
+// sets b = bin_slop times the narrowest bin width in log(r).
+template <>
+struct BinTypeHelper<Edges>
+{
+    static bool doReverse() { return false; }
+
+    static double getEffectiveB(double r, double b)
+    { return r*b; }
+
+    static double getEffectiveBSq(double rsq, double bsq)
+    { return rsq*bsq; }
+
+    static double calculateFullMaxSep(double minsep, double maxsep, int nbins, double binsize)
+    { return maxsep; }
+
+    template <int C>
+    static bool isRSqInRange(double rsq, const Position<C>& p1, const Position<C>& p2,
+                           double minsep, double minsepsq, double maxsep, double maxsepsq)
+    {
+        return rsq >= minsepsq && rsq < maxsepsq;
+    }
+    static bool tooSmallDist(double rsq, double s1ps2, double minsep, double minsepsq)
+    {
+        return rsq < minsepsq && s1ps2 < minsep && rsq < SQR(minsep - s1ps2);
+    }
+    static bool tooLargeDist(double rsq, double s1ps2, double maxsep, double maxsepsq)
+    {
+        return rsq >= maxsepsq && rsq >= SQR(maxsep + s1ps2);
+    }
+
+    template <int C>
+    static int calculateBinK(const Position<C>& p1, const Position<C>& p2,
+                             double r, double logr, double binsize,
+                             double minsep, double maxsep, double logminsep,
+                             const BinEdges* edges)
+    { return edges->lookup(r, logr); }
+
+    template <int C>
+    static bool singleBin(double rsq, double s1ps2,
+                          const Position<C>& p1, const Position<C>& p2,
+                          double binsize, double b, double bsq,
+                          double minsep, double maxsep, double logminsep,
+                          const BinEdges* edges, int& ik, double& r, double& logr)
+    {
+        xdbg<<"singleBin: "<<rsq<<"  "<<s1ps2<<std::endl;
+
+        // If two leaves, stop splitting.
+        if (s1ps2 == 0.) return true;
+
+        // Standard stop splitting criterion.
+        // s1 + s2 <= b * r
+        if (SQR(s1ps2) <= bsq*rsq) return true;
+
+        // Otherwise, the pair fits if r - s1ps2 and r + s1ps2 are both within the edges of
+        // the bin for r, allowing each to leak past its edge by b * r.
+        r = sqrt(rsq);
+        logr = std::log(r);
+        ik = edges->lookup(r, logr);
+        xdbg<<"r, ik = "<<r<<", "<<ik<<std::endl;
+        if (ik < 0 || ik >= edges->nbins) return false;
+        const double br = b * r;
+        if (r - s1ps2 + br < edges->edges[ik]) return false;
+        if (r + s1ps2 - br >= edges->edges[ik+1]) return false;
+
+        xdbg<<"Both checks passed.\n";
+        return true;
+    }
+};
+
 
 #endif
 
@@ -18,9 +18,10 @@
 // Log is logarithmic spacing in r
 // Linear is linear spacing in r
 // TwoD is linear spacing in x,y
+// Edges is an explicit list of bin edges in r
 
 // This is the C++ way to do it.
-//enum BinType { Log=1, Linear=2, TwoD=3 };
+//enum BinType { Log=1, Linear=2, TwoD=3, Edges=4 };
 
 // But this is how we need to do it in C.
-typedef enum { Log=1, Linear=2, TwoD=3 } BinType;
+typedef enum { Log=1, Linear=2, TwoD=3, Edges=4 } BinType;
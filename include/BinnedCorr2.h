@@ -22,10 +22,91 @@
 #include "Field.h"
 #include "BinType.h"
 #include "Metric.h"
+#include "InteractionList.h"
+#include "PruneStats2.h"
 
 template <int D1, int D2>
 struct XiData;
 
+// The locks for an accumulator that is shared by several threads.  (Defined in StripeLocks.h)
+struct StripeLocks;
+
+// The possible outcomes of the tests for what to do with a pair of cells.
+enum PairAction { SkipPair, DirectPair, SplitPair };
+
+// The pairs of cells that process11 has found should be accumulated directly, but whose bins
+// haven't been calculated yet.  Rather than doing each one as soon as it is found, process11
+// collects them here, so the square roots and logs can be calculated for a whole batch at once
+// in simple loops that the compiler can vectorize.
+template <int D1, int D2, int C>
+struct DirectBatch
+{
+    enum { N = 64 };
+    DirectBatch() : n(0) {}
+    bool full() const { return n == N; }
+    void add(const Cell<D1,C>* a, const Cell<D2,C>* b, double dsq)
+    { c1[n] = a; c2[n] = b; rsq[n] = dsq; ++n; }
+
+    const Cell<D1,C>* c1[N];
+    const Cell<D2,C>* c2[N];
+    double rsq[N];
+    long n;
+};
+
+// A pair of cells found by samplePairs whose pairs of objects are all in the range to sample.
+// r is the separation of the cell centers, which is used for all of their pairs, and n is
+// the number of pairs of objects.
+template <int D1, int D2, int C>
+struct SampleCellPair
+{
+    const Cell<D1,C>* c1;
+    const Cell<D2,C>* c2;
+    double r;
+    long n;
+};
+
+// The single precision sums that a thread's copy of the accumulators uses with float_accum.
+// Each bin has N sums (meanr, meanlogr, weight, npairs and then the xi arrays) next to each
+// other.  After FLUSH_COUNT additions to a bin, its sums are promoted to double and added to
+// the original's arrays, so no float sum ever has more than a few terms.
+template <int N>
+struct FloatAccum
+{
+    enum { FLUSH_COUNT = 64 };
+
+    // dest[j] is the array of the original that sum j is added to.
+    FloatAccum(int nbins, double* const* dest) : _sums(nbins*N, 0.f), _count(nbins, 0)
+    { for (int j=0; j<N; ++j) _dest[j] = dest[j]; }
+
+    void add(int k, const double* v)
+    {
+        float* s = &_sums[k*N];
+        for (int j=0; j<N; ++j) s[j] += float(v[j]);
+        if (++_count[k] == FLUSH_COUNT) flush(k);
+    }
+
+    // Other threads may be flushing the same bin of the original, so this is atomic.
+    void flush(int k)
+    {
+        float* s = &_sums[k*N];
+        for (int j=0; j<N; ++j) {
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+            _dest[j][k] += s[j];
+            s[j] = 0.f;
+        }
+        _count[k] = 0;
+    }
+
+    void flushRange(int i1, int i2)
+    { for (int k=i1; k<i2; ++k) if (_count[k]) flush(k); }
+
+    std::vector<float> _sums;
+    std::vector<int> _count;
+    double* _dest[N];
+};
+
 // BinnedCorr2 encapsulates a binned correlation function.
 template <int D1, int D2, int B>
 class BinnedCorr2
@@ -34,18 +115,53 @@ class BinnedCorr2
 public:
 
     BinnedCorr2(double minsep, double maxsep, int nbins, double binsize, double b,
+                const double* edges, const double* bin_b,
                 double minrpar, double maxrpar, double xp, double yp, double zp,
+                double max_accum_mem, bool float_accum,
                 double* xi0, double* xi1, double* xi2, double* xi3,
                 double* meanr, double* meanlogr, double* weight, double* npairs);
-    BinnedCorr2(const BinnedCorr2& rhs, bool copy_data=true);
+    // With float_copy, the copy accumulates into a FloatAccum that adds to rhs's arrays,
+    // rather than having arrays of its own.  (cf. startThread)
+    BinnedCorr2(const BinnedCorr2& rhs, bool copy_data=true, bool float_copy=false);
     ~BinnedCorr2();
 
     void clear();  // Set all data to 0.
 
+    // Set the factor that decides whether to split both cells of a pair or only the larger
+    // one.  (cf. CalcSplit)  The default is the square root of DEFAULT_SPLIT_FACTOR_SQ.
+    void setSplitFactor(double splitfactor) { _splitfactorsq = splitfactor * splitfactor; }
+
+    // Set the min_size of the trees this binning would use.  Cells smaller than this would be
+    // leaves in such a tree, so if the tree is finer, they are treated as points of size 0.
+    // This lets a finer tree stand in for the one that would be built for this binning.
+    // (cf. Catalog reuse_fields)
+    void setMinSize(double minsize) { _minsize = minsize; }
+
+    // Write the counters of how the traversal in process11 went.  (See PruneStats2.h)
+    void writePruneStats(long* counts, long* depth) const { _stats.write(counts, depth); }
+    void clearPruneStats() { _stats.clear(); }
+
+    // If patch >= 0, only use the top-level cells of that patch.  (cf. Field::getNPatch)
     template <int C, int M, int P>
-    void process(const Field<D1, C>& field, bool dots);
+    void process(const Field<D1, C>& field, bool dots, int patch=-1);
     template <int C, int M, int P>
-    void process(const Field<D1, C>& field1, const Field<D2, C>& field2, bool dots);
+    void process(const Field<D1, C>& field1, const Field<D2, C>& field2, bool dots,
+                 int patch1=-1, int patch2=-1);
+    // Record the pairs of cells that directProcess11 accumulates in the following calls to
+    // process, so finishRecord can make them into an InteractionList.  (For an auto-correlation,
+    // field2 is the same as field1.)  metric is the one that process used.
+    void startRecord();
+    template <int C>
+    InteractionList* finishRecord(const Field<D1, C>& field1, const Field<D2, C>& field2,
+                                  bool is_auto, int metric);
+
+    // Accumulate the pairs of cells in an InteractionList, which must have been recorded with
+    // the same trees as these fields, and the same separation range, bin_slop and metric.
+    // If not, this returns false without accumulating anything.
+    template <int C>
+    bool replay(const InteractionList& list, const Field<D1, C>& field1,
+                const Field<D2, C>& field2, int metric);
+
     template <int C, int M, int P>
     void processPairwise(const SimpleField<D1, C>& field, const SimpleField<D2, C>& field2,
                          bool dots);
@@ -58,25 +174,106 @@ public:
     void process11(const Cell<D1,C>& c1, const Cell<D2,C>& c2, const MetricHelper<M,P>& m,
                    bool do_reverse);
 
+    // This is used by process11 when the Cells that need to be split are buckets.  Rather
+    // than continuing the traversal through the buckets, it loops over their leaves.
+    template <int C, int M, int P>
+    void processBucket(const Cell<D1,C>& c1, const Cell<D2,C>& c2, bool split1, bool split2,
+                       const MetricHelper<M,P>& m, bool do_reverse);
+
+    // Process all pairs of leaves1[i] and leaves2[j], which all have zero size.  The CellData
+    // of leaves2 must be contiguous, as they are for the leaves of a bucket.
+    template <int C, int M, int P>
+    void processLeafPairs(const Cell<D1,C>* leaves1, long n1,
+                          const Cell<D2,C>* leaves2, long n2,
+                          const MetricHelper<M,P>& m, bool do_reverse);
+
+    // The same calculations, but using the PackedTree layout.
+    template <int C, int M, int P>
+    void process2(const PackedTree<D1,C>& t, long i, const MetricHelper<M,P>& m);
+
+    template <int C, int M, int P>
+    void process11(const PackedTree<D1,C>& t1, long i1, const PackedTree<D2,C>& t2, long i2,
+                   const MetricHelper<M,P>& m, bool do_reverse);
+
+    // Run process11 for this pair of cells as a new OpenMP task, which any idle thread may
+    // pick up.  The task accumulates into the executing thread's entry in _thread_corrs.
+    template <int C, int M, int P>
+    void process11Task(const Cell<D1,C>& c1, const Cell<D2,C>& c2, const MetricHelper<M,P>& m,
+                       bool do_reverse);
+    template <int C, int M, int P>
+    void process11Task(const PackedTree<D1,C>& t1, long i1, const PackedTree<D2,C>& t2, long i2,
+                       const MetricHelper<M,P>& m, bool do_reverse);
+
+    // Accumulate the pairs in a DirectBatch, and then empty it.
+    template <int C>
+    void directProcessBatch(DirectBatch<D1,D2,C>& batch, bool do_reverse);
+
+    // Whether a pair of cells with n1 and n2 objects is enough work to split into tasks.
+    bool isTaskWork(long n1, long n2) const
+    { return _thread_corrs && double(n1) * double(n2) > _min_task_work; }
+
+    // Determine whether a pair of cells with the given positions and sizes should be
+    // skipped, accumulated directly, or split.  For DirectPair, rsq, k, r, logr are set
+    // appropriately for directProcess11.  For SplitPair, split1, split2 say which to split.
+    template <int C, int M, int P>
+    PairAction classifyPair(const Position<C>& p1, const Position<C>& p2, double s1, double s2,
+                            const MetricHelper<M,P>& m, double& rsq, int& k, double& r,
+                            double& logr, bool& split1, bool& split2);
+
+    // The same, but with rsq (and the possibly modified s1, s2) already computed by
+    // metric.DistSq, e.g. when several correlations share the distance calculation.
+    template <int C, int M, int P>
+    PairAction classifyPairDistSq(const Position<C>& p1, const Position<C>& p2,
+                                  double s1, double s2, const MetricHelper<M,P>& m, double rsq,
+                                  int& k, double& r, double& logr, bool& split1, bool& split2);
+
+    // The b to use for a pair of cells separated by sqrt(rsq).  With a b for each bin, this is
+    // the smallest b of any bin that the pair might fall into, unless _b (the smallest of all)
+    // is already enough for s1ps2.  Otherwise it is just _b.
+    double getPairB(double rsq, double s1ps2) const;
+
     template <int C>
     void directProcess11(const Cell<D1,C>& c1, const Cell<D2,C>& c2, const double dsq,
                          bool do_reverse, int k=-1, double r=0., double logr=0.);
 
+    // The number of values accumulated for each pair: meanr, meanlogr, weight, npairs, xi.
+    enum { NVALUES = 4 + XiData<D1,D2>::NARRAYS };
+
+    // Add the values for one pair to bin k.
+    void addToBin(int k, const double* v);
+
     // Note: op= only copies _data.  Not all the params.
     void operator=(const BinnedCorr2<D1,D2,B>& rhs);
     void operator+=(const BinnedCorr2<D1,D2,B>& rhs);
 
+    // Add bins i1 <= k < i2 of rhs to this.
+    void addRange(const BinnedCorr2<D1,D2,B>& rhs, int i1, int i2);
+
+    // The number of bytes of data in each copy made for the threads.
+    double getCopyBytes() const
+    {
+        return double(_nbins) * (_float_accum ? sizeof(float) * NVALUES + sizeof(int) :
+                                 sizeof(double) * NVALUES);
+    }
+
+    // How many copies to make for nthreads threads, given the limit of _max_accum_mem.
+    int getNCopies(int nthreads) const;
+
+    // These set up the accumulator for the current thread at the start of an omp parallel
+    // region in process and combine all the threads' results into this at the end.
+    BinnedCorr2<D1,D2,B>* startThread(std::vector<BinnedCorr2<D1,D2,B>*>& thread_corrs,
+                                      StripeLocks* locks, int ncopies, double min_task_work);
+    void finishThread(std::vector<BinnedCorr2<D1,D2,B>*>& thread_corrs, int ncopies);
+
     // Sample a random subset of pairs in a given range
     template <int M, int P, int C>
     long samplePairs(const Field<D1, C>& field1, const Field<D2, C>& field2,
                      double min_sep, double max_sep, long* i1, long* i2, double* sep, int n);
     template <int M, int P, int C>
-    void samplePairs(const Cell<D1, C>& c1, const Cell<D2, C>& c2, const MetricHelper<M,P>& m,
+    void samplePairs(const Cell<D1, C>& c1, const std::vector<Cell<D2, C>*>& cells2,
+                     const MetricHelper<M,P>& m,
                      double min_sep, double min_sepsq, double max_sep, double max_sepsq,
-                     long* i1, long* i2, double* sep, int n, long& k);
-    template <int C>
-    void sampleFrom(const Cell<D1, C>& c1, const Cell<D2, C>& c2, double rsq, double r,
-                    long* i1, long* i2, double* sep, int n, long& k);
+                     std::vector<SampleCellPair<D1,D2,C> >& pairs);
 
     bool nontrivialRPar() const
     {
@@ -89,6 +286,13 @@ public:
 
 protected:
 
+    template <int B2>
+    friend class MultiCorr2;
+    template <int D1b, int D2b>
+    friend class MultiBinCorr2;
+    template <int D1b, int B2>
+    friend class MultiKCorr2;
+
     double _minsep;
     double _maxsep;
     int _nbins;
@@ -101,10 +305,44 @@ protected:
     double _minsepsq;
     double _maxsepsq;
     double _bsq;
+    double _splitfactorsq;
+    double _minsize;
     double _fullmaxsep;
     double _fullmaxsepsq;
+    // If b is given for each bin, the b to use for pairs whose separation is in each bin
+    // and the squares of the bin edges.  (cf. getPairB)  Otherwise empty.
+    std::vector<double> _bnear;
+    std::vector<double> _rsqedges;
+    // For the Edges bin type, the bin edges and their lookup table.  Otherwise null.
+    // The thread copies share the original's, which owns it.
+    const BinEdges* _edges;
+    bool _owns_edges;
     int _coords; // Stores the kind of coordinates being used for the analysis.
 
+    // While processing with multiple threads, the accumulators of all the threads, indexed
+    // by thread number, so tasks can find the one for the thread that runs them.  Pairs of
+    // cells whose estimated work (n1 * n2) is more than _min_task_work are split into tasks
+    // rather than recursing on the current thread.  Otherwise _thread_corrs is null.
+    std::vector<BinnedCorr2<D1,D2,B>*>* _thread_corrs;
+    double _min_task_work;
+
+    // The maximum total memory of the copies made for the threads.  If they would need more,
+    // some threads share a copy, which is locked in stripes of bins via _locks.
+    double _max_accum_mem;
+    StripeLocks* _locks;
+
+    // Whether the copies for the threads use single precision sums.  In those copies,
+    // _faccum has the sums, and the arrays below are the original's.  Otherwise null.
+    bool _float_accum;
+    FloatAccum<NVALUES>* _faccum;
+
+    // While recording an InteractionList, the pairs accumulated by each thread, indexed by
+    // thread number.  The thread copies share this with the original.  Otherwise null.
+    std::vector<std::vector<RecordedPair> >* _record;
+
+    // The counters of the traversal, if TreeCorr was compiled with TREECORR_PRUNE_STATS.
+    PruneStats2 _stats;
+
     // These are usually allocated in the python layer and just built up here.
     // So all we have here is a bare pointer for each of them.
     // However, for the OpenMP stuff, we do create copies that we need to delete.
@@ -120,17 +358,184 @@ protected:
     double* _npairs;
 };
 
+// MultiCorr2 computes the NN, NK and NG cross-correlations of the same pair of catalogs in a
+// single traversal of the trees.  The fields for the second catalog must all have been built
+// from the same objects with the same parameters, so their trees have the same structure, and
+// the corresponding cells of each can be walked in lockstep.  Any of the three correlations
+// may be null (but not all of them), and the ones that are given must use the same binning.
+template <int B>
+class MultiCorr2
+{
+
+public:
+
+    MultiCorr2(BinnedCorr2<NData,NData,B>* nn, BinnedCorr2<NData,KData,B>* nk,
+               BinnedCorr2<NData,GData,B>* ng) :
+        _nn(nn), _nk(nk), _ng(ng) {}
+
+    // The fields for the second catalog that correspond to a null correlation may be null.
+    template <int C, int M, int P>
+    void process(const Field<NData,C>& field1, const Field<NData,C>* field2n,
+                 const Field<KData,C>* field2k, const Field<GData,C>* field2g, bool dots);
+
+    // Likewise, c2n, c2k, c2g are the corresponding cells in each of the trees for the
+    // second catalog, which are null for any correlation that isn't being computed.
+    template <int C, int M, int P>
+    void process11(const Cell<NData,C>& c1, const Cell<NData,C>* c2n,
+                   const Cell<KData,C>* c2k, const Cell<GData,C>* c2g,
+                   const MetricHelper<M,P>& m);
+
+    bool nontrivialRPar() const
+    { return _nn ? _nn->nontrivialRPar() : _nk ? _nk->nontrivialRPar() : _ng->nontrivialRPar(); }
+
+private:
+
+    BinnedCorr2<NData,NData,B>* _nn;
+    BinnedCorr2<NData,KData,B>* _nk;
+    BinnedCorr2<NData,GData,B>* _ng;
+};
+
+// MultiKCorr2 computes the NK (D1 = NData) or KK (D1 = KData) correlations of several scalar
+// channels at once, e.g. a set of tomographic maps with the same positions and weights, in a
+// single traversal of one tree for each catalog.  The sums of w k of each channel in each node
+// come from a PackedChannels, so each tree only needs to be built once.  corr does the
+// binning and accumulates meanr, meanlogr, weight and npairs, which are the same for every
+// pair of channels.  (It also accumulates its own xi from the trees' CellData, which the
+// caller should ignore.)  The xi for channels a, b goes into xi[(a*nchan2 + b)*nbins + k].
+// For NK, there is one channel for the N catalog, whose w k is just w.
+//
+// For an auto-correlation, each pair of objects is only visited once.  For bin types that
+// don't reverse the pairs, the xi for a < b is then the sum of both orders of each pair,
+// wk_a(1) wk_b(2) + wk_b(1) wk_a(2), so it matches a cross-correlation of the two channels,
+// and only the ones with a <= b are accumulated.  With doReverse, the reversed pair goes into
+// its own bin, so all of them are accumulated, each with its own order.
+template <int D1, int B>
+class MultiKCorr2
+{
+
+public:
+
+    MultiKCorr2(BinnedCorr2<D1,KData,B>* corr, double* xi, int nchan1, int nchan2) :
+        _corr(corr), _xi(xi), _nchan1(nchan1), _nchan2(nchan2) {}
+
+    template <int C, int M, int P>
+    void process(const PackedTree<D1,C>& t, const PackedChannels<D1,C>& k, bool dots);
+    // k1 is null for NK.
+    template <int C, int M, int P>
+    void process(const PackedTree<D1,C>& t1, const PackedChannels<D1,C>* k1,
+                 const PackedTree<KData,C>& t2, const PackedChannels<KData,C>& k2, bool dots);
+
+    template <int C, int M, int P>
+    void process2(const PackedTree<D1,C>& t, long i, const PackedChannels<D1,C>& k,
+                  const MetricHelper<M,P>& m);
+    template <int C, int M, int P>
+    void process11(const PackedTree<D1,C>& t1, long i1, const PackedChannels<D1,C>* k1,
+                   const PackedTree<KData,C>& t2, long i2, const PackedChannels<KData,C>& k2,
+                   const MetricHelper<M,P>& m, bool is_auto);
+
+    // wk1 and wk2 are the sums of w k for each channel of c1 and c2.  If k < 0, the bin
+    // hasn't been calculated yet.
+    template <int C>
+    void directProcess11(const Cell<D1,C>& c1, const Cell<KData,C>& c2,
+                         const double* wk1, const double* wk2, double rsq, bool is_auto,
+                         int k, double r, double logr);
+
+    bool nontrivialRPar() const { return _corr->nontrivialRPar(); }
+
+private:
+
+    BinnedCorr2<D1,KData,B>* _corr;
+    double* _xi;
+    int _nchan1;
+    int _nchan2;
+};
+
+// MultiBinCorr2 accumulates the same correlation function with several different binnings
+// (possibly of different bin types) in a single traversal of the trees.  Each binning
+// accumulates exactly the same pairs of cells as it would on its own, but the distance
+// calculations and the parts of the walk where they agree are shared.  At most MAX_BINNINGS
+// binnings may be given, and they must all use the same metric parameters (rpar range and
+// periods).
+template <int D1, int D2>
+class MultiBinCorr2
+{
+
+public:
+
+    static const int MAX_BINNINGS = 64;
+    typedef unsigned long long Mask;  // Bit i is set if binning i is still active.
+
+    MultiBinCorr2(const std::vector<BinnedCorr2<D1,D2,Log>*>& log_corrs,
+                  const std::vector<BinnedCorr2<D1,D2,Linear>*>& linear_corrs,
+                  const std::vector<BinnedCorr2<D1,D2,TwoD>*>& twod_corrs);
+
+    template <int C, int M, int P>
+    void process(const Field<D1, C>& field, bool dots);
+    template <int C, int M, int P>
+    void process(const Field<D1, C>& field1, const Field<D2, C>& field2, bool dots);
+
+    template <int C, int M, int P>
+    void process2(const Cell<D1,C>& c12, const MetricHelper<M,P>& m);
+
+    // is_auto says whether to use the bin types' doReverse for the pairs of an auto-correlation.
+    template <int C, int M, int P>
+    void process11(const Cell<D1,C>& c1, const Cell<D2,C>& c2, const MetricHelper<M,P>& m,
+                   bool is_auto);
+
+    bool nontrivialRPar() const
+    {
+        return (_minrpar != -std::numeric_limits<double>::max() ||
+                _maxrpar != std::numeric_limits<double>::max());
+    }
+
+private:
+
+    // Classify the pair of cells for each of the binnings of one bin type in mask, whose bits
+    // start at offset.  The ones that can accumulate the pair do so.  The ones that need it
+    // to be split are added to split[0], split[1] or split[2] according to whether they want
+    // to split c1, c2 or both.  rsq and s1, s2 are the results of metric.DistSq for the pair
+    // with the unclamped sizes of c1 and c2.
+    template <int B, int C, int M, int P>
+    void classify(const std::vector<BinnedCorr2<D1,D2,B>*>& corrs, int offset, Mask mask,
+                  const Cell<D1,C>& c1, const Cell<D2,C>& c2,
+                  const Position<C>& p1, const Position<C>& p2, double s1, double s2,
+                  double rsq, const MetricHelper<M,P>& m, bool is_auto, Mask* split);
+
+    // Run BinnedCorr2::processBucket for each of the binnings in mask.
+    template <int B, int C, int M, int P>
+    void processBucket(const std::vector<BinnedCorr2<D1,D2,B>*>& corrs, int offset, Mask mask,
+                       const Cell<D1,C>& c1, const Cell<D2,C>& c2, bool split1, bool split2,
+                       const MetricHelper<M,P>& m, bool is_auto);
+    template <int C, int M, int P>
+    void processBucket(const Cell<D1,C>& c1, const Cell<D2,C>& c2, bool split1, bool split2,
+                       Mask mask, const MetricHelper<M,P>& m, bool is_auto);
+
+    std::vector<BinnedCorr2<D1,D2,Log>*> _log;
+    std::vector<BinnedCorr2<D1,D2,Linear>*> _linear;
+    std::vector<BinnedCorr2<D1,D2,TwoD>*> _twod;
+    Mask _all;
+    double _halfminsep;  // The smallest of any of the binnings.
+    double _minrpar, _maxrpar;  // These are the same for all of them.
+    double _xp, _yp, _zp;
+};
+
 template <int D1, int D2>
 struct XiData // This works for NK, KK
 {
     XiData(double* xi0, double*, double*, double*) : xi(xi0) {}
 
+    static const int NARRAYS = 1;
+
     void new_data(int n) { xi = new double[n]; }
     void delete_data(int n) { delete [] xi; xi = 0; }
     void copy(const XiData<D1,D2>& rhs,int n)
     { for (int i=0; i<n; ++i) xi[i] = rhs.xi[i]; }
-    void add(const XiData<D1,D2>& rhs,int n)
-    { for (int i=0; i<n; ++i) xi[i] += rhs.xi[i]; }
+    void add(const XiData<D1,D2>& rhs, int i1, int i2)
+    { for (int i=i1; i<i2; ++i) xi[i] += rhs.xi[i]; }
+    void addBin(int k, const double* v)
+    { xi[k] += v[0]; }
+    void getArrays(double** p) const
+    { p[0] = xi; }
     void clear(int n)
     { for (int i=0; i<n; ++i) xi[i] = 0.; }
     void write(std::ostream& os) const // Just used for debugging.  Print the first value.
@@ -148,6 +553,8 @@ struct XiData<D1, GData> // This works for NG, KG
 {
     XiData(double* xi0, double* xi1, double*, double*) : xi(xi0), xi_im(xi1) {}
 
+    static const int NARRAYS = 2;
+
     void new_data(int n)
     {
         xi = new double[n];
@@ -163,11 +570,15 @@ struct XiData<D1, GData> // This works for NG, KG
         for (int i=0; i<n; ++i) xi[i] = rhs.xi[i];
         for (int i=0; i<n; ++i) xi_im[i] = rhs.xi_im[i];
     }
-    void add(const XiData<D1,GData>& rhs,int n)
+    void add(const XiData<D1,GData>& rhs, int i1, int i2)
     {
-        for (int i=0; i<n; ++i) xi[i] += rhs.xi[i];
-        for (int i=0; i<n; ++i) xi_im[i] += rhs.xi_im[i];
+        for (int i=i1; i<i2; ++i) xi[i] += rhs.xi[i];
+        for (int i=i1; i<i2; ++i) xi_im[i] += rhs.xi_im[i];
     }
+    void addBin(int k, const double* v)
+    { xi[k] += v[0]; xi_im[k] += v[1]; }
+    void getArrays(double** p) const
+    { p[0] = xi; p[1] = xi_im; }
     void clear(int n)
     {
         for (int i=0; i<n; ++i) xi[i] = 0.;
@@ -186,6 +597,8 @@ struct XiData<GData, GData>
     XiData(double* xi0, double* xi1, double* xi2, double* xi3) :
         xip(xi0), xip_im(xi1), xim(xi2), xim_im(xi3) {}
 
+    static const int NARRAYS = 4;
+
     void new_data(int n)
     {
         xip = new double[n];
@@ -207,13 +620,22 @@ struct XiData<GData, GData>
         for (int i=0; i<n; ++i) xim[i] = rhs.xim[i];
         for (int i=0; i<n; ++i) xim_im[i] = rhs.xim_im[i];
     }
-    void add(const XiData<GData,GData>& rhs,int n)
+    void add(const XiData<GData,GData>& rhs, int i1, int i2)
+    {
+        for (int i=i1; i<i2; ++i) xip[i] += rhs.xip[i];
+        for (int i=i1; i<i2; ++i) xip_im[i] += rhs.xip_im[i];
+        for (int i=i1; i<i2; ++i) xim[i] += rhs.xim[i];
+        for (int i=i1; i<i2; ++i) xim_im[i] += rhs.xim_im[i];
+    }
+    void addBin(int k, const double* v)
     {
-        for (int i=0; i<n; ++i) xip[i] += rhs.xip[i];
-        for (int i=0; i<n; ++i) xip_im[i] += rhs.xip_im[i];
-        for (int i=0; i<n; ++i) xim[i] += rhs.xim[i];
-        for (int i=0; i<n; ++i) xim_im[i] += rhs.xim_im[i];
+        xip[k] += v[0];
+        xip_im[k] += v[1];
+        xim[k] += v[2];
+        xim_im[k] += v[3];
     }
+    void getArrays(double** p) const
+    { p[0] = xip; p[1] = xip_im; p[2] = xim; p[3] = xim_im; }
     void clear(int n)
     {
         for (int i=0; i<n; ++i) xip[i] = 0.;
@@ -234,10 +656,13 @@ template <>
 struct XiData<NData, NData>
 {
     XiData(double* , double* , double* , double* ) {}
+    static const int NARRAYS = 0;
     void new_data(int n) {}
     void delete_data(int n) {}
     void copy(const XiData<NData,NData>& rhs,int n) {}
-    void add(const XiData<NData,NData>& rhs,int n) {}
+    void add(const XiData<NData,NData>& rhs, int i1, int i2) {}
+    void addBin(int k, const double* v) {}
+    void getArrays(double** p) const {}
     void clear(int n) {}
     void write(std::ostream& os) const {}
 };
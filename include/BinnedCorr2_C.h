@@ -14,7 +14,9 @@
 
 extern void* BuildCorr2(int d1, int d2, int bin_type,
                         double minsep, double maxsep, int nbins, double binsize, double b,
+                        const double* edges, const double* bin_b,
                         double minrpar, double maxrpar, double xp, double yp, double zp,
+                        double max_accum_mem, int float_accum,
                         double* xip, double* xip_im, double* xim, double* xim_im,
                         double* meanr, double* meanlogr, double* weight, double* npairs);
 
@@ -26,12 +28,71 @@ extern void ProcessAuto2(void* corr, void* field, int dots,
 extern void ProcessCross2(void* corr, void* field1, void* field2, int dots,
                           int d1, int d2, int coord, int bin_type, int metric);
 
+extern void ProcessPatches2(void** corrs, void** fields1, void** fields2, int npairs, int dots,
+                            int d1, int d2, int coord, int bin_type, int metric);
+
+// Process pairs of patches of fields built with patch numbers.  If field2 is null, both
+// patches of each pair are in field1, and the pairs with patches1[i] == patches2[i] are
+// auto-correlations.
+extern void ProcessPatchPairs2(void** corrs, void* field1, void* field2,
+                               int* patches1, int* patches2, int npairs, int dots,
+                               int d1, int d2, int coords, int bin_type, int metric);
+
+extern void StartRecord2(void* corr, int d1, int d2, int bin_type);
+
+// Set the factor that decides whether to split both cells of a pair or only the larger one.
+// (cf. CalcSplit in Split.h)
+extern void SetSplitFactor2(void* corr, int d1, int d2, int bin_type, double splitfactor);
+
+// Set the min_size of the trees for this binning.  Cells smaller than this are treated as
+// leaves, so a finer tree gives the same results.
+extern void SetMinSize2(void* corr, int d1, int d2, int bin_type, double minsize);
+
+// Write the counters of the traversal in process11 (see PruneStats2.h): 13 counts and the
+// number of pairs of cells visited at each depth, up to 128.  If counts is null, nothing is
+// written.  If reset, the counters are then set to zero.  Returns 0 (and does nothing) if
+// TreeCorr was not compiled with TREECORR_PRUNE_STATS.
+extern int GetPruneStats2(void* corr, int d1, int d2, int bin_type, long* counts, long* depth,
+                          int reset);
+
+// The number of copies of the accumulated data that process makes for nthreads threads, given
+// max_accum_mem.  bytes is set to the size of each copy.  (Any other threads share these.)
+extern int GetCopyBytes2(void* corr, int d1, int d2, int bin_type, int nthreads, double* bytes);
+
+extern void* FinishRecord2(void* corr, void* field1, void* field2, int is_auto,
+                           int d1, int d2, int coords, int bin_type, int metric);
+
+extern int Replay2(void* corr, void* list, void* field1, void* field2,
+                   int d1, int d2, int coords, int bin_type, int metric);
+
+extern void ProcessMultiCross2(void* corr_nn, void* corr_nk, void* corr_ng,
+                               void* field1, void* field2n, void* field2k, void* field2g,
+                               int dots, int coord, int bin_type, int metric);
+
+// Accumulate the NK (d1 = 1) or KK (d1 = 2) correlations of several scalar channels of the
+// same objects at once.  (cf. MultiKCorr2)  k1 has nchan1 rows of the k values of the objects
+// in field1 (null for NK), and k2 has nchan2 rows for field2, which is null for a KK
+// auto-correlation.  w1, w2 are the weights.  xi has nchan1 * nchan2 rows of nbins values.
+extern void ProcessMultiK2(void* corr, void* field1, void* field2,
+                           const double* k1, const double* w1, int nchan1,
+                           const double* k2, const double* w2, int nchan2,
+                           double* xi, int dots, int d1, int coords, int bin_type, int metric);
+
+extern void ProcessMultiBin2(void** corrs, int* bin_types, int ncorrs,
+                             void* field1, void* field2, int dots,
+                             int d1, int d2, int coords, int metric);
+
 extern void ProcessPair(void* corr, void* field1, void* field2, int dots,
                         int d1, int d2, int coord, int bin_type, int metric);
 
 extern int SetOMPThreads(int num_threads);
 extern int GetOMPThreads();
 
+// Pin the OpenMP threads to the cpus with policy 0 = none, 1 = compact, 2 = spread.
+// (cf. AffinityPolicy)  While they are pinned, the top-level cells are built and processed
+// with an OwnerSchedule.  Returns 0 if pinning isn't possible here.
+extern int SetThreadAffinity(int policy);
+
 extern long SamplePairs(void* corr, void* field1, void* field2, double min_sep, double max_sep,
                         int d1, int d2, int coords, int bin_type, int metric,
                         long* i1, long* i2, double* sep, int n);
@@ -39,3 +100,15 @@ extern long SamplePairs(void* corr, void* field1, void* field2, double min_sep,
 extern int TriviallyZero(void* corr, int d1, int d2, int bin_type, int metric, int coords,
                          double x1, double y1, double z1, double s1,
                          double x2, double y2, double z2, double s2);
+
+// Set zero[i*n2+j] to whether TriviallyZero is true for the cells with centers x1[i], y1[i],
+// z1[i] and size s1[i] and x2[j], y2[j], z2[j], s2[j], checking all the pairs in parallel.
+extern void TriviallyZeroPairs(void* corr, int d1, int d2, int bin_type, int metric, int coords,
+                               const double* x1, const double* y1, const double* z1,
+                               const double* s1, long n1,
+                               const double* x2, const double* y2, const double* z2,
+                               const double* s2, long n2, int* zero);
+
+// Whether the library was built with the given metric or bin type.  (cf. BuildOptions.h)
+extern int MetricCompiled(int metric);
+extern int BinTypeCompiled(int bin_type);
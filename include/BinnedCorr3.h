@@ -22,10 +22,47 @@
 #include "Field.h"
 #include "BinType.h"
 #include "Metric.h"
+#include "PruneStats3.h"
 
 template <int DC1, int DC2, int DC3>
 struct ZetaData;
 
+// The locks for an accumulator that is shared by several threads.  (Defined in StripeLocks.h)
+struct StripeLocks;
+
+// The triangles of cells that process111Sorted has found should be accumulated directly, along
+// with their sides and bins.  Rather than doing each one as soon as it is found, they are
+// collected here, so the logs, the products of the weights and (for GGG) the projections of
+// the shears can be calculated for a whole batch at once in simple loops that the compiler
+// can vectorize.
+template <int D1, int D2, int D3, int C>
+struct DirectBatch3
+{
+    enum { N = 64 };
+    DirectBatch3() : n(0) {}
+    bool full() const { return n == N; }
+    void add(const Cell<D1,C>* a, const Cell<D2,C>* b, const Cell<D3,C>* c,
+             double s1, double s2, double s3, double lr, double uu, double vv, int k)
+    {
+        c1[n] = a; c2[n] = b; c3[n] = c;
+        d1[n] = s1; d2[n] = s2; d3[n] = s3;
+        logr[n] = lr; u[n] = uu; v[n] = vv; index[n] = k;
+        ++n;
+    }
+
+    const Cell<D1,C>* c1[N];
+    const Cell<D2,C>* c2[N];
+    const Cell<D3,C>* c3[N];
+    double d1[N];
+    double d2[N];
+    double d3[N];
+    double logr[N];
+    double u[N];
+    double v[N];
+    int index[N];
+    long n;
+};
+
 // BinnedCorr3 encapsulates a binned correlation function.
 template <int DC1, int DC2, int DC3, int B>
 class BinnedCorr3
@@ -37,27 +74,56 @@ public:
                 double minu, double maxu, int nubins, double ubinsize, double bu,
                 double minv, double maxv, int nvbins, double vbinsize, double bv,
                 double xp, double yp, double zp,
+                double max_accum_mem,
                 double* zeta0, double* zeta1, double* zeta2, double* zeta3,
                 double* zeta4, double* zeta5, double* zeta6, double* zeta7,
                 double* meand1, double* meanlogd1, double* meand2, double* meanlogd2,
                 double* meand3, double* meanlogd3, double* meanu, double* meanv,
                 double* weight, double* ntri);
     BinnedCorr3(const BinnedCorr3& rhs, bool copy_data=true);
+    // An accumulator that adds to the data of shared rather than having its own, for a thread
+    // that shares one of the copies made by startThread.
+    explicit BinnedCorr3(BinnedCorr3* shared);
     ~BinnedCorr3();
 
     void clear();  // Set all data to 0.
 
+    // If progress is not null, the estimated work of the call is added to progress[1], and
+    // the work done to progress[0] as each top-level cell of field1 is finished.  The
+    // estimated work is the number of triangles that each cell could be part of, using
+    // the other top-level cells within maxsep of it.
+    // If sample is not null, it has a factor for each top-level cell of field1.  Only the cells
+    // with sample[i] > 0 are used, and their triangles are weighted by sample[i].  This is
+    // used for the approximate calculation with a random sample of the cells.
     template <int C, int M>
-    void process(const Field<DC1, C>& field, bool dots);
+    void process(const Field<DC1, C>& field, bool dots, double* progress, const double* sample);
     template <int C, int M>
     void process(BinnedCorr3<DC2,DC1,DC2,B>* corr212, BinnedCorr3<DC2,DC2,DC1,B>* corr221,
-                 const Field<DC1, C>& field1, const Field<DC2, C>& field2, bool dots);
+                 const Field<DC1, C>& field1, const Field<DC2, C>& field2, bool dots,
+                 double* progress, const double* sample);
     template <int C, int M>
     void process(BinnedCorr3<DC1,DC3,DC2,B>* corr132,
                  BinnedCorr3<DC2,DC1,DC3,B>* corr213, BinnedCorr3<DC2,DC3,DC1,B>* corr231,
                  BinnedCorr3<DC3,DC1,DC2,B>* corr312, BinnedCorr3<DC3,DC2,DC1,B>* corr321,
                  const Field<DC1, C>& field1, const Field<DC2, C>& field2,
-                 const Field<DC3, C>& field3, bool dots);
+                 const Field<DC3, C>& field3, bool dots, double* progress,
+                 const double* sample);
+
+    // The same as the cross version of process, but all on the calling thread, with no
+    // per-thread copies or tasks.  ProcessPatches3 uses this to run many sets of patches in
+    // parallel, each set with its own accumulators.
+    template <int C, int M>
+    void processSerial(BinnedCorr3<DC1,DC3,DC2,B>* corr132,
+                       BinnedCorr3<DC2,DC1,DC3,B>* corr213, BinnedCorr3<DC2,DC3,DC1,B>* corr231,
+                       BinnedCorr3<DC3,DC1,DC2,B>* corr312, BinnedCorr3<DC3,DC2,DC1,B>* corr321,
+                       const Field<DC1, C>& field1, const Field<DC2, C>& field2,
+                       const Field<DC3, C>& field3);
+
+    // Whether there could be any triangles in the range of the bins with one point each in
+    // three cells with the given centers and sizes.  This uses the same tests as process111.
+    template <int C, int M>
+    bool canFormTriangles(const Position<C>& p1, double s1, const Position<C>& p2, double s2,
+                          const Position<C>& p3, double s3) const;
 
     // Main worker functions for calculating the result
     template <int C, int M>
@@ -83,10 +149,64 @@ public:
                           const MetricHelper<M,0>& metric,
                           double d1sq=0., double d2sq=0., double d3sq=0.);
 
+    // Run process3, process12 or process111 as a new OpenMP task, which any idle thread may
+    // pick up.  The task accumulates into the executing thread's copies in _thread_corrs.
+    template <int C, int M>
+    void process3Task(const Cell<DC1,C>* c1, const MetricHelper<M,0>& metric);
+
+    template <int C, int M>
+    void process12Task(BinnedCorr3<DC2,DC1,DC2,B>& bc212, BinnedCorr3<DC2,DC2,DC1,B>& bc221,
+                       const Cell<DC1,C>* c1, const Cell<DC2,C>* c2,
+                       const MetricHelper<M,0>& metric);
+
+    template <int C, int M>
+    void process111Task(BinnedCorr3<DC1,DC3,DC2,B>& bc132,
+                        BinnedCorr3<DC2,DC1,DC3,B>& bc213, BinnedCorr3<DC2,DC3,DC1,B>& bc231,
+                        BinnedCorr3<DC3,DC1,DC2,B>& bc312, BinnedCorr3<DC3,DC2,DC1,B>& bc321,
+                        const Cell<DC1,C>* c1, const Cell<DC2,C>* c2, const Cell<DC3,C>* c3,
+                        const MetricHelper<M,0>& metric,
+                        double d1sq, double d2sq, double d3sq);
+
+    // Whether a set of cells with n1, n2 and n3 objects is enough work to split into tasks.
+    bool isTaskWork(long n1, long n2, long n3) const
+    { return _thread_corrs && double(n1) * double(n2) * double(n3) > _min_task_work; }
+
+    // The number of bytes of data in each copy made for the threads.
+    double getCopyBytes() const
+    { return double(_ntot) * sizeof(double) * (10 + ZetaData<DC1,DC2,DC3>::NARRAYS); }
+
+    // How many sets of copies to make for nthreads threads, given the limit of _max_accum_mem,
+    // when each set needs the given number of bytes.
+    int getNCopies(int nthreads, double bytes) const;
+
+    // These set up the accumulator for the current thread in the given slot of thread_corrs
+    // at the start of an omp parallel region in process, and add it to this at the end.
+    // Tasks that run on this thread use the one in thread_corrs.  If ncopies is less than the
+    // number of threads, some threads share the data of the copies, and locks has a
+    // StripeLocks for each copy, at slot * ncopies + the copy number.  Otherwise locks is empty.
+    BinnedCorr3<DC1,DC2,DC3,B>* startThread(std::vector<std::vector<void*> >& thread_corrs,
+                                            int slot, std::vector<StripeLocks>& locks,
+                                            int ncopies, double min_task_work);
+    void finishThread(BinnedCorr3<DC1,DC2,DC3,B>* bc3);
+
+    // Add a triangle to the batch of those to be accumulated directly.  They are accumulated
+    // when the batch is full, and the rest by finishBatch at the end of process.
+    template <int C>
+    void addDirect(const Cell<DC1,C>& c1, const Cell<DC2,C>& c2, const Cell<DC3,C>& c3,
+                   const double d1, const double d2, const double d3,
+                   const double logr, const double u, const double v, const int index);
+
+    // Accumulate the triangles in a DirectBatch3, and then empty it.
     template <int C>
-    void directProcess111(const Cell<DC1,C>& c1, const Cell<DC2,C>& c2, const Cell<DC3,C>& c3,
-                          const double d1, const double d2, const double d3,
-                          const double logr, const double u, const double v, const int index);
+    void directProcessBatch(DirectBatch3<DC1,DC2,DC3,C>& batch);
+
+    // Accumulate any triangles left in the batch, and delete it.
+    template <int C>
+    void finishBatch();
+
+    // Write the counters of how the recursion went.  (See PruneStats3.h)
+    void writePruneStats(long* counts, long* terminal, double* depth) const
+    { _stats.write(counts, terminal, depth); }
 
     // Note: op= only copies _data.  Not all the params.
     void operator=(const BinnedCorr3<DC1,DC2,DC3,B>& rhs);
@@ -94,6 +214,9 @@ public:
 
 protected:
 
+    template <int E1, int E2, int E3, int B2>
+    friend class BinnedCorr3;
+
     double _minsep;
     double _maxsep;
     int _nbins;
@@ -128,6 +251,30 @@ protected:
     int _nuv; // = nubins * nvbins2
     int _ntot; // = nbins * nubins2 * nvbins
 
+    // While processing with multiple threads, the accumulators of all the threads, indexed
+    // by thread number and then by slot.  The slots are the (up to 6) accumulators for the
+    // different orders of the three cells, which have different template parameters, so they
+    // are stored as void*.  _slot is the one this accumulator is in.  Sets of cells whose
+    // estimated work (n1 * n2 * n3) is more than _min_task_work are split into tasks rather
+    // than recursing on the current thread.  Otherwise _thread_corrs is null.
+    std::vector<std::vector<void*> >* _thread_corrs;
+    int _slot;
+    double _min_task_work;
+
+    // The DirectBatch3 of triangles waiting to be accumulated, or null.  Its type depends on
+    // the coordinate system, so it is stored as void*.  addDirect allocates it as needed, and
+    // finishBatch deletes it before process returns.
+    void* _batch;
+
+    // The factor for the weights of the triangles being accumulated.  This is 1 except when
+    // process is given a sample of the top-level cells.
+    double _scale;
+
+    // The maximum total memory of the copies made for the threads.  If they would need more,
+    // some threads share a copy, which is locked in stripes of bins via _locks.
+    double _max_accum_mem;
+    StripeLocks* _locks;
+
     // These are usually allocated in the python layer and just built up here.
     // So all we have here is a bare pointer for each of them.
     // However, for the OpenMP stuff, we do create copies that we need to delete.
@@ -147,6 +294,10 @@ protected:
     double* _meanv;
     double* _weight;
     double* _ntri;
+
+    // Counters of the pruning and splitting in process111Sorted.  These do nothing unless
+    // compiled with TREECORR_PRUNE_STATS.
+    PruneStats _stats;
 };
 
 template <int DC1, int DC2, int DC3>
@@ -155,6 +306,8 @@ struct ZetaData // This works for NNK, NKK, KKK
     ZetaData(double* zeta0, double*, double*, double*, double*, double*, double*, double*) :
         zeta(zeta0) {}
 
+    static const int NARRAYS = 1;
+
     void new_data(int n) { zeta = new double[n]; }
     void delete_data() { delete [] zeta; zeta = 0; }
     void copy(const ZetaData<DC1,DC2,DC3>& rhs, int n)
@@ -181,6 +334,8 @@ struct ZetaData<DC1, DC2, GData> // This works for NNG, NKG, KKG
     ZetaData(double* z0, double* z1, double*, double*, double*, double*, double*, double*) :
         zeta(z0), zeta_im(z1) {}
 
+    static const int NARRAYS = 2;
+
     void new_data(int n)
     {
         zeta = new double[n];
@@ -221,6 +376,8 @@ struct ZetaData<DC1, GData, GData> // This works for NGG, KGG
     ZetaData(double* z0, double* z1, double* z2, double* z3, double*, double*, double*, double*) :
         zetap(z0), zetap_im(z1), zetam(z2), zetam_im(z3) {}
 
+    static const int NARRAYS = 4;
+
     void new_data(int n)
     {
         zetap = new double[n];
@@ -276,6 +433,8 @@ struct ZetaData<GData, GData, GData>
         gam0r(z0), gam0i(z1), gam1r(z2), gam1i(z3),
         gam2r(z4), gam2i(z5), gam3r(z6), gam3i(z7) {}
 
+    static const int NARRAYS = 8;
+
     void new_data(int n)
     {
         gam0r = new double[n];
@@ -353,6 +512,7 @@ template <>
 struct ZetaData<NData, NData, NData>
 {
     ZetaData(double* , double* , double* , double*, double*, double*, double*, double * ) {}
+    static const int NARRAYS = 0;
     void new_data(int n) {}
     void delete_data() {}
     void copy(const ZetaData<NData,NData,NData>& rhs, int n) {}
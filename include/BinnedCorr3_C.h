@@ -17,6 +17,7 @@ extern void* BuildCorr3(int d1, int d2, int d3, int bin_type,
                         double minu, double maxu, int nubins, double ubinsize, double bu,
                         double minv, double maxv, int nvbins, double vbinsize, double bv,
                         double xp, double yp, double zp,
+                        double max_accum_mem,
                         double* gam0, double* gam0_im, double* gam1, double* gam1_im,
                         double* gam2, double* gam2_im, double* gam3, double* gam3_im,
                         double* meand1, double* meanlogd1, double* meand2, double* meanlogd2,
@@ -25,14 +26,37 @@ extern void* BuildCorr3(int d1, int d2, int d3, int bin_type,
 
 extern void DestroyCorr3(void* corr, int d1, int d2, int d3, int bin_type);
 
-extern void ProcessAuto3(void* corr, void* field, int dots,
+extern void ProcessAuto3(void* corr, void* field, int dots, double* progress, double* sample,
                          int d, int coord, int bin_type, int metric);
 
 extern void ProcessCross12(void* corr122, void* corr212, void* corr221,
-                           void* field1, void* field2, int dots,
+                           void* field1, void* field2, int dots, double* progress,
+                           double* sample,
                            int d1, int d2, int coord, int bin_type, int metric);
 
 extern void ProcessCross3(void* corr123, void* corr132, void* corr213,
                           void* corr231, void* corr312, void* corr321,
                           void* field1, void* field2, void* field3, int dots,
+                          double* progress, double* sample,
                           int d1, int d2, int d3, int coord, int bin_type, int metric);
+
+extern void PrunePatches3(void* corr, void** fields1, void** fields2, void** fields3,
+                          int ntriplets, int* keep,
+                          int d1, int d2, int d3, int coord, int bin_type, int metric);
+
+extern void ProcessPatches3(void** corrs, void** fields1, void** fields2, void** fields3,
+                            int ntriplets, int dots, double* progress,
+                            int d1, int d2, int d3, int coord, int bin_type, int metric);
+
+// Write the counters of the pruning in process111Sorted (see PruneStats3.h): 15 counts,
+// the number of triangles of cells accumulated in each bin, and the sum of the depths of
+// the recursion where they were accumulated.  Returns 0 (and writes nothing) if TreeCorr
+// was not compiled with TREECORR_PRUNE_STATS.
+extern int GetPruneStats3(void* corr, int d1, int d2, int d3, int bin_type,
+                          long* counts, long* terminal, double* depth);
+
+// The number of copies of the accumulated data that process makes for nthreads threads, given
+// max_accum_mem, when each copy is of nsets correlation objects: 1 for an auto-correlation,
+// or 3 or 6 for the permutations of a cross-correlation.  bytes is set to the size of one.
+extern int GetCopyBytes3(void* corr, int d1, int d2, int d3, int bin_type, int nsets,
+                         int nthreads, double* bytes);
@@ -0,0 +1,43 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+
+#ifndef TreeCorr_BuildOptions_H
+#define TreeCorr_BuildOptions_H
+
+// By default, the library is built with all of the metrics and two-point bin types.
+// Setting the environment variables TREECORR_METRICS and/or TREECORR_BIN_TYPES to a list of
+// names when building (cf. setup.py) defines TREECORR_LIMIT_METRICS and/or
+// TREECORR_LIMIT_BIN_TYPES, along with TREECORR_USE_<NAME> for each of the listed ones.
+// The dispatch functions only instantiate the templates for those, which makes the library
+// much smaller and faster to compile and load.  The python layer checks which ones are
+// available with MetricCompiled and BinTypeCompiled.
+
+#ifndef TREECORR_LIMIT_METRICS
+#define TREECORR_USE_EUCLIDEAN
+#define TREECORR_USE_RPERP
+#define TREECORR_USE_OLDRPERP
+#define TREECORR_USE_RLENS
+#define TREECORR_USE_ARC
+#define TREECORR_USE_PERIODIC
+#endif
+
+#ifndef TREECORR_LIMIT_BIN_TYPES
+#define TREECORR_USE_LOG
+#define TREECORR_USE_LINEAR
+#define TREECORR_USE_TWOD
+#define TREECORR_USE_EDGES
+#endif
+
+#endif
@@ -21,6 +21,7 @@
 #include <vector>
 
 #include "Position.h"
+#include "Arena.h"
 #include "dbg.h"
 
 enum SplitMethod { MIDDLE, MEDIAN, MEAN, RANDOM };
@@ -39,6 +40,22 @@ enum DataType { NData=1 , KData=2 , GData=3 };
 // Return a random number between 0 and 1.
 double urand(long long seed=0);
 
+// The positions in the Cells are normally stored as Position<C>.  If TreeCorr is compiled
+// with TREECORR_FLOAT_POS defined, they are instead stored as FloatPosition<C>, which uses
+// less than half the memory.  Either way, all of the calculations with them (including the
+// accumulation of the mean positions) are done in double precision.
+template <int C>
+struct CellPosition
+{
+#ifdef TREECORR_FLOAT_POS
+    typedef FloatPosition<C> type;
+    typedef Position<C> ref_type;
+#else
+    typedef Position<C> type;
+    typedef const Position<C>& ref_type;
+#endif
+};
+
 // This is usually what we store in the leaf cells. It has size 4, which is always <= the
 // size of a pointer on modern machines, so it never adds any space to the memory needed.
 // (Since it is in a union with the _right pointer.)
@@ -55,11 +72,16 @@ struct WPosLeafInfo : public LeafInfo
 };
 
 // When we decide we're at a leaf, but we have >1 index to include, we use this instead.
+// The length of the indices array is the N of the Cell.
 struct ListLeafInfo
 {
-    std::vector<long>* indices;
+    long* indices;
 };
 
+// An alternative to the usual vector of CellData for building the Cells.  See below.
+template <int D, int C>
+class ColumnData;
+
 
 // This class encapsulates the differences in the different kinds of data being
 // stored in a Cell.  It is used both for the input data from the file and also
@@ -83,19 +105,23 @@ public:
 
     CellData(const std::vector<std::pair<CellData<NData,C>*,WPosLeafInfo> >& vdata,
              size_t start, size_t end);
+    CellData(const ColumnData<NData,C>& vdata, size_t start, size_t end);
+    // This one combines the data for two Cells, e.g. when merging two trees.
+    CellData(const CellData<NData,C>& c1, const CellData<NData,C>& c2);
 
     // This doesn't do anything, but is provided for consistency with the other
     // kinds of CellData.
     void finishAverages(const std::vector<std::pair<CellData<NData,C>*,WPosLeafInfo> >&,
                         size_t , size_t ) {}
+    void finishAverages(const ColumnData<NData,C>&, size_t , size_t ) {}
 
-    const Position<C>& getPos() const { return _pos; }
+    typename CellPosition<C>::ref_type getPos() const { return _pos; }
     double getW() const { return _w; }
     long getN() const { return _n; }
 
 private:
 
-    Position<C> _pos;
+    typename CellPosition<C>::type _pos;
     float _w;
     long _n;
 };
@@ -121,20 +147,24 @@ public:
 
     CellData(const std::vector<std::pair<CellData<KData,C>*,WPosLeafInfo> >& vdata,
              size_t start, size_t end);
+    CellData(const ColumnData<KData,C>& vdata, size_t start, size_t end);
+    // This one combines the data for two Cells, e.g. when merging two trees.
+    CellData(const CellData<KData,C>& c1, const CellData<KData,C>& c2);
 
     // The above constructor just computes the mean pos, since sometimes that's all we
     // need.  So this function will finish the rest of the construction when desired.
     void finishAverages(const std::vector<std::pair<CellData<KData,C>*,WPosLeafInfo> >&,
                         size_t start, size_t end);
+    void finishAverages(const ColumnData<KData,C>&, size_t start, size_t end);
 
-    const Position<C>& getPos() const { return _pos; }
+    typename CellPosition<C>::ref_type getPos() const { return _pos; }
     double getWK() const { return _wk; }
     double getW() const { return _w; }
     long getN() const { return _n; }
 
 private:
 
-    Position<C> _pos;
+    typename CellPosition<C>::type _pos;
     float _wk;
     float _w;
     long _n;
@@ -161,20 +191,24 @@ public:
 
     CellData(const std::vector<std::pair<CellData<GData,C>*,WPosLeafInfo> >& vdata,
              size_t start, size_t end);
+    CellData(const ColumnData<GData,C>& vdata, size_t start, size_t end);
+    // This one combines the data for two Cells, e.g. when merging two trees.
+    CellData(const CellData<GData,C>& c1, const CellData<GData,C>& c2);
 
     // The above constructor just computes the mean pos, since sometimes that's all we
     // need.  So this function will finish the rest of the construction when desired.
     void finishAverages(const std::vector<std::pair<CellData<GData,C>*,WPosLeafInfo> >&,
                         size_t start, size_t end);
+    void finishAverages(const ColumnData<GData,C>&, size_t start, size_t end);
 
-    const Position<C>& getPos() const { return _pos; }
+    typename CellPosition<C>::ref_type getPos() const { return _pos; }
     std::complex<double> getWG() const { return _wg; }
     double getW() const { return _w; }
     long getN() const { return _n; }
 
 private:
 
-    Position<C> _pos;
+    typename CellPosition<C>::type _pos;
     std::complex<float> _wg;
     float _w;
     long _n;
@@ -184,6 +218,162 @@ template <int C>
 std::ostream& operator<<(std::ostream& os, const CellData<GData,C>& c)
 { return os << c.getPos() << " " << c.getWG() << " " << c.getW() << " " << c.getN(); }
 
+// Normally, the data used for building the Cells is a vector with a new CellData for each
+// object along with its wpos and index.  For very large catalogs, the memory for all of these
+// copies can be significant.  So alternatively, a ColumnData just references the caller's
+// column arrays and reorders a permutation of the indices during the build.  Then CellData
+// objects only need to be made for the actual Cells.
+//
+// Note: the arrays need to remain valid until the Cells are finished being built.
+template <int D, int C>
+class ColumnData
+{
+public:
+    ColumnData(const double* x, const double* y, const double* z,
+               const double* g1, const double* g2, const double* k,
+               const double* w, const double* wpos, long nobj) :
+        _x(x), _y(y), _z(z), _g1(g1), _g2(g2), _k(k), _w(w), _wpos(wpos), _index(nobj)
+    {
+        for (long i=0; i<nobj; ++i) _index[i] = i;
+    }
+
+    size_t size() const { return _index.size(); }
+
+    // These all take i as the location in the current permuted order.
+    // The values are rounded to the same precision the CellData use to store them, so the
+    // Cells end up the same as with the usual build, up to float rounding in the sums.
+    long getIndex(size_t i) const { return _index[i]; }
+    Position<C> getPos(size_t i) const { return getObjectPos(_index[i]); }
+    double getW(size_t i) const { return float(_w[_index[i]]); }
+    double getWPos(size_t i) const { long j = _index[i]; return _wpos ? _wpos[j] : _w[j]; }
+    double getWK(size_t i) const { long j = _index[i]; return float(_w[j] * _k[j]); }
+    std::complex<double> getWG(size_t i) const
+    {
+        long j = _index[i];
+        float wg1 = _w[j] * _g1[j];
+        float wg2 = _w[j] * _g2[j];
+        return std::complex<double>(wg1, wg2);
+    }
+
+    // Make a new CellData for the single object at location i.
+    // where is either an Arena* or the memory in which to construct it.
+    template <class P>
+    CellData<D,C>* makeCellData(size_t i, P where) const;
+
+    // This one takes the original object index j.
+    Position<C> getObjectPos(long j) const
+    {
+        typename CellPosition<C>::type pos = Position<C>(_x[j], _y[j], _z ? _z[j] : 0.);
+        return pos;
+    }
+
+    std::vector<long>& getIndices() { return _index; }
+
+private:
+    const double* _x;
+    const double* _y;
+    const double* _z;
+    const double* _g1;
+    const double* _g2;
+    const double* _k;
+    const double* _w;
+    const double* _wpos;
+    std::vector<long> _index;
+};
+
+// A helper to make the right kind of CellData in ColumnData::makeCellData.
+template <int D, int C>
+struct ColumnCellDataHelper;
+
+// The placement P is either an Arena* or a void* to construct the CellData in place.
+template <int C>
+struct ColumnCellDataHelper<NData,C>
+{
+    template <class P>
+    static CellData<NData,C>* build(const Position<C>& pos, double, double, double, double w,
+                                    P where)
+    { return new (where) CellData<NData,C>(pos, w); }
+};
+
+template <int C>
+struct ColumnCellDataHelper<KData,C>
+{
+    template <class P>
+    static CellData<KData,C>* build(const Position<C>& pos, double, double, double k, double w,
+                                    P where)
+    { return new (where) CellData<KData,C>(pos, k, w); }
+};
+
+template <int C>
+struct ColumnCellDataHelper<GData,C>
+{
+    template <class P>
+    static CellData<GData,C>* build(const Position<C>& pos, double g1, double g2, double,
+                                    double w, P where)
+    { return new (where) CellData<GData,C>(pos, std::complex<double>(g1,g2), w); }
+};
+
+template <int D, int C> template <class P>
+inline CellData<D,C>* ColumnData<D,C>::makeCellData(size_t i, P where) const
+{
+    long j = _index[i];
+    return ColumnCellDataHelper<D,C>::build(getPos(i), _g1[j], _g2[j], _k[j], _w[j], where);
+}
+
+// These let the functions that build the Cells work with either kind of data.
+template <int D, int C>
+inline typename CellPosition<C>::ref_type GetPos(
+    const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, size_t i)
+{ return vdata[i].first->getPos(); }
+template <int D, int C>
+inline Position<C> GetPos(const ColumnData<D,C>& vdata, size_t i)
+{ return vdata.getPos(i); }
+
+template <int D, int C>
+inline double GetW(const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, size_t i)
+{ return vdata[i].first->getW(); }
+template <int D, int C>
+inline double GetW(const ColumnData<D,C>& vdata, size_t i)
+{ return vdata.getW(i); }
+
+template <int D, int C>
+inline double GetWPos(const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, size_t i)
+{ return vdata[i].second.wpos; }
+template <int D, int C>
+inline double GetWPos(const ColumnData<D,C>& vdata, size_t i)
+{ return vdata.getWPos(i); }
+
+template <int D, int C>
+inline long GetIndex(const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, size_t i)
+{ return vdata[i].second.index; }
+template <int D, int C>
+inline long GetIndex(const ColumnData<D,C>& vdata, size_t i)
+{ return vdata.getIndex(i); }
+
+// Get the CellData for the single object at location i to use for a leaf Cell.
+// For the usual vector, this takes ownership of the existing one.
+template <int D, int C>
+inline CellData<D,C>* TakeCellData(
+    std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, size_t i, Arena* )
+{
+    CellData<D,C>* data = vdata[i].first;
+    vdata[i].first = 0; // Make sure calling routine doesn't delete this one!
+    return data;
+}
+template <int D, int C>
+inline CellData<D,C>* TakeCellData(ColumnData<D,C>& vdata, size_t i, Arena* arena)
+{ return vdata.makeCellData(i, arena); }
+
+// Make a copy of the CellData for the single object at location i in the memory at mem.
+// This is used for the leaves of a bucket, which need to be contiguous.
+template <int D, int C>
+inline CellData<D,C>* CopyCellData(
+    const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, size_t i, void* mem)
+{ return new (mem) CellData<D,C>(*vdata[i].first); }
+template <int D, int C>
+inline CellData<D,C>* CopyCellData(const ColumnData<D,C>& vdata, size_t i, void* mem)
+{ return vdata.makeCellData(i, mem); }
+
 template <int D, int C>
 class Cell
 {
@@ -199,22 +389,26 @@ public:
     // the galaxies which are used in the correlation function calculations.
 
     Cell(CellData<D,C>* data, const LeafInfo& info) :
-        _data(data), _size(0.), _left(0), _info(info) {}
+        _data(data), _size(0.), _bucket(false), _left(0), _info(info) {}
 
     Cell(CellData<D,C>* data, const ListLeafInfo& listinfo) :
-        _data(data), _size(0.), _left(0), _listinfo(listinfo) {}
+        _data(data), _size(0.), _bucket(false), _left(0), _listinfo(listinfo) {}
 
-    Cell(CellData<D,C>* data, double size, Cell<D,C>* l, Cell<D,C>* r) :
-        _data(data), _size(size), _left(l), _right(r) {}
+    Cell(CellData<D,C>* data, double size, Cell<D,C>* l, Cell<D,C>* r, bool bucket=false) :
+        _data(data), _size(size), _bucket(bucket), _left(l), _right(r) {}
 
+    // Note: If the Cell was built in an Arena, this should not be called.  The whole tree
+    // is released at once when the Arena is deleted.
     ~Cell()
     {
+        // Buckets are only ever built in an Arena.
+        Assert(!_bucket);
         if (_left) {
             Assert(_right);
             delete _left;
             delete _right;
         } else if (_data && _data->getN() > 1) {
-            delete _listinfo.indices;
+            delete [] _listinfo.indices;
         } // if !left and N==1, then _info, which doesn't need anything to be deleted.
         if (_data) {
             delete (_data);
@@ -222,7 +416,7 @@ public:
     }
 
     const CellData<D,C>& getData() const { return *_data; }
-    const Position<C>& getPos() const { return _data->getPos(); }
+    typename CellPosition<C>::ref_type getPos() const { return _data->getPos(); }
     double getW() const { return _data->getW(); }
     long getN() const { return _data->getN(); }
 
@@ -236,6 +430,19 @@ public:
     const LeafInfo& getInfo() const { Assert(!_left && getN()==1); return _info; }
     const ListLeafInfo& getListInfo() const { Assert(!_left && getN()!=1); return _listinfo; }
 
+    // A bucket is a Cell whose subtree was built with all of its getN() single-object leaves
+    // (and their CellData) stored contiguously.  So when a bucket would need to be split,
+    // the correlation code can instead loop over these leaves directly.
+    bool isBucket() const { return _bucket; }
+    const Cell<D,C>* getBucketLeaves() const
+    {
+        Assert(_bucket);
+        // The leaves are in order, so the array starts at the leftmost one.
+        const Cell<D,C>* c = this;
+        while (c->_left) c = c->_left;
+        return c;
+    }
+
     // These are mostly used for debugging purposes.
     long countLeaves() const;
     std::vector<const Cell<D,C>*> getAllLeaves() const;
@@ -243,6 +450,10 @@ public:
     std::vector<long> getAllIndices() const;
     const Cell<D,C>* getLeafNumber(long i) const;
 
+    // Add offset to all of the object indices in the leaves.  This is used when a Field
+    // takes over the Cells of another Field.
+    void addToIndices(long offset);
+
     void Write(std::ostream& os) const;
     void WriteTree(std::ostream& os, int indent=0) const;
 
@@ -250,6 +461,7 @@ protected:
 
     CellData<D,C>* _data;
     float _size;
+    bool _bucket;           // This fits in the padding after _size.
 
     Cell<D,C>* _left;
     union {
@@ -259,20 +471,33 @@ protected:
     };
 };
 
+// In these, V is either std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> > or ColumnData<D,C>.
+template <int C, class V>
+double CalculateSizeSq(const Position<C>& cen, const V& vdata, size_t start, size_t end);
+
+template <int D, int C, int SM, class V>
+size_t SplitData(V& vdata, size_t start, size_t end, const Position<C>& meanpos);
+
+// If arena is given, all new Cells, CellData and index lists are allocated from it.
+// If bucketsize > 1, any Cell with at most bucketsize objects that would otherwise be split
+// is built as a bucket (see Cell::isBucket).  This requires an arena.
+template <int D, int C, int SM, class V>
+Cell<D,C>* BuildCell(V& vdata, double minsizesq, bool brute, size_t start, size_t end,
+                     CellData<D,C>* ave=0, double sizesq=0., Arena* arena=0,
+                     long bucketsize=0);
+
+// Make a new Cell with c1 and c2 as its children.  The size is big enough to include
+// all of both Cells.
+template <int D, int C>
+Cell<D,C>* MergeCells(Cell<D,C>* c1, Cell<D,C>* c2, Arena* arena=0);
+
+// Make a copy of the tree below cell with everything allocated from arena in depth-first
+// order.  Each Cell is followed by its CellData, then its left subtree, then its right subtree.
+// Since the left child always has the smaller values in the split direction, this lays out
+// the leaves along a space-filling curve (the k-d tree analog of Morton order), so every
+// subtree, and hence every compact region of space, is contiguous in memory.
 template <int D, int C>
-double CalculateSizeSq(
-    const Position<C>& cen, const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
-    size_t start, size_t end);
-
-template <int D, int C, int SM>
-size_t SplitData(
-    std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
-    size_t start, size_t end, const Position<C>& meanpos);
-
-template <int D, int C, int SM>
-Cell<D,C>* BuildCell(std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
-                     double minsizesq, bool brute, size_t start, size_t end,
-                     CellData<D,C>* ave=0, double sizesq=0.);
+Cell<D,C>* CopyTree(const Cell<D,C>* cell, Arena* arena);
 
 template <int D, int C>
 inline std::ostream& operator<<(std::ostream& os, const Cell<D,C>& c)
@@ -0,0 +1,24 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+// Fill the columns [voffset, voffset + nnum*nbins) of the design matrix v for a jackknife
+// (method=0), sample (1), marked bootstrap (2) or bootstrap (3) covariance estimate, from the
+// accumulated values of each pair of patches (i1[k], i2[k]).  The statistic is the ratio of
+// each of the nnum numerators to the weight.  Also adds the total weight of each row to w.
+// For the two bootstrap methods, index has the npatch patches selected for each of the nrows.
+// Returns 1 if any row would have no pairs of patches, in which case v is not finished.
+extern int CovDesignMatrix(const double* num, const double* weight, int nnum, long nbins,
+                           const long* i1, const long* i2, long npair, int npatch1, int npatch2,
+                           int method, const long* index, long nrows,
+                           double* v, long vsize, long voffset, double* w);
@@ -16,6 +16,7 @@
 #define TreeCorr_Field_H
 
 #include "Cell.h"
+#include "PackedTree.h"
 
 // Most of the functionality for building Cells and doing the correlation functions is the
 // same regardless of which kind of Cell we have (N, K, G) or which kind of positions we
@@ -35,6 +36,15 @@
 //     Rlens for the perpendicular component at the location of the "lens" (c1)
 //     Arc for great circle distances on the sphere
 
+// The categories of memory reported by Field::getMemory.  The Cells, their CellData, and the
+// index arrays of the leaves with more than one object are counted separately when they are
+// on the heap.  When they are allocated from arenas, they are all in FieldMemArena (or in
+// FieldMemMapped for the parts of a Field read from a file that are used in place).
+// FieldMemBuild is the data kept until the Cells are built, and FieldMemOther is the Field
+// itself and its vectors of top-level Cells and patches.
+enum FieldMemory { FieldMemCells, FieldMemCellData, FieldMemIndices, FieldMemArena,
+                   FieldMemMapped, FieldMemBuild, FieldMemPacked, FieldMemOther, NFIELDMEM };
+
 template <int D, int C>
 class Field
 {
@@ -42,18 +52,90 @@ public:
     Field(double* x, double* y, double* z, double* g1, double* g2, double* k,
           double* w, double* wpos, long nobj,
           double minsize, double maxsize,
-          SplitMethod sm, long long seed, bool brute, int mintop, int maxtop);
+          SplitMethod sm, long long seed, bool brute, int mintop, int maxtop,
+          bool use_arena=false, bool use_packed=false, bool zero_copy=false,
+          bool reorder_tree=false, long bucket_size=0, long* patch=0, int npatch=0);
+
+    // Read a Field that was previously saved with write().  The file is memory-mapped,
+    // and the CellData and leaf index lists are used in place from the mapping, so only
+    // the Cell nodes themselves need to be made.  Throws std::runtime_error if the file
+    // isn't a valid Field file of this type.
+    Field(const char* file_name, bool use_packed=false);
     ~Field();
 
+    // Save the full tree to a binary file that can be read back with the above constructor.
+    // Returns false if the file could not be written.
+    bool write(const char* file_name) const;
+
     long getNObj() const { return _nobj; }
     double getSizeSq() const { return _sizesq; }
     Position<C> getCenter() const { return _center; }
     double getSize() const { return std::sqrt(_sizesq); }
     long getNTopLevel() const { BuildCells(); return long(_cells.size()); }
     const std::vector<Cell<D,C>*>& getCells() const { BuildCells(); return _cells; }
+    // This is null unless the Field was built with use_packed=true.
+    const PackedTree<D,C>* getPacked() const { BuildCells(); return _packed; }
     long countNear(double x, double y, double z, double sep) const;
     void getNear(double x, double y, double z, double sep, long* indices, long n) const;
 
+    // Batched versions of countNear and getNear for nq query positions, each with its own sep.
+    // If offsets is null, counts[q] is set to the number of objects near query q.  Otherwise,
+    // the indices of the objects near query q are written to indices[offsets[q]:offsets[q+1]]
+    // (i.e. CSR format, where offsets is the cumulative sum of the counts).  The queries are
+    // run in parallel.  If dual is true, the queries are first sorted into their own tree, and
+    // the two trees are traversed together, which is faster for dense sets of queries.
+    // z may be null for Flat coordinates.
+    void nearMany(const double* x, const double* y, const double* z, const double* sep,
+                  long nq, bool dual, long* counts, const long* offsets, long* indices) const;
+
+    // Find the k nearest objects to each of nq query positions, using metric M (with periods
+    // xp, yp, zp for Periodic).  The results for query q are in dist[q*k:(q+1)*k] and
+    // indices[q*k:(q+1)*k], sorted by distance.  If there are fewer than k objects, the extra
+    // entries have dist = inf and index = -1.  The queries are run in parallel.
+    template <int M>
+    void nearestNeighbors(const double* x, const double* y, const double* z, long nq, int k,
+                          double xp, double yp, double zp, double* dist, long* indices) const;
+
+    // Add more objects to the Field.  The new objects are built into their own trees using
+    // the same parameters as the original build.  Then each new top-level Cell that lies
+    // entirely within one of the existing top-level Cells is merged with it, and the rest
+    // are added as new top-level Cells.  So the time this takes is proportional to the number
+    // of new objects, not the total.  The new objects get indices starting at getNObj().
+    void insert(double* x, double* y, double* z, double* g1, double* g2, double* k,
+                double* w, double* wpos, long nobj);
+
+    // If the Field was constructed with x = 0, it starts out empty, and the objects are added
+    // in chunks with addData (e.g. as they are read from a file), rather than all at once.
+    // Then finishData() must be called after the last chunk, before the Field is used.
+    // (This isn't available with zero_copy or patch numbers.)
+    void addData(double* x, double* y, double* z, double* g1, double* g2, double* k,
+                 double* w, double* wpos, long nobj);
+    void finishData();
+
+    // If the Field was built with patch numbers, the top-level Cells are grouped by patch.
+    // Each top-level Cell has objects from only one patch, and the Cells for patch p are
+    // getCells()[getPatchBegin(p):getPatchEnd(p)].  So any pair of patches can be processed
+    // with the one tree.  Without patch numbers, getNPatch() is 0.
+    int getNPatch() const { return int(_patch_nobj.size()); }
+    long getPatchBegin(int p) const { BuildCells(); return _patch_top[p]; }
+    long getPatchEnd(int p) const { BuildCells(); return _patch_top[p+1]; }
+    long getPatchNObj(int p) const { return _patch_nobj[p]; }
+    Position<C> getPatchCenter(int p) const { return _patch_center[p]; }
+    double getPatchSize(int p) const { return std::sqrt(_patch_sizesq[p]); }
+
+    bool usesArena() const { return _use_arena; }
+    // The total memory allocated from the arenas (if any).
+    long getArenaBytes() const;
+
+    // Write the bytes of memory used by the Field in each of NFIELDMEM categories
+    // (see FieldMemory).  This builds the Cells first if they haven't been built yet.
+    void getMemory(long* bytes) const;
+
+    // Estimate the memory that a Field with nobj objects would use before building it.
+    // size is the size of the whole field, as for a Cell.  (See EstimateFieldMemory.)
+    static void estimateMemory(long nobj, double minsize, double size,
+                               bool use_arena, bool use_packed, long* bytes);
+
 private:
 
     long _nobj;
@@ -63,16 +145,51 @@ private:
     bool _brute;
     int _mintop;
     int _maxtop;
+    bool _use_arena;
+    bool _use_packed;
+    bool _reorder_tree;
+    long _bucket_size;
     Position<C> _center;
     double _sizesq;
     mutable std::vector<Cell<D,C>*> _cells;
 
+    // The number of objects, center and size of each patch, if built with patch numbers.
+    // Before the Cells are built, _patch_top has the start of each patch in _celldata.
+    // After, it has the start of each patch in _cells.  (Both with a final entry for the end.)
+    std::vector<long> _patch_nobj;
+    std::vector<Position<C> > _patch_center;
+    std::vector<double> _patch_sizesq;
+    mutable std::vector<long> _patch_top;
+
+    // If _use_arena, then all the Cells and CellData are allocated from these, rather than
+    // individually on the heap.  _arenas[0] holds the original celldata and the top-level
+    // CellData.  _arenas[i+1] holds the rest of the tree below top-level cell i.
+    // If _reorder_tree, these are replaced by one arena for each top-level tree.
+    // (After insert, the arenas for the new objects are added after these.)
+    mutable std::vector<Arena*> _arenas;
+
+    // If _use_packed, this is a copy of the tree in a more cache-friendly layout for
+    // the correlation calculations.
+    mutable PackedTree<D,C>* _packed;
+
+    // If the Field was read from a file, this is the memory-mapped file contents.
+    // (Or on Windows, just a copy of it on the heap.)
+    char* _mapped;
+    size_t _mapped_size;
+
     // This is set at the start, but once we finish making all the cells, we don't need it anymore.
     mutable std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> > _celldata;
 
+    // If zero_copy, this is used instead of _celldata.  It is also deleted once the cells
+    // are built.
+    mutable ColumnData<D,C>* _columns;
+
     // This finishes the work of the Field constructor.
     void BuildCells() const;
-    template <int SM> void DoBuildCells() const;
+    template <class V> void DoBuildCells(V& vdata) const;
+    template <int SM, class V> void DoBuildCells(V& vdata) const;
+    // Copy the trees into new arenas in depth-first order.  (See CopyTree in Cell.h.)
+    void ReorderCells() const;
 
 };
 
@@ -15,28 +15,78 @@
 extern void* BuildGField(double* x, double* y, double* z, double* g1, double* g2,
                          double* w, double* wpos, long nobj,
                          double minsize, double maxsize,
-                         int sm_int, long long seed, int brute, int mintop, int maxtop, int coords);
+                         int sm_int, long long seed, int brute, int mintop, int maxtop,
+                         int use_arena, int use_packed, int zero_copy, int reorder_tree,
+                         int bucket_size, long* patch, int npatch, int coords);
 
 extern void* BuildKField(double* x, double* y, double* z, double* k,
                          double* w, double* wpos, long nobj,
                          double minsize, double maxsize,
-                         int sm_int, long long seed, int brute, int mintop, int maxtop, int coords);
+                         int sm_int, long long seed, int brute, int mintop, int maxtop,
+                         int use_arena, int use_packed, int zero_copy, int reorder_tree,
+                         int bucket_size, long* patch, int npatch, int coords);
 
 extern void* BuildNField(double* x, double* y, double* z,
                          double* w, double* wpos, long nobj,
                          double minsize, double maxsize,
-                         int sm_int, long long seed, int brute, int mintop, int maxtop, int coords);
+                         int sm_int, long long seed, int brute, int mintop, int maxtop,
+                         int use_arena, int use_packed, int zero_copy, int reorder_tree,
+                         int bucket_size, long* patch, int npatch, int coords);
 
 extern void DestroyGField(void* field, int coords);
 extern void DestroyKField(void* field, int coords);
 extern void DestroyNField(void* field, int coords);
 
+extern void InsertGField(void* field, double* x, double* y, double* z, double* g1, double* g2,
+                         double* w, double* wpos, long nobj, int coords);
+extern void InsertKField(void* field, double* x, double* y, double* z, double* k,
+                         double* w, double* wpos, long nobj, int coords);
+extern void InsertNField(void* field, double* x, double* y, double* z,
+                         double* w, double* wpos, long nobj, int coords);
+
+// A Field built with x = NULL starts out empty.  Then the objects are given in chunks with
+// these functions, followed by FinishFieldData before the Field is used.
+extern void AddGFieldData(void* field, double* x, double* y, double* z, double* g1, double* g2,
+                          double* w, double* wpos, long nobj, int coords);
+extern void AddKFieldData(void* field, double* x, double* y, double* z, double* k,
+                          double* w, double* wpos, long nobj, int coords);
+extern void AddNFieldData(void* field, double* x, double* y, double* z,
+                          double* w, double* wpos, long nobj, int coords);
+extern void FinishFieldData(void* field, int d, int coords);
+
 extern long FieldGetNTopLevel(void* field, int d, int coords);
+extern void FieldGetTopLevelW(void* field, int d, int coords, double* w, long n);
+
+// Write the bytes of memory used by the field in 8 categories: the Cells, CellData and leaf
+// index arrays on the heap, the arenas, the memory-mapped file, the data kept for building
+// the Cells, the PackedTree, and the rest.  (See FieldMemory in Field.h.)
+extern void FieldGetMemory(void* field, int d, int coords, long* bytes);
+
+// Estimate the same 8 numbers for a field of nobj objects before building it, given the
+// size (the largest distance of any object from the center) of the whole field.
+extern void EstimateFieldMemory(long nobj, double minsize, double size, int use_arena,
+                                int use_packed, int d, int coords, long* bytes);
 extern long FieldCountNear(void* field, double x, double y, double z, double sep,
                            int d, int coords);
 extern void FieldGetNear(void* field, double x, double y, double z, double sep,
                          int d, int coords, long* indices, long n);
 
+// Batched versions of the above for nq query positions, each with its own sep.  The counts are
+// used to make offsets = [0, cumsum(counts)], and then the indices are returned in CSR format.
+// If dual != 0, the queries are built into their own tree for a dual-tree traversal.
+extern void FieldCountNearMany(void* field, double* x, double* y, double* z, double* sep,
+                               long nq, int dual, int d, int coords, long* counts);
+extern void FieldGetNearMany(void* field, double* x, double* y, double* z, double* sep,
+                             long nq, int dual, int d, int coords, long* offsets, long* indices);
+
+// Find the k nearest neighbors of nq query positions with the given metric.
+// dist and indices have shape (nq, k).
+extern void FieldKNN(void* field, double* x, double* y, double* z, long nq, int k,
+                     int d, int coords, int metric, double xp, double yp, double zp,
+                     double* dist, long* indices);
+extern int FieldWrite(void* field, const char* file_name, int d, int coords);
+extern void* FieldRead(const char* file_name, int use_packed, int d, int coords);
+
 extern void* BuildGSimpleField(double* x, double* y, double* z, double* g1, double* g2,
                                double* w, double* wpos, long nobj, int coords);
 
@@ -57,6 +107,8 @@ extern void KMeansRun(void* field, double* centers, int npatch, int max_iter, do
                       int alt, int d, int coords);
 extern void KMeansAssign(void* field, double* centers, int npatch,
                          long* patches, long n, int d, int coords);
+extern void KMeansUpdateBatch(void* field, double* centers, int npatch, double* wsum, int alt,
+                              int d, int coords);
 
 // These aren't field functions, but I'm putting them here anyway, since they're related to patches.
 extern void QuickAssign(double* centers, int npatch,
@@ -65,3 +117,6 @@ extern void SelectPatch(int patch, double* centers, int npatch, double* x, doubl
                         long* use, long n);
 extern void GenerateXYZ(double* x, double* y, double* z, double* ra, double* dec, double* r,
                         long n);
+extern void GenerateXYZPatches(double* x, double* y, double* z, double* ra, double* dec, double* r,
+                               long n, double ra_units, double dec_units,
+                               double* centers, int npatch, long* patches);
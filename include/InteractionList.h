@@ -0,0 +1,159 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_InteractionList_H
+#define TreeCorr_InteractionList_H
+
+#include <cstring>
+#include <vector>
+
+#include "dbg.h"
+#include "Cell.h"
+
+// An InteractionList records the pairs of cells that a two-point correlation accumulated
+// directly (the end points of its dual-tree traversal), along with the bin and the squared
+// separation of each one.  The split and prune decisions only depend on the positions and
+// weights, so another run with the same positions and weights but different values (e.g.
+// a new shape noise realization of the shears) can go straight through the list, redoing
+// just the accumulations, without walking the trees again.
+//
+// Cells are referred to by their index in a depth-first walk of each Field's trees (see
+// ListCells), so a list can be used with a Field that was built anew from the same positions,
+// and it can be saved to and read back from a file.  Each pair takes 20 bytes: two 32-bit
+// cell indices, a 32-bit bin number, and the double rsq.  The distance r and log(r) are
+// recomputed from rsq when replaying.
+class InteractionList
+{
+public:
+
+    // do_reverse is whether the pairs also need to be accumulated in the reversed direction
+    // (cf. BinnedCorr2::directProcess11).  The other values are just recorded so replay can
+    // check that it is being used with the same kind of correlation and the same trees.
+    // The split and prune decisions also depend on minsep, maxsep, b and the metric, so a
+    // list recorded with different ones would accumulate the wrong pairs.
+    InteractionList(int d1, int d2, int bin_type, int nbins, int coords,
+                    double minsep, double maxsep, double b, int metric, bool do_reverse,
+                    long ncells1, long ncells2,
+                    unsigned long long hash1, unsigned long long hash2) :
+        _d1(d1), _d2(d2), _bin_type(bin_type), _nbins(nbins), _coords(coords),
+        _minsep(minsep), _maxsep(maxsep), _b(b), _metric(metric),
+        _do_reverse(do_reverse), _ncells1(ncells1), _ncells2(ncells2),
+        _hash1(hash1), _hash2(hash2) {}
+
+    // Read a list that was previously saved with write().  Throws std::runtime_error if the
+    // file isn't a valid InteractionList file.
+    explicit InteractionList(const char* file_name);
+
+    // Save the list to a binary file.  Returns false if the file could not be written.
+    bool write(const char* file_name) const;
+
+    void reserve(long n)
+    { _i1.reserve(n); _i2.reserve(n); _k.reserve(n); _rsq.reserve(n); }
+
+    void add(long i1, long i2, int k, double rsq)
+    {
+        _i1.push_back(static_cast<unsigned int>(i1));
+        _i2.push_back(static_cast<unsigned int>(i2));
+        _k.push_back(k);
+        _rsq.push_back(rsq);
+    }
+
+    long size() const { return long(_k.size()); }
+    long getI1(long i) const { return _i1[i]; }
+    long getI2(long i) const { return _i2[i]; }
+    int getK(long i) const { return _k[i]; }
+    double getRSq(long i) const { return _rsq[i]; }
+
+    bool matches(int d1, int d2, int bin_type, int nbins, int coords,
+                 double minsep, double maxsep, double b, int metric,
+                 long ncells1, long ncells2,
+                 unsigned long long hash1, unsigned long long hash2) const
+    {
+        return (d1 == _d1 && d2 == _d2 && bin_type == _bin_type && nbins == _nbins &&
+                coords == _coords && minsep == _minsep && maxsep == _maxsep && b == _b &&
+                metric == _metric && ncells1 == _ncells1 && ncells2 == _ncells2 &&
+                hash1 == _hash1 && hash2 == _hash2);
+    }
+    bool doReverse() const { return _do_reverse; }
+
+private:
+
+    int _d1, _d2, _bin_type, _nbins, _coords;
+    double _minsep, _maxsep, _b;
+    int _metric;
+    bool _do_reverse;
+    long _ncells1, _ncells2;
+    unsigned long long _hash1, _hash2;
+
+    std::vector<unsigned int> _i1;
+    std::vector<unsigned int> _i2;
+    std::vector<int> _k;
+    std::vector<double> _rsq;
+};
+
+// One pair of cells accumulated by BinnedCorr2::directProcess11 while recording.
+// These are converted into the indices used by InteractionList once the run is done.
+struct RecordedPair
+{
+    RecordedPair(const void* c1_, const void* c2_, int k_, double rsq_) :
+        c1(c1_), c2(c2_), k(k_), rsq(rsq_) {}
+    const void* c1;
+    const void* c2;
+    int k;
+    double rsq;
+};
+
+// List all the Cells of the given top-level Cells in depth-first order: each top-level tree
+// in turn, and within each one, every Cell comes before its left subtree, then its right
+// subtree.  This is the same order as the nodes of a PackedTree.
+template <int D, int C>
+void ListCells(const std::vector<Cell<D,C>*>& top, std::vector<const Cell<D,C>*>& cells)
+{
+    std::vector<const Cell<D,C>*> todo;
+    for (size_t i=0; i<top.size(); ++i) {
+        todo.push_back(top[i]);
+        while (!todo.empty()) {
+            const Cell<D,C>* c = todo.back();
+            todo.pop_back();
+            cells.push_back(c);
+            if (c->getLeft()) {
+                todo.push_back(c->getRight());
+                todo.push_back(c->getLeft());
+            }
+        }
+    }
+}
+
+// A hash of the structure of the trees, along with the number, weight and position of the
+// objects in each Cell, so replaying an InteractionList can check that the trees match the
+// ones used for recording it.
+template <int D, int C>
+unsigned long long HashCells(const std::vector<const Cell<D,C>*>& cells)
+{
+    // This is the 64-bit FNV-1a hash, using 8 bytes at a time rather than 1.
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i=0; i<cells.size(); ++i) {
+        const Position<C>& p = cells[i]->getPos();
+        const double values[5] = { double(cells[i]->getN()), cells[i]->getW(),
+                                   p.get(0), p.get(1), p.get(2) };
+        for (int j=0; j<5; ++j) {
+            unsigned long long v;
+            std::memcpy(&v, &values[j], sizeof(v));
+            h = (h ^ v) * 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+#endif
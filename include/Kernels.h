@@ -0,0 +1,49 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_Kernels_H
+#define TreeCorr_Kernels_H
+
+// The simple loops over blocks of values in the hot parts of the calculations.  The library
+// is built for the baseline instruction set of the platform, so on x86-64 these are also
+// compiled for SSE4.2, AVX2 and AVX-512, and the best one the cpu supports is chosen when
+// the library is loaded.  Setting the environment variable TREECORR_ISA to one of the names
+// below picks a lower one instead, e.g. to get the same rounding on different machines.
+// On other platforms (e.g. NEON on aarch64, which is part of the baseline), there is only
+// the default version.
+
+enum ISA { ISADefault, ISASSE42, ISAAVX2, ISAAVX512, NISA };
+
+// The one in use, and its name ("default", "sse4.2", "avx2" or "avx512").
+ISA SelectedISA();
+const char* ISAName(ISA isa);
+
+// r[i] = sqrt(rsq[i]) and logr[i] = log(r[i]) for i in [0,n).
+void SqrtLogBlock(const double* rsq, double* r, double* logr, long n);
+
+// logx[i] = log(x[i]) for i in [0,n).
+void LogBlock(const double* x, double* logx, long n);
+
+// Convert objects i1..i2 from ra, dec (in radians) and optionally r to x, y, z.
+void RaDecToXYZ(double* x, double* y, double* z, const double* ra, const double* dec,
+                const double* r, long i1, long i2);
+
+// Set patches[i] for i in [i1,i2) to the nearest of the npatch centers, checking all of them.
+// The centers are (x,y) pairs for NearestCenter2 and (x,y,z) for NearestCenter3.
+void NearestCenter2(const double* centers, int npatch, const double* x, const double* y,
+                    long* patches, long i1, long i2);
+void NearestCenter3(const double* centers, int npatch, const double* x, const double* y,
+                    const double* z, long* patches, long i1, long i2);
+
+#endif
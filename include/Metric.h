@@ -46,9 +46,10 @@ struct ParHelper<1> // P = 1 for most Metrics (all except OldRPerp)
 {
     static double calculateRPar(const Position<ThreeD>& p1, const Position<ThreeD>& p2)
     {
-        Position<ThreeD> r = p2-p1;
-        Position<ThreeD> L = (p1+p2)*0.5;
-        return r.dot(L) / L.norm();
+        // r_par = r.L / |L|, with r = p2-p1 and L = (p1+p2)/2.  The numerator is just
+        // (|p2|^2 - |p1|^2)/2, which uses the squared radial distances that the cell positions
+        // keep, so the only new calculation for each pair is |p1+p2|.
+        return (p2.normSq() - p1.normSq()) / (p1+p2).norm();
     }
 
     static bool isRParOutsideRange(const Position<ThreeD>& p1, const Position<ThreeD>& p2,
@@ -504,7 +505,8 @@ struct MetricHelper<Rlens, P>
 
         // The effect of s2 needs to be modified here.  Its effect on Rlens is approximately
         //      s2' = r1/r2 s2
-        s2 *= sqrt(p1.normSq() / r2sq);
+        // (Skip this for leaves, where s2 = 0, so pairs of objects don't need the sqrt.)
+        if (s2 != 0.) s2 *= sqrt(p1.normSq() / r2sq);
 
         return rsq;
     }
@@ -551,6 +553,18 @@ struct MetricHelper<Rlens, P>
 //
 //
 
+// The Arc metric converts each chord length (or sin(theta) for ThreeD) to an angle with asin.
+// For the small angles of most pairs, the Taylor series is much faster than std::asin, and
+// with terms up to x^11, the first omitted term is < 1.e-17 x for |x| < 0.05, so it is
+// accurate to double precision.  Larger values use std::asin.
+inline double ArcAsin(double x)
+{
+    if (std::abs(x) >= 0.05) return std::asin(x);
+    const double x2 = x*x;
+    return x * (1. + x2 * (1./6. + x2 * (3./40. + x2 * (5./112. +
+                x2 * (35./1152. + x2 * (63./2816.))))));
+}
+
 template <int P>
 struct MetricHelper<Arc, P>
 {
@@ -573,7 +587,7 @@ struct MetricHelper<Arc, P>
         // theta is the Arc distance.
         Position<ThreeD> r = p1-p2;
         double L = r.norm();
-        double theta = 2. * std::asin(L/2.);
+        double theta = 2. * ArcAsin(L/2.);
         return theta;
     }
 
@@ -609,7 +623,7 @@ struct MetricHelper<Arc, P>
     {
         // sin(theta) = |p1 x p2| / |p1| |p2|
         double sintheta = p1.cross(p2).norm() / (p1.norm() * p2.norm());
-        double theta = std::asin(sintheta);
+        double theta = ArcAsin(sintheta);
         return theta;
     }
 
@@ -777,5 +791,51 @@ struct MetricHelper<Periodic, P>
 
 };
 
+//
+// For the Periodic metric, pairs of cells that are close enough together (relative to the
+// periods) never need any of the separations between their points wrapped, so they can be
+// processed with the Euclidean metric, which skips the wrapping.  NoWrapHelper<M>::M2 is the
+// metric to use for such pairs, and noWrap checks whether a pair of cells qualifies.
+// For the other metrics, M2 is just M and noWrap is always false.
+//
+
+template <int M>
+struct NoWrapHelper
+{
+    enum { M2=M };
+
+    template <int C>
+    static bool noWrap(const Position<C>& p1, double s1, const Position<C>& p2, double s2,
+                       double xp, double yp, double zp)
+    { return false; }
+};
+
+template <>
+struct NoWrapHelper<Periodic>
+{
+    enum { M2=Euclidean };
+
+    // Each component of the separation of any two points in the cells is within s1+s2 of
+    // the separation of the centers, so none of them are wrapped if that is at most half
+    // the period.
+    static bool noWrap(const Position<Flat>& p1, double s1, const Position<Flat>& p2, double s2,
+                       double xp, double yp, double zp)
+    {
+        const double s1ps2 = s1 + s2;
+        return (std::abs(p1.getX() - p2.getX()) + s1ps2 <= 0.5 * xp &&
+                std::abs(p1.getY() - p2.getY()) + s1ps2 <= 0.5 * yp);
+    }
+
+    static bool noWrap(const Position<ThreeD>& p1, double s1,
+                       const Position<ThreeD>& p2, double s2,
+                       double xp, double yp, double zp)
+    {
+        const double s1ps2 = s1 + s2;
+        return (std::abs(p1.getX() - p2.getX()) + s1ps2 <= 0.5 * xp &&
+                std::abs(p1.getY() - p2.getY()) + s1ps2 <= 0.5 * yp &&
+                std::abs(p1.getZ() - p2.getZ()) + s1ps2 <= 0.5 * zp);
+    }
+};
+
 #endif
 
@@ -0,0 +1,127 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_Multipole3_H
+#define TreeCorr_Multipole3_H
+
+#include <complex>
+#include <vector>
+
+#include "Cell.h"
+#include "Field.h"
+
+// Multipole3 is an alternative to BinnedCorr3 for the NNN auto-correlation, which doesn't
+// walk through triangles of cells.  Instead, each object is taken in turn as the vertex
+// between the two shortest sides of its triangles (point 1 in the usual convention).  Its
+// neighbors are found in the tree and put into fine radial bins, where each radial bin
+// accumulates the multipoles of the neighbors' position angles around the vertex:
+//
+//     W_a(n) = Sum_j w_j exp(-i n phi_j)    for n = 0..maxn
+//
+// The product W_a(n) W_b(n)^* is the Fourier transform of the distribution of the opening
+// angle between the neighbors in radial bins a and b.  This is summed over all the vertices,
+// and only at the end is it turned into the distribution of the opening angle, and thus into
+// the usual (r,u,v) bins.  So the cost is O(N n_neighbors) rather than O(N n_neighbors^2).
+//
+// This is an approximation to the direct calculation.  The two sides adjacent to the vertex
+// are only known to the resolution of the radial bins, which are nsub times smaller than the
+// smaller of the r and u bins, and the opening angle is only resolved to about 2pi/maxn.
+// Currently it is only implemented for NNN with Flat coordinates, the Euclidean metric, and
+// Log binning.
+class Multipole3
+{
+public:
+
+    // weighted is whether the objects have weights other than 1.  If not, the weights and
+    // the counts are the same, so only one set of multipoles needs to be accumulated.
+    Multipole3(double minsep, double maxsep, int nbins, double binsize, double b,
+               double minu, double maxu, int nubins, double ubinsize,
+               double minv, double maxv, int nvbins, double vbinsize,
+               int maxn, int nsub, bool weighted);
+    Multipole3(const Multipole3& rhs, bool copy_data=true);
+
+    void process(const Field<NData,Flat>& field, bool dots);
+
+    // Add the triangles to the given (r,u,v) bins, which have the layout used by BinnedCorr3.
+    void toBins(double* meand1, double* meanlogd1, double* meand2, double* meanlogd2,
+                double* meand3, double* meanlogd3, double* meanu, double* meanv,
+                double* weight, double* ntri) const;
+
+    void operator+=(const Multipole3& rhs);
+
+protected:
+
+    // Find the radial bin for a neighbor at a distance sqrt(rsq).  Returns -1 if it is too
+    // close or too far to be in any triangle.
+    int radialBin(double rsq) const;
+
+    // Add the neighbors of vertex in the tree of c to the multipoles of the radial bins.
+    void collect(const Cell<NData,Flat>* c, const Cell<NData,Flat>* vertex);
+
+    // Add the products of the multipoles of the current vertex to _gw and _gn, and reset
+    // the multipoles for the next vertex.
+    void finishVertex(double w, double n);
+
+    // The range of u = d3/d2 for triangles with the two sides in radial bins ka >= kb.
+    void rangeU(int ka, int kb, double& umin, double& umax) const;
+
+    // The index of the products for radial bins ka >= kb.
+    long pairIndex(int ka, int kb) const { return (long(ka) * (ka+1) / 2 + kb) * _nn; }
+
+    double _minsep;
+    double _maxsep;
+    int _nbins;
+    double _binsize;
+    double _bsq;
+    double _minu;
+    double _maxu;
+    int _nubins;
+    double _ubinsize;
+    double _minv;
+    double _maxv;
+    int _nvbins;
+    double _vbinsize;
+    int _maxn;
+    int _nsub;
+    bool _weighted;
+
+    int _nn;  // = maxn + 1
+    double _logrbinsize;  // = binsize / nsubr
+    int _nsubr;  // The number of radial bins in each r bin
+    double _logminr;  // log of the lower edge of the first radial bin after the inner one
+    double _minrsq;
+    double _maxsepsq;
+    int _ninner;  // = 1 if there is an inner bin with all the neighbors closer than minr
+    int _nr0;  // The first radial bin with r >= minsep
+    int _nr;  // The total number of radial bins
+    std::vector<double> _rc;  // The nominal radius of each radial bin
+
+    // The products W_a(n) W_b(n)^* summed over the vertices (times the vertex weight),
+    // using the weights (_gw) and the counts (_gn) of the neighbors.  _selfw and _selfn
+    // are the terms in the products for a == b that pair each neighbor with itself.
+    std::vector<std::complex<double> > _gw;
+    std::vector<std::complex<double> > _gn;
+    std::vector<double> _selfw;
+    std::vector<double> _selfn;
+
+    // The multipoles of the current vertex, and which radial bins have any neighbors.
+    std::vector<std::complex<double> > _ww;
+    std::vector<std::complex<double> > _wn;
+    std::vector<double> _s2w;
+    std::vector<double> _s2n;
+    std::vector<int> _used;
+    std::vector<bool> _isused;
+};
+
+#endif
@@ -0,0 +1,27 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+extern void* BuildMultipole3(double minsep, double maxsep, int nbins, double binsize, double b,
+                             double minu, double maxu, int nubins, double ubinsize,
+                             double minv, double maxv, int nvbins, double vbinsize,
+                             int maxn, int nsub, int weighted);
+
+extern void DestroyMultipole3(void* mp);
+
+extern void ProcessMultipole3(void* mp, void* field, int dots, int coords);
+
+extern void Multipole3ToBins(void* mp,
+                             double* meand1, double* meanlogd1, double* meand2, double* meanlogd2,
+                             double* meand3, double* meanlogd3, double* meanu, double* meanv,
+                             double* weight, double* ntri);
@@ -0,0 +1,171 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_PackedTree_H
+#define TreeCorr_PackedTree_H
+
+#include <vector>
+#include <cstddef>
+
+#include "Cell.h"
+
+// A PackedTree is an alternate, structure-of-arrays layout of the Cell trees in a Field.
+// The nodes are stored in depth-first order, with the values needed for the tree traversal
+// (position, size, weight, and the index of the right child) in parallel arrays.
+// In depth-first order, the left child of node i is always i+1, so we only need to store
+// the right child.  Leaves have right == 0, which is never a valid index for a child.
+//
+// When walking the tree, we only need to go back to the Cell once we decide to accumulate
+// a pair of nodes (in directProcess11), so the pruning tests only touch these arrays.
+template <int D, int C>
+class PackedTree
+{
+public:
+
+    PackedTree(const std::vector<Cell<D,C>*>& cells)
+    {
+        // First figure out where each top-level tree will start.
+        const ptrdiff_t ntop = cells.size();
+        _top.resize(ntop+1);
+        _top[0] = 0;
+        for (ptrdiff_t i=0; i<ntop; ++i) {
+            // A binary tree with n leaves has 2n-1 nodes.
+            _top[i+1] = _top[i] + 2*cells[i]->countLeaves() - 1;
+        }
+        long ntot = _top[ntop];
+        dbg<<"PackedTree has "<<ntot<<" nodes in "<<ntop<<" top-level trees\n";
+
+        _pos.resize(ntot);
+        _size.resize(ntot);
+        _w.resize(ntot);
+        _right.resize(ntot);
+        _cells.resize(ntot);
+
+        // Then each one can be filled in independently.
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (ptrdiff_t i=0; i<ntop; ++i) {
+            long k = _top[i];
+            fill(cells[i], k);
+            Assert(k == _top[i+1]);
+        }
+    }
+
+    long getNTop() const { return long(_top.size())-1; }
+    long getTop(long i) const { return _top[i]; }
+    long getNNodes() const { return long(_pos.size()); }
+
+    typename CellPosition<C>::ref_type getPos(long i) const { return _pos[i]; }
+    double getSize(long i) const { return _size[i]; }
+    double getW(long i) const { return _w[i]; }
+    bool isLeaf(long i) const { return _right[i] == 0; }
+    long getLeft(long i) const { Assert(!isLeaf(i)); return i+1; }
+    long getRight(long i) const { Assert(!isLeaf(i)); return _right[i]; }
+    const Cell<D,C>& getCell(long i) const { return *_cells[i]; }
+
+    // The memory used by the arrays.
+    long getBytes() const
+    {
+        return long(_pos.capacity() * sizeof(_pos[0]) + _size.capacity() * sizeof(float) +
+                    _w.capacity() * sizeof(float) + _right.capacity() * sizeof(long) +
+                    _cells.capacity() * sizeof(_cells[0]) + _top.capacity() * sizeof(long));
+    }
+
+    // The bytes per node, for estimating the above before building a tree.
+    static long getNodeBytes()
+    {
+        return long(sizeof(typename CellPosition<C>::type) + 2 * sizeof(float) + sizeof(long) +
+                    sizeof(const Cell<D,C>*));
+    }
+
+private:
+
+    void fill(const Cell<D,C>* cell, long& k)
+    {
+        long i = k++;
+        _pos[i] = cell->getPos();
+        _size[i] = cell->getSize();
+        _w[i] = cell->getW();
+        _cells[i] = cell;
+        if (cell->getLeft()) {
+            fill(cell->getLeft(), k);
+            _right[i] = k;
+            fill(cell->getRight(), k);
+        } else {
+            _right[i] = 0;
+        }
+    }
+
+    std::vector<typename CellPosition<C>::type> _pos;
+    std::vector<float> _size;
+    std::vector<float> _w;
+    std::vector<long> _right;
+    std::vector<const Cell<D,C>*> _cells;
+    std::vector<long> _top;
+};
+
+// The sums of w k in each node of a PackedTree for several scalar columns (channels) of the
+// objects it was built from.  The trees for each of the columns would all have the same
+// structure, so with these, the one tree can stand in for all of them.  (cf. MultiKCorr2)
+// The sums for each node are contiguous, so getWK(i)[c] is the one for channel c.
+template <int D, int C>
+class PackedChannels
+{
+public:
+
+    // k has the values for each channel in turn, so k[c*nobj + j] is channel c of object j.
+    // Like the CellData of a leaf, the w k of each object is rounded to float.
+    PackedChannels(const PackedTree<D,C>& tree, const double* k, const double* w,
+                   int nchan, long nobj) :
+        _nchan(nchan), _wk(tree.getNNodes() * nchan, 0.)
+    {
+        const long ntop = tree.getNTop();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (long t=0; t<ntop; ++t) {
+            // Going backwards through the nodes, both children of each node come before it.
+            for (long i=tree.getTop(t+1)-1; i>=tree.getTop(t); --i) {
+                double* wk = &_wk[i*nchan];
+                if (!tree.isLeaf(i)) {
+                    const double* left = &_wk[tree.getLeft(i)*nchan];
+                    const double* right = &_wk[tree.getRight(i)*nchan];
+                    for (int c=0; c<nchan; ++c) wk[c] = left[c] + right[c];
+                } else if (tree.getCell(i).getN() == 1) {
+                    addObject(wk, tree.getCell(i).getInfo().index, k, w, nobj);
+                } else {
+                    const Cell<D,C>& cell = tree.getCell(i);
+                    const long* indices = cell.getListInfo().indices;
+                    for (long n=0; n<cell.getN(); ++n) addObject(wk, indices[n], k, w, nobj);
+                }
+            }
+        }
+    }
+
+    int getNChan() const { return _nchan; }
+    const double* getWK(long i) const { return &_wk[i*_nchan]; }
+
+private:
+
+    void addObject(double* wk, long j, const double* k, const double* w, long nobj) const
+    {
+        for (int c=0; c<_nchan; ++c) wk[c] += float(w[j] * k[c*nobj + j]);
+    }
+
+    int _nchan;
+    std::vector<double> _wk;
+};
+
+#endif
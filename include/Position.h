@@ -277,4 +277,60 @@ public:
 }; // Position<Sphere>
 
 
+//
+// FloatPosition is a compact alternative for storing a Position in single precision and
+// without the cached norms.  It is only used for storage.  Anything that needs to do
+// calculations with the position converts it back to a normal (double precision) Position.
+//
+
+template <int C>
+class FloatPosition;
+
+template <>
+class FloatPosition<Flat>
+{
+public:
+    FloatPosition() : _x(0.f), _y(0.f) {}
+    FloatPosition(const Position<Flat>& p) : _x(p.getX()), _y(p.getY()) {}
+    FloatPosition& operator=(const Position<Flat>& p)
+    { _x = p.getX(); _y = p.getY(); return *this; }
+
+    operator Position<Flat>() const { return Position<Flat>(_x,_y); }
+
+private:
+    float _x,_y;
+};
+
+template <>
+class FloatPosition<ThreeD>
+{
+public:
+    FloatPosition() : _x(0.f), _y(0.f), _z(0.f) {}
+    FloatPosition(const Position<ThreeD>& p) : _x(p.getX()), _y(p.getY()), _z(p.getZ()) {}
+    FloatPosition& operator=(const Position<ThreeD>& p)
+    { _x = p.getX(); _y = p.getY(); _z = p.getZ(); return *this; }
+
+    operator Position<ThreeD>() const { return Position<ThreeD>(_x,_y,_z); }
+
+protected:
+    float _x,_y,_z;
+};
+
+template <>
+class FloatPosition<Sphere> : public FloatPosition<ThreeD>
+{
+public:
+    FloatPosition() {}
+    FloatPosition(const Position<Sphere>& p) : FloatPosition<ThreeD>(p) {}
+    explicit FloatPosition(const Position<ThreeD>& p) :
+        FloatPosition<ThreeD>(Position<Sphere>(p)) {}
+    FloatPosition& operator=(const Position<Sphere>& p)
+    { FloatPosition<ThreeD>::operator=(p); return *this; }
+
+    // Note: This renormalizes the position, since the float values are generally not
+    // exactly on the unit sphere.
+    operator Position<Sphere>() const { return Position<Sphere>(_x,_y,_z); }
+};
+
+
 #endif
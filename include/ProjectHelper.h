@@ -29,6 +29,45 @@ inline double safe_norm(const std::complex<double>& z)
     return n > 0. ? n : 1.;
 }
 
+// Gather the positions and shears of the three cells of n triangles into separate arrays for
+// each vertex, for the batched versions of ProjectShears.
+template <int N>
+inline void GatherShears(
+    long n, const Cell<GData,Flat>* const* c1, const Cell<GData,Flat>* const* c2,
+    const Cell<GData,Flat>* const* c3, double x[3][N], double y[3][N],
+    double gr[3][N], double gi[3][N])
+{
+    const Cell<GData,Flat>* const* cells[3] = { c1, c2, c3 };
+    for (int k=0; k<3; ++k) {
+        for (long i=0; i<n; ++i) {
+            const CellData<GData,Flat>& data = cells[k][i]->getData();
+            x[k][i] = data.getPos().getX();
+            y[k][i] = data.getPos().getY();
+            gr[k][i] = data.getWG().real();
+            gi[k][i] = data.getWG().imag();
+        }
+    }
+}
+
+template <int N, int C>
+inline void GatherShears(
+    long n, const Cell<GData,C>* const* c1, const Cell<GData,C>* const* c2,
+    const Cell<GData,C>* const* c3, double x[3][N], double y[3][N], double z[3][N],
+    double gr[3][N], double gi[3][N])
+{
+    const Cell<GData,C>* const* cells[3] = { c1, c2, c3 };
+    for (int k=0; k<3; ++k) {
+        for (long i=0; i<n; ++i) {
+            const CellData<GData,C>& data = cells[k][i]->getData();
+            x[k][i] = data.getPos().getX();
+            y[k][i] = data.getPos().getY();
+            z[k][i] = data.getPos().getZ();
+            gr[k][i] = data.getWG().real();
+            gi[k][i] = data.getWG().imag();
+        }
+    }
+}
+
 template <>
 struct ProjectHelper<Flat>
 {
@@ -69,6 +108,34 @@ struct ProjectHelper<Flat>
         g2 = c2.getData().getWG() * conj(cr2*cr2)/safe_norm(cr2);
         g3 = c3.getData().getWG() * conj(cr3*cr3)/safe_norm(cr3);
     }
+
+    // The same as the three-cell ProjectShears for the n triangles c1[i], c2[i], c3[i], with
+    // the projected shear of vertex k of triangle i in gr[k][i], gi[k][i].  The positions are
+    // gathered into separate arrays first, so the projections are simple loops over the
+    // triangles that the compiler can vectorize.
+    template <int N>
+    static void ProjectShearsBatch(
+        long n, const Cell<GData,Flat>* const* c1, const Cell<GData,Flat>* const* c2,
+        const Cell<GData,Flat>* const* c3, double gr[3][N], double gi[3][N])
+    {
+        double x[3][N];
+        double y[3][N];
+        GatherShears<N>(n,c1,c2,c3,x,y,gr,gi);
+        for (int k=0; k<3; ++k) {
+            for (long i=0; i<n; ++i) {
+                const double dx = (x[0][i] + x[1][i] + x[2][i])/3. - x[k][i];
+                const double dy = (y[0][i] + y[1][i] + y[2][i])/3. - y[k][i];
+                const double nsq = dx*dx + dy*dy;
+                const double inv = 1. / (nsq > 0. ? nsq : 1.);  // As in safe_norm.
+                // exp(-2iarg) = conj(cr*cr)/|cr|^2
+                const double cr = (dx*dx - dy*dy) * inv;
+                const double ci = -2.*dx*dy * inv;
+                const double g1 = gr[k][i]*cr - gi[k][i]*ci;
+                gi[k][i] = gr[k][i]*ci + gi[k][i]*cr;
+                gr[k][i] = g1;
+            }
+        }
+    }
 };
 
 template <>
@@ -155,6 +222,35 @@ struct ProjectHelper<Sphere>
         g2 *= expm2ialpha;
     }
 
+    static void ProjectShears2(
+        const Position<Sphere>& p1, const Position<Sphere>& p2,
+        std::complex<double>& g1, std::complex<double>& g2)
+    {
+        // This is the same as ProjectShear2(p2,p1,g1) and ProjectShear2(p1,p2,g2), but it
+        // shares the parts of the calculation that are common to both directions.
+        // In particular, sinA is the same for both except for the sign, and the two
+        // normalizations only need one division.
+        double x1 = p1.getX(), y1 = p1.getY(), z1 = p1.getZ();
+        double x2 = p2.getX(), y2 = p2.getY(), z2 = p2.getZ();
+        double dx = x1-x2, dy = y1-y2, dz = z1-z2;
+        double dsq = dx*dx + dy*dy + dz*dz;
+        double sinA = y1*x2 - x1*y2;   // At p2.  At p1, it's -sinA.
+        double cosA1 = -dz + 0.5*z1*dsq;
+        double cosA2 = dz + 0.5*z2*dsq;
+        double sinAsq = sinA*sinA;
+        double normA1sq = cosA1*cosA1 + sinAsq;
+        double normA2sq = cosA2*cosA2 + sinAsq;
+        if (normA1sq == 0.) normA1sq = 1.;
+        if (normA2sq == 0.) normA2sq = 1.;
+        double inv = 1. / (normA1sq * normA2sq);
+        double inv1 = inv * normA2sq;
+        double inv2 = inv * normA1sq;
+
+        // As in ProjectShear2, exp(-2ialpha) = -exp(-2iA).
+        g1 *= std::complex<double>((sinAsq - cosA1*cosA1) * inv1, -2.*sinA*cosA1 * inv1);
+        g2 *= std::complex<double>((sinAsq - cosA2*cosA2) * inv2, 2.*sinA*cosA2 * inv2);
+    }
+
     template <int DC1>
     static void ProjectShear(
         const Cell<DC1,Sphere>& c1, const Cell<GData,Sphere>& c2, std::complex<double>& g2)
@@ -173,8 +269,7 @@ struct ProjectHelper<Sphere>
         const Position<Sphere>& p2 = c2.getData().getPos();
         g1 = c1.getData().getWG();
         g2 = c2.getData().getWG();
-        ProjectShear2(p2,p1,g1);
-        ProjectShear2(p1,p2,g2);
+        ProjectShears2(p1,p2,g1,g2);
     }
     static void ProjectShears(
         const Cell<GData,Sphere>& c1, const Cell<GData,Sphere>& c2, const Cell<GData,Sphere>& c3,
@@ -192,6 +287,72 @@ struct ProjectHelper<Sphere>
         ProjectShear2(cen,p2,g2);
         ProjectShear2(cen,p3,g3);
     }
+
+    // The same as ProjectShear2 for n pairs of points (x1[i],y1[i],z1[i]) and
+    // (x2[i],y2[i],z2[i]), projecting the shears (gr[i],gi[i]) at the second points in place.
+    // Written as a simple loop without branches, so the compiler can vectorize it.
+    static void ProjectShear2Batch(
+        long n, const double* x1, const double* y1, const double* z1,
+        const double* x2, const double* y2, const double* z2, double* gr, double* gi)
+    {
+        for (long i=0; i<n; ++i) {
+            const double dx = x1[i]-x2[i], dy = y1[i]-y2[i], dz = z1[i]-z2[i];
+            const double dsq = dx*dx + dy*dy + dz*dz;
+            const double cosA = dz + 0.5*z2[i]*dsq;
+            const double sinA = y1[i]*x2[i] - x1[i]*y2[i];
+            const double cosAsq = cosA*cosA;
+            const double sinAsq = sinA*sinA;
+            const double normAsq = cosAsq + sinAsq;
+            const double inv = 1. / (normAsq > 0. ? normAsq : 1.);
+            const double cos2A = (cosAsq - sinAsq) * inv;
+            const double sin2A = 2.*sinA*cosA * inv;
+            // exp(-2ialpha) = -exp(-2iA)
+            const double g1 = -gr[i]*cos2A - gi[i]*sin2A;
+            gi[i] = gr[i]*sin2A - gi[i]*cos2A;
+            gr[i] = g1;
+        }
+    }
+
+    // Put the n points (x[i],y[i],z[i]) on the unit sphere, as Position<Sphere>::normalize does.
+    static void NormalizeBatch(long n, double* x, double* y, double* z)
+    {
+        for (long i=0; i<n; ++i) {
+            const double r = std::sqrt(x[i]*x[i] + y[i]*y[i] + z[i]*z[i]);
+            const double d = r > 0. ? r : 1.;
+            x[i] = r > 0. ? x[i] / d : 1.;  // The arbitrary (1,0,0) for r == 0.
+            y[i] /= d;
+            z[i] /= d;
+        }
+    }
+
+    // The same as the three-cell ProjectShears for a batch of n triangles.  See the Flat
+    // version for the layout.  The positions in x, y, z must already be on the unit sphere.
+    template <int N>
+    static void ProjectShearsBatch(
+        long n, double x[3][N], double y[3][N], double z[3][N], double gr[3][N], double gi[3][N])
+    {
+        double cx[N];
+        double cy[N];
+        double cz[N];
+        for (long i=0; i<n; ++i) cx[i] = (x[0][i] + x[1][i] + x[2][i])/3.;
+        for (long i=0; i<n; ++i) cy[i] = (y[0][i] + y[1][i] + y[2][i])/3.;
+        for (long i=0; i<n; ++i) cz[i] = (z[0][i] + z[1][i] + z[2][i])/3.;
+        NormalizeBatch(n,cx,cy,cz);
+        for (int k=0; k<3; ++k)
+            ProjectShear2Batch(n,cx,cy,cz,x[k],y[k],z[k],gr[k],gi[k]);
+    }
+
+    template <int N>
+    static void ProjectShearsBatch(
+        long n, const Cell<GData,Sphere>* const* c1, const Cell<GData,Sphere>* const* c2,
+        const Cell<GData,Sphere>* const* c3, double gr[3][N], double gi[3][N])
+    {
+        double x[3][N];
+        double y[3][N];
+        double z[3][N];
+        GatherShears<N>(n,c1,c2,c3,x,y,z,gr,gi);
+        ProjectShearsBatch<N>(n,x,y,z,gr,gi);
+    }
 };
 
 // The projections for ThreeD are basically the same as for Sphere.
@@ -222,8 +383,7 @@ struct ProjectHelper<ThreeD>
         Position<Sphere> sp2(p2);
         g1 = c1.getData().getWG();
         g2 = c2.getData().getWG();
-        ProjectHelper<Sphere>::ProjectShear2(sp2,sp1,g1);
-        ProjectHelper<Sphere>::ProjectShear2(sp1,sp2,g2);
+        ProjectHelper<Sphere>::ProjectShears2(sp1,sp2,g1,g2);
     }
 
     static void ProjectShears(
@@ -246,6 +406,19 @@ struct ProjectHelper<ThreeD>
         ProjectHelper<Sphere>::ProjectShear2(cen,sp2,g2);
         ProjectHelper<Sphere>::ProjectShear2(cen,sp3,g3);
     }
+
+    template <int N>
+    static void ProjectShearsBatch(
+        long n, const Cell<GData,ThreeD>* const* c1, const Cell<GData,ThreeD>* const* c2,
+        const Cell<GData,ThreeD>* const* c3, double gr[3][N], double gi[3][N])
+    {
+        double x[3][N];
+        double y[3][N];
+        double z[3][N];
+        GatherShears<N>(n,c1,c2,c3,x,y,z,gr,gi);
+        for (int k=0; k<3; ++k) ProjectHelper<Sphere>::NormalizeBatch(n,x[k],y[k],z[k]);
+        ProjectHelper<Sphere>::ProjectShearsBatch<N>(n,x,y,z,gr,gi);
+    }
 };
 
 #endif
@@ -0,0 +1,145 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_PruneStats2_H
+#define TreeCorr_PruneStats2_H
+
+#include "WorkStack.h"
+
+// The counts kept by PairPruneStats, in the order GetPruneStats2 writes them.
+enum PruneStat2 {
+    Stat2Calls,         // calls to process11
+    Stat2Pairs,         // pairs of cells classified by classifyPairDistSq
+    Stat2RPar,          // skipped by isRParOutsideRange
+    Stat2MinSep,        // skipped by tooSmallDist
+    Stat2MaxSep,        // skipped by tooLargeDist
+    Stat2Range,         // in a single bin, but outside the range of the bins
+    Stat2SingleBin,     // accumulated by singleBin with nonzero s1+s2
+    Stat2Leaf,          // accumulated pairs of leaves (including those in processLeafPairs)
+    Stat2Split1,        // CalcSplitSq only split c1
+    Stat2Split2,        // CalcSplitSq only split c2
+    Stat2SplitBoth,     // CalcSplitSq split both
+    Stat2Bucket,        // pairs of cells handed to processBucket
+    Stat2LeafPairs,     // pairs of leaves checked in processLeafPairs
+    NPRUNESTATS2
+};
+
+// The number of entries in the histogram of the depth of the traversal in process11.
+// Deeper pairs go in the last one.
+const int NPRUNEDEPTH2 = 128;
+
+// Counters of how the traversal in process11 went, to help choose bin_slop, min_top and
+// max_top.  The depth of a pair of cells is the number of splits since the pair of top-level
+// cells it came from.  Each copy of the accumulator for the threads has its own, which are
+// added up along with the rest of the results.  As for PruneStats3, they are only kept if
+// TreeCorr is compiled with TREECORR_PRUNE_STATS defined.  Otherwise PairPruneStats<false> is
+// used, whose methods do nothing, so the calls to them cost nothing.
+template <bool On>
+struct PairPruneStats
+{
+    static const bool enabled = false;
+    void clear() {}
+    void count(int ) {}
+    void count(int , long ) {}
+    void split(bool , bool ) {}
+    void visit(int ) {}
+    void operator+=(const PairPruneStats<On>& ) {}
+    void write(long* , long* ) const {}
+
+    // The depth at which process11 starts on the current thread.  Depths tracks the depth
+    // of the pairs of cells in one call to process11.
+    static int depth() { return 0; }
+    static void setDepth(int ) {}
+    struct Depths
+    {
+        int depth() const { return 0; }
+        void split(int ) {}
+        void pop() {}
+        void descend() {}
+    };
+};
+
+template <>
+struct PairPruneStats<true>
+{
+    static const bool enabled = true;
+    PairPruneStats() { clear(); }
+    void clear()
+    {
+        for (int i=0; i<NPRUNESTATS2; ++i) _counts[i] = 0;
+        for (int i=0; i<NPRUNEDEPTH2; ++i) _depth[i] = 0;
+    }
+    // Threads can share an accumulator when max_accum_mem is set, so these are atomic.
+    void count(int i) { count(i, 1); }
+    void count(int i, long n)
+    {
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+        _counts[i] += n;
+    }
+    void split(bool split1, bool split2)
+    { count(split1 ? (split2 ? Stat2SplitBoth : Stat2Split1) : Stat2Split2); }
+    void visit(int depth)
+    {
+        const int k = depth < NPRUNEDEPTH2 ? depth : NPRUNEDEPTH2-1;
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+        ++_depth[k];
+    }
+    void operator+=(const PairPruneStats<true>& rhs)
+    {
+        for (int i=0; i<NPRUNESTATS2; ++i) _counts[i] += rhs._counts[i];
+        for (int i=0; i<NPRUNEDEPTH2; ++i) _depth[i] += rhs._depth[i];
+    }
+    // Write the counts (NPRUNESTATS2 values) and the depth histogram (NPRUNEDEPTH2 values).
+    void write(long* counts, long* depth) const
+    {
+        for (int i=0; i<NPRUNESTATS2; ++i) counts[i] = _counts[i];
+        for (int i=0; i<NPRUNEDEPTH2; ++i) depth[i] = _depth[i];
+    }
+
+    static int& currentDepth() { static thread_local int d = 0; return d; }
+    static int depth() { return currentDepth(); }
+    static void setDepth(int d) { currentDepth() = d; }
+
+    // This keeps the depth of each pair on the WorkStack in process11.  split(n) is called
+    // when n more sub-pairs are pushed and the traversal goes on to the first one.  Before
+    // starting another process11 (via processBucket or a task) for the sub-pairs of the
+    // current pair, descend() sets the depth where it starts.
+    struct Depths
+    {
+        Depths() : _base(currentDepth()), _d(_base) {}
+        ~Depths() { currentDepth() = _base; }
+        int depth() const { return _d; }
+        void split(int n) { ++_d; for (int i=0; i<n; ++i) _stack.push(_d); }
+        void pop() { _d = _stack.pop(); }
+        void descend() { currentDepth() = _d+1; }
+        WorkStack<int> _stack;
+        int _base;
+        int _d;
+    };
+
+    long _counts[NPRUNESTATS2];
+    long _depth[NPRUNEDEPTH2];
+};
+
+#ifdef TREECORR_PRUNE_STATS
+typedef PairPruneStats<true> PruneStats2;
+#else
+typedef PairPruneStats<false> PruneStats2;
+#endif
+
+#endif
@@ -0,0 +1,116 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_PruneStats3_H
+#define TreeCorr_PruneStats3_H
+
+#include <vector>
+
+// The reasons process111Sorted can stop the recursion for a triangle of cells.  The first
+// ones are the tests in stop111, which returns the reason (or NoPrune).  The Range ones are
+// for a triangle that didn't need to be split, but whose d2, u or v is outside the bins.
+enum PruneReason {
+    NoPrune, PruneMinSep, PruneMaxSep, PruneMinU, PruneMaxU, PruneMaxV, PruneMinV,
+    PruneZeroSide, PruneRangeD2, PruneRangeU, PruneRangeV, NPruneReasons
+};
+
+// The counts kept by PruneStats3, in the order GetPruneStats3 writes them.
+// 0: the number of triangles of cells considered by process111Sorted,
+// 1-3: the number of them where the cell at vertex 1, 2 or 3 was split,
+// 4-13: the number stopped for each PruneReason (after NoPrune),
+// 14: the number accumulated.
+const int NPRUNESTATS = 4 + NPruneReasons;
+
+// Counters of how the recursion in process111Sorted went, to help choose bin_slop and the
+// u and v ranges.  Each accumulator has its own, so they are added up along with the rest
+// of the results.  They are only kept if TreeCorr is compiled with TREECORR_PRUNE_STATS
+// defined.  Otherwise PruneStats3<false> is used, whose methods do nothing, so the calls to
+// them cost nothing.
+template <bool On>
+struct PruneStats3
+{
+    static const bool enabled = false;
+    void init(int ) {}
+    void clear() {}
+    void visit() {}
+    void split(bool , bool , bool ) {}
+    void prune(int ) {}
+    void accumulate(int ) {}
+    void operator+=(const PruneStats3<On>& ) {}
+    void write(long* , long* , double* ) const {}
+
+    // The depth of the recursion in process111Sorted on the current thread.  Level marks
+    // one more level while it exists.
+    static int depth() { return 0; }
+    static void setDepth(int ) {}
+    struct Level {};
+};
+
+template <>
+struct PruneStats3<true>
+{
+    static const bool enabled = true;
+    void init(int ntot) { _terminal.resize(ntot); clear(); }
+    void clear()
+    {
+        for (int i=0; i<NPRUNESTATS; ++i) _counts[i] = 0;
+        for (size_t i=0; i<_terminal.size(); ++i) _terminal[i] = 0;
+        _depth = 0.;
+    }
+    void visit() { ++_counts[0]; }
+    void split(bool split1, bool split2, bool split3)
+    { _counts[1] += split1; _counts[2] += split2; _counts[3] += split3; }
+    void prune(int reason) { ++_counts[3 + reason]; }
+    void accumulate(int index)
+    {
+        ++_counts[3 + NPruneReasons];
+        ++_terminal[index];
+        _depth += depth();
+    }
+    void operator+=(const PruneStats3<true>& rhs)
+    {
+        for (int i=0; i<NPRUNESTATS; ++i) _counts[i] += rhs._counts[i];
+        for (size_t i=0; i<_terminal.size(); ++i) _terminal[i] += rhs._terminal[i];
+        _depth += rhs._depth;
+    }
+    // Write the counts (NPRUNESTATS values), the number accumulated in each bin and the sum
+    // of the depths at which they were accumulated.
+    void write(long* counts, long* terminal, double* depth) const
+    {
+        for (int i=0; i<NPRUNESTATS; ++i) counts[i] = _counts[i];
+        for (size_t i=0; i<_terminal.size(); ++i) terminal[i] = _terminal[i];
+        *depth = _depth;
+    }
+
+    static int& currentDepth() { static thread_local int d = 0; return d; }
+    static int depth() { return currentDepth(); }
+    static void setDepth(int d) { currentDepth() = d; }
+    struct Level
+    {
+        Level() { ++currentDepth(); }
+        ~Level() { --currentDepth(); }
+    };
+
+    long _counts[NPRUNESTATS];
+    std::vector<long> _terminal;
+    double _depth;
+};
+
+#ifdef TREECORR_PRUNE_STATS
+typedef PruneStats3<true> PruneStats;
+#else
+typedef PruneStats3<false> PruneStats;
+#endif
+
+#endif
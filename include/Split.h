@@ -79,17 +79,22 @@ inline void CalcSplit(
     }
 }
 
+// The square of the above splitfactor.
+const double DEFAULT_SPLIT_FACTOR_SQ = 0.3422;
+
 inline void CalcSplitSq(
     bool& split1, bool& split2,
-    const double s1, const double s2, const double s1ps2, const double bsq)
+    const double s1, const double s2, const double s1ps2, const double bsq,
+    const double splitfactorsq=DEFAULT_SPLIT_FACTOR_SQ)
 {
     // The same as above, but when we know the distance squared rather
     // than just the distance.  We get some speed up by saving the
     // square roots in some parts of the code.
-    const double splitfactorsq = 0.3422;
+    // The split factor may also be given, since the best value depends on the data.
+    // (cf. BinnedCorr2::setSplitFactor)
     if (split1 && split2) return;
     if (s2 > s1) {
-        CalcSplitSq(split2,split1,s2,s1,s1ps2,bsq);
+        CalcSplitSq(split2,split1,s2,s1,s1ps2,bsq,splitfactorsq);
     } else if (s1 > 2.*s2) {
         // If one cell is more than 2x the size of the other, only split that one.
         split1 = true;
@@ -0,0 +1,68 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_StripeLocks_H
+#define TreeCorr_StripeLocks_H
+
+#include <algorithm>
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
+
+// When several threads share an accumulator, each update locks the stripe with the bin it
+// is updating.  Bin k is in stripe k % NSTRIPES.
+const int NSTRIPES = 64;
+
+struct StripeLocks
+{
+#ifdef _OPENMP
+    StripeLocks() { for (int i=0; i<NSTRIPES; ++i) omp_init_lock(&_locks[i]); }
+    ~StripeLocks() { for (int i=0; i<NSTRIPES; ++i) omp_destroy_lock(&_locks[i]); }
+
+    // Lock the stripes for bins k and k2 (k2 may be -1 for none).  The lower stripe is
+    // always locked first, so two threads can't each be waiting for the other.
+    void lock(int k, int k2)
+    {
+        int s1 = k % NSTRIPES;
+        int s2 = k2 < 0 ? s1 : k2 % NSTRIPES;
+        if (s2 < s1) std::swap(s1,s2);
+        omp_set_lock(&_locks[s1]);
+        if (s2 != s1) omp_set_lock(&_locks[s2]);
+    }
+    void unlock(int k, int k2)
+    {
+        int s1 = k % NSTRIPES;
+        int s2 = k2 < 0 ? s1 : k2 % NSTRIPES;
+        if (s2 != s1) omp_unset_lock(&_locks[s2]);
+        omp_unset_lock(&_locks[s1]);
+    }
+
+    // The same for a set of bins, given as a mask with bit s set for each stripe s that
+    // they are in (see stripeBit).  Again, the stripes are locked in increasing order.
+    static unsigned long long stripeBit(int k) { return 1ULL << (k % NSTRIPES); }
+    void lockMask(unsigned long long mask)
+    {
+        for (int s=0; s<NSTRIPES; ++s) if (mask & (1ULL << s)) omp_set_lock(&_locks[s]);
+    }
+    void unlockMask(unsigned long long mask)
+    {
+        for (int s=NSTRIPES-1; s>=0; --s) if (mask & (1ULL << s)) omp_unset_lock(&_locks[s]);
+    }
+
+    omp_lock_t _locks[NSTRIPES];
+#endif
+};
+
+#endif
@@ -0,0 +1,176 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_ThreadTimes_H
+#define TreeCorr_ThreadTimes_H
+
+#include <vector>
+#include <string>
+
+#ifdef _OPENMP
+#include "omp.h"
+#else
+#include <chrono>
+#endif
+
+// The times of the threads in one parallel loop over the top-level cells, in seconds.
+// The time spent before the loop, making the thread's accumulator etc., is the part of wall
+// not in busy, wait or merge.
+struct RegionTimes
+{
+    std::string name;
+    int nthreads;
+    double wall;                    // From the start of the region to the end.
+    std::vector<double> busy;       // For each thread, the time on its items in the loop.
+    std::vector<double> wait;       // For each thread, the time from its last item until all
+                                    // the threads are done, including any tasks it ran then.
+    std::vector<double> merge;      // For each thread, the time combining its results.
+    std::vector<double> cost;       // For each item, the time its iteration took.
+};
+
+// In ThreadTimes.cpp.  (cf. SetThreadTimes)
+bool ThreadTimesEnabled();
+void AddThreadTimes(const RegionTimes& times);
+
+// In ThreadTimes.cpp.  (cf. SetTrace)
+bool TraceEnabled();
+void AddTraceEvent(const char* name, double start, double end, long arg1, long arg2,
+                   bool python);
+
+inline double WallTime()
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// This records the RegionTimes of a parallel loop while SetThreadTimes is on.  Otherwise it
+// does nothing.  Make it before the omp parallel, and call startThread at the start of the
+// parallel region.  In the loop, an Item records the time of each iteration.  After the
+// loop, startMerge waits for all the threads, and finishMerge goes after combining the
+// thread's results.  The times are added to the list when it goes out of scope.
+class RegionTimer
+{
+public:
+    RegionTimer(const char* name, long nitems) : _on(ThreadTimesEnabled())
+    {
+        if (!_on) return;
+        _start = WallTime();
+        int maxthreads = 1;
+#ifdef _OPENMP
+        maxthreads = omp_get_max_threads();
+#endif
+        _times.name = name;
+        _times.nthreads = 1;
+        _times.busy.resize(maxthreads, 0.);
+        _times.wait.resize(maxthreads, 0.);
+        _times.merge.resize(maxthreads, 0.);
+        _times.cost.resize(nitems, 0.);
+        _mark.resize(maxthreads, 0.);
+    }
+
+    ~RegionTimer()
+    {
+        if (!_on) return;
+        _times.wall = WallTime() - _start;
+        _times.busy.resize(_times.nthreads);
+        _times.wait.resize(_times.nthreads);
+        _times.merge.resize(_times.nthreads);
+        AddThreadTimes(_times);
+    }
+
+    void startThread()
+    {
+        if (!_on) return;
+#ifdef _OPENMP
+        if (threadNum() == 0) _times.nthreads = omp_get_num_threads();
+#endif
+        _mark[threadNum()] = WallTime();
+    }
+
+    struct Item
+    {
+        Item(RegionTimer& timer, long k) :
+            _timer(timer), _k(k), _t0(timer._on ? WallTime() : 0.) {}
+        ~Item()
+        {
+            if (!_timer._on) return;
+            const double t1 = WallTime();
+            _timer._times.cost[_k] += t1 - _t0;
+            _timer._times.busy[threadNum()] += t1 - _t0;
+            _timer._mark[threadNum()] = t1;
+        }
+        RegionTimer& _timer;
+        long _k;
+        double _t0;
+    };
+
+    void startMerge()
+    {
+        if (!_on) return;
+#ifdef _OPENMP
+#pragma omp barrier
+#endif
+        const double t1 = WallTime();
+        _times.wait[threadNum()] += t1 - _mark[threadNum()];
+        _mark[threadNum()] = t1;
+    }
+
+    void finishMerge()
+    {
+        if (!_on) return;
+        _times.merge[threadNum()] += WallTime() - _mark[threadNum()];
+    }
+
+private:
+    static int threadNum()
+    {
+#ifdef _OPENMP
+        return omp_get_thread_num();
+#else
+        return 0;
+#endif
+    }
+
+    const bool _on;
+    double _start;
+    RegionTimes _times;
+    std::vector<double> _mark;      // When each thread finished its last step.
+};
+
+// This adds a span to the trace while SetTrace is on, from when it is made to when it goes out
+// of scope.  Otherwise it does nothing.  arg1 and arg2 are shown with it, e.g. the index of a
+// top-level cell or the two patches of a pair, or -1 if not used.
+class TraceSpan
+{
+public:
+    TraceSpan(const char* name, long arg1=-1, long arg2=-1) :
+        _name(name), _arg1(arg1), _arg2(arg2), _on(TraceEnabled()),
+        _start(_on ? WallTime() : 0.) {}
+
+    ~TraceSpan()
+    { if (_on) AddTraceEvent(_name, _start, WallTime(), _arg1, _arg2, false); }
+
+private:
+    const char* _name;
+    const long _arg1;
+    const long _arg2;
+    const bool _on;
+    const double _start;
+};
+
+#endif
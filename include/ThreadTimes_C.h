@@ -0,0 +1,51 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+// Start (on != 0) or stop recording the times of the threads in the parallel loops over the
+// top-level cells in BinnedCorr2::process, BinnedCorr3::process and FindCellsInPatches.
+// Starting clears any times recorded before.
+extern void SetThreadTimes(int on);
+
+// The number of parallel loops recorded.
+extern long GetNThreadTimes();
+
+// The name of the function with loop i, and the number of threads and items in the loop.
+extern const char* GetThreadTimesInfo(long i, int* nthreads, long* nitems);
+
+// Write the times of loop i in seconds: the wall time of the whole parallel region, the time
+// each thread spent on its items, waiting for the other threads after the loop, and combining
+// its results (nthreads values each), and the time each item took (nitems values).
+extern void GetThreadTimes(long i, double* wall, double* busy, double* wait, double* merge,
+                           double* cost);
+
+// Start (on != 0) or stop recording a trace of the time spent in the main steps of the
+// calculations, e.g. GenerateXYZ, the k-means iterations, building each top-level cell of a
+// Field, each call to ProcessAuto2 or ProcessCross2, and combining the threads' results.
+// The python layer adds its own steps with AddTrace.  Starting clears any spans recorded before.
+extern void SetTrace(int on);
+
+// The current time on the clock used for the trace, in seconds.
+extern double GetTraceTime();
+
+// Add a span from start to end (from GetTraceTime) for a step in the python layer.
+extern void AddTrace(const char* name, double start, double end);
+
+// The number of spans recorded.
+extern long GetNTrace();
+
+// The name of span i.  Also write the number of the thread it ran on, its start and end in
+// seconds since SetTrace started the trace, its two arguments (-1 if not used), and whether it
+// was added by AddTrace.
+extern const char* GetTrace(long i, int* tid, double* start, double* end, long* args,
+                            int* python);
@@ -0,0 +1,72 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+#ifndef TreeCorr_WorkStack_H
+#define TreeCorr_WorkStack_H
+
+#include <vector>
+
+#include "dbg.h"
+
+// A WorkStack holds the items (usually pairs of cells) that are still waiting to be
+// processed by an iterative tree traversal.  The first N items are kept in a local array,
+// so most traversals don't need any heap allocations.  Only very deep traversals spill over
+// into a std::vector.
+//
+// Each traversal uses its own WorkStack on the C++ stack, rather than one per thread, since
+// a thread may start another traversal (e.g. from an OpenMP task) while one is in progress.
+template <class T, int N=128>
+class WorkStack
+{
+public:
+    WorkStack() : _n(0) {}
+
+    bool empty() const { return _n == 0; }
+    long size() const { return _n; }
+
+    void push(const T& item)
+    {
+        if (_n < N) _local[_n] = item;
+        else _more.push_back(item);
+        ++_n;
+    }
+
+    T pop()
+    {
+        Assert(_n > 0);
+        --_n;
+        if (_n < N) return _local[_n];
+        T item = _more.back();
+        _more.pop_back();
+        return item;
+    }
+
+private:
+    T _local[N];
+    std::vector<T> _more;
+    long _n;
+};
+
+// A pair of items for a WorkStack.  Unlike std::pair, the default constructor doesn't
+// initialize anything, so a WorkStack of these doesn't spend time zeroing its local array.
+template <class T1, class T2>
+struct WorkPair
+{
+    WorkPair() {}
+    WorkPair(T1 a, T2 b) : first(a), second(b) {}
+    T1 first;
+    T2 second;
+};
+
+#endif
@@ -72,6 +72,38 @@ if "--debug" in sys.argv:
             copt[name].append('-g')
     debug = True
 
+# To use single precision for the positions stored in the field trees, set the environment
+# variable TREECORR_FLOAT_POS=1 when building.  This uses much less memory for very large
+# catalogs at the expense of some precision in the positions.
+define_macros = []
+if os.environ.get('TREECORR_FLOAT_POS', '0') not in ['', '0']:
+    define_macros += [('TREECORR_FLOAT_POS', None)]
+
+# To keep counters of the pruning and splitting in the two-point traversal (which can be read
+# with BinnedCorr2.get_prune_stats) and the three-point recursion (which can be read with
+# GetPruneStats3), set TREECORR_PRUNE_STATS=1 when building.  This makes the calculations
+# a bit slower.
+if os.environ.get('TREECORR_PRUNE_STATS', '0') not in ['', '0']:
+    define_macros += [('TREECORR_PRUNE_STATS', None)]
+
+# To only build some of the metrics and two-point bin types, set TREECORR_METRICS and/or
+# TREECORR_BIN_TYPES to a comma-separated list of them when building.  E.g.
+# TREECORR_METRICS=Euclidean,Arc TREECORR_BIN_TYPES=Log.  The others are then unavailable, but
+# the library is much smaller and faster to compile and load.
+for env_name, limit_name, valid_names in [
+        ('TREECORR_METRICS', 'TREECORR_LIMIT_METRICS',
+         ['Euclidean', 'Rperp', 'OldRperp', 'Rlens', 'Arc', 'Periodic']),
+        ('TREECORR_BIN_TYPES', 'TREECORR_LIMIT_BIN_TYPES',
+         ['Log', 'Linear', 'TwoD', 'Edges'])]:
+    names = [n.strip() for n in os.environ.get(env_name, '').split(',') if n.strip() != '']
+    if len(names) > 0:
+        for name in names:
+            if name not in valid_names:
+                raise ValueError("Invalid name %s in %s.  Valid names are %s"%(
+                                 name, env_name, valid_names))
+        define_macros += [(limit_name, None)]
+        define_macros += [('TREECORR_USE_' + name.upper(), None) for name in names]
+
 local_tmp = 'tmp'
 
 def get_compiler_type(compiler, check_unknown=True, output=False):
@@ -555,6 +587,7 @@ class my_install_scripts( install_scripts ):  # For distutils
 ext = Extension("treecorr._treecorr",
                 sources,
                 depends=headers,
+                define_macros=define_macros,
                 undef_macros=undef_macros)
 
 dependencies = ['numpy', 'cffi', 'pyyaml', 'LSSTDESC.Coord>=1.1']
@@ -0,0 +1,112 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+//#define DEBUGLOGGING
+
+#include <fstream>
+#include <string>
+
+#if defined(__linux__) && defined(_OPENMP)
+#include <sched.h>
+#define TREECORR_PIN_THREADS
+#endif
+
+#include "Affinity.h"
+#include "dbg.h"
+
+static AffinityPolicy affinity_policy = AffinityNone;
+
+AffinityPolicy GetAffinityPolicy()
+{ return affinity_policy; }
+
+#ifdef TREECORR_PIN_THREADS
+
+// The cpus the process was allowed to use before we pinned anything, in the order to use them
+// for each policy.
+static bool have_cpus = false;
+static cpu_set_t allowed_cpus;
+static std::vector<int> compact_cpus;
+static std::vector<int> spread_cpus;
+
+static int SocketOf(int cpu)
+{
+    std::ifstream fin(("/sys/devices/system/cpu/cpu" + std::to_string(cpu) +
+                       "/topology/physical_package_id").c_str());
+    int socket = 0;
+    if (fin) fin >> socket;
+    return socket;
+}
+
+static void FindCpus()
+{
+    if (have_cpus) return;
+    have_cpus = true;
+    CPU_ZERO(&allowed_cpus);
+    sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus);
+    std::vector<std::vector<int> > by_socket;
+    for (int cpu=0; cpu<CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed_cpus)) continue;
+        compact_cpus.push_back(cpu);
+        const size_t socket = SocketOf(cpu);
+        if (socket >= by_socket.size()) by_socket.resize(socket+1);
+        by_socket[socket].push_back(cpu);
+    }
+    // Spread takes the first cpu of each socket, then the second of each, etc.
+    for (size_t k=0; spread_cpus.size() < compact_cpus.size(); ++k) {
+        for (size_t s=0; s<by_socket.size(); ++s) {
+            if (k < by_socket[s].size()) spread_cpus.push_back(by_socket[s][k]);
+        }
+    }
+    dbg<<"Found "<<compact_cpus.size()<<" cpus on "<<by_socket.size()<<" sockets\n";
+}
+
+void ApplyAffinityPolicy()
+{
+    if (affinity_policy == AffinityNone && !have_cpus) return;
+    FindCpus();
+    const std::vector<int>& cpus =
+        affinity_policy == AffinitySpread ? spread_cpus : compact_cpus;
+    if (cpus.empty()) return;
+#pragma omp parallel
+    {
+        cpu_set_t set;
+        if (affinity_policy == AffinityNone) {
+            set = allowed_cpus;
+        } else {
+            CPU_ZERO(&set);
+            CPU_SET(cpus[omp_get_thread_num() % cpus.size()], &set);
+        }
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+}
+
+bool SetAffinityPolicy(AffinityPolicy policy)
+{
+    affinity_policy = policy;
+    ApplyAffinityPolicy();
+    return true;
+}
+
+#else
+
+void ApplyAffinityPolicy() {}
+
+bool SetAffinityPolicy(AffinityPolicy policy)
+{
+    // Without pinning, the threads might move, so don't use the OwnerSchedule either.
+    affinity_policy = AffinityNone;
+    return policy == AffinityNone;
+}
+
+#endif
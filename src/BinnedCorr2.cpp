@@ -19,12 +19,20 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <unordered_map>
+#include <random>
 
 #include "dbg.h"
 #include "BinnedCorr2.h"
+#include "ThreadTimes.h"
+#include "Kernels.h"
+#include "Affinity.h"
 #include "Split.h"
 #include "ProjectHelper.h"
 #include "Metric.h"
+#include "WorkStack.h"
+#include "StripeLocks.h"
+#include "BuildOptions.h"
 
 #ifdef _OPENMP
 #include "omp.h"
@@ -34,15 +42,32 @@
 // for compile-time constexpr in C++14, which we don't require.
 #define MAX(a,b) (a > b ? a : b)
 
+// When processing with multiple threads, pairs of cells with more than 1/TASKS_PER_THREAD
+// of each thread's share of the total work are split into OpenMP tasks.  But never make
+// tasks with fewer than MIN_TASK_WORK pairs of objects.
+const double TASKS_PER_THREAD = 16.;
+const double MIN_TASK_WORK = 1.e6;
+
+// ProcessPatches2 only runs the pairs of patches in parallel (each on a single thread) if
+// there are at least this many pairs for each thread.  Otherwise, there are too few for the
+// threads to share evenly, so each pair uses all the threads in turn.
+const int PATCH_PAIRS_PER_THREAD = 4;
+
 template <int D1, int D2, int B>
 BinnedCorr2<D1,D2,B>::BinnedCorr2(
-    double minsep, double maxsep, int nbins, double binsize, double b,
+    double minsep, double maxsep, int nbins, double binsize, double b, const double* edges,
+    const double* bin_b,
     double minrpar, double maxrpar, double xp, double yp, double zp,
+    double max_accum_mem, bool float_accum,
     double* xi0, double* xi1, double* xi2, double* xi3,
     double* meanr, double* meanlogr, double* weight, double* npairs) :
     _minsep(minsep), _maxsep(maxsep), _nbins(nbins), _binsize(binsize), _b(b),
     _minrpar(minrpar), _maxrpar(maxrpar), _xp(xp), _yp(yp), _zp(zp),
-    _coords(-1), _owns_data(false),
+    _splitfactorsq(DEFAULT_SPLIT_FACTOR_SQ), _minsize(0.),
+    _edges(edges ? new BinEdges(edges, nbins) : 0), _owns_edges(true),
+    _coords(-1), _thread_corrs(0), _min_task_work(0.),
+    _max_accum_mem(max_accum_mem), _locks(0), _float_accum(float_accum), _faccum(0),
+    _record(0), _owns_data(false),
     _xi(xi0,xi1,xi2,xi3), _meanr(meanr), _meanlogr(meanlogr), _weight(weight), _npairs(npairs)
 {
     dbg<<"BinnedCorr2 constructor\n";
@@ -54,27 +79,73 @@ BinnedCorr2<D1,D2,B>::BinnedCorr2(
     _bsq = _b * _b;
     _fullmaxsep = BinTypeHelper<B>::calculateFullMaxSep(minsep, maxsep, nbins, binsize);
     _fullmaxsepsq = _fullmaxsep*_fullmaxsep;
+    if (bin_b) {
+        Assert(B == Log || B == Linear);
+        // singleBin accepts pairs of cells with s1+s2 up to max(b, (binsize+b)/2) (times r for
+        // Log binning).  Their separations can then fall into any bin within this many bins,
+        // so each bin uses the smallest b of the bins within that range of it.
+        const double bmax = *std::max_element(bin_b, bin_b+nbins);
+        const double x = std::max(bmax, 0.5*(binsize+bmax));
+        const double spread = B == Linear ? x : x < 1. ? -std::log(1.-x) : 2.*nbins*binsize;
+        const int w = int(std::min(spread/binsize, double(nbins))) + 1;
+        _bnear.resize(nbins);
+        for (int k=0; k<nbins; ++k) {
+            const int j1 = std::max(k-w, 0);
+            const int j2 = std::min(k+w+1, nbins);
+            _bnear[k] = *std::min_element(bin_b+j1, bin_b+j2);
+        }
+        // getPairB finds the bin from the squares of the edges.
+        _rsqedges.resize(nbins+1);
+        for (int k=0; k<=nbins; ++k) {
+            const double e = B == Linear ? minsep + k*binsize : minsep * std::exp(k*binsize);
+            _rsqedges[k] = e*e;
+        }
+        // _b is the smallest one.  Pairs of cells that are small enough for that don't need
+        // to look up their own.
+        _b = *std::min_element(bin_b, bin_b+nbins);
+        _bsq = _b * _b;
+    }
     dbg<<"minsep, maxsep = "<<_minsep<<"  "<<_maxsep<<std::endl;
     dbg<<"nbins = "<<_nbins<<std::endl;
     dbg<<"binsize = "<<_binsize<<std::endl;
     dbg<<"b = "<<_b<<std::endl;
     dbg<<"minrpar, maxrpar = "<<_minrpar<<"  "<<_maxrpar<<std::endl;
     dbg<<"period = "<<_xp<<"  "<<_yp<<"  "<<_zp<<std::endl;
+    dbg<<"max_accum_mem = "<<_max_accum_mem<<std::endl;
+    dbg<<"float_accum = "<<_float_accum<<std::endl;
 }
 
 template <int D1, int D2, int B>
-BinnedCorr2<D1,D2,B>::BinnedCorr2(const BinnedCorr2<D1,D2,B>& rhs, bool copy_data) :
+BinnedCorr2<D1,D2,B>::BinnedCorr2(const BinnedCorr2<D1,D2,B>& rhs, bool copy_data,
+                                  bool float_copy) :
     _minsep(rhs._minsep), _maxsep(rhs._maxsep), _nbins(rhs._nbins),
     _binsize(rhs._binsize), _b(rhs._b),
     _minrpar(rhs._minrpar), _maxrpar(rhs._maxrpar),
     _xp(rhs._xp), _yp(rhs._yp), _zp(rhs._zp),
     _logminsep(rhs._logminsep), _halfminsep(rhs._halfminsep),
     _minsepsq(rhs._minsepsq), _maxsepsq(rhs._maxsepsq), _bsq(rhs._bsq),
+    _splitfactorsq(rhs._splitfactorsq), _minsize(rhs._minsize),
     _fullmaxsep(rhs._fullmaxsep), _fullmaxsepsq(rhs._fullmaxsepsq),
-    _coords(rhs._coords), _owns_data(true),
+    _bnear(rhs._bnear), _rsqedges(rhs._rsqedges),
+    _edges(rhs._edges), _owns_edges(false),
+    _coords(rhs._coords), _thread_corrs(0), _min_task_work(0.),
+    _max_accum_mem(rhs._max_accum_mem), _locks(0), _float_accum(rhs._float_accum), _faccum(0),
+    _record(0), _owns_data(!float_copy),
     _xi(0,0,0,0), _weight(0)
 {
     dbg<<"BinnedCorr2 copy constructor\n";
+    if (float_copy) {
+        // Use rhs's arrays, which the FloatAccum adds to.
+        _xi = rhs._xi;
+        _meanr = rhs._meanr;
+        _meanlogr = rhs._meanlogr;
+        _weight = rhs._weight;
+        _npairs = rhs._npairs;
+        double* dest[NVALUES] = { _meanr, _meanlogr, _weight, _npairs };
+        _xi.getArrays(dest+4);
+        _faccum = new FloatAccum<NVALUES>(_nbins, dest);
+        return;
+    }
     _xi.new_data(_nbins);
     _meanr = new double[_nbins];
     _meanlogr = new double[_nbins];
@@ -96,6 +167,9 @@ BinnedCorr2<D1,D2,B>::~BinnedCorr2()
         delete [] _weight; _weight = 0;
         delete [] _npairs; _npairs = 0;
     }
+    delete _faccum;
+    delete _record;
+    if (_owns_edges) delete _edges;
 }
 
 // BinnedCorr2::process2 is invalid if D1 != D2, so this helper struct lets us only call
@@ -104,6 +178,8 @@ template <int D1, int D2, int B, int C, int M, int P>
 struct ProcessHelper
 {
     static void process2(BinnedCorr2<D1,D2,B>& , const Cell<D1,C>&, const MetricHelper<M,P>& ) {}
+    static void process2(BinnedCorr2<D1,D2,B>& , const PackedTree<D1,C>&, long,
+                         const MetricHelper<M,P>& ) {}
 };
 
 template <int D, int B, int C, int M, int P>
@@ -111,6 +187,9 @@ struct ProcessHelper<D,D,B,C,M,P>
 {
     static void process2(BinnedCorr2<D,D,B>& b, const Cell<D,C>& c12, const MetricHelper<M,P>& m)
     { b.template process2<C,M,P>(c12, m); }
+    static void process2(BinnedCorr2<D,D,B>& b, const PackedTree<D,C>& t, long i,
+                         const MetricHelper<M,P>& m)
+    { b.template process2<C,M,P>(t, i, m); }
 };
 
 template <int D1, int D2, int B>
@@ -121,36 +200,136 @@ void BinnedCorr2<D1,D2,B>::clear()
     for (int i=0; i<_nbins; ++i) _meanlogr[i] = 0.;
     for (int i=0; i<_nbins; ++i) _weight[i] = 0.;
     for (int i=0; i<_nbins; ++i) _npairs[i] = 0.;
+    _stats.clear();
     _coords = -1;
 }
 
+template <int D1, int D2, int B>
+int BinnedCorr2<D1,D2,B>::getNCopies(int nthreads) const
+{
+    // With no limit, each thread gets its own copy.
+    if (_max_accum_mem <= 0.) return nthreads;
+    const double ncopies = _max_accum_mem / getCopyBytes();
+    return ncopies < 1. ? 1 : ncopies < nthreads ? int(ncopies) : nthreads;
+}
+
+template <int D1, int D2, int B>
+BinnedCorr2<D1,D2,B>* BinnedCorr2<D1,D2,B>::startThread(
+    std::vector<BinnedCorr2<D1,D2,B>*>& thread_corrs, StripeLocks* locks, int ncopies,
+    double min_task_work)
+{
+#ifdef _OPENMP
+    // The first ncopies threads each make a copy of the data vector to fill in.  Any other
+    // threads share these copies, so then the copies lock the bins they update.
+    const int tid = omp_get_thread_num();
+    if (tid < ncopies) {
+        BinnedCorr2<D1,D2,B>* bc2 = new BinnedCorr2<D1,D2,B>(*this,false,_float_accum);
+        if (locks) bc2->_locks = &locks[tid];
+        bc2->_record = _record;
+        if (omp_get_num_threads() > 1) {
+            bc2->_thread_corrs = &thread_corrs;
+            bc2->_min_task_work = min_task_work;
+        }
+        thread_corrs[tid] = bc2;
+    }
+#pragma omp barrier
+    // Now thread_corrs[tid] is the one this thread uses, which is also where the tasks that
+    // run on this thread accumulate.
+    thread_corrs[tid] = thread_corrs[tid % ncopies];
+    return thread_corrs[tid];
+#else
+    return this;
+#endif
+}
+
+template <int D1, int D2, int B>
+void BinnedCorr2<D1,D2,B>::finishThread(std::vector<BinnedCorr2<D1,D2,B>*>& thread_corrs,
+                                        int ncopies)
+{
+#ifdef _OPENMP
+    const int tid = omp_get_thread_num();
+    const int nthreads = omp_get_num_threads();
+    if (ncopies > nthreads) ncopies = nthreads;
+    // Wait for all the threads and tasks to finish.
+#pragma omp barrier
+    // Rather than adding each copy to this in turn, each thread adds up one range of bins
+    // over all the copies.  So the combining is done in parallel, and each bin of this is
+    // only written by one thread.  (The first ncopies entries of thread_corrs are the copies.)
+    const int i1 = int(double(_nbins) * tid / nthreads);
+    const int i2 = int(double(_nbins) * (tid+1) / nthreads);
+    // The single precision copies instead add what they haven't flushed yet to this.
+    for (int j=0; j<ncopies; ++j) {
+        if (thread_corrs[j]->_faccum) thread_corrs[j]->_faccum->flushRange(i1, i2);
+        else addRange(*thread_corrs[j], i1, i2);
+    }
+    if (PruneStats2::enabled && tid < ncopies) {
+#pragma omp critical
+        {
+            _stats += thread_corrs[tid]->_stats;
+        }
+    }
+    // Then wait until everyone is done with all the copies before deleting them.
+#pragma omp barrier
+    if (tid < ncopies) {
+        thread_corrs[tid]->_record = 0;  // This belongs to the original.
+        delete thread_corrs[tid];
+    }
+#endif
+}
+
 template <int D1, int D2, int B> template <int C, int M, int P>
-void BinnedCorr2<D1,D2,B>::process(const Field<D1,C>& field, bool dots)
+void BinnedCorr2<D1,D2,B>::process(const Field<D1,C>& field, bool dots, int patch)
 {
     xdbg<<"Start process (auto): M,P,C = "<<M<<"  "<<P<<"  "<<C<<std::endl;
     Assert(D1 == D2);
     Assert(_coords == -1 || _coords == C);
     _coords = C;
-    const long n1 = field.getNTopLevel();
-    dbg<<"field has "<<n1<<" top level nodes\n";
-    Assert(n1 > 0);
+    // The range of top-level cells to use.
+    const long b1 = patch >= 0 ? field.getPatchBegin(patch) : 0;
+    const long n1 = patch >= 0 ? field.getPatchEnd(patch) : field.getNTopLevel();
+    dbg<<"field has "<<n1-b1<<" top level nodes\n";
+    if (patch >= 0 && n1 == b1) return;
+    Assert(n1 > b1);
+    // If the field has a PackedTree, use that for the traversal.
+    const PackedTree<D1,C>* packed = field.getPacked();
+    dbg<<"packed = "<<packed<<std::endl;
+    RegionTimer timer("BinnedCorr2::process", n1-b1);
+    // If the threads are pinned, each one starts with the cells it built.  (cf. OwnerSchedule)
+    OwnerSchedule owner(n1-b1);
 
 #ifdef _OPENMP
+    // A few dense cells can have much more work than the rest, so large pairs of cells are
+    // split into tasks, which the threads that have finished their share pick up.
+    const double nobj = patch >= 0 ? field.getPatchNObj(patch) : field.getNObj();
+    std::vector<BinnedCorr2<D1,D2,B>*> thread_corrs(omp_get_max_threads(), 0);
+    const double min_task_work = MAX(0.5*nobj*nobj / (TASKS_PER_THREAD * thread_corrs.size()),
+                                     MIN_TASK_WORK);
+    dbg<<"min_task_work = "<<min_task_work<<std::endl;
+    const int ncopies = getNCopies(thread_corrs.size());
+    std::vector<StripeLocks> locks(ncopies < int(thread_corrs.size()) ? ncopies : 0);
+    dbg<<"ncopies = "<<ncopies<<std::endl;
 #pragma omp parallel
     {
-        // Give each thread their own copy of the data vector to fill in.
-        BinnedCorr2<D1,D2,B> bc2(*this,false);
+        // Get this thread's copy of the data vector to fill in.
+        BinnedCorr2<D1,D2,B>& bc2 = *startThread(thread_corrs, locks.empty() ? 0 : &locks[0],
+                                                 ncopies, min_task_work);
 #else
         BinnedCorr2<D1,D2,B>& bc2 = *this;
 #endif
+        timer.startThread();
 
         // Inside the omp parallel, so each thread has its own MetricHelper.
         MetricHelper<M,P> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+        // For Periodic, the pairs of top-level cells that don't need any wrapping use this.
+        const int M2 = NoWrapHelper<M>::M2;
+        MetricHelper<M2,P> metric2(_minrpar, _maxrpar, _xp, _yp, _zp);
 
 #ifdef _OPENMP
 #pragma omp for schedule(dynamic)
 #endif
-        for (long i=0;i<n1;++i) {
+        for (long k=b1;k<n1;++k) {
+            const long i = owner.on() ? b1 + owner.next() : k;
+            RegionTimer::Item item(timer, i-b1);
 #ifdef _OPENMP
 #pragma omp critical
 #endif
@@ -160,19 +339,49 @@ void BinnedCorr2<D1,D2,B>::process(const Field<D1,C>& field, bool dots)
 #endif
                 if (dots) std::cout<<'.'<<std::flush;
             }
+            if (packed) {
+                const long t1 = packed->getTop(i);
+                const Position<C> p1 = packed->getPos(t1);
+                const double s1 = packed->getSize(t1);
+                if (NoWrapHelper<M>::noWrap(p1, s1, p1, s1, _xp, _yp, _zp))
+                    ProcessHelper<D1,D2,B,C,M2,P>::process2(bc2, *packed, t1, metric2);
+                else
+                    ProcessHelper<D1,D2,B,C,M,P>::process2(bc2, *packed, t1, metric);
+                for (long j=i+1;j<n1;++j) {
+                    const long t2 = packed->getTop(j);
+                    if (NoWrapHelper<M>::noWrap(p1, s1, packed->getPos(t2), packed->getSize(t2),
+                                                _xp, _yp, _zp))
+                        bc2.template process11<C,M2,P>(*packed, t1, *packed, t2, metric2,
+                                                       BinTypeHelper<B>::doReverse());
+                    else
+                        bc2.template process11<C,M,P>(*packed, t1, *packed, t2, metric,
+                                                      BinTypeHelper<B>::doReverse());
+                }
+                continue;
+            }
             const Cell<D1,C>& c1 = *field.getCells()[i];
-            ProcessHelper<D1,D2,B,C,M,P>::process2(bc2, c1, metric);
+            const Position<C> p1 = c1.getPos();
+            const double s1 = c1.getSize();
+            if (NoWrapHelper<M>::noWrap(p1, s1, p1, s1, _xp, _yp, _zp))
+                ProcessHelper<D1,D2,B,C,M2,P>::process2(bc2, c1, metric2);
+            else
+                ProcessHelper<D1,D2,B,C,M,P>::process2(bc2, c1, metric);
             for (long j=i+1;j<n1;++j) {
                 const Cell<D1,C>& c2 = *field.getCells()[j];
-                bc2.process11<C,M,P>(c1, c2, metric, BinTypeHelper<B>::doReverse());
+                if (NoWrapHelper<M>::noWrap(p1, s1, c2.getPos(), c2.getSize(), _xp, _yp, _zp))
+                    bc2.process11<C,M2,P>(c1, c2, metric2, BinTypeHelper<B>::doReverse());
+                else
+                    bc2.process11<C,M,P>(c1, c2, metric, BinTypeHelper<B>::doReverse());
             }
         }
 #ifdef _OPENMP
         // Accumulate the results
-#pragma omp critical
+        timer.startMerge();
         {
-            *this += bc2;
+            TraceSpan span("BinnedCorr2::merge");
+            finishThread(thread_corrs, ncopies);
         }
+        timer.finishMerge();
     }
 #endif
     if (dots) std::cout<<std::endl;
@@ -180,18 +389,25 @@ void BinnedCorr2<D1,D2,B>::process(const Field<D1,C>& field, bool dots)
 
 template <int D1, int D2, int B> template <int C, int M, int P>
 void BinnedCorr2<D1,D2,B>::process(const Field<D1,C>& field1, const Field<D2,C>& field2,
-                                   bool dots)
+                                   bool dots, int patch1, int patch2)
 {
     xdbg<<"Start process (cross): M,P,C = "<<M<<"  "<<P<<"  "<<C<<std::endl;
     Assert(_coords == -1 || _coords == C);
     _coords = C;
 
+    // The ranges of top-level cells to use.
+    const long b1 = patch1 >= 0 ? field1.getPatchBegin(patch1) : 0;
+    const long n1 = patch1 >= 0 ? field1.getPatchEnd(patch1) : field1.getNTopLevel();
+    const long b2 = patch2 >= 0 ? field2.getPatchBegin(patch2) : 0;
+    const long n2 = patch2 >= 0 ? field2.getPatchEnd(patch2) : field2.getNTopLevel();
+    if ((patch1 >= 0 && n1 == b1) || (patch2 >= 0 && n2 == b2)) return;
+
     // Check if we can early exit.
     MetricHelper<M,P> metric1(_minrpar, _maxrpar, _xp, _yp, _zp);
-    const Position<C>& p1 = field1.getCenter();
-    const Position<C>& p2 = field2.getCenter();
-    double s1 = field1.getSize();
-    double s2 = field2.getSize();
+    const Position<C> p1 = patch1 >= 0 ? field1.getPatchCenter(patch1) : field1.getCenter();
+    const Position<C> p2 = patch2 >= 0 ? field2.getPatchCenter(patch2) : field2.getCenter();
+    double s1 = patch1 >= 0 ? field1.getPatchSize(patch1) : field1.getSize();
+    double s2 = patch2 >= 0 ? field2.getPatchSize(patch2) : field2.getSize();
     const double rsq = metric1.DistSq(p1, p2, s1, s2);
     double s1ps2 = s1 + s2;
     double rpar = 0; // Gets set to correct value by isRParOutsideRange if appropriate
@@ -204,28 +420,50 @@ void BinnedCorr2<D1,D2,B>::process(const Field<D1,C>& field1, const Field<D2,C>&
         return;
     }
 
-    const long n1 = field1.getNTopLevel();
-    const long n2 = field2.getNTopLevel();
-    dbg<<"field1 has "<<n1<<" top level nodes\n";
-    dbg<<"field2 has "<<n2<<" top level nodes\n";
-    Assert(n1 > 0);
-    Assert(n2 > 0);
+    dbg<<"field1 has "<<n1-b1<<" top level nodes\n";
+    dbg<<"field2 has "<<n2-b2<<" top level nodes\n";
+    Assert(n1 > b1);
+    Assert(n2 > b2);
+    // If both fields have a PackedTree, use those for the traversal.
+    const PackedTree<D1,C>* packed1 = field1.getPacked();
+    const PackedTree<D2,C>* packed2 = field2.getPacked();
+    dbg<<"packed = "<<packed1<<", "<<packed2<<std::endl;
+    RegionTimer timer("BinnedCorr2::process", n1-b1);
+    // If the threads are pinned, each one starts with the cells it built.  (cf. OwnerSchedule)
+    OwnerSchedule owner(n1-b1);
 
 #ifdef _OPENMP
+    // As for the auto-correlation, split large pairs of cells into tasks.
+    const double nobj1 = patch1 >= 0 ? field1.getPatchNObj(patch1) : field1.getNObj();
+    const double nobj2 = patch2 >= 0 ? field2.getPatchNObj(patch2) : field2.getNObj();
+    std::vector<BinnedCorr2<D1,D2,B>*> thread_corrs(omp_get_max_threads(), 0);
+    const double min_task_work = MAX(nobj1*nobj2 / (TASKS_PER_THREAD * thread_corrs.size()),
+                                     MIN_TASK_WORK);
+    dbg<<"min_task_work = "<<min_task_work<<std::endl;
+    const int ncopies = getNCopies(thread_corrs.size());
+    std::vector<StripeLocks> locks(ncopies < int(thread_corrs.size()) ? ncopies : 0);
+    dbg<<"ncopies = "<<ncopies<<std::endl;
 #pragma omp parallel
     {
-        // Give each thread their own copy of the data vector to fill in.
-        BinnedCorr2<D1,D2,B> bc2(*this,false);
+        // Get this thread's copy of the data vector to fill in.
+        BinnedCorr2<D1,D2,B>& bc2 = *startThread(thread_corrs, locks.empty() ? 0 : &locks[0],
+                                                 ncopies, min_task_work);
 #else
         BinnedCorr2<D1,D2,B>& bc2 = *this;
 #endif
+        timer.startThread();
 
         MetricHelper<M,P> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+        // As for the auto-correlation, Periodic uses Euclidean where no wrapping is needed.
+        const int M2 = NoWrapHelper<M>::M2;
+        MetricHelper<M2,P> metric2(_minrpar, _maxrpar, _xp, _yp, _zp);
 
 #ifdef _OPENMP
 #pragma omp for schedule(dynamic)
 #endif
-        for (long i=0;i<n1;++i) {
+        for (long k=b1;k<n1;++k) {
+            const long i = owner.on() ? b1 + owner.next() : k;
+            RegionTimer::Item item(timer, i-b1);
 #ifdef _OPENMP
 #pragma omp critical
 #endif
@@ -235,18 +473,41 @@ void BinnedCorr2<D1,D2,B>::process(const Field<D1,C>& field1, const Field<D2,C>&
 #endif
                 if (dots) std::cout<<'.'<<std::flush;
             }
+            if (packed1 && packed2) {
+                const long t1 = packed1->getTop(i);
+                const Position<C> p1 = packed1->getPos(t1);
+                const double s1 = packed1->getSize(t1);
+                for (long j=b2;j<n2;++j) {
+                    const long t2 = packed2->getTop(j);
+                    if (NoWrapHelper<M>::noWrap(p1, s1, packed2->getPos(t2),
+                                                packed2->getSize(t2), _xp, _yp, _zp))
+                        bc2.template process11<C,M2,P>(*packed1, t1, *packed2, t2,
+                                                       metric2, false);
+                    else
+                        bc2.template process11<C,M,P>(*packed1, t1, *packed2, t2,
+                                                      metric, false);
+                }
+                continue;
+            }
             const Cell<D1,C>& c1 = *field1.getCells()[i];
-            for (long j=0;j<n2;++j) {
+            const Position<C> p1 = c1.getPos();
+            const double s1 = c1.getSize();
+            for (long j=b2;j<n2;++j) {
                 const Cell<D2,C>& c2 = *field2.getCells()[j];
-                bc2.process11<C,M,P>(c1, c2, metric, false);
+                if (NoWrapHelper<M>::noWrap(p1, s1, c2.getPos(), c2.getSize(), _xp, _yp, _zp))
+                    bc2.process11<C,M2,P>(c1, c2, metric2, false);
+                else
+                    bc2.process11<C,M,P>(c1, c2, metric, false);
             }
         }
 #ifdef _OPENMP
         // Accumulate the results
-#pragma omp critical
+        timer.startMerge();
         {
-            *this += bc2;
+            TraceSpan span("BinnedCorr2::merge");
+            finishThread(thread_corrs, ncopies);
         }
+        timer.finishMerge();
     }
 #endif
     if (dots) std::cout<<std::endl;
@@ -316,317 +577,1037 @@ void BinnedCorr2<D1,D2,B>::processPairwise(
     if (dots) std::cout<<std::endl;
 }
 
+// Push the sub-pairs of a pair of cells that needs to be split onto a WorkStack.
+// All but the first sub-pair go on the stack in reverse order, and c1, c2 are set to the
+// first one, which the caller can go on to process directly.  So the pairs end up being
+// processed in the same order as the recursive version would have done them.
+template <int D1, int D2, int C>
+inline void PushSplit(WorkStack<WorkPair<const Cell<D1,C>*, const Cell<D2,C>*> >& todo,
+                      const Cell<D1,C>*& c1, const Cell<D2,C>*& c2, bool split1, bool split2)
+{
+    typedef WorkPair<const Cell<D1,C>*, const Cell<D2,C>*> CellPair;
+    if (split1 && split2) {
+        todo.push(CellPair(c1->getRight(), c2->getRight()));
+        todo.push(CellPair(c1->getRight(), c2->getLeft()));
+        todo.push(CellPair(c1->getLeft(), c2->getRight()));
+        c1 = c1->getLeft();
+        c2 = c2->getLeft();
+    } else if (split1) {
+        todo.push(CellPair(c1->getRight(), c2));
+        c1 = c1->getLeft();
+    } else {
+        Assert(split2);
+        todo.push(CellPair(c1, c2->getRight()));
+        c2 = c2->getLeft();
+    }
+}
+
+// The same thing for the nodes of a PackedTree.
+template <int D1, int D2, int C>
+inline void PushSplit(WorkStack<WorkPair<long, long> >& todo,
+                      const PackedTree<D1,C>& t1, long& i1, const PackedTree<D2,C>& t2, long& i2,
+                      bool split1, bool split2)
+{
+    typedef WorkPair<long, long> NodePair;
+    if (split1 && split2) {
+        const long l1 = t1.getLeft(i1), r1 = t1.getRight(i1);
+        const long l2 = t2.getLeft(i2), r2 = t2.getRight(i2);
+        todo.push(NodePair(r1, r2));
+        todo.push(NodePair(r1, l2));
+        todo.push(NodePair(l1, r2));
+        i1 = l1;
+        i2 = l2;
+    } else if (split1) {
+        todo.push(NodePair(t1.getRight(i1), i2));
+        i1 = t1.getLeft(i1);
+    } else {
+        Assert(split2);
+        todo.push(NodePair(i1, t2.getRight(i2)));
+        i2 = t2.getLeft(i2);
+    }
+}
+
 template <int D1, int D2, int B> template <int C, int M, int P>
 void BinnedCorr2<D1,D2,B>::process2(const Cell<D1,C>& c12, const MetricHelper<M,P>& metric)
 {
-    if (c12.getW() == 0.) return;
-    if (c12.getSize() <= _halfminsep) return;
+    // Rather than recursing, keep the cells still to be done on a stack.
+    WorkStack<const Cell<D1,C>*> todo;
+    todo.push(&c12);
+    while (!todo.empty()) {
+        const Cell<D1,C>& c = *todo.pop();
+        if (c.getW() == 0.) continue;
+        if (c.getSize() <= _halfminsep) continue;
 
-    Assert(c12.getLeft());
-    Assert(c12.getRight());
-    process2<C,M,P>(*c12.getLeft(), metric);
-    process2<C,M,P>(*c12.getRight(), metric);
-    process11<C,M,P>(*c12.getLeft(), *c12.getRight(), metric, BinTypeHelper<B>::doReverse());
+        if (c.isBucket()) {
+            // Just do all the pairs of leaves directly.
+            const Cell<D1,C>* leaves = c.getBucketLeaves();
+            const long n = c.getN();
+            for (long i=0; i<n; ++i)
+                for (long j=i+1; j<n; ++j)
+                    process11<C,M,P>(leaves[i], leaves[j], metric,
+                                     BinTypeHelper<B>::doReverse());
+            continue;
+        }
+
+        Assert(c.getLeft());
+        Assert(c.getRight());
+        todo.push(c.getRight());
+        todo.push(c.getLeft());
+        process11<C,M,P>(*c.getLeft(), *c.getRight(), metric, BinTypeHelper<B>::doReverse());
+    }
 }
 
 template <int D1, int D2, int B> template <int C, int M, int P>
-void BinnedCorr2<D1,D2,B>::process11(const Cell<D1,C>& c1, const Cell<D2,C>& c2,
-                                     const MetricHelper<M,P>& metric, bool do_reverse)
+PairAction BinnedCorr2<D1,D2,B>::classifyPair(
+    const Position<C>& p1, const Position<C>& p2, double s1, double s2,
+    const MetricHelper<M,P>& metric, double& rsq, int& k, double& r, double& logr,
+    bool& split1, bool& split2)
 {
-    //set_verbose(2);
-    xdbg<<"Start process11 for "<<c1.getPos()<<",  "<<c2.getPos()<<"   ";
-    xdbg<<"w = "<<c1.getW()<<", "<<c2.getW()<<std::endl;
-    if (c1.getW() == 0. || c2.getW() == 0.) return;
-
-    const Position<C>& p1 = c1.getPos();
-    const Position<C>& p2 = c2.getPos();
-    double s1 = c1.getSize(); // May be modified by DistSq function.
-    double s2 = c2.getSize(); // "
+    // Cells below the min_size of this binning would have been leaves.  (cf. setMinSize)
+    if (s1 <= _minsize) s1 = 0.;
+    if (s2 <= _minsize) s2 = 0.;
+    // Note: s1, s2 may be modified by DistSq function.
     xdbg<<"s1,s2 = "<<s1<<','<<s2<<std::endl;
     xdbg<<"M,C = "<<M<<"  "<<C<<std::endl;
-    const double rsq = metric.DistSq(p1,p2,s1,s2);
+    rsq = metric.DistSq(p1,p2,s1,s2);
     xdbg<<"rsq = "<<rsq<<std::endl;
     xdbg<<"s1,s2 => "<<s1<<','<<s2<<std::endl;
+    return classifyPairDistSq(p1, p2, s1, s2, metric, rsq, k, r, logr, split1, split2);
+}
+
+template <int D1, int D2, int B>
+inline double BinnedCorr2<D1,D2,B>::getPairB(double rsq, double s1ps2) const
+{
+    if (_bnear.empty() || SQR(s1ps2) <= BinTypeHelper<B>::getEffectiveBSq(rsq,_bsq)) return _b;
+    // The first edge above rsq, not counting the outer ones, so separations outside the range
+    // use the first or last bin.
+    const int k = int(std::upper_bound(_rsqedges.begin()+1, _rsqedges.end()-1, rsq) -
+                      _rsqedges.begin()) - 1;
+    return _bnear[k];
+}
+
+template <int D1, int D2, int B> template <int C, int M, int P>
+PairAction BinnedCorr2<D1,D2,B>::classifyPairDistSq(
+    const Position<C>& p1, const Position<C>& p2, double s1, double s2,
+    const MetricHelper<M,P>& metric, double rsq, int& k, double& r, double& logr,
+    bool& split1, bool& split2)
+{
     const double s1ps2 = s1+s2;
+    _stats.count(Stat2Pairs);
 
     double rpar = 0; // Gets set to correct value by this function if appropriate
     if (metric.isRParOutsideRange(p1, p2, s1ps2, rpar)) {
-        return;
+        _stats.count(Stat2RPar);
+        return SkipPair;
     }
     xdbg<<"RPar in range\n";
 
     if (BinTypeHelper<B>::tooSmallDist(rsq, s1ps2, _minsep, _minsepsq) &&
         metric.tooSmallDist(p1, p2, rsq, rpar, s1ps2, _minsep, _minsepsq)) {
-        return;
+        _stats.count(Stat2MinSep);
+        return SkipPair;
     }
     xdbg<<"Not too small separation\n";
 
     if (BinTypeHelper<B>::tooLargeDist(rsq, s1ps2, _maxsep, _maxsepsq) &&
         metric.tooLargeDist(p1, p2, rsq, rpar, s1ps2, _fullmaxsep, _fullmaxsepsq)) {
-        return;
+        _stats.count(Stat2MaxSep);
+        return SkipPair;
     }
     xdbg<<"Not too large separation\n";
 
     // Now check if these cells are small enough that it is ok to drop into a single bin.
-    int k=-1;
-    double r=0,logr=0;  // If singleBin is true, these values are set for use by directProcess11
+    // If singleBin is true, k, r, logr are set for use by directProcess11
+    const double b = getPairB(rsq, s1ps2);
     if (metric.isRParInsideRange(p1, p2, s1ps2, rpar) &&
-        BinTypeHelper<B>::singleBin(rsq, s1ps2, p1, p2, _binsize, _b, _bsq,
-                                    _minsep, _maxsep, _logminsep, k, r, logr))
+        BinTypeHelper<B>::singleBin(rsq, s1ps2, p1, p2, _binsize, b, b*b,
+                                    _minsep, _maxsep, _logminsep, _edges, k, r, logr))
     {
         xdbg<<"Drop into single bin.\n";
         if (BinTypeHelper<B>::isRSqInRange(rsq, p1, p2, _minsep, _minsepsq, _maxsep, _maxsepsq)) {
-            directProcess11(c1,c2,rsq,do_reverse,k,r,logr);
+            _stats.count(s1ps2 == 0. ? Stat2Leaf : Stat2SingleBin);
+            return DirectPair;
+        } else {
+            _stats.count(Stat2Range);
+            return SkipPair;
         }
     } else {
         xdbg<<"Need to split.\n";
-        bool split1=false, split2=false;
-        double bsq_eff = BinTypeHelper<B>::getEffectiveBSq(rsq,_bsq);
+        double bsq_eff = BinTypeHelper<B>::getEffectiveBSq(rsq,b*b);
         xdbg<<"bsq_eff = "<<bsq_eff<<std::endl;
-        CalcSplitSq(split1,split2,s1,s2,s1ps2,bsq_eff);
+        CalcSplitSq(split1,split2,s1,s2,s1ps2,bsq_eff,_splitfactorsq);
         xdbg<<"rsq = "<<rsq<<", s1ps2 = "<<s1ps2<<"  ";
-        xdbg<<"s1ps2 / r = "<<s1ps2 / sqrt(rsq)<<", b = "<<_b<<"  ";
+        xdbg<<"s1ps2 / r = "<<s1ps2 / sqrt(rsq)<<", b = "<<b<<"  ";
         xdbg<<"split = "<<split1<<','<<split2<<std::endl;
+        _stats.split(split1,split2);
+        return SplitPair;
+    }
+}
 
-        if (split1 && split2) {
-            Assert(c1.getLeft());
-            Assert(c1.getRight());
-            Assert(c2.getLeft());
-            Assert(c2.getRight());
-            process11<C,M,P>(*c1.getLeft(),*c2.getLeft(),metric,do_reverse);
-            process11<C,M,P>(*c1.getLeft(),*c2.getRight(),metric,do_reverse);
-            process11<C,M,P>(*c1.getRight(),*c2.getLeft(),metric,do_reverse);
-            process11<C,M,P>(*c1.getRight(),*c2.getRight(),metric,do_reverse);
-        } else if (split1) {
-            Assert(c1.getLeft());
-            Assert(c1.getRight());
-            process11<C,M,P>(*c1.getLeft(),c2,metric,do_reverse);
-            process11<C,M,P>(*c1.getRight(),c2,metric,do_reverse);
-        } else {
-            Assert(split2);
-            Assert(c2.getLeft());
-            Assert(c2.getRight());
-            process11<C,M,P>(c1,*c2.getLeft(),metric,do_reverse);
-            process11<C,M,P>(c1,*c2.getRight(),metric,do_reverse);
+template <int D1, int D2, int B> template <int C, int M, int P>
+void BinnedCorr2<D1,D2,B>::process11(const Cell<D1,C>& c1, const Cell<D2,C>& c2,
+                                     const MetricHelper<M,P>& metric, bool do_reverse)
+{
+    //set_verbose(2);
+    // Rather than recursing, keep the pairs of cells still to be done on a stack.
+    // This visits the pairs in the same (depth-first) order as recursion would.
+    typedef WorkPair<const Cell<D1,C>*, const Cell<D2,C>*> CellPair;
+    WorkStack<CellPair> todo;
+    DirectBatch<D1,D2,C> batch;
+    typename PruneStats2::Depths depth;
+    _stats.count(Stat2Calls);
+    const Cell<D1,C>* pa = &c1;
+    const Cell<D2,C>* pb = &c2;
+    for (;;) {
+        const Cell<D1,C>& a = *pa;
+        const Cell<D2,C>& b = *pb;
+        xdbg<<"process11 for "<<a.getPos()<<",  "<<b.getPos()<<"   ";
+        xdbg<<"w = "<<a.getW()<<", "<<b.getW()<<std::endl;
+        if (a.getW() != 0. && b.getW() != 0.) {
+            _stats.visit(depth.depth());
+            double rsq;
+            int k=-1;
+            double r=0,logr=0;
+            bool split1=false, split2=false;
+            switch (classifyPair(a.getPos(), b.getPos(), a.getSize(), b.getSize(), metric,
+                                 rsq, k, r, logr, split1, split2)) {
+              case SkipPair:
+                   break;
+              case DirectPair:
+                   if (k >= 0) {
+                       directProcess11(a,b,rsq,do_reverse,k,r,logr);
+                   } else {
+                       batch.add(&a,&b,rsq);
+                       if (batch.full()) directProcessBatch(batch,do_reverse);
+                   }
+                   break;
+              case SplitPair:
+                   if ((split1 && a.isBucket()) || (split2 && b.isBucket())) {
+                       // If the other one needs to be split too, but isn't a bucket, split it
+                       // normally first.  This way we only loop over all the pairs of leaves
+                       // once both sides are either buckets or small enough not to need
+                       // splitting.
+                       if (split1 && !a.isBucket()) split2 = false;
+                       else if (split2 && !b.isBucket()) split1 = false;
+                       else {
+                           depth.descend();
+                           processBucket<C,M,P>(a,b,split1,split2,metric,do_reverse);
+                           break;
+                       }
+                   }
+                   if (isTaskWork(a.getN(), b.getN())) {
+                       // Each sub-pair is a separate task rather than going on our stack.
+                       const Cell<D1,C>* a1 = split1 ? a.getLeft() : &a;
+                       const Cell<D1,C>* a2 = split1 ? a.getRight() : 0;
+                       const Cell<D2,C>* b1 = split2 ? b.getLeft() : &b;
+                       const Cell<D2,C>* b2 = split2 ? b.getRight() : 0;
+                       depth.descend();
+                       process11Task<C,M,P>(*a1,*b1,metric,do_reverse);
+                       if (b2) process11Task<C,M,P>(*a1,*b2,metric,do_reverse);
+                       if (a2) process11Task<C,M,P>(*a2,*b1,metric,do_reverse);
+                       if (a2 && b2) process11Task<C,M,P>(*a2,*b2,metric,do_reverse);
+                   } else {
+                       // Go straight on to the first sub-pair.  The rest wait on the stack.
+                       PushSplit(todo,pa,pb,split1,split2);
+                       depth.split(split1 && split2 ? 3 : 1);
+                       continue;
+                   }
+            }
         }
+        if (todo.empty()) break;
+        const CellPair next = todo.pop();
+        pa = next.first;
+        pb = next.second;
+        depth.pop();
     }
+    directProcessBatch(batch,do_reverse);
 }
 
-
-// We also set up a helper class for doing the direct processing
-template <int D1, int D2>
-struct DirectHelper;
-
-template <>
-struct DirectHelper<NData,NData>
+template <int D1, int D2, int B> template <int C, int M, int P>
+void BinnedCorr2<D1,D2,B>::processBucket(const Cell<D1,C>& c1, const Cell<D2,C>& c2,
+                                         bool split1, bool split2,
+                                         const MetricHelper<M,P>& metric, bool do_reverse)
 {
-    template <int C>
-    static void ProcessXi(
-        const Cell<NData,C>& , const Cell<NData,C>& , const double ,
-        XiData<NData,NData>& , int, int )
-    {}
-};
+    // process11 has already split any non-bucket that needed it, so each cell here is
+    // either a bucket that needs splitting or a cell that doesn't.
+    Assert(!split1 || c1.isBucket());
+    Assert(!split2 || c2.isBucket());
+    const Cell<D1,C>* leaves1 = split1 ? c1.getBucketLeaves() : &c1;
+    const Cell<D2,C>* leaves2 = split2 ? c2.getBucketLeaves() : &c2;
+    const long n1 = split1 ? c1.getN() : 1;
+    const long n2 = split2 ? c2.getN() : 1;
+    _stats.count(Stat2Bucket);
+    if ((split1 || c1.getSize() == 0.) && (split2 || c2.getSize() == 0.)) {
+        processLeafPairs<C,M,P>(leaves1,n1,leaves2,n2,metric,do_reverse);
+    } else {
+        // The one that didn't need to be split might need to be split for some of the pairs.
+        for (long i=0; i<n1; ++i)
+            for (long j=0; j<n2; ++j)
+                process11<C,M,P>(leaves1[i],leaves2[j],metric,do_reverse);
+    }
+}
 
-template <>
-struct DirectHelper<NData,KData>
+template <int D1, int D2, int B> template <int C, int M, int P>
+void BinnedCorr2<D1,D2,B>::processLeafPairs(const Cell<D1,C>* leaves1, long n1,
+                                            const Cell<D2,C>* leaves2, long n2,
+                                            const MetricHelper<M,P>& metric, bool do_reverse)
 {
-    template <int C>
-    static void ProcessXi(
-        const Cell<NData,C>& c1, const Cell<KData,C>& c2, const double ,
-        XiData<NData,KData>& xi, int k, int )
-    { xi.xi[k] += c1.getW() * c2.getData().getWK(); }
-};
+    // With zero sizes, each pair is either accumulated directly or skipped, so we don't need
+    // the full classifyPair logic.  For each row of pairs, first calculate the distances and
+    // logs in simple loops without any branches, which the compiler can vectorize.  Then
+    // only the pairs in range go on to the bin calculation and accumulation.
+    const long BLOCK = 64;
+    double rsq[BLOCK];
+    double r[BLOCK];
+    double logr[BLOCK];
+    const CellData<D2,C>* data2 = &leaves2[0].getData();
+    long nleaf = 0;
+    for (long j0=0; j0<n2; j0+=BLOCK) {
+        const long nj = std::min(n2-j0, BLOCK);
+        const CellData<D2,C>* d2 = data2 + j0;
+        for (long i=0; i<n1; ++i) {
+            const Cell<D1,C>& c1 = leaves1[i];
+            if (c1.getW() == 0.) continue;
+            const Position<C>& p1 = c1.getPos();
+            for (long j=0; j<nj; ++j) {
+                double s1=0., s2=0.;
+                rsq[j] = metric.DistSq(p1, d2[j].getPos(), s1, s2);
+            }
+            SqrtLogBlock(rsq, r, logr, nj);
+            for (long j=0; j<nj; ++j) {
+                const Cell<D2,C>& c2 = leaves2[j0+j];
+                Assert(&c2.getData() == d2+j);
+                if (c2.getW() == 0.) continue;
+                const Position<C>& p2 = c2.getPos();
+                double rpar = 0;
+                if (metric.isRParOutsideRange(p1, p2, 0., rpar)) continue;
+                if (!BinTypeHelper<B>::isRSqInRange(rsq[j], p1, p2, _minsep, _minsepsq,
+                                                    _maxsep, _maxsepsq)) continue;
+                int k = BinTypeHelper<B>::calculateBinK(p1, p2, r[j], logr[j], _binsize,
+                                                        _minsep, _maxsep, _logminsep, _edges);
+                directProcess11(c1,c2,rsq[j],do_reverse,k,r[j],logr[j]);
+                if (PruneStats2::enabled) ++nleaf;
+            }
+        }
+    }
+    _stats.count(Stat2LeafPairs, n1*n2);
+    _stats.count(Stat2Leaf, nleaf);
+}
 
-template <>
-struct DirectHelper<NData,GData>
+template <int D1, int D2, int B> template <int C, int M, int P>
+void BinnedCorr2<D1,D2,B>::process2(const PackedTree<D1,C>& t, long i,
+                                    const MetricHelper<M,P>& metric)
 {
-    template <int C>
-    static void ProcessXi(
-        const Cell<NData,C>& c1, const Cell<GData,C>& c2, const double rsq,
-        XiData<NData,GData>& xi, int k, int )
-    {
-        std::complex<double> g2;
-        ProjectHelper<C>::ProjectShear(c1,c2,g2);
-        // The minus sign here is to make it accumulate tangential shear, rather than radial.
-        // g2 from the above ProjectShear is measured along the connecting line, not tangent.
-        g2 *= -c1.getW();
-        xi.xi[k] += real(g2);
-        xi.xi_im[k] += imag(g2);
+    WorkStack<long> todo;
+    todo.push(i);
+    while (!todo.empty()) {
+        const long j = todo.pop();
+        if (t.getW(j) == 0.) continue;
+        if (t.getSize(j) <= _halfminsep) continue;
+
+        const long left = t.getLeft(j);
+        const long right = t.getRight(j);
+        todo.push(right);
+        todo.push(left);
+        process11<C,M,P>(t, left, t, right, metric, BinTypeHelper<B>::doReverse());
     }
-};
+}
 
-template <>
-struct DirectHelper<KData,KData>
+// This is the same as the above process11, but walking the PackedTree arrays rather than
+// following the Cell pointers.  We only go back to the Cells in directProcess11.
+template <int D1, int D2, int B> template <int C, int M, int P>
+void BinnedCorr2<D1,D2,B>::process11(const PackedTree<D1,C>& t1, long i1,
+                                     const PackedTree<D2,C>& t2, long i2,
+                                     const MetricHelper<M,P>& metric, bool do_reverse)
 {
-    template <int C>
-    static void ProcessXi(
-        const Cell<KData,C>& c1, const Cell<KData,C>& c2, const double ,
-        XiData<KData,KData>& xi, int k, int k2)
-    {
-        double wkk = c1.getData().getWK() * c2.getData().getWK();
-        xi.xi[k] += wkk;
-        if (k2 != -1) xi.xi[k2] += wkk;
+    typedef WorkPair<long, long> NodePair;
+    WorkStack<NodePair> todo;
+    DirectBatch<D1,D2,C> batch;
+    typename PruneStats2::Depths depth;
+    _stats.count(Stat2Calls);
+    long j1 = i1;
+    long j2 = i2;
+    for (;;) {
+        xdbg<<"packed process11 for "<<j1<<",  "<<j2<<std::endl;
+        if (t1.getW(j1) != 0. && t2.getW(j2) != 0.) {
+            _stats.visit(depth.depth());
+            double rsq;
+            int k=-1;
+            double r=0,logr=0;
+            bool split1=false, split2=false;
+            switch (classifyPair(t1.getPos(j1), t2.getPos(j2), t1.getSize(j1), t2.getSize(j2),
+                                 metric, rsq, k, r, logr, split1, split2)) {
+              case SkipPair:
+                   break;
+              case DirectPair:
+                   if (k >= 0) {
+                       directProcess11(t1.getCell(j1),t2.getCell(j2),rsq,do_reverse,k,r,logr);
+                   } else {
+                       batch.add(&t1.getCell(j1),&t2.getCell(j2),rsq);
+                       if (batch.full()) directProcessBatch(batch,do_reverse);
+                   }
+                   break;
+              case SplitPair:
+                   if (isTaskWork(t1.getCell(j1).getN(), t2.getCell(j2).getN())) {
+                       const long a1 = split1 ? t1.getLeft(j1) : j1;
+                       const long a2 = split1 ? t1.getRight(j1) : -1;
+                       const long b1 = split2 ? t2.getLeft(j2) : j2;
+                       const long b2 = split2 ? t2.getRight(j2) : -1;
+                       depth.descend();
+                       process11Task<C,M,P>(t1,a1,t2,b1,metric,do_reverse);
+                       if (b2 >= 0) process11Task<C,M,P>(t1,a1,t2,b2,metric,do_reverse);
+                       if (a2 >= 0) process11Task<C,M,P>(t1,a2,t2,b1,metric,do_reverse);
+                       if (a2 >= 0 && b2 >= 0)
+                           process11Task<C,M,P>(t1,a2,t2,b2,metric,do_reverse);
+                   } else {
+                       PushSplit(todo,t1,j1,t2,j2,split1,split2);
+                       depth.split(split1 && split2 ? 3 : 1);
+                       continue;
+                   }
+            }
+        }
+        if (todo.empty()) break;
+        const NodePair next = todo.pop();
+        j1 = next.first;
+        j2 = next.second;
+        depth.pop();
     }
-};
+    directProcessBatch(batch,do_reverse);
+}
 
-template <>
-struct DirectHelper<KData,GData>
+template <int D1, int D2, int B> template <int C, int M, int P>
+void BinnedCorr2<D1,D2,B>::process11Task(const Cell<D1,C>& c1, const Cell<D2,C>& c2,
+                                         const MetricHelper<M,P>& metric, bool do_reverse)
 {
-    template <int C>
-    static void ProcessXi(
-        const Cell<KData,C>& c1, const Cell<GData,C>& c2, const double rsq,
-        XiData<KData,GData>& xi, int k, int )
+#ifdef _OPENMP
+    // The task may run on any thread, possibly after this function returns, so it takes
+    // copies of everything it needs.  All tasks are done by the barrier at the end of the
+    // parallel region in process, before the accumulators are combined.
+    std::vector<BinnedCorr2<D1,D2,B>*>* corrs = _thread_corrs;
+    const Cell<D1,C>* p1 = &c1;
+    const Cell<D2,C>* p2 = &c2;
+    MetricHelper<M,P> m = metric;
+    // The task continues the traversal at this depth, whichever thread runs it.
+    const int depth = PruneStats2::depth();
+#pragma omp task firstprivate(corrs, p1, p2, m, do_reverse, depth)
     {
-        std::complex<double> g2;
-        ProjectHelper<C>::ProjectShear(c1,c2,g2);
-        // The minus sign here is to make it accumulate tangential shear, rather than radial.
-        // g2 from the above ProjectShear is measured along the connecting line, not tangent.
-        g2 *= -c1.getData().getWK();
-        xi.xi[k] += real(g2);
-        xi.xi_im[k] += imag(g2);
+        const int prev_depth = PruneStats2::depth();
+        PruneStats2::setDepth(depth);
+        (*corrs)[omp_get_thread_num()]->template process11<C,M,P>(*p1, *p2, m, do_reverse);
+        PruneStats2::setDepth(prev_depth);
     }
-};
+#else
+    process11<C,M,P>(c1, c2, metric, do_reverse);
+#endif
+}
 
-template <>
-struct DirectHelper<GData,GData>
+template <int D1, int D2, int B> template <int C, int M, int P>
+void BinnedCorr2<D1,D2,B>::process11Task(const PackedTree<D1,C>& t1, long i1,
+                                         const PackedTree<D2,C>& t2, long i2,
+                                         const MetricHelper<M,P>& metric, bool do_reverse)
 {
-    template <int C>
-    static void ProcessXi(
-        const Cell<GData,C>& c1, const Cell<GData,C>& c2, const double rsq,
-        XiData<GData,GData>& xi, int k, int k2)
+#ifdef _OPENMP
+    std::vector<BinnedCorr2<D1,D2,B>*>* corrs = _thread_corrs;
+    const PackedTree<D1,C>* p1 = &t1;
+    const PackedTree<D2,C>* p2 = &t2;
+    MetricHelper<M,P> m = metric;
+    const int depth = PruneStats2::depth();
+#pragma omp task firstprivate(corrs, p1, i1, p2, i2, m, do_reverse, depth)
     {
-        std::complex<double> g1, g2;
-        ProjectHelper<C>::ProjectShears(c1,c2,g1,g2);
-
-        // The complex products g1 g2 and g1 g2* share most of the calculations,
-        // so faster to do this manually.
-        double g1rg2r = g1.real() * g2.real();
-        double g1rg2i = g1.real() * g2.imag();
-        double g1ig2r = g1.imag() * g2.real();
-        double g1ig2i = g1.imag() * g2.imag();
-
-        xi.xip[k] += g1rg2r + g1ig2i;       // g1 * conj(g2)
-        xi.xip_im[k] += g1ig2r - g1rg2i;
-        xi.xim[k] += g1rg2r - g1ig2i;       // g1 * g2
-        xi.xim_im[k] += g1ig2r + g1rg2i;
-
-        if (k2 != -1) {
-            xi.xip[k2] += g1rg2r + g1ig2i;       // g1 * conj(g2)
-            xi.xip_im[k2] += g1ig2r - g1rg2i;
-            xi.xim[k2] += g1rg2r - g1ig2i;       // g1 * g2
-            xi.xim_im[k2] += g1ig2r + g1rg2i;
-        }
+        const int prev_depth = PruneStats2::depth();
+        PruneStats2::setDepth(depth);
+        (*corrs)[omp_get_thread_num()]->template process11<C,M,P>(*p1, i1, *p2, i2, m,
+                                                                   do_reverse);
+        PruneStats2::setDepth(prev_depth);
     }
-};
+#else
+    process11<C,M,P>(t1, i1, t2, i2, metric, do_reverse);
+#endif
+}
 
-template <int D1, int D2, int B> template <int C>
-void BinnedCorr2<D1,D2,B>::directProcess11(
-    const Cell<D1,C>& c1, const Cell<D2,C>& c2, const double rsq, bool do_reverse,
-    int k, double r, double logr)
+// The corresponding cells in the N, K and G trees for the second catalog in MultiCorr2.
+// The ones for correlations that aren't being computed are null.  Since the trees all have
+// the same structure, the geometry can come from whichever one is there.
+template <int C>
+struct MultiCell
 {
-    xdbg<<"DirectProcess11: rsq = "<<rsq<<std::endl;
-    XAssert(rsq >= _minsepsq);
-    XAssert(rsq < _fullmaxsepsq);
-    // Note that most of these XAsserts around are still hardcoded for Log binning and Euclidean
-    // metric.  If turning on verbose>=3, these could fail.
-    XAssert(c1.getSize()+c2.getSize() < sqrt(rsq)*_b + 0.0001);
+    MultiCell() {}
+    MultiCell(const Cell<NData,C>* n_, const Cell<KData,C>* k_, const Cell<GData,C>* g_) :
+        n(n_), k(k_), g(g_) {}
 
-    XAssert(_binsize != 0.);
-    const Position<C>& p1 = c1.getPos();
-    const Position<C>& p2 = c2.getPos();
-    if (k < 0) {
-        r = sqrt(rsq);
-        logr = log(r);
-        Assert(logr >= _logminsep);
-        k = BinTypeHelper<B>::calculateBinK(p1, p2, r, logr, _binsize,
-                                            _minsep, _maxsep, _logminsep);
-    } else {
-        XAssert(std::abs(r - sqrt(rsq)) < 1.e-10*r);
-        XAssert(std::abs(logr - 0.5*log(rsq)) < 1.e-10);
-        XAssert(k == BinTypeHelper<B>::calculateBinK(p1, p2, r, logr, _binsize,
-                                                     _minsep, _maxsep, _logminsep));
+    Position<C> getPos() const { return n ? n->getPos() : k ? k->getPos() : g->getPos(); }
+    double getSize() const { return n ? n->getSize() : k ? k->getSize() : g->getSize(); }
+    double getW() const { return n ? n->getW() : k ? k->getW() : g->getW(); }
+    bool isBucket() const { return n ? n->isBucket() : k ? k->isBucket() : g->isBucket(); }
+
+    MultiCell<C> getLeft() const
+    {
+        return MultiCell<C>(n ? n->getLeft() : 0, k ? k->getLeft() : 0, g ? g->getLeft() : 0);
     }
-    Assert(k >= 0);
-    Assert(k <= _nbins);
-    // It's possible for k to be == _nbins here if the r is very close to the top of the
-    // last bin, but numerical rounding in the log calculation bumped k into the next
-    // (non-existent) bin.
-    if (k == _nbins) {
-        XAssert(BinTypeHelper<B>::calculateBinK(p2, p1, r, logr-1.e-10, _binsize,
-                                                _minsep, _maxsep, _logminsep) == _nbins-1);
-        --k;
+    MultiCell<C> getRight() const
+    {
+        return MultiCell<C>(n ? n->getRight() : 0, k ? k->getRight() : 0,
+                            g ? g->getRight() : 0);
     }
-    Assert(k < _nbins);
-    xdbg<<"r,logr,k = "<<r<<','<<logr<<','<<k<<std::endl;
 
-    double nn = double(c1.getN()) * double(c2.getN());
-    _npairs[k] += nn;
+    const Cell<NData,C>* n;
+    const Cell<KData,C>* k;
+    const Cell<GData,C>* g;
+};
 
-    double ww = double(c1.getW()) * double(c2.getW());
-    _meanr[k] += ww * r;
-    _meanlogr[k] += ww * logr;
-    _weight[k] += ww;
-    xdbg<<"n,w = "<<nn<<','<<ww<<" ==>  "<<_npairs[k]<<','<<_weight[k]<<std::endl;
+// The per-thread copies of one of the correlations in MultiCorr2::process or
+// MultiBinCorr2::process.
+template <int D1, int D2, int B>
+struct MultiThreadCorrs
+{
+    MultiThreadCorrs(BinnedCorr2<D1,D2,B>* corr) : _corr(corr), _ncopies(0)
+    {
+#ifdef _OPENMP
+        if (_corr) {
+            _thread_corrs.resize(omp_get_max_threads(), 0);
+            _ncopies = _corr->getNCopies(_thread_corrs.size());
+            if (_ncopies < int(_thread_corrs.size())) _locks.resize(_ncopies);
+        }
+#endif
+    }
 
-    int k2 = -1;
-    if (do_reverse) {
-        k2 = BinTypeHelper<B>::calculateBinK(p2, p1, r, logr, _binsize,
-                                             _minsep, _maxsep, _logminsep);
-        if (k == _nbins) --k;  // As before, this can (rarely) happen.
-        Assert(k2 >= 0);
-        Assert(k2 < _nbins);
-        _npairs[k2] += nn;
-        _meanr[k2] += ww * r;
-        _meanlogr[k2] += ww * logr;
-        _weight[k2] += ww;
+    // These must be called by every thread in the parallel region.
+    BinnedCorr2<D1,D2,B>* start()
+    {
+        // BinnedCorr2::process11 only knows about its own correlation, so don't split
+        // anything into tasks.  They would skip the other correlations.
+        if (!_corr) return 0;
+        return _corr->startThread(_thread_corrs, _locks.empty() ? 0 : &_locks[0], _ncopies,
+                                  std::numeric_limits<double>::max());
     }
+    void finish()
+    { if (_corr) _corr->finishThread(_thread_corrs, _ncopies); }
 
-    DirectHelper<D1,D2>::template ProcessXi<C>(c1,c2,rsq,_xi,k,k2);
-}
+    BinnedCorr2<D1,D2,B>* _corr;
+    std::vector<BinnedCorr2<D1,D2,B>*> _thread_corrs;
+    std::vector<StripeLocks> _locks;
+    int _ncopies;
+};
 
-template <int D1, int D2, int B>
-void BinnedCorr2<D1,D2,B>::operator=(const BinnedCorr2<D1,D2,B>& rhs)
+template <int B> template <int C, int M, int P>
+void MultiCorr2<B>::process(const Field<NData,C>& field1, const Field<NData,C>* field2n,
+                            const Field<KData,C>* field2k, const Field<GData,C>* field2g,
+                            bool dots)
 {
-    Assert(rhs._nbins == _nbins);
-    _xi.copy(rhs._xi,_nbins);
-    for (int i=0; i<_nbins; ++i) _meanr[i] = rhs._meanr[i];
-    for (int i=0; i<_nbins; ++i) _meanlogr[i] = rhs._meanlogr[i];
-    for (int i=0; i<_nbins; ++i) _weight[i] = rhs._weight[i];
-    for (int i=0; i<_nbins; ++i) _npairs[i] = rhs._npairs[i];
-}
+    xdbg<<"Start MultiCorr2::process: M,P,C = "<<M<<"  "<<P<<"  "<<C<<std::endl;
+    Assert(_nn || _nk || _ng);
+    Assert(!_nn == !field2n);
+    Assert(!_nk == !field2k);
+    Assert(!_ng == !field2g);
+    if (_nn) { Assert(_nn->_coords == -1 || _nn->_coords == C); _nn->_coords = C; }
+    if (_nk) { Assert(_nk->_coords == -1 || _nk->_coords == C); _nk->_coords = C; }
+    if (_ng) { Assert(_ng->_coords == -1 || _ng->_coords == C); _ng->_coords = C; }
 
-template <int D1, int D2, int B>
-void BinnedCorr2<D1,D2,B>::operator+=(const BinnedCorr2<D1,D2,B>& rhs)
-{
-    Assert(rhs._nbins == _nbins);
-    _xi.add(rhs._xi,_nbins);
-    for (int i=0; i<_nbins; ++i) _meanr[i] += rhs._meanr[i];
-    for (int i=0; i<_nbins; ++i) _meanlogr[i] += rhs._meanlogr[i];
-    for (int i=0; i<_nbins; ++i) _weight[i] += rhs._weight[i];
-    for (int i=0; i<_nbins; ++i) _npairs[i] += rhs._npairs[i];
-}
+    const long n1 = field1.getNTopLevel();
+    const long n2 = field2n ? field2n->getNTopLevel() :
+        field2k ? field2k->getNTopLevel() : field2g->getNTopLevel();
+    dbg<<"field1 has "<<n1<<" top level nodes\n";
+    dbg<<"field2 has "<<n2<<" top level nodes\n";
+    Assert(n1 > 0);
+    Assert(n2 > 0);
+    Assert(!field2n || field2n->getNTopLevel() == n2);
+    Assert(!field2k || field2k->getNTopLevel() == n2);
+    Assert(!field2g || field2g->getNTopLevel() == n2);
 
-template <int D1, int D2, int B> template <int M, int C>
-bool BinnedCorr2<D1,D2,B>::triviallyZero(Position<C> p1, Position<C> p2, double s1, double s2)
-{
-    // Ignore any min/max rpar for this calculation.
-    double minrpar = -std::numeric_limits<double>::max();
-    double maxrpar = std::numeric_limits<double>::max();
-    MetricHelper<M,0> metric(minrpar, maxrpar, _xp, _yp, _zp);
-    const double rsq = metric.DistSq(p1, p2, s1, s2);
-    double s1ps2 = s1 + s2;
-    double rpar = 0;
-    return (BinTypeHelper<B>::tooLargeDist(rsq, s1ps2, _maxsep, _maxsepsq) &&
-            metric.tooLargeDist(p1, p2, rsq, rpar, s1ps2, _fullmaxsep, _fullmaxsepsq));
+    // All the correlations have the same rpar limits and periods, so use any of them.
+    const double minrpar = _nn ? _nn->_minrpar : _nk ? _nk->_minrpar : _ng->_minrpar;
+    const double maxrpar = _nn ? _nn->_maxrpar : _nk ? _nk->_maxrpar : _ng->_maxrpar;
+    const double xp = _nn ? _nn->_xp : _nk ? _nk->_xp : _ng->_xp;
+    const double yp = _nn ? _nn->_yp : _nk ? _nk->_yp : _ng->_yp;
+    const double zp = _nn ? _nn->_zp : _nk ? _nk->_zp : _ng->_zp;
+
+#ifdef _OPENMP
+    MultiThreadCorrs<NData,NData,B> nn_corrs(_nn);
+    MultiThreadCorrs<NData,KData,B> nk_corrs(_nk);
+    MultiThreadCorrs<NData,GData,B> ng_corrs(_ng);
+#pragma omp parallel
+    {
+        // Get this thread's copies of the data vectors to fill in.
+        // (Each start has barriers, so do them one at a time in a fixed order.)
+        BinnedCorr2<NData,NData,B>* nn = nn_corrs.start();
+        BinnedCorr2<NData,KData,B>* nk = nk_corrs.start();
+        BinnedCorr2<NData,GData,B>* ng = ng_corrs.start();
+        MultiCorr2<B> mc2(nn, nk, ng);
+#else
+        MultiCorr2<B>& mc2 = *this;
+#endif
+
+        MetricHelper<M,P> metric(minrpar, maxrpar, xp, yp, zp);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (long i=0;i<n1;++i) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            {
+                if (dots) std::cout<<'.'<<std::flush;
+            }
+            const Cell<NData,C>& c1 = *field1.getCells()[i];
+            for (long j=0;j<n2;++j) {
+                mc2.template process11<C,M,P>(
+                    c1, field2n ? field2n->getCells()[j] : 0,
+                    field2k ? field2k->getCells()[j] : 0,
+                    field2g ? field2g->getCells()[j] : 0, metric);
+            }
+        }
+#ifdef _OPENMP
+        // Accumulate the results
+        nn_corrs.finish();
+        nk_corrs.finish();
+        ng_corrs.finish();
+    }
+#endif
+    if (dots) std::cout<<std::endl;
 }
 
-template <int D1, int D2, int B> template <int M, int P, int C>
-long BinnedCorr2<D1,D2,B>::samplePairs(
-    const Field<D1, C>& field1, const Field<D2, C>& field2,
-    double minsep, double maxsep, long* i1, long* i2, double* sep, int n)
+template <int B> template <int C, int M, int P>
+void MultiCorr2<B>::process11(const Cell<NData,C>& c1, const Cell<NData,C>* c2n,
+                              const Cell<KData,C>* c2k, const Cell<GData,C>* c2g,
+                              const MetricHelper<M,P>& metric)
 {
-    Assert(_coords == -1 || _coords == C);
-    _coords = C;
+    // This is the same traversal as BinnedCorr2::process11, except that each time a pair of
+    // cells is accumulated, it is accumulated into all of the correlations.
+    typedef WorkPair<const Cell<NData,C>*, MultiCell<C> > CellPair;
+    WorkStack<CellPair> todo;
+    const Cell<NData,C>* pa = &c1;
+    MultiCell<C> b(c2n, c2k, c2g);
+    for (;;) {
+        const Cell<NData,C>& a = *pa;
+        xdbg<<"multi process11 for "<<a.getPos()<<",  "<<b.getPos()<<std::endl;
+        Assert(!b.n || !b.k || b.n->getN() == b.k->getN());
+        Assert(!b.n || !b.g || b.n->getN() == b.g->getN());
+        Assert(!b.k || !b.g || b.k->getN() == b.g->getN());
+        if (a.getW() != 0. && b.getW() != 0.) {
+            double rsq;
+            int k=-1;
+            double r=0,logr=0;
+            bool split1=false, split2=false;
+            // The classification only depends on the binning, which is the same for all of them.
+            PairAction action =
+                _nn ? _nn->classifyPair(a.getPos(), b.getPos(), a.getSize(), b.getSize(), metric,
+                                        rsq, k, r, logr, split1, split2) :
+                _nk ? _nk->classifyPair(a.getPos(), b.getPos(), a.getSize(), b.getSize(), metric,
+                                        rsq, k, r, logr, split1, split2) :
+                _ng->classifyPair(a.getPos(), b.getPos(), a.getSize(), b.getSize(), metric,
+                                  rsq, k, r, logr, split1, split2);
+            switch (action) {
+              case SkipPair:
+                   break;
+              case DirectPair:
+                   if (_nn) _nn->directProcess11(a,*b.n,rsq,false,k,r,logr);
+                   if (_nk) _nk->directProcess11(a,*b.k,rsq,false,k,r,logr);
+                   if (_ng) _ng->directProcess11(a,*b.g,rsq,false,k,r,logr);
+                   break;
+              case SplitPair:
+                   if ((split1 && a.isBucket()) || (split2 && b.isBucket())) {
+                       // As in BinnedCorr2::process11, split any non-bucket first.  Once we
+                       // get to the leaves of the buckets, each correlation does its own.
+                       if (split1 && !a.isBucket()) split2 = false;
+                       else if (split2 && !b.isBucket()) split1 = false;
+                       else {
+                           if (_nn)
+                               _nn->template processBucket<C,M,P>(a,*b.n,split1,split2,
+                                                                  metric,false);
+                           if (_nk)
+                               _nk->template processBucket<C,M,P>(a,*b.k,split1,split2,
+                                                                  metric,false);
+                           if (_ng)
+                               _ng->template processBucket<C,M,P>(a,*b.g,split1,split2,
+                                                                  metric,false);
+                           break;
+                       }
+                   }
+                   // Go straight on to the first sub-pair.  The rest wait on the stack.
+                   if (split1 && split2) {
+                       todo.push(CellPair(a.getRight(), b.getRight()));
+                       todo.push(CellPair(a.getRight(), b.getLeft()));
+                       todo.push(CellPair(a.getLeft(), b.getRight()));
+                       pa = a.getLeft();
+                       b = b.getLeft();
+                   } else if (split1) {
+                       todo.push(CellPair(a.getRight(), b));
+                       pa = a.getLeft();
+                   } else {
+                       Assert(split2);
+                       todo.push(CellPair(&a, b.getRight()));
+                       b = b.getLeft();
+                   }
+                   continue;
+            }
+        }
+        if (todo.empty()) break;
+        const CellPair next = todo.pop();
+        pa = next.first;
+        b = next.second;
+    }
+}
+
+template <int D1, int B> template <int C, int M, int P>
+void MultiKCorr2<D1,B>::process(const PackedTree<D1,C>& t, const PackedChannels<D1,C>& k,
+                                bool dots)
+{
+    xdbg<<"Start MultiKCorr2::process (auto): M,P,C = "<<M<<"  "<<P<<"  "<<C<<std::endl;
+    Assert(D1 == KData);
+    Assert(_nchan1 == _nchan2);
+    Assert(k.getNChan() == _nchan1);
+    Assert(_corr->_coords == -1 || _corr->_coords == C);
+    _corr->_coords = C;
+    const long n1 = t.getNTop();
+    dbg<<"field has "<<n1<<" top level nodes\n";
+    Assert(n1 > 0);
+    const long nxi = long(_nchan1) * _nchan2 * _corr->_nbins;
+
+#ifdef _OPENMP
+    MultiThreadCorrs<D1,KData,B> corrs(_corr);
+#pragma omp parallel
+    {
+        // Each thread accumulates its xi in its own array, which is added to _xi at the end.
+        std::vector<double> xi(nxi, 0.);
+        MultiKCorr2<D1,B> mk2(corrs.start(), &xi[0], _nchan1, _nchan2);
+#else
+        MultiKCorr2<D1,B>& mk2 = *this;
+#endif
+
+        MetricHelper<M,P> metric(_corr->_minrpar, _corr->_maxrpar,
+                                 _corr->_xp, _corr->_yp, _corr->_zp);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (long i=0;i<n1;++i) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            {
+                if (dots) std::cout<<'.'<<std::flush;
+            }
+            const long t1 = t.getTop(i);
+            mk2.template process2<C,M,P>(t, t1, k, metric);
+            for (long j=i+1;j<n1;++j) {
+                mk2.template process11<C,M,P>(t, t1, &k, t, t.getTop(j), k, metric, true);
+            }
+        }
+#ifdef _OPENMP
+        // Accumulate the results
+        corrs.finish();
+#pragma omp critical
+        {
+            for (long n=0; n<nxi; ++n) _xi[n] += xi[n];
+        }
+    }
+#endif
+    if (dots) std::cout<<std::endl;
+}
+
+template <int D1, int B> template <int C, int M, int P>
+void MultiKCorr2<D1,B>::process(const PackedTree<D1,C>& t1, const PackedChannels<D1,C>* k1,
+                                const PackedTree<KData,C>& t2,
+                                const PackedChannels<KData,C>& k2, bool dots)
+{
+    xdbg<<"Start MultiKCorr2::process (cross): M,P,C = "<<M<<"  "<<P<<"  "<<C<<std::endl;
+    Assert(k1 ? k1->getNChan() == _nchan1 : _nchan1 == 1);
+    Assert(k2.getNChan() == _nchan2);
+    Assert(_corr->_coords == -1 || _corr->_coords == C);
+    _corr->_coords = C;
+    const long n1 = t1.getNTop();
+    const long n2 = t2.getNTop();
+    dbg<<"field1 has "<<n1<<" top level nodes\n";
+    dbg<<"field2 has "<<n2<<" top level nodes\n";
+    Assert(n1 > 0);
+    Assert(n2 > 0);
+    const long nxi = long(_nchan1) * _nchan2 * _corr->_nbins;
+
+#ifdef _OPENMP
+    MultiThreadCorrs<D1,KData,B> corrs(_corr);
+#pragma omp parallel
+    {
+        std::vector<double> xi(nxi, 0.);
+        MultiKCorr2<D1,B> mk2(corrs.start(), &xi[0], _nchan1, _nchan2);
+#else
+        MultiKCorr2<D1,B>& mk2 = *this;
+#endif
+
+        MetricHelper<M,P> metric(_corr->_minrpar, _corr->_maxrpar,
+                                 _corr->_xp, _corr->_yp, _corr->_zp);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (long i=0;i<n1;++i) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            {
+                if (dots) std::cout<<'.'<<std::flush;
+            }
+            for (long j=0;j<n2;++j) {
+                mk2.template process11<C,M,P>(t1, t1.getTop(i), k1, t2, t2.getTop(j), k2,
+                                              metric, false);
+            }
+        }
+#ifdef _OPENMP
+        corrs.finish();
+#pragma omp critical
+        {
+            for (long n=0; n<nxi; ++n) _xi[n] += xi[n];
+        }
+    }
+#endif
+    if (dots) std::cout<<std::endl;
+}
+
+template <int D1, int B> template <int C, int M, int P>
+void MultiKCorr2<D1,B>::process2(const PackedTree<D1,C>& t, long i,
+                                 const PackedChannels<D1,C>& k, const MetricHelper<M,P>& metric)
+{
+    WorkStack<long> todo;
+    todo.push(i);
+    while (!todo.empty()) {
+        const long j = todo.pop();
+        if (t.getW(j) == 0.) continue;
+        if (t.getSize(j) <= _corr->_halfminsep) continue;
+
+        const long left = t.getLeft(j);
+        const long right = t.getRight(j);
+        todo.push(right);
+        todo.push(left);
+        process11<C,M,P>(t, left, &k, t, right, k, metric, true);
+    }
+}
+
+template <int D1, int B> template <int C, int M, int P>
+void MultiKCorr2<D1,B>::process11(const PackedTree<D1,C>& t1, long i1,
+                                  const PackedChannels<D1,C>* k1,
+                                  const PackedTree<KData,C>& t2, long i2,
+                                  const PackedChannels<KData,C>& k2,
+                                  const MetricHelper<M,P>& metric, bool is_auto)
+{
+    // This is the same traversal as BinnedCorr2::process11 for a PackedTree, except that
+    // the pairs are accumulated for all the channels.
+    typedef WorkPair<long, long> NodePair;
+    WorkStack<NodePair> todo;
+    long j1 = i1;
+    long j2 = i2;
+    for (;;) {
+        xdbg<<"multi-k process11 for "<<j1<<",  "<<j2<<std::endl;
+        const double w1 = t1.getW(j1);
+        if (w1 != 0. && t2.getW(j2) != 0.) {
+            double rsq;
+            int k=-1;
+            double r=0,logr=0;
+            bool split1=false, split2=false;
+            switch (_corr->classifyPair(t1.getPos(j1), t2.getPos(j2), t1.getSize(j1),
+                                        t2.getSize(j2), metric, rsq, k, r, logr,
+                                        split1, split2)) {
+              case SkipPair:
+                   break;
+              case DirectPair:
+                   directProcess11(t1.getCell(j1), t2.getCell(j2),
+                                   k1 ? k1->getWK(j1) : &w1, k2.getWK(j2),
+                                   rsq, is_auto, k, r, logr);
+                   break;
+              case SplitPair:
+                   PushSplit(todo,t1,j1,t2,j2,split1,split2);
+                   continue;
+            }
+        }
+        if (todo.empty()) break;
+        const NodePair next = todo.pop();
+        j1 = next.first;
+        j2 = next.second;
+    }
+}
+
+template <int D1, int B> template <int C>
+void MultiKCorr2<D1,B>::directProcess11(const Cell<D1,C>& c1, const Cell<KData,C>& c2,
+                                        const double* wk1, const double* wk2, double rsq,
+                                        bool is_auto, int k, double r, double logr)
+{
+    const BinnedCorr2<D1,KData,B>& bc = *_corr;
+    const Position<C>& p1 = c1.getPos();
+    const Position<C>& p2 = c2.getPos();
+    const int nbins = bc._nbins;
+    if (k < 0) {
+        r = sqrt(rsq);
+        logr = log(r);
+        k = BinTypeHelper<B>::calculateBinK(p1, p2, r, logr, bc._binsize,
+                                            bc._minsep, bc._maxsep, bc._logminsep, bc._edges);
+    }
+    // As in BinnedCorr2::directProcess11, rounding can (rarely) put this one past the end.
+    if (k == nbins) --k;
+    Assert(k >= 0 && k < nbins);
+    const bool do_reverse = is_auto && BinTypeHelper<B>::doReverse();
+    _corr->directProcess11(c1, c2, rsq, do_reverse, k, r, logr);
+
+    const int n1 = _nchan1;
+    const int n2 = _nchan2;
+    if (do_reverse) {
+        int k2 = BinTypeHelper<B>::calculateBinK(p2, p1, r, logr, bc._binsize,
+                                                 bc._minsep, bc._maxsep, bc._logminsep,
+                                                 bc._edges);
+        if (k2 == nbins) --k2;
+        Assert(k2 >= 0 && k2 < nbins);
+        for (int a=0; a<n1; ++a) {
+            double* xi = _xi + long(a)*n2*nbins;
+            for (int b=0; b<n2; ++b) {
+                xi[b*nbins + k] += wk1[a] * wk2[b];
+                xi[b*nbins + k2] += wk2[a] * wk1[b];
+            }
+        }
+    } else if (is_auto) {
+        for (int a=0; a<n1; ++a) {
+            double* xi = _xi + long(a)*n2*nbins;
+            xi[a*nbins + k] += wk1[a] * wk2[a];
+            for (int b=a+1; b<n2; ++b)
+                xi[b*nbins + k] += wk1[a] * wk2[b] + wk1[b] * wk2[a];
+        }
+    } else {
+        for (int a=0; a<n1; ++a) {
+            double* xi = _xi + long(a)*n2*nbins + k;
+            for (int b=0; b<n2; ++b) xi[b*nbins] += wk1[a] * wk2[b];
+        }
+    }
+}
+
+template <int D1, int D2>
+MultiBinCorr2<D1,D2>::MultiBinCorr2(const std::vector<BinnedCorr2<D1,D2,Log>*>& log_corrs,
+                                    const std::vector<BinnedCorr2<D1,D2,Linear>*>& linear_corrs,
+                                    const std::vector<BinnedCorr2<D1,D2,TwoD>*>& twod_corrs) :
+    _log(log_corrs), _linear(linear_corrs), _twod(twod_corrs),
+    _halfminsep(std::numeric_limits<double>::max())
+{
+    const int n = _log.size() + _linear.size() + _twod.size();
+    Assert(n > 0);
+    Assert(n <= MAX_BINNINGS);
+    _all = (n == MAX_BINNINGS) ? ~Mask(0) : (Mask(1) << n) - 1;
+    for (size_t i=0; i<_log.size(); ++i)
+        _halfminsep = std::min(_halfminsep, _log[i]->_halfminsep);
+    for (size_t i=0; i<_linear.size(); ++i)
+        _halfminsep = std::min(_halfminsep, _linear[i]->_halfminsep);
+    for (size_t i=0; i<_twod.size(); ++i)
+        _halfminsep = std::min(_halfminsep, _twod[i]->_halfminsep);
+    // The metric parameters are the same for all of them, so use any of them.
+    if (!_log.empty()) {
+        _minrpar = _log[0]->_minrpar; _maxrpar = _log[0]->_maxrpar;
+        _xp = _log[0]->_xp; _yp = _log[0]->_yp; _zp = _log[0]->_zp;
+    } else if (!_linear.empty()) {
+        _minrpar = _linear[0]->_minrpar; _maxrpar = _linear[0]->_maxrpar;
+        _xp = _linear[0]->_xp; _yp = _linear[0]->_yp; _zp = _linear[0]->_zp;
+    } else {
+        _minrpar = _twod[0]->_minrpar; _maxrpar = _twod[0]->_maxrpar;
+        _xp = _twod[0]->_xp; _yp = _twod[0]->_yp; _zp = _twod[0]->_zp;
+    }
+}
+
+// Set up the per-thread copies of each of the correlations in one of the lists in
+// MultiBinCorr2.  The MultiThreadCorrs are created with new, since they own locks that
+// shouldn't be copied.
+template <int D1, int D2, int B>
+void MultiBinThreadCorrs(const std::vector<BinnedCorr2<D1,D2,B>*>& corrs,
+                         std::vector<MultiThreadCorrs<D1,D2,B>*>& thread_corrs)
+{
+    for (size_t i=0; i<corrs.size(); ++i)
+        thread_corrs.push_back(new MultiThreadCorrs<D1,D2,B>(corrs[i]));
+}
+
+template <int D1, int D2, int B>
+std::vector<BinnedCorr2<D1,D2,B>*> MultiBinStartThread(
+    std::vector<MultiThreadCorrs<D1,D2,B>*>& thread_corrs)
+{
+    std::vector<BinnedCorr2<D1,D2,B>*> corrs(thread_corrs.size());
+    for (size_t i=0; i<thread_corrs.size(); ++i) corrs[i] = thread_corrs[i]->start();
+    return corrs;
+}
+
+template <int D1, int D2, int B>
+void MultiBinFinishThread(std::vector<MultiThreadCorrs<D1,D2,B>*>& thread_corrs)
+{
+    for (size_t i=0; i<thread_corrs.size(); ++i) thread_corrs[i]->finish();
+}
+
+template <int D1, int D2, int B>
+void MultiBinDeleteThreadCorrs(std::vector<MultiThreadCorrs<D1,D2,B>*>& thread_corrs)
+{
+    for (size_t i=0; i<thread_corrs.size(); ++i) delete thread_corrs[i];
+}
+
+template <int D1, int D2> template <int C, int M, int P>
+void MultiBinCorr2<D1,D2>::process(const Field<D1,C>& field, bool dots)
+{
+    xdbg<<"Start MultiBinCorr2::process (auto): M,P,C = "<<M<<"  "<<P<<"  "<<C<<std::endl;
+    Assert(D1 == D2);
+    for (size_t i=0; i<_log.size(); ++i) _log[i]->_coords = C;
+    for (size_t i=0; i<_linear.size(); ++i) _linear[i]->_coords = C;
+    for (size_t i=0; i<_twod.size(); ++i) _twod[i]->_coords = C;
+    const long n1 = field.getNTopLevel();
+    dbg<<"field has "<<n1<<" top level nodes\n";
+    Assert(n1 > 0);
+
+#ifdef _OPENMP
+    std::vector<MultiThreadCorrs<D1,D2,Log>*> log_corrs;
+    std::vector<MultiThreadCorrs<D1,D2,Linear>*> linear_corrs;
+    std::vector<MultiThreadCorrs<D1,D2,TwoD>*> twod_corrs;
+    MultiBinThreadCorrs(_log, log_corrs);
+    MultiBinThreadCorrs(_linear, linear_corrs);
+    MultiBinThreadCorrs(_twod, twod_corrs);
+#pragma omp parallel
+    {
+        // Get this thread's copies of the data vectors to fill in.
+        std::vector<BinnedCorr2<D1,D2,Log>*> log = MultiBinStartThread(log_corrs);
+        std::vector<BinnedCorr2<D1,D2,Linear>*> linear = MultiBinStartThread(linear_corrs);
+        std::vector<BinnedCorr2<D1,D2,TwoD>*> twod = MultiBinStartThread(twod_corrs);
+        MultiBinCorr2<D1,D2> mbc2(log, linear, twod);
+#else
+        MultiBinCorr2<D1,D2>& mbc2 = *this;
+#endif
+
+        MetricHelper<M,P> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (long i=0;i<n1;++i) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            {
+                if (dots) std::cout<<'.'<<std::flush;
+            }
+            const Cell<D1,C>& c1 = *field.getCells()[i];
+            mbc2.template process2<C,M,P>(c1, metric);
+            for (long j=i+1;j<n1;++j) {
+                const Cell<D2,C>& c2 = *field.getCells()[j];
+                mbc2.template process11<C,M,P>(c1, c2, metric, true);
+            }
+        }
+#ifdef _OPENMP
+        // Accumulate the results
+        MultiBinFinishThread(log_corrs);
+        MultiBinFinishThread(linear_corrs);
+        MultiBinFinishThread(twod_corrs);
+    }
+    MultiBinDeleteThreadCorrs(log_corrs);
+    MultiBinDeleteThreadCorrs(linear_corrs);
+    MultiBinDeleteThreadCorrs(twod_corrs);
+#endif
+    if (dots) std::cout<<std::endl;
+}
+
+template <int D1, int D2> template <int C, int M, int P>
+void MultiBinCorr2<D1,D2>::process(const Field<D1,C>& field1, const Field<D2,C>& field2,
+                                   bool dots)
+{
+    xdbg<<"Start MultiBinCorr2::process (cross): M,P,C = "<<M<<"  "<<P<<"  "<<C<<std::endl;
+    for (size_t i=0; i<_log.size(); ++i) _log[i]->_coords = C;
+    for (size_t i=0; i<_linear.size(); ++i) _linear[i]->_coords = C;
+    for (size_t i=0; i<_twod.size(); ++i) _twod[i]->_coords = C;
     const long n1 = field1.getNTopLevel();
     const long n2 = field2.getNTopLevel();
     dbg<<"field1 has "<<n1<<" top level nodes\n";
@@ -634,369 +1615,2008 @@ long BinnedCorr2<D1,D2,B>::samplePairs(
     Assert(n1 > 0);
     Assert(n2 > 0);
 
-    MetricHelper<M,P> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+#ifdef _OPENMP
+    std::vector<MultiThreadCorrs<D1,D2,Log>*> log_corrs;
+    std::vector<MultiThreadCorrs<D1,D2,Linear>*> linear_corrs;
+    std::vector<MultiThreadCorrs<D1,D2,TwoD>*> twod_corrs;
+    MultiBinThreadCorrs(_log, log_corrs);
+    MultiBinThreadCorrs(_linear, linear_corrs);
+    MultiBinThreadCorrs(_twod, twod_corrs);
+#pragma omp parallel
+    {
+        // Get this thread's copies of the data vectors to fill in.
+        std::vector<BinnedCorr2<D1,D2,Log>*> log = MultiBinStartThread(log_corrs);
+        std::vector<BinnedCorr2<D1,D2,Linear>*> linear = MultiBinStartThread(linear_corrs);
+        std::vector<BinnedCorr2<D1,D2,TwoD>*> twod = MultiBinStartThread(twod_corrs);
+        MultiBinCorr2<D1,D2> mbc2(log, linear, twod);
+#else
+        MultiBinCorr2<D1,D2>& mbc2 = *this;
+#endif
 
-    double minsepsq = minsep*minsep;
-    double maxsepsq = maxsep*maxsep;
+        MetricHelper<M,P> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (long i=0;i<n1;++i) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            {
+                if (dots) std::cout<<'.'<<std::flush;
+            }
+            const Cell<D1,C>& c1 = *field1.getCells()[i];
+            for (long j=0;j<n2;++j) {
+                const Cell<D2,C>& c2 = *field2.getCells()[j];
+                mbc2.template process11<C,M,P>(c1, c2, metric, false);
+            }
+        }
+#ifdef _OPENMP
+        // Accumulate the results
+        MultiBinFinishThread(log_corrs);
+        MultiBinFinishThread(linear_corrs);
+        MultiBinFinishThread(twod_corrs);
+    }
+    MultiBinDeleteThreadCorrs(log_corrs);
+    MultiBinDeleteThreadCorrs(linear_corrs);
+    MultiBinDeleteThreadCorrs(twod_corrs);
+#endif
+    if (dots) std::cout<<std::endl;
+}
 
-    long k=0;
-    for (long i=0;i<n1;++i) {
-        const Cell<D1,C>& c1 = *field1.getCells()[i];
-        for (long j=0;j<n2;++j) {
-            const Cell<D2,C>& c2 = *field2.getCells()[j];
-            samplePairs(c1, c2, metric, minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
+template <int D1, int D2> template <int C, int M, int P>
+void MultiBinCorr2<D1,D2>::process2(const Cell<D1,C>& c12, const MetricHelper<M,P>& metric)
+{
+    // The same as BinnedCorr2::process2, but with all the binnings at once.
+    WorkStack<const Cell<D1,C>*> todo;
+    todo.push(&c12);
+    while (!todo.empty()) {
+        const Cell<D1,C>& c = *todo.pop();
+        if (c.getW() == 0.) continue;
+        if (c.getSize() <= _halfminsep) continue;
+
+        if (c.isBucket()) {
+            const Cell<D1,C>* leaves = c.getBucketLeaves();
+            const long n = c.getN();
+            for (long i=0; i<n; ++i)
+                for (long j=i+1; j<n; ++j)
+                    process11<C,M,P>(leaves[i], leaves[j], metric, true);
+            continue;
+        }
+
+        Assert(c.getLeft());
+        Assert(c.getRight());
+        todo.push(c.getRight());
+        todo.push(c.getLeft());
+        process11<C,M,P>(*c.getLeft(), *c.getRight(), metric, true);
+    }
+}
+
+template <int D1, int D2> template <int B, int C, int M, int P>
+void MultiBinCorr2<D1,D2>::classify(
+    const std::vector<BinnedCorr2<D1,D2,B>*>& corrs, int offset, Mask mask,
+    const Cell<D1,C>& c1, const Cell<D2,C>& c2, const Position<C>& p1, const Position<C>& p2,
+    double s1, double s2, double rsq, const MetricHelper<M,P>& metric,
+    bool is_auto, Mask* split)
+{
+    const bool do_reverse = is_auto && BinTypeHelper<B>::doReverse();
+    for (size_t i=0; i<corrs.size(); ++i) {
+        const Mask bit = Mask(1) << (offset + i);
+        if (!(mask & bit)) continue;
+        int k=-1;
+        double r=0,logr=0;
+        bool split1=false, split2=false;
+        // The trees are fine enough for the binning with the smallest min_size, so the cells
+        // that would be leaves in the tree of this binning need to be treated as points.
+        // As in BinnedCorr2::classifyPair, this uses the raw sizes, before DistSq adjusts them.
+        // DistSq only ever rescales a size (leaving 0 as 0) and rsq doesn't depend on the
+        // sizes, so clamping the raw size first is the same as using 0 in place of s1 or s2.
+        const double s1i = c1.getSize() <= corrs[i]->_minsize ? 0. : s1;
+        const double s2i = c2.getSize() <= corrs[i]->_minsize ? 0. : s2;
+        switch (corrs[i]->classifyPairDistSq(p1, p2, s1i, s2i, metric, rsq, k, r, logr,
+                                             split1, split2)) {
+          case SkipPair:
+               break;
+          case DirectPair:
+               corrs[i]->directProcess11(c1,c2,rsq,do_reverse,k,r,logr);
+               break;
+          case SplitPair:
+               split[split1 ? (split2 ? 2 : 0) : 1] |= bit;
         }
     }
-    return k;
 }
 
-template <int D1, int D2, int B> template <int M, int P, int C>
-void BinnedCorr2<D1,D2,B>::samplePairs(
-    const Cell<D1, C>& c1, const Cell<D2, C>& c2, const MetricHelper<M,P>& metric,
-    double minsep, double minsepsq, double maxsep, double maxsepsq,
-    long* i1, long* i2, double* sep, int n, long& k)
+template <int D1, int D2> template <int B, int C, int M, int P>
+void MultiBinCorr2<D1,D2>::processBucket(
+    const std::vector<BinnedCorr2<D1,D2,B>*>& corrs, int offset, Mask mask,
+    const Cell<D1,C>& c1, const Cell<D2,C>& c2, bool split1, bool split2,
+    const MetricHelper<M,P>& metric, bool is_auto)
+{
+    const bool do_reverse = is_auto && BinTypeHelper<B>::doReverse();
+    for (size_t i=0; i<corrs.size(); ++i) {
+        if (mask & (Mask(1) << (offset + i)))
+            corrs[i]->template processBucket<C,M,P>(c1,c2,split1,split2,metric,do_reverse);
+    }
+}
+
+template <int D1, int D2> template <int C, int M, int P>
+void MultiBinCorr2<D1,D2>::processBucket(const Cell<D1,C>& c1, const Cell<D2,C>& c2,
+                                         bool split1, bool split2, Mask mask,
+                                         const MetricHelper<M,P>& metric, bool is_auto)
+{
+    const int nlog = _log.size();
+    const int nlin = _linear.size();
+    processBucket(_log, 0, mask, c1, c2, split1, split2, metric, is_auto);
+    processBucket(_linear, nlog, mask, c1, c2, split1, split2, metric, is_auto);
+    processBucket(_twod, nlog+nlin, mask, c1, c2, split1, split2, metric, is_auto);
+}
+
+// Push the sub-pairs of a pair of cells onto the stack in MultiBinCorr2::process11 with
+// the given mask.
+template <int D1, int D2, int C, class MaskedPair, class Mask>
+inline void PushMaskedSplit(WorkStack<MaskedPair>& todo, const Cell<D1,C>& c1,
+                            const Cell<D2,C>& c2, bool split1, bool split2, Mask mask)
+{
+    typedef WorkPair<const Cell<D1,C>*, const Cell<D2,C>*> CellPair;
+    if (split1 && split2) {
+        todo.push(MaskedPair(CellPair(c1.getRight(), c2.getRight()), mask));
+        todo.push(MaskedPair(CellPair(c1.getRight(), c2.getLeft()), mask));
+        todo.push(MaskedPair(CellPair(c1.getLeft(), c2.getRight()), mask));
+        todo.push(MaskedPair(CellPair(c1.getLeft(), c2.getLeft()), mask));
+    } else if (split1) {
+        todo.push(MaskedPair(CellPair(c1.getRight(), &c2), mask));
+        todo.push(MaskedPair(CellPair(c1.getLeft(), &c2), mask));
+    } else {
+        todo.push(MaskedPair(CellPair(&c1, c2.getRight()), mask));
+        todo.push(MaskedPair(CellPair(&c1, c2.getLeft()), mask));
+    }
+}
+
+template <int D1, int D2> template <int C, int M, int P>
+void MultiBinCorr2<D1,D2>::process11(const Cell<D1,C>& c1, const Cell<D2,C>& c2,
+                                     const MetricHelper<M,P>& metric, bool is_auto)
+{
+    // This is the same traversal as BinnedCorr2::process11, but each pair of cells on the
+    // stack also has the mask of the binnings that still need it.  Each binning drops out of
+    // the mask as soon as it accumulates or skips the pair.  The rest are grouped by which
+    // cells they want to split, so each binning sees exactly the same pairs of cells as it
+    // would on its own, starting from the same top-level cells.  But the distances are only
+    // calculated once for all of them, and most of the time they all agree on what to split,
+    // so they share the rest of the walk.
+    const int nlog = _log.size();
+    const int nlin = _linear.size();
+    typedef WorkPair<WorkPair<const Cell<D1,C>*, const Cell<D2,C>*>, Mask> MaskedPair;
+    WorkStack<MaskedPair> todo;
+    todo.push(MaskedPair(WorkPair<const Cell<D1,C>*, const Cell<D2,C>*>(&c1, &c2), _all));
+    while (!todo.empty()) {
+        const MaskedPair next = todo.pop();
+        const Cell<D1,C>& a = *next.first.first;
+        const Cell<D2,C>& b = *next.first.second;
+        Mask mask = next.second;
+        xdbg<<"multibin process11 for "<<a.getPos()<<",  "<<b.getPos()<<"   ";
+        xdbg<<"mask = "<<mask<<std::endl;
+        if (a.getW() == 0. || b.getW() == 0.) continue;
+
+        // The distance is the same for all of them, so only calculate it once.
+        const Position<C> p1 = a.getPos();
+        const Position<C> p2 = b.getPos();
+        // s1, s2 may be modified by DistSq function.  classify clamps the raw sizes from a and b
+        // for each binning.
+        double s1 = a.getSize();
+        double s2 = b.getSize();
+        const double rsq = metric.DistSq(p1, p2, s1, s2);
+        // The binnings that want to split c1 only, c2 only, or both.
+        Mask split[3] = { 0, 0, 0 };
+        classify(_log, 0, mask, a, b, p1, p2, s1, s2, rsq, metric, is_auto, split);
+        classify(_linear, nlog, mask, a, b, p1, p2, s1, s2, rsq, metric, is_auto, split);
+        classify(_twod, nlog+nlin, mask, a, b, p1, p2, s1, s2, rsq, metric, is_auto, split);
+
+        // As in BinnedCorr2::process11, if only one of the cells to split is a bucket, split
+        // the other one first.  Once both are buckets, each binning loops over the leaves.
+        if (split[2] && (a.isBucket() || b.isBucket())) {
+            if (!a.isBucket()) split[0] |= split[2];
+            else if (!b.isBucket()) split[1] |= split[2];
+            else processBucket(a, b, true, true, split[2], metric, is_auto);
+            split[2] = 0;
+        }
+        if (split[0] && a.isBucket()) {
+            processBucket(a, b, true, false, split[0], metric, is_auto);
+            split[0] = 0;
+        }
+        if (split[1] && b.isBucket()) {
+            processBucket(a, b, false, true, split[1], metric, is_auto);
+            split[1] = 0;
+        }
+
+        if (split[0]) PushMaskedSplit(todo, a, b, true, false, split[0]);
+        if (split[1]) PushMaskedSplit(todo, a, b, false, true, split[1]);
+        if (split[2]) PushMaskedSplit(todo, a, b, true, true, split[2]);
+    }
+}
+
+// We also set up a helper class for doing the direct processing
+template <int D1, int D2>
+struct DirectHelper;
+
+template <>
+struct DirectHelper<NData,NData>
+{
+    template <int C>
+    static void CalcXi(const Cell<NData,C>& , const Cell<NData,C>& , const double , double* )
+    {}
+};
+
+template <>
+struct DirectHelper<NData,KData>
+{
+    template <int C>
+    static void CalcXi(
+        const Cell<NData,C>& c1, const Cell<KData,C>& c2, const double , double* xi)
+    { xi[0] = c1.getW() * c2.getData().getWK(); }
+};
+
+template <>
+struct DirectHelper<NData,GData>
+{
+    template <int C>
+    static void CalcXi(
+        const Cell<NData,C>& c1, const Cell<GData,C>& c2, const double rsq, double* xi)
+    {
+        std::complex<double> g2;
+        ProjectHelper<C>::ProjectShear(c1,c2,g2);
+        // The minus sign here is to make it accumulate tangential shear, rather than radial.
+        // g2 from the above ProjectShear is measured along the connecting line, not tangent.
+        g2 *= -c1.getW();
+        xi[0] = real(g2);
+        xi[1] = imag(g2);
+    }
+};
+
+template <>
+struct DirectHelper<KData,KData>
+{
+    template <int C>
+    static void CalcXi(
+        const Cell<KData,C>& c1, const Cell<KData,C>& c2, const double , double* xi)
+    { xi[0] = c1.getData().getWK() * c2.getData().getWK(); }
+};
+
+template <>
+struct DirectHelper<KData,GData>
+{
+    template <int C>
+    static void CalcXi(
+        const Cell<KData,C>& c1, const Cell<GData,C>& c2, const double rsq, double* xi)
+    {
+        std::complex<double> g2;
+        ProjectHelper<C>::ProjectShear(c1,c2,g2);
+        // The minus sign here is to make it accumulate tangential shear, rather than radial.
+        // g2 from the above ProjectShear is measured along the connecting line, not tangent.
+        g2 *= -c1.getData().getWK();
+        xi[0] = real(g2);
+        xi[1] = imag(g2);
+    }
+};
+
+template <>
+struct DirectHelper<GData,GData>
+{
+    template <int C>
+    static void CalcXi(
+        const Cell<GData,C>& c1, const Cell<GData,C>& c2, const double rsq, double* xi)
+    {
+        std::complex<double> g1, g2;
+        ProjectHelper<C>::ProjectShears(c1,c2,g1,g2);
+
+        // The complex products g1 g2 and g1 g2* share most of the calculations,
+        // so faster to do this manually.
+        double g1rg2r = g1.real() * g2.real();
+        double g1rg2i = g1.real() * g2.imag();
+        double g1ig2r = g1.imag() * g2.real();
+        double g1ig2i = g1.imag() * g2.imag();
+
+        xi[0] = g1rg2r + g1ig2i;       // g1 * conj(g2)
+        xi[1] = g1ig2r - g1rg2i;
+        xi[2] = g1rg2r - g1ig2i;       // g1 * g2
+        xi[3] = g1ig2r + g1rg2i;
+    }
+};
+
+template <int D1, int D2, int B> template <int C>
+void BinnedCorr2<D1,D2,B>::directProcess11(
+    const Cell<D1,C>& c1, const Cell<D2,C>& c2, const double rsq, bool do_reverse,
+    int k, double r, double logr)
+{
+    xdbg<<"DirectProcess11: rsq = "<<rsq<<std::endl;
+    XAssert(rsq >= _minsepsq);
+    XAssert(rsq < _fullmaxsepsq);
+    // Note that most of these XAsserts around are still hardcoded for Log binning and Euclidean
+    // metric.  If turning on verbose>=3, these could fail.
+    // Cells below _minsize count as leaves.  (cf. classifyPair)
+    XAssert((c1.getSize() <= _minsize ? 0. : c1.getSize()) +
+            (c2.getSize() <= _minsize ? 0. : c2.getSize()) < sqrt(rsq)*_b + 0.0001);
+
+    XAssert(_binsize != 0.);
+    const Position<C>& p1 = c1.getPos();
+    const Position<C>& p2 = c2.getPos();
+    if (k < 0) {
+        r = sqrt(rsq);
+        logr = log(r);
+        Assert(logr >= _logminsep);
+        k = BinTypeHelper<B>::calculateBinK(p1, p2, r, logr, _binsize,
+                                            _minsep, _maxsep, _logminsep, _edges);
+    } else {
+        XAssert(std::abs(r - sqrt(rsq)) < 1.e-10*r);
+        XAssert(std::abs(logr - 0.5*log(rsq)) < 1.e-10);
+        XAssert(k == BinTypeHelper<B>::calculateBinK(p1, p2, r, logr, _binsize,
+                                                     _minsep, _maxsep, _logminsep, _edges));
+    }
+    Assert(k >= 0);
+    Assert(k <= _nbins);
+    // It's possible for k to be == _nbins here if the r is very close to the top of the
+    // last bin, but numerical rounding in the log calculation bumped k into the next
+    // (non-existent) bin.
+    if (k == _nbins) {
+        XAssert(BinTypeHelper<B>::calculateBinK(p2, p1, r, logr-1.e-10, _binsize,
+                                                _minsep, _maxsep, _logminsep, _edges) == _nbins-1);
+        --k;
+    }
+    Assert(k < _nbins);
+    xdbg<<"r,logr,k = "<<r<<','<<logr<<','<<k<<std::endl;
+
+    if (_record) {
+#ifdef _OPENMP
+        const int tid = omp_get_thread_num();
+#else
+        const int tid = 0;
+#endif
+        (*_record)[tid].push_back(RecordedPair(&c1,&c2,k,rsq));
+    }
+
+    int k2 = -1;
+    if (do_reverse) {
+        k2 = BinTypeHelper<B>::calculateBinK(p2, p1, r, logr, _binsize,
+                                             _minsep, _maxsep, _logminsep, _edges);
+        if (k == _nbins) --k;  // As before, this can (rarely) happen.
+        Assert(k2 >= 0);
+        Assert(k2 < _nbins);
+    }
+
+#ifdef _OPENMP
+    // If other threads are using this accumulator too, lock the bins we're about to update.
+    if (_locks) _locks->lock(k,k2);
+#endif
+
+    double v[NVALUES];
+    double ww = double(c1.getW()) * double(c2.getW());
+    v[0] = ww * r;
+    v[1] = ww * logr;
+    v[2] = ww;
+    v[3] = double(c1.getN()) * double(c2.getN());
+    xdbg<<"n,w = "<<v[3]<<','<<ww<<std::endl;
+    DirectHelper<D1,D2>::template CalcXi<C>(c1,c2,rsq,v+4);
+
+    addToBin(k, v);
+    if (k2 != -1) addToBin(k2, v);
+
+#ifdef _OPENMP
+    if (_locks) _locks->unlock(k,k2);
+#endif
+}
+
+template <int D1, int D2, int B>
+inline void BinnedCorr2<D1,D2,B>::addToBin(int k, const double* v)
+{
+    if (_faccum) {
+        _faccum->add(k, v);
+    } else {
+        _meanr[k] += v[0];
+        _meanlogr[k] += v[1];
+        _weight[k] += v[2];
+        _npairs[k] += v[3];
+        _xi.addBin(k, v+4);
+    }
+}
+
+template <int D1, int D2, int B> template <int C>
+void BinnedCorr2<D1,D2,B>::directProcessBatch(DirectBatch<D1,D2,C>& batch, bool do_reverse)
+{
+    const long n = batch.n;
+    double r[DirectBatch<D1,D2,C>::N];
+    double logr[DirectBatch<D1,D2,C>::N];
+    SqrtLogBlock(batch.rsq, r, logr, n);
+    for (long i=0; i<n; ++i) {
+        const Cell<D1,C>& c1 = *batch.c1[i];
+        const Cell<D2,C>& c2 = *batch.c2[i];
+        int k = BinTypeHelper<B>::calculateBinK(c1.getPos(), c2.getPos(), r[i], logr[i],
+                                                _binsize, _minsep, _maxsep, _logminsep, _edges);
+        directProcess11(c1,c2,batch.rsq[i],do_reverse,k,r[i],logr[i]);
+    }
+    batch.n = 0;
+}
+
+template <int D1, int D2, int B>
+void BinnedCorr2<D1,D2,B>::startRecord()
+{
+#ifdef _OPENMP
+    const int nthreads = omp_get_max_threads();
+#else
+    const int nthreads = 1;
+#endif
+    delete _record;
+    _record = new std::vector<std::vector<RecordedPair> >(nthreads);
+}
+
+template <int D1, int D2, int B> template <int C>
+InteractionList* BinnedCorr2<D1,D2,B>::finishRecord(
+    const Field<D1,C>& field1, const Field<D2,C>& field2, bool is_auto, int metric)
+{
+    Assert(_record);
+    std::vector<const Cell<D1,C>*> cells1;
+    std::vector<const Cell<D2,C>*> cells2;
+    ListCells(field1.getCells(), cells1);
+    ListCells(field2.getCells(), cells2);
+    dbg<<"finishRecord: ncells = "<<cells1.size()<<", "<<cells2.size()<<std::endl;
+    // InteractionList stores the indices as 32 bit unsigned ints.
+    Assert(cells1.size() <= 0xffffffffUL);
+    Assert(cells2.size() <= 0xffffffffUL);
+    std::unordered_map<const void*, long> index1(2*cells1.size());
+    std::unordered_map<const void*, long> index2(2*cells2.size());
+    for (size_t i=0; i<cells1.size(); ++i) index1[cells1[i]] = long(i);
+    for (size_t i=0; i<cells2.size(); ++i) index2[cells2[i]] = long(i);
+
+    InteractionList* list = new InteractionList(
+        D1, D2, B, _nbins, C, _minsep, _maxsep, _b, metric,
+        is_auto && BinTypeHelper<B>::doReverse(),
+        long(cells1.size()), long(cells2.size()), HashCells(cells1), HashCells(cells2));
+    long n = 0;
+    for (size_t t=0; t<_record->size(); ++t) n += long((*_record)[t].size());
+    dbg<<"Recorded "<<n<<" pairs\n";
+    list->reserve(n);
+    for (size_t t=0; t<_record->size(); ++t) {
+        std::vector<RecordedPair>& pairs = (*_record)[t];
+        for (size_t i=0; i<pairs.size(); ++i) {
+            Assert(index1.count(pairs[i].c1));
+            Assert(index2.count(pairs[i].c2));
+            list->add(index1[pairs[i].c1], index2[pairs[i].c2], pairs[i].k, pairs[i].rsq);
+        }
+        // Release each thread's pairs as we go, so we don't need the memory for both at once.
+        std::vector<RecordedPair>().swap(pairs);
+    }
+    delete _record;
+    _record = 0;
+    return list;
+}
+
+template <int D1, int D2, int B> template <int C>
+bool BinnedCorr2<D1,D2,B>::replay(const InteractionList& list,
+                                  const Field<D1,C>& field1, const Field<D2,C>& field2,
+                                  int metric)
+{
+    Assert(_coords == -1 || _coords == C);
+    std::vector<const Cell<D1,C>*> cells1;
+    std::vector<const Cell<D2,C>*> cells2;
+    ListCells(field1.getCells(), cells1);
+    ListCells(field2.getCells(), cells2);
+    if (!list.matches(D1, D2, B, _nbins, C, _minsep, _maxsep, _b, metric,
+                      long(cells1.size()), long(cells2.size()),
+                      HashCells(cells1), HashCells(cells2))) {
+        dbg<<"InteractionList doesn't match these fields\n";
+        return false;
+    }
+    _coords = C;
+    const long n = list.size();
+    const bool do_reverse = list.doReverse();
+    dbg<<"Replay "<<n<<" pairs\n";
+
+#ifdef _OPENMP
+    // Each pair is a small amount of work, so there is no need for tasks here.
+    std::vector<BinnedCorr2<D1,D2,B>*> thread_corrs(omp_get_max_threads(), 0);
+    const int ncopies = getNCopies(thread_corrs.size());
+    std::vector<StripeLocks> locks(ncopies < int(thread_corrs.size()) ? ncopies : 0);
+#pragma omp parallel
+    {
+        BinnedCorr2<D1,D2,B>& bc2 = *startThread(thread_corrs, locks.empty() ? 0 : &locks[0],
+                                                 ncopies, std::numeric_limits<double>::max());
+#else
+        BinnedCorr2<D1,D2,B>& bc2 = *this;
+#endif
+
+        // The list is in the order of the original traversal, so contiguous ranges of it
+        // mostly use nearby cells.
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (long i=0; i<n; ++i) {
+            const double rsq = list.getRSq(i);
+            const double r = sqrt(rsq);
+            bc2.directProcess11(*cells1[list.getI1(i)], *cells2[list.getI2(i)], rsq,
+                                do_reverse, list.getK(i), r, std::log(r));
+        }
+#ifdef _OPENMP
+        finishThread(thread_corrs, ncopies);
+    }
+#endif
+    return true;
+}
+
+template <int D1, int D2, int B>
+void BinnedCorr2<D1,D2,B>::operator=(const BinnedCorr2<D1,D2,B>& rhs)
+{
+    Assert(rhs._nbins == _nbins);
+    _xi.copy(rhs._xi,_nbins);
+    for (int i=0; i<_nbins; ++i) _meanr[i] = rhs._meanr[i];
+    for (int i=0; i<_nbins; ++i) _meanlogr[i] = rhs._meanlogr[i];
+    for (int i=0; i<_nbins; ++i) _weight[i] = rhs._weight[i];
+    for (int i=0; i<_nbins; ++i) _npairs[i] = rhs._npairs[i];
+    _stats = rhs._stats;
+}
+
+template <int D1, int D2, int B>
+void BinnedCorr2<D1,D2,B>::operator+=(const BinnedCorr2<D1,D2,B>& rhs)
+{
+    addRange(rhs, 0, _nbins);
+    _stats += rhs._stats;
+}
+
+template <int D1, int D2, int B>
+void BinnedCorr2<D1,D2,B>::addRange(const BinnedCorr2<D1,D2,B>& rhs, int i1, int i2)
+{
+    Assert(rhs._nbins == _nbins);
+    _xi.add(rhs._xi,i1,i2);
+    for (int i=i1; i<i2; ++i) _meanr[i] += rhs._meanr[i];
+    for (int i=i1; i<i2; ++i) _meanlogr[i] += rhs._meanlogr[i];
+    for (int i=i1; i<i2; ++i) _weight[i] += rhs._weight[i];
+    for (int i=i1; i<i2; ++i) _npairs[i] += rhs._npairs[i];
+}
+
+template <int D1, int D2, int B> template <int M, int C>
+bool BinnedCorr2<D1,D2,B>::triviallyZero(Position<C> p1, Position<C> p2, double s1, double s2)
+{
+    // Ignore any min/max rpar for this calculation.
+    double minrpar = -std::numeric_limits<double>::max();
+    double maxrpar = std::numeric_limits<double>::max();
+    MetricHelper<M,0> metric(minrpar, maxrpar, _xp, _yp, _zp);
+    const double rsq = metric.DistSq(p1, p2, s1, s2);
+    double s1ps2 = s1 + s2;
+    double rpar = 0;
+    return (BinTypeHelper<B>::tooLargeDist(rsq, s1ps2, _maxsep, _maxsepsq) &&
+            metric.tooLargeDist(p1, p2, rsq, rpar, s1ps2, _fullmaxsep, _fullmaxsepsq));
+}
+
+// Choose ns distinct values uniformly from 0..ntot-1 and put them in sel, sorted.
+// This draws with replacement and removes the duplicates, then draws again for however many
+// were duplicates, until there are ns.  Every step is symmetric in the possible values, so
+// every subset of ns values is equally likely.  Each chunk of values has its own random
+// number stream, seeded from seed, the round and the chunk number, so the draws are done in
+// parallel, but the result doesn't depend on the number of threads.  ns should be at most
+// ntot/2, so that each round is at least half new values.
+void SelectSortedRandomFrom(long ntot, long ns, unsigned long long seed, std::vector<long>& sel)
+{
+    const long chunk_size = 1L << 16;
+    // Values v go to bucket v * nbuckets / ntot, so duplicates are in the same bucket,
+    // and each bucket can be sorted separately.
+    const long nbuckets = std::max(1L, std::min(ns / 1024, 4096L));
+    sel.clear();
+    sel.reserve(ns);
+    for (int round=0; long(sel.size()) < ns; ++round) {
+        const long n0 = sel.size();
+        const long need = ns - n0;
+        sel.resize(ns);
+        const long nchunks = (need + chunk_size - 1) / chunk_size;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (long c=0; c<nchunks; ++c) {
+            // seed_seq only uses the low 32 bits of each value, so split the seed in two.
+            std::seed_seq seq = { seed & 0xffffffffULL, seed >> 32,
+                                  (unsigned long long)(round), (unsigned long long)(c) };
+            std::mt19937_64 rng(seq);
+            std::uniform_int_distribution<long> dist(0, ntot-1);
+            const long end = std::min(need, (c+1)*chunk_size);
+            for (long i=c*chunk_size; i<end; ++i) sel[n0+i] = dist(rng);
+        }
+
+        if (n0 == 0) {
+            // Sort and remove duplicates, one bucket at a time.
+            std::vector<long> bstart(nbuckets+1, 0);
+            const double bscale = double(nbuckets) / double(ntot);
+            for (long i=0; i<ns; ++i)
+                ++bstart[std::min(long(sel[i] * bscale), nbuckets-1) + 1];
+            for (long b=0; b<nbuckets; ++b) bstart[b+1] += bstart[b];
+            std::vector<long> tmp(ns);
+            std::vector<long> next(bstart.begin(), bstart.end()-1);
+            for (long i=0; i<ns; ++i)
+                tmp[next[std::min(long(sel[i] * bscale), nbuckets-1)]++] = sel[i];
+            std::vector<long> bsize(nbuckets);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+            for (long b=0; b<nbuckets; ++b) {
+                std::sort(tmp.begin()+bstart[b], tmp.begin()+bstart[b+1]);
+                bsize[b] = std::unique(tmp.begin()+bstart[b], tmp.begin()+bstart[b+1]) -
+                    (tmp.begin()+bstart[b]);
+            }
+            sel.clear();
+            for (long b=0; b<nbuckets; ++b)
+                sel.insert(sel.end(), tmp.begin()+bstart[b], tmp.begin()+bstart[b]+bsize[b]);
+        } else {
+            // Later rounds are much smaller, so just sort the new ones and merge them in.
+            std::sort(sel.begin()+n0, sel.end());
+            std::inplace_merge(sel.begin(), sel.begin()+n0, sel.end());
+            sel.erase(std::unique(sel.begin(), sel.end()), sel.end());
+        }
+        dbg<<"SelectSortedRandomFrom round "<<round<<": "<<sel.size()<<" of "<<ns<<std::endl;
+    }
+}
+
+// Append the indices of the objects in a Cell to index, in the order of getAllLeaves.
+template <int D, int C>
+void GetCellIndices(const Cell<D,C>& cell, std::vector<long>& index)
+{
+    if (cell.getLeft()) {
+        GetCellIndices(*cell.getLeft(), index);
+        GetCellIndices(*cell.getRight(), index);
+    } else if (cell.getN() == 1) {
+        index.push_back(cell.getInfo().index);
+    } else {
+        const long* indices = cell.getListInfo().indices;
+        index.insert(index.end(), indices, indices + cell.getN());
+    }
+}
+
+template <int D1, int D2, int B> template <int M, int P, int C>
+long BinnedCorr2<D1,D2,B>::samplePairs(
+    const Field<D1, C>& field1, const Field<D2, C>& field2,
+    double minsep, double maxsep, long* i1, long* i2, double* sep, int n)
+{
+    Assert(_coords == -1 || _coords == C);
+    _coords = C;
+    const long n1 = field1.getNTopLevel();
+    const long n2 = field2.getNTopLevel();
+    dbg<<"field1 has "<<n1<<" top level nodes\n";
+    dbg<<"field2 has "<<n2<<" top level nodes\n";
+    Assert(n1 > 0);
+    Assert(n2 > 0);
+
+    double minsepsq = minsep*minsep;
+    double maxsepsq = maxsep*maxsep;
+
+    // First find all the pairs of cells that are entirely in the range, in parallel over
+    // the top-level cells in field1.  Each one keeps its own list, so the final order doesn't
+    // depend on the threads.
+    const std::vector<Cell<D1,C>*>& cells1 = field1.getCells();
+    const std::vector<Cell<D2,C>*>& cells2 = field2.getCells();
+    std::vector<std::vector<SampleCellPair<D1,D2,C> > > task_pairs(n1);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        // Inside the omp parallel, so each thread has its own MetricHelper.
+        MetricHelper<M,P> metric(_minrpar, _maxrpar, _xp, _yp, _zp);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (long i=0; i<n1; ++i) {
+            samplePairs(*cells1[i], cells2, metric, minsep, minsepsq, maxsep, maxsepsq,
+                        task_pairs[i]);
+        }
+    }
+    long npairs = 0;
+    for (long t=0; t<n1; ++t) npairs += task_pairs[t].size();
+    std::vector<SampleCellPair<D1,D2,C> > pairs;
+    pairs.reserve(npairs);
+    for (long t=0; t<n1; ++t) {
+        pairs.insert(pairs.end(), task_pairs[t].begin(), task_pairs[t].end());
+        std::vector<SampleCellPair<D1,D2,C> >().swap(task_pairs[t]);
+    }
+
+    // Number all the object pairs, so pair j of cell pair p has the number pstart[p] + j.
+    std::vector<long> pstart(npairs+1, 0);
+    for (long p=0; p<npairs; ++p)
+        pstart[p+1] = pstart[p] + pairs[p].n;
+    const long ntot = pstart[npairs];
+    dbg<<"Found "<<npairs<<" cell pairs with "<<ntot<<" pairs of objects\n";
+
+    // Select which of these to use.  For n > ntot/2, select the ones not to use instead.
+    std::vector<long> sel;
+    if (ntot <= n) {
+        sel.resize(ntot);
+        for (long i=0; i<ntot; ++i) sel[i] = i;
+    } else {
+        unsigned long long seed = (unsigned long long)(urand() * 2147483648.) << 31;
+        seed += (unsigned long long)(urand() * 2147483648.);
+        if (n <= ntot/2) {
+            SelectSortedRandomFrom(ntot, n, seed, sel);
+        } else {
+            std::vector<long> skip;
+            SelectSortedRandomFrom(ntot, ntot-n, seed, skip);
+            sel.reserve(n);
+            long j = 0;
+            for (long i=0; i<ntot; ++i) {
+                if (j < long(skip.size()) && skip[j] == i) ++j;
+                else sel.push_back(i);
+            }
+        }
+    }
+    const long ns = sel.size();
+    Assert(ns == std::min(ntot, long(n)));
+
+    // Find the range of sel in each cell pair.
+    std::vector<long> sstart(npairs+1, 0);
+    for (long p=0, i=0; p<npairs; ++p) {
+        while (i < ns && sel[i] < pstart[p+1]) ++i;
+        sstart[p+1] = i;
+    }
+
+    // Finally fill in the selected pairs, in parallel over the cell pairs.
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        std::vector<long> index1, index2;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,64)
+#endif
+        for (long p=0; p<npairs; ++p) {
+            if (sstart[p] == sstart[p+1]) continue;
+            index1.clear();
+            index2.clear();
+            GetCellIndices(*pairs[p].c1, index1);
+            GetCellIndices(*pairs[p].c2, index2);
+            const long nn2 = index2.size();
+            for (long i=sstart[p]; i<sstart[p+1]; ++i) {
+                long j = sel[i] - pstart[p];
+                i1[i] = index1[j / nn2];
+                i2[i] = index2[j % nn2];
+                sep[i] = pairs[p].r;
+            }
+        }
+    }
+    return ntot;
+}
+
+template <int D1, int D2, int B> template <int M, int P, int C>
+void BinnedCorr2<D1,D2,B>::samplePairs(
+    const Cell<D1, C>& c1, const std::vector<Cell<D2, C>*>& cells2,
+    const MetricHelper<M,P>& metric,
+    double minsep, double minsepsq, double maxsep, double maxsepsq,
+    std::vector<SampleCellPair<D1,D2,C> >& pairs)
+{
+    // This tracks process11 for c1 with each of the top-level cells in cells2, but rather than
+    // call directProcess11, we just collect the pairs of cells that are entirely in the range.
+    // Start with all of them on the stack (in reverse, so they come off in order), which is
+    // much faster than a separate traversal for each one when most of them are too far apart.
+    typedef WorkPair<const Cell<D1,C>*, const Cell<D2,C>*> CellPair;
+    WorkStack<CellPair> todo;
+    for (long j=cells2.size()-1; j>=0; --j) todo.push(CellPair(&c1, cells2[j]));
+    while (!todo.empty()) {
+        const CellPair next = todo.pop();
+        const Cell<D1,C>& a = *next.first;
+        const Cell<D2,C>& b = *next.second;
+        xdbg<<"samplePairs for "<<a.getPos()<<",  "<<b.getPos()<<"   ";
+        xdbg<<"w = "<<a.getW()<<", "<<b.getW()<<std::endl;
+        if (a.getW() == 0. || b.getW() == 0.) continue;
+
+        const Position<C>& p1 = a.getPos();
+        const Position<C>& p2 = b.getPos();
+        double s1 = a.getSize() <= _minsize ? 0. : a.getSize(); // May be modified by DistSq.
+        double s2 = b.getSize() <= _minsize ? 0. : b.getSize(); // "
+        xdbg<<"s1,s2 = "<<s1<<','<<s2<<std::endl;
+        xdbg<<"M,C = "<<M<<"  "<<C<<std::endl;
+        const double rsq = metric.DistSq(p1, p2, s1, s2);
+        xdbg<<"rsq = "<<rsq<<std::endl;
+        xdbg<<"s1,s2 => "<<s1<<','<<s2<<std::endl;
+        const double s1ps2 = s1+s2;
+
+        double rpar = 0; // Gets set to correct value by this function if appropriate
+        if (metric.isRParOutsideRange(p1, p2, s1ps2, rpar)) {
+            continue;
+        }
+        xdbg<<"RPar in range\n";
+
+        if (BinTypeHelper<B>::tooSmallDist(rsq, s1ps2, minsep, minsepsq) &&
+            metric.tooSmallDist(p1, p2, rsq, rpar, s1ps2, minsep, minsepsq)) {
+            continue;
+        }
+        xdbg<<"Not too small separation\n";
+
+        if (BinTypeHelper<B>::tooLargeDist(rsq, s1ps2, maxsep, maxsepsq) &&
+            metric.tooLargeDist(p1, p2, rsq, rpar, s1ps2, maxsep, maxsepsq)) {
+            continue;
+        }
+        xdbg<<"Not too large separation\n";
+
+        // Now check if these cells are small enough that it is ok to drop into a single bin.
+        int kk=-1;
+        double r=0,logr=0;  // If singleBin is true, these values are set.
+        const double bb = getPairB(rsq, s1ps2);
+        if (metric.isRParInsideRange(p1, p2, s1ps2, rpar) &&
+            BinTypeHelper<B>::singleBin(rsq, s1ps2, p1, p2, _binsize, bb, bb*bb,
+                                        _minsep, _maxsep, _logminsep, _edges, kk, r, logr))
+        {
+            xdbg<<"Drop into single bin.\n";
+            xdbg<<"rsq = "<<rsq<<std::endl;
+            xdbg<<"minsepsq = "<<minsepsq<<std::endl;
+            xdbg<<"maxsepsq = "<<maxsepsq<<std::endl;
+            if (BinTypeHelper<B>::isRSqInRange(rsq, p1, p2, minsep, minsepsq,
+                                               maxsep, maxsepsq)) {
+                SampleCellPair<D1,D2,C> pair;
+                pair.c1 = &a;
+                pair.c2 = &b;
+                pair.r = r == 0. ? sqrt(rsq) : r;
+                pair.n = a.getN() * b.getN();
+                pairs.push_back(pair);
+            }
+        } else {
+            xdbg<<"Need to split.\n";
+            bool split1=false, split2=false;
+            double bsq_eff = BinTypeHelper<B>::getEffectiveBSq(rsq,bb*bb);
+            CalcSplitSq(split1,split2,s1,s2,s1ps2,bsq_eff,_splitfactorsq);
+            xdbg<<"rsq = "<<rsq<<", s1ps2 = "<<s1ps2<<"  ";
+            xdbg<<"s1ps2 / r = "<<s1ps2 / sqrt(rsq)<<", b = "<<bb<<"  ";
+            xdbg<<"split = "<<split1<<','<<split2<<std::endl;
+            // This isn't time critical, so just put the first sub-pair back on the stack too.
+            const Cell<D1,C>* pa = &a;
+            const Cell<D2,C>* pb = &b;
+            PushSplit(todo,pa,pb,split1,split2);
+            todo.push(CellPair(pa,pb));
+        }
+    }
+}
+
+void SelectRandomFrom(long m, std::vector<long>& selection)
+{
+    xdbg<<"SelectRandomFrom("<<m<<", "<<selection.size()<<")\n";
+    long n = selection.size();
+    // There are two algorithms here.
+    // Floyd's algorithm is efficient for m >> n.
+    // Fisher-Yates is efficient for m not much > n.
+    // I don't know exactly the transition for when Floyd's becomes the better choice.
+    // So I'm somewhat arbitrarily picking 3*n.
+    if (m > 3*n) {
+        dbg<<"Floyd's algorithm\n";
+        // Floyd's algorithm
+        // O(n) in memory, but slightly more than O(n) in time, especially as m ~ n.
+        std::set<long> selected;
+        while (long(selected.size()) < n) {
+            double urd = urand();
+            long j = long(urd * m); // 0 <= j < m
+            if (j == m) j = m-1;    // Just in case.
+            std::pair<std::set<long>::iterator,bool> ret = selected.insert(j);
+            if (ret.second) {
+                // Then insertion happened.  I.e. not already present.
+                // Also write it to the end of the selection list
+                selection[selected.size()-1] = j;
+            }
+        }
+    } else {
+        dbg<<"Fisher-Yates\n";
+        // Fisher-Yates shuffle up through n elements
+        // O(n) in time, but O(m) in memory.
+        std::vector<long> full(m);
+        for (long i=0; i<m; ++i) full[i] = i;
+        for (long i=0; i<n; ++i) {
+            double urd = urand();
+            long j = long(urd * (m-i)); // 0 <= j < m-i
+            j += i;                     // i <= j < m
+            if (j == m) j = m-1;        // Just in case.
+            std::swap(full[i], full[j]);
+        }
+        std::copy(full.begin(), full.begin()+n, selection.begin());
+    }
+}
+
+//
+//
+// The C interface for python
+//
+//
+
+extern "C" {
+
+#ifdef _WIN32
+#define extern __declspec(dllexport)
+#endif
+
+#include "BinnedCorr2_C.h"
+}
+
+template <int D1, int D2>
+void* BuildCorr2b(int bin_type,
+                  double minsep, double maxsep, int nbins, double binsize, double b,
+                  const double* edges, const double* bin_b,
+                  double minrpar, double maxrpar, double xp, double yp, double zp,
+                  double max_accum_mem, int float_accum,
+                  double* xi0, double* xi1, double* xi2, double* xi3,
+                  double* meanr, double* meanlogr, double* weight, double* npairs)
+{
+    switch(bin_type) {
+#ifdef TREECORR_USE_LOG
+      case Log:
+           return static_cast<void*>(new BinnedCorr2<D1,D2,Log>(
+                   minsep, maxsep, nbins, binsize, b, edges, bin_b,
+                   minrpar, maxrpar, xp, yp, zp, max_accum_mem, bool(float_accum),
+                   xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs));
+           break;
+#endif
+#ifdef TREECORR_USE_LINEAR
+      case Linear:
+           return static_cast<void*>(new BinnedCorr2<D1,D2,Linear>(
+                   minsep, maxsep, nbins, binsize, b, edges, bin_b,
+                   minrpar, maxrpar, xp, yp, zp, max_accum_mem, bool(float_accum),
+                   xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs));
+           break;
+#endif
+#ifdef TREECORR_USE_TWOD
+      case TwoD:
+           return static_cast<void*>(new BinnedCorr2<D1,D2,TwoD>(
+                   minsep, maxsep, nbins, binsize, b, edges, bin_b,
+                   minrpar, maxrpar, xp, yp, zp, max_accum_mem, bool(float_accum),
+                   xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs));
+           break;
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           return static_cast<void*>(new BinnedCorr2<D1,D2,Edges>(
+                   minsep, maxsep, nbins, binsize, b, edges, bin_b,
+                   minrpar, maxrpar, xp, yp, zp, max_accum_mem, bool(float_accum),
+                   xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs));
+           break;
+#endif
+      default:
+           Assert(false);
+    }
+    return 0;
+}
+
+template <int D1>
+void* BuildCorr2a(int d2, int bin_type,
+                  double minsep, double maxsep, int nbins, double binsize, double b,
+                  const double* edges, const double* bin_b,
+                  double minrpar, double maxrpar, double xp, double yp, double zp,
+                  double max_accum_mem, int float_accum,
+                  double* xi0, double* xi1, double* xi2, double* xi3,
+                  double* meanr, double* meanlogr, double* weight, double* npairs)
+{
+    // Note: we only ever call this with d2 >= d1, so the MAX bit below is equivalent to
+    // just using d2 for the cases that actually get called, but doing this saves some
+    // compile time and some size in the final library from not instantiating templates
+    // that aren't needed.
+    switch(d2) {
+      case NData:
+           return BuildCorr2b<D1,MAX(D1,NData)>(bin_type,
+                                                minsep, maxsep, nbins, binsize, b, edges, bin_b,
+                                                minrpar, maxrpar, xp, yp, zp, max_accum_mem,
+                                                float_accum,
+                                                xi0, xi1, xi2, xi3,
+                                                meanr, meanlogr, weight, npairs);
+           break;
+      case KData:
+           return BuildCorr2b<D1,MAX(D1,KData)>(bin_type,
+                                                minsep, maxsep, nbins, binsize, b, edges, bin_b,
+                                                minrpar, maxrpar, xp, yp, zp, max_accum_mem,
+                                                float_accum,
+                                                xi0, xi1, xi2, xi3,
+                                                meanr, meanlogr, weight, npairs);
+           break;
+      case GData:
+           return BuildCorr2b<D1,MAX(D1,GData)>(bin_type,
+                                                minsep, maxsep, nbins, binsize, b, edges, bin_b,
+                                                minrpar, maxrpar, xp, yp, zp, max_accum_mem,
+                                                float_accum,
+                                                xi0, xi1, xi2, xi3,
+                                                meanr, meanlogr, weight, npairs);
+           break;
+      default:
+           Assert(false);
+    }
+    return 0;
+}
+
+
+void* BuildCorr2(int d1, int d2, int bin_type,
+                 double minsep, double maxsep, int nbins, double binsize, double b,
+                 const double* edges, const double* bin_b,
+                 double minrpar, double maxrpar, double xp, double yp, double zp,
+                 double max_accum_mem, int float_accum,
+                 double* xi0, double* xi1, double* xi2, double* xi3,
+                 double* meanr, double* meanlogr, double* weight, double* npairs)
+{
+    dbg<<"Start BuildCorr2: "<<d1<<" "<<d2<<" "<<bin_type<<std::endl;
+    void* corr=0;
+    switch(d1) {
+      case NData:
+           corr = BuildCorr2a<NData>(d2, bin_type,
+                                     minsep, maxsep, nbins, binsize, b, edges, bin_b,
+                                     minrpar, maxrpar, xp, yp, zp, max_accum_mem, float_accum,
+                                     xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs);
+           break;
+      case KData:
+           corr = BuildCorr2a<KData>(d2, bin_type,
+                                     minsep, maxsep, nbins, binsize, b, edges, bin_b,
+                                     minrpar, maxrpar, xp, yp, zp, max_accum_mem, float_accum,
+                                     xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs);
+           break;
+      case GData:
+           corr = BuildCorr2a<GData>(d2, bin_type,
+                                     minsep, maxsep, nbins, binsize, b, edges, bin_b,
+                                     minrpar, maxrpar, xp, yp, zp, max_accum_mem, float_accum,
+                                     xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs);
+           break;
+      default:
+           Assert(false);
+    }
+    xdbg<<"corr = "<<corr<<std::endl;
+    return corr;
+}
+
+template <int D1, int D2>
+void DestroyCorr2b(void* corr, int bin_type)
+{
+    switch(bin_type) {
+#ifdef TREECORR_USE_LOG
+      case Log:
+           delete static_cast<BinnedCorr2<D1,D2,Log>*>(corr);
+           break;
+#endif
+#ifdef TREECORR_USE_LINEAR
+      case Linear:
+           delete static_cast<BinnedCorr2<D1,D2,Linear>*>(corr);
+           break;
+#endif
+#ifdef TREECORR_USE_TWOD
+      case TwoD:
+           delete static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr);
+           break;
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           delete static_cast<BinnedCorr2<D1,D2,Edges>*>(corr);
+           break;
+#endif
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void DestroyCorr2a(void* corr, int d2, int bin_type)
+{
+    switch(d2) {
+      case NData:
+           DestroyCorr2b<D1,MAX(D1,NData)>(corr, bin_type);
+           break;
+      case KData:
+           DestroyCorr2b<D1,MAX(D1,KData)>(corr, bin_type);
+           break;
+      case GData:
+           DestroyCorr2b<D1,MAX(D1,GData)>(corr, bin_type);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void DestroyCorr2(void* corr, int d1, int d2, int bin_type)
+{
+    dbg<<"Start DestroyCorr2: "<<d1<<" "<<d2<<" "<<bin_type<<std::endl;
+    xdbg<<"corr = "<<corr<<std::endl;
+    switch(d1) {
+      case NData:
+           DestroyCorr2a<NData>(corr, d2, bin_type);
+           break;
+      case KData:
+           DestroyCorr2a<KData>(corr, d2, bin_type);
+           break;
+      case GData:
+           DestroyCorr2a<GData>(corr, d2, bin_type);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int M, int D, int B>
+void ProcessAuto2d(BinnedCorr2<D,D,B>* corr, void* field, int patch, int dots, int coords)
+{
+    const bool P = corr->nontrivialRPar();
+    dbg<<"ProcessAuto: coords = "<<coords<<", metric = "<<M<<", P = "<<P<<std::endl;
+
+    switch(coords) {
+      case Flat:
+           Assert((MetricHelper<M,0>::_Flat == int(Flat)));
+           Assert(!P);
+           corr->template process<MetricHelper<M,0>::_Flat, M, false>(
+               *static_cast<Field<D,MetricHelper<M,0>::_Flat>*>(field), dots, patch);
+           break;
+      case Sphere:
+           Assert((MetricHelper<M,0>::_Sphere == int(Sphere)));
+           Assert(!P);
+           corr->template process<MetricHelper<M,0>::_Sphere, M, false>(
+               *static_cast<Field<D,MetricHelper<M,0>::_Sphere>*>(field), dots, patch);
+           break;
+      case ThreeD:
+           Assert((MetricHelper<M,0>::_ThreeD == int(ThreeD)));
+           if (P)
+               corr->template process<MetricHelper<M,1>::_ThreeD, M, true>(
+                   *static_cast<Field<D,MetricHelper<M,1>::_ThreeD>*>(field), dots, patch);
+           else
+               corr->template process<MetricHelper<M,0>::_ThreeD, M, false>(
+                   *static_cast<Field<D,MetricHelper<M,0>::_ThreeD>*>(field), dots, patch);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D, int B>
+void ProcessAuto2c(BinnedCorr2<D,D,B>* corr, void* field, int patch, int dots,
+                   int coords, int metric)
+{
+    switch(metric) {
+#ifdef TREECORR_USE_EUCLIDEAN
+      case Euclidean:
+           ProcessAuto2d<Euclidean>(corr, field, patch, dots, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_RPERP
+      case Rperp:
+           ProcessAuto2d<Rperp>(corr, field, patch, dots, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_OLDRPERP
+      case OldRperp:
+           ProcessAuto2d<OldRperp>(corr, field, patch, dots, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_RLENS
+      case Rlens:
+           ProcessAuto2d<Rlens>(corr, field, patch, dots, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_ARC
+      case Arc:
+           ProcessAuto2d<Arc>(corr, field, patch, dots, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_PERIODIC
+      case Periodic:
+           ProcessAuto2d<Periodic>(corr, field, patch, dots, coords);
+           break;
+#endif
+      default:
+           Assert(false);
+    }
+}
+
+template <int D>
+void ProcessAuto2b(void* corr, void* field, int patch, int dots,
+                   int coords, int bin_type, int metric)
+{
+    switch(bin_type) {
+#ifdef TREECORR_USE_LOG
+      case Log:
+           ProcessAuto2c(static_cast<BinnedCorr2<D,D,Log>*>(corr), field, patch, dots,
+                         coords, metric);
+           break;
+#endif
+#ifdef TREECORR_USE_LINEAR
+      case Linear:
+           ProcessAuto2c(static_cast<BinnedCorr2<D,D,Linear>*>(corr), field, patch, dots,
+                         coords, metric);
+           break;
+#endif
+#ifdef TREECORR_USE_TWOD
+      case TwoD:
+           ProcessAuto2c(static_cast<BinnedCorr2<D,D,TwoD>*>(corr), field, patch, dots,
+                         coords, metric);
+           break;
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           ProcessAuto2c(static_cast<BinnedCorr2<D,D,Edges>*>(corr), field, patch, dots,
+                         coords, metric);
+           break;
+#endif
+      default:
+           Assert(false);
+    }
+}
+
+// If patch >= 0, only process the cells in that patch of the field.
+void ProcessAuto2p(void* corr, void* field, int patch, int dots,
+                   int d, int coords, int bin_type, int metric)
+{
+    dbg<<"Start ProcessAuto2: "<<patch<<" "<<d<<" "<<coords<<" "<<bin_type<<" "<<metric<<
+        std::endl;
+    TraceSpan span("ProcessAuto2", patch);
+
+    switch(d) {
+      case NData:
+           ProcessAuto2b<NData>(corr, field, patch, dots, coords, bin_type, metric);
+           break;
+      case KData:
+           ProcessAuto2b<KData>(corr, field, patch, dots, coords, bin_type, metric);
+           break;
+      case GData:
+           ProcessAuto2b<GData>(corr, field, patch, dots, coords, bin_type, metric);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int M, int D1, int D2, int B>
+void ProcessCross2d(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2,
+                    int patch1, int patch2, int dots, int coords)
+{
+    const bool P = corr->nontrivialRPar();
+    dbg<<"ProcessCross: coords = "<<coords<<", metric = "<<M<<", P = "<<P<<std::endl;
+
+    switch(coords) {
+      case Flat:
+           Assert((MetricHelper<M,0>::_Flat == int(Flat)));
+           Assert(!P);
+           corr->template process<MetricHelper<M,0>::_Flat, M, false>(
+               *static_cast<Field<D1,MetricHelper<M,0>::_Flat>*>(field1),
+               *static_cast<Field<D2,MetricHelper<M,0>::_Flat>*>(field2), dots,
+               patch1, patch2);
+           break;
+      case Sphere:
+           Assert((MetricHelper<M,0>::_Sphere == int(Sphere)));
+           Assert(!P);
+           corr->template process<MetricHelper<M,0>::_Sphere, M, false>(
+               *static_cast<Field<D1,MetricHelper<M,0>::_Sphere>*>(field1),
+               *static_cast<Field<D2,MetricHelper<M,0>::_Sphere>*>(field2), dots,
+               patch1, patch2);
+           break;
+      case ThreeD:
+           Assert((MetricHelper<M,0>::_ThreeD == int(ThreeD)));
+           if (P)
+               corr->template process<MetricHelper<M,1>::_ThreeD, M, true>(
+                   *static_cast<Field<D1,MetricHelper<M,1>::_ThreeD>*>(field1),
+                   *static_cast<Field<D2,MetricHelper<M,1>::_ThreeD>*>(field2), dots,
+                   patch1, patch2);
+           else
+               corr->template process<MetricHelper<M,0>::_ThreeD, M, false>(
+                   *static_cast<Field<D1,MetricHelper<M,0>::_ThreeD>*>(field1),
+                   *static_cast<Field<D2,MetricHelper<M,0>::_ThreeD>*>(field2), dots,
+                   patch1, patch2);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2, int B>
+void ProcessCross2c(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2,
+                    int patch1, int patch2, int dots, int coords, int metric)
+{
+    switch(metric) {
+#ifdef TREECORR_USE_EUCLIDEAN
+      case Euclidean:
+           ProcessCross2d<Euclidean>(corr, field1, field2, patch1, patch2, dots, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_RPERP
+      case Rperp:
+           ProcessCross2d<Rperp>(corr, field1, field2, patch1, patch2, dots, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_OLDRPERP
+      case OldRperp:
+           ProcessCross2d<OldRperp>(corr, field1, field2, patch1, patch2, dots, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_RLENS
+      case Rlens:
+           ProcessCross2d<Rlens>(corr, field1, field2, patch1, patch2, dots, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_ARC
+      case Arc:
+           ProcessCross2d<Arc>(corr, field1, field2, patch1, patch2, dots, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_PERIODIC
+      case Periodic:
+           ProcessCross2d<Periodic>(corr, field1, field2, patch1, patch2, dots, coords);
+           break;
+#endif
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2>
+void ProcessCross2b(void* corr, void* field1, void* field2, int patch1, int patch2, int dots,
+                    int coords, int bin_type, int metric)
+{
+    switch(bin_type) {
+#ifdef TREECORR_USE_LOG
+      case Log:
+           ProcessCross2c(static_cast<BinnedCorr2<D1,D2,Log>*>(corr), field1, field2,
+                          patch1, patch2, dots, coords, metric);
+           break;
+#endif
+#ifdef TREECORR_USE_LINEAR
+      case Linear:
+           ProcessCross2c(static_cast<BinnedCorr2<D1,D2,Linear>*>(corr), field1, field2,
+                          patch1, patch2, dots, coords, metric);
+           break;
+#endif
+#ifdef TREECORR_USE_TWOD
+      case TwoD:
+           ProcessCross2c(static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr), field1, field2,
+                          patch1, patch2, dots, coords, metric);
+           break;
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           ProcessCross2c(static_cast<BinnedCorr2<D1,D2,Edges>*>(corr), field1, field2,
+                          patch1, patch2, dots, coords, metric);
+           break;
+#endif
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void ProcessCross2a(void* corr, void* field1, void* field2, int patch1, int patch2, int dots,
+                    int d2, int coords, int bin_type, int metric)
+{
+    // Note: we only ever call this with d2 >= d1, so the MAX bit below is equivalent to
+    // just using d2 for the cases that actually get called, but doing this saves some
+    // compile time and some size in the final library from not instantiating templates
+    // that aren't needed.
+    Assert(d2 >= D1);
+    switch(d2) {
+      case NData:
+           ProcessCross2b<D1,MAX(D1,NData)>(corr, field1, field2, patch1, patch2, dots,
+                                            coords, bin_type, metric);
+           break;
+      case KData:
+           ProcessCross2b<D1,MAX(D1,KData)>(corr, field1, field2, patch1, patch2, dots,
+                                            coords, bin_type, metric);
+           break;
+      case GData:
+           ProcessCross2b<D1,MAX(D1,GData)>(corr, field1, field2, patch1, patch2, dots,
+                                            coords, bin_type, metric);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+// If patch1 (patch2) >= 0, only process the cells in that patch of field1 (field2).
+void ProcessCross2p(void* corr, void* field1, void* field2, int patch1, int patch2, int dots,
+                    int d1, int d2, int coords, int bin_type, int metric)
+{
+    dbg<<"Start ProcessCross2: "<<patch1<<" "<<patch2<<" "<<d1<<" "<<d2<<" "<<coords<<" "<<
+        bin_type<<" "<<metric<<std::endl;
+    TraceSpan span("ProcessCross2", patch1, patch2);
+
+    switch(d1) {
+      case NData:
+           ProcessCross2a<NData>(corr, field1, field2, patch1, patch2, dots,
+                                 d2, coords, bin_type, metric);
+           break;
+      case KData:
+           ProcessCross2a<KData>(corr, field1, field2, patch1, patch2, dots,
+                                 d2, coords, bin_type, metric);
+           break;
+      case GData:
+           ProcessCross2a<GData>(corr, field1, field2, patch1, patch2, dots,
+                                 d2, coords, bin_type, metric);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void ProcessAuto2(void* corr, void* field, int dots,
+                  int d, int coords, int bin_type, int metric)
+{ ProcessAuto2p(corr, field, -1, dots, d, coords, bin_type, metric); }
+
+void ProcessCross2(void* corr, void* field1, void* field2, int dots,
+                   int d1, int d2, int coords, int bin_type, int metric)
+{ ProcessCross2p(corr, field1, field2, -1, -1, dots, d1, d2, coords, bin_type, metric); }
+
+// Build the top-level cells of a field.  Field::BuildCells isn't safe for several threads to
+// do at once, so the patch functions below do this for all their fields before running the
+// pairs in parallel.  (cf. ProcessPatches3f)
+template <int D>
+void BuildFieldCells1(void* field, int coords)
+{
+    switch(coords) {
+      case Flat:
+           static_cast<Field<D,Flat>*>(field)->getNTopLevel();
+           break;
+      case Sphere:
+           static_cast<Field<D,Sphere>*>(field)->getNTopLevel();
+           break;
+      case ThreeD:
+           static_cast<Field<D,ThreeD>*>(field)->getNTopLevel();
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void BuildFieldCells(void* field, int d, int coords)
+{
+    switch(d) {
+      case NData:
+           BuildFieldCells1<NData>(field, coords);
+           break;
+      case KData:
+           BuildFieldCells1<KData>(field, coords);
+           break;
+      case GData:
+           BuildFieldCells1<GData>(field, coords);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void ProcessPatches2(void** corrs, void** fields1, void** fields2, int npairs, int dots,
+                     int d1, int d2, int coords, int bin_type, int metric)
+{
+    dbg<<"Start ProcessPatches2: "<<npairs<<" "<<d1<<" "<<d2<<" "<<coords<<" "<<bin_type<<" "<<
+        metric<<std::endl;
+
+    // The same field is usually in many of the pairs, so only build each one once.
+    std::set<void*> built;
+    for (int i=0; i<npairs; ++i) {
+        if (built.insert(fields1[i]).second) BuildFieldCells(fields1[i], d1, coords);
+        if (fields2[i] && built.insert(fields2[i]).second)
+            BuildFieldCells(fields2[i], d2, coords);
+    }
+
+#ifdef _OPENMP
+    // When the pairs run in parallel, the parallel regions in process are nested inside this
+    // one, so (with nested parallelism off, which is the default) each of them just has the
+    // one thread.
+    const bool by_pair = npairs >= PATCH_PAIRS_PER_THREAD * omp_get_max_threads();
+    dbg<<"by_pair = "<<by_pair<<std::endl;
+#pragma omp parallel for schedule(dynamic) if (by_pair)
+#endif
+    for (int i=0; i<npairs; ++i) {
+        if (fields2[i])
+            ProcessCross2(corrs[i], fields1[i], fields2[i], 0, d1, d2, coords, bin_type, metric);
+        else
+            ProcessAuto2(corrs[i], fields1[i], 0, d1, coords, bin_type, metric);
+        if (dots) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            std::cout<<'.'<<std::flush;
+        }
+    }
+    if (dots) std::cout<<std::endl;
+}
+
+void ProcessPatchPairs2(void** corrs, void* field1, void* field2,
+                        int* patches1, int* patches2, int npairs, int dots,
+                        int d1, int d2, int coords, int bin_type, int metric)
+{
+    dbg<<"Start ProcessPatchPairs2: "<<npairs<<" "<<d1<<" "<<d2<<" "<<coords<<" "<<bin_type<<
+        " "<<metric<<std::endl;
+
+    BuildFieldCells(field1, d1, coords);
+    if (field2) BuildFieldCells(field2, d2, coords);
+
+    // As in ProcessPatches2, either run the pairs in parallel or each one with all the threads.
+#ifdef _OPENMP
+    const bool by_pair = npairs >= PATCH_PAIRS_PER_THREAD * omp_get_max_threads();
+    dbg<<"by_pair = "<<by_pair<<std::endl;
+#pragma omp parallel for schedule(dynamic) if (by_pair)
+#endif
+    for (int i=0; i<npairs; ++i) {
+        if (field2)
+            ProcessCross2p(corrs[i], field1, field2, patches1[i], patches2[i], 0,
+                           d1, d2, coords, bin_type, metric);
+        else if (patches1[i] == patches2[i])
+            ProcessAuto2p(corrs[i], field1, patches1[i], 0, d1, coords, bin_type, metric);
+        else
+            ProcessCross2p(corrs[i], field1, field1, patches1[i], patches2[i], 0,
+                           d1, d1, coords, bin_type, metric);
+        if (dots) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            std::cout<<'.'<<std::flush;
+        }
+    }
+    if (dots) std::cout<<std::endl;
+}
+
+template <int D1, int D2>
+void StartRecord2b(void* corr, int bin_type)
+{
+    switch(bin_type) {
+#ifdef TREECORR_USE_LOG
+      case Log:
+           static_cast<BinnedCorr2<D1,D2,Log>*>(corr)->startRecord();
+           break;
+#endif
+#ifdef TREECORR_USE_LINEAR
+      case Linear:
+           static_cast<BinnedCorr2<D1,D2,Linear>*>(corr)->startRecord();
+           break;
+#endif
+#ifdef TREECORR_USE_TWOD
+      case TwoD:
+           static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr)->startRecord();
+           break;
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           static_cast<BinnedCorr2<D1,D2,Edges>*>(corr)->startRecord();
+           break;
+#endif
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void StartRecord2a(void* corr, int d2, int bin_type)
+{
+    switch(d2) {
+      case NData:
+           StartRecord2b<D1,MAX(D1,NData)>(corr, bin_type);
+           break;
+      case KData:
+           StartRecord2b<D1,MAX(D1,KData)>(corr, bin_type);
+           break;
+      case GData:
+           StartRecord2b<D1,MAX(D1,GData)>(corr, bin_type);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void StartRecord2(void* corr, int d1, int d2, int bin_type)
+{
+    dbg<<"Start StartRecord2: "<<d1<<" "<<d2<<" "<<bin_type<<std::endl;
+    switch(d1) {
+      case NData:
+           StartRecord2a<NData>(corr, d2, bin_type);
+           break;
+      case KData:
+           StartRecord2a<KData>(corr, d2, bin_type);
+           break;
+      case GData:
+           StartRecord2a<GData>(corr, d2, bin_type);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2>
+void SetSplitFactor2b(void* corr, int bin_type, double splitfactor)
+{
+    switch(bin_type) {
+#ifdef TREECORR_USE_LOG
+      case Log:
+           static_cast<BinnedCorr2<D1,D2,Log>*>(corr)->setSplitFactor(splitfactor);
+           break;
+#endif
+#ifdef TREECORR_USE_LINEAR
+      case Linear:
+           static_cast<BinnedCorr2<D1,D2,Linear>*>(corr)->setSplitFactor(splitfactor);
+           break;
+#endif
+#ifdef TREECORR_USE_TWOD
+      case TwoD:
+           static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr)->setSplitFactor(splitfactor);
+           break;
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           static_cast<BinnedCorr2<D1,D2,Edges>*>(corr)->setSplitFactor(splitfactor);
+           break;
+#endif
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void SetSplitFactor2a(void* corr, int d2, int bin_type, double splitfactor)
+{
+    switch(d2) {
+      case NData:
+           SetSplitFactor2b<D1,MAX(D1,NData)>(corr, bin_type, splitfactor);
+           break;
+      case KData:
+           SetSplitFactor2b<D1,MAX(D1,KData)>(corr, bin_type, splitfactor);
+           break;
+      case GData:
+           SetSplitFactor2b<D1,MAX(D1,GData)>(corr, bin_type, splitfactor);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void SetSplitFactor2(void* corr, int d1, int d2, int bin_type, double splitfactor)
+{
+    dbg<<"Start SetSplitFactor2: "<<d1<<" "<<d2<<" "<<bin_type<<" "<<splitfactor<<std::endl;
+    switch(d1) {
+      case NData:
+           SetSplitFactor2a<NData>(corr, d2, bin_type, splitfactor);
+           break;
+      case KData:
+           SetSplitFactor2a<KData>(corr, d2, bin_type, splitfactor);
+           break;
+      case GData:
+           SetSplitFactor2a<GData>(corr, d2, bin_type, splitfactor);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2>
+void SetMinSize2b(void* corr, int bin_type, double minsize)
+{
+    switch(bin_type) {
+#ifdef TREECORR_USE_LOG
+      case Log:
+           static_cast<BinnedCorr2<D1,D2,Log>*>(corr)->setMinSize(minsize);
+           break;
+#endif
+#ifdef TREECORR_USE_LINEAR
+      case Linear:
+           static_cast<BinnedCorr2<D1,D2,Linear>*>(corr)->setMinSize(minsize);
+           break;
+#endif
+#ifdef TREECORR_USE_TWOD
+      case TwoD:
+           static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr)->setMinSize(minsize);
+           break;
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           static_cast<BinnedCorr2<D1,D2,Edges>*>(corr)->setMinSize(minsize);
+           break;
+#endif
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void SetMinSize2a(void* corr, int d2, int bin_type, double minsize)
+{
+    switch(d2) {
+      case NData:
+           SetMinSize2b<D1,MAX(D1,NData)>(corr, bin_type, minsize);
+           break;
+      case KData:
+           SetMinSize2b<D1,MAX(D1,KData)>(corr, bin_type, minsize);
+           break;
+      case GData:
+           SetMinSize2b<D1,MAX(D1,GData)>(corr, bin_type, minsize);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+void SetMinSize2(void* corr, int d1, int d2, int bin_type, double minsize)
+{
+    dbg<<"Start SetMinSize2: "<<d1<<" "<<d2<<" "<<bin_type<<" "<<minsize<<std::endl;
+    switch(d1) {
+      case NData:
+           SetMinSize2a<NData>(corr, d2, bin_type, minsize);
+           break;
+      case KData:
+           SetMinSize2a<KData>(corr, d2, bin_type, minsize);
+           break;
+      case GData:
+           SetMinSize2a<GData>(corr, d2, bin_type, minsize);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1, int D2, int B>
+void GetPruneStats2c(void* corr, long* counts, long* depth, int reset)
+{
+    BinnedCorr2<D1,D2,B>* bc2 = static_cast<BinnedCorr2<D1,D2,B>*>(corr);
+    if (counts) bc2->writePruneStats(counts, depth);
+    if (reset) bc2->clearPruneStats();
+}
+
+template <int D1, int D2>
+void GetPruneStats2b(void* corr, int bin_type, long* counts, long* depth, int reset)
+{
+    switch(bin_type) {
+#ifdef TREECORR_USE_LOG
+      case Log:
+           GetPruneStats2c<D1,D2,Log>(corr, counts, depth, reset);
+           break;
+#endif
+#ifdef TREECORR_USE_LINEAR
+      case Linear:
+           GetPruneStats2c<D1,D2,Linear>(corr, counts, depth, reset);
+           break;
+#endif
+#ifdef TREECORR_USE_TWOD
+      case TwoD:
+           GetPruneStats2c<D1,D2,TwoD>(corr, counts, depth, reset);
+           break;
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           GetPruneStats2c<D1,D2,Edges>(corr, counts, depth, reset);
+           break;
+#endif
+      default:
+           Assert(false);
+    }
+}
+
+template <int D1>
+void GetPruneStats2a(void* corr, int d2, int bin_type, long* counts, long* depth, int reset)
+{
+    switch(d2) {
+      case NData:
+           GetPruneStats2b<D1,MAX(D1,NData)>(corr, bin_type, counts, depth, reset);
+           break;
+      case KData:
+           GetPruneStats2b<D1,MAX(D1,KData)>(corr, bin_type, counts, depth, reset);
+           break;
+      case GData:
+           GetPruneStats2b<D1,MAX(D1,GData)>(corr, bin_type, counts, depth, reset);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+int GetPruneStats2(void* corr, int d1, int d2, int bin_type, long* counts, long* depth,
+                   int reset)
+{
+    dbg<<"Start GetPruneStats2: "<<d1<<" "<<d2<<" "<<bin_type<<std::endl;
+    if (!PruneStats2::enabled) return 0;
+    switch(d1) {
+      case NData:
+           GetPruneStats2a<NData>(corr, d2, bin_type, counts, depth, reset);
+           break;
+      case KData:
+           GetPruneStats2a<KData>(corr, d2, bin_type, counts, depth, reset);
+           break;
+      case GData:
+           GetPruneStats2a<GData>(corr, d2, bin_type, counts, depth, reset);
+           break;
+      default:
+           Assert(false);
+    }
+    return 1;
+}
+
+template <int D1, int D2, int B>
+int GetCopyBytes2c(void* corr, int nthreads, double* bytes)
+{
+    BinnedCorr2<D1,D2,B>* bc2 = static_cast<BinnedCorr2<D1,D2,B>*>(corr);
+    *bytes = bc2->getCopyBytes();
+    return bc2->getNCopies(nthreads);
+}
+
+template <int D1, int D2>
+int GetCopyBytes2b(void* corr, int bin_type, int nthreads, double* bytes)
+{
+    switch(bin_type) {
+#ifdef TREECORR_USE_LOG
+      case Log:
+           return GetCopyBytes2c<D1,D2,Log>(corr, nthreads, bytes);
+           break;
+#endif
+#ifdef TREECORR_USE_LINEAR
+      case Linear:
+           return GetCopyBytes2c<D1,D2,Linear>(corr, nthreads, bytes);
+           break;
+#endif
+#ifdef TREECORR_USE_TWOD
+      case TwoD:
+           return GetCopyBytes2c<D1,D2,TwoD>(corr, nthreads, bytes);
+           break;
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           return GetCopyBytes2c<D1,D2,Edges>(corr, nthreads, bytes);
+           break;
+#endif
+      default:
+           Assert(false);
+    }
+    return 0;
+}
+
+template <int D1>
+int GetCopyBytes2a(void* corr, int d2, int bin_type, int nthreads, double* bytes)
 {
-    // This tracks process11, but we only select pairs at the end, not call directProcess11
-    xdbg<<"Start samplePairs for "<<c1.getPos()<<",  "<<c2.getPos()<<"   ";
-    xdbg<<"w = "<<c1.getW()<<", "<<c2.getW()<<std::endl;
-    if (c1.getW() == 0. || c2.getW() == 0.) return;
-
-    const Position<C>& p1 = c1.getPos();
-    const Position<C>& p2 = c2.getPos();
-    double s1 = c1.getSize(); // May be modified by DistSq function.
-    double s2 = c2.getSize(); // "
-    xdbg<<"s1,s2 = "<<s1<<','<<s2<<std::endl;
-    xdbg<<"M,C = "<<M<<"  "<<C<<std::endl;
-    const double rsq = metric.DistSq(p1, p2, s1, s2);
-    xdbg<<"rsq = "<<rsq<<std::endl;
-    xdbg<<"s1,s2 => "<<s1<<','<<s2<<std::endl;
-    const double s1ps2 = s1+s2;
-
-    double rpar = 0; // Gets set to correct value by this function if appropriate
-    if (metric.isRParOutsideRange(p1, p2, s1ps2, rpar)) {
-        return;
-    }
-    xdbg<<"RPar in range\n";
-
-    if (BinTypeHelper<B>::tooSmallDist(rsq, s1ps2, minsep, minsepsq) &&
-        metric.tooSmallDist(p1, p2, rsq, rpar, s1ps2, minsep, minsepsq)) {
-        return;
+    switch(d2) {
+      case NData:
+           return GetCopyBytes2b<D1,MAX(D1,NData)>(corr, bin_type, nthreads, bytes);
+           break;
+      case KData:
+           return GetCopyBytes2b<D1,MAX(D1,KData)>(corr, bin_type, nthreads, bytes);
+           break;
+      case GData:
+           return GetCopyBytes2b<D1,MAX(D1,GData)>(corr, bin_type, nthreads, bytes);
+           break;
+      default:
+           Assert(false);
     }
-    xdbg<<"Not too small separation\n";
+    return 0;
+}
 
-    if (BinTypeHelper<B>::tooLargeDist(rsq, s1ps2, maxsep, maxsepsq) &&
-        metric.tooLargeDist(p1, p2, rsq, rpar, s1ps2, maxsep, maxsepsq)) {
-        return;
+int GetCopyBytes2(void* corr, int d1, int d2, int bin_type, int nthreads, double* bytes)
+{
+    dbg<<"Start GetCopyBytes2: "<<d1<<" "<<d2<<" "<<bin_type<<" "<<nthreads<<std::endl;
+    switch(d1) {
+      case NData:
+           return GetCopyBytes2a<NData>(corr, d2, bin_type, nthreads, bytes);
+           break;
+      case KData:
+           return GetCopyBytes2a<KData>(corr, d2, bin_type, nthreads, bytes);
+           break;
+      case GData:
+           return GetCopyBytes2a<GData>(corr, d2, bin_type, nthreads, bytes);
+           break;
+      default:
+           Assert(false);
     }
-    xdbg<<"Not too large separation\n";
-
-    // Now check if these cells are small enough that it is ok to drop into a single bin.
-    int kk=-1;
-    double r=0,logr=0;  // If singleBin is true, these values are set for use by directProcess11
-    if (metric.isRParInsideRange(p1, p2, s1ps2, rpar) &&
-        BinTypeHelper<B>::singleBin(rsq, s1ps2, p1, p2, _binsize, _b, _bsq,
-                                    _minsep, _maxsep, _logminsep, kk, r, logr))
-    {
-        xdbg<<"Drop into single bin.\n";
-        xdbg<<"rsq = "<<rsq<<std::endl;
-        xdbg<<"minsepsq = "<<minsepsq<<std::endl;
-        xdbg<<"maxsepsq = "<<maxsepsq<<std::endl;
-        if (BinTypeHelper<B>::isRSqInRange(rsq, p1, p2, minsep, minsepsq, maxsep, maxsepsq)) {
-            sampleFrom(c1,c2,rsq,r,i1,i2,sep,n,k);
-        }
-    } else {
-        xdbg<<"Need to split.\n";
-        bool split1=false, split2=false;
-        double bsq_eff = BinTypeHelper<B>::getEffectiveBSq(rsq,_bsq);
-        CalcSplitSq(split1,split2,s1,s2,s1ps2,bsq_eff);
-        xdbg<<"rsq = "<<rsq<<", s1ps2 = "<<s1ps2<<"  ";
-        xdbg<<"s1ps2 / r = "<<s1ps2 / sqrt(rsq)<<", b = "<<_b<<"  ";
-        xdbg<<"split = "<<split1<<','<<split2<<std::endl;
+    return 0;
+}
 
-        if (split1 && split2) {
-            Assert(c1.getLeft());
-            Assert(c1.getRight());
-            Assert(c2.getLeft());
-            Assert(c2.getRight());
-            samplePairs(*c1.getLeft(), *c2.getLeft(), metric,
-                        minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
-            samplePairs(*c1.getLeft(), *c2.getRight(), metric,
-                        minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
-            samplePairs(*c1.getRight(), *c2.getLeft(), metric,
-                        minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
-            samplePairs(*c1.getRight(), *c2.getRight(), metric,
-                        minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
-        } else if (split1) {
-            Assert(c1.getLeft());
-            Assert(c1.getRight());
-            samplePairs(*c1.getLeft(), c2, metric,
-                        minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
-            samplePairs(*c1.getRight(), c2, metric,
-                        minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
-        } else {
-            Assert(split2);
-            Assert(c2.getLeft());
-            Assert(c2.getRight());
-            samplePairs(c1, *c2.getLeft(), metric,
-                        minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
-            samplePairs(c1, *c2.getRight(), metric,
-                        minsep, minsepsq, maxsep, maxsepsq, i1, i2, sep, n, k);
-        }
+template <int D1, int D2, int B>
+void* FinishRecord2c(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2, int is_auto,
+                     int coords, int metric)
+{
+    switch(coords) {
+      case Flat:
+           return corr->finishRecord(*static_cast<Field<D1,Flat>*>(field1),
+                                     *static_cast<Field<D2,Flat>*>(field2), is_auto, metric);
+      case Sphere:
+           return corr->finishRecord(*static_cast<Field<D1,Sphere>*>(field1),
+                                     *static_cast<Field<D2,Sphere>*>(field2), is_auto, metric);
+      case ThreeD:
+           return corr->finishRecord(*static_cast<Field<D1,ThreeD>*>(field1),
+                                     *static_cast<Field<D2,ThreeD>*>(field2), is_auto, metric);
+      default:
+           Assert(false);
     }
+    return 0;
 }
 
-void SelectRandomFrom(long m, std::vector<long>& selection)
+template <int D1, int D2>
+void* FinishRecord2b(void* corr, void* field1, void* field2, int is_auto,
+                     int coords, int bin_type, int metric)
 {
-    xdbg<<"SelectRandomFrom("<<m<<", "<<selection.size()<<")\n";
-    long n = selection.size();
-    // There are two algorithms here.
-    // Floyd's algorithm is efficient for m >> n.
-    // Fisher-Yates is efficient for m not much > n.
-    // I don't know exactly the transition for when Floyd's becomes the better choice.
-    // So I'm somewhat arbitrarily picking 3*n.
-    if (m > 3*n) {
-        dbg<<"Floyd's algorithm\n";
-        // Floyd's algorithm
-        // O(n) in memory, but slightly more than O(n) in time, especially as m ~ n.
-        std::set<long> selected;
-        while (long(selected.size()) < n) {
-            double urd = urand();
-            long j = long(urd * m); // 0 <= j < m
-            if (j == m) j = m-1;    // Just in case.
-            std::pair<std::set<long>::iterator,bool> ret = selected.insert(j);
-            if (ret.second) {
-                // Then insertion happened.  I.e. not already present.
-                // Also write it to the end of the selection list
-                selection[selected.size()-1] = j;
-            }
-        }
-    } else {
-        dbg<<"Fisher-Yates\n";
-        // Fisher-Yates shuffle up through n elements
-        // O(n) in time, but O(m) in memory.
-        std::vector<long> full(m);
-        for (long i=0; i<m; ++i) full[i] = i;
-        for (long i=0; i<n; ++i) {
-            double urd = urand();
-            long j = long(urd * (m-i)); // 0 <= j < m-i
-            j += i;                     // i <= j < m
-            if (j == m) j = m-1;        // Just in case.
-            std::swap(full[i], full[j]);
-        }
-        std::copy(full.begin(), full.begin()+n, selection.begin());
+    switch(bin_type) {
+#ifdef TREECORR_USE_LOG
+      case Log:
+           return FinishRecord2c(static_cast<BinnedCorr2<D1,D2,Log>*>(corr),
+                                 field1, field2, is_auto, coords, metric);
+#endif
+#ifdef TREECORR_USE_LINEAR
+      case Linear:
+           return FinishRecord2c(static_cast<BinnedCorr2<D1,D2,Linear>*>(corr),
+                                 field1, field2, is_auto, coords, metric);
+#endif
+#ifdef TREECORR_USE_TWOD
+      case TwoD:
+           return FinishRecord2c(static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr),
+                                 field1, field2, is_auto, coords, metric);
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           return FinishRecord2c(static_cast<BinnedCorr2<D1,D2,Edges>*>(corr),
+                                 field1, field2, is_auto, coords, metric);
+#endif
+      default:
+           Assert(false);
     }
+    return 0;
 }
 
-template <int D1, int D2, int B> template <int C>
-void BinnedCorr2<D1,D2,B>::sampleFrom(
-    const Cell<D1, C>& c1, const Cell<D2, C>& c2, double rsq, double r,
-    long* i1, long* i2, double* sep, int n, long& k)
-{
-    // At the start, k pairs will already have been considered for selection.
-    // Of these min(k,n) will have been selected for inclusion in the lists.
-
-    // If we consider each pair one at a time, then the algorithm to end up with a
-    // uniform probability that any given pair is selected is as follows.
-    // 1. When k < n, always select the next pair.
-    // 2. When k >= n, select the next pair with probability n/(k+1).
-    // 3. If selected, replace a random pair currently in the list with the new pair.
-
-    // Proof that for all k >= n, all pairs fromm i=1..k have P(selected) = n/k:
-    //
-    // 1. If k==n, then all items are selected with probability 1 = n/k.
-    // 2. If true for some k>=n, then for step k+1:
-    //    - probability for i=k+1 is n/(k+1)
-    //    - probability for i<=k is
-    //      P(already selected) * P(remains in list | alread selected)
-    //      = n/k * (P(i=k+1 not selected) + P(i=k+1 is selected, but given pair is not replaced))
-    //      = n/k * ( (1 - n/(k+1)) + n/(k+1) * (n-1)/n )
-    //      = n/k * ( (k+1 - n + n-1)/(k+1) )
-    //      = n/k * ( k/(k+1) )
-    //      = n/(k+1)
-    // QED
-
-    // In practice, we usually have many pairs to add, not just one at a time.  So we want to
-    // try to do the net result of m passes of the above algorithm.
-    // Consider 3 cases:
-    // 1. k+m<=n:           Take all m pairs
-    // 2. m<=n:             Just do m passes of the above algorithm.
-    // 3. k+m>n and m>n:    Choose n pairs randomly without replacement from full k+m set.
-    //                      For the selected pairs with k<=i<k+m, either place in the next spot
-    //                      (if k<n) or randomly replace one of the ones that was already there.
-
-    long n1 = c1.getN();
-    long n2 = c2.getN();
-    long m = n1 * n2;
-
-    std::vector<const Cell<D1,C>*> leaf1 = c1.getAllLeaves();
-    std::vector<const Cell<D2,C>*> leaf2 = c2.getAllLeaves();
-
-    if (r == 0.) {
-        r = sqrt(rsq);
-    } else {
-        XAssert(std::abs(r - sqrt(rsq)) < 1.e-10*r);
+template <int D1>
+void* FinishRecord2a(void* corr, void* field1, void* field2, int is_auto,
+                     int d2, int coords, int bin_type, int metric)
+{
+    switch(d2) {
+      case NData:
+           return FinishRecord2b<D1,MAX(D1,NData)>(corr, field1, field2, is_auto,
+                                                   coords, bin_type, metric);
+      case KData:
+           return FinishRecord2b<D1,MAX(D1,KData)>(corr, field1, field2, is_auto,
+                                                   coords, bin_type, metric);
+      case GData:
+           return FinishRecord2b<D1,MAX(D1,GData)>(corr, field1, field2, is_auto,
+                                                   coords, bin_type, metric);
+      default:
+           Assert(false);
     }
-    xdbg<<"sampleFrom: "<<c1.getN()<<"  "<<c2.getN()<<"  "<<rsq<<"  "<<r<<std::endl;
-    xdbg<<"   n1,n2,k,n,m = "<<n1<<','<<n2<<','<<k<<','<<n<<','<<m<<std::endl;
-
-    if (k + m <= n) {
-        // Case 1
-        xdbg<<"Case 1: take all pairs\n";
-        for (size_t p1=0; p1<leaf1.size(); ++p1) {
-            long nn1 = leaf1[p1]->getN();
-            for (long q1=0; q1<nn1; ++q1) {
-                long index1;
-                if (nn1 == 1) index1 = leaf1[p1]->getInfo().index;
-                else index1 = (*leaf1[p1]->getListInfo().indices)[q1];
-                for (size_t p2=0; p2<leaf2.size(); ++p2) {
-                    long nn2 = leaf2[p2]->getN();
-                    for (long q2=0; q2<nn2; ++q2) {
-                        long index2;
-                        if (nn2 == 1) index2 = leaf2[p2]->getInfo().index;
-                        else index2 = (*leaf2[p2]->getListInfo().indices)[q2];
-                        i1[k] = index1;
-                        i2[k] = index2;
-                        sep[k] = r;
-                        ++k;
-                    }
-                }
-            }
-        }
-    } else if (m <= n) {
-        // Case 2
-        xdbg<<"Case 2: Check one at a time.\n";
-        for (size_t p1=0; p1<leaf1.size(); ++p1) {
-            long nn1 = leaf1[p1]->getN();
-            for (long q1=0; q1<nn1; ++q1) {
-                long index1;
-                if (nn1 == 1) index1 = leaf1[p1]->getInfo().index;
-                else index1 = (*leaf1[p1]->getListInfo().indices)[q1];
-                for (size_t p2=0; p2<leaf2.size(); ++p2) {
-                    long nn2 = leaf2[p2]->getN();
-                    for (long q2=0; q2<nn2; ++q2) {
-                        long index2;
-                        if (nn2 == 1) index2 = leaf2[p2]->getInfo().index;
-                        else index2 = (*leaf2[p2]->getListInfo().indices)[q2];
-                        long j = k;  // j is where in the lists we will place this
-                        if (k >= n) {
-                            double urd = urand(); // 0 < urd < 1
-                            j = int(urd * (k+1)); // 0 <= j < k+1
-                        }
-                        if (j < n)  {
-                            i1[j] = index1;
-                            i2[j] = index2;
-                            sep[j] = r;
-                        }
-                        ++k;
-                    }
-                }
-            }
-        }
-    } else {
-        // Case 3
-        xdbg<<"Case 3: Select n without replacement\n";
-        std::vector<long> selection(n);
-        SelectRandomFrom(k+m, selection);
-        // If any items in k<=i<n are from the original set, put them in their original place.
-        for(long i=k;i<n;++i) {
-            long j = selection[i];
-            if (j < n) std::swap(selection[i], selection[j]);
-        }
-
-        // Now any items with j >= k can replace the value at their i in this list.
-        std::map<long, long> places;
-        for(long i=0;i<n;++i) {
-            long j = selection[i];
-            if (j >= k) places[j] = i;
-        }
-        if (places.size() == 0) {
-            // If nothing selected from the new set, then we're done.
-            k += m;
-            return;
-        }
+    return 0;
+}
 
-        std::map<long, long>::iterator next = places.begin();
-
-        long i=k;  // When i is in the map, place it at places[i]
-        for (size_t p1=0; p1<leaf1.size(); ++p1) {
-            long nn1 = leaf1[p1]->getN();
-            for (long q1=0; q1<nn1; ++q1) {
-                xdbg<<"i = "<<i<<", next = "<<next->first<<"  "<<next->second<<std::endl;
-                Assert(i <= next->first);
-                if (next->first > i + n2) {
-                    // Then skip this loop through the second vector
-                    i += n2;
-                    continue;
-                }
-                long index1;
-                if (nn1 == 1) index1 = leaf1[p1]->getInfo().index;
-                else index1 = (*leaf1[p1]->getListInfo().indices)[q1];
-                for (size_t p2=0; p2<leaf2.size(); ++p2) {
-                    long nn2 = leaf2[p2]->getN();
-                    for (long q2=0; q2<nn2; ++q2,++i) {
-                        if (i == next->first) {
-                            xdbg<<"Use i = "<<i<<std::endl;
-                            long index2;
-                            if (nn2 == 1) index2 = leaf2[p2]->getInfo().index;
-                            else index2 = (*leaf2[p2]->getListInfo().indices)[q2];
-                            long j = next->second;
-                            i1[j] = index1;
-                            i2[j] = index2;
-                            sep[j] = r;
-                            ++next;
-                        }
-                        if (next == places.end()) break;
-                    }
-                    if (next == places.end()) break;
-                }
-                if (next == places.end()) break;
-            }
-            if (next == places.end()) break;
-        }
-        xdbg<<"Done: i = "<<i<<", k+m = "<<k+m<<std::endl;
-        k += m;
+void* FinishRecord2(void* corr, void* field1, void* field2, int is_auto,
+                    int d1, int d2, int coords, int bin_type, int metric)
+{
+    dbg<<"Start FinishRecord2: "<<d1<<" "<<d2<<" "<<coords<<" "<<bin_type<<std::endl;
+    switch(d1) {
+      case NData:
+           return FinishRecord2a<NData>(corr, field1, field2, is_auto, d2, coords, bin_type,
+                                         metric);
+      case KData:
+           return FinishRecord2a<KData>(corr, field1, field2, is_auto, d2, coords, bin_type,
+                                         metric);
+      case GData:
+           return FinishRecord2a<GData>(corr, field1, field2, is_auto, d2, coords, bin_type,
+                                         metric);
+      default:
+           Assert(false);
     }
+    return 0;
 }
 
-
-//
-//
-// The C interface for python
-//
-//
-
-extern "C" {
-
-#ifdef _WIN32
-#define extern __declspec(dllexport)
-#endif
-
-#include "BinnedCorr2_C.h"
+template <int D1, int D2, int B>
+int Replay2c(BinnedCorr2<D1,D2,B>* corr, const InteractionList& list,
+             void* field1, void* field2, int coords, int metric)
+{
+    switch(coords) {
+      case Flat:
+           return corr->replay(list, *static_cast<Field<D1,Flat>*>(field1),
+                               *static_cast<Field<D2,Flat>*>(field2), metric);
+      case Sphere:
+           return corr->replay(list, *static_cast<Field<D1,Sphere>*>(field1),
+                               *static_cast<Field<D2,Sphere>*>(field2), metric);
+      case ThreeD:
+           return corr->replay(list, *static_cast<Field<D1,ThreeD>*>(field1),
+                               *static_cast<Field<D2,ThreeD>*>(field2), metric);
+      default:
+           Assert(false);
+    }
+    return 0;
 }
 
 template <int D1, int D2>
-void* BuildCorr2b(int bin_type,
-                  double minsep, double maxsep, int nbins, double binsize, double b,
-                  double minrpar, double maxrpar, double xp, double yp, double zp,
-                  double* xi0, double* xi1, double* xi2, double* xi3,
-                  double* meanr, double* meanlogr, double* weight, double* npairs)
+int Replay2b(void* corr, const InteractionList& list, void* field1, void* field2,
+             int coords, int bin_type, int metric)
 {
     switch(bin_type) {
+#ifdef TREECORR_USE_LOG
       case Log:
-           return static_cast<void*>(new BinnedCorr2<D1,D2,Log>(
-                   minsep, maxsep, nbins, binsize, b, minrpar, maxrpar, xp, yp, zp,
-                   xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs));
-           break;
+           return Replay2c(static_cast<BinnedCorr2<D1,D2,Log>*>(corr),
+                           list, field1, field2, coords, metric);
+#endif
+#ifdef TREECORR_USE_LINEAR
       case Linear:
-           return static_cast<void*>(new BinnedCorr2<D1,D2,Linear>(
-                   minsep, maxsep, nbins, binsize, b, minrpar, maxrpar, xp, yp, zp,
-                   xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs));
-           break;
+           return Replay2c(static_cast<BinnedCorr2<D1,D2,Linear>*>(corr),
+                           list, field1, field2, coords, metric);
+#endif
+#ifdef TREECORR_USE_TWOD
       case TwoD:
-           return static_cast<void*>(new BinnedCorr2<D1,D2,TwoD>(
-                   minsep, maxsep, nbins, binsize, b, minrpar, maxrpar, xp, yp, zp,
-                   xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs));
-           break;
+           return Replay2c(static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr),
+                           list, field1, field2, coords, metric);
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           return Replay2c(static_cast<BinnedCorr2<D1,D2,Edges>*>(corr),
+                           list, field1, field2, coords, metric);
+#endif
       default:
            Assert(false);
     }
@@ -1004,364 +3624,544 @@ void* BuildCorr2b(int bin_type,
 }
 
 template <int D1>
-void* BuildCorr2a(int d2, int bin_type,
-                  double minsep, double maxsep, int nbins, double binsize, double b,
-                  double minrpar, double maxrpar, double xp, double yp, double zp,
-                  double* xi0, double* xi1, double* xi2, double* xi3,
-                  double* meanr, double* meanlogr, double* weight, double* npairs)
+int Replay2a(void* corr, const InteractionList& list, void* field1, void* field2,
+             int d2, int coords, int bin_type, int metric)
 {
-    // Note: we only ever call this with d2 >= d1, so the MAX bit below is equivalent to
-    // just using d2 for the cases that actually get called, but doing this saves some
-    // compile time and some size in the final library from not instantiating templates
-    // that aren't needed.
     switch(d2) {
       case NData:
-           return BuildCorr2b<D1,MAX(D1,NData)>(bin_type,
-                                                minsep, maxsep, nbins, binsize, b,
-                                                minrpar, maxrpar, xp, yp, zp,
-                                                xi0, xi1, xi2, xi3,
-                                                meanr, meanlogr, weight, npairs);
-           break;
+           return Replay2b<D1,MAX(D1,NData)>(corr, list, field1, field2, coords, bin_type,
+                                              metric);
       case KData:
-           return BuildCorr2b<D1,MAX(D1,KData)>(bin_type,
-                                                minsep, maxsep, nbins, binsize, b,
-                                                minrpar, maxrpar, xp, yp, zp,
-                                                xi0, xi1, xi2, xi3,
-                                                meanr, meanlogr, weight, npairs);
-           break;
+           return Replay2b<D1,MAX(D1,KData)>(corr, list, field1, field2, coords, bin_type,
+                                              metric);
       case GData:
-           return BuildCorr2b<D1,MAX(D1,GData)>(bin_type,
-                                                minsep, maxsep, nbins, binsize, b,
-                                                minrpar, maxrpar, xp, yp, zp,
-                                                xi0, xi1, xi2, xi3,
-                                                meanr, meanlogr, weight, npairs);
-           break;
+           return Replay2b<D1,MAX(D1,GData)>(corr, list, field1, field2, coords, bin_type,
+                                              metric);
       default:
            Assert(false);
     }
     return 0;
 }
 
-
-void* BuildCorr2(int d1, int d2, int bin_type,
-                 double minsep, double maxsep, int nbins, double binsize, double b,
-                 double minrpar, double maxrpar, double xp, double yp, double zp,
-                 double* xi0, double* xi1, double* xi2, double* xi3,
-                 double* meanr, double* meanlogr, double* weight, double* npairs)
+// Returns 0 if the list doesn't match the fields, in which case nothing is accumulated.
+int Replay2(void* corr, void* list, void* field1, void* field2,
+            int d1, int d2, int coords, int bin_type, int metric)
 {
-    dbg<<"Start BuildCorr2: "<<d1<<" "<<d2<<" "<<bin_type<<std::endl;
-    void* corr=0;
+    dbg<<"Start Replay2: "<<d1<<" "<<d2<<" "<<coords<<" "<<bin_type<<std::endl;
+    const InteractionList& ilist = *static_cast<InteractionList*>(list);
     switch(d1) {
       case NData:
-           corr = BuildCorr2a<NData>(d2, bin_type,
-                                     minsep, maxsep, nbins, binsize, b,
-                                     minrpar, maxrpar, xp, yp, zp,
-                                     xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs);
-           break;
+           return Replay2a<NData>(corr, ilist, field1, field2, d2, coords, bin_type, metric);
       case KData:
-           corr = BuildCorr2a<KData>(d2, bin_type,
-                                     minsep, maxsep, nbins, binsize, b,
-                                     minrpar, maxrpar, xp, yp, zp,
-                                     xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs);
-           break;
+           return Replay2a<KData>(corr, ilist, field1, field2, d2, coords, bin_type, metric);
       case GData:
-           corr = BuildCorr2a<GData>(d2, bin_type,
-                                     minsep, maxsep, nbins, binsize, b,
-                                     minrpar, maxrpar, xp, yp, zp,
-                                     xi0, xi1, xi2, xi3, meanr, meanlogr, weight, npairs);
+           return Replay2a<GData>(corr, ilist, field1, field2, d2, coords, bin_type, metric);
+      default:
+           Assert(false);
+    }
+    return 0;
+}
+
+template <int M, int B>
+void ProcessMultiCross2c(MultiCorr2<B>& mc2, void* field1, void* field2n, void* field2k,
+                         void* field2g, int dots, int coords)
+{
+    const bool P = mc2.nontrivialRPar();
+    dbg<<"ProcessMultiCross: coords = "<<coords<<", metric = "<<M<<", P = "<<P<<std::endl;
+
+    switch(coords) {
+      case Flat:
+           Assert((MetricHelper<M,0>::_Flat == int(Flat)));
+           Assert(!P);
+           mc2.template process<MetricHelper<M,0>::_Flat, M, false>(
+               *static_cast<Field<NData,MetricHelper<M,0>::_Flat>*>(field1),
+               static_cast<Field<NData,MetricHelper<M,0>::_Flat>*>(field2n),
+               static_cast<Field<KData,MetricHelper<M,0>::_Flat>*>(field2k),
+               static_cast<Field<GData,MetricHelper<M,0>::_Flat>*>(field2g), dots);
+           break;
+      case Sphere:
+           Assert((MetricHelper<M,0>::_Sphere == int(Sphere)));
+           Assert(!P);
+           mc2.template process<MetricHelper<M,0>::_Sphere, M, false>(
+               *static_cast<Field<NData,MetricHelper<M,0>::_Sphere>*>(field1),
+               static_cast<Field<NData,MetricHelper<M,0>::_Sphere>*>(field2n),
+               static_cast<Field<KData,MetricHelper<M,0>::_Sphere>*>(field2k),
+               static_cast<Field<GData,MetricHelper<M,0>::_Sphere>*>(field2g), dots);
+           break;
+      case ThreeD:
+           Assert((MetricHelper<M,0>::_ThreeD == int(ThreeD)));
+           if (P)
+               mc2.template process<MetricHelper<M,1>::_ThreeD, M, true>(
+                   *static_cast<Field<NData,MetricHelper<M,1>::_ThreeD>*>(field1),
+                   static_cast<Field<NData,MetricHelper<M,1>::_ThreeD>*>(field2n),
+                   static_cast<Field<KData,MetricHelper<M,1>::_ThreeD>*>(field2k),
+                   static_cast<Field<GData,MetricHelper<M,1>::_ThreeD>*>(field2g), dots);
+           else
+               mc2.template process<MetricHelper<M,0>::_ThreeD, M, false>(
+                   *static_cast<Field<NData,MetricHelper<M,0>::_ThreeD>*>(field1),
+                   static_cast<Field<NData,MetricHelper<M,0>::_ThreeD>*>(field2n),
+                   static_cast<Field<KData,MetricHelper<M,0>::_ThreeD>*>(field2k),
+                   static_cast<Field<GData,MetricHelper<M,0>::_ThreeD>*>(field2g), dots);
            break;
       default:
            Assert(false);
     }
-    xdbg<<"corr = "<<corr<<std::endl;
-    return corr;
 }
 
-template <int D1, int D2>
-void DestroyCorr2b(void* corr, int bin_type)
+template <int B>
+void ProcessMultiCross2b(void* corr_nn, void* corr_nk, void* corr_ng,
+                         void* field1, void* field2n, void* field2k, void* field2g,
+                         int dots, int coords, int metric)
 {
-    switch(bin_type) {
-      case Log:
-           delete static_cast<BinnedCorr2<D1,D2,Log>*>(corr);
+    MultiCorr2<B> mc2(static_cast<BinnedCorr2<NData,NData,B>*>(corr_nn),
+                      static_cast<BinnedCorr2<NData,KData,B>*>(corr_nk),
+                      static_cast<BinnedCorr2<NData,GData,B>*>(corr_ng));
+    switch(metric) {
+#ifdef TREECORR_USE_EUCLIDEAN
+      case Euclidean:
+           ProcessMultiCross2c<Euclidean>(mc2, field1, field2n, field2k, field2g, dots, coords);
            break;
-      case Linear:
-           delete static_cast<BinnedCorr2<D1,D2,Linear>*>(corr);
+#endif
+#ifdef TREECORR_USE_RPERP
+      case Rperp:
+           ProcessMultiCross2c<Rperp>(mc2, field1, field2n, field2k, field2g, dots, coords);
            break;
-      case TwoD:
-           delete static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr);
+#endif
+#ifdef TREECORR_USE_OLDRPERP
+      case OldRperp:
+           ProcessMultiCross2c<OldRperp>(mc2, field1, field2n, field2k, field2g, dots, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_RLENS
+      case Rlens:
+           ProcessMultiCross2c<Rlens>(mc2, field1, field2n, field2k, field2g, dots, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_ARC
+      case Arc:
+           ProcessMultiCross2c<Arc>(mc2, field1, field2n, field2k, field2g, dots, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_PERIODIC
+      case Periodic:
+           ProcessMultiCross2c<Periodic>(mc2, field1, field2n, field2k, field2g, dots, coords);
            break;
+#endif
       default:
            Assert(false);
     }
 }
 
-template <int D1>
-void DestroyCorr2a(void* corr, int d2, int bin_type)
+void ProcessMultiCross2(void* corr_nn, void* corr_nk, void* corr_ng,
+                        void* field1, void* field2n, void* field2k, void* field2g,
+                        int dots, int coords, int bin_type, int metric)
 {
-    switch(d2) {
-      case NData:
-           DestroyCorr2b<D1,MAX(D1,NData)>(corr, bin_type);
+    dbg<<"Start ProcessMultiCross2: "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
+
+    switch(bin_type) {
+#ifdef TREECORR_USE_LOG
+      case Log:
+           ProcessMultiCross2b<Log>(corr_nn, corr_nk, corr_ng, field1, field2n, field2k, field2g,
+                                    dots, coords, metric);
            break;
-      case KData:
-           DestroyCorr2b<D1,MAX(D1,KData)>(corr, bin_type);
+#endif
+#ifdef TREECORR_USE_LINEAR
+      case Linear:
+           ProcessMultiCross2b<Linear>(corr_nn, corr_nk, corr_ng, field1, field2n, field2k,
+                                       field2g, dots, coords, metric);
            break;
-      case GData:
-           DestroyCorr2b<D1,MAX(D1,GData)>(corr, bin_type);
+#endif
+#ifdef TREECORR_USE_TWOD
+      case TwoD:
+           ProcessMultiCross2b<TwoD>(corr_nn, corr_nk, corr_ng, field1, field2n, field2k,
+                                     field2g, dots, coords, metric);
+           break;
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           ProcessMultiCross2b<Edges>(corr_nn, corr_nk, corr_ng, field1, field2n, field2k,
+                                      field2g, dots, coords, metric);
            break;
+#endif
       default:
            Assert(false);
     }
 }
 
-void DestroyCorr2(void* corr, int d1, int d2, int bin_type)
+// Likewise, the auto-correlation in MultiKCorr2 is only valid for KK.
+template <int D1, int B, int C, int M, int P>
+struct MultiKAutoHelper
 {
-    dbg<<"Start DestroyCorr2: "<<d1<<" "<<d2<<" "<<bin_type<<std::endl;
-    xdbg<<"corr = "<<corr<<std::endl;
-    switch(d1) {
-      case NData:
-           DestroyCorr2a<NData>(corr, d2, bin_type);
-           break;
-      case KData:
-           DestroyCorr2a<KData>(corr, d2, bin_type);
-           break;
-      case GData:
-           DestroyCorr2a<GData>(corr, d2, bin_type);
-           break;
-      default:
-           Assert(false);
+    static void process(MultiKCorr2<D1,B>& , const PackedTree<D1,C>& ,
+                        const PackedChannels<D1,C>& , bool )
+    { Assert(false); }
+};
+
+template <int B, int C, int M, int P>
+struct MultiKAutoHelper<KData,B,C,M,P>
+{
+    static void process(MultiKCorr2<KData,B>& mk2, const PackedTree<KData,C>& t,
+                        const PackedChannels<KData,C>& k, bool dots)
+    { mk2.template process<C,M,P>(t, k, dots); }
+};
+
+// The PackedTree of a Field, or if it wasn't built with one, a new one in local.
+template <int D, int C>
+const PackedTree<D,C>* GetPackedTree(const Field<D,C>& field, PackedTree<D,C>*& local)
+{
+    const PackedTree<D,C>* packed = field.getPacked();
+    if (!packed) packed = local = new PackedTree<D,C>(field.getCells());
+    return packed;
+}
+
+template <int D1, int B, int C, int M, int P>
+void ProcessMultiK2d(MultiKCorr2<D1,B>& mk2, void* field1, void* field2,
+                     const double* k1, const double* w1, int nchan1,
+                     const double* k2, const double* w2, int nchan2, int dots)
+{
+    const Field<D1,C>& f1 = *static_cast<Field<D1,C>*>(field1);
+    PackedTree<D1,C>* local1 = 0;
+    const PackedTree<D1,C>* t1 = GetPackedTree(f1, local1);
+    PackedChannels<D1,C>* c1 = k1 ? new PackedChannels<D1,C>(*t1, k1, w1, nchan1,
+                                                             f1.getNObj()) : 0;
+    if (field2) {
+        const Field<KData,C>& f2 = *static_cast<Field<KData,C>*>(field2);
+        PackedTree<KData,C>* local2 = 0;
+        const PackedTree<KData,C>* t2 = GetPackedTree(f2, local2);
+        PackedChannels<KData,C> c2(*t2, k2, w2, nchan2, f2.getNObj());
+        mk2.template process<C,M,P>(*t1, c1, *t2, c2, dots);
+        delete local2;
+    } else {
+        Assert(c1);
+        MultiKAutoHelper<D1,B,C,M,P>::process(mk2, *t1, *c1, dots);
     }
+    delete c1;
+    delete local1;
 }
 
-template <int M, int D, int B>
-void ProcessAuto2d(BinnedCorr2<D,D,B>* corr, void* field, int dots, int coords)
+template <int M, int D1, int B>
+void ProcessMultiK2c(MultiKCorr2<D1,B>& mk2, void* field1, void* field2,
+                     const double* k1, const double* w1, int nchan1,
+                     const double* k2, const double* w2, int nchan2, int dots, int coords)
 {
-    const bool P = corr->nontrivialRPar();
-    dbg<<"ProcessAuto: coords = "<<coords<<", metric = "<<M<<", P = "<<P<<std::endl;
+    const bool P = mk2.nontrivialRPar();
+    dbg<<"ProcessMultiK: coords = "<<coords<<", metric = "<<M<<", P = "<<P<<std::endl;
 
     switch(coords) {
       case Flat:
            Assert((MetricHelper<M,0>::_Flat == int(Flat)));
            Assert(!P);
-           corr->template process<MetricHelper<M,0>::_Flat, M, false>(
-               *static_cast<Field<D,MetricHelper<M,0>::_Flat>*>(field), dots);
+           ProcessMultiK2d<D1,B,MetricHelper<M,0>::_Flat,M,false>(
+               mk2, field1, field2, k1, w1, nchan1, k2, w2, nchan2, dots);
            break;
       case Sphere:
            Assert((MetricHelper<M,0>::_Sphere == int(Sphere)));
            Assert(!P);
-           corr->template process<MetricHelper<M,0>::_Sphere, M, false>(
-               *static_cast<Field<D,MetricHelper<M,0>::_Sphere>*>(field), dots);
+           ProcessMultiK2d<D1,B,MetricHelper<M,0>::_Sphere,M,false>(
+               mk2, field1, field2, k1, w1, nchan1, k2, w2, nchan2, dots);
            break;
       case ThreeD:
            Assert((MetricHelper<M,0>::_ThreeD == int(ThreeD)));
            if (P)
-               corr->template process<MetricHelper<M,1>::_ThreeD, M, true>(
-                   *static_cast<Field<D,MetricHelper<M,1>::_ThreeD>*>(field), dots);
+               ProcessMultiK2d<D1,B,MetricHelper<M,1>::_ThreeD,M,true>(
+                   mk2, field1, field2, k1, w1, nchan1, k2, w2, nchan2, dots);
            else
-               corr->template process<MetricHelper<M,0>::_ThreeD, M, false>(
-                   *static_cast<Field<D,MetricHelper<M,0>::_ThreeD>*>(field), dots);
+               ProcessMultiK2d<D1,B,MetricHelper<M,0>::_ThreeD,M,false>(
+                   mk2, field1, field2, k1, w1, nchan1, k2, w2, nchan2, dots);
            break;
       default:
            Assert(false);
     }
 }
 
-template <int D, int B>
-void ProcessAuto2c(BinnedCorr2<D,D,B>* corr, void* field, int dots,
-                   int coords, int metric)
+template <int D1, int B>
+void ProcessMultiK2b(void* corr, void* field1, void* field2,
+                     const double* k1, const double* w1, int nchan1,
+                     const double* k2, const double* w2, int nchan2,
+                     double* xi, int dots, int coords, int metric)
 {
+    MultiKCorr2<D1,B> mk2(static_cast<BinnedCorr2<D1,KData,B>*>(corr), xi, nchan1, nchan2);
     switch(metric) {
+#ifdef TREECORR_USE_EUCLIDEAN
       case Euclidean:
-           ProcessAuto2d<Euclidean>(corr, field, dots, coords);
+           ProcessMultiK2c<Euclidean>(mk2, field1, field2, k1, w1, nchan1, k2, w2, nchan2,
+                                      dots, coords);
            break;
+#endif
+#ifdef TREECORR_USE_RPERP
       case Rperp:
-           ProcessAuto2d<Rperp>(corr, field, dots, coords);
+           ProcessMultiK2c<Rperp>(mk2, field1, field2, k1, w1, nchan1, k2, w2, nchan2,
+                                  dots, coords);
            break;
+#endif
+#ifdef TREECORR_USE_OLDRPERP
       case OldRperp:
-           ProcessAuto2d<OldRperp>(corr, field, dots, coords);
+           ProcessMultiK2c<OldRperp>(mk2, field1, field2, k1, w1, nchan1, k2, w2, nchan2,
+                                     dots, coords);
            break;
+#endif
+#ifdef TREECORR_USE_RLENS
       case Rlens:
-           ProcessAuto2d<Rlens>(corr, field, dots, coords);
+           ProcessMultiK2c<Rlens>(mk2, field1, field2, k1, w1, nchan1, k2, w2, nchan2,
+                                  dots, coords);
            break;
+#endif
+#ifdef TREECORR_USE_ARC
       case Arc:
-           ProcessAuto2d<Arc>(corr, field, dots, coords);
+           ProcessMultiK2c<Arc>(mk2, field1, field2, k1, w1, nchan1, k2, w2, nchan2,
+                                dots, coords);
            break;
+#endif
+#ifdef TREECORR_USE_PERIODIC
       case Periodic:
-           ProcessAuto2d<Periodic>(corr, field, dots, coords);
+           ProcessMultiK2c<Periodic>(mk2, field1, field2, k1, w1, nchan1, k2, w2, nchan2,
+                                     dots, coords);
            break;
+#endif
       default:
            Assert(false);
     }
 }
 
-template <int D>
-void ProcessAuto2b(void* corr, void* field, int dots, int coords, int bin_type, int metric)
+template <int D1>
+void ProcessMultiK2a(void* corr, void* field1, void* field2,
+                     const double* k1, const double* w1, int nchan1,
+                     const double* k2, const double* w2, int nchan2,
+                     double* xi, int dots, int coords, int bin_type, int metric)
 {
     switch(bin_type) {
+#ifdef TREECORR_USE_LOG
       case Log:
-           ProcessAuto2c(static_cast<BinnedCorr2<D,D,Log>*>(corr), field, dots, coords, metric);
+           ProcessMultiK2b<D1,Log>(corr, field1, field2, k1, w1, nchan1, k2, w2, nchan2,
+                                   xi, dots, coords, metric);
            break;
+#endif
+#ifdef TREECORR_USE_LINEAR
       case Linear:
-           ProcessAuto2c(static_cast<BinnedCorr2<D,D,Linear>*>(corr), field, dots, coords, metric);
+           ProcessMultiK2b<D1,Linear>(corr, field1, field2, k1, w1, nchan1, k2, w2, nchan2,
+                                      xi, dots, coords, metric);
            break;
+#endif
+#ifdef TREECORR_USE_TWOD
       case TwoD:
-           ProcessAuto2c(static_cast<BinnedCorr2<D,D,TwoD>*>(corr), field, dots, coords, metric);
+           ProcessMultiK2b<D1,TwoD>(corr, field1, field2, k1, w1, nchan1, k2, w2, nchan2,
+                                    xi, dots, coords, metric);
            break;
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           ProcessMultiK2b<D1,Edges>(corr, field1, field2, k1, w1, nchan1, k2, w2, nchan2,
+                                     xi, dots, coords, metric);
+           break;
+#endif
       default:
            Assert(false);
     }
 }
 
-void ProcessAuto2(void* corr, void* field, int dots,
-                  int d, int coords, int bin_type, int metric)
+void ProcessMultiK2(void* corr, void* field1, void* field2,
+                    const double* k1, const double* w1, int nchan1,
+                    const double* k2, const double* w2, int nchan2,
+                    double* xi, int dots, int d1, int coords, int bin_type, int metric)
 {
-    dbg<<"Start ProcessAuto2: "<<d<<" "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
+    dbg<<"Start ProcessMultiK2: "<<d1<<" "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
+    TraceSpan span("ProcessMultiK2", nchan1, nchan2);
 
-    switch(d) {
+    switch(d1) {
       case NData:
-           ProcessAuto2b<NData>(corr, field, dots, coords, bin_type, metric);
+           ProcessMultiK2a<NData>(corr, field1, field2, k1, w1, nchan1, k2, w2, nchan2,
+                                  xi, dots, coords, bin_type, metric);
            break;
       case KData:
-           ProcessAuto2b<KData>(corr, field, dots, coords, bin_type, metric);
-           break;
-      case GData:
-           ProcessAuto2b<GData>(corr, field, dots, coords, bin_type, metric);
+           ProcessMultiK2a<KData>(corr, field1, field2, k1, w1, nchan1, k2, w2, nchan2,
+                                  xi, dots, coords, bin_type, metric);
            break;
       default:
            Assert(false);
     }
 }
 
-template <int M, int D1, int D2, int B>
-void ProcessCross2d(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2, int dots, int coords)
+// The auto-correlation is only valid when D1 == D2, but the switch on coords below has
+// to compile for all of them.
+template <int D1, int D2, int C, int M, int P>
+struct MultiBinAutoHelper
 {
-    const bool P = corr->nontrivialRPar();
-    dbg<<"ProcessCross: coords = "<<coords<<", metric = "<<M<<", P = "<<P<<std::endl;
+    static void process(MultiBinCorr2<D1,D2>& , const Field<D1,C>& , bool ) { Assert(false); }
+};
+
+template <int D, int C, int M, int P>
+struct MultiBinAutoHelper<D,D,C,M,P>
+{
+    static void process(MultiBinCorr2<D,D>& mbc2, const Field<D,C>& field, bool dots)
+    { mbc2.template process<C,M,P>(field, dots); }
+};
 
+template <int M, int D1, int D2>
+void ProcessMultiBin2c(MultiBinCorr2<D1,D2>& mbc2, void* field1, void* field2, int dots,
+                       int coords)
+{
+    const bool P = mbc2.nontrivialRPar();
+    dbg<<"ProcessMultiBin: coords = "<<coords<<", metric = "<<M<<", P = "<<P<<std::endl;
+
+    // field2 is null for an auto-correlation.  (Then D1 == D2.)
     switch(coords) {
       case Flat:
            Assert((MetricHelper<M,0>::_Flat == int(Flat)));
            Assert(!P);
-           corr->template process<MetricHelper<M,0>::_Flat, M, false>(
-               *static_cast<Field<D1,MetricHelper<M,0>::_Flat>*>(field1),
-               *static_cast<Field<D2,MetricHelper<M,0>::_Flat>*>(field2), dots);
+           if (field2)
+               mbc2.template process<MetricHelper<M,0>::_Flat, M, false>(
+                   *static_cast<Field<D1,MetricHelper<M,0>::_Flat>*>(field1),
+                   *static_cast<Field<D2,MetricHelper<M,0>::_Flat>*>(field2), dots);
+           else
+               MultiBinAutoHelper<D1,D2,MetricHelper<M,0>::_Flat,M,false>::process(
+                   mbc2, *static_cast<Field<D1,MetricHelper<M,0>::_Flat>*>(field1), dots);
            break;
       case Sphere:
            Assert((MetricHelper<M,0>::_Sphere == int(Sphere)));
            Assert(!P);
-           corr->template process<MetricHelper<M,0>::_Sphere, M, false>(
-               *static_cast<Field<D1,MetricHelper<M,0>::_Sphere>*>(field1),
-               *static_cast<Field<D2,MetricHelper<M,0>::_Sphere>*>(field2), dots);
+           if (field2)
+               mbc2.template process<MetricHelper<M,0>::_Sphere, M, false>(
+                   *static_cast<Field<D1,MetricHelper<M,0>::_Sphere>*>(field1),
+                   *static_cast<Field<D2,MetricHelper<M,0>::_Sphere>*>(field2), dots);
+           else
+               MultiBinAutoHelper<D1,D2,MetricHelper<M,0>::_Sphere,M,false>::process(
+                   mbc2, *static_cast<Field<D1,MetricHelper<M,0>::_Sphere>*>(field1), dots);
            break;
       case ThreeD:
            Assert((MetricHelper<M,0>::_ThreeD == int(ThreeD)));
-           if (P)
-               corr->template process<MetricHelper<M,1>::_ThreeD, M, true>(
-                   *static_cast<Field<D1,MetricHelper<M,1>::_ThreeD>*>(field1),
-                   *static_cast<Field<D2,MetricHelper<M,1>::_ThreeD>*>(field2), dots);
-           else
-               corr->template process<MetricHelper<M,0>::_ThreeD, M, false>(
-                   *static_cast<Field<D1,MetricHelper<M,0>::_ThreeD>*>(field1),
-                   *static_cast<Field<D2,MetricHelper<M,0>::_ThreeD>*>(field2), dots);
+           if (P) {
+               if (field2)
+                   mbc2.template process<MetricHelper<M,1>::_ThreeD, M, true>(
+                       *static_cast<Field<D1,MetricHelper<M,1>::_ThreeD>*>(field1),
+                       *static_cast<Field<D2,MetricHelper<M,1>::_ThreeD>*>(field2), dots);
+               else
+                   MultiBinAutoHelper<D1,D2,MetricHelper<M,1>::_ThreeD,M,true>::process(
+                       mbc2, *static_cast<Field<D1,MetricHelper<M,1>::_ThreeD>*>(field1), dots);
+           } else {
+               if (field2)
+                   mbc2.template process<MetricHelper<M,0>::_ThreeD, M, false>(
+                       *static_cast<Field<D1,MetricHelper<M,0>::_ThreeD>*>(field1),
+                       *static_cast<Field<D2,MetricHelper<M,0>::_ThreeD>*>(field2), dots);
+               else
+                   MultiBinAutoHelper<D1,D2,MetricHelper<M,0>::_ThreeD,M,false>::process(
+                       mbc2, *static_cast<Field<D1,MetricHelper<M,0>::_ThreeD>*>(field1), dots);
+           }
            break;
       default:
            Assert(false);
     }
 }
 
-template <int D1, int D2, int B>
-void ProcessCross2c(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2, int dots,
-                    int coords, int metric)
+template <int D1, int D2>
+void ProcessMultiBin2b(void** corrs, int* bin_types, int ncorrs,
+                       void* field1, void* field2, int dots, int coords, int metric)
 {
+    std::vector<BinnedCorr2<D1,D2,Log>*> log_corrs;
+    std::vector<BinnedCorr2<D1,D2,Linear>*> linear_corrs;
+    std::vector<BinnedCorr2<D1,D2,TwoD>*> twod_corrs;
+    for (int i=0; i<ncorrs; ++i) {
+        switch(bin_types[i]) {
+#ifdef TREECORR_USE_LOG
+          case Log:
+               log_corrs.push_back(static_cast<BinnedCorr2<D1,D2,Log>*>(corrs[i]));
+               break;
+#endif
+#ifdef TREECORR_USE_LINEAR
+          case Linear:
+               linear_corrs.push_back(static_cast<BinnedCorr2<D1,D2,Linear>*>(corrs[i]));
+               break;
+#endif
+#ifdef TREECORR_USE_TWOD
+          case TwoD:
+               twod_corrs.push_back(static_cast<BinnedCorr2<D1,D2,TwoD>*>(corrs[i]));
+               break;
+#endif
+          default:
+               Assert(false);
+        }
+    }
+    MultiBinCorr2<D1,D2> mbc2(log_corrs, linear_corrs, twod_corrs);
+
     switch(metric) {
+#ifdef TREECORR_USE_EUCLIDEAN
       case Euclidean:
-           ProcessCross2d<Euclidean>(corr, field1, field2, dots, coords);
+           ProcessMultiBin2c<Euclidean>(mbc2, field1, field2, dots, coords);
            break;
+#endif
+#ifdef TREECORR_USE_RPERP
       case Rperp:
-           ProcessCross2d<Rperp>(corr, field1, field2, dots, coords);
+           ProcessMultiBin2c<Rperp>(mbc2, field1, field2, dots, coords);
            break;
+#endif
+#ifdef TREECORR_USE_OLDRPERP
       case OldRperp:
-           ProcessCross2d<OldRperp>(corr, field1, field2, dots, coords);
+           ProcessMultiBin2c<OldRperp>(mbc2, field1, field2, dots, coords);
            break;
+#endif
+#ifdef TREECORR_USE_RLENS
       case Rlens:
-           ProcessCross2d<Rlens>(corr, field1, field2, dots, coords);
+           ProcessMultiBin2c<Rlens>(mbc2, field1, field2, dots, coords);
            break;
+#endif
+#ifdef TREECORR_USE_ARC
       case Arc:
-           ProcessCross2d<Arc>(corr, field1, field2, dots, coords);
+           ProcessMultiBin2c<Arc>(mbc2, field1, field2, dots, coords);
            break;
+#endif
+#ifdef TREECORR_USE_PERIODIC
       case Periodic:
-           ProcessCross2d<Periodic>(corr, field1, field2, dots, coords);
-           break;
-      default:
-           Assert(false);
-    }
-}
-
-template <int D1, int D2>
-void ProcessCross2b(void* corr, void* field1, void* field2, int dots,
-                    int coords, int bin_type, int metric)
-{
-    switch(bin_type) {
-      case Log:
-           ProcessCross2c(static_cast<BinnedCorr2<D1,D2,Log>*>(corr), field1, field2, dots,
-                          coords, metric);
-           break;
-      case Linear:
-           ProcessCross2c(static_cast<BinnedCorr2<D1,D2,Linear>*>(corr), field1, field2, dots,
-                          coords, metric);
-           break;
-      case TwoD:
-           ProcessCross2c(static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr), field1, field2, dots,
-                          coords, metric);
+           ProcessMultiBin2c<Periodic>(mbc2, field1, field2, dots, coords);
            break;
+#endif
       default:
            Assert(false);
     }
 }
 
 template <int D1>
-void ProcessCross2a(void* corr, void* field1, void* field2, int dots,
-                    int d2, int coords, int bin_type, int metric)
+void ProcessMultiBin2a(void** corrs, int* bin_types, int ncorrs,
+                       void* field1, void* field2, int dots,
+                       int d2, int coords, int metric)
 {
-    // Note: we only ever call this with d2 >= d1, so the MAX bit below is equivalent to
-    // just using d2 for the cases that actually get called, but doing this saves some
-    // compile time and some size in the final library from not instantiating templates
-    // that aren't needed.
+    // As for ProcessCross2a, we only ever call this with d2 >= d1.
     Assert(d2 >= D1);
     switch(d2) {
       case NData:
-           ProcessCross2b<D1,MAX(D1,NData)>(corr, field1, field2, dots,
-                                            coords, bin_type, metric);
+           ProcessMultiBin2b<D1,MAX(D1,NData)>(corrs, bin_types, ncorrs, field1, field2, dots,
+                                               coords, metric);
            break;
       case KData:
-           ProcessCross2b<D1,MAX(D1,KData)>(corr, field1, field2, dots,
-                                            coords, bin_type, metric);
+           ProcessMultiBin2b<D1,MAX(D1,KData)>(corrs, bin_types, ncorrs, field1, field2, dots,
+                                               coords, metric);
            break;
       case GData:
-           ProcessCross2b<D1,MAX(D1,GData)>(corr, field1, field2, dots,
-                                            coords, bin_type, metric);
+           ProcessMultiBin2b<D1,MAX(D1,GData)>(corrs, bin_types, ncorrs, field1, field2, dots,
+                                               coords, metric);
            break;
       default:
            Assert(false);
     }
 }
 
-void ProcessCross2(void* corr, void* field1, void* field2, int dots,
-                   int d1, int d2, int coords, int bin_type, int metric)
+void ProcessMultiBin2(void** corrs, int* bin_types, int ncorrs,
+                      void* field1, void* field2, int dots,
+                      int d1, int d2, int coords, int metric)
 {
-    dbg<<"Start ProcessCross2: "<<d1<<" "<<d2<<" "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
+    dbg<<"Start ProcessMultiBin2: "<<ncorrs<<" "<<d1<<" "<<d2<<" "<<coords<<" "<<metric<<std::endl;
+    Assert(field2 || d1 == d2);
 
     switch(d1) {
       case NData:
-           ProcessCross2a<NData>(corr, field1, field2, dots,
-                                 d2, coords, bin_type, metric);
+           ProcessMultiBin2a<NData>(corrs, bin_types, ncorrs, field1, field2, dots,
+                                    d2, coords, metric);
            break;
       case KData:
-           ProcessCross2a<KData>(corr, field1, field2, dots,
-                                 d2, coords, bin_type, metric);
+           ProcessMultiBin2a<KData>(corrs, bin_types, ncorrs, field1, field2, dots,
+                                    d2, coords, metric);
            break;
       case GData:
-           ProcessCross2a<GData>(corr, field1, field2, dots,
-                                 d2, coords, bin_type, metric);
+           ProcessMultiBin2a<GData>(corrs, bin_types, ncorrs, field1, field2, dots,
+                                    d2, coords, metric);
            break;
       default:
            Assert(false);
@@ -1410,24 +4210,36 @@ void ProcessPair2c(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2, int d
                    int coords, int metric)
 {
     switch(metric) {
+#ifdef TREECORR_USE_EUCLIDEAN
       case Euclidean:
            ProcessPair2d<Euclidean>(corr, field1, field2, dots, coords);
            break;
+#endif
+#ifdef TREECORR_USE_RPERP
       case Rperp:
            ProcessPair2d<Rperp>(corr, field1, field2, dots, coords);
            break;
+#endif
+#ifdef TREECORR_USE_OLDRPERP
       case OldRperp:
            ProcessPair2d<OldRperp>(corr, field1, field2, dots, coords);
            break;
+#endif
+#ifdef TREECORR_USE_RLENS
       case Rlens:
            ProcessPair2d<Rlens>(corr, field1, field2, dots, coords);
            break;
+#endif
+#ifdef TREECORR_USE_ARC
       case Arc:
            ProcessPair2d<Arc>(corr, field1, field2, dots, coords);
            break;
+#endif
+#ifdef TREECORR_USE_PERIODIC
       case Periodic:
            ProcessPair2d<Periodic>(corr, field1, field2, dots, coords);
            break;
+#endif
       default:
            Assert(false);
     }
@@ -1438,18 +4250,30 @@ void ProcessPair2b(void* corr, void* field1, void* field2, int dots,
                    int coords, int bin_type, int metric)
 {
     switch(bin_type) {
+#ifdef TREECORR_USE_LOG
       case Log:
            ProcessPair2c(static_cast<BinnedCorr2<D1,D2,Log>*>(corr), field1, field2, dots,
                          coords, metric);
            break;
+#endif
+#ifdef TREECORR_USE_LINEAR
       case Linear:
            ProcessPair2c(static_cast<BinnedCorr2<D1,D2,Linear>*>(corr), field1, field2, dots,
                          coords, metric);
            break;
+#endif
+#ifdef TREECORR_USE_TWOD
       case TwoD:
            ProcessPair2c(static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr), field1, field2, dots,
                          coords, metric);
            break;
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           ProcessPair2c(static_cast<BinnedCorr2<D1,D2,Edges>*>(corr), field1, field2, dots,
+                         coords, metric);
+           break;
+#endif
       default:
            Assert(false);
     }
@@ -1506,6 +4330,8 @@ int SetOMPThreads(int num_threads)
 {
 #ifdef _OPENMP
     omp_set_num_threads(num_threads);
+    // Any new threads in the pool need to be pinned too.
+    ApplyAffinityPolicy();
     return omp_get_max_threads();
 #else
     return 1;
@@ -1521,6 +4347,12 @@ int GetOMPThreads()
 #endif
 }
 
+int SetThreadAffinity(int policy)
+{
+    dbg<<"Start SetThreadAffinity: "<<policy<<std::endl;
+    return SetAffinityPolicy(AffinityPolicy(policy));
+}
+
 template <int M, int D1, int D2, int B>
 long SamplePairs2d(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2,
                    double minsep, double maxsep,
@@ -1571,30 +4403,42 @@ long SamplePairs2c(BinnedCorr2<D1,D2,B>* corr, void* field1, void* field2,
                    int coords, int metric, long* i1, long* i2, double* sep, int n)
 {
     switch(metric) {
+#ifdef TREECORR_USE_EUCLIDEAN
       case Euclidean:
            return SamplePairs2d<Euclidean>(corr, field1, field2, minsep, maxsep,
                                            coords, i1, i2, sep, n);
            break;
+#endif
+#ifdef TREECORR_USE_RPERP
       case Rperp:
            return SamplePairs2d<Rperp>(corr, field1, field2, minsep, maxsep,
                                        coords, i1, i2, sep, n);
            break;
+#endif
+#ifdef TREECORR_USE_OLDRPERP
       case OldRperp:
            return SamplePairs2d<OldRperp>(corr, field1, field2, minsep, maxsep,
                                           coords, i1, i2, sep, n);
            break;
+#endif
+#ifdef TREECORR_USE_RLENS
       case Rlens:
            return SamplePairs2d<Rlens>(corr, field1, field2, minsep, maxsep,
                                        coords, i1, i2, sep, n);
            break;
+#endif
+#ifdef TREECORR_USE_ARC
       case Arc:
            return SamplePairs2d<Arc>(corr, field1, field2, minsep, maxsep,
                                      coords, i1, i2, sep, n);
            break;
+#endif
+#ifdef TREECORR_USE_PERIODIC
       case Periodic:
            return SamplePairs2d<Periodic>(corr, field1, field2, minsep, maxsep,
                                           coords, i1, i2, sep, n);
            break;
+#endif
       default:
            Assert(false);
     }
@@ -1607,19 +4451,32 @@ long SamplePairs2b(void* corr, void* field1, void* field2, double minsep, double
                    long* i1, long* i2, double* sep, int n)
 {
     switch(bin_type) {
+#ifdef TREECORR_USE_LOG
       case Log:
            return SamplePairs2c(static_cast<BinnedCorr2<D1,D2,Log>*>(corr),
                                 field1, field2, minsep, maxsep,
                                 coords, metric, i1, i2, sep, n);
            break;
+#endif
+#ifdef TREECORR_USE_LINEAR
       case Linear:
            return SamplePairs2c(static_cast<BinnedCorr2<D1,D2,Linear>*>(corr),
                                 field1, field2, minsep, maxsep,
                                 coords, metric, i1, i2, sep, n);
            break;
+#endif
+#ifdef TREECORR_USE_TWOD
       case TwoD:
            // TwoD not implemented.
            break;
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           return SamplePairs2c(static_cast<BinnedCorr2<D1,D2,Edges>*>(corr),
+                                field1, field2, minsep, maxsep,
+                                coords, metric, i1, i2, sep, n);
+           break;
+#endif
       default:
            Assert(false);
     }
@@ -1676,139 +4533,221 @@ long SamplePairs(void* corr, void* field1, void* field2, double minsep, double m
     return 0;
 }
 
+// The arguments for the centers and sizes of the two lists of cells (usually patches) for
+// TriviallyZeroPairs.
+struct CenterSizes
+{
+    const double* x1; const double* y1; const double* z1; const double* s1; long n1;
+    const double* x2; const double* y2; const double* z2; const double* s2; long n2;
+};
+
 template <int M, int C, int D1, int D2, int B>
-int TriviallyZero2e(BinnedCorr2<D1,D2,B>* corr,
-                    double x1, double y1, double z1, double s1,
-                    double x2, double y2, double z2, double s2)
+void TriviallyZero2e(BinnedCorr2<D1,D2,B>* corr, const CenterSizes& cs, int* zero)
 {
-    Position<C> p1(x1,y1,z1);
-    Position<C> p2(x2,y2,z2);
-    return corr->template triviallyZero<M>(p1, p2, s1, s2);
+    const long n = cs.n1 * cs.n2;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (n > 1000)
+#endif
+    for (long k=0; k<n; ++k) {
+        const long i = k / cs.n2;
+        const long j = k % cs.n2;
+        Position<C> p1(cs.x1[i], cs.y1[i], cs.z1[i]);
+        Position<C> p2(cs.x2[j], cs.y2[j], cs.z2[j]);
+        zero[k] = corr->template triviallyZero<M>(p1, p2, cs.s1[i], cs.s2[j]);
+    }
 }
 
 template <int M, int D1, int D2, int B>
-int TriviallyZero2d(BinnedCorr2<D1,D2,B>* corr, int coords,
-                    double x1, double y1, double z1, double s1,
-                    double x2, double y2, double z2, double s2)
+void TriviallyZero2d(BinnedCorr2<D1,D2,B>* corr, int coords, const CenterSizes& cs, int* zero)
 {
     switch(coords) {
       case Flat:
            Assert((MetricHelper<M,0>::_Flat == int(Flat)));
-           return TriviallyZero2e<M, MetricHelper<M,0>::_Flat>(
-               corr, x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2e<M, MetricHelper<M,0>::_Flat>(corr, cs, zero);
            break;
       case Sphere:
            Assert((MetricHelper<M,0>::_Sphere == int(Sphere)));
-           return TriviallyZero2e<M, MetricHelper<M,0>::_Sphere>(
-               corr, x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2e<M, MetricHelper<M,0>::_Sphere>(corr, cs, zero);
            break;
       case ThreeD:
            Assert((MetricHelper<M,0>::_ThreeD == int(ThreeD)));
-           return TriviallyZero2e<M, MetricHelper<M,0>::_ThreeD>(
-               corr, x1, y1, z1, s1, x2, y2, z2, s2);
-       default:
+           TriviallyZero2e<M, MetricHelper<M,0>::_ThreeD>(corr, cs, zero);
+           break;
+      default:
            Assert(false);
     }
-    return 0;
 }
 
 template <int D1, int D2, int B>
-int TriviallyZero2c(BinnedCorr2<D1,D2,B>* corr, int metric, int coords,
-                    double x1, double y1, double z1, double s1,
-                    double x2, double y2, double z2, double s2)
+void TriviallyZero2c(BinnedCorr2<D1,D2,B>* corr, int metric, int coords,
+                     const CenterSizes& cs, int* zero)
 {
     switch(metric) {
+#ifdef TREECORR_USE_EUCLIDEAN
       case Euclidean:
-           return TriviallyZero2d<Euclidean>(corr, coords, x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2d<Euclidean>(corr, coords, cs, zero);
            break;
+#endif
+#ifdef TREECORR_USE_RPERP
       case Rperp:
-           return TriviallyZero2d<Rperp>(corr, coords, x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2d<Rperp>(corr, coords, cs, zero);
            break;
+#endif
+#ifdef TREECORR_USE_OLDRPERP
       case OldRperp:
-           return TriviallyZero2d<OldRperp>(corr, coords, x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2d<OldRperp>(corr, coords, cs, zero);
            break;
+#endif
+#ifdef TREECORR_USE_RLENS
       case Rlens:
-           return TriviallyZero2d<Rlens>(corr, coords, x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2d<Rlens>(corr, coords, cs, zero);
            break;
+#endif
+#ifdef TREECORR_USE_ARC
       case Arc:
-           return TriviallyZero2d<Arc>(corr, coords, x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2d<Arc>(corr, coords, cs, zero);
            break;
+#endif
+#ifdef TREECORR_USE_PERIODIC
       case Periodic:
-           return TriviallyZero2d<Periodic>(corr, coords, x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2d<Periodic>(corr, coords, cs, zero);
            break;
+#endif
       default:
            Assert(false);
     }
-    return 0;
 }
 
 template <int D1, int D2>
-int TriviallyZero2b(void* corr, int bin_type, int metric, int coords,
-                    double x1, double y1, double z1, double s1,
-                    double x2, double y2, double z2, double s2)
+void TriviallyZero2b(void* corr, int bin_type, int metric, int coords,
+                     const CenterSizes& cs, int* zero)
 {
     switch(bin_type) {
+#ifdef TREECORR_USE_LOG
       case Log:
-           return TriviallyZero2c(static_cast<BinnedCorr2<D1,D2,Log>*>(corr), metric, coords,
-                                  x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2c(static_cast<BinnedCorr2<D1,D2,Log>*>(corr), metric, coords,
+                           cs, zero);
            break;
+#endif
+#ifdef TREECORR_USE_LINEAR
       case Linear:
-           return TriviallyZero2c(static_cast<BinnedCorr2<D1,D2,Linear>*>(corr), metric, coords,
-                                  x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2c(static_cast<BinnedCorr2<D1,D2,Linear>*>(corr), metric, coords,
+                           cs, zero);
            break;
+#endif
+#ifdef TREECORR_USE_TWOD
       case TwoD:
-           return TriviallyZero2c(static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr), metric, coords,
-                                  x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2c(static_cast<BinnedCorr2<D1,D2,TwoD>*>(corr), metric, coords,
+                           cs, zero);
+           break;
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+           TriviallyZero2c(static_cast<BinnedCorr2<D1,D2,Edges>*>(corr), metric, coords,
+                           cs, zero);
            break;
+#endif
       default:
            Assert(false);
     }
-    return 0;
 }
 
 template <int D1>
-int TriviallyZero2a(void* corr, int d2, int bin_type, int metric, int coords,
-                    double x1, double y1, double z1, double s1,
-                    double x2, double y2, double z2, double s2)
+void TriviallyZero2a(void* corr, int d2, int bin_type, int metric, int coords,
+                     const CenterSizes& cs, int* zero)
 {
     switch(d2) {
       case NData:
-           return TriviallyZero2b<D1,NData>(corr, bin_type, metric, coords,
-                                            x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2b<D1,NData>(corr, bin_type, metric, coords, cs, zero);
            break;
       case KData:
-           return TriviallyZero2b<D1,KData>(corr, bin_type, metric, coords,
-                                            x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2b<D1,KData>(corr, bin_type, metric, coords, cs, zero);
            break;
       case GData:
-           return TriviallyZero2b<D1,GData>(corr, bin_type, metric, coords,
-                                            x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2b<D1,GData>(corr, bin_type, metric, coords, cs, zero);
            break;
       default:
            Assert(false);
     }
-    return 0;
 }
 
-int TriviallyZero(void* corr, int d1, int d2, int bin_type, int metric, int coords,
-                  double x1, double y1, double z1, double s1,
-                  double x2, double y2, double z2, double s2)
+void TriviallyZeroPairs(void* corr, int d1, int d2, int bin_type, int metric, int coords,
+                        const double* x1, const double* y1, const double* z1,
+                        const double* s1, long n1,
+                        const double* x2, const double* y2, const double* z2,
+                        const double* s2, long n2, int* zero)
 {
+    dbg<<"Start TriviallyZeroPairs: "<<n1<<" "<<n2<<std::endl;
+    CenterSizes cs = { x1, y1, z1, s1, n1, x2, y2, z2, s2, n2 };
     switch(d1) {
       case NData:
-           return TriviallyZero2a<NData>(corr, d2, bin_type, metric, coords,
-                                         x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2a<NData>(corr, d2, bin_type, metric, coords, cs, zero);
            break;
       case KData:
-           return TriviallyZero2a<KData>(corr, d2, bin_type, metric, coords,
-                                         x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2a<KData>(corr, d2, bin_type, metric, coords, cs, zero);
            break;
       case GData:
-           return TriviallyZero2a<GData>(corr, d2, bin_type, metric, coords,
-                                         x1, y1, z1, s1, x2, y2, z2, s2);
+           TriviallyZero2a<GData>(corr, d2, bin_type, metric, coords, cs, zero);
            break;
       default:
            Assert(false);
     }
-    return 0;
+}
+
+int TriviallyZero(void* corr, int d1, int d2, int bin_type, int metric, int coords,
+                  double x1, double y1, double z1, double s1,
+                  double x2, double y2, double z2, double s2)
+{
+    int zero = 0;
+    TriviallyZeroPairs(corr, d1, d2, bin_type, metric, coords,
+                       &x1, &y1, &z1, &s1, 1, &x2, &y2, &z2, &s2, 1, &zero);
+    return zero;
+}
+
+int MetricCompiled(int metric)
+{
+    switch(metric) {
+#ifdef TREECORR_USE_EUCLIDEAN
+      case Euclidean:
+#endif
+#ifdef TREECORR_USE_RPERP
+      case Rperp:
+#endif
+#ifdef TREECORR_USE_OLDRPERP
+      case OldRperp:
+#endif
+#ifdef TREECORR_USE_RLENS
+      case Rlens:
+#endif
+#ifdef TREECORR_USE_ARC
+      case Arc:
+#endif
+#ifdef TREECORR_USE_PERIODIC
+      case Periodic:
+#endif
+           return 1;
+      default:
+           return 0;
+    }
+}
+
+int BinTypeCompiled(int bin_type)
+{
+    switch(bin_type) {
+#ifdef TREECORR_USE_LOG
+      case Log:
+#endif
+#ifdef TREECORR_USE_LINEAR
+      case Linear:
+#endif
+#ifdef TREECORR_USE_TWOD
+      case TwoD:
+#endif
+#ifdef TREECORR_USE_EDGES
+      case Edges:
+#endif
+           return 1;
+      default:
+           return 0;
+    }
 }
@@ -14,21 +14,41 @@
 
 //#define DEBUGLOGGING
 
+#include <algorithm>
+#include <map>
+
 #include "dbg.h"
 #include "BinnedCorr3.h"
+#include "ThreadTimes.h"
+#include "Kernels.h"
 #include "Split.h"
 #include "ProjectHelper.h"
+#include "StripeLocks.h"
+#include "BuildOptions.h"
 
 #ifdef _OPENMP
 #include "omp.h"
 #endif
 
+#define MAX(a,b) (a > b ? a : b)
+
+// As for BinnedCorr2, sets of cells with more than 1/TASKS_PER_THREAD of each thread's share
+// of the total work are split into OpenMP tasks.  But never make tasks with fewer than
+// MIN_TASK_WORK triangles of objects.
+const double TASKS_PER_THREAD = 16.;
+const double MIN_TASK_WORK = 1.e8;
+
+// As for ProcessPatches2, ProcessPatches3 only runs the sets of patches in parallel (each on a
+// single thread) if there are at least this many sets for each thread.
+const int PATCH_TRIPLETS_PER_THREAD = 4;
+
 template <int D1, int D2, int D3, int B>
 BinnedCorr3<D1,D2,D3,B>::BinnedCorr3(
     double minsep, double maxsep, int nbins, double binsize, double b,
     double minu, double maxu, int nubins, double ubinsize, double bu,
     double minv, double maxv, int nvbins, double vbinsize, double bv,
     double xp, double yp, double zp,
+    double max_accum_mem,
     double* zeta0, double* zeta1, double* zeta2, double* zeta3,
     double* zeta4, double* zeta5, double* zeta6, double* zeta7,
     double* meand1, double* meanlogd1, double* meand2, double* meanlogd2,
@@ -38,7 +58,8 @@ BinnedCorr3<D1,D2,D3,B>::BinnedCorr3(
     _minu(minu), _maxu(maxu), _nubins(nubins), _ubinsize(ubinsize), _bu(bu),
     _minv(minv), _maxv(maxv), _nvbins(nvbins), _vbinsize(vbinsize), _bv(bv),
     _xp(xp), _yp(yp), _zp(zp),
-    _coords(-1), _owns_data(false),
+    _coords(-1), _thread_corrs(0), _slot(0), _min_task_work(0.), _batch(0), _scale(1.),
+    _max_accum_mem(max_accum_mem), _locks(0), _owns_data(false),
     _zeta(zeta0,zeta1,zeta2,zeta3,zeta4,zeta5,zeta6,zeta7),
     _meand1(meand1), _meanlogd1(meanlogd1), _meand2(meand2), _meanlogd2(meanlogd2),
     _meand3(meand3), _meanlogd3(meanlogd3), _meanu(meanu), _meanv(meanv),
@@ -61,6 +82,7 @@ BinnedCorr3<D1,D2,D3,B>::BinnedCorr3(
     _nvbins2 = _nvbins * 2;
     _nuv = _nubins * _nvbins2;
     _ntot = _nbins * _nuv;
+    _stats.init(_ntot);
 }
 
 template <int D1, int D2, int D3, int B>
@@ -77,6 +99,8 @@ BinnedCorr3<D1,D2,D3,B>::BinnedCorr3(const BinnedCorr3<D1,D2,D3,B>& rhs, bool co
     _minvsq(rhs._minvsq), _maxvsq(rhs._maxvsq),
     _bsq(rhs._bsq), _busq(rhs._busq), _bvsq(rhs._bvsq), _sqrttwobv(rhs._sqrttwobv),
     _coords(rhs._coords), _nvbins2(rhs._nvbins2), _nuv(rhs._nuv), _ntot(rhs._ntot),
+    _thread_corrs(0), _slot(0), _min_task_work(0.), _batch(0), _scale(1.),
+    _max_accum_mem(rhs._max_accum_mem), _locks(0),
     _owns_data(true), _zeta(0,0,0,0,0,0,0,0), _weight(0)
 {
     _zeta.new_data(_ntot);
@@ -90,14 +114,48 @@ BinnedCorr3<D1,D2,D3,B>::BinnedCorr3(const BinnedCorr3<D1,D2,D3,B>& rhs, bool co
     _meanv = new double[_ntot];
     _weight = new double[_ntot];
     _ntri = new double[_ntot];
+    _stats.init(_ntot);
 
     if (copy_data) *this = rhs;
     else clear();
 }
 
+template <int D1, int D2, int D3, int B>
+BinnedCorr3<D1,D2,D3,B>::BinnedCorr3(BinnedCorr3<D1,D2,D3,B>* shared) :
+    _minsep(shared->_minsep), _maxsep(shared->_maxsep), _nbins(shared->_nbins),
+    _binsize(shared->_binsize), _b(shared->_b),
+    _minu(shared->_minu), _maxu(shared->_maxu), _nubins(shared->_nubins),
+    _ubinsize(shared->_ubinsize), _bu(shared->_bu),
+    _minv(shared->_minv), _maxv(shared->_maxv), _nvbins(shared->_nvbins),
+    _vbinsize(shared->_vbinsize), _bv(shared->_bv),
+    _logminsep(shared->_logminsep), _halfminsep(shared->_halfminsep),
+    _halfmind3(shared->_halfmind3),
+    _minsepsq(shared->_minsepsq), _maxsepsq(shared->_maxsepsq),
+    _minusq(shared->_minusq), _maxusq(shared->_maxusq),
+    _minvsq(shared->_minvsq), _maxvsq(shared->_maxvsq),
+    _bsq(shared->_bsq), _busq(shared->_busq), _bvsq(shared->_bvsq),
+    _sqrttwobv(shared->_sqrttwobv),
+    _coords(shared->_coords), _nvbins2(shared->_nvbins2), _nuv(shared->_nuv),
+    _ntot(shared->_ntot),
+    _thread_corrs(0), _slot(0), _min_task_work(0.), _batch(0), _scale(1.),
+    _max_accum_mem(shared->_max_accum_mem), _locks(shared->_locks),
+    _owns_data(false), _zeta(shared->_zeta),
+    _meand1(shared->_meand1), _meanlogd1(shared->_meanlogd1),
+    _meand2(shared->_meand2), _meanlogd2(shared->_meanlogd2),
+    _meand3(shared->_meand3), _meanlogd3(shared->_meanlogd3),
+    _meanu(shared->_meanu), _meanv(shared->_meanv),
+    _weight(shared->_weight), _ntri(shared->_ntri)
+{
+    // The triangles are accumulated directly into the shared data, so it needs to be locked.
+    Assert(_locks);
+    _stats.init(_ntot);
+}
+
 template <int D1, int D2, int D3, int B>
 BinnedCorr3<D1,D2,D3,B>::~BinnedCorr3()
 {
+    // process always finishes the batch before returning.
+    Assert(!_batch);
     if (_owns_data) {
         _zeta.delete_data();
         delete [] _meand1; _meand1 = 0;
@@ -127,9 +185,91 @@ void BinnedCorr3<D1,D2,D3,B>::clear()
     for (int i=0; i<_ntot; ++i) _meanv[i] = 0.;
     for (int i=0; i<_ntot; ++i) _weight[i] = 0.;
     for (int i=0; i<_ntot; ++i) _ntri[i] = 0.;
+    _stats.clear();
     _coords = -1;
 }
 
+template <int D1, int D2, int D3, int B>
+int BinnedCorr3<D1,D2,D3,B>::getNCopies(int nthreads, double bytes) const
+{
+    // With no limit, each thread gets its own copy.
+    if (_max_accum_mem <= 0.) return nthreads;
+    const double ncopies = _max_accum_mem / bytes;
+    return ncopies < 1. ? 1 : ncopies < nthreads ? int(ncopies) : nthreads;
+}
+
+template <int D1, int D2, int D3, int B>
+BinnedCorr3<D1,D2,D3,B>* BinnedCorr3<D1,D2,D3,B>::startThread(
+    std::vector<std::vector<void*> >& thread_corrs, int slot, std::vector<StripeLocks>& locks,
+    int ncopies, double min_task_work)
+{
+#ifdef _OPENMP
+    // The first ncopies threads each make a copy of the data vector to fill in.  Any other
+    // threads share the data of these copies, so then the copies lock the bins they update.
+    // Every thread still has its own accumulator for its own batch of triangles though.
+    const int tid = omp_get_thread_num();
+    BinnedCorr3<D1,D2,D3,B>* bc3 = 0;
+    if (tid < ncopies) {
+        bc3 = new BinnedCorr3<D1,D2,D3,B>(*this,false);
+        if (!locks.empty()) bc3->_locks = &locks[slot * ncopies + tid];
+        thread_corrs[tid][slot] = bc3;
+    }
+#pragma omp barrier
+    if (tid >= ncopies) {
+        BinnedCorr3<D1,D2,D3,B>* shared =
+            static_cast<BinnedCorr3<D1,D2,D3,B>*>(thread_corrs[tid % ncopies][slot]);
+        bc3 = new BinnedCorr3<D1,D2,D3,B>(shared);
+        thread_corrs[tid][slot] = bc3;
+    }
+    bc3->_slot = slot;
+    if (omp_get_num_threads() > 1) {
+        bc3->_thread_corrs = &thread_corrs;
+        bc3->_min_task_work = min_task_work;
+    }
+    return bc3;
+#else
+    return this;
+#endif
+}
+
+template <int D1, int D2, int D3, int B>
+void BinnedCorr3<D1,D2,D3,B>::finishThread(BinnedCorr3<D1,D2,D3,B>* bc3)
+{
+#ifdef _OPENMP
+    // The threads that share a copy have already added to it, so only the copies are added.
+    if (bc3->_owns_data) {
+#pragma omp critical
+        {
+            *this += *bc3;
+        }
+    } else if (PruneStats::enabled) {
+        // The counters are always the thread's own though.
+#pragma omp critical
+        {
+            _stats += bc3->_stats;
+        }
+    }
+    delete bc3;
+#endif
+}
+
+#ifdef _OPENMP
+// The NNN, KKK and GGG classes that don't keep track of which catalog is at each vertex pass
+// the same object for all the permutations of a cross-correlation.  Then each thread only needs
+// one accumulator, which gets the triangles of all the permutations, rather than one for each.
+// If same, bc0 is the accumulator already started for this object (so it has the same type),
+// else this starts a new one in the given slot.
+template <int D1, int D2, int D3, int B, class BC0>
+BinnedCorr3<D1,D2,D3,B>& StartPermutation(
+    BinnedCorr3<D1,D2,D3,B>* corr, bool same, BC0& bc0,
+    std::vector<std::vector<void*> >& thread_corrs, int slot, std::vector<StripeLocks>& locks,
+    int ncopies, double min_task_work)
+{
+    if (same) return *reinterpret_cast<BinnedCorr3<D1,D2,D3,B>*>(&bc0);
+    else return *corr->startThread(thread_corrs, slot, locks, ncopies, min_task_work);
+}
+#endif
+
 // BinnedCorr3::process3 is invalid if D1 != D2 or D3, so this helper struct lets us only call
 // process3, process12 and process111 when D1 == D2 == D3
 template <int D1, int D2, int D3, int B, int C, int M>
@@ -194,8 +334,50 @@ struct ProcessHelper<D,D,D,B,C,M>
     { b122.template process111<C,M>(b122,b212,b221,b212,b221,c1,c2,c3, metric); }
 };
 
+// The number of objects in the top-level cells of field2 from j0 on that are close enough to
+// c1 to be in a triangle with it.  This is used to estimate the work for each top-level cell
+// when reporting the progress.
+template <int D1, int D2, int C, int M>
+static double NearbyObjects(const Cell<D1,C>* c1, const Field<D2,C>& field2, long j0,
+                            const MetricHelper<M,0>& metric, double maxsep)
+{
+    const long n2 = field2.getNTopLevel();
+    double n = 0.;
+    for (long j=j0;j<n2;++j) {
+        const Cell<D2,C>* c2 = field2.getCells()[j];
+        double s1 = c1->getSize();
+        double s2 = c2->getSize();
+        double dsq = metric.DistSq(c1->getData().getPos(), c2->getData().getPos(), s1, s2);
+        if (dsq < SQR(maxsep + s1 + s2)) n += c2->getN();
+    }
+    return n;
+}
+
+// Add the total estimated work for a call to process to progress[1].
+static void StartProgress(double* progress, const std::vector<double>& work)
+{
+    double total = 0.;
+    for (size_t i=0; i<work.size(); ++i) total += work[i];
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+    progress[1] += total;
+}
+
+// Add the work for a top-level cell that is finished to progress[0].  This is an atomic add
+// rather than a critical section, so it doesn't hold up the other threads, and progress may be
+// read at any time (e.g. from Python while the calculation is running).
+static void AddProgress(double* progress, double work)
+{
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+    progress[0] += work;
+}
+
 template <int D1, int D2, int D3, int B> template <int C, int M>
-void BinnedCorr3<D1,D2,D3,B>::process(const Field<D1,C>& field, bool dots)
+void BinnedCorr3<D1,D2,D3,B>::process(const Field<D1,C>& field, bool dots, double* progress,
+                                      const double* sample)
 {
     Assert(D1 == D2);
     Assert(D1 == D3);
@@ -208,19 +390,52 @@ void BinnedCorr3<D1,D2,D3,B>::process(const Field<D1,C>& field, bool dots)
 
     MetricHelper<M,0> metric(0, 0, _xp, _yp, _zp);
 
+    // For the progress, the work for each top-level cell is roughly the number of triangles
+    // with their first point in it and the other two in it or a later cell.
+    std::vector<double> work;
+    if (progress) {
+        work.resize(n1, 0.);
+        for (long i=0;i<n1;++i) {
+            if (sample && !(sample[i] > 0.)) continue;
+            const Cell<D1,C>* c1 = field.getCells()[i];
+            work[i] = 0.5 * c1->getN() * SQR(NearbyObjects(c1, field, i, metric, _maxsep));
+        }
+        StartProgress(progress, work);
+    }
+    RegionTimer timer("BinnedCorr3::process", n1);
+
 #ifdef _OPENMP
+    // A few dense cells can have much more work than the rest, so large sets of cells are
+    // split into tasks, which the threads that have finished their share pick up.
+    const double nobj = field.getNObj();
+    std::vector<std::vector<void*> > thread_corrs(omp_get_max_threads(), std::vector<void*>(1));
+    const double ntasks = TASKS_PER_THREAD * thread_corrs.size();
+    // Tasks may run on a thread that is working on another top-level cell, whose triangles have
+    // a different scale, so don't split the work into tasks when sampling.
+    const double min_task_work = sample ? std::numeric_limits<double>::max() :
+        MAX(nobj*nobj*nobj / (6. * ntasks), MIN_TASK_WORK);
+    dbg<<"min_task_work = "<<min_task_work<<std::endl;
+    const int ncopies = getNCopies(thread_corrs.size(), getCopyBytes());
+    std::vector<StripeLocks> locks(ncopies < int(thread_corrs.size()) ? ncopies : 0);
+    dbg<<"ncopies = "<<ncopies<<std::endl;
 #pragma omp parallel
     {
-        // Give each thread their own copy of the data vector to fill in.
-        BinnedCorr3<D1,D2,D3,B> bc3(*this,false);
+        // Get this thread's accumulator to fill in.
+        BinnedCorr3<D1,D2,D3,B>& bc3 = *startThread(thread_corrs, 0, locks, ncopies,
+                                                    min_task_work);
+        // Make sure every thread's copy is ready before any tasks might use it.
+#pragma omp barrier
 #else
         BinnedCorr3<D1,D2,D3,B>& bc3 = *this;
 #endif
+        timer.startThread();
 
 #ifdef _OPENMP
 #pragma omp for schedule(dynamic)
 #endif
         for (long i=0;i<n1;++i) {
+            if (sample && !(sample[i] > 0.)) continue;
+            RegionTimer::Item item(timer, i);
             const Cell<D1,C>* c1 = field.getCells()[i];
 #ifdef _OPENMP
 #pragma omp critical
@@ -235,23 +450,40 @@ void BinnedCorr3<D1,D2,D3,B>::process(const Field<D1,C>& field, bool dots)
                 if (verbose_level >= 2) c1->WriteTree(get_dbgout());
 #endif
             }
-            ProcessHelper<D1,D2,D3,B,C,M>::process3(bc3,c1, metric);
-            for (long j=i+1;j<n1;++j) {
-                const Cell<D1,C>* c2 = field.getCells()[j];
-                ProcessHelper<D1,D2,D3,B,C,M>::process12(bc3,c1,c2, metric);
-                ProcessHelper<D1,D2,D3,B,C,M>::process12(bc3,c2,c1, metric);
-                for (long k=j+1;k<n1;++k) {
-                    const Cell<D1,C>* c3 = field.getCells()[k];
-                    ProcessHelper<D1,D2,D3,B,C,M>::process111(bc3,c1,c2,c3, metric);
+            if (sample) bc3._scale = sample[i];
+#ifdef _OPENMP
+            // Wait for any tasks spawned for this cell before counting its progress.
+            // (The thread runs other tasks while it waits.)
+#pragma omp taskgroup
+#endif
+            {
+                ProcessHelper<D1,D2,D3,B,C,M>::process3(bc3,c1, metric);
+                for (long j=i+1;j<n1;++j) {
+                    const Cell<D1,C>* c2 = field.getCells()[j];
+                    ProcessHelper<D1,D2,D3,B,C,M>::process12(bc3,c1,c2, metric);
+                    ProcessHelper<D1,D2,D3,B,C,M>::process12(bc3,c2,c1, metric);
+                    for (long k=j+1;k<n1;++k) {
+                        const Cell<D1,C>* c3 = field.getCells()[k];
+                        ProcessHelper<D1,D2,D3,B,C,M>::process111(bc3,c1,c2,c3, metric);
+                    }
                 }
             }
+            // The batch needs to be accumulated with this cell's scale.
+            if (sample) bc3.template finishBatch<C>();
+            if (progress) AddProgress(progress, work[i]);
         }
+        bc3.template finishBatch<C>();
+        bc3._scale = 1.;
 #ifdef _OPENMP
-        // Accumulate the results
-#pragma omp critical
-        {
-            *this += bc3;
+        // Accumulate the results.  (The barrier at the end of the omp for also waits for all
+        // the tasks, so every thread's copies are finished by now.  If some threads share
+        // the copies, also wait for them to finish their batches.)
+        if (!locks.empty()) {
+#pragma omp barrier
         }
+        timer.startMerge();
+        finishThread(&bc3);
+        timer.finishMerge();
     }
 #endif
     if (dots) std::cout<<std::endl;
@@ -262,7 +494,7 @@ template <int D1, int D2, int D3, int B> template <int C, int M>
 void BinnedCorr3<D1,D2,D3,B>::process(BinnedCorr3<D2,D1,D2,B>* corr212,
                                       BinnedCorr3<D2,D2,D1,B>* corr221,
                                       const Field<D1,C>& field1, const Field<D2,C>& field2,
-                                      bool dots)
+                                      bool dots, double* progress, const double* sample)
 {
     xdbg<<"_coords = "<<_coords<<std::endl;
     xdbg<<"C = "<<C<<std::endl;
@@ -277,6 +509,19 @@ void BinnedCorr3<D1,D2,D3,B>::process(BinnedCorr3<D2,D1,D2,B>* corr212,
 
     MetricHelper<M,0> metric(0, 0, _xp, _yp, _zp);
 
+    // For the progress, the work for each top-level cell of field1 is roughly the number of
+    // triangles with one point in it and two in field2.
+    std::vector<double> work;
+    if (progress) {
+        work.resize(n1, 0.);
+        for (long i=0;i<n1;++i) {
+            if (sample && !(sample[i] > 0.)) continue;
+            const Cell<D1,C>* c1 = field1.getCells()[i];
+            work[i] = 0.5 * c1->getN() * SQR(NearbyObjects(c1, field2, 0, metric, _maxsep));
+        }
+        StartProgress(progress, work);
+    }
+
 #ifdef DEBUGLOGGING
     if (verbose_level >= 2) {
         xdbg<<"field1: \n";
@@ -294,23 +539,47 @@ void BinnedCorr3<D1,D2,D3,B>::process(BinnedCorr3<D2,D1,D2,B>* corr212,
     }
 #endif
 
+    RegionTimer timer("BinnedCorr3::process", n1);
+
 #ifdef _OPENMP
+    const double nobj1 = field1.getNObj();
+    const double nobj2 = field2.getNObj();
+    std::vector<std::vector<void*> > thread_corrs(omp_get_max_threads(), std::vector<void*>(3));
+    const double ntasks = TASKS_PER_THREAD * thread_corrs.size();
+    // No tasks when sampling.  (See the auto-correlation above.)
+    const double min_task_work = sample ? std::numeric_limits<double>::max() :
+        MAX(nobj1*nobj2*nobj2 / (2. * ntasks), MIN_TASK_WORK);
+    dbg<<"min_task_work = "<<min_task_work<<std::endl;
+    const bool same = static_cast<void*>(corr212) == this && static_cast<void*>(corr221) == this;
+    const int nslots = same ? 1 : 3;
+    const double bytes = same ? getCopyBytes() :
+        getCopyBytes() + corr212->getCopyBytes() + corr221->getCopyBytes();
+    const int ncopies = getNCopies(thread_corrs.size(), bytes);
+    std::vector<StripeLocks> locks(ncopies < int(thread_corrs.size()) ? nslots*ncopies : 0);
+    dbg<<"ncopies = "<<ncopies<<", same = "<<same<<std::endl;
 #pragma omp parallel
     {
-        // Give each thread their own copy of the data vector to fill in.
-        BinnedCorr3<D2,D2,D1,B> bc122(*this,false);
-        BinnedCorr3<D2,D1,D2,B> bc212(*corr212,false);
-        BinnedCorr3<D1,D2,D2,B> bc221(*corr221,false);
+        // Get this thread's accumulators to fill in.
+        BinnedCorr3<D1,D2,D3,B>& bc122 =
+            *startThread(thread_corrs, 0, locks, ncopies, min_task_work);
+        BinnedCorr3<D2,D1,D2,B>& bc212 = StartPermutation(
+            corr212, same, bc122, thread_corrs, 1, locks, ncopies, min_task_work);
+        BinnedCorr3<D2,D2,D1,B>& bc221 = StartPermutation(
+            corr221, same, bc122, thread_corrs, 2, locks, ncopies, min_task_work);
+#pragma omp barrier
 #else
-        BinnedCorr3<D2,D2,D1,B>& bc122 = *this;
+        BinnedCorr3<D1,D2,D3,B>& bc122 = *this;
         BinnedCorr3<D2,D1,D2,B>& bc212 = *corr212;
-        BinnedCorr3<D2,D2,D2,B>& bc221 = *corr221;
+        BinnedCorr3<D2,D2,D1,B>& bc221 = *corr221;
 #endif
+        timer.startThread();
 
 #ifdef _OPENMP
 #pragma omp for schedule(dynamic)
 #endif
         for (long i=0;i<n1;++i) {
+            if (sample && !(sample[i] > 0.)) continue;
+            RegionTimer::Item item(timer, i);
 #ifdef _OPENMP
 #pragma omp critical
 #endif
@@ -321,23 +590,48 @@ void BinnedCorr3<D1,D2,D3,B>::process(BinnedCorr3<D2,D1,D2,B>* corr212,
 #endif
             }
             const Cell<D1,C>* c1 = field1.getCells()[i];
-            for (long j=0;j<n2;++j) {
-                const Cell<D2,C>* c2 = field2.getCells()[j];
-                ProcessHelper<D1,D2,D3,B,C,M>::process12(bc122,bc212,bc221, c1,c2, metric);
-                for (long k=j+1;k<n2;++k) {
-                    const Cell<D2,C>* c3 = field2.getCells()[k];
-                    ProcessHelper<D1,D2,D3,B,C,M>::process111(bc122,bc212,bc221, c1,c2,c3, metric);
+            if (sample) bc122._scale = bc212._scale = bc221._scale = sample[i];
+#ifdef _OPENMP
+            // Wait for any tasks spawned for this cell before counting its progress.
+            // (The thread runs other tasks while it waits.)
+#pragma omp taskgroup
+#endif
+            {
+                for (long j=0;j<n2;++j) {
+                    const Cell<D2,C>* c2 = field2.getCells()[j];
+                    ProcessHelper<D1,D2,D3,B,C,M>::process12(bc122,bc212,bc221, c1,c2, metric);
+                    for (long k=j+1;k<n2;++k) {
+                        const Cell<D2,C>* c3 = field2.getCells()[k];
+                        ProcessHelper<D1,D2,D3,B,C,M>::process111(bc122,bc212,bc221,
+                                                                  c1,c2,c3, metric);
+                    }
                 }
             }
+            if (sample) {
+                bc122.template finishBatch<C>();
+                bc212.template finishBatch<C>();
+                bc221.template finishBatch<C>();
+            }
+            if (progress) AddProgress(progress, work[i]);
         }
+        bc122.template finishBatch<C>();
+        bc212.template finishBatch<C>();
+        bc221.template finishBatch<C>();
+        bc122._scale = bc212._scale = bc221._scale = 1.;
 #ifdef _OPENMP
-        // Accumulate the results
-#pragma omp critical
-        {
-            *this += bc122;
-            *corr212 += bc212;
-            *corr221 += bc221;
+        // Accumulate the results.  (The barrier at the end of the omp for also waits for all
+        // the tasks, so every thread's copies are finished by now.  If some threads share
+        // the copies, also wait for them to finish their batches.)
+        if (!locks.empty()) {
+#pragma omp barrier
+        }
+        timer.startMerge();
+        finishThread(&bc122);
+        if (!same) {
+            corr212->finishThread(&bc212);
+            corr221->finishThread(&bc221);
         }
+        timer.finishMerge();
     }
 #endif
     if (dots) std::cout<<std::endl;
@@ -350,7 +644,8 @@ void BinnedCorr3<D1,D2,D3,B>::process(BinnedCorr3<D1,D3,D2,B>* corr132,
                                       BinnedCorr3<D3,D1,D2,B>* corr312,
                                       BinnedCorr3<D3,D2,D1,B>* corr321,
                                       const Field<D1,C>& field1, const Field<D2,C>& field2,
-                                      const Field<D3,C>& field3, bool dots)
+                                      const Field<D3,C>& field3, bool dots, double* progress,
+                                      const double* sample)
 {
     xdbg<<"_coords = "<<_coords<<std::endl;
     xdbg<<"C = "<<C<<std::endl;
@@ -368,6 +663,20 @@ void BinnedCorr3<D1,D2,D3,B>::process(BinnedCorr3<D1,D3,D2,B>* corr132,
 
     MetricHelper<M,0> metric(0, 0, _xp, _yp, _zp);
 
+    // For the progress, the work for each top-level cell of field1 is roughly the number of
+    // triangles with one point in it and the others in field2 and field3.
+    std::vector<double> work;
+    if (progress) {
+        work.resize(n1, 0.);
+        for (long i=0;i<n1;++i) {
+            if (sample && !(sample[i] > 0.)) continue;
+            const Cell<D1,C>* c1 = field1.getCells()[i];
+            work[i] = double(c1->getN()) * NearbyObjects(c1, field2, 0, metric, _maxsep) *
+                NearbyObjects(c1, field3, 0, metric, _maxsep);
+        }
+        StartProgress(progress, work);
+    }
+
 #ifdef DEBUGLOGGING
     if (verbose_level >= 2) {
         xdbg<<"field1: \n";
@@ -391,16 +700,44 @@ void BinnedCorr3<D1,D2,D3,B>::process(BinnedCorr3<D1,D3,D2,B>* corr132,
     }
 #endif
 
+    RegionTimer timer("BinnedCorr3::process", n1);
+
 #ifdef _OPENMP
+    const double nobj1 = field1.getNObj();
+    const double nobj2 = field2.getNObj();
+    const double nobj3 = field3.getNObj();
+    std::vector<std::vector<void*> > thread_corrs(omp_get_max_threads(), std::vector<void*>(6));
+    const double ntasks = TASKS_PER_THREAD * thread_corrs.size();
+    // No tasks when sampling.  (See the auto-correlation above.)
+    const double min_task_work = sample ? std::numeric_limits<double>::max() :
+        MAX(nobj1*nobj2*nobj3 / ntasks, MIN_TASK_WORK);
+    dbg<<"min_task_work = "<<min_task_work<<std::endl;
+    const bool same = static_cast<void*>(corr132) == this && static_cast<void*>(corr213) == this &&
+        static_cast<void*>(corr231) == this && static_cast<void*>(corr312) == this &&
+        static_cast<void*>(corr321) == this;
+    const int nslots = same ? 1 : 6;
+    const double bytes = same ? getCopyBytes() :
+        getCopyBytes() + corr132->getCopyBytes() + corr213->getCopyBytes() +
+        corr231->getCopyBytes() + corr312->getCopyBytes() + corr321->getCopyBytes();
+    const int ncopies = getNCopies(thread_corrs.size(), bytes);
+    std::vector<StripeLocks> locks(ncopies < int(thread_corrs.size()) ? nslots*ncopies : 0);
+    dbg<<"ncopies = "<<ncopies<<", same = "<<same<<std::endl;
 #pragma omp parallel
     {
-        // Give each thread their own copy of the data vector to fill in.
-        BinnedCorr3<D1,D2,D3,B> bc123(*this,false);
-        BinnedCorr3<D1,D3,D2,B> bc132(*corr132,false);
-        BinnedCorr3<D2,D1,D3,B> bc213(*corr213,false);
-        BinnedCorr3<D2,D3,D1,B> bc231(*corr231,false);
-        BinnedCorr3<D3,D1,D2,B> bc312(*corr312,false);
-        BinnedCorr3<D3,D2,D1,B> bc321(*corr321,false);
+        // Get this thread's accumulators to fill in.
+        BinnedCorr3<D1,D2,D3,B>& bc123 =
+            *startThread(thread_corrs, 0, locks, ncopies, min_task_work);
+        BinnedCorr3<D1,D3,D2,B>& bc132 = StartPermutation(
+            corr132, same, bc123, thread_corrs, 1, locks, ncopies, min_task_work);
+        BinnedCorr3<D2,D1,D3,B>& bc213 = StartPermutation(
+            corr213, same, bc123, thread_corrs, 2, locks, ncopies, min_task_work);
+        BinnedCorr3<D2,D3,D1,B>& bc231 = StartPermutation(
+            corr231, same, bc123, thread_corrs, 3, locks, ncopies, min_task_work);
+        BinnedCorr3<D3,D1,D2,B>& bc312 = StartPermutation(
+            corr312, same, bc123, thread_corrs, 4, locks, ncopies, min_task_work);
+        BinnedCorr3<D3,D2,D1,B>& bc321 = StartPermutation(
+            corr321, same, bc123, thread_corrs, 5, locks, ncopies, min_task_work);
+#pragma omp barrier
 #else
         BinnedCorr3<D1,D2,D3,B>& bc123 = *this;
         BinnedCorr3<D1,D3,D2,B>& bc132 = *corr132;
@@ -409,11 +746,14 @@ void BinnedCorr3<D1,D2,D3,B>::process(BinnedCorr3<D1,D3,D2,B>* corr132,
         BinnedCorr3<D3,D1,D2,B>& bc312 = *corr312;
         BinnedCorr3<D3,D2,D1,B>& bc321 = *corr321;
 #endif
+        timer.startThread();
 
 #ifdef _OPENMP
 #pragma omp for schedule(dynamic)
 #endif
         for (long i=0;i<n1;++i) {
+            if (sample && !(sample[i] > 0.)) continue;
+            RegionTimer::Item item(timer, i);
 #ifdef _OPENMP
 #pragma omp critical
 #endif
@@ -424,32 +764,102 @@ void BinnedCorr3<D1,D2,D3,B>::process(BinnedCorr3<D1,D3,D2,B>* corr132,
 #endif
             }
             const Cell<D1,C>* c1 = field1.getCells()[i];
-            for (long j=0;j<n2;++j) {
-                const Cell<D2,C>* c2 = field2.getCells()[j];
-                for (long k=0;k<n3;++k) {
-                    const Cell<D3,C>* c3 = field3.getCells()[k];
-                    bc123.template process111<C,M>(
-                        bc132, bc213, bc231, bc312, bc321,
-                        c1, c2, c3, metric);
+            if (sample) {
+                bc123._scale = bc132._scale = bc213._scale = sample[i];
+                bc231._scale = bc312._scale = bc321._scale = sample[i];
+            }
+#ifdef _OPENMP
+            // Wait for any tasks spawned for this cell before counting its progress.
+            // (The thread runs other tasks while it waits.)
+#pragma omp taskgroup
+#endif
+            {
+                for (long j=0;j<n2;++j) {
+                    const Cell<D2,C>* c2 = field2.getCells()[j];
+                    for (long k=0;k<n3;++k) {
+                        const Cell<D3,C>* c3 = field3.getCells()[k];
+                        bc123.template process111<C,M>(
+                            bc132, bc213, bc231, bc312, bc321,
+                            c1, c2, c3, metric);
+                    }
                 }
             }
+            if (sample) {
+                bc123.template finishBatch<C>();
+                bc132.template finishBatch<C>();
+                bc213.template finishBatch<C>();
+                bc231.template finishBatch<C>();
+                bc312.template finishBatch<C>();
+                bc321.template finishBatch<C>();
+            }
+            if (progress) AddProgress(progress, work[i]);
         }
+        bc123.template finishBatch<C>();
+        bc132.template finishBatch<C>();
+        bc213.template finishBatch<C>();
+        bc231.template finishBatch<C>();
+        bc312.template finishBatch<C>();
+        bc321.template finishBatch<C>();
+        bc123._scale = bc132._scale = bc213._scale = 1.;
+        bc231._scale = bc312._scale = bc321._scale = 1.;
 #ifdef _OPENMP
-        // Accumulate the results
-#pragma omp critical
-        {
-            *this += bc123;
-            *corr132 += bc132;
-            *corr213 += bc213;
-            *corr231 += bc231;
-            *corr312 += bc312;
-            *corr321 += bc321;
+        // Accumulate the results.  (The barrier at the end of the omp for also waits for all
+        // the tasks, so every thread's copies are finished by now.  If some threads share
+        // the copies, also wait for them to finish their batches.)
+        if (!locks.empty()) {
+#pragma omp barrier
+        }
+        timer.startMerge();
+        finishThread(&bc123);
+        if (!same) {
+            corr132->finishThread(&bc132);
+            corr213->finishThread(&bc213);
+            corr231->finishThread(&bc231);
+            corr312->finishThread(&bc312);
+            corr321->finishThread(&bc321);
         }
+        timer.finishMerge();
     }
 #endif
     if (dots) std::cout<<std::endl;
 }
 
+template <int D1, int D2, int D3, int B> template <int C, int M>
+void BinnedCorr3<D1,D2,D3,B>::processSerial(BinnedCorr3<D1,D3,D2,B>* corr132,
+                                            BinnedCorr3<D2,D1,D3,B>* corr213,
+                                            BinnedCorr3<D2,D3,D1,B>* corr231,
+                                            BinnedCorr3<D3,D1,D2,B>* corr312,
+                                            BinnedCorr3<D3,D2,D1,B>* corr321,
+                                            const Field<D1,C>& field1, const Field<D2,C>& field2,
+                                            const Field<D3,C>& field3)
+{
+    Assert(_coords == -1 || _coords == C);
+    _coords = C;
+    const long n1 = field1.getNTopLevel();
+    const long n2 = field2.getNTopLevel();
+    const long n3 = field3.getNTopLevel();
+
+    MetricHelper<M,0> metric(0, 0, _xp, _yp, _zp);
+
+    for (long i=0;i<n1;++i) {
+        const Cell<D1,C>* c1 = field1.getCells()[i];
+        for (long j=0;j<n2;++j) {
+            const Cell<D2,C>* c2 = field2.getCells()[j];
+            for (long k=0;k<n3;++k) {
+                const Cell<D3,C>* c3 = field3.getCells()[k];
+                process111<C,M>(*corr132, *corr213, *corr231, *corr312, *corr321,
+                                c1, c2, c3, metric);
+            }
+        }
+    }
+    finishBatch<C>();
+    corr132->template finishBatch<C>();
+    corr213->template finishBatch<C>();
+    corr231->template finishBatch<C>();
+    corr312->template finishBatch<C>();
+    corr321->template finishBatch<C>();
+}
+
 template <int D1, int D2, int D3, int B> template <int C, int M>
 void BinnedCorr3<D1,D2,D3,B>::process3(const Cell<D1,C>* c1, const MetricHelper<M,0>& metric)
 {
@@ -466,6 +876,13 @@ void BinnedCorr3<D1,D2,D3,B>::process3(const Cell<D1,C>* c1, const MetricHelper<
 
     Assert(c1->getLeft());
     Assert(c1->getRight());
+    if (isTaskWork(c1->getN(), c1->getN(), c1->getN())) {
+        process3Task<C,M>(c1->getLeft(), metric);
+        process3Task<C,M>(c1->getRight(), metric);
+        process12Task<C,M>(*this, *this, c1->getLeft(),c1->getRight(), metric);
+        process12Task<C,M>(*this, *this, c1->getRight(),c1->getLeft(), metric);
+        return;
+    }
     process3<C,M>(c1->getLeft(), metric);
     process3<C,M>(c1->getRight(), metric);
     process12<C,M>(*this, *this, c1->getLeft(),c1->getRight(), metric);
@@ -531,13 +948,22 @@ void BinnedCorr3<D1,D2,D3,B>::process12(
 
     Assert(c2->getLeft());
     Assert(c2->getRight());
+    if (isTaskWork(c1->getN(), c2->getN(), c2->getN())) {
+        process12Task<C,M>(bc212, bc221, c1, c2->getLeft(), metric);
+        process12Task<C,M>(bc212, bc221, c1, c2->getRight(), metric);
+        process111Task<C,M>(*this,bc212,bc221,bc212,bc221, c1, c2->getLeft(), c2->getRight(),
+                            metric, 0., 0., 0.);
+        return;
+    }
     process12<C,M>(bc212, bc221, c1, c2->getLeft(), metric);
     process12<C,M>(bc212, bc221, c1, c2->getRight(), metric);
     // 111 order is 123, 132, 213, 231, 312, 321   Here 3->2.
     process111<C,M>(*this,bc212,bc221,bc212,bc221, c1, c2->getLeft(), c2->getRight(), metric);
 }
 
-static bool stop111(
+// Returns the PruneReason if no triangle with one point in each cell can be in the range of
+// the bins, or NoPrune (0) if it might be.
+static int stop111(
     double d1sq, double d2sq, double d3sq, double& d2,
     double s1, double s2, double s3,
     double minsep, double minsepsq, double maxsep, double maxsepsq,
@@ -553,7 +979,7 @@ static bool stop111(
         (s1+s3 == 0. || d2sq < SQR(minsep - s1-s3)) &&
         (s1+s2 == 0. || d3sq < SQR(minsep - s1-s2)) ) {
         xdbg<<"d2 cannot be as large as minsep\n";
-        return true;
+        return PruneMinSep;
     }
 
     // Similarly, we can abort if all possible triangles will have d2 > maxsep.
@@ -565,7 +991,7 @@ static bool stop111(
         (s1+s3 == 0. || d2sq >= SQR(maxsep + s1+s3)) &&
         (s2+s3 == 0. || d1sq >= SQR(maxsep + s2+s3))) {
         xdbg<<"d2 cannot be as small as maxsep\n";
-        return true;
+        return PruneMaxSep;
     }
 
     // If the user sets minu > 0, then we can abort if no possible triangle can have
@@ -574,8 +1000,12 @@ static bool stop111(
     // Abort if (d3+s1+s2) / (d2-s1-s3) < minu
     // (d3+s1+s2) < minu * (d2-s1-s3)
     // d3 < minu * (d2-s1-s3) - (s1+s2)
-    d2 = sqrt(d2sq);
-    if (minu > 0. && d3sq < minusq*d2sq && d2 > s1+s3) {
+    // This and the other u,v checks below only need d2 itself once their first checks in terms
+    // of the squared distances have passed.  Otherwise d2 is only needed if we don't stop, so
+    // the sqrt is put off until one of them needs it, or until the end.
+    d2 = 0.;
+    if (minu > 0. && d3sq < minusq*d2sq && d2sq > SQR(s1+s3)) {
+        d2 = sqrt(d2sq);
         double temp = minu * (d2-s1-s3);
         if (temp > s1+s2 && d3sq < SQR(temp - s1-s2)) {
             // However, d2 might not really be the middle leg.  So check d1 as well.
@@ -583,7 +1013,7 @@ static bool stop111(
             if (d3sq < minusq_d1sq && d1sq > 2.*SQR(s2+s3) &&
                 minusq_d1sq > 2.*d3sq + 2.*SQR(s1+s2 + minu * (s2+s3))) {
                 xdbg<<"u cannot be as large as minu\n";
-                return true;
+                return PruneMinU;
             }
         }
     }
@@ -594,7 +1024,8 @@ static bool stop111(
     // Abort if (d3-s1-s2) / (d2+s1+s3) > maxu
     // (d3-s1-s2) > maxu * (d2+s1+s3)
     // d3 > maxu * (d2+s1+s3) + (s1+s2)
-    if (maxu < 1. && d3sq >= maxusq*d2sq && d3sq >= SQR(maxu * (d2+s1+s3) + s1+s2)) {
+    if (maxu < 1. && d3sq >= maxusq*d2sq &&
+        d3sq >= SQR(maxu * ((d2 > 0. ? d2 : (d2 = sqrt(d2sq))) + s1+s3) + s1+s2)) {
         // This time, just make sure no other side could become the smallest side.
         // d3 - s1-s2 < d2 - s1-s3
         // d3 - s1-s2 < d1 - s2-s3
@@ -602,7 +1033,7 @@ static bool stop111(
              (s2 > s3 || d3sq <= SQR(d2 - s3 + s2)) &&
              (s1 > s3 || d1sq >= 2.*d3sq + 2.*SQR(s3 - s1)) ) {
             xdbg<<"u cannot be as small as maxu\n";
-            return true;
+            return PruneMaxU;
         }
     }
 
@@ -612,12 +1043,13 @@ static bool stop111(
     // As before, use the fact that d3 < d2, so check
     // d1 > maxv d2 + d2+s1+s2+s3 + maxv*(s1+s2)
     double sums = s1+s2+s3;
-    if (maxv < 1. && d1sq > SQR((1.+maxv)*d2 + sums + maxv * (s1+s2))) {
+    if (maxv < 1. && d1sq > SQR(1.+maxv)*d2sq &&
+        d1sq > SQR((1.+maxv)*(d2 > 0. ? d2 : (d2 = sqrt(d2sq))) + sums + maxv * (s1+s2))) {
         // We don't need any extra checks here related to the possibility of the sides
         // switching roles, since if this condition is true, than d1 has to be the largest
         // side no matter what.  d1-s2 > d2+s1
         xdbg<<"v cannot be as small as maxv\n";
-        return true;
+        return PruneMaxV;
     }
 
     // It will unusual, but if minv > 0, then we can also potentially stop if no triangle
@@ -628,20 +1060,68 @@ static bool stop111(
     // d1^2-d2^2 < (minv d3 - (s1+s2+s3) - minv*(s1+s2)) 2d2
     // minv d3 > (d1^2-d2^2)/(2d2) + (s1+s2+s3) + minv*(s1+s2)
     if (minv > 0. && d3sq > SQR(s1+s2) &&
-        minvsq*d3sq > SQR((d1sq-d2sq)/(2.*d2) + sums + minv*(s1+s2))) {
+        minvsq*d3sq > SQR((d1sq-d2sq)/(2.*(d2 > 0. ? d2 : (d2 = sqrt(d2sq)))) + sums +
+                          minv*(s1+s2))) {
         // And again, we don't need anything else here, since it's fine if d1,d2 swap or
         // even if d2,d3 swap.
         xdbg<<"|v| cannot be as large as minv\n";
-        return true;
+        return PruneMinV;
     }
 
     // Stop if any side is exactly 0 and elements are leaves
     // (This is unusual, but we want to make sure to stop if it happens.)
-    if (s2==0 && s3==0 && d1sq == 0) return true;
-    if (s1==0 && s3==0 && d2sq == 0) return true;
-    if (s1==0 && s2==0 && d3sq == 0) return true;
+    if (s2==0 && s3==0 && d1sq == 0) return PruneZeroSide;
+    if (s1==0 && s3==0 && d2sq == 0) return PruneZeroSide;
+    if (s1==0 && s2==0 && d3sq == 0) return PruneZeroSide;
+
+    if (d2 == 0.) d2 = sqrt(d2sq);
+    return NoPrune;
+}
+
+template <int D1, int D2, int D3, int B> template <int C, int M>
+bool BinnedCorr3<D1,D2,D3,B>::canFormTriangles(
+    const Position<C>& p1, double s1, const Position<C>& p2, double s2,
+    const Position<C>& p3, double s3) const
+{
+    // The centers of regions that wrap around a periodic box aren't meaningful, so don't
+    // try to rule anything out then.
+    if (M == Periodic) return true;
+
+    MetricHelper<M,0> metric(0, 0, _xp, _yp, _zp);
+    double s=0.;
+    double dsq[3] = { metric.DistSq(p2, p3, s,s), metric.DistSq(p1, p3, s,s),
+                      metric.DistSq(p1, p2, s,s) };
+    double size[3] = { s1, s2, s3 };
+
+    // Sort the sides as d1 >= d2 >= d3, keeping each size with the side opposite to it.
+    int k[3] = { 0, 1, 2 };
+    if (dsq[k[0]] < dsq[k[1]]) std::swap(k[0],k[1]);
+    if (dsq[k[1]] < dsq[k[2]]) std::swap(k[1],k[2]);
+    if (dsq[k[0]] < dsq[k[1]]) std::swap(k[0],k[1]);
+
+    double d2;
+    return NoPrune == stop111(dsq[k[0]], dsq[k[1]], dsq[k[2]], d2, size[k[0]], size[k[1]], size[k[2]],
+                    _minsep,_minsepsq,_maxsep,_maxsepsq,
+                    _minu,_minusq,_maxu,_maxusq,
+                    _minv,_minvsq,_maxv,_maxvsq);
+}
 
-    return false;
+// The squared distances between the sub-cells of ca and cb, or ca or cb itself if it isn't
+// being split.  When two or three of the cells of a triangle are split, each of these is a
+// side of two or four of the sub-triangles, so process111Sorted calculates them here once,
+// rather than in each of the calls to process111.
+template <int DA, int DB, int C, int M>
+static void SubDistSq(const Cell<DA,C>* ca, bool splita, const Cell<DB,C>* cb, bool splitb,
+                      const MetricHelper<M,0>& metric, double dsq[2][2])
+{
+    const Cell<DA,C>* cas[2] = { splita ? ca->getLeft() : ca, ca->getRight() };
+    const Cell<DB,C>* cbs[2] = { splitb ? cb->getLeft() : cb, cb->getRight() };
+    const int na = splita ? 2 : 1;
+    const int nb = splitb ? 2 : 1;
+    double s=0.;
+    for (int i=0; i<na; ++i)
+        for (int j=0; j<nb; ++j)
+            dsq[i][j] = metric.DistSq(cas[i]->getData().getPos(), cbs[j]->getData().getPos(), s,s);
 }
 
 template <int D1, int D2, int D3, int B> template <int C, int M>
@@ -737,11 +1217,14 @@ void BinnedCorr3<D1,D2,D3,B>::process111Sorted(
     Assert(d1sq >= d2sq);
     Assert(d2sq >= d3sq);
 
+    _stats.visit();
     double d2 = 0.;  // If not stop111, then d2 will be set.
-    if (stop111(d1sq,d2sq,d3sq,d2,s1,s2,s3,
-                _minsep,_minsepsq,_maxsep,_maxsepsq,
-                _minu,_minusq,_maxu,_maxusq,
-                _minv,_minvsq,_maxv,_maxvsq)) {
+    const int reason = stop111(d1sq,d2sq,d3sq,d2,s1,s2,s3,
+                               _minsep,_minsepsq,_maxsep,_maxsepsq,
+                               _minu,_minusq,_maxu,_maxusq,
+                               _minv,_minvsq,_maxv,_maxvsq);
+    if (reason != NoPrune) {
+        _stats.prune(reason);
         return;
     }
 
@@ -873,8 +1356,30 @@ void BinnedCorr3<D1,D2,D3,B>::process111Sorted(
         Assert(split1 == false || s1 > 0);
         Assert(split2 == false || s2 > 0);
         Assert(split3 == false || s3 > 0);
-
-        if (split3) {
+        _stats.split(split1, split2, split3);
+
+        if (isTaskWork(c1->getN(), c2->getN(), c3->getN())) {
+            // Each combination of the sub-cells is a separate task.  As below, any distance
+            // between two cells that aren't split is passed along.
+            const Cell<D1,C>* c1a = split1 ? c1->getLeft() : c1;
+            const Cell<D1,C>* c1b = split1 ? c1->getRight() : 0;
+            const Cell<D2,C>* c2a = split2 ? c2->getLeft() : c2;
+            const Cell<D2,C>* c2b = split2 ? c2->getRight() : 0;
+            const Cell<D3,C>* c3a = split3 ? c3->getLeft() : c3;
+            const Cell<D3,C>* c3b = split3 ? c3->getRight() : 0;
+            const Cell<D1,C>* c1s[2] = { c1a, c1b };
+            const Cell<D2,C>* c2s[2] = { c2a, c2b };
+            const Cell<D3,C>* c3s[2] = { c3a, c3b };
+            const double d1sq_sub = (split2 || split3) ? 0. : d1sq;
+            const double d2sq_sub = (split1 || split3) ? 0. : d2sq;
+            const double d3sq_sub = (split1 || split2) ? 0. : d3sq;
+            for (int i=0; i<2 && c1s[i]; ++i)
+                for (int j=0; j<2 && c2s[j]; ++j)
+                    for (int k=0; k<2 && c3s[k]; ++k)
+                        process111Task<C,M>(bc132,bc213,bc231,bc312,bc321,
+                                            c1s[i],c2s[j],c3s[k],metric,
+                                            d1sq_sub,d2sq_sub,d3sq_sub);
+        } else if (split3) {
             if (split2) {
                 if (split1) {
                     // split 1,2,3
@@ -884,36 +1389,56 @@ void BinnedCorr3<D1,D2,D3,B>::process111Sorted(
                     Assert(c2->getRight());
                     Assert(c3->getLeft());
                     Assert(c3->getRight());
+                    double d1s[2][2], d2s[2][2], d3s[2][2];
+                    SubDistSq(c2,true,c3,true,metric,d1s);
+                    SubDistSq(c1,true,c3,true,metric,d2s);
+                    SubDistSq(c1,true,c2,true,metric,d3s);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getLeft(),c2->getLeft(),c3->getLeft(),metric);
+                                    c1->getLeft(),c2->getLeft(),c3->getLeft(),metric,
+                                    d1s[0][0],d2s[0][0],d3s[0][0]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getLeft(),c2->getLeft(),c3->getRight(),metric);
+                                    c1->getLeft(),c2->getLeft(),c3->getRight(),metric,
+                                    d1s[0][1],d2s[0][1],d3s[0][0]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getLeft(),c2->getRight(),c3->getLeft(),metric);
+                                    c1->getLeft(),c2->getRight(),c3->getLeft(),metric,
+                                    d1s[1][0],d2s[0][0],d3s[0][1]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getLeft(),c2->getRight(),c3->getRight(),metric);
+                                    c1->getLeft(),c2->getRight(),c3->getRight(),metric,
+                                    d1s[1][1],d2s[0][1],d3s[0][1]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getRight(),c2->getLeft(),c3->getLeft(),metric);
+                                    c1->getRight(),c2->getLeft(),c3->getLeft(),metric,
+                                    d1s[0][0],d2s[1][0],d3s[1][0]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getRight(),c2->getLeft(),c3->getRight(),metric);
+                                    c1->getRight(),c2->getLeft(),c3->getRight(),metric,
+                                    d1s[0][1],d2s[1][1],d3s[1][0]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getRight(),c2->getRight(),c3->getLeft(),metric);
+                                    c1->getRight(),c2->getRight(),c3->getLeft(),metric,
+                                    d1s[1][0],d2s[1][0],d3s[1][1]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getRight(),c2->getRight(),c3->getRight(),metric);
+                                    c1->getRight(),c2->getRight(),c3->getRight(),metric,
+                                    d1s[1][1],d2s[1][1],d3s[1][1]);
                 } else {
                     // split 2,3
                     Assert(c2->getLeft());
                     Assert(c2->getRight());
                     Assert(c3->getLeft());
                     Assert(c3->getRight());
+                    double d1s[2][2], d2s[2][2], d3s[2][2];
+                    SubDistSq(c2,true,c3,true,metric,d1s);
+                    SubDistSq(c1,false,c3,true,metric,d2s);
+                    SubDistSq(c1,false,c2,true,metric,d3s);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1,c2->getLeft(),c3->getLeft(),metric);
+                                    c1,c2->getLeft(),c3->getLeft(),metric,
+                                    d1s[0][0],d2s[0][0],d3s[0][0]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1,c2->getLeft(),c3->getRight(),metric);
+                                    c1,c2->getLeft(),c3->getRight(),metric,
+                                    d1s[0][1],d2s[0][1],d3s[0][0]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1,c2->getRight(),c3->getLeft(),metric);
+                                    c1,c2->getRight(),c3->getLeft(),metric,
+                                    d1s[1][0],d2s[0][0],d3s[0][1]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1,c2->getRight(),c3->getRight(),metric);
+                                    c1,c2->getRight(),c3->getRight(),metric,
+                                    d1s[1][1],d2s[0][1],d3s[0][1]);
                 }
             } else {
                 if (split1) {
@@ -922,14 +1447,22 @@ void BinnedCorr3<D1,D2,D3,B>::process111Sorted(
                     Assert(c1->getRight());
                     Assert(c3->getLeft());
                     Assert(c3->getRight());
+                    double d1s[2][2], d2s[2][2], d3s[2][2];
+                    SubDistSq(c2,false,c3,true,metric,d1s);
+                    SubDistSq(c1,true,c3,true,metric,d2s);
+                    SubDistSq(c1,true,c2,false,metric,d3s);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getLeft(),c2,c3->getLeft(),metric);
+                                    c1->getLeft(),c2,c3->getLeft(),metric,
+                                    d1s[0][0],d2s[0][0],d3s[0][0]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getLeft(),c2,c3->getRight(),metric);
+                                    c1->getLeft(),c2,c3->getRight(),metric,
+                                    d1s[0][1],d2s[0][1],d3s[0][0]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getRight(),c2,c3->getLeft(),metric);
+                                    c1->getRight(),c2,c3->getLeft(),metric,
+                                    d1s[0][0],d2s[1][0],d3s[1][0]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getRight(),c2,c3->getRight(),metric);
+                                    c1->getRight(),c2,c3->getRight(),metric,
+                                    d1s[0][1],d2s[1][1],d3s[1][0]);
                 } else {
                     // split 3 only
                     Assert(c3->getLeft());
@@ -948,14 +1481,22 @@ void BinnedCorr3<D1,D2,D3,B>::process111Sorted(
                     Assert(c1->getRight());
                     Assert(c2->getLeft());
                     Assert(c2->getRight());
+                    double d1s[2][2], d2s[2][2], d3s[2][2];
+                    SubDistSq(c2,true,c3,false,metric,d1s);
+                    SubDistSq(c1,true,c3,false,metric,d2s);
+                    SubDistSq(c1,true,c2,true,metric,d3s);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getLeft(),c2->getLeft(),c3,metric);
+                                    c1->getLeft(),c2->getLeft(),c3,metric,
+                                    d1s[0][0],d2s[0][0],d3s[0][0]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getLeft(),c2->getRight(),c3,metric);
+                                    c1->getLeft(),c2->getRight(),c3,metric,
+                                    d1s[1][0],d2s[0][0],d3s[0][1]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getRight(),c2->getLeft(),c3,metric);
+                                    c1->getRight(),c2->getLeft(),c3,metric,
+                                    d1s[0][0],d2s[1][0],d3s[1][0]);
                     process111<C,M>(bc132,bc213,bc231,bc312,bc321,
-                                    c1->getRight(),c2->getRight(),c3,metric);
+                                    c1->getRight(),c2->getRight(),c3,metric,
+                                    d1s[1][0],d2s[1][0],d3s[1][1]);
                 } else {
                     // split 2 only
                     Assert(c2->getLeft());
@@ -985,16 +1526,19 @@ void BinnedCorr3<D1,D2,D3,B>::process111Sorted(
         // Now we can check to make sure the final d2, u, v are in the right ranges.
         if (d2 < _minsep || d2 >= _maxsep) {
             xdbg<<"d2 not in minsep .. maxsep\n";
+            _stats.prune(PruneRangeD2);
             return;
         }
 
         if (u < _minu || u >= _maxu) {
             xdbg<<"u not in minu .. maxu\n";
+            _stats.prune(PruneRangeU);
             return;
         }
 
         if (v < _minv || v >= _maxv) {
             xdbg<<"v not in minv .. maxv\n";
+            _stats.prune(PruneRangeV);
             return;
         }
 
@@ -1055,8 +1599,91 @@ void BinnedCorr3<D1,D2,D3,B>::process111Sorted(
         if (index < 0 || index >= _ntot) {
             return;
         }
-        directProcess111<C>(*c1,*c2,*c3,d1,d2,d3,logr,u,v,index);
+        _stats.accumulate(index);
+        addDirect<C>(*c1,*c2,*c3,d1,d2,d3,logr,u,v,index);
+    }
+}
+
+template <int D1, int D2, int D3, int B> template <int C, int M>
+void BinnedCorr3<D1,D2,D3,B>::process3Task(const Cell<D1,C>* c1, const MetricHelper<M,0>& metric)
+{
+#ifdef _OPENMP
+    // The task may run on any thread, possibly after this function returns, so it takes
+    // copies of everything it needs, including which slots of _thread_corrs to use.
+    std::vector<std::vector<void*> >* corrs = _thread_corrs;
+    const int s1 = _slot;
+    MetricHelper<M,0> m = metric;
+#pragma omp task firstprivate(corrs, s1, c1, m)
+    {
+        std::vector<void*>& tc = (*corrs)[omp_get_thread_num()];
+        static_cast<BinnedCorr3<D1,D2,D3,B>*>(tc[s1])->template process3<C,M>(c1, m);
+    }
+#else
+    process3<C,M>(c1, metric);
+#endif
+}
+
+template <int D1, int D2, int D3, int B> template <int C, int M>
+void BinnedCorr3<D1,D2,D3,B>::process12Task(
+    BinnedCorr3<D2,D1,D2,B>& bc212, BinnedCorr3<D2,D2,D1,B>& bc221,
+    const Cell<D1,C>* c1, const Cell<D2,C>* c2, const MetricHelper<M,0>& metric)
+{
+#ifdef _OPENMP
+    std::vector<std::vector<void*> >* corrs = _thread_corrs;
+    const int s1 = _slot;
+    const int s2 = bc212._slot;
+    const int s3 = bc221._slot;
+    MetricHelper<M,0> m = metric;
+#pragma omp task firstprivate(corrs, s1, s2, s3, c1, c2, m)
+    {
+        std::vector<void*>& tc = (*corrs)[omp_get_thread_num()];
+        static_cast<BinnedCorr3<D1,D2,D3,B>*>(tc[s1])->template process12<C,M>(
+            *static_cast<BinnedCorr3<D2,D1,D2,B>*>(tc[s2]),
+            *static_cast<BinnedCorr3<D2,D2,D1,B>*>(tc[s3]), c1, c2, m);
     }
+#else
+    process12<C,M>(bc212, bc221, c1, c2, metric);
+#endif
+}
+
+template <int D1, int D2, int D3, int B> template <int C, int M>
+void BinnedCorr3<D1,D2,D3,B>::process111Task(
+    BinnedCorr3<D1,D3,D2,B>& bc132,
+    BinnedCorr3<D2,D1,D3,B>& bc213, BinnedCorr3<D2,D3,D1,B>& bc231,
+    BinnedCorr3<D3,D1,D2,B>& bc312, BinnedCorr3<D3,D2,D1,B>& bc321,
+    const Cell<D1,C>* c1, const Cell<D2,C>* c2, const Cell<D3,C>* c3,
+    const MetricHelper<M,0>& metric,
+    double d1sq, double d2sq, double d3sq)
+{
+#ifdef _OPENMP
+    std::vector<std::vector<void*> >* corrs = _thread_corrs;
+    const int s123 = _slot;
+    const int s132 = bc132._slot;
+    const int s213 = bc213._slot;
+    const int s231 = bc231._slot;
+    const int s312 = bc312._slot;
+    const int s321 = bc321._slot;
+    MetricHelper<M,0> m = metric;
+    // The task continues the recursion at this depth, whichever thread runs it.
+    const int depth = PruneStats::depth();
+#pragma omp task firstprivate(corrs, s123, s132, s213, s231, s312, s321, c1, c2, c3, m, \
+                              d1sq, d2sq, d3sq, depth)
+    {
+        const int prev_depth = PruneStats::depth();
+        PruneStats::setDepth(depth);
+        std::vector<void*>& tc = (*corrs)[omp_get_thread_num()];
+        static_cast<BinnedCorr3<D1,D2,D3,B>*>(tc[s123])->template process111<C,M>(
+            *static_cast<BinnedCorr3<D1,D3,D2,B>*>(tc[s132]),
+            *static_cast<BinnedCorr3<D2,D1,D3,B>*>(tc[s213]),
+            *static_cast<BinnedCorr3<D2,D3,D1,B>*>(tc[s231]),
+            *static_cast<BinnedCorr3<D3,D1,D2,B>*>(tc[s312]),
+            *static_cast<BinnedCorr3<D3,D2,D1,B>*>(tc[s321]),
+            c1, c2, c3, m, d1sq, d2sq, d3sq);
+        PruneStats::setDepth(prev_depth);
+    }
+#else
+    process111<C,M>(bc132, bc213, bc231, bc312, bc321, c1, c2, c3, metric, d1sq, d2sq, d3sq);
+#endif
 }
 
 // We also set up a helper class for doing the direct processing
@@ -1067,10 +1694,8 @@ template <>
 struct DirectHelper<NData,NData,NData>
 {
     template <int C>
-    static void ProcessZeta(
-        const Cell<NData,C>& , const Cell<NData,C>& , const Cell<NData,C>&,
-        const double , const double , const double ,
-        ZetaData<NData,NData,NData>& , int )
+    static void ProcessZeta(const DirectBatch3<NData,NData,NData,C>& ,
+                            ZetaData<NData,NData,NData>& , double )
     {}
 };
 
@@ -1078,12 +1703,15 @@ template <>
 struct DirectHelper<KData,KData,KData>
 {
     template <int C>
-    static void ProcessZeta(
-        const Cell<KData,C>& c1, const Cell<KData,C>& c2, const Cell<KData,C>& c3,
-        const double , const double , const double ,
-        ZetaData<KData,KData,KData>& zeta, int index)
+    static void ProcessZeta(const DirectBatch3<KData,KData,KData,C>& batch,
+                            ZetaData<KData,KData,KData>& zeta, double scale)
     {
-        zeta.zeta[index] += c1.getData().getWK() * c2.getData().getWK() * c3.getData().getWK();
+        const long n = batch.n;
+        double kkk[DirectBatch3<KData,KData,KData,C>::N];
+        for (long i=0; i<n; ++i)
+            kkk[i] = scale * batch.c1[i]->getData().getWK() * batch.c2[i]->getData().getWK() *
+                batch.c3[i]->getData().getWK();
+        for (long i=0; i<n; ++i) zeta.zeta[batch.index[i]] += kkk[i];
     }
 };
 
@@ -1091,13 +1719,20 @@ template <>
 struct DirectHelper<GData,GData,GData>
 {
     template <int C>
-    static void ProcessZeta(
-        const Cell<GData,C>& c1, const Cell<GData,C>& c2, const Cell<GData,C>& c3,
-        const double d1, const double d2, const double d3,
-        ZetaData<GData,GData,GData>& zeta, int index)
+    static void ProcessZeta(const DirectBatch3<GData,GData,GData,C>& batch,
+                            ZetaData<GData,GData,GData>& zeta, double scale)
     {
-        std::complex<double> g1, g2, g3;
-        ProjectHelper<C>::ProjectShears(c1,c2,c3,g1,g2,g3);
+        const int N = DirectBatch3<GData,GData,GData,C>::N;
+        const long n = batch.n;
+        double gr[3][N];
+        double gi[3][N];
+        ProjectHelper<C>::template ProjectShearsBatch<N>(
+            n, batch.c1, batch.c2, batch.c3, gr, gi);
+        // All the products are linear in g1, so that is where the scale goes.
+        if (scale != 1.) {
+            for (long i=0; i<n; ++i) gr[0][i] *= scale;
+            for (long i=0; i<n; ++i) gi[0][i] *= scale;
+        }
 
         //std::complex<double> gam0 = g1 * g2 * g3;
         //std::complex<double> gam1 = std::conj(g1) * g2 * g3;
@@ -1108,63 +1743,131 @@ struct DirectHelper<GData,GData,GData>
         // so faster to do this manually.
         // The above uses 32 multiplies and 16 adds.
         // We can do this with just 12 multiplies and 12 adds.
-        double g1rg2r = g1.real() * g2.real();
-        double g1rg2i = g1.real() * g2.imag();
-        double g1ig2r = g1.imag() * g2.real();
-        double g1ig2i = g1.imag() * g2.imag();
-
-        double g1g2r = g1rg2r - g1ig2i;
-        double g1g2i = g1rg2i + g1ig2r;
-        double g1cg2r = g1rg2r + g1ig2i;
-        double g1cg2i = g1rg2i - g1ig2r;
-
-        double g1g2rg3r = g1g2r * g3.real();
-        double g1g2rg3i = g1g2r * g3.imag();
-        double g1g2ig3r = g1g2i * g3.real();
-        double g1g2ig3i = g1g2i * g3.imag();
-        double g1cg2rg3r = g1cg2r * g3.real();
-        double g1cg2rg3i = g1cg2r * g3.imag();
-        double g1cg2ig3r = g1cg2i * g3.real();
-        double g1cg2ig3i = g1cg2i * g3.imag();
-
-        zeta.gam0r[index] += g1g2rg3r - g1g2ig3i;
-        zeta.gam0i[index] += g1g2rg3i + g1g2ig3r;
-        zeta.gam1r[index] += g1cg2rg3r - g1cg2ig3i;
-        zeta.gam1i[index] += g1cg2rg3i + g1cg2ig3r;
-        zeta.gam2r[index] += g1cg2rg3r + g1cg2ig3i;
-        zeta.gam2i[index] += g1cg2rg3i - g1cg2ig3r;
-        zeta.gam3r[index] += g1g2rg3r + g1g2ig3i;
-        zeta.gam3i[index] += -g1g2rg3i + g1g2ig3r;
+        double gam[8][N];
+        for (long i=0; i<n; ++i) {
+            const double g1r = gr[0][i], g1i = gi[0][i];
+            const double g2r = gr[1][i], g2i = gi[1][i];
+            const double g3r = gr[2][i], g3i = gi[2][i];
+
+            const double g1rg2r = g1r * g2r;
+            const double g1rg2i = g1r * g2i;
+            const double g1ig2r = g1i * g2r;
+            const double g1ig2i = g1i * g2i;
+
+            const double g1g2r = g1rg2r - g1ig2i;
+            const double g1g2i = g1rg2i + g1ig2r;
+            const double g1cg2r = g1rg2r + g1ig2i;
+            const double g1cg2i = g1rg2i - g1ig2r;
+
+            const double g1g2rg3r = g1g2r * g3r;
+            const double g1g2rg3i = g1g2r * g3i;
+            const double g1g2ig3r = g1g2i * g3r;
+            const double g1g2ig3i = g1g2i * g3i;
+            const double g1cg2rg3r = g1cg2r * g3r;
+            const double g1cg2rg3i = g1cg2r * g3i;
+            const double g1cg2ig3r = g1cg2i * g3r;
+            const double g1cg2ig3i = g1cg2i * g3i;
+
+            gam[0][i] = g1g2rg3r - g1g2ig3i;
+            gam[1][i] = g1g2rg3i + g1g2ig3r;
+            gam[2][i] = g1cg2rg3r - g1cg2ig3i;
+            gam[3][i] = g1cg2rg3i + g1cg2ig3r;
+            gam[4][i] = g1cg2rg3r + g1cg2ig3i;
+            gam[5][i] = g1cg2rg3i - g1cg2ig3r;
+            gam[6][i] = g1g2rg3r + g1g2ig3i;
+            gam[7][i] = -g1g2rg3i + g1g2ig3r;
+        }
+
+        // Several triangles in a batch can have the same index, so this part stays scalar.
+        for (long i=0; i<n; ++i) {
+            const int index = batch.index[i];
+            zeta.gam0r[index] += gam[0][i];
+            zeta.gam0i[index] += gam[1][i];
+            zeta.gam1r[index] += gam[2][i];
+            zeta.gam1i[index] += gam[3][i];
+            zeta.gam2r[index] += gam[4][i];
+            zeta.gam2i[index] += gam[5][i];
+            zeta.gam3r[index] += gam[6][i];
+            zeta.gam3i[index] += gam[7][i];
+        }
     }
 };
 
-
 template <int D1, int D2, int D3, int B> template <int C>
-void BinnedCorr3<D1,D2,D3,B>::directProcess111(
+void BinnedCorr3<D1,D2,D3,B>::addDirect(
     const Cell<D1,C>& c1, const Cell<D2,C>& c2, const Cell<D3,C>& c3,
     const double d1, const double d2, const double d3,
     const double logr, const double u, const double v, const int index)
 {
-    double nnn = double(c1.getData().getN()) * double(c2.getData().getN()) *
-        double(c3.getData().getN());
-    _ntri[index] += nnn;
     xdbg<<"            index = "<<index<<std::endl;
-    xdbg<<"            nnn = "<<nnn<<std::endl;
-    xdbg<<"            ntri = "<<_ntri[index]<<std::endl;
-
-    double www = double(c1.getData().getW()) * double(c2.getData().getW()) *
-        double(c3.getData().getW());
-    _meand1[index] += www * d1;
-    _meanlogd1[index] += www * log(d1);
-    _meand2[index] += www * d2;
-    _meanlogd2[index] += www * logr;
-    _meand3[index] += www * d3;
-    _meanlogd3[index] += www * log(d3);
-    _meanu[index] += www * u;
-    _meanv[index] += www * v;
-    _weight[index] += www;
-
-    DirectHelper<D1,D2,D3>::template ProcessZeta<C>(c1,c2,c3,d1,d2,d3,_zeta,index);
+    if (!_batch) _batch = new DirectBatch3<D1,D2,D3,C>();
+    DirectBatch3<D1,D2,D3,C>& batch = *static_cast<DirectBatch3<D1,D2,D3,C>*>(_batch);
+    batch.add(&c1,&c2,&c3,d1,d2,d3,logr,u,v,index);
+    if (batch.full()) directProcessBatch(batch);
+}
+
+template <int D1, int D2, int D3, int B> template <int C>
+void BinnedCorr3<D1,D2,D3,B>::directProcessBatch(DirectBatch3<D1,D2,D3,C>& batch)
+{
+    const int N = DirectBatch3<D1,D2,D3,C>::N;
+    const long n = batch.n;
+    xdbg<<"directProcessBatch: n = "<<n<<std::endl;
+
+    // First the parts that don't depend on the bins, in loops the compiler can vectorize.
+    double nnn[N];
+    double www[N];
+    double logd1[N];
+    double logd3[N];
+    for (long i=0; i<n; ++i)
+        nnn[i] = _scale * double(batch.c1[i]->getData().getN()) *
+            double(batch.c2[i]->getData().getN()) * double(batch.c3[i]->getData().getN());
+    for (long i=0; i<n; ++i)
+        www[i] = _scale * double(batch.c1[i]->getData().getW()) *
+            double(batch.c2[i]->getData().getW()) * double(batch.c3[i]->getData().getW());
+    LogBlock(batch.d1, logd1, n);
+    LogBlock(batch.d3, logd3, n);
+
+#ifdef _OPENMP
+    // If other threads are using this accumulator too, lock the stripes of all the bins in
+    // the batch while we update them.
+    unsigned long long stripes = 0;
+    if (_locks) {
+        for (long i=0; i<n; ++i) stripes |= StripeLocks::stripeBit(batch.index[i]);
+        _locks->lockMask(stripes);
+    }
+#endif
+
+    for (long i=0; i<n; ++i) {
+        const int index = batch.index[i];
+        const double w = www[i];
+        _ntri[index] += nnn[i];
+        _meand1[index] += w * batch.d1[i];
+        _meanlogd1[index] += w * logd1[i];
+        _meand2[index] += w * batch.d2[i];
+        _meanlogd2[index] += w * batch.logr[i];
+        _meand3[index] += w * batch.d3[i];
+        _meanlogd3[index] += w * logd3[i];
+        _meanu[index] += w * batch.u[i];
+        _meanv[index] += w * batch.v[i];
+        _weight[index] += w;
+    }
+
+    DirectHelper<D1,D2,D3>::template ProcessZeta<C>(batch,_zeta,_scale);
+
+#ifdef _OPENMP
+    if (_locks) _locks->unlockMask(stripes);
+#endif
+    batch.n = 0;
+}
+
+template <int D1, int D2, int D3, int B> template <int C>
+void BinnedCorr3<D1,D2,D3,B>::finishBatch()
+{
+    if (!_batch) return;
+    DirectBatch3<D1,D2,D3,C>* batch = static_cast<DirectBatch3<D1,D2,D3,C>*>(_batch);
+    directProcessBatch(*batch);
+    delete batch;
+    _batch = 0;
 }
 
 template <int D1, int D2, int D3, int B>
@@ -1199,6 +1902,7 @@ void BinnedCorr3<D1,D2,D3,B>::operator+=(const BinnedCorr3<D1,D2,D3,B>& rhs)
     for (int i=0; i<_ntot; ++i) _meanv[i] += rhs._meanv[i];
     for (int i=0; i<_ntot; ++i) _weight[i] += rhs._weight[i];
     for (int i=0; i<_ntot; ++i) _ntri[i] += rhs._ntri[i];
+    _stats += rhs._stats;
 }
 
 //
@@ -1223,6 +1927,7 @@ void* BuildCorr3c(int bin_type,
                   double minu, double maxu, int nubins, double ubinsize, double bu,
                   double minv, double maxv, int nvbins, double vbinsize, double bv,
                   double xp, double yp, double zp,
+                  double max_accum_mem,
                   double* zeta0, double* zeta1, double* zeta2, double* zeta3,
                   double* zeta4, double* zeta5, double* zeta6, double* zeta7,
                   double* meand1, double* meanlogd1, double* meand2, double* meanlogd2,
@@ -1235,6 +1940,7 @@ void* BuildCorr3c(int bin_type,
             minu, maxu, nubins, ubinsize, bu,
             minv, maxv, nvbins, vbinsize, bv,
             xp, yp, zp,
+            max_accum_mem,
             zeta0, zeta1, zeta2, zeta3, zeta4, zeta5, zeta6, zeta7,
             meand1, meanlogd1, meand2, meanlogd2, meand3, meanlogd3, meanu, meanv,
             weight, ntri));
@@ -1245,6 +1951,7 @@ void* BuildCorr3(int d1, int d2, int d3, int bin_type,
                  double minu, double maxu, int nubins, double ubinsize, double bu,
                  double minv, double maxv, int nvbins, double vbinsize, double bv,
                  double xp, double yp, double zp,
+                 double max_accum_mem,
                  double* zeta0, double* zeta1, double* zeta2, double* zeta3,
                  double* zeta4, double* zeta5, double* zeta6, double* zeta7,
                  double* meand1, double* meanlogd1, double* meand2, double* meanlogd2,
@@ -1262,6 +1969,7 @@ void* BuildCorr3(int d1, int d2, int d3, int bin_type,
                minu, maxu, nubins, ubinsize, bu,
                minv, maxv, nvbins, vbinsize, bv,
                xp, yp, zp,
+               max_accum_mem,
                zeta0, zeta1, zeta2, zeta3, zeta4, zeta5, zeta6, zeta7,
                meand1, meanlogd1, meand2, meanlogd2, meand3, meanlogd3, meanu, meanv,
                weight, ntri);
@@ -1272,6 +1980,7 @@ void* BuildCorr3(int d1, int d2, int d3, int bin_type,
                minu, maxu, nubins, ubinsize, bu,
                minv, maxv, nvbins, vbinsize, bv,
                xp, yp, zp,
+               max_accum_mem,
                zeta0, zeta1, zeta2, zeta3, zeta4, zeta5, zeta6, zeta7,
                meand1, meanlogd1, meand2, meanlogd2, meand3, meanlogd3, meanu, meanv,
                weight, ntri);
@@ -1282,6 +1991,7 @@ void* BuildCorr3(int d1, int d2, int d3, int bin_type,
                minu, maxu, nubins, ubinsize, bu,
                minv, maxv, nvbins, vbinsize, bv,
                xp, yp, zp,
+               max_accum_mem,
                zeta0, zeta1, zeta2, zeta3, zeta4, zeta5, zeta6, zeta7,
                meand1, meanlogd1, meand2, meanlogd2, meand3, meanlogd3, meanu, meanv,
                weight, ntri);
@@ -1321,24 +2031,87 @@ void DestroyCorr3(void* corr, int d1, int d2, int d3, int bin_type)
     }
 }
 
+template <int D1, int D2, int D3>
+void GetPruneStats3c(void* corr, int bin_type, long* counts, long* terminal, double* depth)
+{
+    Assert(bin_type == Log);
+    static_cast<BinnedCorr3<D1,D2,D3,Log>*>(corr)->writePruneStats(counts, terminal, depth);
+}
+
+int GetPruneStats3(void* corr, int d1, int d2, int d3, int bin_type,
+                   long* counts, long* terminal, double* depth)
+{
+    dbg<<"Start GetPruneStats3 "<<d1<<" "<<d2<<" "<<d3<<" "<<bin_type<<std::endl;
+    Assert(d2 == d1);
+    Assert(d3 == d1);
+    if (!PruneStats::enabled) return 0;
+    switch(d1) {
+      case NData:
+           GetPruneStats3c<NData, NData, NData>(corr, bin_type, counts, terminal, depth);
+           break;
+      case KData:
+           GetPruneStats3c<KData, KData, KData>(corr, bin_type, counts, terminal, depth);
+           break;
+      case GData:
+           GetPruneStats3c<GData, GData, GData>(corr, bin_type, counts, terminal, depth);
+           break;
+      default:
+           Assert(false);
+    }
+    return 1;
+}
+
+template <int D1, int D2, int D3>
+int GetCopyBytes3c(void* corr, int bin_type, int nsets, int nthreads, double* bytes)
+{
+    Assert(bin_type == Log);
+    BinnedCorr3<D1,D2,D3,Log>* bc3 = static_cast<BinnedCorr3<D1,D2,D3,Log>*>(corr);
+    *bytes = bc3->getCopyBytes();
+    return bc3->getNCopies(nthreads, nsets * bc3->getCopyBytes());
+}
+
+int GetCopyBytes3(void* corr, int d1, int d2, int d3, int bin_type, int nsets, int nthreads,
+                  double* bytes)
+{
+    dbg<<"Start GetCopyBytes3 "<<d1<<" "<<d2<<" "<<d3<<" "<<bin_type<<" "<<nsets<<" "<<
+        nthreads<<std::endl;
+    Assert(d2 == d1);
+    Assert(d3 == d1);
+    switch(d1) {
+      case NData:
+           return GetCopyBytes3c<NData, NData, NData>(corr, bin_type, nsets, nthreads, bytes);
+           break;
+      case KData:
+           return GetCopyBytes3c<KData, KData, KData>(corr, bin_type, nsets, nthreads, bytes);
+           break;
+      case GData:
+           return GetCopyBytes3c<GData, GData, GData>(corr, bin_type, nsets, nthreads, bytes);
+           break;
+      default:
+           Assert(false);
+    }
+    return 0;
+}
+
 template <int M, int D, int B>
-void ProcessAuto3e(BinnedCorr3<D,D,D,B>* corr, void* field, int dots, int coords)
+void ProcessAuto3e(BinnedCorr3<D,D,D,B>* corr, void* field, int dots, double* progress,
+                   double* sample, int coords)
 {
     switch(coords) {
       case Flat:
            Assert((MetricHelper<M,0>::_Flat == int(Flat)));
            corr->template process<MetricHelper<M,0>::_Flat,M>(
-               *static_cast<Field<D,MetricHelper<M,0>::_Flat>*>(field), dots);
+               *static_cast<Field<D,MetricHelper<M,0>::_Flat>*>(field), dots, progress, sample);
            break;
       case Sphere:
            Assert((MetricHelper<M,0>::_Sphere == int(Sphere)));
            corr->template process<MetricHelper<M,0>::_Sphere,M>(
-               *static_cast<Field<D,MetricHelper<M,0>::_Sphere>*>(field), dots);
+               *static_cast<Field<D,MetricHelper<M,0>::_Sphere>*>(field), dots, progress, sample);
            break;
       case ThreeD:
            Assert((MetricHelper<M,0>::_ThreeD == int(ThreeD)));
            corr->template process<MetricHelper<M,0>::_ThreeD,M>(
-               *static_cast<Field<D,MetricHelper<M,0>::_ThreeD>*>(field), dots);
+               *static_cast<Field<D,MetricHelper<M,0>::_ThreeD>*>(field), dots, progress, sample);
            break;
       default:
            Assert(false);
@@ -1346,43 +2119,53 @@ void ProcessAuto3e(BinnedCorr3<D,D,D,B>* corr, void* field, int dots, int coords
 }
 
 template <int D, int B>
-void ProcessAuto3d(BinnedCorr3<D,D,D,B>* corr, void* field, int dots, int coords, int metric)
+void ProcessAuto3d(BinnedCorr3<D,D,D,B>* corr, void* field, int dots, double* progress,
+                   double* sample, int coords, int metric)
 {
     switch(metric) {
+#ifdef TREECORR_USE_EUCLIDEAN
       case Euclidean:
-           ProcessAuto3e<Euclidean>(corr, field, dots, coords);
+           ProcessAuto3e<Euclidean>(corr, field, dots, progress, sample, coords);
            break;
+#endif
+#ifdef TREECORR_USE_ARC
       case Arc:
-           ProcessAuto3e<Arc>(corr, field, dots, coords);
+           ProcessAuto3e<Arc>(corr, field, dots, progress, sample, coords);
            break;
+#endif
+#ifdef TREECORR_USE_PERIODIC
       case Periodic:
-           ProcessAuto3e<Periodic>(corr, field, dots, coords);
+           ProcessAuto3e<Periodic>(corr, field, dots, progress, sample, coords);
            break;
+#endif
       default:
            Assert(false);
     }
 }
 
 template <int D>
-void ProcessAuto3c(void* corr, void* field, int dots, int coords, int bin_type, int metric)
+void ProcessAuto3c(void* corr, void* field, int dots, double* progress, double* sample,
+                   int coords, int bin_type, int metric)
 {
     Assert(bin_type == Log);
-    ProcessAuto3d(static_cast<BinnedCorr3<D,D,D,Log>*>(corr), field, dots, coords, metric);
+    ProcessAuto3d(static_cast<BinnedCorr3<D,D,D,Log>*>(corr), field, dots, progress, sample,
+                  coords, metric);
 }
 
-void ProcessAuto3(void* corr, void* field, int dots, int d, int coords, int bin_type, int metric)
+void ProcessAuto3(void* corr, void* field, int dots, double* progress, double* sample,
+                  int d, int coords, int bin_type, int metric)
 {
     dbg<<"Start ProcessAuto3 "<<d<<" "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
 
     switch(d) {
       case NData:
-           ProcessAuto3c<NData>(corr, field, dots, coords, bin_type, metric);
+           ProcessAuto3c<NData>(corr, field, dots, progress, sample, coords, bin_type, metric);
            break;
       case KData:
-           ProcessAuto3c<KData>(corr, field, dots, coords, bin_type, metric);
+           ProcessAuto3c<KData>(corr, field, dots, progress, sample, coords, bin_type, metric);
            break;
       case GData:
-           ProcessAuto3c<GData>(corr, field, dots, coords, bin_type, metric);
+           ProcessAuto3c<GData>(corr, field, dots, progress, sample, coords, bin_type, metric);
            break;
       default:
            Assert(false);
@@ -1393,7 +2176,8 @@ template <int M, int D1, int D2, int B>
 void ProcessCross12e(BinnedCorr3<D1,D2,D2,B>* corr122,
                     BinnedCorr3<D2,D1,D2,B>* corr212,
                     BinnedCorr3<D2,D2,D1,B>* corr221,
-                    void* field1, void* field2, int dots, int coords)
+                    void* field1, void* field2, int dots, double* progress, double* sample,
+                    int coords)
 {
     switch(coords) {
       case Flat:
@@ -1401,21 +2185,21 @@ void ProcessCross12e(BinnedCorr3<D1,D2,D2,B>* corr122,
            corr122->template process<MetricHelper<M,0>::_Flat,M>(
                corr212, corr221,
                *static_cast<Field<D1,MetricHelper<M,0>::_Flat>*>(field1),
-               *static_cast<Field<D2,MetricHelper<M,0>::_Flat>*>(field2), dots);
+               *static_cast<Field<D2,MetricHelper<M,0>::_Flat>*>(field2), dots, progress, sample);
            break;
       case Sphere:
            Assert((MetricHelper<M,0>::_Sphere == int(Sphere)));
            corr122->template process<MetricHelper<M,0>::_Sphere,M>(
                corr212, corr221,
                *static_cast<Field<D1,MetricHelper<M,0>::_Sphere>*>(field1),
-               *static_cast<Field<D2,MetricHelper<M,0>::_Sphere>*>(field2), dots);
+               *static_cast<Field<D2,MetricHelper<M,0>::_Sphere>*>(field2), dots, progress, sample);
            break;
       case ThreeD:
            Assert((MetricHelper<M,0>::_ThreeD == int(ThreeD)));
            corr122->template process<MetricHelper<M,0>::_ThreeD,M>(
                corr212, corr221,
                *static_cast<Field<D1,MetricHelper<M,0>::_ThreeD>*>(field1),
-               *static_cast<Field<D2,MetricHelper<M,0>::_ThreeD>*>(field2), dots);
+               *static_cast<Field<D2,MetricHelper<M,0>::_ThreeD>*>(field2), dots, progress, sample);
            break;
       default:
            Assert(false);
@@ -1426,21 +2210,28 @@ template <int D1, int D2, int B>
 void ProcessCross12d(BinnedCorr3<D1,D2,D2,B>* corr122,
                     BinnedCorr3<D2,D1,D2,B>* corr212,
                     BinnedCorr3<D2,D2,D1,B>* corr221,
-                    void* field1, void* field2, int dots, int coords, int metric)
+                    void* field1, void* field2, int dots, double* progress, double* sample,
+                    int coords, int metric)
 {
     switch(metric) {
+#ifdef TREECORR_USE_EUCLIDEAN
       case Euclidean:
            ProcessCross12e<Euclidean>(corr122, corr212, corr221,
-                                     field1, field2, dots, coords);
+                                     field1, field2, dots, progress, sample, coords);
            break;
+#endif
+#ifdef TREECORR_USE_ARC
       case Arc:
            ProcessCross12e<Arc>(corr122, corr212, corr221,
-                               field1, field2, dots, coords);
+                               field1, field2, dots, progress, sample, coords);
            break;
+#endif
+#ifdef TREECORR_USE_PERIODIC
       case Periodic:
            ProcessCross12e<Periodic>(corr122, corr212, corr221,
-                                    field1, field2, dots, coords);
+                                    field1, field2, dots, progress, sample, coords);
            break;
+#endif
       default:
            Assert(false);
     }
@@ -1448,18 +2239,18 @@ void ProcessCross12d(BinnedCorr3<D1,D2,D2,B>* corr122,
 
 template <int D1, int D2>
 void ProcessCross12c(void* corr122, void* corr212, void* corr221,
-                     void* field1, void* field2, int dots,
+                     void* field1, void* field2, int dots, double* progress, double* sample,
                      int bin_type, int coords, int metric)
 {
     Assert(bin_type == Log);
     ProcessCross12d(static_cast<BinnedCorr3<D1,D2,D2,Log>*>(corr122),
                    static_cast<BinnedCorr3<D2,D1,D2,Log>*>(corr212),
                    static_cast<BinnedCorr3<D2,D2,D1,Log>*>(corr221),
-                   field1, field2, dots, coords, metric);
+                   field1, field2, dots, progress, sample, coords, metric);
 }
 
 void ProcessCross12(void* corr122, void* corr212, void* corr221,
-                    void* field1, void* field2, int dots,
+                    void* field1, void* field2, int dots, double* progress, double* sample,
                     int d1, int d2, int coords, int bin_type, int metric)
 {
     dbg<<"Start ProcessCross12 "<<d1<<" "<<d2<<" "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
@@ -1468,17 +2259,17 @@ void ProcessCross12(void* corr122, void* corr212, void* corr221,
     switch(d1) {
       case NData:
            ProcessCross12c<NData,NData>(corr122, corr212, corr221,
-                                        field1, field2, dots,
+                                        field1, field2, dots, progress, sample,
                                         bin_type, coords, metric);
            break;
       case KData:
            ProcessCross12c<KData,KData>(corr122, corr212, corr221,
-                                        field1, field2, dots,
+                                        field1, field2, dots, progress, sample,
                                         bin_type, coords, metric);
            break;
       case GData:
            ProcessCross12c<GData,GData>(corr122, corr212, corr221,
-                                        field1, field2, dots,
+                                        field1, field2, dots, progress, sample,
                                         bin_type, coords, metric);
            break;
       default:
@@ -1494,7 +2285,7 @@ void ProcessCross3e(BinnedCorr3<D1,D2,D3,B>* corr123,
                     BinnedCorr3<D3,D1,D2,B>* corr312,
                     BinnedCorr3<D3,D2,D1,B>* corr321,
                     void* field1, void* field2, void* field3,
-                    int dots, int coords)
+                    int dots, double* progress, double* sample, int coords)
 {
     switch(coords) {
       case Flat:
@@ -1503,7 +2294,7 @@ void ProcessCross3e(BinnedCorr3<D1,D2,D3,B>* corr123,
                corr132, corr213, corr231, corr312, corr321,
                *static_cast<Field<D1,MetricHelper<M,0>::_Flat>*>(field1),
                *static_cast<Field<D2,MetricHelper<M,0>::_Flat>*>(field2),
-               *static_cast<Field<D3,MetricHelper<M,0>::_Flat>*>(field3), dots);
+               *static_cast<Field<D3,MetricHelper<M,0>::_Flat>*>(field3), dots, progress, sample);
            break;
       case Sphere:
            Assert((MetricHelper<M,0>::_Sphere == int(Sphere)));
@@ -1511,7 +2302,7 @@ void ProcessCross3e(BinnedCorr3<D1,D2,D3,B>* corr123,
                corr132, corr213, corr231, corr312, corr321,
                *static_cast<Field<D1,MetricHelper<M,0>::_Sphere>*>(field1),
                *static_cast<Field<D2,MetricHelper<M,0>::_Sphere>*>(field2),
-               *static_cast<Field<D3,MetricHelper<M,0>::_Sphere>*>(field3), dots);
+               *static_cast<Field<D3,MetricHelper<M,0>::_Sphere>*>(field3), dots, progress, sample);
            break;
       case ThreeD:
            Assert((MetricHelper<M,0>::_ThreeD == int(ThreeD)));
@@ -1519,7 +2310,7 @@ void ProcessCross3e(BinnedCorr3<D1,D2,D3,B>* corr123,
                corr132, corr213, corr231, corr312, corr321,
                *static_cast<Field<D1,MetricHelper<M,0>::_ThreeD>*>(field1),
                *static_cast<Field<D2,MetricHelper<M,0>::_ThreeD>*>(field2),
-               *static_cast<Field<D3,MetricHelper<M,0>::_ThreeD>*>(field3), dots);
+               *static_cast<Field<D3,MetricHelper<M,0>::_ThreeD>*>(field3), dots, progress, sample);
            break;
       default:
            Assert(false);
@@ -1534,21 +2325,27 @@ void ProcessCross3d(BinnedCorr3<D1,D2,D3,B>* corr123,
                     BinnedCorr3<D3,D1,D2,B>* corr312,
                     BinnedCorr3<D3,D2,D1,B>* corr321,
                     void* field1, void* field2, void* field3,
-                    int dots, int coords, int metric)
+                    int dots, double* progress, double* sample, int coords, int metric)
 {
     switch(metric) {
+#ifdef TREECORR_USE_EUCLIDEAN
       case Euclidean:
            ProcessCross3e<Euclidean>(corr123, corr132, corr213, corr231, corr312, corr321,
-                                     field1, field2, field3, dots, coords);
+                                     field1, field2, field3, dots, progress, sample, coords);
            break;
+#endif
+#ifdef TREECORR_USE_ARC
       case Arc:
            ProcessCross3e<Arc>(corr123, corr132, corr213, corr231, corr312, corr321,
-                               field1, field2, field3, dots, coords);
+                               field1, field2, field3, dots, progress, sample, coords);
            break;
+#endif
+#ifdef TREECORR_USE_PERIODIC
       case Periodic:
            ProcessCross3e<Periodic>(corr123, corr132, corr213, corr231, corr312, corr321,
-                                    field1, field2, field3, dots, coords);
+                                    field1, field2, field3, dots, progress, sample, coords);
            break;
+#endif
       default:
            Assert(false);
     }
@@ -1558,6 +2355,7 @@ template <int D1, int D2, int D3>
 void ProcessCross3c(void* corr123, void* corr132, void* corr213,
                     void* corr231, void* corr312, void* corr321,
                     void* field1, void* field2, void* field3, int dots,
+                    double* progress, double* sample,
                     int bin_type, int coords, int metric)
 {
     Assert(bin_type == Log);
@@ -1567,12 +2365,13 @@ void ProcessCross3c(void* corr123, void* corr132, void* corr213,
                    static_cast<BinnedCorr3<D2,D3,D1,Log>*>(corr231),
                    static_cast<BinnedCorr3<D3,D1,D2,Log>*>(corr312),
                    static_cast<BinnedCorr3<D3,D2,D1,Log>*>(corr321),
-                   field1, field2, field3, dots, coords, metric);
+                   field1, field2, field3, dots, progress, sample, coords, metric);
 }
 
 void ProcessCross3(void* corr123, void* corr132, void* corr213,
                    void* corr231, void* corr312, void* corr321,
                    void* field1, void* field2, void* field3, int dots,
+                   double* progress, double* sample,
                    int d1, int d2, int d3, int coords, int bin_type, int metric)
 {
     dbg<<"Start ProcessCross3 "<<d1<<" "<<d2<<" "<<d3<<" "<<coords<<" "<<bin_type<<" "<<metric<<std::endl;
@@ -1582,20 +2381,297 @@ void ProcessCross3(void* corr123, void* corr132, void* corr213,
     switch(d1) {
       case NData:
            ProcessCross3c<NData,NData,NData>(corr123, corr132, corr213, corr231, corr312, corr321,
-                                             field1, field2, field3, dots,
+                                             field1, field2, field3, dots, progress, sample,
                                              bin_type, coords, metric);
            break;
       case KData:
            ProcessCross3c<KData,KData,KData>(corr123, corr132, corr213, corr231, corr312, corr321,
-                                             field1, field2, field3, dots,
+                                             field1, field2, field3, dots, progress, sample,
                                              bin_type, coords, metric);
            break;
       case GData:
            ProcessCross3c<GData,GData,GData>(corr123, corr132, corr213, corr231, corr312, corr321,
-                                             field1, field2, field3, dots,
+                                             field1, field2, field3, dots, progress, sample,
                                              bin_type, coords, metric);
            break;
       default:
            Assert(false);
     }
 }
+
+// The center and size of a cell that would contain all the top-level cells of field.
+template <int D, int C>
+static void FieldBounds(const Field<D,C>& field, Position<C>& cen, double& size)
+{
+    const std::vector<Cell<D,C>*>& cells = field.getCells();
+    double n = 0.;
+    for (size_t i=0; i<cells.size(); ++i) {
+        cen += cells[i]->getData().getPos() * double(cells[i]->getN());
+        n += cells[i]->getN();
+    }
+    if (n > 0.) cen /= n;
+    cen.normalize();
+    size = 0.;
+    for (size_t i=0; i<cells.size(); ++i) {
+        double s = sqrt((cells[i]->getData().getPos() - cen).normSq()) + cells[i]->getSize();
+        if (s > size) size = s;
+    }
+}
+
+template <int M, int D, int B, int C>
+void PrunePatches3f(BinnedCorr3<D,D,D,B>* corr, void** fields1, void** fields2,
+                    void** fields3, int ntriplets, int* keep)
+{
+    // Most patches are in many sets, so only find the bounds of each field once.
+    std::map<void*, std::pair<Position<C>, double> > bounds;
+    void** fields[3] = { fields1, fields2, fields3 };
+    for (int t=0; t<ntriplets; ++t) {
+        const std::pair<Position<C>, double>* b[3];
+        for (int m=0; m<3; ++m) {
+            void* field = fields[m][t];
+            if (bounds.find(field) == bounds.end()) {
+                std::pair<Position<C>, double>& bf = bounds[field];
+                FieldBounds(*static_cast<Field<D,C>*>(field), bf.first, bf.second);
+            }
+            b[m] = &bounds[field];
+        }
+        keep[t] = corr->template canFormTriangles<C,M>(b[0]->first, b[0]->second,
+                                                        b[1]->first, b[1]->second,
+                                                        b[2]->first, b[2]->second);
+    }
+}
+
+// For sorting the indices of the sets of patches in order of decreasing work.
+struct MoreWork
+{
+    MoreWork(const std::vector<double>& work) : _work(work) {}
+    bool operator()(int a, int b) const { return _work[a] > _work[b]; }
+    const std::vector<double>& _work;
+};
+
+template <int M, int D, int B, int C>
+void ProcessPatches3f(void** corrs, void** fields1, void** fields2, void** fields3,
+                      int ntriplets, int dots, double* progress)
+{
+    typedef BinnedCorr3<D,D,D,B> BC3;
+    // The work for each set is roughly the product of the numbers of objects.  The top-level
+    // cells of each field are built here too, since that isn't safe for several threads to
+    // do at once.
+    std::vector<double> work(ntriplets);
+    for (int t=0; t<ntriplets; ++t) {
+        const Field<D,C>* f1 = static_cast<Field<D,C>*>(fields1[t]);
+        const Field<D,C>* f2 = static_cast<Field<D,C>*>(fields2[t]);
+        const Field<D,C>* f3 = static_cast<Field<D,C>*>(fields3[t]);
+        f1->getNTopLevel();
+        f2->getNTopLevel();
+        f3->getNTopLevel();
+        work[t] = double(f1->getNObj()) * double(f2->getNObj()) * double(f3->getNObj());
+    }
+    if (progress) StartProgress(progress, work);
+
+#ifdef _OPENMP
+    // As in ProcessPatches2, but when the sets run in parallel, each one uses processSerial,
+    // so it accumulates directly into its own corr objects rather than making copies of them
+    // for a parallel region with just the one thread.
+    const bool by_triplet = ntriplets >= PATCH_TRIPLETS_PER_THREAD * omp_get_max_threads();
+    dbg<<"by_triplet = "<<by_triplet<<std::endl;
+#else
+    const bool by_triplet = true;
+#endif
+
+    // Start with the sets with the most work, so the small ones at the end can fill in around
+    // them when running in parallel.
+    std::vector<int> order(ntriplets);
+    for (int t=0; t<ntriplets; ++t) order[t] = t;
+    std::sort(order.begin(), order.end(), MoreWork(work));
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if (by_triplet)
+#endif
+    for (int q=0; q<ntriplets; ++q) {
+        const int t = order[q];
+        BC3* const* c = reinterpret_cast<BC3* const*>(corrs + 6*t);
+        const Field<D,C>& f1 = *static_cast<Field<D,C>*>(fields1[t]);
+        const Field<D,C>& f2 = *static_cast<Field<D,C>*>(fields2[t]);
+        const Field<D,C>& f3 = *static_cast<Field<D,C>*>(fields3[t]);
+        if (by_triplet)
+            c[0]->template processSerial<C,M>(c[1], c[2], c[3], c[4], c[5], f1, f2, f3);
+        else
+            c[0]->template process<C,M>(c[1], c[2], c[3], c[4], c[5], f1, f2, f3, false, 0, 0);
+        if (progress) AddProgress(progress, work[t]);
+        if (dots) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            std::cout<<'.'<<std::flush;
+        }
+    }
+    if (dots) std::cout<<std::endl;
+}
+
+template <int M, int D, int B>
+void PrunePatches3e(BinnedCorr3<D,D,D,B>* corr, void** fields1, void** fields2, void** fields3,
+                    int ntriplets, int* keep, int coords)
+{
+    switch(coords) {
+      case Flat:
+           Assert((MetricHelper<M,0>::_Flat == int(Flat)));
+           PrunePatches3f<M,D,B,MetricHelper<M,0>::_Flat>(
+               corr, fields1, fields2, fields3, ntriplets, keep);
+           break;
+      case Sphere:
+           Assert((MetricHelper<M,0>::_Sphere == int(Sphere)));
+           PrunePatches3f<M,D,B,MetricHelper<M,0>::_Sphere>(
+               corr, fields1, fields2, fields3, ntriplets, keep);
+           break;
+      case ThreeD:
+           Assert((MetricHelper<M,0>::_ThreeD == int(ThreeD)));
+           PrunePatches3f<M,D,B,MetricHelper<M,0>::_ThreeD>(
+               corr, fields1, fields2, fields3, ntriplets, keep);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D, int B>
+void PrunePatches3d(BinnedCorr3<D,D,D,B>* corr, void** fields1, void** fields2, void** fields3,
+                    int ntriplets, int* keep, int coords, int metric)
+{
+    switch(metric) {
+#ifdef TREECORR_USE_EUCLIDEAN
+      case Euclidean:
+           PrunePatches3e<Euclidean>(corr, fields1, fields2, fields3, ntriplets, keep, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_ARC
+      case Arc:
+           PrunePatches3e<Arc>(corr, fields1, fields2, fields3, ntriplets, keep, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_PERIODIC
+      case Periodic:
+           PrunePatches3e<Periodic>(corr, fields1, fields2, fields3, ntriplets, keep, coords);
+           break;
+#endif
+      default:
+           Assert(false);
+    }
+}
+
+template <int D>
+void PrunePatches3c(void* corr, void** fields1, void** fields2, void** fields3,
+                    int ntriplets, int* keep, int bin_type, int coords, int metric)
+{
+    Assert(bin_type == Log);
+    PrunePatches3d(static_cast<BinnedCorr3<D,D,D,Log>*>(corr), fields1, fields2, fields3,
+                   ntriplets, keep, coords, metric);
+}
+
+void PrunePatches3(void* corr, void** fields1, void** fields2, void** fields3,
+                   int ntriplets, int* keep,
+                   int d1, int d2, int d3, int coords, int bin_type, int metric)
+{
+    dbg<<"Start PrunePatches3: "<<ntriplets<<" "<<d1<<" "<<d2<<" "<<d3<<" "<<coords<<" "<<
+        bin_type<<" "<<metric<<std::endl;
+
+    Assert(d2 == d1);
+    Assert(d3 == d1);
+    switch(d1) {
+      case NData:
+           PrunePatches3c<NData>(corr, fields1, fields2, fields3, ntriplets, keep,
+                                 bin_type, coords, metric);
+           break;
+      case KData:
+           PrunePatches3c<KData>(corr, fields1, fields2, fields3, ntriplets, keep,
+                                 bin_type, coords, metric);
+           break;
+      case GData:
+           PrunePatches3c<GData>(corr, fields1, fields2, fields3, ntriplets, keep,
+                                 bin_type, coords, metric);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int M, int D, int B>
+void ProcessPatches3e(void** corrs, void** fields1, void** fields2, void** fields3,
+                      int ntriplets, int dots, double* progress, int coords)
+{
+    switch(coords) {
+      case Flat:
+           Assert((MetricHelper<M,0>::_Flat == int(Flat)));
+           ProcessPatches3f<M,D,B,MetricHelper<M,0>::_Flat>(
+               corrs, fields1, fields2, fields3, ntriplets, dots, progress);
+           break;
+      case Sphere:
+           Assert((MetricHelper<M,0>::_Sphere == int(Sphere)));
+           ProcessPatches3f<M,D,B,MetricHelper<M,0>::_Sphere>(
+               corrs, fields1, fields2, fields3, ntriplets, dots, progress);
+           break;
+      case ThreeD:
+           Assert((MetricHelper<M,0>::_ThreeD == int(ThreeD)));
+           ProcessPatches3f<M,D,B,MetricHelper<M,0>::_ThreeD>(
+               corrs, fields1, fields2, fields3, ntriplets, dots, progress);
+           break;
+      default:
+           Assert(false);
+    }
+}
+
+template <int D, int B>
+void ProcessPatches3d(void** corrs, void** fields1, void** fields2, void** fields3,
+                      int ntriplets, int dots, double* progress, int coords, int metric)
+{
+    switch(metric) {
+#ifdef TREECORR_USE_EUCLIDEAN
+      case Euclidean:
+           ProcessPatches3e<Euclidean,D,B>(corrs, fields1, fields2, fields3, ntriplets,
+                                           dots, progress, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_ARC
+      case Arc:
+           ProcessPatches3e<Arc,D,B>(corrs, fields1, fields2, fields3, ntriplets,
+                                     dots, progress, coords);
+           break;
+#endif
+#ifdef TREECORR_USE_PERIODIC
+      case Periodic:
+           ProcessPatches3e<Periodic,D,B>(corrs, fields1, fields2, fields3, ntriplets,
+                                          dots, progress, coords);
+           break;
+#endif
+      default:
+           Assert(false);
+    }
+}
+
+void ProcessPatches3(void** corrs, void** fields1, void** fields2, void** fields3,
+                     int ntriplets, int dots, double* progress,
+                     int d1, int d2, int d3, int coords, int bin_type, int metric)
+{
+    dbg<<"Start ProcessPatches3: "<<ntriplets<<" "<<d1<<" "<<d2<<" "<<d3<<" "<<coords<<" "<<
+        bin_type<<" "<<metric<<std::endl;
+
+    Assert(d2 == d1);
+    Assert(d3 == d1);
+    Assert(bin_type == Log);
+    switch(d1) {
+      case NData:
+           ProcessPatches3d<NData,Log>(corrs, fields1, fields2, fields3, ntriplets,
+                                       dots, progress, coords, metric);
+           break;
+      case KData:
+           ProcessPatches3d<KData,Log>(corrs, fields1, fields2, fields3, ntriplets,
+                                       dots, progress, coords, metric);
+           break;
+      case GData:
+           ProcessPatches3d<GData,Log>(corrs, fields1, fields2, fields3, ntriplets,
+                                       dots, progress, coords, metric);
+           break;
+      default:
+           Assert(false);
+    }
+}
@@ -22,6 +22,7 @@
 #include <sys/time.h>   // Unix-only
 #endif
 
+#include <cmath>
 #include <fstream>
 #include <limits>
 
@@ -86,14 +87,12 @@ double urand(long long seed)
 // CellData
 //
 
-template <int D, int C>
-double CalculateSizeSq(
-    const Position<C>& cen, const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
-    size_t start, size_t end)
+template <int C, class V>
+double CalculateSizeSq(const Position<C>& cen, const V& vdata, size_t start, size_t end)
 {
     double sizesq = 0.;
     for(size_t i=start;i<end;++i) {
-        double devsq = (cen-vdata[i].first->getPos()).normSq();
+        double devsq = (cen-GetPos(vdata,i)).normSq();
         if (devsq > sizesq) sizesq = devsq;
     }
     return sizesq;
@@ -136,23 +135,20 @@ double Cell<D,C>::calculateInertia() const
 }
 
 
-template <int D, int C>
-void BuildCellData(
-    const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, size_t start, size_t end,
-    Position<C>& pos, float& w)
+template <int C, class V>
+void BuildCellData(const V& vdata, size_t start, size_t end, Position<C>& pos, float& w)
 {
     Assert(start < end);
-    double wp = vdata[start].second.wpos;
-    pos = vdata[start].first->getPos();
+    double wp = GetWPos(vdata,start);
+    pos = GetPos(vdata,start);
     pos *= wp;
-    w = vdata[start].first->getW();
+    w = GetW(vdata,start);
     double sumwp = wp;
     for(size_t i=start+1; i!=end; ++i) {
-        const CellData<D,C>& data = *vdata[i].first;
-        wp = vdata[i].second.wpos;
-        pos += data.getPos() * wp;
+        wp = GetWPos(vdata,i);
+        pos += GetPos(vdata,i) * wp;
         sumwp += wp;
-        w += data.getW();
+        w += GetW(vdata,i);
     }
     if (sumwp != 0.) {
         pos /= sumwp;
@@ -161,7 +157,7 @@ void BuildCellData(
         pos.normalize();
     } else {
         // Make sure we don't have an invalid position, even if all wpos == 0.
-        pos = vdata[start].first->getPos();
+        pos = GetPos(vdata,start);
         // But in this case, we should have w == 0 too!
         Assert(w == 0.);
     }
@@ -171,44 +167,161 @@ template <int C>
 CellData<NData,C>::CellData(
     const std::vector<std::pair<CellData<NData,C>*,WPosLeafInfo> >& vdata, size_t start, size_t end) :
     _w(0.), _n(end-start)
-{ BuildCellData(vdata,start,end,_pos,_w); }
+{
+    Position<C> pos;
+    BuildCellData(vdata,start,end,pos,_w);
+    _pos = pos;
+}
+
+template <int C>
+CellData<NData,C>::CellData(const ColumnData<NData,C>& vdata, size_t start, size_t end) :
+    _w(0.), _n(end-start)
+{
+    Position<C> pos;
+    BuildCellData(vdata,start,end,pos,_w);
+    _pos = pos;
+}
 
 template <int C>
 CellData<KData,C>::CellData(
     const std::vector<std::pair<CellData<KData,C>*,WPosLeafInfo> >& vdata, size_t start, size_t end) :
     _wk(0.), _w(0.), _n(end-start)
-{ BuildCellData(vdata,start,end,_pos,_w); }
+{
+    Position<C> pos;
+    BuildCellData(vdata,start,end,pos,_w);
+    _pos = pos;
+}
+
+template <int C>
+CellData<KData,C>::CellData(const ColumnData<KData,C>& vdata, size_t start, size_t end) :
+    _wk(0.), _w(0.), _n(end-start)
+{
+    Position<C> pos;
+    BuildCellData(vdata,start,end,pos,_w);
+    _pos = pos;
+}
 
 template <int C>
 CellData<GData,C>::CellData(
     const std::vector<std::pair<CellData<GData,C>*,WPosLeafInfo> >& vdata, size_t start, size_t end) :
     _wg(0.), _w(0.), _n(end-start)
-{ BuildCellData(vdata,start,end,_pos,_w); }
+{
+    Position<C> pos;
+    BuildCellData(vdata,start,end,pos,_w);
+    _pos = pos;
+}
 
 template <int C>
-void CellData<KData,C>::finishAverages(
-    const std::vector<std::pair<CellData<KData,C>*,WPosLeafInfo> >& vdata, size_t start, size_t end)
+CellData<GData,C>::CellData(const ColumnData<GData,C>& vdata, size_t start, size_t end) :
+    _wg(0.), _w(0.), _n(end-start)
+{
+    Position<C> pos;
+    BuildCellData(vdata,start,end,pos,_w);
+    _pos = pos;
+}
+
+// When combining two CellData, we treat them as two objects with wpos = w.
+template <int D, int C>
+std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> > MakePairData(
+    const CellData<D,C>& c1, const CellData<D,C>& c2)
+{
+    std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> > vdata(2);
+    vdata[0].first = const_cast<CellData<D,C>*>(&c1);
+    vdata[0].second.wpos = c1.getW();
+    vdata[0].second.index = -1;
+    vdata[1].first = const_cast<CellData<D,C>*>(&c2);
+    vdata[1].second.wpos = c2.getW();
+    vdata[1].second.index = -1;
+    return vdata;
+}
+
+template <int C>
+CellData<NData,C>::CellData(const CellData<NData,C>& c1, const CellData<NData,C>& c2) :
+    _w(0.), _n(c1.getN() + c2.getN())
+{
+    Position<C> pos;
+    BuildCellData(MakePairData(c1,c2),0,2,pos,_w);
+    _pos = pos;
+}
+
+template <int C>
+CellData<KData,C>::CellData(const CellData<KData,C>& c1, const CellData<KData,C>& c2) :
+    _wk(0.), _w(0.), _n(c1.getN() + c2.getN())
+{
+    std::vector<std::pair<CellData<KData,C>*,WPosLeafInfo> > vdata = MakePairData(c1,c2);
+    Position<C> pos;
+    BuildCellData(vdata,0,2,pos,_w);
+    _pos = pos;
+    finishAverages(vdata,0,2);
+}
+
+template <int C>
+CellData<GData,C>::CellData(const CellData<GData,C>& c1, const CellData<GData,C>& c2) :
+    _wg(0.), _w(0.), _n(c1.getN() + c2.getN())
+{
+    std::vector<std::pair<CellData<GData,C>*,WPosLeafInfo> > vdata = MakePairData(c1,c2);
+    Position<C> pos;
+    BuildCellData(vdata,0,2,pos,_w);
+    _pos = pos;
+    finishAverages(vdata,0,2);
+}
+
+template <int C>
+inline double GetWK(
+    const std::vector<std::pair<CellData<KData,C>*,WPosLeafInfo> >& vdata, size_t i)
+{ return vdata[i].first->getWK(); }
+template <int C>
+inline double GetWK(const ColumnData<KData,C>& vdata, size_t i)
+{ return vdata.getWK(i); }
+
+template <int C>
+inline std::complex<double> GetWG(
+    const std::vector<std::pair<CellData<GData,C>*,WPosLeafInfo> >& vdata, size_t i)
+{ return vdata[i].first->getWG(); }
+template <int C>
+inline std::complex<double> GetWG(const ColumnData<GData,C>& vdata, size_t i)
+{ return vdata.getWG(i); }
+
+template <class V>
+double SumWK(const V& vdata, size_t start, size_t end)
 {
     // Accumulate in double precision for better accuracy.
     double dwk = 0.;
-    for(size_t i=start;i<end;++i) dwk += vdata[i].first->getWK();
-    _wk = dwk;
+    for(size_t i=start;i<end;++i) dwk += GetWK(vdata,i);
+    return dwk;
 }
 
-template <>
-void CellData<GData,Flat>::finishAverages(
-    const std::vector<std::pair<CellData<GData,Flat>*,WPosLeafInfo> >& vdata, size_t start, size_t end)
+template <class V>
+std::complex<double> SumWG(const V& vdata, size_t start, size_t end)
 {
     // Accumulate in double precision for better accuracy.
     std::complex<double> dwg(0.);
-    for(size_t i=start;i<end;++i) dwg += vdata[i].first->getWG();
-    _wg = dwg;
+    for(size_t i=start;i<end;++i) dwg += GetWG(vdata,i);
+    return dwg;
 }
 
 template <int C>
+void CellData<KData,C>::finishAverages(
+    const std::vector<std::pair<CellData<KData,C>*,WPosLeafInfo> >& vdata, size_t start, size_t end)
+{ _wk = SumWK(vdata,start,end); }
+
+template <int C>
+void CellData<KData,C>::finishAverages(const ColumnData<KData,C>& vdata, size_t start, size_t end)
+{ _wk = SumWK(vdata,start,end); }
+
+template <>
+void CellData<GData,Flat>::finishAverages(
+    const std::vector<std::pair<CellData<GData,Flat>*,WPosLeafInfo> >& vdata, size_t start, size_t end)
+{ _wg = SumWG(vdata,start,end); }
+
+template <>
+void CellData<GData,Flat>::finishAverages(
+    const ColumnData<GData,Flat>& vdata, size_t start, size_t end)
+{ _wg = SumWG(vdata,start,end); }
+
+template <int C, class V>
 std::complex<double> ParallelTransportShift(
-    const std::vector<std::pair<CellData<GData,C>*,WPosLeafInfo> >& vdata,
-    const Position<C>& center, size_t start, size_t end)
+    const V& vdata, const Position<C>& center, size_t start, size_t end)
 {
     // For the average shear, we need to parallel transport each one to the center
     // to account for the different coordinate systems for each measurement.
@@ -216,13 +329,13 @@ std::complex<double> ParallelTransportShift(
     std::complex<double> dwg=0.;
     Position<Sphere> cen(center);
     for(size_t i=start;i<end;++i) {
-        xxdbg<<"Project shear "<<(vdata[i].first->getWG()/vdata[i].first->getW())<<
-            " at point "<<vdata[i].first->getPos()<<std::endl;
+        xxdbg<<"Project shear "<<(GetWG(vdata,i)/GetW(vdata,i))<<
+            " at point "<<GetPos(vdata,i)<<std::endl;
         // This is a lot like the ProjectShear function in BinCorr2.cpp
         // The difference is that here, we just rotate the single shear by
         // (Pi-A-B).  See the comments in ProjectShear2 for understanding
         // the initial bit where we calculate A,B.
-        Position<Sphere> pi(vdata[i].first->getPos());
+        Position<Sphere> pi(GetPos(vdata,i));
         double z1 = center.getZ();
         double z2 = pi.getZ();
         double dsq = (cen - pi).normSq();
@@ -236,7 +349,7 @@ std::complex<double> ParallelTransportShift(
         xxdbg<<"B = atan("<<sinB<<"/"<<cosB<<") = "<<atan2(sinB,cosB)*180./M_PI<<std::endl;
         if (normAsq < 1.e-12 && normBsq < 1.e-12) {
             // Then this point is at the center, no need to project.
-            dwg += vdata[i].first->getWG();
+            dwg += GetWG(vdata,i);
         } else {
             // The angle we need to rotate the shear by is (Pi-A-B)
             // cos(beta) = -cos(A+B)
@@ -248,7 +361,7 @@ std::complex<double> ParallelTransportShift(
             xxdbg<<"expibeta = "<<expibeta/sqrt(normAsq*normBsq)<<std::endl;
             std::complex<double> exp2ibeta = (expibeta * expibeta) / (normAsq*normBsq);
             xxdbg<<"exp2ibeta = "<<exp2ibeta<<std::endl;
-            dwg += vdata[i].first->getWG() * exp2ibeta;
+            dwg += GetWG(vdata,i) * exp2ibeta;
         }
     }
     return dwg;
@@ -259,14 +372,28 @@ template <>
 void CellData<GData,ThreeD>::finishAverages(
     const std::vector<std::pair<CellData<GData,ThreeD>*,WPosLeafInfo> >& vdata, size_t start, size_t end)
 {
-    _wg = ParallelTransportShift(vdata,_pos,start,end);
+    _wg = ParallelTransportShift(vdata,getPos(),start,end);
+}
+
+template <>
+void CellData<GData,ThreeD>::finishAverages(
+    const ColumnData<GData,ThreeD>& vdata, size_t start, size_t end)
+{
+    _wg = ParallelTransportShift(vdata,getPos(),start,end);
 }
 
 template <>
 void CellData<GData,Sphere>::finishAverages(
     const std::vector<std::pair<CellData<GData,Sphere>*,WPosLeafInfo> >& vdata, size_t start, size_t end)
 {
-    _wg = ParallelTransportShift(vdata,_pos,start,end);
+    _wg = ParallelTransportShift(vdata,getPos(),start,end);
+}
+
+template <>
+void CellData<GData,Sphere>::finishAverages(
+    const ColumnData<GData,Sphere>& vdata, size_t start, size_t end)
+{
+    _wg = ParallelTransportShift(vdata,getPos(),start,end);
 }
 
 
@@ -295,6 +422,98 @@ struct DataCompareToValue
     { return cd.first->getPos().get(split) < splitvalue; }
 };
 
+template <int D, int C>
+struct ColumnCompare
+{
+    const ColumnData<D,C>& vdata;
+    int split;
+    ColumnCompare(const ColumnData<D,C>& vd, int s) : vdata(vd), split(s) {}
+    bool operator()(long j1, long j2) const
+    { return vdata.getObjectPos(j1).get(split) < vdata.getObjectPos(j2).get(split); }
+};
+
+template <int D, int C>
+struct ColumnCompareToValue
+{
+    const ColumnData<D,C>& vdata;
+    int split;
+    double splitvalue;
+
+    ColumnCompareToValue(const ColumnData<D,C>& vd, int s, double v) :
+        vdata(vd), split(s), splitvalue(v) {}
+    bool operator()(long j) const
+    { return vdata.getObjectPos(j).get(split) < splitvalue; }
+};
+
+// Reorder vdata[start:end] so all the ones with pos.get(split) < splitvalue come first.
+// Returns the location of the first one that is not.
+template <int D, int C>
+size_t PartitionData(std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
+                     size_t start, size_t end, int split, double splitvalue)
+{
+    DataCompareToValue<D,C> comp(split,splitvalue);
+    typename std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >::iterator middle =
+        std::partition(vdata.begin()+start,vdata.begin()+end,comp);
+    return middle - vdata.begin();
+}
+
+template <int D, int C>
+size_t PartitionData(ColumnData<D,C>& vdata,
+                     size_t start, size_t end, int split, double splitvalue)
+{
+    ColumnCompareToValue<D,C> comp(vdata,split,splitvalue);
+    std::vector<long>& index = vdata.getIndices();
+    std::vector<long>::iterator middle = std::partition(index.begin()+start,index.begin()+end,comp);
+    return middle - index.begin();
+}
+
+// Reorder vdata[start:end] so the element at mid is the one that would be there if sorted
+// by pos.get(split), with all smaller ones before it and larger ones after it.
+template <int D, int C>
+void NthElementData(std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
+                    size_t start, size_t mid, size_t end, int split)
+{
+    DataCompare<D,C> comp(split);
+    std::nth_element(vdata.begin()+start,vdata.begin()+mid,vdata.begin()+end,comp);
+}
+
+template <int D, int C>
+void NthElementData(ColumnData<D,C>& vdata, size_t start, size_t mid, size_t end, int split)
+{
+    ColumnCompare<D,C> comp(vdata,split);
+    std::vector<long>& index = vdata.getIndices();
+    std::nth_element(index.begin()+start,index.begin()+mid,index.begin()+end,comp);
+}
+
+// Below this many elements, it's faster to just do the selection in place.
+const size_t MIN_KEY_SELECT = 64;
+
+// nth_element does several comparisons per element, and for large ranges, each of these
+// would be a cache miss to get the position from the CellData (or the columns).  So this
+// first copies the values into a contiguous array and finds the one that belongs at mid
+// there.  (std::nth_element is linear time on average.)  Then vdata just needs to be
+// partitioned around that value, which only touches each element once, like for MEAN.
+template <class V>
+void SelectData(V& vdata, size_t start, size_t mid, size_t end, int split)
+{
+    if (end - start < MIN_KEY_SELECT) {
+        NthElementData(vdata,start,mid,end,split);
+        return;
+    }
+    std::vector<double> keys(end-start);
+    for (size_t i=start; i<end; ++i) keys[i-start] = GetPos(vdata,i).get(split);
+    std::nth_element(keys.begin(), keys.begin()+(mid-start), keys.end());
+    double value = keys[mid-start];
+    size_t m1 = PartitionData(vdata,start,end,split,value);
+    Assert(m1 <= mid);
+    if (m1 < mid) {
+        // Then there are other values equal to value.  Move them all next, so one of them
+        // is at mid.
+        size_t m2 = PartitionData(vdata,m1,end,split,std::nextafter(value,HUGE_VAL));
+        Assert(m2 > mid);
+    }
+}
+
 size_t select_random(size_t lo, size_t hi)
 {
     if (lo == hi) {
@@ -317,15 +536,12 @@ template <int D, int C>
 struct SplitDataCore<D, C, MIDDLE>
 {
     // Middle is the average of the min and max value of x or y
-    static size_t run(std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
-                      size_t start, size_t end, const Position<C>& meanpos,
+    template <class V>
+    static size_t run(V& vdata, size_t start, size_t end, const Position<C>& meanpos,
                       const Bounds<C>& b, int split)
     {
         double splitvalue = b.getMiddle(split);
-        DataCompareToValue<D,C> comp(split,splitvalue);
-        typename std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >::iterator middle =
-            std::partition(vdata.begin()+start,vdata.begin()+end,comp);
-        return middle - vdata.begin();
+        return PartitionData(vdata,start,end,split,splitvalue);
     }
 };
 
@@ -333,15 +549,12 @@ template <int D, int C>
 struct SplitDataCore<D, C, MEDIAN>
 {
     // Median is the point which divides the group into equal numbers
-    static size_t run(std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
-                      size_t start, size_t end, const Position<C>& meanpos,
+    template <class V>
+    static size_t run(V& vdata, size_t start, size_t end, const Position<C>& meanpos,
                       const Bounds<C>& b, int split)
     {
-        DataCompare<D,C> comp(split);
         size_t mid = (start+end)/2;
-        typename std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >::iterator middle =
-            vdata.begin()+mid;
-        std::nth_element(vdata.begin()+start,middle,vdata.begin()+end,comp);
+        SelectData(vdata,start,mid,end,split);
         return mid;
     }
 };
@@ -350,15 +563,12 @@ template <int D, int C>
 struct SplitDataCore<D, C, MEAN>
 {
     // Mean is the weighted average value of x or y
-    static size_t run(std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
-                      size_t start, size_t end, const Position<C>& meanpos,
+    template <class V>
+    static size_t run(V& vdata, size_t start, size_t end, const Position<C>& meanpos,
                       const Bounds<C>& b, int split)
     {
         double splitvalue = meanpos.get(split);
-        DataCompareToValue<D,C> comp(split,splitvalue);
-        typename std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >::iterator middle =
-            std::partition(vdata.begin()+start,vdata.begin()+end,comp);
-        return middle - vdata.begin();
+        return PartitionData(vdata,start,end,split,splitvalue);
     }
 };
 
@@ -366,34 +576,28 @@ template <int D, int C>
 struct SplitDataCore<D, C, RANDOM>
 {
     // Random is a random point from the first quartile to the third quartile
-    static size_t run(std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
-                      size_t start, size_t end, const Position<C>& meanpos,
+    template <class V>
+    static size_t run(V& vdata, size_t start, size_t end, const Position<C>& meanpos,
                       const Bounds<C>& b, int split)
     {
-        DataCompare<D,C> comp(split);
-
         // The code for RANDOM is same as MEDIAN except for the next line.
         // Note: The lo and hi values are slightly subtle.  We want to make sure if there
         // are only two values, we actually split.  So if start=1, end=3, the only possible
         // result should be mid=2.  Otherwise, we want roughly 2/5 and 3/5 of the span.
         size_t mid = select_random(end-3*(end-start)/5,start+3*(end-start)/5);
 
-        typename std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >::iterator middle =
-            vdata.begin()+mid;
-        std::nth_element(vdata.begin()+start,middle,vdata.begin()+end,comp);
+        SelectData(vdata,start,mid,end,split);
         return mid;
     }
 };
 
-template <int D, int C, int SM>
-size_t SplitData(
-    std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
-    size_t start, size_t end, const Position<C>& meanpos)
+template <int D, int C, int SM, class V>
+size_t SplitData(V& vdata, size_t start, size_t end, const Position<C>& meanpos)
 {
     Assert(end-start > 1);
 
     Bounds<C> b;
-    for(size_t i=start;i<end;++i) b += vdata[i].first->getPos();
+    for(size_t i=start;i<end;++i) b += GetPos(vdata,i);
     int split = b.getSplit();
 
     size_t mid = SplitDataCore<D,C,SM>::run(vdata, start, end, meanpos, b, split);
@@ -406,7 +610,7 @@ size_t SplitData(
         xdbg<<"b = "<<b<<std::endl;
         xdbg<<"split = "<<split<<std::endl;
         for(size_t i=start; i!=end; ++i) {
-            xdbg<<"v["<<i<<"] = "<<vdata[i].first<<std::endl;
+            xdbg<<"v["<<i<<"] = "<<GetPos(vdata,i)<<std::endl;
         }
         // With duplicate entries, can get mid == start or mid == end.
         // This should only happen if all entries in this set are equal.
@@ -421,10 +625,38 @@ size_t SplitData(
     return mid;
 }
 
-template <int D, int C, int SM>
-Cell<D,C>* BuildCell(std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata,
-                     double minsizesq, bool brute, size_t start, size_t end,
-                     CellData<D,C>* data, double sizesq)
+// Build the subtree of a bucket.  All the leaves go in order into the array leaves, starting
+// at leaves[0] for vdata[first], and their CellData similarly into leafdata.  These are always
+// split down to single objects, regardless of minsizesq.  top is true for the bucket itself.
+template <int D, int C, int SM, class V>
+Cell<D,C>* BuildBucketCell(V& vdata, bool brute, size_t start, size_t end, size_t first,
+                           CellData<D,C>* data, double sizesq,
+                           Cell<D,C>* leaves, CellData<D,C>* leafdata, Arena* arena, bool top)
+{
+    if (end - start == 1) {
+        CellData<D,C>* d = CopyCellData(vdata, start, leafdata + (start-first));
+        LeafInfo info;
+        info.index = GetIndex(vdata,start);
+        return new (leaves + (start-first)) Cell<D,C>(d, info);
+    }
+
+    if (!data) {
+        data = new (arena) CellData<D,C>(vdata,start,end);
+        data->finishAverages(vdata,start,end);
+        sizesq = CalculateSizeSq(data->getPos(),vdata,start,end);
+    }
+    double size = brute ? std::numeric_limits<double>::infinity() : sqrt(sizesq);
+    size_t mid = SplitData<D,C,SM>(vdata,start,end,data->getPos());
+    Cell<D,C>* l = BuildBucketCell<D,C,SM>(vdata,brute,start,mid,first,0,0.,
+                                           leaves,leafdata,arena,false);
+    Cell<D,C>* r = BuildBucketCell<D,C,SM>(vdata,brute,mid,end,first,0,0.,
+                                           leaves,leafdata,arena,false);
+    return new (arena) Cell<D,C>(data, size, l, r, top);
+}
+
+template <int D, int C, int SM, class V>
+Cell<D,C>* BuildCell(V& vdata, double minsizesq, bool brute, size_t start, size_t end,
+                     CellData<D,C>* data, double sizesq, Arena* arena, long bucketsize)
 {
     xdbg<<"Build "<<minsizesq<<" "<<brute<<" "<<start<<" "<<end<<" "<<data<<" "<<sizesq<<std::endl;
     Assert(sizesq >= 0.);
@@ -433,14 +665,12 @@ Cell<D,C>* BuildCell(std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata
     Assert(end > start);
 
     if (end - start == 1) {
-        if (!data) {
-            data = vdata[start].first;
-            vdata[start].first = 0; // Make sure calling routine doesn't delete this one!
-        }
+        if (!data) data = TakeCellData(vdata,start,arena);
         xdbg<<"Make leaf cell from "<<*data<<std::endl;
-        LeafInfo info = vdata[start].second; // Only copies as a LeafInfo, so throws away wpos.
-        xdbg<<"info.index = "<<info.index<<"  "<<vdata[start].second.index<<std::endl;
-        return new Cell<D,C>(data, info);
+        LeafInfo info;
+        info.index = GetIndex(vdata,start);
+        xdbg<<"info.index = "<<info.index<<std::endl;
+        return new (arena) Cell<D,C>(data, info);
     }
 
     // Not a leaf.  Calculate size and data for this Cell.
@@ -448,7 +678,7 @@ Cell<D,C>* BuildCell(std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata
         xdbg<<"Make cell starting with ave = "<<*data<<std::endl;
         xdbg<<"sizesq = "<<sizesq<<", brute = "<<brute<<std::endl;
     } else {
-        data = new CellData<D,C>(vdata,start,end);
+        data = new (arena) CellData<D,C>(vdata,start,end);
         data->finishAverages(vdata,start,end);
         xdbg<<"Make cell from "<<start<<".."<<end<<" = "<<*data<<std::endl;
         sizesq = CalculateSizeSq(data->getPos(),vdata,start,end);
@@ -456,28 +686,39 @@ Cell<D,C>* BuildCell(std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata
     }
 
     xdbg<<"sizesq = "<<sizesq<<" cf. "<<minsizesq<<", brute="<<brute<<std::endl;
-    if (sizesq > minsizesq) {
+    if (sizesq > minsizesq && long(end-start) <= bucketsize) {
+        Assert(arena);
+        xdbg<<"Make bucket from "<<start<<".."<<end<<std::endl;
+        const size_t n = end-start;
+        Cell<D,C>* leaves = static_cast<Cell<D,C>*>(arena->allocate(n * sizeof(Cell<D,C>)));
+        CellData<D,C>* leafdata = static_cast<CellData<D,C>*>(
+            arena->allocate(n * sizeof(CellData<D,C>)));
+        return BuildBucketCell<D,C,SM>(vdata,brute,start,end,start,data,sizesq,
+                                       leaves,leafdata,arena,true);
+    } else if (sizesq > minsizesq) {
         // If size is large enough, recurse to leaves.
         double size = brute ? std::numeric_limits<double>::infinity() : sqrt(sizesq);
         if (brute) sizesq = std::numeric_limits<double>::infinity();
         xdbg<<"size,sizesq = "<<size<<","<<sizesq<<std::endl;
         size_t mid = SplitData<D,C,SM>(vdata,start,end,data->getPos());
-        Cell<D,C>* l = BuildCell<D,C,SM>(vdata,minsizesq,brute,start,mid);
+        Cell<D,C>* l = BuildCell<D,C,SM>(vdata,minsizesq,brute,start,mid,0,0.,arena,
+                                         bucketsize);
         xdbg<<"Made left"<<std::endl;
-        Cell<D,C>* r = BuildCell<D,C,SM>(vdata,minsizesq,brute,mid,end);
+        Cell<D,C>* r = BuildCell<D,C,SM>(vdata,minsizesq,brute,mid,end,0,0.,arena,
+                                         bucketsize);
         xdbg<<"Made right"<<std::endl;
         xdbg<<data<<"  "<<size<<"  "<<sizesq<<"  "<<l<<"  "<<r<<std::endl;
-        return new Cell<D,C>(data, size, l, r);
+        return new (arena) Cell<D,C>(data, size, l, r);
     } else {
         // Too small, so stop here anyway.
         ListLeafInfo info;
-        info.indices = new std::vector<long>(end-start);
+        info.indices = new (arena) long[end-start];
         for (size_t i=start; i<end; ++i) {
-            xdbg<<"Set indices["<<i-start<<"] = "<<vdata[i].second.index<<std::endl;
-            (*info.indices)[i-start] = vdata[i].second.index;
+            xdbg<<"Set indices["<<i-start<<"] = "<<GetIndex(vdata,i)<<std::endl;
+            info.indices[i-start] = GetIndex(vdata,i);
         }
         xdbg<<"Made indices"<<std::endl;
-        return new Cell<D,C>(data, info);
+        return new (arena) Cell<D,C>(data, info);
     }
 }
 
@@ -498,8 +739,8 @@ bool Cell<D,C>::includesIndex(long index) const
     } else if (getN() == 1) {
         return _info.index == index;
     } else {
-        const std::vector<long>& indices = *_listinfo.indices;
-        return std::find(indices.begin(), indices.end(), index) != indices.end();
+        const long* indices = _listinfo.indices;
+        return std::find(indices, indices+getN(), index) != indices+getN();
     }
 }
 
@@ -532,8 +773,8 @@ std::vector<long> Cell<D,C>::getAllIndices() const
     } else if (getN() == 1) {
         ret.push_back(_info.index);
     } else {
-        const std::vector<long>& indices = *_listinfo.indices;
-        ret.insert(ret.end(),indices.begin(),indices.end());
+        const long* indices = _listinfo.indices;
+        ret.insert(ret.end(),indices,indices+getN());
     }
     return ret;
 }
@@ -551,6 +792,76 @@ const Cell<D,C>* Cell<D,C>::getLeafNumber(long i) const
     }
 }
 
+template <int D, int C>
+void Cell<D,C>::addToIndices(long offset)
+{
+    if (_left) {
+        Assert(_right);
+        _left->addToIndices(offset);
+        _right->addToIndices(offset);
+    } else if (getN() == 1) {
+        _info.index += offset;
+    } else {
+        long* indices = _listinfo.indices;
+        for (long i=0; i<getN(); ++i) indices[i] += offset;
+    }
+}
+
+template <int D, int C>
+Cell<D,C>* MergeCells(Cell<D,C>* c1, Cell<D,C>* c2, Arena* arena)
+{
+    CellData<D,C>* ave = new (arena) CellData<D,C>(c1->getData(), c2->getData());
+    const Position<C> cen = ave->getPos();
+    double s1 = (cen - c1->getPos()).norm() + c1->getSize();
+    double s2 = (cen - c2->getPos()).norm() + c2->getSize();
+    return new (arena) Cell<D,C>(ave, std::max(s1,s2), c1, c2);
+}
+
+// Copy the subtree of a bucket, putting the leaves in order at next_leaf, next_data.
+template <int D, int C>
+Cell<D,C>* CopyBucket(const Cell<D,C>* cell, Cell<D,C>*& next_leaf,
+                      CellData<D,C>*& next_data, Arena* arena)
+{
+    if (!cell->getLeft()) {
+        CellData<D,C>* data = new (next_data++) CellData<D,C>(cell->getData());
+        return new (next_leaf++) Cell<D,C>(data, cell->getInfo());
+    }
+    CellData<D,C>* data = new (arena) CellData<D,C>(cell->getData());
+    Cell<D,C>* l = CopyBucket(cell->getLeft(), next_leaf, next_data, arena);
+    Cell<D,C>* r = CopyBucket(cell->getRight(), next_leaf, next_data, arena);
+    return new (arena) Cell<D,C>(data, cell->getSize(), l, r, cell->isBucket());
+}
+
+template <int D, int C>
+Cell<D,C>* CopyTree(const Cell<D,C>* cell, Arena* arena)
+{
+    Assert(arena);
+    if (cell->isBucket()) {
+        const size_t n = cell->getN();
+        Cell<D,C>* leaves = static_cast<Cell<D,C>*>(arena->allocate(n * sizeof(Cell<D,C>)));
+        CellData<D,C>* leafdata = static_cast<CellData<D,C>*>(
+            arena->allocate(n * sizeof(CellData<D,C>)));
+        return CopyBucket(cell, leaves, leafdata, arena);
+    }
+    // Reserve the space for this Cell first, so its children come right after it.
+    void* mem = arena->allocate(sizeof(Cell<D,C>));
+    CellData<D,C>* data = new (arena) CellData<D,C>(cell->getData());
+    if (cell->getLeft()) {
+        Cell<D,C>* l = CopyTree(cell->getLeft(), arena);
+        Cell<D,C>* r = CopyTree(cell->getRight(), arena);
+        return new (mem) Cell<D,C>(data, cell->getSize(), l, r);
+    } else if (cell->getN() == 1) {
+        return new (mem) Cell<D,C>(data, cell->getInfo());
+    } else {
+        const long n = cell->getN();
+        const long* indices = cell->getListInfo().indices;
+        ListLeafInfo info;
+        info.indices = new (arena) long[n];
+        std::copy(indices, indices+n, info.indices);
+        return new (mem) Cell<D,C>(data, info);
+    }
+}
+
 template <int D, int C>
 void Cell<D,C>::Write(std::ostream& os) const
 {
@@ -567,41 +878,40 @@ void Cell<D,C>::WriteTree(std::ostream& os, int indent) const
     }
 }
 
-#define Inst(D,C)\
-    template class CellData<D,C>; \
-    template class Cell<D,C>; \
+#define InstV(D,C,V)\
     template double CalculateSizeSq( \
-        const Position<C>& cen, \
-        const std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
-        size_t start, size_t end); \
+        const Position<C>& cen, const V& vdata, size_t start, size_t end); \
     template Cell<D,C>* BuildCell<D,C,MIDDLE>( \
-        std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
-        double minsizesq, bool brute, size_t start, size_t end, \
-        CellData<D,C>* data, double sizesq); \
+        V& vdata, double minsizesq, bool brute, size_t start, size_t end, \
+        CellData<D,C>* data, double sizesq, Arena* arena, long bucketsize); \
     template Cell<D,C>* BuildCell<D,C,MEDIAN>( \
-        std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
-        double minsizesq, bool brute, size_t start, size_t end, \
-        CellData<D,C>* data, double sizesq); \
+        V& vdata, double minsizesq, bool brute, size_t start, size_t end, \
+        CellData<D,C>* data, double sizesq, Arena* arena, long bucketsize); \
     template Cell<D,C>* BuildCell<D,C,MEAN>( \
-        std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
-        double minsizesq, bool brute, size_t start, size_t end, \
-        CellData<D,C>* data, double sizesq); \
+        V& vdata, double minsizesq, bool brute, size_t start, size_t end, \
+        CellData<D,C>* data, double sizesq, Arena* arena, long bucketsize); \
     template Cell<D,C>* BuildCell<D,C,RANDOM>( \
-        std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
-        double minsizesq, bool brute, size_t start, size_t end, \
-        CellData<D,C>* data, double sizesq); \
+        V& vdata, double minsizesq, bool brute, size_t start, size_t end, \
+        CellData<D,C>* data, double sizesq, Arena* arena, long bucketsize); \
     template size_t SplitData<D,C,MIDDLE>( \
-        std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
-        size_t start, size_t end, const Position<C>& meanpos); \
+        V& vdata, size_t start, size_t end, const Position<C>& meanpos); \
     template size_t SplitData<D,C,MEDIAN>( \
-        std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
-        size_t start, size_t end, const Position<C>& meanpos); \
+        V& vdata, size_t start, size_t end, const Position<C>& meanpos); \
     template size_t SplitData<D,C,MEAN>( \
-        std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
-        size_t start, size_t end, const Position<C>& meanpos); \
+        V& vdata, size_t start, size_t end, const Position<C>& meanpos); \
     template size_t SplitData<D,C,RANDOM>( \
-        std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& vdata, \
-        size_t start, size_t end, const Position<C>& meanpos); \
+        V& vdata, size_t start, size_t end, const Position<C>& meanpos); \
+
+// The typedefs are just so the vector type can be passed to the macro.
+#define Inst(D,C)\
+    template class CellData<D,C>; \
+    template class Cell<D,C>; \
+    template Cell<D,C>* MergeCells(Cell<D,C>* c1, Cell<D,C>* c2, Arena* arena); \
+    template Cell<D,C>* CopyTree(const Cell<D,C>* cell, Arena* arena); \
+    typedef std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> > CellDataVector_##D##_##C; \
+    typedef ColumnData<D,C> ColumnData_##D##_##C; \
+    InstV(D,C,CellDataVector_##D##_##C); \
+    InstV(D,C,ColumnData_##D##_##C); \
 
 Inst(NData,Flat);
 Inst(NData,ThreeD);
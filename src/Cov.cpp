@@ -0,0 +1,230 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+//#define DEBUGLOGGING
+
+#include <vector>
+#include <algorithm>
+
+#include "dbg.h"
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
+
+// The design matrix for the patch-based covariance estimates has one row for each jackknife
+// sample, patch, or bootstrap realization.  When the statistic is just the ratio of some
+// accumulated values to the accumulated weight (e.g. xi+ and xi- for GG), each row only needs
+// the sums of the values for its pairs of patches, so we can build it here directly from the
+// values for each pair, rather than making the sums in Python one row at a time.
+
+enum CovMethod { Jackknife=0, Sample=1, Marked=2, Bootstrap=3 };
+
+// The accumulated values for each pair of patches, with the sums over the pairs by patch.
+struct PatchPairSums
+{
+    PatchPairSums(const double* num, const double* weight, int nnum, long nbins,
+                  const long* i1, const long* i2, long npair, int npatch1, int npatch2) :
+        _num(num), _weight(weight), _nstat(nnum*nbins), _nbins(nbins),
+        _i1(i1), _i2(i2), _npair(npair)
+    {
+        // For most rows, the patch that matters for each pair is the first one, or the second
+        // one if the first catalog didn't have patches.
+        _use1 = npatch1 != 1;
+        _use2 = npatch2 != 1;
+        _npatch = _use1 ? npatch1 : npatch2;
+    }
+
+    const double* num(long k) const { return _num + k*_nstat; }
+    const double* weight(long k) const { return _weight + k*_nbins; }
+    long key(long k) const { return _use1 ? _i1[k] : _i2[k]; }
+
+    // Sum the values of the pairs whose key patch is each patch.  For the jackknife, also
+    // sum separately the pairs whose second patch is each patch (but not the first).
+    void sumByPatch(bool both)
+    {
+        _key_sum.assign(_npatch * _nstat, 0.);
+        _key_wsum.assign(_npatch * _nbins, 0.);
+        _key_count.assign(_npatch, 0);
+        if (both) {
+            _other_sum.assign(_npatch * _nstat, 0.);
+            _other_wsum.assign(_npatch * _nbins, 0.);
+            _other_count.assign(_npatch, 0);
+        }
+        for (long k=0; k<_npair; ++k) {
+            long p = key(k);
+            add(&_key_sum[p*_nstat], &_key_wsum[p*_nbins], k, 1.);
+            ++_key_count[p];
+            if (both && _i2[k] != _i1[k]) {
+                p = _i2[k];
+                add(&_other_sum[p*_nstat], &_other_wsum[p*_nbins], k, 1.);
+                ++_other_count[p];
+            }
+        }
+    }
+
+    void add(double* sum, double* wsum, long k, double f) const
+    {
+        const double* nk = num(k);
+        const double* wk = weight(k);
+        for (long s=0; s<_nstat; ++s) sum[s] += f * nk[s];
+        for (long b=0; b<_nbins; ++b) wsum[b] += f * wk[b];
+    }
+
+    const double* _num;
+    const double* _weight;
+    long _nstat;
+    long _nbins;
+    const long* _i1;
+    const long* _i2;
+    long _npair;
+    bool _use1;
+    bool _use2;
+    int _npatch;
+
+    std::vector<double> _key_sum;
+    std::vector<double> _key_wsum;
+    std::vector<long> _key_count;
+    std::vector<double> _other_sum;
+    std::vector<double> _other_wsum;
+    std::vector<long> _other_count;
+};
+
+// Set one row of the design matrix from the sums of its pairs of patches, dividing by the
+// weight as _finalize does, and add the total weight of the row to w.
+void SetDesignRow(const double* sum, const double* wsum, int nnum, long nbins,
+                  double* vrow, double& w)
+{
+    double wtot = 0.;
+    for (long b=0; b<nbins; ++b) wtot += wsum[b];
+    for (int n=0; n<nnum; ++n) {
+        for (long b=0; b<nbins; ++b) {
+            const double x = sum[n*nbins+b];
+            vrow[n*nbins+b] = wsum[b] != 0. ? x / wsum[b] : x;
+        }
+    }
+    // getWeight repeats the weight for each of the nnum statistics.
+    w += nnum * wtot;
+}
+
+int BuildDesignMatrix(PatchPairSums& pp, int nnum, int method, const long* index, long nrows,
+                      double* v, long vsize, long voffset, double* w)
+{
+    const long nstat = pp._nstat;
+    const long nbins = pp._nbins;
+    const int npatch = pp._npatch;
+    const bool both = pp._use1 && pp._use2;
+    pp.sumByPatch(method == Jackknife && both);
+
+    // The total of all pairs, for the jackknife.
+    std::vector<double> tot(nstat, 0.);
+    std::vector<double> wtot(nbins, 0.);
+    if (method == Jackknife) {
+        for (long k=0; k<pp._npair; ++k) pp.add(&tot[0], &wtot[0], k, 1.);
+    }
+
+    long nempty = 0;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        std::vector<double> sum(nstat);
+        std::vector<double> wsum(nbins);
+        std::vector<double> mult(npatch);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic) reduction(+:nempty)
+#endif
+        for (long r=0; r<nrows; ++r) {
+            long count = 0;
+            if (method == Jackknife) {
+                // Everything except the pairs that include patch r.
+                const long p = r;
+                for (long s=0; s<nstat; ++s) sum[s] = tot[s] - pp._key_sum[p*nstat+s];
+                for (long b=0; b<nbins; ++b) wsum[b] = wtot[b] - pp._key_wsum[p*nbins+b];
+                count = pp._npair - pp._key_count[p];
+                if (both) {
+                    for (long s=0; s<nstat; ++s) sum[s] -= pp._other_sum[p*nstat+s];
+                    for (long b=0; b<nbins; ++b) wsum[b] -= pp._other_wsum[p*nbins+b];
+                    count -= pp._other_count[p];
+                }
+            } else if (method == Sample) {
+                // Just the pairs whose first patch is r.
+                const long p = r;
+                for (long s=0; s<nstat; ++s) sum[s] = pp._key_sum[p*nstat+s];
+                for (long b=0; b<nbins; ++b) wsum[b] = pp._key_wsum[p*nbins+b];
+                count = pp._key_count[p];
+            } else {
+                // The number of times each patch was selected for this realization.
+                std::fill(mult.begin(), mult.end(), 0.);
+                for (int i=0; i<npatch; ++i) mult[index[r*npatch+i]] += 1.;
+                std::fill(sum.begin(), sum.end(), 0.);
+                std::fill(wsum.begin(), wsum.end(), 0.);
+                if (method == Marked || !both) {
+                    // Each pair counts as many times as its first patch was selected.
+                    for (int p=0; p<npatch; ++p) {
+                        if (mult[p] == 0.) continue;
+                        const double* ps = &pp._key_sum[p*nstat];
+                        const double* pw = &pp._key_wsum[p*nbins];
+                        for (long s=0; s<nstat; ++s) sum[s] += mult[p] * ps[s];
+                        for (long b=0; b<nbins; ++b) wsum[b] += mult[p] * pw[b];
+                        count += pp._key_count[p];
+                    }
+                } else {
+                    // Auto-correlations count as many times as their patch was selected,
+                    // and cross-correlations as many times as each of their patches.
+                    for (long k=0; k<pp._npair; ++k) {
+                        const long i = pp._i1[k];
+                        const long j = pp._i2[k];
+                        const double f = i == j ? mult[i] : mult[i] * mult[j];
+                        if (f == 0.) continue;
+                        pp.add(&sum[0], &wsum[0], k, f);
+                        ++count;
+                    }
+                }
+            }
+            if (count == 0) {
+                ++nempty;
+            } else {
+                SetDesignRow(&sum[0], &wsum[0], nnum, nbins, v + r*vsize + voffset, w[r]);
+            }
+        }
+    }
+    return nempty > 0 ? 1 : 0;
+}
+
+//
+//
+// Now the C-C++ interface functions that get used in python:
+//
+//
+
+extern "C" {
+
+#ifdef _WIN32
+#define extern __declspec(dllexport)
+#endif
+
+#include "Cov_C.h"
+}
+
+int CovDesignMatrix(const double* num, const double* weight, int nnum, long nbins,
+                    const long* i1, const long* i2, long npair, int npatch1, int npatch2,
+                    int method, const long* index, long nrows,
+                    double* v, long vsize, long voffset, double* w)
+{
+    dbg<<"Start CovDesignMatrix: method = "<<method<<", npair = "<<npair<<
+        ", nrows = "<<nrows<<std::endl;
+    PatchPairSums pp(num, weight, nnum, nbins, i1, i2, npair, npatch1, npatch2);
+    return BuildDesignMatrix(pp, nnum, method, index, nrows, v, vsize, voffset, w);
+}
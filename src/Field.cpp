@@ -15,20 +15,55 @@
 //#define DEBUGLOGGING
 
 #include <cstddef>  // for ptrdiff_t
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include "Field.h"
 #include "Cell.h"
+#include "Metric.h"
+#include "BuildOptions.h"
+#include "ThreadTimes.h"
+#include "Affinity.h"
 #include "dbg.h"
 
+// Arenas are not thread safe, but SetupTopLevelCells may be running in several OpenMP tasks
+// at once, all using the same arena.  So just the allocation is done one thread at a time.
+// (The CellData constructor, which is the slow part, is then run in parallel.)
+template <int D, int C>
+inline void* AllocateTopCellData(Arena* arena)
+{
+    if (!arena) return ::operator new(sizeof(CellData<D,C>));
+    void* mem;
+#ifdef _OPENMP
+#pragma omp critical (top_arena)
+#endif
+    mem = arena->allocate(sizeof(CellData<D,C>));
+    return mem;
+}
+
+// Below this many objects, it's not worth making a new task for each half in
+// SetupTopLevelCells.
+const size_t MIN_TASK_SIZE = 10000;
+
 // This function just works on the top level data to figure out which data goes into
 // each top-level Cell.  It is building up the top_* vectors, which can then be used
 // to build the actual Cells.
-template <int D, int C, int SM>
+// celldata may be either the usual vector of CellData or a ColumnData.
+template <int D, int C, int SM, class V>
 double SetupTopLevelCells(
-    std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >& celldata,
-    double maxsizesq, size_t start, size_t end, int mintop, int maxtop,
+    V& celldata, double maxsizesq, size_t start, size_t end, int mintop, int maxtop,
     std::vector<CellData<D,C>*>& top_data,
     std::vector<double>& top_sizesq,
-    std::vector<size_t>& top_start, std::vector<size_t>& top_end)
+    std::vector<size_t>& top_start, std::vector<size_t>& top_end,
+    Arena* arena)
 {
     xdbg<<"Start SetupTopLevelCells: start,end = "<<start<<','<<end<<std::endl;
     xdbg<<"maxsizesq = "<<maxsizesq<<std::endl;
@@ -41,11 +76,15 @@ double SetupTopLevelCells(
     double sizesq;
     if (end-start == 1) {
         xdbg<<"Only 1 CellData entry: size = 0\n";
-        ave = celldata[start].first;
-        celldata[start].first = 0; // Make sure the calling function doesn't delete this!
+        // For ColumnData, this allocates a new CellData, so it needs the same protection
+        // as AllocateTopCellData.
+#ifdef _OPENMP
+#pragma omp critical (top_arena)
+#endif
+        ave = TakeCellData(celldata,start,arena);
         sizesq = 0.;
     } else {
-        ave = new CellData<D,C>(celldata,start,end);
+        ave = new (AllocateTopCellData<D,C>(arena)) CellData<D,C>(celldata,start,end);
         xdbg<<"ave pos = "<<ave->getPos()<<std::endl;
         xdbg<<"n = "<<ave->getN()<<std::endl;
         xdbg<<"w = "<<ave->getW()<<std::endl;
@@ -70,10 +109,33 @@ double SetupTopLevelCells(
     } else {
         size_t mid = SplitData<D,C,SM>(celldata,start,end,ave->getPos());
         xdbg<<"Too big.  Recurse with mid = "<<mid<<std::endl;
+        // We don't need ave anymore, since this level doesn't get a Cell.
+        if (!arena) delete ave;
+
+        // The two halves are independent, so if they are large, the left half is done in
+        // a separate OpenMP task.  It appends directly to the top_* vectors, while the right
+        // half goes into local vectors, which are appended after the left half is done.
+        // So the top-level cells end up in the same order as they would serially.
+        // (Not for RANDOM, since urand isn't thread safe, and we want a given seed to give
+        // the same top-level cells.)
+        std::vector<CellData<D,C>*> right_data;
+        std::vector<double> right_sizesq;
+        std::vector<size_t> right_start;
+        std::vector<size_t> right_end;
+#ifdef _OPENMP
+#pragma omp task default(shared) if(SM != RANDOM && end-start >= MIN_TASK_SIZE)
+#endif
         SetupTopLevelCells<D,C,SM>(celldata, maxsizesq, start, mid, mintop-1, maxtop-1,
-                                   top_data, top_sizesq, top_start, top_end);
+                                   top_data, top_sizesq, top_start, top_end, arena);
         SetupTopLevelCells<D,C,SM>(celldata, maxsizesq, mid, end, mintop-1, maxtop-1,
-                                   top_data, top_sizesq, top_start, top_end);
+                                   right_data, right_sizesq, right_start, right_end, arena);
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+        top_data.insert(top_data.end(), right_data.begin(), right_data.end());
+        top_sizesq.insert(top_sizesq.end(), right_sizesq.begin(), right_sizesq.end());
+        top_start.insert(top_start.end(), right_start.begin(), right_start.end());
+        top_end.insert(top_end.end(), right_end.begin(), right_end.end());
     }
     return sizesq;
 }
@@ -87,22 +149,22 @@ template <>
 struct CellDataHelper<NData,Flat>
 {
     static CellData<NData,Flat>* build(double x, double y, double,
-                                       double , double , double, double w)
-    { return new CellData<NData,Flat>(Position<Flat>(x,y), w); }
+                                       double , double , double, double w, Arena* arena)
+    { return new (arena) CellData<NData,Flat>(Position<Flat>(x,y), w); }
 };
 template <>
 struct CellDataHelper<KData,Flat>
 {
     static CellData<KData,Flat>* build(double x, double y, double,
-                                       double , double , double k, double w)
-    { return new CellData<KData,Flat>(Position<Flat>(x,y), k, w); }
+                                       double , double , double k, double w, Arena* arena)
+    { return new (arena) CellData<KData,Flat>(Position<Flat>(x,y), k, w); }
 };
 template <>
 struct CellDataHelper<GData,Flat>
 {
     static CellData<GData,Flat>* build(double x, double y,  double,
-                                       double g1, double g2, double, double w)
-    { return new CellData<GData,Flat>(Position<Flat>(x,y), std::complex<double>(g1,g2), w); }
+                                       double g1, double g2, double, double w, Arena* arena)
+    { return new (arena) CellData<GData,Flat>(Position<Flat>(x,y), std::complex<double>(g1,g2), w); }
 };
 
 
@@ -110,22 +172,22 @@ template <>
 struct CellDataHelper<NData,ThreeD>
 {
     static CellData<NData,ThreeD>* build(double x, double y, double z,
-                                         double , double , double, double w)
-    { return new CellData<NData,ThreeD>(Position<ThreeD>(x,y,z), w); }
+                                         double , double , double, double w, Arena* arena)
+    { return new (arena) CellData<NData,ThreeD>(Position<ThreeD>(x,y,z), w); }
 };
 template <>
 struct CellDataHelper<KData,ThreeD>
 {
     static CellData<KData,ThreeD>* build(double x, double y, double z,
-                                         double , double , double k, double w)
-    { return new CellData<KData,ThreeD>(Position<ThreeD>(x,y,z), k, w); }
+                                         double , double , double k, double w, Arena* arena)
+    { return new (arena) CellData<KData,ThreeD>(Position<ThreeD>(x,y,z), k, w); }
 };
 template <>
 struct CellDataHelper<GData,ThreeD>
 {
     static CellData<GData,ThreeD>* build(double x, double y, double z,
-                                         double g1, double g2, double, double w)
-    { return new CellData<GData,ThreeD>(Position<ThreeD>(x,y,z), std::complex<double>(g1,g2), w); }
+                                         double g1, double g2, double, double w, Arena* arena)
+    { return new (arena) CellData<GData,ThreeD>(Position<ThreeD>(x,y,z), std::complex<double>(g1,g2), w); }
 };
 
 
@@ -134,22 +196,22 @@ template <>
 struct CellDataHelper<NData,Sphere>
 {
     static CellData<NData,Sphere>* build(double x, double y, double z,
-                                         double , double , double, double w)
-    { return new CellData<NData,Sphere>(Position<Sphere>(x,y,z), w); }
+                                         double , double , double, double w, Arena* arena)
+    { return new (arena) CellData<NData,Sphere>(Position<Sphere>(x,y,z), w); }
 };
 template <>
 struct CellDataHelper<KData,Sphere>
 {
     static CellData<KData,Sphere>* build(double x, double y, double z,
-                                         double , double , double k, double w)
-    { return new CellData<KData,Sphere>(Position<Sphere>(x,y,z), k, w); }
+                                         double , double , double k, double w, Arena* arena)
+    { return new (arena) CellData<KData,Sphere>(Position<Sphere>(x,y,z), k, w); }
 };
 template <>
 struct CellDataHelper<GData,Sphere>
 {
     static CellData<GData,Sphere>* build(double x, double y, double z,
-                                         double g1, double g2, double, double w)
-    { return new CellData<GData,Sphere>(Position<Sphere>(x,y,z), std::complex<double>(g1,g2), w); }
+                                         double g1, double g2, double, double w, Arena* arena)
+    { return new (arena) CellData<GData,Sphere>(Position<Sphere>(x,y,z), std::complex<double>(g1,g2), w); }
 };
 
 inline WPosLeafInfo get_wpos(double* wpos, double* w, long i)
@@ -164,37 +226,119 @@ template <int D, int C>
 Field<D,C>::Field(double* x, double* y, double* z, double* g1, double* g2, double* k,
                   double* w, double* wpos, long nobj,
                   double minsize, double maxsize,
-                  SplitMethod sm, long long seed, bool brute, int mintop, int maxtop) :
+                  SplitMethod sm, long long seed, bool brute, int mintop, int maxtop,
+                  bool use_arena, bool use_packed, bool zero_copy, bool reorder_tree,
+                  long bucket_size, long* patch, int npatch) :
     _nobj(nobj), _minsize(minsize), _maxsize(maxsize), _sm(sm),
-    _brute(brute), _mintop(mintop), _maxtop(maxtop)
+    _brute(brute), _mintop(mintop), _maxtop(maxtop),
+    // The reordered trees and buckets are always allocated from arenas.
+    _use_arena(use_arena || reorder_tree || bucket_size > 1),
+    _use_packed(use_packed), _reorder_tree(reorder_tree), _bucket_size(bucket_size),
+    _packed(0), _mapped(0), _mapped_size(0), _columns(0)
 {
     //set_verbose(2);
     dbg<<"Starting to Build Field with "<<nobj<<" objects\n";
     xdbg<<"D,C = "<<D<<','<<C<<std::endl;
     xdbg<<"First few values are:\n";
-    for(int i=0;i<5;++i) {
+    for(int i=0;i<5 && i<nobj;++i) {
         xdbg<<x[i]<<"  "<<y[i]<<"  "<<(z?z[i]:0)<<"  "<<g1[i]<<"  "<<g2[i]<<"  "<<k[i]<<"  "<<w[i]<<"  "<<(wpos?wpos[i]:0)<<std::endl;
     }
 
     if (seed != 0) { urand(seed); }
+    // The objects need to be sorted by patch, which we only do with the usual _celldata.
+    if (patch) zero_copy = false;
+    if (!x) {
+        // The objects will be given later with addData.
+        Assert(!patch && !zero_copy);
+        if (_use_arena) _arenas.push_back(new Arena());
+        return;
+    }
+    if (_use_arena) {
+        // Make the first block big enough for all the original CellData.
+        // (With zero_copy, it only holds the top-level CellData.)
+        _arenas.push_back(new Arena((zero_copy ? 0 : nobj * sizeof(CellData<D,C>)) + (1<<16)));
+    }
+
+    if (zero_copy) {
+        _columns = new ColumnData<D,C>(x, y, z, g1, g2, k, w, wpos, nobj);
+        CellData<D,C> ave(*_columns, 0, nobj);
+        ave.finishAverages(*_columns, 0, nobj);
+        _center = ave.getPos();
+        _sizesq = CalculateSizeSq(_center, *_columns, 0, nobj);
+        // The caller's arrays are only guaranteed to be valid during this call, so we can't
+        // wait until the Cells are needed to build them.
+        BuildCells();
+        return;
+    }
+
     _celldata.reserve(nobj);
+    addData(x, y, z, g1, g2, k, w, wpos, nobj);
+
+    if (patch) {
+        // Sort the objects by patch.  (Stably, so each patch's objects stay in their original
+        // order.)  The leaf indices keep track of the original order.
+        _patch_top.assign(npatch+1, 0);
+        for(long i=0;i<nobj;++i) {
+            Assert(patch[i] >= 0 && patch[i] < npatch);
+            ++_patch_top[patch[i]+1];
+        }
+        for(int p=0;p<npatch;++p) _patch_top[p+1] += _patch_top[p];
+        std::vector<long> next(_patch_top.begin(), _patch_top.end()-1);
+        std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> > sorted(nobj);
+        for(long i=0;i<nobj;++i) sorted[next[patch[i]]++] = _celldata[i];
+        _celldata.swap(sorted);
+
+        _patch_nobj.resize(npatch);
+        _patch_center.resize(npatch);
+        _patch_sizesq.resize(npatch, 0.);
+        for(int p=0;p<npatch;++p) {
+            const long start = _patch_top[p];
+            const long end = _patch_top[p+1];
+            _patch_nobj[p] = end - start;
+            if (end == start) continue;
+            CellData<D,C> ave(_celldata, start, end);
+            ave.finishAverages(_celldata, start, end);
+            _patch_center[p] = ave.getPos();
+            _patch_sizesq[p] = CalculateSizeSq(_patch_center[p], _celldata, start, end);
+        }
+        dbg<<"Sorted celldata into "<<npatch<<" patches\n";
+    }
+
+    finishData();
+}
+
+template <int D, int C>
+void Field<D,C>::addData(double* x, double* y, double* z, double* g1, double* g2, double* k,
+                         double* w, double* wpos, long nobj)
+{
+    Arena* arena = _use_arena ? _arenas[0] : 0;
+    // The leaf indices continue from the objects in previous chunks.
+    const long i0 = _celldata.size();
     if (z) {
         for(long i=0;i<nobj;++i) {
             WPosLeafInfo wp = get_wpos(wpos,w,i);
+            wp.index += i0;
             _celldata.push_back(std::make_pair(
-                    CellDataHelper<D,C>::build(x[i],y[i],z[i],g1[i],g2[i],k[i],w[i]),
+                    CellDataHelper<D,C>::build(x[i],y[i],z[i],g1[i],g2[i],k[i],w[i],arena),
                     wp));
         }
     } else {
         Assert(C == Flat);
         for(long i=0;i<nobj;++i) {
             WPosLeafInfo wp = get_wpos(wpos,w,i);
+            wp.index += i0;
             _celldata.push_back(std::make_pair(
-                    CellDataHelper<D,C>::build(x[i],y[i],0.,g1[i],g2[i],k[i],w[i]),
+                    CellDataHelper<D,C>::build(x[i],y[i],0.,g1[i],g2[i],k[i],w[i],arena),
                     wp));
         }
     }
     dbg<<"Built celldata with "<<_celldata.size()<<" entries\n";
+}
+
+template <int D, int C>
+void Field<D,C>::finishData()
+{
+    _nobj = _celldata.size();
 
     // Calculate the overall center and size
     CellData<D,C> ave(_celldata, 0, _celldata.size());
@@ -207,28 +351,53 @@ template <int D, int C>
 void Field<D,C>::BuildCells() const
 {
     // Signal that we already built the cells.
-    if (_celldata.size() == 0) return;
+    if (_celldata.size() == 0 && !_columns) return;
+
+    if (_columns) DoBuildCells(*_columns);
+    else DoBuildCells(_celldata);
+
+    if (_columns) {
+        delete _columns;
+        _columns = 0;
+    } else {
+        // delete any CellData elements that didn't get kept in the _cells object.
+        // (If using arenas, these will be released along with the rest of the arena.)
+        if (!_use_arena) {
+            for (size_t i=0;i<_celldata.size();++i)
+                if (_celldata[i].first) delete _celldata[i].first;
+        }
+        // Release the vector's memory too, not just its elements.
+        std::vector<std::pair<CellData<D,C>*,WPosLeafInfo> >().swap(_celldata);
+    }
+    if (_reorder_tree) ReorderCells();
+    if (_use_arena) dbg<<"Arenas use "<<getArenaBytes()<<" bytes\n";
+
+    if (_use_packed) _packed = new PackedTree<D,C>(_cells);
+}
 
+template <int D, int C> template <class V>
+void Field<D,C>::DoBuildCells(V& vdata) const
+{
     switch (_sm) {
       case MIDDLE:
-           DoBuildCells<MIDDLE>();
+           DoBuildCells<MIDDLE>(vdata);
            break;
       case MEDIAN:
-           DoBuildCells<MEDIAN>();
+           DoBuildCells<MEDIAN>(vdata);
            break;
       case MEAN:
-           DoBuildCells<MEAN>();
+           DoBuildCells<MEAN>(vdata);
            break;
       case RANDOM:
-           DoBuildCells<RANDOM>();
+           DoBuildCells<RANDOM>(vdata);
            break;
       default:
            throw std::runtime_error("Invalid SplitMethod");
     };
 }
 
-template <int D, int C> template <int SM>
-void Field<D,C>::DoBuildCells() const
+template <int D, int C> template <int SM, class V>
+void Field<D,C>::DoBuildCells(V& vdata) const
 {
     // We don't build Cells that are too big or too small based on the min/max separation:
 
@@ -249,36 +418,570 @@ void Field<D,C>::DoBuildCells() const
     std::vector<size_t> top_start;
     std::vector<size_t> top_end;
 
-    SetupTopLevelCells<D,C,SM>(_celldata, maxsizesq, 0, _celldata.size(), _mintop, _maxtop,
-                               top_data, top_sizesq, top_start, top_end);
+    // The recursion near the root is done with OpenMP tasks, so start a team for it here.
+#ifdef _OPENMP
+#pragma omp parallel
+#pragma omp single
+#endif
+    {
+        TraceSpan span("SetupTopLevelCells");
+        if (_patch_top.empty()) {
+            SetupTopLevelCells<D,C,SM>(vdata, maxsizesq, 0, vdata.size(), _mintop, _maxtop,
+                                       top_data, top_sizesq, top_start, top_end,
+                                       _use_arena ? _arenas[0] : 0);
+        } else {
+            // Set up each patch separately, so no top-level cell has objects from two patches.
+            // Then switch _patch_top to index the top-level cells.
+            const int npatch = getNPatch();
+            std::vector<long> patch_top(npatch+1, 0);
+            for (int p=0; p<npatch; ++p) {
+                if (_patch_top[p+1] > _patch_top[p]) {
+                    SetupTopLevelCells<D,C,SM>(vdata, maxsizesq, _patch_top[p], _patch_top[p+1],
+                                               _mintop, _maxtop,
+                                               top_data, top_sizesq, top_start, top_end,
+                                               _use_arena ? _arenas[0] : 0);
+                }
+                patch_top[p+1] = top_data.size();
+            }
+            _patch_top.swap(patch_top);
+        }
+    }
     const ptrdiff_t n = top_data.size();
 
-    // Now build the lower cells in parallel
+    // Now build the lower cells in parallel.
+    // The top-level cells can have very different numbers of objects, so use dynamic
+    // scheduling to keep all the threads busy.
     dbg<<"Field has "<<n<<" top-level nodes.  Building lower nodes...\n";
     _cells.resize(n);
+    if (_use_arena) _arenas.resize(n+1, 0);
+    // If the threads are pinned, build each cell on the thread that will process it, so its
+    // memory is on that thread's NUMA node.  (cf. OwnerSchedule)
+    OwnerSchedule owner(n);
 #ifdef _OPENMP
-#pragma omp parallel for
+#pragma omp parallel for schedule(dynamic)
 #endif
-    for(ptrdiff_t i=0;i<n;++i) {
-        _cells[i] = BuildCell<D,C,SM>(_celldata, minsizesq, _brute,
+    for(ptrdiff_t k=0;k<n;++k) {
+        const ptrdiff_t i = owner.on() ? owner.next() : k;
+        TraceSpan span("BuildCell", i);
+        Arena* arena = 0;
+        if (_use_arena) {
+            // Each top-level cell gets its own arena, so the threads don't need to coordinate.
+            // A tree with N points has at most 2N-1 Cells, N-1 new CellData, and N indices.
+            // Buckets also have a copy of the CellData for each point.
+            // Size the block for this worst case, so it is normally the only allocation.
+            // (Most OSes don't commit the pages that never get touched.)
+            size_t ni = top_end[i] - top_start[i];
+            size_t align = alignof(std::max_align_t);
+            size_t nbytes = ni * (2*sizeof(Cell<D,C>) + sizeof(CellData<D,C>) + sizeof(long)
+                                  + 3*align);
+            if (_bucket_size > 1) nbytes += ni * sizeof(CellData<D,C>);
+            arena = _arenas[i+1] = new Arena(nbytes);
+        }
+        _cells[i] = BuildCell<D,C,SM>(vdata, minsizesq, _brute,
                                       top_start[i], top_end[i],
-                                      top_data[i], top_sizesq[i]);
+                                      top_data[i], top_sizesq[i], arena, _bucket_size);
         xdbg<<i<<": "<<_cells[i]->getN()<<"  "<<_cells[i]->getW()<<"  "<<
             _cells[i]->getPos()<<"  "<<_cells[i]->getSize()<<std::endl;
     }
+}
 
-    // delete any CellData elements that didn't get kept in the _cells object.
-    for (size_t i=0;i<_celldata.size();++i) if (_celldata[i].first) delete _celldata[i].first;
-    //set_verbose(1);
-    _celldata.clear();
+template <int D, int C>
+void Field<D,C>::ReorderCells() const
+{
+    Assert(_use_arena);
+    // Copy each top-level tree into its own new arena.  The leaves in the old arenas are in
+    // the order of the input catalog, so once everything is copied, they can all be released.
+    const ptrdiff_t n = _cells.size();
+    std::vector<Arena*> arenas(n);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for(ptrdiff_t i=0;i<n;++i) {
+        // Every Cell has its own CellData, and the leaf index lists have at most N indices.
+        // Size the block for all of it, so the whole tree is in one contiguous block.
+        size_t nnodes = 2*_cells[i]->countLeaves() - 1;
+        size_t align = alignof(std::max_align_t);
+        size_t nbytes = nnodes * (sizeof(Cell<D,C>) + sizeof(CellData<D,C>) + 3*align)
+            + _cells[i]->getN() * sizeof(long);
+        arenas[i] = new Arena(nbytes);
+        _cells[i] = CopyTree(_cells[i], arenas[i]);
+    }
+    for (size_t i=0; i<_arenas.size(); ++i) delete _arenas[i];
+    _arenas.swap(arenas);
 }
 
 template <int D, int C>
 Field<D,C>::~Field()
 {
-    for (size_t i=0; i<_cells.size(); ++i) delete _cells[i];
-    // If this is still around, need to delete those too.
-    for (size_t i=0; i<_celldata.size(); ++i) if (_celldata[i].first) delete _celldata[i].first;
+    if (_packed) delete _packed;
+    if (_use_arena) {
+        // Everything was allocated from the arenas, so this is all we need to do.
+        for (size_t i=0; i<_arenas.size(); ++i) delete _arenas[i];
+    } else {
+        for (size_t i=0; i<_cells.size(); ++i) delete _cells[i];
+        // If this is still around, need to delete those too.
+        for (size_t i=0; i<_celldata.size(); ++i) if (_celldata[i].first) delete _celldata[i].first;
+    }
+    if (_columns) delete _columns;
+    if (_mapped) {
+#ifdef _WIN32
+        delete [] _mapped;
+#else
+        munmap(_mapped, _mapped_size);
+#endif
+    }
+}
+
+template <int D, int C>
+void Field<D,C>::insert(double* x, double* y, double* z, double* g1, double* g2, double* k,
+                        double* w, double* wpos, long nobj)
+{
+    dbg<<"Start insert of "<<nobj<<" objects into Field with "<<_nobj<<" objects\n";
+    // The new objects don't have patch numbers.
+    Assert(_patch_nobj.empty());
+    if (nobj == 0) return;
+    BuildCells();
+
+    // Build the new objects into a separate Field, and then take over its Cells (and arenas).
+    std::vector<Cell<D,C>*> new_cells;
+    {
+        Field<D,C> batch(x, y, z, g1, g2, k, w, wpos, nobj, _minsize, _maxsize, _sm, 0,
+                         _brute, _mintop, _maxtop, _use_arena, false, false, _reorder_tree,
+                         _bucket_size);
+        batch.BuildCells();
+        new_cells.swap(batch._cells);
+        _arenas.insert(_arenas.end(), batch._arenas.begin(), batch._arenas.end());
+        batch._arenas.clear();
+    }
+    dbg<<"Built "<<new_cells.size()<<" new top-level cells\n";
+
+    // The merged parent Cells need somewhere to go too.
+    Arena* arena = 0;
+    if (_use_arena) {
+        arena = new Arena(new_cells.size() * (sizeof(Cell<D,C>) + sizeof(CellData<D,C>)
+                                              + 2*alignof(std::max_align_t)));
+        _arenas.push_back(arena);
+    }
+
+    const size_t ntop = _cells.size();
+    for (size_t j=0; j<new_cells.size(); ++j) {
+        Cell<D,C>* c = new_cells[j];
+        c->addToIndices(_nobj);
+
+        // Find the smallest original top-level cell that contains all of c.
+        long best = -1;
+        for (size_t i=0; i<ntop; ++i) {
+            double s = _cells[i]->getSize();
+            double d = (_cells[i]->getPos() - c->getPos()).norm();
+            if (d + c->getSize() <= s && (best < 0 || s < _cells[best]->getSize())) best = i;
+        }
+        if (best >= 0) {
+            xdbg<<"Merge new cell "<<j<<" into top-level cell "<<best<<std::endl;
+            _cells[best] = MergeCells(_cells[best], c, arena);
+        } else {
+            xdbg<<"Add new cell "<<j<<" as a new top-level cell\n";
+            _cells.push_back(c);
+        }
+    }
+    _nobj += nobj;
+    dbg<<"Field now has "<<_cells.size()<<" top-level cells\n";
+
+    // Update the overall center and size.
+    Position<C> cen;
+    double sumw = 0.;
+    for (size_t i=0; i<_cells.size(); ++i) {
+        cen += _cells[i]->getPos() * _cells[i]->getW();
+        sumw += _cells[i]->getW();
+    }
+    if (sumw != 0.) {
+        cen /= sumw;
+        cen.normalize();
+        _center = cen;
+    }
+    double size = 0.;
+    for (size_t i=0; i<_cells.size(); ++i) {
+        double s = (_cells[i]->getPos() - _center).norm() + _cells[i]->getSize();
+        if (s > size) size = s;
+    }
+    _sizesq = size * size;
+
+    if (_packed) {
+        delete _packed;
+        _packed = new PackedTree<D,C>(_cells);
+    }
+}
+
+template <int D, int C>
+long Field<D,C>::getArenaBytes() const
+{
+    long nbytes = 0;
+    for (size_t i=0; i<_arenas.size(); ++i) if (_arenas[i]) nbytes += _arenas[i]->getNBytes();
+    return nbytes;
+}
+
+template <int D, int C>
+void Field<D,C>::getMemory(long* bytes) const
+{
+    BuildCells();
+    for (int i=0; i<NFIELDMEM; ++i) bytes[i] = 0;
+    if (!_use_arena) {
+        // Then each Cell and CellData was allocated separately, so count them.
+        long ncells = 0;
+        long nindices = 0;
+        std::vector<const Cell<D,C>*> todo(_cells.begin(), _cells.end());
+        while (!todo.empty()) {
+            const Cell<D,C>* cell = todo.back();
+            todo.pop_back();
+            ++ncells;
+            if (cell->getLeft()) {
+                todo.push_back(cell->getLeft());
+                todo.push_back(cell->getRight());
+            } else if (cell->getN() > 1) {
+                nindices += cell->getN();
+            }
+        }
+        bytes[FieldMemCells] = ncells * sizeof(Cell<D,C>);
+        bytes[FieldMemCellData] = ncells * sizeof(CellData<D,C>);
+        bytes[FieldMemIndices] = nindices * sizeof(long);
+    }
+    // The arena blocks are sized for the worst case, but the pages that are never touched
+    // don't use any memory.  So count what has been allocated from them.
+    for (size_t i=0; i<_arenas.size(); ++i) {
+        if (_arenas[i]) bytes[FieldMemArena] += sizeof(Arena) + _arenas[i]->getNBytes();
+    }
+    bytes[FieldMemMapped] = _mapped_size;
+    bytes[FieldMemBuild] = _celldata.capacity() * sizeof(_celldata[0]);
+    if (_columns) bytes[FieldMemBuild] += sizeof(*_columns) + _columns->size() * sizeof(long);
+    if (_packed) bytes[FieldMemPacked] = sizeof(*_packed) + _packed->getBytes();
+    bytes[FieldMemOther] = sizeof(*this) + _cells.capacity() * sizeof(Cell<D,C>*) +
+        _patch_nobj.capacity() * sizeof(long) +
+        _patch_center.capacity() * sizeof(Position<C>) +
+        _patch_sizesq.capacity() * sizeof(double) + _patch_top.capacity() * sizeof(long) +
+        _arenas.capacity() * sizeof(Arena*);
+}
+
+template <int D, int C>
+void Field<D,C>::estimateMemory(long nobj, double minsize, double size,
+                                bool use_arena, bool use_packed, long* bytes)
+{
+    for (int i=0; i<NFIELDMEM; ++i) bytes[i] = 0;
+    if (nobj <= 0) return;
+
+    // A Cell is split unless it is smaller than minsize, so the leaves are at least about
+    // minsize/2.  For objects spread evenly over the field, that makes at most
+    // (2 size/minsize)^ndim leaves, where the positions are on a 2-d surface for Flat and
+    // Sphere.  Clustered objects need fewer, so this is an upper bound in practice.
+    double nleaves = nobj;
+    if (minsize > 0. && size > 0.) {
+        const int ndim = C == ThreeD ? 3 : 2;
+        nleaves = std::max(1., std::min(nleaves, std::pow(2. * size / minsize, ndim)));
+    }
+    // A binary tree with n leaves has 2n-1 nodes.
+    const double nnodes = 2. * nleaves - 1.;
+    // If there are fewer leaves than objects, (most of) the objects are in list leaves.
+    const double nindices = nleaves < nobj ? nobj : 0.;
+
+    if (use_arena) {
+        // Each allocation from an arena is rounded up to the alignment.  The arenas also
+        // keep the original CellData of all the objects.
+        const double align = alignof(std::max_align_t);
+        const double cellbytes = std::ceil(sizeof(Cell<D,C>) / align) * align;
+        const double databytes = std::ceil(sizeof(CellData<D,C>) / align) * align;
+        double arena = nnodes * cellbytes + (nobj + nnodes) * databytes;
+        if (nindices > 0.) arena += nindices * sizeof(long) + nleaves * align;
+        bytes[FieldMemArena] = long(arena);
+    } else {
+        bytes[FieldMemCells] = long(nnodes * sizeof(Cell<D,C>));
+        bytes[FieldMemCellData] = long(nnodes * sizeof(CellData<D,C>));
+        bytes[FieldMemIndices] = long(nindices * sizeof(long));
+    }
+    // While building, there is a vector with the original CellData of each object.
+    // Without arenas, the ones that don't end up in the tree are deleted afterwards.
+    bytes[FieldMemBuild] = long(nobj * (sizeof(std::pair<CellData<D,C>*,WPosLeafInfo>) +
+                                        (use_arena ? 0 : sizeof(CellData<D,C>))));
+    if (use_packed) {
+        bytes[FieldMemPacked] = long(sizeof(PackedTree<D,C>) +
+                                     nnodes * PackedTree<D,C>::getNodeBytes());
+    }
+    bytes[FieldMemOther] = sizeof(Field<D,C>);
+}
+
+//
+// Writing and reading Fields to/from files.
+//
+// The file starts with a FieldFileHeader, followed by these arrays, each of which starts
+// at an offset aligned for any type (so they can be used in place from a memory map):
+//
+//   top[ntop+1]        The node index where each top-level tree starts.
+//   data[nnodes]       The CellData for each node in depth-first order.
+//   size[nnodes]       The size of each node.
+//   right[nnodes]      The index of the right child of each node, or 0 for leaves.
+//                      (As in PackedTree, the left child of node i is always at i+1.)
+//   leaf[nnodes]       For leaves with N==1, the index of the object.  For leaves with N>1,
+//                      the offset of its index list in indices.  Unused for other nodes.
+//   indices[nindices]  The index lists for the leaves with N>1.
+//
+// The file is only meant to be read back on the same kind of machine that wrote it, since
+// the CellData are written as raw bytes.  The header records enough to check that.
+
+const char FIELD_FILE_MAGIC[8] = "TCFIELD";
+const int FIELD_FILE_VERSION = 1;
+
+template <int C>
+struct FieldFileHeader
+{
+    // This first part doesn't depend on C, so it can be checked before anything else.
+    char magic[8];
+    int version;
+    int d;
+    int c;
+    int sizeof_long;
+    int sizeof_celldata;
+
+    int sm;
+    int brute;
+    int mintop;
+    int maxtop;
+    long nobj;
+    double minsize;
+    double maxsize;
+    double sizesq;
+    Position<C> center;
+    long ntop;
+    long nnodes;
+    long nindices;
+};
+
+inline size_t AlignOffset(size_t offset)
+{
+    const size_t align = alignof(std::max_align_t);
+    return (offset + align - 1) & ~(align - 1);
+}
+
+// The offsets of each array in the file (after the header), and the total file size.
+struct FieldFileOffsets
+{
+    template <int D, int C>
+    FieldFileOffsets(const FieldFileHeader<C>& h, const CellData<D,C>*)
+    {
+        top = AlignOffset(sizeof(FieldFileHeader<C>));
+        data = AlignOffset(top + (h.ntop+1) * sizeof(long));
+        size = AlignOffset(data + h.nnodes * sizeof(CellData<D,C>));
+        right = AlignOffset(size + h.nnodes * sizeof(float));
+        leaf = AlignOffset(right + h.nnodes * sizeof(long));
+        indices = AlignOffset(leaf + h.nnodes * sizeof(long));
+        end = indices + h.nindices * sizeof(long);
+    }
+    size_t top, data, size, right, leaf, indices, end;
+};
+
+template <int D, int C>
+void FlattenCell(const Cell<D,C>* cell,
+                 std::vector<CellData<D,C> >& data, std::vector<float>& size,
+                 std::vector<long>& right, std::vector<long>& leaf, std::vector<long>& indices)
+{
+    long k = long(data.size());
+    data.push_back(cell->getData());
+    size.push_back(cell->getSize());
+    right.push_back(0);
+    leaf.push_back(0);
+    if (cell->getLeft()) {
+        FlattenCell(cell->getLeft(), data, size, right, leaf, indices);
+        right[k] = long(data.size());
+        FlattenCell(cell->getRight(), data, size, right, leaf, indices);
+    } else if (cell->getN() == 1) {
+        leaf[k] = cell->getInfo().index;
+    } else {
+        leaf[k] = long(indices.size());
+        const long* leaf_indices = cell->getListInfo().indices;
+        indices.insert(indices.end(), leaf_indices, leaf_indices + cell->getN());
+    }
+}
+
+template <typename T>
+void WriteArray(std::ofstream& fout, const std::vector<T>& v, size_t offset)
+{
+    // Pad with zeros up to the (aligned) offset where this array starts.
+    static const char zeros[64] = {0};
+    size_t pos = fout.tellp();
+    Assert(offset >= pos && offset - pos < sizeof(zeros));
+    fout.write(zeros, offset - pos);
+    if (!v.empty()) fout.write(reinterpret_cast<const char*>(&v[0]), v.size() * sizeof(T));
+}
+
+template <int D, int C>
+bool Field<D,C>::write(const char* file_name) const
+{
+    BuildCells();  // Make sure this is done.
+    dbg<<"Start Field::write: "<<file_name<<std::endl;
+
+    std::vector<long> top(1,0);
+    std::vector<CellData<D,C> > data;
+    std::vector<float> size;
+    std::vector<long> right;
+    std::vector<long> leaf;
+    std::vector<long> indices;
+    data.reserve(2*_nobj);
+    size.reserve(2*_nobj);
+    right.reserve(2*_nobj);
+    leaf.reserve(2*_nobj);
+    for (size_t i=0; i<_cells.size(); ++i) {
+        FlattenCell(_cells[i], data, size, right, leaf, indices);
+        top.push_back(long(data.size()));
+    }
+
+    FieldFileHeader<C> h = FieldFileHeader<C>();
+    std::memcpy(h.magic, FIELD_FILE_MAGIC, sizeof(h.magic));
+    h.version = FIELD_FILE_VERSION;
+    h.d = D;
+    h.c = C;
+    h.sizeof_long = sizeof(long);
+    h.sizeof_celldata = sizeof(CellData<D,C>);
+    h.sm = _sm;
+    h.brute = _brute;
+    h.mintop = _mintop;
+    h.maxtop = _maxtop;
+    h.nobj = _nobj;
+    h.minsize = _minsize;
+    h.maxsize = _maxsize;
+    h.sizesq = _sizesq;
+    h.center = _center;
+    h.ntop = long(_cells.size());
+    h.nnodes = long(data.size());
+    h.nindices = long(indices.size());
+    FieldFileOffsets off(h, static_cast<const CellData<D,C>*>(0));
+
+    std::ofstream fout(file_name, std::ios::binary);
+    if (!fout) return false;
+    fout.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    WriteArray(fout, top, off.top);
+    WriteArray(fout, data, off.data);
+    WriteArray(fout, size, off.size);
+    WriteArray(fout, right, off.right);
+    WriteArray(fout, leaf, off.leaf);
+    WriteArray(fout, indices, off.indices);
+    fout.close();
+    dbg<<"Wrote "<<off.end<<" bytes\n";
+    return bool(fout);
+}
+
+// A helper for the reading constructor to remake the Cells from the arrays in the file.
+template <int D, int C>
+struct FieldFileReader
+{
+    const CellData<D,C>* data;
+    const float* size;
+    const long* right;
+    const long* leaf;
+    const long* indices;
+    Arena* arena;
+
+    Cell<D,C>* makeCell(long& k) const
+    {
+        long i = k++;
+        // The CellData aren't modified, except for the mutable cached norms in Position.
+        // The mapping is copy-on-write, so that's ok.
+        CellData<D,C>* d = const_cast<CellData<D,C>*>(data + i);
+        if (right[i]) {
+            Cell<D,C>* l = makeCell(k);
+            Assert(k == right[i]);
+            Cell<D,C>* r = makeCell(k);
+            return new (arena) Cell<D,C>(d, size[i], l, r);
+        } else if (d->getN() == 1) {
+            LeafInfo info;
+            info.index = leaf[i];
+            return new (arena) Cell<D,C>(d, info);
+        } else {
+            ListLeafInfo listinfo;
+            listinfo.indices = const_cast<long*>(indices + leaf[i]);
+            return new (arena) Cell<D,C>(d, listinfo);
+        }
+    }
+};
+
+template <int D, int C>
+Field<D,C>::Field(const char* file_name, bool use_packed) :
+    _use_arena(true), _use_packed(use_packed), _reorder_tree(false), _bucket_size(0),
+    _packed(0), _mapped(0), _mapped_size(0), _columns(0)
+{
+    dbg<<"Start reading Field from "<<file_name<<std::endl;
+#ifdef _WIN32
+    std::ifstream fin(file_name, std::ios::binary | std::ios::ate);
+    if (!fin) throw std::runtime_error("Unable to open Field file");
+    _mapped_size = fin.tellg();
+    _mapped = new char[_mapped_size];
+    fin.seekg(0);
+    fin.read(_mapped, _mapped_size);
+    if (!fin) {
+        delete [] _mapped;
+        throw std::runtime_error("Unable to read Field file");
+    }
+#else
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Unable to open Field file");
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("Unable to read Field file");
+    }
+    _mapped_size = st.st_size;
+    void* p = mmap(0, _mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);  // The mapping stays valid after closing the file.
+    if (p == MAP_FAILED) throw std::runtime_error("Unable to map Field file");
+    _mapped = static_cast<char*>(p);
+#endif
+
+    // Check that this is really a Field file of the right type before using any of it.
+    const FieldFileHeader<C>& h = *reinterpret_cast<const FieldFileHeader<C>*>(_mapped);
+    bool ok = (_mapped_size >= sizeof(FieldFileHeader<C>) &&
+               std::memcmp(h.magic, FIELD_FILE_MAGIC, sizeof(h.magic)) == 0 &&
+               h.version == FIELD_FILE_VERSION && h.d == D && h.c == C &&
+               h.sizeof_long == int(sizeof(long)) &&
+               h.sizeof_celldata == int(sizeof(CellData<D,C>)));
+    if (ok) {
+        FieldFileOffsets off(h, static_cast<const CellData<D,C>*>(0));
+        ok = (_mapped_size == off.end);
+        if (ok) {
+            _nobj = h.nobj;
+            _minsize = h.minsize;
+            _maxsize = h.maxsize;
+            _sm = static_cast<SplitMethod>(h.sm);
+            _brute = h.brute;
+            _mintop = h.mintop;
+            _maxtop = h.maxtop;
+            _center = h.center;
+            _sizesq = h.sizesq;
+
+            const long* top = reinterpret_cast<const long*>(_mapped + off.top);
+            FieldFileReader<D,C> reader;
+            reader.data = reinterpret_cast<const CellData<D,C>*>(_mapped + off.data);
+            reader.size = reinterpret_cast<const float*>(_mapped + off.size);
+            reader.right = reinterpret_cast<const long*>(_mapped + off.right);
+            reader.leaf = reinterpret_cast<const long*>(_mapped + off.leaf);
+            reader.indices = reinterpret_cast<const long*>(_mapped + off.indices);
+            reader.arena = new Arena(h.nnodes * sizeof(Cell<D,C>) + (1<<16));
+            _arenas.push_back(reader.arena);
+
+            _cells.resize(h.ntop);
+            for (long i=0; i<h.ntop; ++i) {
+                long k = top[i];
+                _cells[i] = reader.makeCell(k);
+                Assert(k == top[i+1]);
+            }
+            dbg<<"Read Field with "<<h.ntop<<" top-level cells and "<<h.nnodes<<" nodes\n";
+        }
+    }
+    if (!ok) {
+        dbg<<"Invalid Field file\n";
+#ifdef _WIN32
+        delete [] _mapped;
+#else
+        munmap(_mapped, _mapped_size);
+#endif
+        throw std::runtime_error("Invalid Field file");
+    }
+
+    if (_use_packed) _packed = new PackedTree<D,C>(_cells);
 }
 
 template <int D, int C>
@@ -363,10 +1066,9 @@ void GetNear(const Cell<D,C>* cell, const Position<C>& pos, double sep, double s
                 indices[k++] = cell->getInfo().index;
             } else {
                 dbg<<"N > 1 case: "<<n1<<std::endl;
-                std::vector<long>* leaf_indices = cell->getListInfo().indices;
-                Assert(long(leaf_indices->size()) == n1);
+                const long* leaf_indices = cell->getListInfo().indices;
                 for (long m=0; m<n1; ++m)
-                    indices[k++] = (*leaf_indices)[m];
+                    indices[k++] = leaf_indices[m];
             }
             Assert(k <= n);
         } else {
@@ -404,6 +1106,417 @@ void Field<D,C>::getNear(double x, double y, double z, double sep, long* indices
     }
 }
 
+// The batched versions of countNear and getNear below can optionally put the query points into
+// their own tree, so that a pair of Cells can rule out (or include) a whole group of queries at
+// once.  This is a simple median-split binary tree over the query positions.  Each node keeps
+// the range of seps of its queries, since every query has its own separation.
+template <int C>
+struct QueryCompare
+{
+    const Position<C>* qpos;
+    int split;
+    QueryCompare(const Position<C>* q, int s) : qpos(q), split(s) {}
+    bool operator()(long q1, long q2) const
+    { return qpos[q1].get(split) < qpos[q2].get(split); }
+};
+
+template <int C>
+struct QueryTree
+{
+    struct Node
+    {
+        Position<C> pos;    // The centroid of the query positions
+        double size;        // The maximum distance of any query from pos
+        double minsep;
+        double maxsep;
+        long start;         // The queries in this node are index[start:end]
+        long end;
+        long left;          // Indices of the child nodes in nodes, or -1 for a leaf.
+        long right;
+    };
+
+    QueryTree(const Position<C>* qpos, const double* sep, long nq, long leaf_size) :
+        _qpos(qpos), _sep(sep), _leaf_size(leaf_size), index(nq)
+    {
+        for (long i=0; i<nq; ++i) index[i] = i;
+        nodes.reserve(2*nq/leaf_size + 1);
+        build(0, nq);
+    }
+
+    long build(long start, long end)
+    {
+        const int ndim = C == Flat ? 2 : 3;
+        double sum[3] = {0., 0., 0.};
+        double lo[3], hi[3];
+        for (int j=0; j<ndim; ++j) {
+            lo[j] = std::numeric_limits<double>::infinity();
+            hi[j] = -lo[j];
+        }
+        double minsep = std::numeric_limits<double>::infinity();
+        double maxsep = 0.;
+        for (long i=start; i<end; ++i) {
+            const Position<C>& p = _qpos[index[i]];
+            for (int j=0; j<ndim; ++j) {
+                double v = p.get(j);
+                sum[j] += v;
+                lo[j] = std::min(lo[j], v);
+                hi[j] = std::max(hi[j], v);
+            }
+            minsep = std::min(minsep, _sep[index[i]]);
+            maxsep = std::max(maxsep, _sep[index[i]]);
+        }
+        const double n = double(end-start);
+        Node node;
+        node.pos = Position<C>(sum[0]/n, sum[1]/n, sum[2]/n);
+        double sizesq = 0.;
+        for (long i=start; i<end; ++i)
+            sizesq = std::max(sizesq, (_qpos[index[i]] - node.pos).normSq());
+        node.size = std::sqrt(sizesq);
+        node.minsep = minsep;
+        node.maxsep = maxsep;
+        node.start = start;
+        node.end = end;
+        node.left = node.right = -1;
+        long inode = long(nodes.size());
+        nodes.push_back(node);
+
+        if (end - start > _leaf_size) {
+            // Split at the median of the direction with the largest extent.
+            int split = 0;
+            for (int j=1; j<ndim; ++j)
+                if (hi[j]-lo[j] > hi[split]-lo[split]) split = j;
+            long mid = (start + end) / 2;
+            std::nth_element(index.begin()+start, index.begin()+mid, index.begin()+end,
+                             QueryCompare<C>(_qpos, split));
+            long left = build(start, mid);
+            long right = build(mid, end);
+            nodes[inode].left = left;
+            nodes[inode].right = right;
+        }
+        return inode;
+    }
+
+    // Collect the nodes with no more than max_n queries each, which between them cover all
+    // the queries.  These are the units of work to do in parallel.
+    void getTasks(long inode, long max_n, std::vector<long>& tasks) const
+    {
+        const Node& node = nodes[inode];
+        if (node.left < 0 || node.end - node.start <= max_n) {
+            tasks.push_back(inode);
+        } else {
+            getTasks(node.left, max_n, tasks);
+            getTasks(node.right, max_n, tasks);
+        }
+    }
+
+    const Position<C>* _qpos;
+    const double* _sep;
+    long _leaf_size;
+    std::vector<long> index;
+    std::vector<Node> nodes;
+};
+
+// Append the indices of all the objects in a Cell to indices[k:].
+template <int D, int C>
+void GetAllIndices(const Cell<D,C>* cell, long* indices, long& k)
+{
+    if (cell->getLeft()) {
+        GetAllIndices(cell->getLeft(), indices, k);
+        GetAllIndices(cell->getRight(), indices, k);
+    } else if (cell->getN() == 1) {
+        indices[k++] = cell->getInfo().index;
+    } else {
+        const long n1 = cell->getN();
+        const long* leaf_indices = cell->getListInfo().indices;
+        for (long m=0; m<n1; ++m) indices[k++] = leaf_indices[m];
+    }
+}
+
+// The dual-tree traversal.  If offsets is null, this adds to counts[q] the number of objects
+// within sep[q] of each query q in the node.  Otherwise, it writes their indices into
+// indices[k[q]:offsets[q+1]], incrementing k[q].
+template <int D, int C>
+void NearDual(const Cell<D,C>* cell, const QueryTree<C>& qt, long inode,
+              const Position<C>* qpos, const double* sep,
+              long* counts, const long* offsets, long* k, long* indices)
+{
+    const typename QueryTree<C>::Node& node = qt.nodes[inode];
+    const double s = cell->getSize();
+    const double d = std::sqrt((cell->getPos() - node.pos).normSq());
+    xdbg<<"NearDual: "<<cell->getPos()<<"  "<<node.pos<<"  "<<d<<"  "<<s<<"  "<<node.size<<std::endl;
+
+    // If d - s - qsize > maxsep, then no objects are near any of the queries.
+    if (d - s - node.size > node.maxsep) return;
+
+    // If d + s + qsize <= minsep, then all the objects are near all of the queries.
+    if (d + s + node.size <= node.minsep) {
+        const long n1 = cell->getN();
+        if (!offsets) {
+            for (long i=node.start; i<node.end; ++i) counts[qt.index[i]] += n1;
+        } else {
+            for (long i=node.start; i<node.end; ++i) {
+                long q = qt.index[i];
+                // This shouldn't happen, but check to avoid a seg fault.
+                Assert(k[q] + n1 <= offsets[q+1]);
+                if (k[q] + n1 > offsets[q+1]) continue;
+                GetAllIndices(cell, indices, k[q]);
+            }
+        }
+        return;
+    }
+
+    if (node.left < 0) {
+        // A leaf of the query tree: do each query on its own.
+        for (long i=node.start; i<node.end; ++i) {
+            long q = qt.index[i];
+            const double sepsq = sep[q]*sep[q];
+            if (!offsets) counts[q] += CountNear(cell, qpos[q], sep[q], sepsq);
+            else GetNear(cell, qpos[q], sep[q], sepsq, indices, k[q], offsets[q+1]);
+        }
+    } else if (s == 0. || node.size >= s) {
+        NearDual(cell, qt, node.left, qpos, sep, counts, offsets, k, indices);
+        NearDual(cell, qt, node.right, qpos, sep, counts, offsets, k, indices);
+    } else {
+        Assert(cell->getLeft());
+        Assert(cell->getRight());
+        NearDual(cell->getLeft(), qt, inode, qpos, sep, counts, offsets, k, indices);
+        NearDual(cell->getRight(), qt, inode, qpos, sep, counts, offsets, k, indices);
+    }
+}
+
+template <int D, int C>
+void Field<D,C>::nearMany(const double* x, const double* y, const double* z, const double* sep,
+                          long nq, bool dual, long* counts, const long* offsets,
+                          long* indices) const
+{
+    BuildCells();  // Make sure this is done.
+    dbg<<"Start nearMany: "<<nq<<" queries, "<<_cells.size()<<" top level cells\n";
+    std::vector<Position<C> > qpos(nq);
+    for (long q=0; q<nq; ++q) qpos[q] = Position<C>(x[q], y[q], z ? z[q] : 0.);
+
+    // For getNearMany, k[q] is where the next index for query q goes.
+    std::vector<long> k;
+    if (offsets) k.assign(offsets, offsets+nq);
+    else std::fill(counts, counts+nq, 0L);
+    long* kp = offsets ? &k[0] : 0;
+
+    if (dual && nq > 0) {
+        QueryTree<C> qt(&qpos[0], sep, nq, 8);
+        std::vector<long> tasks;
+        qt.getTasks(0, std::max(nq / 256, 8L), tasks);
+        dbg<<"Dual tree with "<<qt.nodes.size()<<" nodes, "<<tasks.size()<<" tasks\n";
+        const long ntasks = long(tasks.size());
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (long t=0; t<ntasks; ++t) {
+            // The tasks have disjoint sets of queries, so each query is only touched by
+            // one thread.
+            for (size_t i=0; i<_cells.size(); ++i)
+                NearDual(_cells[i], qt, tasks[t], &qpos[0], sep, counts, offsets, kp, indices);
+        }
+    } else {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,64)
+#endif
+        for (long q=0; q<nq; ++q) {
+            const double sepsq = sep[q]*sep[q];
+            for (size_t i=0; i<_cells.size(); ++i) {
+                if (!offsets) counts[q] += CountNear(_cells[i], qpos[q], sep[q], sepsq);
+                else GetNear(_cells[i], qpos[q], sep[q], sepsq, indices, kp[q], offsets[q+1]);
+            }
+        }
+    }
+
+    if (offsets) {
+        // Sort the indices for each query.  (Not really required, but nicer output.)
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,64)
+#endif
+        for (long q=0; q<nq; ++q)
+            std::sort(indices+offsets[q], indices+offsets[q+1]);
+    }
+}
+
+// For the k-nearest-neighbor search, we need a lower bound on the distance from a query
+// position to any object in a Cell, given the distance d to its center and its size s (as
+// adjusted by the metric's DistSq).  For most metrics this is just d - s.  For Arc, s is a
+// chord length (or its ratio to the distance), so convert it to the maximum angle it can span.
+template <int M>
+struct KNNHelper
+{
+    static double sizeBound(double s) { return s; }
+};
+
+template <>
+struct KNNHelper<Arc>
+{
+    static double sizeBound(double s) { return s < 1. ? std::asin(s) : M_PI; }
+};
+
+// A candidate, which is either a Cell to check, a node of the tree of top-level Cells to check
+// (cell = 0), or an object that was found.  The ordering is by distance, then by index, so
+// ties among the objects always come out the same way.
+template <int D, int C>
+struct KNNItem
+{
+    double dist;
+    long index;
+    const Cell<D,C>* cell;
+
+    KNNItem(double d, long i, const Cell<D,C>* c) : dist(d), index(i), cell(c) {}
+    bool operator<(const KNNItem& rhs) const
+    { return dist < rhs.dist || (dist == rhs.dist && index < rhs.index); }
+    bool operator>(const KNNItem& rhs) const { return rhs < *this; }
+};
+
+// Add the object(s) in a leaf Cell at distance d to the k nearest found so far.
+// (If the Field has min_size > 0, the leaf may be the centroid of several objects.)
+template <int D, int C>
+void AddNearest(const Cell<D,C>* cell, double d, int k,
+                std::priority_queue<KNNItem<D,C> >& found)
+{
+    const long n1 = cell->getN();
+    const long* leaf_indices = n1 == 1 ? &cell->getInfo().index : cell->getListInfo().indices;
+    for (long m=0; m<n1; ++m) {
+        KNNItem<D,C> obj(d, leaf_indices[m], 0);
+        if (long(found.size()) < k) {
+            found.push(obj);
+        } else if (obj < found.top()) {
+            found.pop();
+            found.push(obj);
+        }
+    }
+}
+
+// Check a Cell: leaves are added to found right away, since their size is 0, so d is the
+// distance to the object.  Others are added to todo if they may have anything closer than
+// the k-th object found so far.
+template <int M, int D, int C>
+void CheckNearest(const Cell<D,C>* cell, const Position<C>& pos, const MetricHelper<M,0>& metric,
+                  int k, std::priority_queue<KNNItem<D,C>, std::vector<KNNItem<D,C> >,
+                                             std::greater<KNNItem<D,C> > >& todo,
+                  std::priority_queue<KNNItem<D,C> >& found)
+{
+    double s1 = 0., s2 = cell->getSize();
+    double d = std::sqrt(metric.DistSq(pos, cell->getPos(), s1, s2));
+    if (!cell->getLeft()) {
+        AddNearest(cell, d, k, found);
+    } else {
+        double lb = std::max(d - KNNHelper<M>::sizeBound(s2), 0.);
+        if (long(found.size()) < k || lb <= found.top().dist)
+            todo.push(KNNItem<D,C>(lb, 0, cell));
+    }
+}
+
+// There are often ~1000 top-level Cells, so rather than check each of them for every query,
+// they are put into a QueryTree (with the Cell sizes as the seps), whose nodes are searched
+// first.  A node with position p, size s and maxsep m includes every object in its Cells
+// within s + m of p.
+template <int M, int D, int C>
+void FindNearest(const std::vector<Cell<D,C>*>& cells, const QueryTree<C>& top,
+                 const Position<C>& pos, const MetricHelper<M,0>& metric, int k,
+                 double* dist, long* indices)
+{
+    // The Cells and nodes still to check, closest (lower bound) first.
+    std::priority_queue<KNNItem<D,C>, std::vector<KNNItem<D,C> >,
+                        std::greater<KNNItem<D,C> > > todo;
+    // The k nearest objects found so far, farthest first.
+    std::priority_queue<KNNItem<D,C> > found;
+
+    todo.push(KNNItem<D,C>(0., 0, 0));
+    while (!todo.empty()) {
+        const KNNItem<D,C> item = todo.top();
+        todo.pop();
+        // If the closest remaining candidate is farther than the k-th object found, we're done.
+        if (long(found.size()) == k && item.dist > found.top().dist) break;
+
+        if (item.cell) {
+            if (item.cell->getLeft()) {
+                CheckNearest(item.cell->getLeft(), pos, metric, k, todo, found);
+                CheckNearest(item.cell->getRight(), pos, metric, k, todo, found);
+            } else {
+                AddNearest(item.cell, item.dist, k, found);
+            }
+        } else {
+            const typename QueryTree<C>::Node& node = top.nodes[item.index];
+            if (node.left >= 0) {
+                const long kids[2] = { node.left, node.right };
+                for (int j=0; j<2; ++j) {
+                    const typename QueryTree<C>::Node& kid = top.nodes[kids[j]];
+                    double s1 = 0., s2 = kid.size + kid.maxsep;
+                    double d = std::sqrt(metric.DistSq(pos, kid.pos, s1, s2));
+                    double lb = std::max(d - KNNHelper<M>::sizeBound(s2), 0.);
+                    if (long(found.size()) < k || lb <= found.top().dist)
+                        todo.push(KNNItem<D,C>(lb, kids[j], 0));
+                }
+            } else {
+                for (long i=node.start; i<node.end; ++i)
+                    CheckNearest(cells[top.index[i]], pos, metric, k, todo, found);
+            }
+        }
+    }
+
+    // Fill in the results from the farthest to the nearest.  If there were fewer than k
+    // objects, the rest are left as dist = inf, index = -1.
+    for (int j=k-1; j>=0; --j) {
+        if (long(found.size()) > j) {
+            dist[j] = found.top().dist;
+            indices[j] = found.top().index;
+            found.pop();
+        } else {
+            dist[j] = std::numeric_limits<double>::infinity();
+            indices[j] = -1;
+        }
+    }
+}
+
+template <int D, int C> template <int M>
+void Field<D,C>::nearestNeighbors(const double* x, const double* y, const double* z, long nq,
+                                  int k, double xp, double yp, double zp,
+                                  double* dist, long* indices) const
+{
+    BuildCells();  // Make sure this is done.
+    dbg<<"Start nearestNeighbors: "<<nq<<" queries, k = "<<k<<", metric = "<<M<<std::endl;
+    if (nq == 0) return;
+    if (_cells.size() == 0) {
+        std::fill(dist, dist+nq*k, std::numeric_limits<double>::infinity());
+        std::fill(indices, indices+nq*k, -1L);
+        return;
+    }
+    const long ntop = long(_cells.size());
+    std::vector<Position<C> > top_pos(ntop);
+    std::vector<double> top_size(ntop);
+    for (long i=0; i<ntop; ++i) {
+        top_pos[i] = _cells[i]->getPos();
+        top_size[i] = _cells[i]->getSize();
+    }
+    QueryTree<C> top(&top_pos[0], &top_size[0], ntop, 4);
+
+    std::vector<Position<C> > qpos(nq);
+    for (long q=0; q<nq; ++q) qpos[q] = Position<C>(x[q], y[q], z ? z[q] : 0.);
+
+    // Do the queries in the order of a QueryTree, so consecutive queries are near each other
+    // and mostly visit the same Cells, which are then already in the cache.
+    std::vector<double> zero(nq, 0.);
+    QueryTree<C> qt(&qpos[0], &zero[0], nq, 8);
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        // Some metrics save values between function calls, so each thread needs its own.
+        MetricHelper<M,0> metric(0., 0., xp, yp, zp);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,64)
+#endif
+        for (long i=0; i<nq; ++i) {
+            long q = qt.index[i];
+            FindNearest(_cells, top, qpos[q], metric, k, dist + q*k, indices + q*k);
+        }
+    }
+}
+
 template <int D, int C>
 SimpleField<D,C>::SimpleField(
     double* x, double* y, double* z, double* g1, double* g2, double* k,
@@ -417,7 +1530,7 @@ SimpleField<D,C>::SimpleField(
         for(long i=0;i<nobj;++i) {
             WPosLeafInfo wp = get_wpos(wpos,w,i);
             celldata.push_back(std::make_pair(
-                    CellDataHelper<D,C>::build(x[i],y[i],z[i],g1[i],g2[i],k[i],w[i]),
+                    CellDataHelper<D,C>::build(x[i],y[i],z[i],g1[i],g2[i],k[i],w[i],0),
                     wp));
         }
     } else {
@@ -425,7 +1538,7 @@ SimpleField<D,C>::SimpleField(
         for(long i=0;i<nobj;++i) {
             WPosLeafInfo wp = get_wpos(wpos,w,i);
             celldata.push_back(std::make_pair(
-                    CellDataHelper<D,C>::build(x[i],y[i],0.,g1[i],g2[i],k[i],w[i]),
+                    CellDataHelper<D,C>::build(x[i],y[i],0.,g1[i],g2[i],k[i],w[i],0),
                     wp));
         }
     }
@@ -467,7 +1580,9 @@ template <int D>
 void* BuildField(double* x, double* y, double* z, double* g1, double* g2, double* k,
                  double* w, double* wpos, long nobj,
                  double minsize, double maxsize,
-                 int sm_int, long long seed, int brute, int mintop, int maxtop, int coords)
+                 int sm_int, long long seed, int brute, int mintop, int maxtop,
+                 int use_arena, int use_packed, int zero_copy, int reorder_tree,
+                 int bucket_size, long* patch, int npatch, int coords)
 {
     dbg<<"Start BuildField "<<D<<"  "<<coords<<std::endl;
     void* field=0;
@@ -479,21 +1594,30 @@ void* BuildField(double* x, double* y, double* z, double* g1, double* g2, double
                                                         w, wpos, nobj,
                                                         minsize, maxsize,
                                                         sm, seed,
-                                                        bool(brute), mintop, maxtop));
+                                                        bool(brute), mintop, maxtop,
+                                                        bool(use_arena), bool(use_packed),
+                                                        bool(zero_copy), bool(reorder_tree),
+                                                        bucket_size, patch, npatch));
            break;
       case Sphere:
            field = static_cast<void*>(new Field<D,Sphere>(x, y, z, g1, g2, k,
                                                           w, wpos, nobj,
                                                           minsize, maxsize,
                                                           sm, seed,
-                                                          bool(brute), mintop, maxtop));
+                                                          bool(brute), mintop, maxtop,
+                                                          bool(use_arena), bool(use_packed),
+                                                          bool(zero_copy), bool(reorder_tree),
+                                                          bucket_size, patch, npatch));
            break;
       case ThreeD:
            field = static_cast<void*>(new Field<D,ThreeD>(x, y, z, g1, g2, k,
                                                           w, wpos, nobj,
                                                           minsize, maxsize,
                                                           sm, seed,
-                                                          bool(brute), mintop, maxtop));
+                                                          bool(brute), mintop, maxtop,
+                                                          bool(use_arena), bool(use_packed),
+                                                          bool(zero_copy), bool(reorder_tree),
+                                                          bucket_size, patch, npatch));
            break;
     }
     xdbg<<"field = "<<field<<std::endl;
@@ -503,32 +1627,41 @@ void* BuildField(double* x, double* y, double* z, double* g1, double* g2, double
 void* BuildGField(double* x, double* y, double* z, double* g1, double* g2,
                   double* w, double* wpos, long nobj,
                   double minsize, double maxsize,
-                  int sm_int, long long seed, int brute, int mintop, int maxtop, int coords)
+                  int sm_int, long long seed, int brute, int mintop, int maxtop,
+                  int use_arena, int use_packed, int zero_copy, int reorder_tree,
+                  int bucket_size, long* patch, int npatch, int coords)
 {
     // Note: Use w for k, since we access k[i], even though value will be ignored.
     return BuildField<GData>(x,y,z, g1,g2,w, w,wpos,nobj, minsize,maxsize, sm_int, seed,
-                             brute,mintop,maxtop,coords);
+                             brute,mintop,maxtop,use_arena,use_packed,zero_copy,reorder_tree,
+                             bucket_size,patch,npatch,coords);
 }
 
 
 void* BuildKField(double* x, double* y, double* z, double* k,
                   double* w, double* wpos, long nobj,
                   double minsize, double maxsize,
-                  int sm_int, long long seed, int brute, int mintop, int maxtop, int coords)
+                  int sm_int, long long seed, int brute, int mintop, int maxtop,
+                  int use_arena, int use_packed, int zero_copy, int reorder_tree,
+                  int bucket_size, long* patch, int npatch, int coords)
 {
     // Note: Use w for g1,g2, since we access g1[i],g2[i] even though values are ignored.
     return BuildField<KData>(x,y,z, w,w,k, w,wpos,nobj, minsize,maxsize, sm_int, seed,
-                             brute,mintop,maxtop,coords);
+                             brute,mintop,maxtop,use_arena,use_packed,zero_copy,reorder_tree,
+                             bucket_size,patch,npatch,coords);
 }
 
 void* BuildNField(double* x, double* y, double* z,
                   double* w, double* wpos, long nobj,
                   double minsize, double maxsize,
-                  int sm_int, long long seed, int brute, int mintop, int maxtop, int coords)
+                  int sm_int, long long seed, int brute, int mintop, int maxtop,
+                  int use_arena, int use_packed, int zero_copy, int reorder_tree,
+                  int bucket_size, long* patch, int npatch, int coords)
 {
     // Note: Use w for g1,g2,k for same reasons as above.
     return BuildField<NData>(x,y,z, w,w,w, w,wpos,nobj, minsize,maxsize, sm_int, seed,
-                             brute,mintop,maxtop,coords);
+                             brute,mintop,maxtop,use_arena,use_packed,zero_copy,reorder_tree,
+                             bucket_size,patch,npatch,coords);
 }
 
 template <int D>
@@ -558,6 +1691,172 @@ void DestroyKField(void* field, int coords)
 void DestroyNField(void* field, int coords)
 { DestroyField<NData>(field, coords); }
 
+template <int D>
+void InsertField(void* field, double* x, double* y, double* z,
+                 double* g1, double* g2, double* k,
+                 double* w, double* wpos, long nobj, int coords)
+{
+    dbg<<"Start InsertField "<<D<<"  "<<coords<<std::endl;
+    switch(coords) {
+      case Flat:
+           static_cast<Field<D,Flat>*>(field)->insert(x, y, 0, g1, g2, k, w, wpos, nobj);
+           break;
+      case Sphere:
+           static_cast<Field<D,Sphere>*>(field)->insert(x, y, z, g1, g2, k, w, wpos, nobj);
+           break;
+      case ThreeD:
+           static_cast<Field<D,ThreeD>*>(field)->insert(x, y, z, g1, g2, k, w, wpos, nobj);
+           break;
+    }
+}
+
+void InsertGField(void* field, double* x, double* y, double* z, double* g1, double* g2,
+                  double* w, double* wpos, long nobj, int coords)
+{ InsertField<GData>(field, x,y,z, g1,g2,w, w,wpos,nobj, coords); }
+
+void InsertKField(void* field, double* x, double* y, double* z, double* k,
+                  double* w, double* wpos, long nobj, int coords)
+{ InsertField<KData>(field, x,y,z, w,w,k, w,wpos,nobj, coords); }
+
+void InsertNField(void* field, double* x, double* y, double* z,
+                  double* w, double* wpos, long nobj, int coords)
+{ InsertField<NData>(field, x,y,z, w,w,w, w,wpos,nobj, coords); }
+
+template <int D>
+void AddFieldData(void* field, double* x, double* y, double* z,
+                  double* g1, double* g2, double* k,
+                  double* w, double* wpos, long nobj, int coords)
+{
+    dbg<<"Start AddFieldData "<<D<<"  "<<coords<<"  "<<nobj<<std::endl;
+    switch(coords) {
+      case Flat:
+           static_cast<Field<D,Flat>*>(field)->addData(x, y, 0, g1, g2, k, w, wpos, nobj);
+           break;
+      case Sphere:
+           static_cast<Field<D,Sphere>*>(field)->addData(x, y, z, g1, g2, k, w, wpos, nobj);
+           break;
+      case ThreeD:
+           static_cast<Field<D,ThreeD>*>(field)->addData(x, y, z, g1, g2, k, w, wpos, nobj);
+           break;
+    }
+}
+
+void AddGFieldData(void* field, double* x, double* y, double* z, double* g1, double* g2,
+                   double* w, double* wpos, long nobj, int coords)
+{ AddFieldData<GData>(field, x,y,z, g1,g2,w, w,wpos,nobj, coords); }
+
+void AddKFieldData(void* field, double* x, double* y, double* z, double* k,
+                   double* w, double* wpos, long nobj, int coords)
+{ AddFieldData<KData>(field, x,y,z, w,w,k, w,wpos,nobj, coords); }
+
+void AddNFieldData(void* field, double* x, double* y, double* z,
+                   double* w, double* wpos, long nobj, int coords)
+{ AddFieldData<NData>(field, x,y,z, w,w,w, w,wpos,nobj, coords); }
+
+template <int D>
+void FinishFieldData1(void* field, int coords)
+{
+    switch(coords) {
+      case Flat:
+           static_cast<Field<D,Flat>*>(field)->finishData();
+           break;
+      case Sphere:
+           static_cast<Field<D,Sphere>*>(field)->finishData();
+           break;
+      case ThreeD:
+           static_cast<Field<D,ThreeD>*>(field)->finishData();
+           break;
+    }
+}
+
+void FinishFieldData(void* field, int d, int coords)
+{
+    switch(d) {
+      case NData:
+           FinishFieldData1<NData>(field, coords);
+           break;
+      case KData:
+           FinishFieldData1<KData>(field, coords);
+           break;
+      case GData:
+           FinishFieldData1<GData>(field, coords);
+           break;
+    }
+}
+
+template <int D>
+int FieldWrite1(void* field, const char* file_name, int coords)
+{
+    switch(coords) {
+      case Flat:
+           return static_cast<Field<D,Flat>*>(field)->write(file_name);
+           break;
+      case Sphere:
+           return static_cast<Field<D,Sphere>*>(field)->write(file_name);
+           break;
+      case ThreeD:
+           return static_cast<Field<D,ThreeD>*>(field)->write(file_name);
+           break;
+    }
+    return 0;  // Can't get here, but saves a compiler warning
+}
+
+int FieldWrite(void* field, const char* file_name, int d, int coords)
+{
+    dbg<<"Start FieldWrite "<<d<<"  "<<coords<<"  "<<file_name<<std::endl;
+    switch(d) {
+      case NData:
+           return FieldWrite1<NData>(field, file_name, coords);
+           break;
+      case KData:
+           return FieldWrite1<KData>(field, file_name, coords);
+           break;
+      case GData:
+           return FieldWrite1<GData>(field, file_name, coords);
+           break;
+    }
+    return 0;  // Can't get here, but saves a compiler warning
+}
+
+template <int D>
+void* FieldRead1(const char* file_name, bool use_packed, int coords)
+{
+    switch(coords) {
+      case Flat:
+           return static_cast<void*>(new Field<D,Flat>(file_name, use_packed));
+           break;
+      case Sphere:
+           return static_cast<void*>(new Field<D,Sphere>(file_name, use_packed));
+           break;
+      case ThreeD:
+           return static_cast<void*>(new Field<D,ThreeD>(file_name, use_packed));
+           break;
+    }
+    return 0;  // Can't get here, but saves a compiler warning
+}
+
+// Returns null if the file doesn't exist or isn't a valid Field file of this type.
+void* FieldRead(const char* file_name, int use_packed, int d, int coords)
+{
+    dbg<<"Start FieldRead "<<d<<"  "<<coords<<"  "<<file_name<<std::endl;
+    try {
+        switch(d) {
+          case NData:
+               return FieldRead1<NData>(file_name, bool(use_packed), coords);
+               break;
+          case KData:
+               return FieldRead1<KData>(file_name, bool(use_packed), coords);
+               break;
+          case GData:
+               return FieldRead1<GData>(file_name, bool(use_packed), coords);
+               break;
+        }
+    } catch (std::runtime_error& e) {
+        dbg<<"Caught error: "<<e.what()<<std::endl;
+    }
+    return 0;
+}
+
 template <int D>
 long FieldGetNTopLevel1(void* field, int coords)
 {
@@ -591,6 +1890,109 @@ long FieldGetNTopLevel(void* field, int d, int coords)
     return 0;  // Can't get here, but saves a compiler warning
 }
 
+template <int D, int C>
+void FieldGetTopLevelW2(Field<D,C>* field, double* w, long n)
+{
+    const std::vector<Cell<D,C>*>& cells = field->getCells();
+    Assert(n == long(cells.size()));
+    for (long i=0; i<n; ++i) w[i] = cells[i]->getW();
+}
+
+template <int D>
+void FieldGetTopLevelW1(void* field, int coords, double* w, long n)
+{
+    switch(coords) {
+      case Flat:
+           FieldGetTopLevelW2(static_cast<Field<D,Flat>*>(field), w, n);
+           break;
+      case Sphere:
+           FieldGetTopLevelW2(static_cast<Field<D,Sphere>*>(field), w, n);
+           break;
+      case ThreeD:
+           FieldGetTopLevelW2(static_cast<Field<D,ThreeD>*>(field), w, n);
+           break;
+    }
+}
+
+void FieldGetTopLevelW(void* field, int d, int coords, double* w, long n)
+{
+    switch(d) {
+      case NData:
+           FieldGetTopLevelW1<NData>(field, coords, w, n);
+           break;
+      case KData:
+           FieldGetTopLevelW1<KData>(field, coords, w, n);
+           break;
+      case GData:
+           FieldGetTopLevelW1<GData>(field, coords, w, n);
+           break;
+    }
+}
+
+template <int D>
+void FieldGetMemory1(void* field, int coords, long* bytes)
+{
+    switch(coords) {
+      case Flat:
+           static_cast<Field<D,Flat>*>(field)->getMemory(bytes);
+           break;
+      case Sphere:
+           static_cast<Field<D,Sphere>*>(field)->getMemory(bytes);
+           break;
+      case ThreeD:
+           static_cast<Field<D,ThreeD>*>(field)->getMemory(bytes);
+           break;
+    }
+}
+
+void FieldGetMemory(void* field, int d, int coords, long* bytes)
+{
+    switch(d) {
+      case NData:
+           FieldGetMemory1<NData>(field, coords, bytes);
+           break;
+      case KData:
+           FieldGetMemory1<KData>(field, coords, bytes);
+           break;
+      case GData:
+           FieldGetMemory1<GData>(field, coords, bytes);
+           break;
+    }
+}
+
+template <int D>
+void EstimateFieldMemory1(long nobj, double minsize, double size, int use_arena,
+                          int use_packed, int coords, long* bytes)
+{
+    switch(coords) {
+      case Flat:
+           Field<D,Flat>::estimateMemory(nobj, minsize, size, use_arena, use_packed, bytes);
+           break;
+      case Sphere:
+           Field<D,Sphere>::estimateMemory(nobj, minsize, size, use_arena, use_packed, bytes);
+           break;
+      case ThreeD:
+           Field<D,ThreeD>::estimateMemory(nobj, minsize, size, use_arena, use_packed, bytes);
+           break;
+    }
+}
+
+void EstimateFieldMemory(long nobj, double minsize, double size, int use_arena,
+                         int use_packed, int d, int coords, long* bytes)
+{
+    switch(d) {
+      case NData:
+           EstimateFieldMemory1<NData>(nobj, minsize, size, use_arena, use_packed, coords, bytes);
+           break;
+      case KData:
+           EstimateFieldMemory1<KData>(nobj, minsize, size, use_arena, use_packed, coords, bytes);
+           break;
+      case GData:
+           EstimateFieldMemory1<GData>(nobj, minsize, size, use_arena, use_packed, coords, bytes);
+           break;
+    }
+}
+
 template <int D>
 long FieldCountNear1(void* field, double x, double y, double z, double sep, int coords)
 {
@@ -657,6 +2059,129 @@ void FieldGetNear(void* field, double x, double y, double z, double sep, int d,
     }
 }
 
+template <int D>
+void FieldNearMany1(void* field, double* x, double* y, double* z, double* sep, long nq,
+                    int dual, int coords, long* counts, long* offsets, long* indices)
+{
+    switch(coords) {
+      case Flat:
+           static_cast<Field<D,Flat>*>(field)->nearMany(
+               x,y,z,sep,nq,dual,counts,offsets,indices);
+           break;
+      case Sphere:
+           static_cast<Field<D,Sphere>*>(field)->nearMany(
+               x,y,z,sep,nq,dual,counts,offsets,indices);
+           break;
+      case ThreeD:
+           static_cast<Field<D,ThreeD>*>(field)->nearMany(
+               x,y,z,sep,nq,dual,counts,offsets,indices);
+           break;
+    }
+}
+
+static void FieldNearMany(void* field, double* x, double* y, double* z, double* sep, long nq,
+                          int dual, int d, int coords, long* counts, long* offsets, long* indices)
+{
+    switch(d) {
+      case NData:
+           FieldNearMany1<NData>(field, x, y, z, sep, nq, dual, coords, counts, offsets, indices);
+           break;
+      case KData:
+           FieldNearMany1<KData>(field, x, y, z, sep, nq, dual, coords, counts, offsets, indices);
+           break;
+      case GData:
+           FieldNearMany1<GData>(field, x, y, z, sep, nq, dual, coords, counts, offsets, indices);
+           break;
+    }
+}
+
+void FieldCountNearMany(void* field, double* x, double* y, double* z, double* sep, long nq,
+                        int dual, int d, int coords, long* counts)
+{
+    FieldNearMany(field, x, y, z, sep, nq, dual, d, coords, counts, 0, 0);
+}
+
+void FieldGetNearMany(void* field, double* x, double* y, double* z, double* sep, long nq,
+                      int dual, int d, int coords, long* offsets, long* indices)
+{
+    FieldNearMany(field, x, y, z, sep, nq, dual, d, coords, 0, offsets, indices);
+}
+
+template <int M, int D>
+void FieldKNN2(void* field, double* x, double* y, double* z, long nq, int k, int coords,
+               double xp, double yp, double zp, double* dist, long* indices)
+{
+    switch(coords) {
+      case Flat:
+           Assert((MetricHelper<M,0>::_Flat == int(Flat)));
+           static_cast<Field<D,MetricHelper<M,0>::_Flat>*>(field)->template
+               nearestNeighbors<M>(x,y,z,nq,k,xp,yp,zp,dist,indices);
+           break;
+      case Sphere:
+           Assert((MetricHelper<M,0>::_Sphere == int(Sphere)));
+           static_cast<Field<D,MetricHelper<M,0>::_Sphere>*>(field)->template
+               nearestNeighbors<M>(x,y,z,nq,k,xp,yp,zp,dist,indices);
+           break;
+      case ThreeD:
+           Assert((MetricHelper<M,0>::_ThreeD == int(ThreeD)));
+           static_cast<Field<D,MetricHelper<M,0>::_ThreeD>*>(field)->template
+               nearestNeighbors<M>(x,y,z,nq,k,xp,yp,zp,dist,indices);
+           break;
+    }
+}
+
+template <int D>
+void FieldKNN1(void* field, double* x, double* y, double* z, long nq, int k, int coords,
+               int metric, double xp, double yp, double zp, double* dist, long* indices)
+{
+    switch(metric) {
+#ifdef TREECORR_USE_EUCLIDEAN
+      case Euclidean:
+           FieldKNN2<Euclidean,D>(field, x, y, z, nq, k, coords, xp, yp, zp, dist, indices);
+           break;
+#endif
+#ifdef TREECORR_USE_RPERP
+      case Rperp:
+           FieldKNN2<Rperp,D>(field, x, y, z, nq, k, coords, xp, yp, zp, dist, indices);
+           break;
+#endif
+#ifdef TREECORR_USE_OLDRPERP
+      case OldRperp:
+           FieldKNN2<OldRperp,D>(field, x, y, z, nq, k, coords, xp, yp, zp, dist, indices);
+           break;
+#endif
+#ifdef TREECORR_USE_ARC
+      case Arc:
+           FieldKNN2<Arc,D>(field, x, y, z, nq, k, coords, xp, yp, zp, dist, indices);
+           break;
+#endif
+#ifdef TREECORR_USE_PERIODIC
+      case Periodic:
+           FieldKNN2<Periodic,D>(field, x, y, z, nq, k, coords, xp, yp, zp, dist, indices);
+           break;
+#endif
+      default:
+           Assert(false);
+    }
+}
+
+void FieldKNN(void* field, double* x, double* y, double* z, long nq, int k,
+              int d, int coords, int metric, double xp, double yp, double zp,
+              double* dist, long* indices)
+{
+    switch(d) {
+      case NData:
+           FieldKNN1<NData>(field, x, y, z, nq, k, coords, metric, xp, yp, zp, dist, indices);
+           break;
+      case KData:
+           FieldKNN1<KData>(field, x, y, z, nq, k, coords, metric, xp, yp, zp, dist, indices);
+           break;
+      case GData:
+           FieldKNN1<GData>(field, x, y, z, nq, k, coords, metric, xp, yp, zp, dist, indices);
+           break;
+    }
+}
+
 template <int D>
 void* BuildSimpleField(double* x, double* y, double* z, double* g1, double* g2, double* k,
                        double* w, double* wpos, long nobj, int coords)
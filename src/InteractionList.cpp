@@ -0,0 +1,179 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+//#define DEBUGLOGGING
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "InteractionList.h"
+#include "dbg.h"
+
+// The file format for InteractionList::write is the header below, followed by the arrays
+// i1[n], i2[n], k[n] and rsq[n] written as raw bytes.  As for the Field files, it is only
+// meant to be read back on the same kind of machine that wrote it.
+
+const char INTERACTION_FILE_MAGIC[8] = "TCILIST";
+const int INTERACTION_FILE_VERSION = 2;
+
+struct InteractionFileHeader
+{
+    char magic[8];
+    int version;
+    int d1;
+    int d2;
+    int bin_type;
+    int nbins;
+    int coords;
+    int metric;
+    int do_reverse;
+    double minsep;
+    double maxsep;
+    double b;
+    long ncells1;
+    long ncells2;
+    unsigned long long hash1;
+    unsigned long long hash2;
+    long n;
+};
+
+template <typename T>
+void WriteArray(std::ofstream& fout, const std::vector<T>& v)
+{
+    if (!v.empty()) fout.write(reinterpret_cast<const char*>(&v[0]), v.size() * sizeof(T));
+}
+
+template <typename T>
+void ReadArray(std::ifstream& fin, std::vector<T>& v, long n)
+{
+    v.resize(n);
+    if (n > 0) fin.read(reinterpret_cast<char*>(&v[0]), n * sizeof(T));
+}
+
+bool InteractionList::write(const char* file_name) const
+{
+    dbg<<"Start InteractionList::write: "<<file_name<<std::endl;
+    InteractionFileHeader h = InteractionFileHeader();
+    std::memcpy(h.magic, INTERACTION_FILE_MAGIC, sizeof(h.magic));
+    h.version = INTERACTION_FILE_VERSION;
+    h.d1 = _d1;
+    h.d2 = _d2;
+    h.bin_type = _bin_type;
+    h.nbins = _nbins;
+    h.coords = _coords;
+    h.metric = _metric;
+    h.do_reverse = _do_reverse;
+    h.minsep = _minsep;
+    h.maxsep = _maxsep;
+    h.b = _b;
+    h.ncells1 = _ncells1;
+    h.ncells2 = _ncells2;
+    h.hash1 = _hash1;
+    h.hash2 = _hash2;
+    h.n = size();
+
+    std::ofstream fout(file_name, std::ios::binary);
+    if (!fout) return false;
+    fout.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    WriteArray(fout, _i1);
+    WriteArray(fout, _i2);
+    WriteArray(fout, _k);
+    WriteArray(fout, _rsq);
+    fout.close();
+    dbg<<"Wrote "<<h.n<<" pairs\n";
+    return bool(fout);
+}
+
+InteractionList::InteractionList(const char* file_name)
+{
+    dbg<<"Start InteractionList read: "<<file_name<<std::endl;
+    std::ifstream fin(file_name, std::ios::binary);
+    if (!fin) throw std::runtime_error("Unable to open InteractionList file");
+    InteractionFileHeader h;
+    fin.read(reinterpret_cast<char*>(&h), sizeof(h));
+    if (!fin || std::memcmp(h.magic, INTERACTION_FILE_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != INTERACTION_FILE_VERSION || h.n < 0)
+        throw std::runtime_error("Invalid InteractionList file");
+
+    _d1 = h.d1;
+    _d2 = h.d2;
+    _bin_type = h.bin_type;
+    _nbins = h.nbins;
+    _coords = h.coords;
+    _metric = h.metric;
+    _do_reverse = h.do_reverse;
+    _minsep = h.minsep;
+    _maxsep = h.maxsep;
+    _b = h.b;
+    _ncells1 = h.ncells1;
+    _ncells2 = h.ncells2;
+    _hash1 = h.hash1;
+    _hash2 = h.hash2;
+    ReadArray(fin, _i1, h.n);
+    ReadArray(fin, _i2, h.n);
+    ReadArray(fin, _k, h.n);
+    ReadArray(fin, _rsq, h.n);
+    // Make sure we got all of it, and there isn't anything else.
+    if (!fin || fin.peek() != std::ifstream::traits_type::eof())
+        throw std::runtime_error("Invalid InteractionList file");
+    // The indices are used without any more checks when replaying, so check them here.
+    for (long i=0; i<h.n; ++i) {
+        if (long(_i1[i]) >= _ncells1 || long(_i2[i]) >= _ncells2 ||
+            _k[i] < 0 || _k[i] >= _nbins)
+            throw std::runtime_error("Invalid InteractionList file");
+    }
+    dbg<<"Read "<<h.n<<" pairs\n";
+}
+
+//
+//
+// Now the C-C++ interface functions that get used in python:
+//
+//
+
+extern "C" {
+
+#ifdef _WIN32
+#define extern __declspec(dllexport)
+#endif
+
+#include "InteractionList_C.h"
+}
+
+void DestroyInteractionList(void* list)
+{
+    delete static_cast<InteractionList*>(list);
+}
+
+long InteractionListSize(void* list)
+{
+    return static_cast<InteractionList*>(list)->size();
+}
+
+int InteractionListWrite(void* list, const char* file_name)
+{
+    return static_cast<InteractionList*>(list)->write(file_name);
+}
+
+// Returns null if the file doesn't exist or isn't a valid InteractionList file.
+void* InteractionListRead(const char* file_name)
+{
+    try {
+        return static_cast<void*>(new InteractionList(file_name));
+    } catch (std::runtime_error& e) {
+        dbg<<"Caught error: "<<e.what()<<std::endl;
+    }
+    return 0;
+}
@@ -16,8 +16,12 @@
 
 #include <vector>
 #include <cmath>
+#include <limits>
+#include <algorithm>
 #include "Field.h"
 #include "Cell.h"
+#include "ThreadTimes.h"
+#include "Kernels.h"
 #include "dbg.h"
 
 extern "C" {
@@ -502,10 +506,11 @@ struct AssignPatches
             inertia[patch_num] += (cell->getPos() - centers[patch_num]).normSq() * cell->getW();
 #endif
         } else {
-            std::vector<long>* indices = cell->getListInfo().indices;
-            xdbg<<"Leaf with N>1.  "<<indices->size()<<" indices\n";
-            for (size_t j=0; j<indices->size(); ++j) {
-                long index = (*indices)[j];
+            const long* indices = cell->getListInfo().indices;
+            long n1 = cell->getN();
+            xdbg<<"Leaf with N>1.  "<<n1<<" indices\n";
+            for (long j=0; j<n1; ++j) {
+                long index = indices[j];
                 xdbg<<"    index = "<<index<<std::endl;
                 Assert(index < n);
                 patches[index] = patch_num;
@@ -649,13 +654,66 @@ void FindCellsInPatches(const std::vector<Position<C> >& centers,
     }
 }
 
+// The candidate centers for each top-level cell, kept between the k-means iterations.
+// Starting the recursion with all npatch centers costs npatch distances for each top-level
+// cell, which can be a large part of each iteration.  So for each one, we keep the centers
+// with d <= min_d + 2s + margin, where margin = s, which are the ones the recursion keeps
+// (d <= min_d + 2s) along with some extra to allow for the centers moving.
+// As long as the centers have moved less than margin/2 since then, the others still can't be
+// the closest center to any point in the cell, so the recursion can start from just these.
+// (This is the same kind of bound Elkan's version of k-means uses to skip centers.)
+template <int D, int C>
+struct TopCandidates
+{
+    TopCandidates(long ncells) : cand(ncells), slack(ncells, -1.) {}
+
+    // Set the candidates for top-level cell k from all the centers.
+    void setCandidates(long k, const std::vector<Position<C> >& centers, const Cell<D,C>* cell,
+                       std::vector<double>& saved_dsq)
+    {
+        const Position<C> cell_center = cell->getPos();
+        double s = cell->getSize();
+        int npatch = centers.size();
+        double min_dsq = std::numeric_limits<double>::max();
+        for (int i=0; i<npatch; ++i) {
+            saved_dsq[i] = (cell_center - centers[i]).normSq();
+            if (saved_dsq[i] < min_dsq) min_dsq = saved_dsq[i];
+        }
+        double thresh_dsq = SQR(sqrt(min_dsq) + 3*s);
+        cand[k].clear();
+        for (int i=0; i<npatch; ++i) {
+            if (saved_dsq[i] <= thresh_dsq) cand[k].push_back(i);
+        }
+        slack[k] = s;
+        xdbg<<"Top cell "<<k<<" has "<<cand[k].size()<<" candidates\n";
+    }
+
+    // Use up the slack by twice the largest distance any center moved.
+    void update(const std::vector<Position<C> >& centers,
+                const std::vector<Position<C> >& new_centers)
+    {
+        double max_shiftsq = 0.;
+        for (size_t i=0; i<centers.size(); ++i)
+            max_shiftsq = std::max(max_shiftsq, (centers[i] - new_centers[i]).normSq());
+        double max_shift = sqrt(max_shiftsq);
+        for (size_t k=0; k<slack.size(); ++k) slack[k] -= 2*max_shift;
+    }
+
+    std::vector<std::vector<long> > cand;
+    std::vector<double> slack;
+};
+
 // This recurses the tree until if finds a cell that completely belongs in only a single
 // patch and then runs f, which can be any of the above function classes.
+// If top is given, then each top-level cell starts with the candidates there, rather than
+// all the centers.  This is only valid without the inertia.
 template <int D, int C, typename F>
 void FindCellsInPatches(const std::vector<Position<C> >& centers,
                         const std::vector<Cell<D,C>*>& cells, F& f,
-                        const std::vector<double>* inertia=0)
+                        const std::vector<double>* inertia=0, TopCandidates<D,C>* top=0)
 {
+    Assert(!(inertia && top));
+    RegionTimer timer("FindCellsInPatches", cells.size());
 #ifdef _OPENMP
 #pragma omp parallel
     {
@@ -664,6 +722,7 @@ void FindCellsInPatches(const std::vector<Position<C> >& centers,
 #else
         F& f2 = f;
 #endif
+        timer.startThread();
 
         // We start with all patches as candidates.
         int npatch = centers.size();
@@ -678,15 +737,25 @@ void FindCellsInPatches(const std::vector<Position<C> >& centers,
 #pragma omp for schedule(static)
 #endif
         for (size_t k=0; k<cells.size(); ++k) {
-            FindCellsInPatches(centers, cells[k], patches, npatch, saved_dsq, f2, inertia);
+            RegionTimer::Item item(timer, k);
+            if (top) {
+                if (top->slack[k] < 0.) top->setCandidates(k, centers, cells[k], saved_dsq);
+                const std::vector<long>& cand = top->cand[k];
+                std::copy(cand.begin(), cand.end(), patches.begin());
+                FindCellsInPatches(centers, cells[k], patches, cand.size(), saved_dsq, f2, 0);
+            } else {
+                FindCellsInPatches(centers, cells[k], patches, npatch, saved_dsq, f2, inertia);
+            }
         }
 
 #ifdef _OPENMP
         // Combine the results
+        timer.startMerge();
 #pragma omp critical
         {
             f.combineWith(f2);
         }
+        timer.finishMerge();
     }
 #endif
 }
@@ -750,6 +819,7 @@ template <int D, int C>
 void KMeansInitTree2(Field<D,C>*field, double* pycenters, int npatch, long long seed)
 {
     dbg<<"Start KMeansInitTree for "<<npatch<<" patches\n";
+    TraceSpan span("KMeansInitTree");
     const std::vector<Cell<D,C>*> cells = field->getCells();
     std::vector<Position<C> > centers(npatch);
     InitializeCentersTree(centers, cells, seed);
@@ -760,6 +830,7 @@ template <int D, int C>
 void KMeansInitRand2(Field<D,C>*field, double* pycenters, int npatch, long long seed)
 {
     dbg<<"Start KMeansInitRand for "<<npatch<<" patches\n";
+    TraceSpan span("KMeansInitRand");
     const std::vector<Cell<D,C>*> cells = field->getCells();
     std::vector<Position<C> > centers(npatch);
     InitializeCentersRand(centers, cells, seed);
@@ -770,6 +841,7 @@ template <int D, int C>
 void KMeansInitKMPP2(Field<D,C>*field, double* pycenters, int npatch, long long seed)
 {
     dbg<<"Start KMeansInitKMPP for "<<npatch<<" patches\n";
+    TraceSpan span("KMeansInitKMPP");
     const std::vector<Cell<D,C>*> cells = field->getCells();
     std::vector<Position<C> > centers(npatch);
     InitializeCentersKMPP(centers, cells, seed);
@@ -803,12 +875,17 @@ void KMeansRun2(Field<D,C>*field, double* pycenters, int npatch, int max_iter, d
     UpdateCenters<D,C> update_centers(npatch);
     xdbg<<"Made update_centers\n";
 
+    // The candidate centers for the top-level cells.  Once the centers stop moving much,
+    // most iterations don't need to check all of them.
+    TopCandidates<D,C> top(cells.size());
+
     for(int iter=0; iter<max_iter; ++iter) {
         xdbg<<"Start iter "<<iter<<std::endl;
+        TraceSpan span("KMeansIteration", iter);
         // Update the inertia if we are doing the alternate version
         if (alt) {
             calculate_inertia.reset();
-            FindCellsInPatches(centers, cells, calculate_inertia);
+            FindCellsInPatches(centers, cells, calculate_inertia, 0, &top);
             calculate_inertia.finalize();
             pinertia = &calculate_inertia.inertia;
         }
@@ -817,12 +894,13 @@ void KMeansRun2(Field<D,C>*field, double* pycenters, int npatch, int max_iter, d
         // Note: clear leaves the previous capacity available, so usually won't need much
         // in the way of allocation here.
         update_centers.reset();
-        FindCellsInPatches(centers, cells, update_centers, pinertia);
+        FindCellsInPatches(centers, cells, update_centers, pinertia, alt ? 0 : &top);
         update_centers.finalize();
         xdbg<<"After UpdateCenters\n";
 
         // Check for convergence
         double shiftsq = CalculateShiftSq(centers, update_centers.new_centers);
+        top.update(centers, update_centers.new_centers);
         centers = update_centers.new_centers;
         xdbg<<"Iter "<<iter<<": shiftsq = "<<shiftsq<<"  tolsq = "<<tolsq<<std::endl;
         // Stop if (rms shift / size) < tol
@@ -838,6 +916,48 @@ void KMeansRun2(Field<D,C>*field, double* pycenters, int npatch, int max_iter, d
     WriteCenters(centers, pycenters, npatch);
 }
 
+// One step of mini-batch k-means, for catalogs too large to build a single field.  This
+// assigns the objects in this field (one chunk of the full catalog) to the current centers
+// and moves each center towards the centroid of the ones assigned to it.  wsum has the total
+// weight assigned to each center in the previous chunks, so each center ends up at the
+// weighted mean of all the objects that were assigned to it along the way.
+template <int D, int C>
+void KMeansUpdateBatch2(Field<D,C>*field, double* pycenters, int npatch, double* wsum,
+                        bool alt)
+{
+    dbg<<"Start KMeansUpdateBatch for "<<npatch<<" patches\n";
+    const std::vector<Cell<D,C>*> cells = field->getCells();
+
+    std::vector<Position<C> > centers(npatch);
+    ReadCenters(centers, pycenters, npatch);
+
+    // For the alt version, use the inertia of the objects in this chunk.
+    CalculateInertia<D,C> calculate_inertia(alt ? npatch : 0, centers);
+    std::vector<double>* pinertia = 0;
+    if (alt) {
+        FindCellsInPatches(centers, cells, calculate_inertia);
+        calculate_inertia.finalize();
+        pinertia = &calculate_inertia.inertia;
+    }
+
+    // Note: update_centers isn't finalized, so new_centers has the weighted sums of the
+    // positions, not the means.
+    UpdateCenters<D,C> update_centers(npatch);
+    FindCellsInPatches(centers, cells, update_centers, pinertia);
+    for (int i=0; i<npatch; ++i) {
+        double w = update_centers.w[i];
+        if (w > 0.) {
+            centers[i] *= wsum[i];
+            centers[i] += update_centers.new_centers[i];
+            centers[i] /= wsum[i] + w;
+            centers[i].normalize();
+            wsum[i] += w;
+        }
+        xdbg<<"New center = "<<centers[i]<<"  wsum = "<<wsum[i]<<std::endl;
+    }
+    WriteCenters(centers, pycenters, npatch);
+}
+
 template <int D, int C>
 void KMeansAssign2(Field<D,C>*field, double* pycenters, int npatch, long* patches, long n)
 {
@@ -980,6 +1100,39 @@ void KMeansRun(void* field, double* centers, int npatch, int max_iter, double to
     }
 }
 
+template <int D>
+void KMeansUpdateBatch1(void* field, double* centers, int npatch, double* wsum, bool alt,
+                        int coords)
+{
+    switch(coords) {
+      case Flat:
+           KMeansUpdateBatch2(static_cast<Field<D,Flat>*>(field), centers, npatch, wsum, alt);
+           break;
+      case Sphere:
+           KMeansUpdateBatch2(static_cast<Field<D,Sphere>*>(field), centers, npatch, wsum, alt);
+           break;
+      case ThreeD:
+           KMeansUpdateBatch2(static_cast<Field<D,ThreeD>*>(field), centers, npatch, wsum, alt);
+           break;
+    }
+}
+
+void KMeansUpdateBatch(void* field, double* centers, int npatch, double* wsum, int alt,
+                       int d, int coords)
+{
+    switch(d) {
+      case NData:
+           KMeansUpdateBatch1<NData>(field, centers, npatch, wsum, bool(alt), coords);
+           break;
+      case KData:
+           KMeansUpdateBatch1<KData>(field, centers, npatch, wsum, bool(alt), coords);
+           break;
+      case GData:
+           KMeansUpdateBatch1<GData>(field, centers, npatch, wsum, bool(alt), coords);
+           break;
+    }
+}
+
 template <int D>
 void KMeansAssign1(void* field, double* centers, int npatch, long* patches, long n, int coords)
 {
@@ -1012,44 +1165,193 @@ void KMeansAssign(void* field, double* centers, int npatch, long* patches, long
     }
 }
 
-void QuickAssign(double* centers, int npatch,
-                 double* x, double* y, double* z, long* patches, long n)
+// A small kd-tree over the patch centers, so QuickAssign doesn't need to check every center
+// for each object.  N is the number of coordinates (2 or 3).  The distances are calculated the
+// same way as the direct loop over the centers, and ties go to the lower index, so the results
+// are the same.
+template <int N>
+class CenterTree
 {
-    if (z) {
-#ifdef _OPENMP
-#pragma omp parallel for schedule(static)
-#endif
-        for (int i=0; i<n; ++i) {
-            int kmin = 0;
-            double min_rsq = SQR(x[i]-centers[0]) + SQR(y[i]-centers[1]) + SQR(z[i]-centers[2]);
-            for (int k=1; k<npatch; ++k) {
-                double rsq = SQR(x[i]-centers[3*k]) + SQR(y[i]-centers[3*k+1]) + SQR(z[i]-centers[3*k+2]);
-                if (rsq < min_rsq) {
-                    kmin = k;
-                    min_rsq = rsq;
+public:
+    CenterTree(const double* centers, int npatch) :
+        _centers(centers), _index(npatch), _pos(N*npatch)
+    {
+        for (int k=0; k<npatch; ++k) _index[k] = k;
+        _nodes.reserve(2*(npatch/LEAF_SIZE+1));
+        build(0, npatch);
+        // Copy the centers in the order of the tree, so each leaf's are contiguous.
+        for (int j=0; j<npatch; ++j)
+            for (int d=0; d<N; ++d) _pos[N*j+d] = centers[N*_index[j]+d];
+    }
+
+    // The index of the center closest to p.
+    int nearest(const double* p) const
+    {
+        int kmin = _index[0];
+        double min_rsq = dsq(p, 0);
+        int stack[MAX_DEPTH];
+        int nstack = 0;
+        stack[nstack++] = 0;
+        while (nstack) {
+            const Node& node = _nodes[stack[--nstack]];
+            if (boxDsq(p, node) > min_rsq) continue;
+            if (node.left < 0) {
+                for (int j=node.start; j<node.end; ++j) {
+                    double rsq = dsq(p, j);
+                    if (rsq < min_rsq || (rsq == min_rsq && _index[j] < kmin)) {
+                        kmin = _index[j];
+                        min_rsq = rsq;
+                    }
                 }
+            } else {
+                pushChildren(p, node, stack, nstack);
+            }
+        }
+        return kmin;
+    }
+
+private:
+    static const int LEAF_SIZE = 32;
+    static const int MAX_DEPTH = 64;
+
+    // A node covers _index[start:end], with bounding box lo..hi.  split is the dimension
+    // its parent split on.  Leaves have left = right = -1.
+    struct Node
+    {
+        double lo[N], hi[N];
+        int start, end, split;
+        int left, right;
+    };
+
+    // The distance to the j-th center in the order of the tree.
+    double dsq(const double* p, int j) const
+    {
+        double rsq = SQR(p[0]-_pos[N*j]) + SQR(p[1]-_pos[N*j+1]);
+        if (N == 3) rsq += SQR(p[2]-_pos[N*j+2]);
+        return rsq;
+    }
+
+    // Push the farther child first, so the nearer one is checked first.
+    void pushChildren(const double* p, const Node& node, int* stack, int& nstack) const
+    {
+        const Node& left = _nodes[node.left];
+        bool left_near = p[left.split] < left.hi[left.split];
+        stack[nstack++] = left_near ? node.right : node.left;
+        stack[nstack++] = left_near ? node.left : node.right;
+    }
+
+    double boxDsq(const double* p, const Node& node) const
+    {
+        double rsq = 0.;
+        for (int d=0; d<N; ++d) {
+            if (p[d] < node.lo[d]) rsq += SQR(node.lo[d] - p[d]);
+            else if (p[d] > node.hi[d]) rsq += SQR(p[d] - node.hi[d]);
+        }
+        return rsq;
+    }
+
+    struct LessInDim
+    {
+        LessInDim(const double* pos, int d) : _pos(pos), _d(d) {}
+        bool operator()(int k1, int k2) const { return _pos[N*k1+_d] < _pos[N*k2+_d]; }
+        const double* _pos;
+        int _d;
+    };
+
+    int build(int start, int end, int split=0)
+    {
+        int inode = _nodes.size();
+        _nodes.push_back(Node());
+        Node node;
+        node.start = start;
+        node.end = end;
+        node.split = split;
+        node.left = node.right = -1;
+        for (int d=0; d<N; ++d) {
+            node.lo[d] = node.hi[d] = _centers[N*_index[start]+d];
+            for (int j=start+1; j<end; ++j) {
+                double x = _centers[N*_index[j]+d];
+                if (x < node.lo[d]) node.lo[d] = x;
+                if (x > node.hi[d]) node.hi[d] = x;
             }
-            patches[i] = kmin;
+        }
+        if (end - start > LEAF_SIZE) {
+            // Split at the median of the widest dimension.
+            int dsplit = 0;
+            for (int d=1; d<N; ++d)
+                if (node.hi[d]-node.lo[d] > node.hi[dsplit]-node.lo[dsplit]) dsplit = d;
+            int mid = (start + end) / 2;
+            std::nth_element(_index.begin()+start, _index.begin()+mid, _index.begin()+end,
+                             LessInDim(_centers, dsplit));
+            node.left = build(start, mid, dsplit);
+            node.right = build(mid, end, dsplit);
+        }
+        _nodes[inode] = node;
+        return inode;
+    }
+
+    const double* _centers;
+    std::vector<int> _index;
+    std::vector<double> _pos;
+    std::vector<Node> _nodes;
+};
+
+// Assign objects i1..i2 to the nearest center, searching tree if it is given, else checking
+// all of the centers.
+template <int N>
+void AssignRange(const CenterTree<N>* tree, const double* centers, int npatch,
+                 const double* x, const double* y, const double* z, long* patches,
+                 long i1, long i2)
+{
+    if (tree) {
+        for (long i=i1; i<i2; ++i) {
+            double p[3] = { x[i], y[i], N == 3 ? z[i] : 0. };
+            patches[i] = tree->nearest(p);
         }
     } else {
+        if (N == 3)
+            NearestCenter3(centers, npatch, x, y, z, patches, i1, i2);
+        else
+            NearestCenter2(centers, npatch, x, y, patches, i1, i2);
+    }
+}
+
+// With more than a few tens of centers, it is faster to search a kd-tree of them than to
+// check all of them for each object.  Returns 0 if the direct loop is better.
+template <int N>
+CenterTree<N>* MakeCenterTree(const double* centers, int npatch)
+{
+    return npatch >= 100 ? new CenterTree<N>(centers, npatch) : 0;
+}
+
+// The number of objects GenerateXYZ and QuickAssign work on at a time.  Small enough that the
+// block's ra, dec, x, y, z stay in L1 cache between the separate passes over it.
+const long XYZ_BLOCK_SIZE = 512;
+
+template <int N>
+void QuickAssign1(double* centers, int npatch,
+                  double* x, double* y, double* z, long* patches, long n)
+{
+    TraceSpan span("QuickAssign", n);
+    CenterTree<N>* tree = MakeCenterTree<N>(centers, npatch);
 #ifdef _OPENMP
 #pragma omp parallel for schedule(static)
 #endif
-        for (int i=0; i<n; ++i) {
-            int kmin = 0;
-            double min_rsq = SQR(x[i]-centers[0]) + SQR(y[i]-centers[1]);
-            for (int k=1; k<npatch; ++k) {
-                double rsq = SQR(x[i]-centers[2*k]) + SQR(y[i]-centers[2*k+1]);
-                if (rsq < min_rsq) {
-                    kmin = k;
-                    min_rsq = rsq;
-                }
-            }
-            patches[i] = kmin;
-        }
+    for (long i1=0; i1<n; i1+=XYZ_BLOCK_SIZE) {
+        long i2 = std::min(i1 + XYZ_BLOCK_SIZE, n);
+        AssignRange<N>(tree, centers, npatch, x, y, z, patches, i1, i2);
     }
+    delete tree;
 }
 
+void QuickAssign(double* centers, int npatch,
+                 double* x, double* y, double* z, long* patches, long n)
+{
+    if (z)
+        QuickAssign1<3>(centers, npatch, x, y, z, patches, n);
+    else
+        QuickAssign1<2>(centers, npatch, x, y, z, patches, n);
+}
 
 void SelectPatch(int patch, double* centers, int npatch, double* x, double* y, double* z,
                  long* use, long n)
@@ -1065,7 +1367,7 @@ void SelectPatch(int patch, double* centers, int npatch, double* x, double* y, d
 #ifdef _OPENMP
 #pragma omp parallel for schedule(static)
 #endif
-        for (int i=0; i<n; ++i) {
+        for (long i=0; i<n; ++i) {
             double p_dsq = SQR(x[i]-px) + SQR(y[i]-py) + SQR(z[i]-pz);
             use[i] = 1;
             for (int q=0; q<npatch; ++q) {
@@ -1087,7 +1389,7 @@ void SelectPatch(int patch, double* centers, int npatch, double* x, double* y, d
 #ifdef _OPENMP
 #pragma omp parallel for schedule(static)
 #endif
-        for (int i=0; i<n; ++i) {
+        for (long i=0; i<n; ++i) {
             double p_dsq = SQR(x[i]-px) + SQR(y[i]-py);
             use[i] = 1;
             for (int q=0; q<npatch; ++q) {
@@ -1104,31 +1406,31 @@ void SelectPatch(int patch, double* centers, int npatch, double* x, double* y, d
     }
 }
 
-void GenerateXYZ(double* x, double* y, double* z, double* ra, double* dec, double* r, long n)
+void GenerateXYZPatches(double* x, double* y, double* z, double* ra, double* dec, double* r,
+                        long n, double ra_units, double dec_units,
+                        double* centers, int npatch, long* patches)
 {
+    TraceSpan span("GenerateXYZ", n);
+    // Do everything one block at a time, so each pass over a block finds it still in cache,
+    // rather than streaming the full arrays through memory once for each step.
+    CenterTree<3>* tree = patches ? MakeCenterTree<3>(centers, npatch) : 0;
 #ifdef _OPENMP
 #pragma omp parallel for schedule(static)
 #endif
-    for (int i=0; i<n; ++i) {
-        double sr, cr, sd, cd;
-#ifdef _GLIBCXX_HAVE_SINCOS
-        ::sincos(ra[i],&sr,&cr);
-        ::sincos(dec[i],&sd,&cd);
-#else
-        // If the native sincos function isn't available, then most compilers will still optimize
-        // these into a single trig call for each.
-        sr = std::sin(ra[i]);
-        cr = std::cos(ra[i]);
-        sd = std::sin(dec[i]);
-        cd = std::cos(dec[i]);
-#endif
-        x[i] = cd * cr;
-        y[i] = cd * sr;
-        z[i] = sd;
-        if (r) {
-            x[i] *= r[i];
-            y[i] *= r[i];
-            z[i] *= r[i];
-        }
+    for (long i1=0; i1<n; i1+=XYZ_BLOCK_SIZE) {
+        long i2 = std::min(i1 + XYZ_BLOCK_SIZE, n);
+        if (ra_units != 1.)
+            for (long i=i1; i<i2; ++i) ra[i] *= ra_units;
+        if (dec_units != 1.)
+            for (long i=i1; i<i2; ++i) dec[i] *= dec_units;
+        RaDecToXYZ(x, y, z, ra, dec, r, i1, i2);
+        if (patches)
+            AssignRange<3>(tree, centers, npatch, x, y, z, patches, i1, i2);
     }
+    delete tree;
+}
+
+void GenerateXYZ(double* x, double* y, double* z, double* ra, double* dec, double* r, long n)
+{
+    GenerateXYZPatches(x, y, z, ra, dec, r, n, 1., 1., 0, 0, 0);
 }
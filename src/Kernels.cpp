@@ -0,0 +1,200 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+//#define DEBUGLOGGING
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "Kernels.h"
+#include "Position.h"
+#include "dbg.h"
+
+// The versions for each instruction set are made with the target attribute of gcc and clang,
+// which only exists for x86.  Each one just calls the Impl function, which is always inlined,
+// so its loops get compiled (and vectorized) for that target.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TREECORR_ISA_DISPATCH
+#define KERNEL_INLINE inline __attribute__((always_inline))
+#else
+#define KERNEL_INLINE inline
+#endif
+
+const char* ISAName(ISA isa)
+{
+    static const char* names[NISA] = { "default", "sse4.2", "avx2", "avx512" };
+    return names[isa];
+}
+
+static ISA BestISA()
+{
+#ifdef TREECORR_ISA_DISPATCH
+    // This runs before main (or while loading the library), so cpuid might not have been
+    // checked yet.
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+        return ISAAVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return ISAAVX2;
+    if (__builtin_cpu_supports("sse4.2"))
+        return ISASSE42;
+#endif
+    return ISADefault;
+}
+
+static ISA ChooseISA()
+{
+    // TREECORR_ISA can only lower the choice.  Anything else it might be set to is ignored.
+    ISA isa = BestISA();
+    const char* env = std::getenv("TREECORR_ISA");
+    if (env) {
+        for (int i=0; i<isa; ++i) {
+            if (std::strcmp(env, ISAName(ISA(i))) == 0) isa = ISA(i);
+        }
+    }
+    return isa;
+}
+
+static const ISA selected_isa = ChooseISA();
+
+ISA SelectedISA()
+{ return selected_isa; }
+
+#ifdef TREECORR_ISA_DISPATCH
+#define DEFINE_ISA_VARIANTS(name, params, args) \
+    static void name##Default params \
+    { name##Impl args; } \
+    static __attribute__((target("sse4.2"))) void name##SSE42 params \
+    { name##Impl args; } \
+    static __attribute__((target("avx2,fma"))) void name##AVX2 params \
+    { name##Impl args; } \
+    static __attribute__((target("avx512f,avx512dq,avx2,fma"))) void name##AVX512 params \
+    { name##Impl args; } \
+    void name params \
+    { \
+        switch (selected_isa) { \
+          case ISAAVX512: name##AVX512 args; break; \
+          case ISAAVX2: name##AVX2 args; break; \
+          case ISASSE42: name##SSE42 args; break; \
+          default: name##Default args; \
+        } \
+    }
+#else
+#define DEFINE_ISA_VARIANTS(name, params, args) \
+    void name params \
+    { name##Impl args; }
+#endif
+
+static KERNEL_INLINE void SqrtLogBlockImpl(const double* rsq, double* r, double* logr, long n)
+{
+    for (long i=0; i<n; ++i) r[i] = std::sqrt(rsq[i]);
+    for (long i=0; i<n; ++i) logr[i] = std::log(r[i]);
+}
+DEFINE_ISA_VARIANTS(SqrtLogBlock,
+                    (const double* rsq, double* r, double* logr, long n),
+                    (rsq, r, logr, n))
+
+static KERNEL_INLINE void LogBlockImpl(const double* x, double* logx, long n)
+{
+    for (long i=0; i<n; ++i) logx[i] = std::log(x[i]);
+}
+DEFINE_ISA_VARIANTS(LogBlock,
+                    (const double* x, double* logx, long n),
+                    (x, logx, n))
+
+// These are written as simple loops with separate sin and cos calls (rather than sincos, which
+// doesn't vectorize), so the compiler can use the vector versions of the trig functions.
+static KERNEL_INLINE void RaDecToXYZImpl(double* x, double* y, double* z,
+                                         const double* ra, const double* dec, const double* r,
+                                         long i1, long i2)
+{
+    for (long i=i1; i<i2; ++i) {
+        double cd = std::cos(dec[i]);
+        x[i] = cd * std::cos(ra[i]);
+        y[i] = cd * std::sin(ra[i]);
+        z[i] = std::sin(dec[i]);
+    }
+    if (r) {
+        for (long i=i1; i<i2; ++i) {
+            x[i] *= r[i];
+            y[i] *= r[i];
+            z[i] *= r[i];
+        }
+    }
+}
+DEFINE_ISA_VARIANTS(RaDecToXYZ,
+                    (double* x, double* y, double* z, const double* ra, const double* dec,
+                     const double* r, long i1, long i2),
+                    (x, y, z, ra, dec, r, i1, i2))
+
+template <int N>
+static KERNEL_INLINE void NearestCenterImpl(const double* centers, int npatch,
+                                            const double* x, const double* y, const double* z,
+                                            long* patches, long i1, long i2)
+{
+    for (long i=i1; i<i2; ++i) {
+        int kmin = 0;
+        double min_rsq = SQR(x[i]-centers[0]) + SQR(y[i]-centers[1]);
+        if (N == 3) min_rsq += SQR(z[i]-centers[2]);
+        for (int k=1; k<npatch; ++k) {
+            double rsq = SQR(x[i]-centers[N*k]) + SQR(y[i]-centers[N*k+1]);
+            if (N == 3) rsq += SQR(z[i]-centers[N*k+2]);
+            if (rsq < min_rsq) {
+                kmin = k;
+                min_rsq = rsq;
+            }
+        }
+        patches[i] = kmin;
+    }
+}
+
+static KERNEL_INLINE void NearestCenter2Impl(const double* centers, int npatch,
+                                             const double* x, const double* y,
+                                             long* patches, long i1, long i2)
+{ NearestCenterImpl<2>(centers, npatch, x, y, 0, patches, i1, i2); }
+DEFINE_ISA_VARIANTS(NearestCenter2,
+                    (const double* centers, int npatch, const double* x, const double* y,
+                     long* patches, long i1, long i2),
+                    (centers, npatch, x, y, patches, i1, i2))
+
+static KERNEL_INLINE void NearestCenter3Impl(const double* centers, int npatch,
+                                             const double* x, const double* y, const double* z,
+                                             long* patches, long i1, long i2)
+{ NearestCenterImpl<3>(centers, npatch, x, y, z, patches, i1, i2); }
+DEFINE_ISA_VARIANTS(NearestCenter3,
+                    (const double* centers, int npatch, const double* x, const double* y,
+                     const double* z, long* patches, long i1, long i2),
+                    (centers, npatch, x, y, z, patches, i1, i2))
+
+//
+//
+// Now the C-C++ interface functions that get used in python:
+//
+//
+
+extern "C" {
+
+#ifdef _WIN32
+#define extern __declspec(dllexport)
+#endif
+
+#include "Kernels_C.h"
+}
+
+const char* GetISA()
+{
+    dbg<<"Start GetISA: "<<ISAName(selected_isa)<<std::endl;
+    return ISAName(selected_isa);
+}
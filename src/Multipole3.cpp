@@ -0,0 +1,458 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+//#define DEBUGLOGGING
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "dbg.h"
+#include "Multipole3.h"
+#include "WorkStack.h"
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
+
+// The number of bins in the opening angle used when converting the multipoles to (r,u,v)
+// bins is at least this many, and at least PHI_BINS_PER_N * maxn.
+const int MIN_PHI_BINS = 360;
+const int PHI_BINS_PER_N = 8;
+
+// The number of points used to spread each pair of radial bins over the range of u that
+// the triangles with those two sides can have.
+const int U_POINTS = 8;
+
+Multipole3::Multipole3(double minsep, double maxsep, int nbins, double binsize, double b,
+                       double minu, double maxu, int nubins, double ubinsize,
+                       double minv, double maxv, int nvbins, double vbinsize,
+                       int maxn, int nsub, bool weighted) :
+    _minsep(minsep), _maxsep(maxsep), _nbins(nbins), _binsize(binsize), _bsq(b*b),
+    _minu(minu), _maxu(maxu), _nubins(nubins), _ubinsize(ubinsize),
+    _minv(minv), _maxv(maxv), _nvbins(nvbins), _vbinsize(vbinsize),
+    _maxn(maxn), _nsub(nsub), _weighted(weighted)
+{
+    dbg<<"Start Multipole3: maxn = "<<maxn<<", nsub = "<<nsub<<std::endl;
+    _nn = _maxn + 1;
+    _maxsepsq = SQR(_maxsep);
+
+    // The radial bins are nsub times finer than the r bins (or the u bins if those are
+    // smaller), and the ones with r >= minsep line up with the r bins.  They continue below
+    // minsep to minu * minsep for the shortest side.  If minu == 0, they go down to where
+    // every triangle would be in the first u bin, and an inner bin (bin 0) collects all the
+    // neighbors closer than that.
+    _logrbinsize = std::min(_binsize, _ubinsize) / _nsub;
+    _nsubr = int(std::ceil(_binsize / _logrbinsize - 1.e-8));
+    _logrbinsize = _binsize / _nsubr;
+    const double minr = _minu > 0. ? _minu * _minsep : _minsep * _ubinsize / _nsub;
+    const int nlow = int(std::ceil(std::log(_minsep / minr) / _logrbinsize - 1.e-8));
+    _logminr = std::log(_minsep) - nlow * _logrbinsize;
+    _minrsq = std::exp(2.*_logminr);
+    _ninner = _minu > 0. ? 0 : 1;
+    _nr0 = _ninner + nlow;
+    _nr = _nr0 + _nbins * _nsubr;
+    dbg<<"nr = "<<_nr<<", nr0 = "<<_nr0<<", minr = "<<std::exp(_logminr)<<std::endl;
+
+    _rc.resize(_nr);
+    if (_ninner) _rc[0] = 0.5 * std::exp(_logminr);
+    for (int k=_ninner; k<_nr; ++k)
+        _rc[k] = std::exp(_logminr + (k - _ninner + 0.5) * _logrbinsize);
+
+    _gw.resize(pairIndex(_nr, 0));
+    if (_weighted) _gn.resize(pairIndex(_nr, 0));
+    _selfw.resize(_nr);
+    if (_weighted) _selfn.resize(_nr);
+
+    _ww.resize(_nr * _nn);
+    if (_weighted) _wn.resize(_nr * _nn);
+    _s2w.resize(_nr);
+    _s2n.resize(_nr);
+    _isused.resize(_nr);
+}
+
+Multipole3::Multipole3(const Multipole3& rhs, bool copy_data) :
+    _minsep(rhs._minsep), _maxsep(rhs._maxsep), _nbins(rhs._nbins), _binsize(rhs._binsize),
+    _bsq(rhs._bsq), _minu(rhs._minu), _maxu(rhs._maxu), _nubins(rhs._nubins),
+    _ubinsize(rhs._ubinsize), _minv(rhs._minv), _maxv(rhs._maxv), _nvbins(rhs._nvbins),
+    _vbinsize(rhs._vbinsize), _maxn(rhs._maxn), _nsub(rhs._nsub), _weighted(rhs._weighted),
+    _nn(rhs._nn), _logrbinsize(rhs._logrbinsize), _nsubr(rhs._nsubr),
+    _logminr(rhs._logminr), _minrsq(rhs._minrsq), _maxsepsq(rhs._maxsepsq),
+    _ninner(rhs._ninner), _nr0(rhs._nr0), _nr(rhs._nr), _rc(rhs._rc),
+    _gw(rhs._gw.size()), _gn(rhs._gn.size()), _selfw(rhs._selfw.size()),
+    _selfn(rhs._selfn.size()),
+    _ww(rhs._ww.size()), _wn(rhs._wn.size()), _s2w(rhs._s2w.size()), _s2n(rhs._s2n.size()),
+    _isused(rhs._isused.size())
+{
+    if (copy_data) *this += rhs;
+}
+
+void Multipole3::operator+=(const Multipole3& rhs)
+{
+    Assert(rhs._gw.size() == _gw.size());
+    for (size_t i=0; i<_gw.size(); ++i) _gw[i] += rhs._gw[i];
+    for (size_t i=0; i<_gn.size(); ++i) _gn[i] += rhs._gn[i];
+    for (size_t i=0; i<_selfw.size(); ++i) _selfw[i] += rhs._selfw[i];
+    for (size_t i=0; i<_selfn.size(); ++i) _selfn[i] += rhs._selfn[i];
+}
+
+int Multipole3::radialBin(double rsq) const
+{
+    if (rsq >= _maxsepsq) return -1;
+    if (rsq < _minrsq) return _ninner - 1;  // The inner bin if there is one, else -1.
+    int k = _ninner + int(std::floor((0.5*std::log(rsq) - _logminr) / _logrbinsize));
+    // Rounding can put these just outside the range.
+    if (k < _ninner) k = _ninner;
+    if (k >= _nr) k = _nr - 1;
+    return k;
+}
+
+void Multipole3::rangeU(int ka, int kb, double& umin, double& umax) const
+{
+    Assert(kb <= ka);
+    if (kb < _ninner) {
+        umin = 0.;
+        umax = std::exp(-(ka - _ninner) * _logrbinsize);
+    } else {
+        umin = std::exp(-(ka - kb + 1) * _logrbinsize);
+        umax = std::min(1., std::exp(-(ka - kb - 1) * _logrbinsize));
+    }
+}
+
+void Multipole3::collect(const Cell<NData,Flat>* c, const Cell<NData,Flat>* vertex)
+{
+    const Position<Flat>& p1 = vertex->getPos();
+    const double minr = std::sqrt(_minrsq);
+    WorkStack<const Cell<NData,Flat>*> todo;
+    todo.push(c);
+    while (!todo.empty()) {
+        c = todo.pop();
+        if (c == vertex) continue;
+        const Position<Flat>& p = c->getPos();
+        const double dx = p.getX() - p1.getX();
+        const double dy = p.getY() - p1.getY();
+        const double rsq = dx*dx + dy*dy;
+        const double s = c->getSize();
+
+        // Skip cells that are entirely too far away, or (if there is no inner bin) too close.
+        if (rsq >= SQR(_maxsep + s)) continue;
+        if (!_ninner && s < minr && rsq < SQR(minr - s)) continue;
+
+        // Split the cell if it is too large to treat as a single neighbor.
+        if (c->getLeft() && s*s > _bsq * rsq) {
+            todo.push(c->getRight());
+            todo.push(c->getLeft());
+            continue;
+        }
+
+        // Coincident points only make degenerate triangles, which we skip.
+        if (rsq == 0.) continue;
+        const int k = radialBin(rsq);
+        if (k < 0) continue;
+
+        // z = exp(-i phi)
+        const double r = std::sqrt(rsq);
+        const std::complex<double> z(dx/r, -dy/r);
+        const double w = c->getW();
+        const double n = c->getN();
+        std::complex<double>* ww = &_ww[k*_nn];
+        std::complex<double> zn = 1.;
+        if (_weighted) {
+            std::complex<double>* wn = &_wn[k*_nn];
+            for (int m=0; m<_nn; ++m) {
+                ww[m] += w * zn;
+                wn[m] += n * zn;
+                zn *= z;
+            }
+        } else {
+            for (int m=0; m<_nn; ++m) {
+                ww[m] += w * zn;
+                zn *= z;
+            }
+        }
+        _s2w[k] += w*w;
+        _s2n[k] += n*n;
+        if (!_isused[k]) {
+            _isused[k] = true;
+            _used.push_back(k);
+        }
+    }
+}
+
+void Multipole3::finishVertex(double w, double n)
+{
+    const int nused = int(_used.size());
+    for (int i=0; i<nused; ++i) {
+        const int ka = _used[i];
+        if (ka < _nr0) continue;  // Too close to be d2.
+        for (int j=0; j<nused; ++j) {
+            const int kb = _used[j];
+            if (kb > ka) continue;
+            double umin, umax;
+            rangeU(ka, kb, umin, umax);
+            if (umax <= _minu || umin >= _maxu) continue;
+
+            const long index = pairIndex(ka, kb);
+            const std::complex<double>* wa = &_ww[ka*_nn];
+            const std::complex<double>* wb = &_ww[kb*_nn];
+            std::complex<double>* gw = &_gw[index];
+            for (int m=0; m<_nn; ++m) gw[m] += w * wa[m] * std::conj(wb[m]);
+            if (ka == kb) _selfw[ka] += w * _s2w[ka];
+            if (_weighted) {
+                const std::complex<double>* na = &_wn[ka*_nn];
+                const std::complex<double>* nb = &_wn[kb*_nn];
+                std::complex<double>* gn = &_gn[index];
+                for (int m=0; m<_nn; ++m) gn[m] += n * na[m] * std::conj(nb[m]);
+                if (ka == kb) _selfn[ka] += n * _s2n[ka];
+            }
+        }
+    }
+
+    // Reset the radial bins that were used for the next vertex.
+    for (int i=0; i<nused; ++i) {
+        const int k = _used[i];
+        for (int m=0; m<_nn; ++m) _ww[k*_nn + m] = 0.;
+        if (_weighted) for (int m=0; m<_nn; ++m) _wn[k*_nn + m] = 0.;
+        _s2w[k] = 0.;
+        _s2n[k] = 0.;
+        _isused[k] = false;
+    }
+    _used.clear();
+}
+
+void Multipole3::process(const Field<NData,Flat>& field, bool dots)
+{
+    const std::vector<Cell<NData,Flat>*>& cells = field.getCells();
+    const long n1 = long(cells.size());
+
+    // Each leaf of the trees is a vertex.
+    std::vector<const Cell<NData,Flat>*> leaves;
+    for (long i=0; i<n1; ++i) {
+        std::vector<const Cell<NData,Flat>*> leaves_i = cells[i]->getAllLeaves();
+        leaves.insert(leaves.end(), leaves_i.begin(), leaves_i.end());
+    }
+    const long nleaves = long(leaves.size());
+    dbg<<"Multipole3::process: "<<nleaves<<" vertices\n";
+
+#ifdef _OPENMP
+#pragma omp parallel
+    {
+        // Give each thread their own copy of the products to fill in.
+        Multipole3 mp(*this, false);
+#else
+        Multipole3& mp = *this;
+#endif
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+        for (long i=0; i<nleaves; ++i) {
+            if (dots && i % 1000 == 0) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+                std::cout<<'.'<<std::flush;
+            }
+            const Cell<NData,Flat>* vertex = leaves[i];
+            for (long j=0; j<n1; ++j) mp.collect(cells[j], vertex);
+            mp.finishVertex(vertex->getW(), vertex->getN());
+        }
+#ifdef _OPENMP
+        // Accumulate the results
+#pragma omp critical
+        {
+            *this += mp;
+        }
+    }
+#endif
+    if (dots) std::cout<<std::endl;
+}
+
+void Multipole3::toBins(double* meand1, double* meanlogd1, double* meand2, double* meanlogd2,
+                        double* meand3, double* meanlogd3, double* meanu, double* meanv,
+                        double* weight, double* ntri) const
+{
+    // The integral of exp(i n phi) over each phi bin, divided by 2pi.  With these, the
+    // number of triangles with the opening angle in bin k is
+    //     Sum_n G(n) E_k(n) = Re(G(0) E_k(0) + 2 Sum_n>0 G(n) E_k(n)),
+    // since G(-n) = G(n)^*.
+    const int nphi = std::max(MIN_PHI_BINS, PHI_BINS_PER_N * _maxn);
+    const double dphi = 2.*M_PI / nphi;
+    std::vector<std::complex<double> > ek(nphi * _nn);
+    for (int k=0; k<nphi; ++k) {
+        const double phi0 = -M_PI + k * dphi;
+        const double phi1 = phi0 + dphi;
+        ek[k*_nn] = dphi / (2.*M_PI);
+        for (int m=1; m<_nn; ++m) {
+            const std::complex<double> e0 = std::polar(1., m*phi0);
+            const std::complex<double> e1 = std::polar(1., m*phi1);
+            ek[k*_nn + m] = 2. * (e1 - e0) / (std::complex<double>(0.,m) * 2.*M_PI);
+        }
+    }
+
+    const int nvbins2 = 2 * _nvbins;
+    const int nuv = _nubins * nvbins2;
+    const std::vector<std::complex<double> >& gn = _weighted ? _gn : _gw;
+    const std::vector<double>& selfn = _weighted ? _selfn : _selfw;
+    std::vector<double> wphi(nphi);
+    std::vector<double> nphi_k(nphi);
+    std::vector<double> uq(U_POINTS);
+    std::vector<double> fq(U_POINTS);
+    for (int ka=_nr0; ka<_nr; ++ka) {
+        const double d2 = _rc[ka];
+        const double logd2 = std::log(d2);
+        const int kr = (ka - _nr0) / _nsubr;
+        for (int kb=0; kb<=ka; ++kb) {
+            double umin, umax;
+            rangeU(ka, kb, umin, umax);
+            if (umax <= _minu || umin >= _maxu) continue;
+
+            // The weight and count of the triangles in each phi bin.  phi is the angle from
+            // point 2 (at d3) to point 3 (at d2) around point 1.
+            // For two neighbors in the same radial bin, each pair is in the products twice,
+            // once each way around.  Since we don't know which one is farther, count each
+            // way as half a triangle.
+            const double f = ka == kb ? 0.5 : 1.;
+            const double sw = ka == kb ? _selfw[ka] : 0.;
+            const double sn = ka == kb ? selfn[ka] : 0.;
+            const long index = pairIndex(ka, kb);
+            for (int k=0; k<nphi; ++k) {
+                double www = 0.;
+                double nnn = 0.;
+                for (int m=0; m<_nn; ++m) {
+                    www += std::real((_gw[index+m] - sw) * ek[k*_nn+m]);
+                    nnn += std::real((gn[index+m] - sn) * ek[k*_nn+m]);
+                }
+                wphi[k] = f * www;
+                nphi_k[k] = f * nnn;
+            }
+
+            // Spread the triangles over the values of u they can have.  With both sides
+            // uniform in log(r) within their bins, t = log(d2/d3) / logrbinsize has a
+            // triangular distribution centered at ka-kb (or from 0 to 1 if ka == kb).
+            int nq;
+            if (kb < _ninner) {
+                nq = 1;
+                uq[0] = _rc[kb] / d2;
+                fq[0] = 1.;
+            } else {
+                nq = U_POINTS;
+                double sumf = 0.;
+                for (int q=0; q<nq; ++q) {
+                    double t;
+                    if (ka == kb) {
+                        t = (q + 0.5) / nq;
+                        fq[q] = 1. - t;
+                    } else {
+                        const double s = -1. + 2. * (q + 0.5) / nq;
+                        t = ka - kb + s;
+                        fq[q] = 1. - std::abs(s);
+                    }
+                    uq[q] = std::exp(-t * _logrbinsize);
+                    sumf += fq[q];
+                }
+                for (int q=0; q<nq; ++q) fq[q] /= sumf;
+            }
+
+            for (int q=0; q<nq; ++q) {
+                const double u = uq[q];
+                if (u < _minu || u >= _maxu) continue;
+                int ku = int(std::floor((u-_minu)/_ubinsize));
+                if (ku >= _nubins) ku = _nubins-1;
+                const double d3 = u * d2;
+                const double logd3 = std::log(d3);
+                for (int k=0; k<nphi; ++k) {
+                    const double phi = -M_PI + (k + 0.5) * dphi;
+                    const double d1sq = d2*d2 + d3*d3 - 2.*d2*d3*std::cos(phi);
+                    // Point 1 has to be the vertex opposite the longest side.
+                    if (d1sq < d2*d2) continue;
+                    const double d1 = std::sqrt(d1sq);
+                    double v = (d1-d2)/d3;
+                    if (v < _minv || v >= _maxv) continue;
+                    int kv = int(std::floor((v-_minv)/_vbinsize));
+                    if (kv >= _nvbins) kv = _nvbins-1;
+                    if (phi < 0.) {
+                        v = -v;
+                        kv = _nvbins - kv - 1;
+                    } else {
+                        kv += _nvbins;
+                    }
+                    const int ibin = kr * nuv + ku * nvbins2 + kv;
+
+                    const double www = fq[q] * wphi[k];
+                    ntri[ibin] += fq[q] * nphi_k[k];
+                    meand1[ibin] += www * d1;
+                    meanlogd1[ibin] += www * std::log(d1);
+                    meand2[ibin] += www * d2;
+                    meanlogd2[ibin] += www * logd2;
+                    meand3[ibin] += www * d3;
+                    meanlogd3[ibin] += www * logd3;
+                    meanu[ibin] += www * u;
+                    meanv[ibin] += www * v;
+                    weight[ibin] += www;
+                }
+            }
+        }
+    }
+}
+
+//
+//
+// Now the C-C++ interface functions that get used in python:
+//
+//
+
+extern "C" {
+
+#ifdef _WIN32
+#define extern __declspec(dllexport)
+#endif
+
+#include "Multipole3_C.h"
+}
+
+void* BuildMultipole3(double minsep, double maxsep, int nbins, double binsize, double b,
+                      double minu, double maxu, int nubins, double ubinsize,
+                      double minv, double maxv, int nvbins, double vbinsize,
+                      int maxn, int nsub, int weighted)
+{
+    dbg<<"Start BuildMultipole3\n";
+    return static_cast<void*>(new Multipole3(minsep, maxsep, nbins, binsize, b,
+                                             minu, maxu, nubins, ubinsize,
+                                             minv, maxv, nvbins, vbinsize,
+                                             maxn, nsub, bool(weighted)));
+}
+
+void DestroyMultipole3(void* mp)
+{
+    dbg<<"Start DestroyMultipole3\n";
+    delete static_cast<Multipole3*>(mp);
+}
+
+void ProcessMultipole3(void* mp, void* field, int dots, int coords)
+{
+    dbg<<"Start ProcessMultipole3 "<<coords<<std::endl;
+    Assert(coords == Flat);
+    static_cast<Multipole3*>(mp)->process(*static_cast<Field<NData,Flat>*>(field), dots);
+}
+
+void Multipole3ToBins(void* mp,
+                      double* meand1, double* meanlogd1, double* meand2, double* meanlogd2,
+                      double* meand3, double* meanlogd3, double* meanu, double* meanv,
+                      double* weight, double* ntri)
+{
+    dbg<<"Start Multipole3ToBins\n";
+    static_cast<Multipole3*>(mp)->toBins(meand1, meanlogd1, meand2, meanlogd2,
+                                         meand3, meanlogd3, meanu, meanv, weight, ntri);
+}
@@ -0,0 +1,163 @@
+/* Copyright (c) 2003-2019 by Mike Jarvis
+ *
+ * TreeCorr is free software: redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions, and the disclaimer given in the accompanying LICENSE
+ *    file.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the disclaimer given in the documentation
+ *    and/or other materials provided with the distribution.
+ */
+
+//#define DEBUGLOGGING
+
+#include <algorithm>
+#include <atomic>
+
+#include "ThreadTimes.h"
+#include "dbg.h"
+
+// The times recorded since SetThreadTimes turned them on.  The parallel loops may themselves
+// be running on several threads (e.g. for the pairs of patches), so adding to the list is
+// in a critical section.
+static bool thread_times_on = false;
+static std::vector<RegionTimes> thread_times;
+
+bool ThreadTimesEnabled()
+{ return thread_times_on; }
+
+void AddThreadTimes(const RegionTimes& times)
+{
+#ifdef _OPENMP
+#pragma omp critical (thread_times)
+#endif
+    {
+        if (thread_times_on) thread_times.push_back(times);
+    }
+}
+
+// The spans recorded since SetTrace turned it on.  The times are from WallTime, and are
+// written relative to trace_start.  Each thread gets a number the first time it adds one.
+struct TraceEvent
+{
+    std::string name;
+    int tid;
+    double start;
+    double end;
+    long arg1;
+    long arg2;
+    bool python;
+};
+
+static bool trace_on = false;
+static double trace_start = 0.;
+static std::vector<TraceEvent> trace_events;
+
+static int TraceThreadId()
+{
+    static std::atomic<int> next_id(0);
+    static thread_local int id = next_id++;
+    return id;
+}
+
+bool TraceEnabled()
+{ return trace_on; }
+
+void AddTraceEvent(const char* name, double start, double end, long arg1, long arg2,
+                   bool python)
+{
+    TraceEvent event = { name, TraceThreadId(), start, end, arg1, arg2, python };
+#ifdef _OPENMP
+#pragma omp critical (trace)
+#endif
+    {
+        if (trace_on) trace_events.push_back(event);
+    }
+}
+
+//
+//
+// Now the C-C++ interface functions that get used in python:
+//
+//
+
+extern "C" {
+
+#ifdef _WIN32
+#define extern __declspec(dllexport)
+#endif
+
+#include "ThreadTimes_C.h"
+}
+
+void SetThreadTimes(int on)
+{
+    dbg<<"Start SetThreadTimes: "<<on<<std::endl;
+    thread_times.clear();
+    thread_times_on = (on != 0);
+}
+
+long GetNThreadTimes()
+{
+    return thread_times.size();
+}
+
+const char* GetThreadTimesInfo(long i, int* nthreads, long* nitems)
+{
+    Assert(i >= 0 && i < long(thread_times.size()));
+    const RegionTimes& times = thread_times[i];
+    *nthreads = times.nthreads;
+    *nitems = times.cost.size();
+    return times.name.c_str();
+}
+
+void GetThreadTimes(long i, double* wall, double* busy, double* wait, double* merge,
+                    double* cost)
+{
+    Assert(i >= 0 && i < long(thread_times.size()));
+    const RegionTimes& times = thread_times[i];
+    *wall = times.wall;
+    std::copy(times.busy.begin(), times.busy.end(), busy);
+    std::copy(times.wait.begin(), times.wait.end(), wait);
+    std::copy(times.merge.begin(), times.merge.end(), merge);
+    std::copy(times.cost.begin(), times.cost.end(), cost);
+}
+
+void SetTrace(int on)
+{
+    dbg<<"Start SetTrace: "<<on<<std::endl;
+    trace_events.clear();
+    trace_start = WallTime();
+    trace_on = (on != 0);
+}
+
+double GetTraceTime()
+{
+    return WallTime();
+}
+
+void AddTrace(const char* name, double start, double end)
+{
+    AddTraceEvent(name, start, end, -1, -1, true);
+}
+
+long GetNTrace()
+{
+    return trace_events.size();
+}
+
+const char* GetTrace(long i, int* tid, double* start, double* end, long* args, int* python)
+{
+    Assert(i >= 0 && i < long(trace_events.size()));
+    const TraceEvent& event = trace_events[i];
+    *tid = event.tid;
+    *start = event.start - trace_start;
+    *end = event.end - trace_start;
+    args[0] = event.arg1;
+    args[1] = event.arg2;
+    *python = event.python;
+    return event.name.c_str();
+}
@@ -492,10 +492,9 @@ def test_hdf5():
 @timer
 def test_parquet():
     try:
-        import pandas  # noqa: F401
         import pyarrow # noqa: F401
     except ImportError:
-        print('Skipping ParquetReader tests, since pandas or pyarrow not installed.')
+        print('Skipping ParquetReader tests, since pyarrow not installed.')
         return
     _test_aardvark('Aardvark.parquet', 'Parquet', None)
 
@@ -2006,6 +2005,682 @@ def test_field():
     assert_raises(NotImplementedError, treecorr.SimpleField)
 
 
+@timer
+def test_arena():
+    # Check that building the fields in arenas gives identical trees and results.
+
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(222,50, (ngal,) )
+    y = rng.normal(138,20, (ngal,) )
+    z = rng.normal(912,130, (ngal,) )
+    w = rng.random_sample(ngal)
+    k = rng.normal(0,3, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+
+    cat1 = treecorr.Catalog(x=x, y=y, w=w, k=k, g1=g1, g2=g2)
+    cat2 = treecorr.Catalog(x=x, y=y, w=w, k=k, g1=g1, g2=g2, use_arena=True)
+    cat3 = treecorr.Catalog(x=x, y=y, z=z, w=w, k=k, use_arena=True)
+
+    for min_size in [0, 1, 10]:
+        nfield1 = cat1.getNField(min_size=min_size)
+        nfield2 = cat2.getNField(min_size=min_size)
+        assert not nfield1.use_arena
+        assert nfield2.use_arena
+        assert nfield2.nTopLevelNodes == nfield1.nTopLevelNodes
+        for sep in [3, 30]:
+            n = nfield1.count_near(200, 150, sep=sep)
+            assert nfield2.count_near(200, 150, sep=sep) == n
+            np.testing.assert_array_equal(np.sort(nfield2.get_near(200, 150, sep=sep)),
+                                          np.sort(nfield1.get_near(200, 150, sep=sep)))
+
+    # Also check direct construction
+    kfield = treecorr.KField(cat3, min_size=1, use_arena=True)
+    assert kfield.use_arena
+    assert kfield.count_near(222, 138, 912, sep=50) == cat3.getKField(min_size=1).count_near(
+            222, 138, 912, sep=50)
+
+    # The correlation functions are identical.
+    gg1 = treecorr.GGCorrelation(min_sep=1, max_sep=100, nbins=20)
+    gg2 = treecorr.GGCorrelation(min_sep=1, max_sep=100, nbins=20)
+    gg1.process(cat1)
+    gg2.process(cat2)
+    np.testing.assert_array_equal(gg2.npairs, gg1.npairs)
+    np.testing.assert_allclose(gg2.xip, gg1.xip, rtol=1.e-12, atol=1.e-14)
+    np.testing.assert_allclose(gg2.xim, gg1.xim, rtol=1.e-12, atol=1.e-14)
+
+    nk1 = treecorr.NKCorrelation(min_sep=1, max_sep=100, nbins=20, bin_slop=0)
+    nk2 = treecorr.NKCorrelation(min_sep=1, max_sep=100, nbins=20, bin_slop=0)
+    nk1.process(cat1, cat1)
+    nk2.process(cat2, cat2)
+    np.testing.assert_array_equal(nk2.npairs, nk1.npairs)
+    np.testing.assert_allclose(nk2.xi, nk1.xi, rtol=1.e-12, atol=1.e-14)
+
+
+@timer
+def test_packed():
+    # Check that using the packed tree layout for the traversal gives identical results.
+
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(222,50, (ngal,) )
+    y = rng.normal(138,20, (ngal,) )
+    z = rng.normal(912,130, (ngal,) )
+    w = rng.random_sample(ngal)
+    k = rng.normal(0,3, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+
+    cat1 = treecorr.Catalog(x=x, y=y, z=z, w=w, k=k, g1=g1, g2=g2)
+    cat2 = treecorr.Catalog(x=x, y=y, z=z, w=w, k=k, g1=g1, g2=g2, use_packed=True)
+    cat3 = treecorr.Catalog(x=x, y=y, z=z, w=w, k=k, g1=g1, g2=g2, use_packed=True,
+                            use_arena=True)
+
+    gfield = cat2.getGField()
+    assert gfield.use_packed
+    assert not cat1.getGField().use_packed
+
+    gg1 = treecorr.GGCorrelation(min_sep=1, max_sep=100, nbins=20)
+    gg1.process(cat1)
+    for cat in [cat2, cat3]:
+        gg2 = treecorr.GGCorrelation(min_sep=1, max_sep=100, nbins=20)
+        gg2.process(cat)
+        np.testing.assert_array_equal(gg2.npairs, gg1.npairs)
+        np.testing.assert_allclose(gg2.xip, gg1.xip, rtol=1.e-12, atol=1.e-14)
+        np.testing.assert_allclose(gg2.xim, gg1.xim, rtol=1.e-12, atol=1.e-14)
+
+    # Cross correlations use the packed trees only if both fields have one.
+    nk1 = treecorr.NKCorrelation(min_sep=1, max_sep=100, nbins=20, bin_slop=0)
+    nk2 = treecorr.NKCorrelation(min_sep=1, max_sep=100, nbins=20, bin_slop=0)
+    nk3 = treecorr.NKCorrelation(min_sep=1, max_sep=100, nbins=20, bin_slop=0)
+    nk1.process(cat1, cat1)
+    nk2.process(cat2, cat3)
+    nk3.process(cat1, cat2)
+    np.testing.assert_array_equal(nk2.npairs, nk1.npairs)
+    np.testing.assert_allclose(nk2.xi, nk1.xi, rtol=1.e-12, atol=1.e-14)
+    np.testing.assert_array_equal(nk3.npairs, nk1.npairs)
+    np.testing.assert_allclose(nk3.xi, nk1.xi, rtol=1.e-12, atol=1.e-14)
+
+    nn1 = treecorr.NNCorrelation(min_sep=1, max_sep=100, nbins=20, bin_type='Linear')
+    nn2 = treecorr.NNCorrelation(min_sep=1, max_sep=100, nbins=20, bin_type='Linear')
+    nn1.process(cat1)
+    nn2.process(cat2)
+    np.testing.assert_array_equal(nn2.npairs, nn1.npairs)
+
+
+@timer
+def test_field_cache():
+    # Check that fields can be saved to and read back from a cache directory.
+    import shutil
+
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    ra = rng.uniform(11,13, (ngal,) )
+    dec = rng.uniform(-31,-29, (ngal,) )
+    w = rng.random_sample(ngal)
+    k = rng.normal(0,3, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+
+    cache_dir = os.path.join('output','field_cache')
+    if os.path.exists(cache_dir):
+        shutil.rmtree(cache_dir)
+
+    def make_cat(w=w, **kwargs):
+        return treecorr.Catalog(ra=ra, dec=dec, w=w, k=k, g1=g1, g2=g2,
+                                ra_units='deg', dec_units='deg', **kwargs)
+
+    # The first time, the fields get built and saved.
+    cat1 = make_cat(field_cache_dir=cache_dir)
+    nfield1 = cat1.getNField(min_size=1.e-4, max_size=0.02)
+    kfield1 = cat1.getKField(min_size=1.e-4, max_size=0.02)
+    gfield1 = cat1.getGField(min_size=1.e-4, max_size=0.02)
+    assert len(os.listdir(cache_dir)) == 3
+
+    # The second time, they are read back from the cache.
+    cat2 = make_cat(field_cache_dir=cache_dir, use_packed=True)
+    nfield2 = cat2.getNField(min_size=1.e-4, max_size=0.02)
+    kfield2 = cat2.getKField(min_size=1.e-4, max_size=0.02)
+    gfield2 = cat2.getGField(min_size=1.e-4, max_size=0.02)
+    assert len(os.listdir(cache_dir)) == 3
+    assert nfield2.nTopLevelNodes == nfield1.nTopLevelNodes
+    assert kfield2.nTopLevelNodes == kfield1.nTopLevelNodes
+    assert gfield2.nTopLevelNodes == gfield1.nTopLevelNodes
+    for sep in [0.1, 0.5]:
+        kwargs = dict(ra=12, dec=-30, ra_units='deg', dec_units='deg', sep=sep, sep_units='deg')
+        n = nfield1.count_near(**kwargs)
+        assert nfield2.count_near(**kwargs) == n
+        np.testing.assert_array_equal(np.sort(nfield2.get_near(**kwargs)),
+                                      np.sort(nfield1.get_near(**kwargs)))
+
+    # Different build parameters or different values get different files.
+    cat2.getNField(min_size=2.e-4, max_size=0.02)
+    assert len(os.listdir(cache_dir)) == 4
+    cat3 = make_cat(field_cache_dir=cache_dir, w=2*w)
+    cat3.getNField(min_size=1.e-4, max_size=0.02)
+    assert len(os.listdir(cache_dir)) == 5
+
+    # The correlation functions are identical.
+    cat4 = make_cat()
+    kk1 = treecorr.KKCorrelation(min_sep=0.01, max_sep=1, nbins=10, sep_units='deg')
+    kk2 = treecorr.KKCorrelation(min_sep=0.01, max_sep=1, nbins=10, sep_units='deg')
+    kk1.process(cat4)
+    kk2.process(make_cat(field_cache_dir=cache_dir))
+    kk2.process(make_cat(field_cache_dir=cache_dir))  # Now this one is read from the cache.
+    np.testing.assert_array_equal(kk2.npairs, kk1.npairs)
+    np.testing.assert_allclose(kk2.xi, kk1.xi, rtol=1.e-12, atol=1.e-14)
+
+    gg1 = treecorr.GGCorrelation(min_sep=0.01, max_sep=1, nbins=10, sep_units='deg')
+    gg2 = treecorr.GGCorrelation(min_sep=0.01, max_sep=1, nbins=10, sep_units='deg')
+    gg1.process(cat4)
+    gg2.process(make_cat(field_cache_dir=cache_dir))
+    gg2.process(make_cat(field_cache_dir=cache_dir))
+    np.testing.assert_array_equal(gg2.npairs, gg1.npairs)
+    np.testing.assert_allclose(gg2.xip, gg1.xip, rtol=1.e-12, atol=1.e-14)
+
+    # An invalid file is ignored and rebuilt.
+    for file_name in os.listdir(cache_dir):
+        with open(os.path.join(cache_dir, file_name), 'w') as f:
+            f.write('not a field')
+    nfield5 = make_cat(field_cache_dir=cache_dir).getNField(min_size=1.e-4, max_size=0.02)
+    assert nfield5.nTopLevelNodes == nfield1.nTopLevelNodes
+    nfield6 = make_cat(field_cache_dir=cache_dir).getNField(min_size=1.e-4, max_size=0.02)
+    assert nfield6.nTopLevelNodes == nfield1.nTopLevelNodes
+
+    # An empty cache_dir means no cache.
+    nfield7 = make_cat(field_cache_dir='').getNField(min_size=1.e-4, max_size=0.02)
+    assert nfield7.nTopLevelNodes == nfield1.nTopLevelNodes
+
+
+@timer
+def test_zero_copy():
+    # Check that building the fields directly from the catalog arrays gives the same results.
+
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(222,50, (ngal,) )
+    y = rng.normal(138,20, (ngal,) )
+    w = rng.random_sample(ngal)
+    k = rng.normal(0,3, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+    ra = rng.uniform(11,13, (ngal,) )
+    dec = rng.uniform(-31,-29, (ngal,) )
+
+    cat1 = treecorr.Catalog(x=x, y=y, w=w, k=k, g1=g1, g2=g2)
+    cat2 = treecorr.Catalog(x=x, y=y, w=w, k=k, g1=g1, g2=g2, zero_copy=True)
+    cat3 = treecorr.Catalog(x=x, y=y, w=w, k=k, g1=g1, g2=g2, zero_copy=True,
+                            use_arena=True, use_packed=True)
+    assert cat2.getGField().zero_copy
+    assert not cat1.getGField().zero_copy
+
+    # The trees are the same, but the sums in each cell may differ by float rounding.
+    for split_method in ['mean', 'median', 'middle']:
+        f1 = cat1.getNField(min_size=0.1, split_method=split_method)
+        f2 = cat2.getNField(min_size=0.1, split_method=split_method)
+        assert f2.nTopLevelNodes == f1.nTopLevelNodes
+        n = f1.count_near(x=220, y=140, sep=20)
+        assert f2.count_near(x=220, y=140, sep=20) == n
+        np.testing.assert_array_equal(np.sort(f2.get_near(x=220, y=140, sep=20)),
+                                      np.sort(f1.get_near(x=220, y=140, sep=20)))
+
+    gg1 = treecorr.GGCorrelation(min_sep=1, max_sep=100, nbins=20)
+    gg1.process(cat1)
+    kk1 = treecorr.KKCorrelation(min_sep=1, max_sep=100, nbins=20)
+    kk1.process(cat1)
+    nn1 = treecorr.NNCorrelation(min_sep=1, max_sep=100, nbins=20)
+    nn1.process(cat1)
+    for cat in [cat2, cat3]:
+        gg2 = treecorr.GGCorrelation(min_sep=1, max_sep=100, nbins=20)
+        gg2.process(cat)
+        np.testing.assert_array_equal(gg2.npairs, gg1.npairs)
+        np.testing.assert_allclose(gg2.xip, gg1.xip, rtol=1.e-6, atol=1.e-10)
+        np.testing.assert_allclose(gg2.xim, gg1.xim, rtol=1.e-6, atol=1.e-10)
+        kk2 = treecorr.KKCorrelation(min_sep=1, max_sep=100, nbins=20)
+        kk2.process(cat)
+        np.testing.assert_array_equal(kk2.npairs, kk1.npairs)
+        np.testing.assert_allclose(kk2.xi, kk1.xi, rtol=1.e-6, atol=1.e-10)
+        nn2 = treecorr.NNCorrelation(min_sep=1, max_sep=100, nbins=20)
+        nn2.process(cat)
+        np.testing.assert_array_equal(nn2.npairs, nn1.npairs)
+        np.testing.assert_allclose(nn2.weight, nn1.weight, rtol=1.e-6)
+
+    # Spherical coordinates use the parallel transported shears.
+    cat4 = treecorr.Catalog(ra=ra, dec=dec, w=w, g1=g1, g2=g2, ra_units='deg', dec_units='deg')
+    cat5 = treecorr.Catalog(ra=ra, dec=dec, w=w, g1=g1, g2=g2, ra_units='deg', dec_units='deg',
+                            zero_copy=True)
+    gg1 = treecorr.GGCorrelation(min_sep=1, max_sep=60, nbins=10, sep_units='arcmin')
+    gg2 = treecorr.GGCorrelation(min_sep=1, max_sep=60, nbins=10, sep_units='arcmin')
+    gg1.process(cat4)
+    gg2.process(cat5)
+    np.testing.assert_array_equal(gg2.npairs, gg1.npairs)
+    np.testing.assert_allclose(gg2.xip, gg1.xip, rtol=1.e-6, atol=1.e-10)
+    np.testing.assert_allclose(gg2.xim, gg1.xim, rtol=1.e-6, atol=1.e-10)
+
+
+@timer
+def test_field_insert():
+    # Check that inserting objects into a field is equivalent to building it with all of them.
+
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(222,50, (ngal,) )
+    y = rng.normal(138,20, (ngal,) )
+    x[ngal//2:] += 80    # The second half are mostly off to one side.
+    w = rng.random_sample(ngal)
+    k = rng.normal(0,3, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+
+    cat = treecorr.Catalog(x=x, y=y, w=w, k=k, g1=g1, g2=g2)
+    for use_arena in [False, True]:
+        n1 = ngal//2
+        n2 = ngal - n1 - 100
+        cat1 = treecorr.Catalog(x=x[:n1], y=y[:n1], w=w[:n1], k=k[:n1], g1=g1[:n1], g2=g2[:n1],
+                                use_arena=use_arena)
+        cat2 = treecorr.Catalog(x=x[n1:n1+n2], y=y[n1:n1+n2], w=w[n1:n1+n2], k=k[n1:n1+n2],
+                                g1=g1[n1:n1+n2], g2=g2[n1:n1+n2])
+        cat3 = treecorr.Catalog(x=x[n1+n2:], y=y[n1+n2:], w=w[n1+n2:], k=k[n1+n2:],
+                                g1=g1[n1+n2:], g2=g2[n1+n2:])
+        for get_field in ['getNField', 'getKField', 'getGField']:
+            full = getattr(cat, get_field)()
+            field = getattr(cat1, get_field)()
+            ntop = field.nTopLevelNodes
+            field.insert(cat2)
+            field.insert(cat3)
+            assert field.ntot == ngal
+            assert field.nTopLevelNodes >= ntop
+            for sep in [5, 20, 50]:
+                for x0, y0 in [(222,138), (300,140)]:
+                    n = full.count_near(x=x0, y=y0, sep=sep)
+                    assert field.count_near(x=x0, y=y0, sep=sep) == n
+                    # The order depends on the trees, which are different, so sort them.
+                    np.testing.assert_array_equal(np.sort(field.get_near(x=x0, y=y0, sep=sep)),
+                                                  np.sort(full.get_near(x=x0, y=y0, sep=sep)))
+
+    # The field is updated in place, so correlations using cat1 now include all the objects.
+    cat1 = treecorr.Catalog(x=x[:n1], y=y[:n1], w=w[:n1], k=k[:n1], g1=g1[:n1], g2=g2[:n1])
+    kk1 = treecorr.KKCorrelation(min_sep=1, max_sep=100, nbins=20, bin_slop=0)
+    kk1.process(cat1)
+    cat1.field.insert(
+            treecorr.Catalog(x=x[n1:], y=y[n1:], w=w[n1:], k=k[n1:], g1=g1[n1:], g2=g2[n1:]))
+    kk1.process(cat)
+    kk2 = treecorr.KKCorrelation(min_sep=1, max_sep=100, nbins=20, bin_slop=0)
+    kk2.process(cat1)
+    np.testing.assert_array_equal(kk2.npairs, kk1.npairs)
+    np.testing.assert_allclose(kk2.xi, kk1.xi, rtol=1.e-6, atol=1.e-10)
+
+    # The coordinates need to match.
+    cat4 = treecorr.Catalog(x=x, y=y, z=x, w=w)
+    with assert_raises(ValueError):
+        cat1.getNField().insert(cat4)
+
+
+@timer
+def test_field_chunks():
+    # Check that building the fields from chunks of the file is equivalent to loading the
+    # whole catalog first.
+
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(222,50, (ngal,) )
+    y = rng.normal(138,20, (ngal,) )
+    w = rng.random_sample(ngal)
+    w[::17] = 0.
+    k = rng.normal(0,3, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+    file_name = os.path.join('output','test_field_chunks.dat')
+    np.savetxt(file_name, np.array([x,y,w,k,g1,g2]).T)
+    config = dict(x_col=1, y_col=2, w_col=3, k_col=4, g1_col=5, g2_col=6)
+
+    for kwargs in [dict(), dict(first_row=11, last_row=4000, every_nth=3),
+                   dict(use_arena=True)]:
+        cat1 = treecorr.Catalog(file_name, config, **kwargs)
+        cat2 = treecorr.Catalog(file_name, config, field_chunk_size=700, **kwargs)
+        for get_field in ['getNField', 'getKField', 'getGField']:
+            f1 = getattr(cat1, get_field)(min_size=0.1)
+            f2 = getattr(cat2, get_field)(min_size=0.1)
+            assert not cat2.loaded
+            assert f2.ntot == f1.ntot
+            assert f2.nTopLevelNodes == f1.nTopLevelNodes
+            for sep in [5, 20, 50]:
+                np.testing.assert_array_equal(f2.get_near(x=222, y=138, sep=sep),
+                                              f1.get_near(x=222, y=138, sep=sep))
+        assert cat2.coords == cat1.coords
+        assert cat2.nobj == cat1.nobj
+        np.testing.assert_allclose(cat2.sumw, cat1.sumw, rtol=1.e-12)
+        assert not cat2.loaded
+        # The chunks shared the reader, which remembers where each one started.
+        assert len(cat2.reader._row_pos) > 1
+
+        nn1 = treecorr.NNCorrelation(min_sep=1, max_sep=100, nbins=20)
+        nn1.process(cat1)
+        nn2 = treecorr.NNCorrelation(min_sep=1, max_sep=100, nbins=20)
+        nn2.process(cat2)
+        np.testing.assert_array_equal(nn2.npairs, nn1.npairs)
+        np.testing.assert_allclose(nn2.weight, nn1.weight, rtol=1.e-10)
+        assert not cat2.loaded
+
+        # The shear variance needs the catalog to be loaded, which happens automatically.
+        gg1 = treecorr.GGCorrelation(min_sep=1, max_sep=100, nbins=20)
+        gg1.process(cat1)
+        gg2 = treecorr.GGCorrelation(min_sep=1, max_sep=100, nbins=20)
+        gg2.process(cat2)
+        np.testing.assert_array_equal(gg2.npairs, gg1.npairs)
+        np.testing.assert_allclose(gg2.xip, gg1.xip, rtol=1.e-10, atol=1.e-14)
+        np.testing.assert_allclose(gg2.varxip, gg1.varxip, rtol=1.e-10)
+
+    # Catalogs given as arrays, or that are already loaded, build the fields as usual.
+    cat3 = treecorr.Catalog(x=x, y=y, w=w, field_chunk_size=700)
+    assert cat3.getNField().ntot == cat3.ntot
+    cat4 = treecorr.Catalog(file_name, config, field_chunk_size=700, npatch=4)
+    assert cat4.getNField().ntot == cat4.ntot
+
+
+@timer
+def test_mmap():
+    # Check that reading memory-mapped columns gives the same catalogs as reading them normally.
+    try:
+        import fitsio
+        import h5py
+    except ImportError:
+        print('Skipping test_mmap, since fitsio or h5py not installed.')
+        return
+
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(222,50, (ngal,) )
+    y = rng.normal(138,20, (ngal,) )
+    w = rng.random_sample(ngal)
+    k = rng.normal(0,3, (ngal,) )
+    k[::97] = np.nan
+    flag = np.zeros(ngal, dtype=np.int16)
+    flag[::13] = 4
+
+    fits_name = os.path.join('output','test_mmap.fits')
+    data = np.empty(ngal, dtype=[('x',float), ('y',float), ('w',np.float32), ('k',float),
+                                 ('flag',np.int16)])
+    data['x'] = x
+    data['y'] = y
+    data['w'] = w
+    data['k'] = k
+    data['flag'] = flag
+    with fitsio.FITS(fits_name, 'rw', clobber=True) as f:
+        f.write(data)
+
+    hdf_name = os.path.join('output','test_mmap.hdf5')
+    with h5py.File(hdf_name, 'w') as f:
+        f.create_dataset('x', data=x)
+        f.create_dataset('y', data=y)
+        f.create_dataset('w', data=w.astype(np.float32))
+        f.create_dataset('k', data=k, chunks=(1000,), compression='gzip')
+        f.create_dataset('flag', data=flag)
+
+    config = dict(x_col='x', y_col='y', w_col='w', k_col='k', flag_col='flag', ignore_flag=4)
+    for file_name in [fits_name, hdf_name]:
+        for kwargs in [dict(), dict(x_units='arcmin', y_units='arcmin'),
+                       dict(first_row=11, last_row=4000, every_nth=3)]:
+            cat1 = treecorr.Catalog(file_name, config, **kwargs)
+            cat2 = treecorr.Catalog(file_name, config, use_mmap=True, **kwargs)
+            np.testing.assert_array_equal(cat2.x, cat1.x)
+            np.testing.assert_array_equal(cat2.y, cat1.y)
+            np.testing.assert_array_equal(cat2.w, cat1.w)
+            np.testing.assert_array_equal(cat2.k, cat1.k)
+            assert cat2.sumw == cat1.sumw
+            f1 = cat1.getKField(min_size=0.1)
+            f2 = cat2.getKField(min_size=0.1, zero_copy=True)
+            assert f2.nTopLevelNodes == f1.nTopLevelNodes
+            np.testing.assert_array_equal(f2.get_near(x=cat1.x[0], y=cat1.y[0], sep=10),
+                                          f1.get_near(x=cat1.x[0], y=cat1.y[0], sep=10))
+
+    # The contiguous float64 HDF5 datasets are used without reading them into memory.
+    # (Without the flags, since removing the objects with zero weight makes copies.)
+    config = dict(x_col='x', y_col='y', w_col='w', k_col='k')
+    cat = treecorr.Catalog(hdf_name, config, use_mmap=True)
+    assert isinstance(cat.x, np.memmap)
+    assert not cat.x.flags.writeable
+    assert not cat.y.flags.writeable
+    # But the ones that need to be converted or modified are copies.
+    assert cat.w.flags.writeable
+    assert cat.k.flags.writeable
+    cat = treecorr.Catalog(hdf_name, config, use_mmap=True, x_units='arcmin', y_units='arcmin')
+    assert cat.x.flags.writeable
+
+@timer
+def test_lazy_values():
+    # Check that waiting to read the g1, g2, k columns gives the same catalogs.
+
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(222,50, (ngal,) )
+    y = rng.normal(138,20, (ngal,) )
+    w = rng.random_sample(ngal)
+    w[::17] = 0.
+    k = rng.normal(0,3, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+    file_name = os.path.join('output','test_lazy_values.dat')
+    np.savetxt(file_name, np.array([x,y,w,k,g1,g2]).T)
+    config = dict(x_col=1, y_col=2, w_col=3, k_col=4, g1_col=5, g2_col=6, flip_g2=True)
+
+    for kwargs in [dict(), dict(first_row=11, last_row=4000, every_nth=3),
+                   dict(npatch=4)]:
+        cat1 = treecorr.Catalog(file_name, config, **kwargs)
+        cat2 = treecorr.Catalog(file_name, config, lazy_values=True, **kwargs)
+        np.testing.assert_array_equal(cat2.x, cat1.x)
+        np.testing.assert_array_equal(cat2.w, cat1.w)
+        f1 = cat1.getNField(min_size=0.1)
+        f2 = cat2.getNField(min_size=0.1)
+        assert f2.nTopLevelNodes == f1.nTopLevelNodes
+        # Nothing needed g1, g2, k yet.
+        assert cat2._g1 is None and cat2._g2 is None and cat2._k is None
+        cat2.getGField(min_size=0.1)
+        assert cat2._g1 is not None and cat2._g2 is not None and cat2._k is None
+        np.testing.assert_array_equal(cat2.g1, cat1.g1)
+        np.testing.assert_array_equal(cat2.g2, cat1.g2)
+        assert cat2.varg == cat1.varg
+        cat2.getKField(min_size=0.1)
+        np.testing.assert_array_equal(cat2.k, cat1.k)
+        assert cat2.vark == cat1.vark
+
+    # The selection of a single patch also applies to the columns read later.
+    cat1 = treecorr.Catalog(file_name, config, npatch=4)
+    for i in range(4):
+        p1 = treecorr.Catalog(file_name, config, patch_centers=cat1.patch_centers, patch=i)
+        p2 = treecorr.Catalog(file_name, config, patch_centers=cat1.patch_centers, patch=i,
+                              lazy_values=True)
+        np.testing.assert_array_equal(p2.x, p1.x)
+        assert p2._k is None
+        np.testing.assert_array_equal(p2.k, p1.k)
+        np.testing.assert_array_equal(p2.g1, p1.g1)
+
+    # Randoms don't read these columns at all.
+    rand = treecorr.Catalog(file_name, config, lazy_values=True, is_rand=True)
+    assert rand.g1 is None and rand.k is None
+
+    # NaNs in these columns set w=0 when they are read, but don't remove the objects.
+    k[::31] = np.nan
+    np.savetxt(file_name, np.array([x,y,w,k,g1,g2]).T)
+    cat1 = treecorr.Catalog(file_name, config)
+    cat2 = treecorr.Catalog(file_name, config, lazy_values=True)
+    f2 = cat2.getNField()
+    assert cat2.ntot > cat1.ntot
+    assert cat2.sumw > cat1.sumw
+    assert np.sum(cat2.k == 0) > 0
+    np.testing.assert_allclose(cat2.sumw, cat1.sumw, rtol=1.e-12)
+    assert cat2.nobj == cat1.nobj
+    np.testing.assert_array_equal(cat2.k[cat2.w != 0], cat1.k)
+    assert cat2.getNField() is not f2
+
+@timer
+def test_reorder_tree():
+    # Check that copying the trees into depth-first order gives identical results.
+
+    ngal = 20000
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(222,50, (ngal,) )
+    y = rng.normal(138,20, (ngal,) )
+    z = rng.normal(912,130, (ngal,) )
+    w = rng.random_sample(ngal)
+    k = rng.normal(0,3, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+
+    cat1 = treecorr.Catalog(x=x, y=y, z=z, w=w, k=k, g1=g1, g2=g2)
+    cat2 = treecorr.Catalog(x=x, y=y, z=z, w=w, k=k, g1=g1, g2=g2, reorder_tree=True)
+    cat3 = treecorr.Catalog(x=x, y=y, z=z, w=w, k=k, g1=g1, g2=g2, reorder_tree=True,
+                            use_packed=True, zero_copy=True)
+
+    gfield = cat2.getGField()
+    assert gfield.reorder_tree
+    assert not cat1.getGField().reorder_tree
+    assert gfield.nTopLevelNodes == cat1.getGField().nTopLevelNodes
+
+    gg1 = treecorr.GGCorrelation(min_sep=1, max_sep=100, nbins=20)
+    t0 = time.time()
+    gg1.process(cat1)
+    t1 = time.time()
+    print('time for normal tree: ',t1-t0)
+    for cat in [cat2, cat3]:
+        gg2 = treecorr.GGCorrelation(min_sep=1, max_sep=100, nbins=20)
+        t0 = time.time()
+        gg2.process(cat)
+        t1 = time.time()
+        print('time for reordered tree: ',t1-t0)
+        np.testing.assert_array_equal(gg2.npairs, gg1.npairs)
+        np.testing.assert_allclose(gg2.xip, gg1.xip, rtol=1.e-6, atol=1.e-11)
+        np.testing.assert_allclose(gg2.xim, gg1.xim, rtol=1.e-6, atol=1.e-11)
+
+    # getNear should find the same objects.
+    nfield1 = cat1.getNField()
+    nfield2 = cat2.getNField()
+    for sep in [1, 10, 100]:
+        near1 = nfield1.get_near(x=220, y=140, z=900, sep=sep)
+        near2 = nfield2.get_near(x=220, y=140, z=900, sep=sep)
+        np.testing.assert_array_equal(np.sort(near2), np.sort(near1))
+
+    # Fields can still have more objects inserted after being reordered.
+    cat4 = treecorr.Catalog(x=x[:ngal//2], y=y[:ngal//2], z=z[:ngal//2], w=w[:ngal//2],
+                            k=k[:ngal//2], reorder_tree=True)
+    cat5 = treecorr.Catalog(x=x[ngal//2:], y=y[ngal//2:], z=z[ngal//2:], w=w[ngal//2:],
+                            k=k[ngal//2:])
+    kk1 = treecorr.KKCorrelation(min_sep=1, max_sep=100, nbins=20, bin_slop=0)
+    kk1.process(cat4)
+    cat4.field.insert(cat5)
+    kk1.process(cat1)
+    kk2 = treecorr.KKCorrelation(min_sep=1, max_sep=100, nbins=20, bin_slop=0)
+    kk2.process(cat4)
+    np.testing.assert_array_equal(kk2.npairs, kk1.npairs)
+    np.testing.assert_allclose(kk2.xi, kk1.xi, rtol=1.e-6, atol=1.e-10)
+
+
+@timer
+def test_bucket_size():
+    # Check that using buckets for the small cells gives the right answer for bin_slop=0.
+
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(222,50, (ngal,) )
+    y = rng.normal(138,20, (ngal,) )
+    w = rng.random_sample(ngal)
+    k = rng.normal(0,3, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+
+    cat0 = treecorr.Catalog(x=x, y=y, w=w, k=k, g1=g1, g2=g2)
+    gg0 = treecorr.GGCorrelation(min_sep=1, max_sep=100, nbins=20, brute=True)
+    gg0.process(cat0)
+
+    for bucket_size in [2, 8, 32]:
+        cat1 = treecorr.Catalog(x=x, y=y, w=w, k=k, g1=g1, g2=g2, bucket_size=bucket_size)
+        gfield = cat1.getGField()
+        assert gfield.bucket_size == bucket_size
+        assert gfield.use_arena
+        gg1 = treecorr.GGCorrelation(min_sep=1, max_sep=100, nbins=20, bin_slop=0)
+        t0 = time.time()
+        gg1.process(cat1)
+        t1 = time.time()
+        print('bucket_size = %d: time = %s'%(bucket_size,t1-t0))
+        np.testing.assert_array_equal(gg1.npairs, gg0.npairs)
+        np.testing.assert_allclose(gg1.weight, gg0.weight, rtol=1.e-5, atol=1.e-8)
+        np.testing.assert_allclose(gg1.meanr, gg0.meanr, rtol=2.e-4)
+        np.testing.assert_allclose(gg1.xip, gg0.xip, rtol=1.e-3, atol=1.e-6)
+        np.testing.assert_allclose(gg1.xip_im, gg0.xip_im, rtol=1.e-3, atol=1.e-6)
+        np.testing.assert_allclose(gg1.xim, gg0.xim, rtol=1.e-3, atol=2.e-4)
+        np.testing.assert_allclose(gg1.xim_im, gg0.xim_im, rtol=1.e-3, atol=2.e-4)
+
+    cat1 = treecorr.Catalog(x=x, y=y, w=w, k=k, g1=g1, g2=g2)
+    gg1 = treecorr.GGCorrelation(min_sep=1, max_sep=100, nbins=20, bin_slop=0)
+    t0 = time.time()
+    gg1.process(cat1)
+    t1 = time.time()
+    print('no buckets: time = %s'%(t1-t0))
+
+    # Cross correlations, where only one of the fields has buckets, and the packed
+    # traversal, which doesn't use them, should also be right.
+    cat2 = treecorr.Catalog(x=x[:ngal//2], y=y[:ngal//2], w=w[:ngal//2], k=k[:ngal//2],
+                            bucket_size=16)
+    cat3 = treecorr.Catalog(x=x[ngal//2:], y=y[ngal//2:], w=w[ngal//2:], k=k[ngal//2:])
+    cat4 = treecorr.Catalog(x=x[ngal//2:], y=y[ngal//2:], w=w[ngal//2:], k=k[ngal//2:],
+                            bucket_size=16, use_packed=True)
+    kk0 = treecorr.KKCorrelation(min_sep=1, max_sep=100, nbins=20, brute=True)
+    kk0.process(cat2, cat3)
+    for c3 in [cat3, cat4]:
+        kk1 = treecorr.KKCorrelation(min_sep=1, max_sep=100, nbins=20, bin_slop=0)
+        kk1.process(cat2, c3)
+        np.testing.assert_array_equal(kk1.npairs, kk0.npairs)
+        np.testing.assert_allclose(kk1.xi, kk0.xi, rtol=1.e-3, atol=1.e-6)
+    kk0.process(cat3)
+    kk1.process(cat4)
+    np.testing.assert_array_equal(kk1.npairs, kk0.npairs)
+    np.testing.assert_allclose(kk1.xi, kk0.xi, rtol=1.e-3, atol=1.e-6)
+
+    # The buckets are also used for the pairs within a single field.
+    nn0 = treecorr.NNCorrelation(min_sep=1, max_sep=100, nbins=20, brute=True)
+    nn0.process(cat3)
+    nn1 = treecorr.NNCorrelation(min_sep=1, max_sep=100, nbins=20, bin_slop=0)
+    nn1.process(treecorr.Catalog(x=x[ngal//2:], y=y[ngal//2:], bucket_size=16))
+    np.testing.assert_array_equal(nn1.npairs, nn0.npairs)
+    np.testing.assert_allclose(nn1.meanr, nn0.meanr, rtol=2.e-4)
+
+    # The leaf pairs in buckets are computed in blocks.  Check the other bin types too.
+    for bin_type in ['Linear', 'TwoD']:
+        gg0 = treecorr.GGCorrelation(min_sep=0.5, max_sep=40, nbins=20, bin_type=bin_type,
+                                     brute=True)
+        gg0.process(cat0)
+        gg1 = treecorr.GGCorrelation(min_sep=0.5, max_sep=40, nbins=20, bin_type=bin_type,
+                                     bin_slop=0)
+        gg1.process(treecorr.Catalog(x=x, y=y, w=w, g1=g1, g2=g2, bucket_size=64))
+        np.testing.assert_array_equal(gg1.npairs, gg0.npairs)
+        np.testing.assert_allclose(gg1.meanr, gg0.meanr, rtol=2.e-4)
+        np.testing.assert_allclose(gg1.xip, gg0.xip, rtol=1.e-3, atol=1.e-6)
+        np.testing.assert_allclose(gg1.xim, gg0.xim, rtol=1.e-3, atol=2.e-4)
+
+
+@timer
+def test_split_method_pairs():
+    # With bin_slop=0, all of the split methods should find exactly the same pairs.
+    # (The time to build the trees with each one is in devel/benchmark.py.)
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(222,50, (ngal,) )
+    y = rng.normal(138,20, (ngal,) )
+    z = rng.normal(912,130, (ngal,) )
+    w = rng.random_sample(ngal)
+    cat2 = treecorr.Catalog(x=x, y=y, z=z, w=w)
+    nn1 = treecorr.NNCorrelation(min_sep=1, max_sep=100, nbins=20, bin_slop=0,
+                                 split_method='middle')
+    nn1.process(cat2)
+    for sm in ['median', 'mean', 'random']:
+        nn2 = treecorr.NNCorrelation(min_sep=1, max_sep=100, nbins=20, bin_slop=0,
+                                     split_method=sm)
+        nn2.process(cat2)
+        np.testing.assert_array_equal(nn2.npairs, nn1.npairs)
+        np.testing.assert_allclose(nn2.weight, nn1.weight, rtol=1.e-10)
+
+
 @timer
 def test_lru():
     f = lambda x: x+1
@@ -2090,6 +2765,198 @@ def test_lru():
 
     assert_raises(ValueError, cache.resize, -20)
 
+@timer
+def test_merge_size():
+    # With merge_size, the objects in small cells are merged into single weighted points.
+    # The pair counts are only slightly biased as long as merge_size << min_sep.
+    nrand = 20000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (nrand,) )
+    y = rng.uniform(0,100, (nrand,) )
+    w = rng.uniform(0.5,1.5, (nrand,) )
+    cat0 = treecorr.Catalog(x=x, y=y, w=w)
+    cat1 = treecorr.Catalog(x=x, y=y, w=w, merge_size=0.2)
+    rr0 = treecorr.NNCorrelation(min_sep=5., max_sep=50., nbins=10, bin_slop=0)
+    rr0.process(cat0)
+    rr1 = treecorr.NNCorrelation(min_sep=5., max_sep=50., nbins=10, bin_slop=0)
+    rr1.process(cat1)
+    print('rr0.npairs = ',rr0.npairs)
+    print('rr1.npairs = ',rr1.npairs)
+    np.testing.assert_allclose(rr1.npairs, rr0.npairs, rtol=1.e-2)
+    np.testing.assert_allclose(rr1.weight, rr0.weight, rtol=1.e-2)
+    np.testing.assert_allclose(rr1.meanr, rr0.meanr, rtol=1.e-3)
+    assert np.sum(rr1.npairs) != np.sum(rr0.npairs)
+
+    # The merged cells are not split even with brute force.
+    rr2 = treecorr.NNCorrelation(min_sep=5., max_sep=50., nbins=10, brute=True)
+    rr2.process(cat1)
+    np.testing.assert_allclose(rr2.npairs, rr0.npairs, rtol=1.e-2)
+
+    # merge_size_units applies for angles.
+    ra = x / 10.
+    dec = y / 10.
+    cat2 = treecorr.Catalog(ra=ra, dec=dec, w=w, ra_units='deg', dec_units='deg')
+    cat3 = treecorr.Catalog(ra=ra, dec=dec, w=w, ra_units='deg', dec_units='deg',
+                            merge_size=1.2, merge_size_units='arcmin')
+    rr3 = treecorr.NNCorrelation(min_sep=30., max_sep=300., nbins=10, bin_slop=0,
+                                 sep_units='arcmin')
+    rr3.process(cat2)
+    rr4 = treecorr.NNCorrelation(min_sep=30., max_sep=300., nbins=10, bin_slop=0,
+                                 sep_units='arcmin')
+    rr4.process(cat3)
+    np.testing.assert_allclose(rr4.npairs, rr3.npairs, rtol=1.e-2)
+    assert np.sum(rr4.npairs) != np.sum(rr3.npairs)
+
+
+@timer
+def test_field_memory():
+    # Check the memory reported for a Field against the estimate before building it.
+    ngal = 20000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    k = rng.normal(0,3, (ngal,) )
+    size = 50 * np.sqrt(2)
+
+    for min_size in [0., 2.]:
+        cat = treecorr.Catalog(x=x, y=y, k=k)
+        field = cat.getKField(min_size=min_size)
+        mem = field.memory
+        print('min_size = %s: mem = %s'%(min_size,mem))
+        assert mem['total'] == sum(mem[key] for key in mem if key != 'total')
+        assert mem['cells'] > 0
+        assert mem['celldata'] > 0
+        assert mem['arena'] == 0
+        assert mem['mapped'] == 0
+        assert mem['packed'] == 0
+        # The data used to build the tree is released afterwards.
+        assert mem['build'] == 0
+        # There are list leaves only if the leaves have a minimum size.
+        assert (mem['indices'] > 0) == (min_size > 0)
+        if min_size == 0:
+            # Then every object is in its own leaf, so the estimate is only off by not knowing
+            # the number of top-level cells.
+            est = treecorr.estimate_field_memory(ngal, 'K')
+            assert mem['cells'] <= est['cells'] < 1.01 * mem['cells']
+            assert mem['celldata'] <= est['celldata'] < 1.01 * mem['celldata']
+            assert est['indices'] == 0
+        else:
+            # For uniform objects, this is an upper bound, but not by too much.
+            est = treecorr.estimate_field_memory(ngal, 'K', min_size=min_size, size=size)
+            print('est = ',est)
+            assert mem['cells'] <= est['cells'] < 10 * mem['cells']
+            assert mem['indices'] <= est['indices']
+        assert est['build'] > 0
+        assert est['peak'] == est['total'] + est['build']
+
+        # With arenas, all of the tree is in the arena blocks.
+        cat = treecorr.Catalog(x=x, y=y, k=k, use_arena=True, use_packed=True)
+        field = cat.getKField(min_size=min_size)
+        mem2 = field.memory
+        print('arena: mem = %s'%mem2)
+        assert mem2['cells'] == mem2['celldata'] == mem2['indices'] == 0
+        assert mem2['arena'] >= mem['cells'] + mem['celldata'] + mem['indices']
+        assert mem2['packed'] > 0
+        est = treecorr.estimate_field_memory(ngal, 'K', min_size=min_size, size=size,
+                                             use_arena=True, use_packed=True)
+        assert est['packed'] > 0
+        assert est['arena'] > 0
+
+    # The per-thread copies of the correlation objects.
+    kk = treecorr.KKCorrelation(min_sep=1, max_sep=50, nbins=20)
+    ncopies, nbytes = kk.thread_copy_memory(num_threads=4)
+    assert ncopies == 4
+    assert nbytes >= 20 * 5 * 8
+    kk = treecorr.KKCorrelation(min_sep=1, max_sep=50, nbins=20, max_accum_mem=2.5*nbytes)
+    ncopies, nbytes2 = kk.thread_copy_memory(num_threads=4)
+    assert ncopies == 2
+    kkk = treecorr.KKKCorrelation(min_sep=1, max_sep=50, nbins=5)
+    ncopies, nbytes = kkk.thread_copy_memory(num_threads=4)
+    assert ncopies == 4
+    kkk = treecorr.KKKCorrelation(min_sep=1, max_sep=50, nbins=5, max_accum_mem=7*nbytes)
+    assert kkk.thread_copy_memory(num_threads=4)[0] == 4
+    assert kkk.thread_copy_memory(num_threads=4, nsets=3)[0] == 2
+    assert kkk.thread_copy_memory(num_threads=4, nsets=6)[0] == 1
+
+
+@timer
+def test_reuse_fields():
+    # With reuse_fields, a cached field with a finer tree is used rather than building a new
+    # one.  The correlations treat the cells below their own min_size as leaves, so the
+    # results are the same as with a new field.
+    ngal = 20000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    g1 = rng.normal(0,0.2, (ngal,) )
+    g2 = rng.normal(0,0.2, (ngal,) )
+    cat0 = treecorr.Catalog(x=x, y=y, g1=g1, g2=g2)
+    cat1 = treecorr.Catalog(x=x, y=y, g1=g1, g2=g2, reuse_fields=True)
+
+    # These have the same bin_size, so the same max_size.
+    config1 = dict(min_sep=1., max_sep=64., nbins=12, bin_slop=0.5)
+    config2 = dict(min_sep=4., max_sep=64., nbins=8, bin_slop=0.5)
+    gg1 = treecorr.GGCorrelation(config1)
+    gg1.process(cat1)
+    field1 = cat1.field
+    gg2 = treecorr.GGCorrelation(config2)
+    gg2.process(cat1)
+    assert cat1.field is field1
+    assert len(cat1.gfields.keys()) == 1
+
+    gg0 = treecorr.GGCorrelation(config2)
+    gg0.process(cat0)
+    assert cat0.field.min_size > field1.min_size
+    np.testing.assert_allclose(gg2.npairs, gg0.npairs, rtol=1.e-12)
+    np.testing.assert_allclose(gg2.weight, gg0.weight, rtol=1.e-12)
+    np.testing.assert_allclose(gg2.meanr, gg0.meanr, rtol=1.e-10)
+    np.testing.assert_allclose(gg2.xip, gg0.xip, rtol=1.e-10, atol=1.e-14)
+    np.testing.assert_allclose(gg2.xim, gg0.xim, rtol=1.e-10, atol=1.e-14)
+
+    # Also when the field is used by process_multi_binning, which classifies the pairs for
+    # each binning separately.
+    gg5 = treecorr.GGCorrelation(config2)
+    treecorr.process_multi_binning([gg5], cat1)
+    gg5.finalize(cat1.varg, cat1.varg)
+    assert cat1.field is field1
+    np.testing.assert_allclose(gg5.npairs, gg0.npairs, rtol=1.e-12)
+    np.testing.assert_allclose(gg5.weight, gg0.weight, rtol=1.e-12)
+    np.testing.assert_allclose(gg5.xip, gg0.xip, rtol=1.e-10, atol=1.e-14)
+    np.testing.assert_allclose(gg5.xim, gg0.xim, rtol=1.e-10, atol=1.e-14)
+
+    # Same for NN, which also uses the packed tree path here.
+    cat2 = treecorr.Catalog(x=x, y=y, reuse_fields=True, use_packed=True)
+    cat3 = treecorr.Catalog(x=x, y=y, use_packed=True)
+    nn1 = treecorr.NNCorrelation(config1)
+    nn1.process(cat2)
+    field2 = cat2.field
+    nn2 = treecorr.NNCorrelation(config2)
+    nn2.process(cat2)
+    assert cat2.field is field2
+    nn0 = treecorr.NNCorrelation(config2)
+    nn0.process(cat3)
+    np.testing.assert_allclose(nn2.npairs, nn0.npairs, rtol=1.e-12)
+    np.testing.assert_allclose(nn2.meanr, nn0.meanr, rtol=1.e-10)
+
+    # A coarser field isn't used for a finer one.
+    gg3 = treecorr.GGCorrelation(config1, min_sep=0.5, nbins=14)
+    gg3.process(cat1)
+    assert cat1.field is not field1
+    assert cat1.field.min_size < field1.min_size
+
+    # Nor is anything reused without reuse_fields.
+    field0 = cat0.field
+    gg4 = treecorr.GGCorrelation(config1, min_sep=8., nbins=6)
+    gg4.process(cat0)
+    assert cat0.field is not field0
+
+    # The trees of the dropped fields are deleted in the background.
+    del field0, field1, field2
+    cat0.clear_cache()
+    cat1.clear_cache()
+    cat2.clear_cache()
+    treecorr.wait_for_release()
+
 
 if __name__ == '__main__':
     test_ascii()
@@ -2106,4 +2973,18 @@ if __name__ == '__main__':
     test_list()
     test_write()
     test_field()
+    test_arena()
+    test_packed()
+    test_field_cache()
+    test_zero_copy()
+    test_field_insert()
+    test_field_chunks()
+    test_mmap()
+    test_lazy_values()
+    test_reorder_tree()
+    test_bucket_size()
+    test_split_method_pairs()
     test_lru()
+    test_merge_size()
+    test_field_memory()
+    test_reuse_fields()
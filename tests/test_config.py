@@ -14,6 +14,8 @@
 import treecorr
 import os
 import sys
+import subprocess
+import json
 import logging
 import numpy as np
 from unittest import mock
@@ -590,6 +592,168 @@ def test_util():
     with assert_raises(ValueError):
         treecorr.util.metric_enum('Invalid')
 
+@timer
+def test_thread_timing():
+    """Test recording the times of the threads in the C++ layer.
+    """
+    rng = np.random.RandomState(1234)
+    x = rng.uniform(0, 100, 2000)
+    y = rng.uniform(0, 100, 2000)
+    cat = treecorr.Catalog(x=x, y=y)
+    nn = treecorr.NNCorrelation(min_sep=1., max_sep=10., nbins=10, num_threads=2)
+    nnn = treecorr.NNNCorrelation(min_sep=1., max_sep=5., nbins=5, num_threads=2)
+
+    # Nothing is recorded until start_thread_timing is called.
+    nn.process(cat)
+    treecorr.start_thread_timing()
+    assert treecorr.stop_thread_timing() == []
+
+    treecorr.start_thread_timing()
+    nn.process(cat)
+    nnn.process(cat)
+    pcat = treecorr.Catalog(x=x, y=y, npatch=8)
+    report = treecorr.stop_thread_timing()
+    print('report = ',report)
+    names = [r['name'] for r in report]
+    assert names[0] == 'BinnedCorr2::process'
+    assert names[1] == 'BinnedCorr3::process'
+    assert 'FindCellsInPatches' in names[2:]
+    for r in report:
+        nthreads = r['nthreads']
+        assert 1 <= nthreads <= 2
+        assert len(r['busy']) == len(r['wait']) == len(r['merge']) == nthreads
+        assert len(r['cost']) > 0
+        assert np.all(r['cost'] >= 0.)
+        assert r['wall'] >= np.max(r['busy'])
+        np.testing.assert_allclose(np.sum(r['busy']), np.sum(r['cost']))
+        assert r['imbalance'] >= 1.
+
+    # After stopping, nothing more is recorded.
+    nn.process(cat)
+    treecorr.start_thread_timing()
+    assert treecorr.stop_thread_timing() == []
+
+@timer
+def test_thread_affinity():
+    """Test pinning the threads, which changes the order the top-level cells are done.
+    """
+    rng = np.random.RandomState(1234)
+    x = rng.uniform(0, 100, 5000)
+    y = rng.uniform(0, 100, 5000)
+    k = rng.normal(0, 1, 5000)
+    cat = treecorr.Catalog(x=x, y=y, k=k)
+    kk0 = treecorr.KKCorrelation(min_sep=1., max_sep=20., nbins=10, num_threads=4)
+    kk0.process(cat)
+
+    for policy in ['compact', 'spread', 'none']:
+        ok = treecorr.set_thread_affinity(policy)
+        print(policy, ok)
+        # Pinning only works on Linux with OpenMP, but 'none' is always fine.
+        assert ok or policy != 'none'
+        cat.clear_cache()
+        kk1 = treecorr.KKCorrelation(min_sep=1., max_sep=20., nbins=10, num_threads=4)
+        kk1.process(cat)
+        np.testing.assert_array_equal(kk1.npairs, kk0.npairs)
+        np.testing.assert_allclose(kk1.xi, kk0.xi, rtol=1.e-10)
+        np.testing.assert_allclose(kk1.meanr, kk0.meanr, rtol=1.e-10)
+
+    with assert_raises(ValueError):
+        treecorr.set_thread_affinity('close')
+
+@timer
+def test_tracing():
+    """Test the trace of the steps of a calculation in the Chrome trace format.
+    """
+    rng = np.random.RandomState(1234)
+    ra = rng.uniform(0, 20, 5000)
+    dec = rng.uniform(-10, 10, 5000)
+    g1 = rng.normal(0, 0.2, 5000)
+    g2 = rng.normal(0, 0.2, 5000)
+    file_name = os.path.join('output', 'test_tracing_cat.dat')
+    np.savetxt(file_name, np.array([ra, dec, g1, g2]).T)
+
+    # Nothing is recorded until start_tracing is called.
+    treecorr.start_tracing()
+    assert treecorr.stop_tracing() == []
+
+    treecorr.start_tracing()
+    cat = treecorr.Catalog(file_name, ra_col=1, dec_col=2, g1_col=3, g2_col=4,
+                           ra_units='deg', dec_units='deg', npatch=8, rng=rng)
+    gg = treecorr.GGCorrelation(min_sep=1., max_sep=100., nbins=10, sep_units='arcmin',
+                                var_method='jackknife', num_threads=2)
+    gg.process(cat)
+    print('varxip = ',gg.varxip)
+    trace_file = os.path.join('output', 'test_tracing.json')
+    events = treecorr.stop_tracing(trace_file)
+    names = set(e['name'] for e in events)
+    print('names = ',names)
+    for name in ['Catalog.load', 'GenerateXYZ', 'KMeansInitTree', 'KMeansIteration',
+                 'Field.run_kmeans', 'SetupTopLevelCells', 'BuildCell',
+                 'BinnedCorr2.process_all_auto', 'ProcessAuto2', 'ProcessCross2',
+                 'BinnedCorr2.sum_results', 'BinnedCorr2.estimate_cov']:
+        assert name in names
+    for e in events:
+        assert e['ph'] == 'X'
+        assert e['dur'] >= 0
+        assert e['cat'] == ('python' if '.' in e['name'] else 'C++')
+    assert [e['ts'] for e in events] == sorted(e['ts'] for e in events)
+
+    # The python spans contain the C++ calls they make on the same thread.
+    load = [e for e in events if e['name'] == 'Catalog.load'][0]
+    xyz = [e for e in events if e['name'] == 'GenerateXYZ'][0]
+    assert xyz['tid'] == load['tid']
+    assert load['ts'] <= xyz['ts'] <= xyz['ts'] + xyz['dur'] <= load['ts'] + load['dur']
+    assert xyz['args']['i'] == 5000
+    iters = [e['args']['i'] for e in events if e['name'] == 'KMeansIteration']
+    assert iters == list(range(len(iters)))
+    cross = [e for e in events if e['name'] == 'ProcessCross2' and 'args' in e]
+    assert all(e['args']['i'] != e['args']['j'] for e in cross)
+
+    with open(trace_file) as fin:
+        trace = json.load(fin)
+    assert trace['traceEvents'][0]['ph'] == 'M'
+    assert trace['traceEvents'][0]['args']['name'] == 'python'
+    assert [e for e in trace['traceEvents'] if e['ph'] == 'X'] == events
+
+    # After stopping, nothing more is recorded.
+    gg.process(cat)
+    treecorr.start_tracing()
+    assert treecorr.stop_tracing() == []
+
+@timer
+def test_isa():
+    """Test the choice of instruction set for the vectorized loops in the C++ layer.
+    """
+    isa = treecorr.get_isa()
+    print('isa = ',isa)
+    assert isa in ['default', 'sse4.2', 'avx2', 'avx512']
+
+    # TREECORR_ISA picks a lower one when the library is loaded, so check in a new process.
+    # The results should match to the rounding errors.
+    code = ("import treecorr, numpy as np; "
+            "rng = np.random.RandomState(1234); "
+            "cat = treecorr.Catalog(ra=rng.uniform(0,360,5000), dec=rng.uniform(-90,90,5000), "
+            "ra_units='deg', dec_units='deg', npatch=20, rng=rng); "
+            "nn = treecorr.NNCorrelation(min_sep=10., max_sep=300., nbins=10, sep_units='arcmin'); "
+            "nn.process(cat); "
+            "print(treecorr.get_isa()); print(repr(list(cat.x[:5]))); "
+            "print(repr(list(cat.patch[:20]))); print(repr(list(nn.npairs)))")
+    outputs = []
+    for name in ['default', isa, 'bogus']:
+        env = dict(os.environ, TREECORR_ISA=name)
+        p = subprocess.Popen([sys.executable, '-c', code], env=env, stdout=subprocess.PIPE)
+        out = p.communicate()[0].decode().split('\n')
+        print(name,':',out)
+        outputs.append(out)
+    assert outputs[0][0] == 'default'
+    assert outputs[1][0] == isa
+    assert outputs[2][0] == isa  # Unknown names are ignored.
+    np.testing.assert_allclose(eval(outputs[0][1]), eval(outputs[1][1]), rtol=1.e-12)
+    # A rare point or pair that is right at a boundary could go the other way.
+    assert np.sum(np.array(eval(outputs[0][2])) != np.array(eval(outputs[1][2]))) <= 1
+    np.testing.assert_allclose(eval(outputs[0][3]), eval(outputs[1][3]), rtol=1.e-4)
+
+
 if __name__ == '__main__':
     test_parse_variables()
     test_parse_bool()
@@ -602,4 +766,8 @@ if __name__ == '__main__':
     test_merge()
     test_convert()
     test_omp()
+    test_thread_timing()
+    test_thread_affinity()
+    test_tracing()
+    test_isa()
     test_util()
@@ -13,6 +13,7 @@
 
 import numpy as np
 import os
+import time
 import coord
 import treecorr
 
@@ -1438,6 +1439,521 @@ def test_double():
     np.testing.assert_allclose(gg_2.xim_im, gg.xim_im, rtol=1.e-7)
 
 
+@timer
+def test_dense_cluster():
+    # With half the galaxies in one small cluster, most of the work is in a few pairs of
+    # top-level cells.  These are split into tasks for the other threads to pick up.
+    # Check that the result doesn't depend on the number of threads.
+    ngal = 20000
+    rng = np.random.RandomState(8675309)
+    x = np.concatenate([rng.uniform(0,1, (ngal//2,) ), rng.uniform(0,100, (ngal//2,) )])
+    y = np.concatenate([rng.uniform(0,1, (ngal//2,) ), rng.uniform(0,100, (ngal//2,) )])
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, g1=g1, g2=g2)
+
+    gg1 = treecorr.GGCorrelation(min_sep=0.01, max_sep=10, nbins=20, bin_slop=0.5)
+    t0 = time.time()
+    gg1.process(cat, num_threads=1)
+    t1 = time.time()
+    gg4 = treecorr.GGCorrelation(min_sep=0.01, max_sep=10, nbins=20, bin_slop=0.5)
+    gg4.process(cat, num_threads=4)
+    t2 = time.time()
+    print('time for 1 thread = ',t1-t0)
+    print('time for 4 threads = ',t2-t1)
+    np.testing.assert_array_equal(gg4.npairs, gg1.npairs)
+    np.testing.assert_allclose(gg4.meanr, gg1.meanr, rtol=1.e-10)
+    np.testing.assert_allclose(gg4.xip, gg1.xip, rtol=1.e-8, atol=1.e-12)
+    np.testing.assert_allclose(gg4.xim, gg1.xim, rtol=1.e-8, atol=1.e-12)
+
+    # Also the cross correlation.
+    gg1.process(cat, cat, num_threads=1)
+    gg4.process(cat, cat, num_threads=4)
+    np.testing.assert_array_equal(gg4.npairs, gg1.npairs)
+    np.testing.assert_allclose(gg4.xip, gg1.xip, rtol=1.e-8, atol=1.e-12)
+    np.testing.assert_allclose(gg4.xim, gg1.xim, rtol=1.e-8, atol=1.e-12)
+
+
+@timer
+def test_max_accum_mem():
+    # With max_accum_mem, some threads share the copies of the results, which shouldn't change
+    # the answer.  TwoD with many bins is the main use case.
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, g1=g1, g2=g2)
+
+    gg0 = treecorr.GGCorrelation(max_sep=20, nbins=100, bin_type='TwoD', bin_slop=0)
+    gg0.process(cat, num_threads=1)
+    assert gg0.max_accum_mem == 0
+
+    # Each copy is 8 arrays of 100x100 doubles = 640000 bytes.
+    for max_mem in [1.e3, 1.5e6, 1.e9]:
+        gg1 = treecorr.GGCorrelation(max_sep=20, nbins=100, bin_type='TwoD', bin_slop=0,
+                                     max_accum_mem=max_mem)
+        assert gg1.max_accum_mem == max_mem
+        gg1.process(cat, num_threads=4)
+        np.testing.assert_array_equal(gg1.npairs, gg0.npairs)
+        np.testing.assert_allclose(gg1.weight, gg0.weight, rtol=1.e-10)
+        np.testing.assert_allclose(gg1.xip, gg0.xip, rtol=1.e-8, atol=1.e-12)
+        np.testing.assert_allclose(gg1.xim, gg0.xim, rtol=1.e-8, atol=1.e-12)
+
+
+@timer
+def test_float_accum():
+    # With float_accum, the copies for each thread use single precision, but they are added
+    # to the double precision results every few pairs, so the results should be very close.
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    w = rng.uniform(0.5,1.5, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, w=w, g1=g1, g2=g2)
+
+    for kwargs in [dict(max_sep=20, nbins=100, bin_type='TwoD', bin_slop=0),
+                   dict(min_sep=1, max_sep=50, nbins=20)]:
+        gg0 = treecorr.GGCorrelation(**kwargs)
+        gg0.process(cat, num_threads=4)
+        assert gg0.float_accum is False
+
+        # Also check it when the threads share copies.
+        for max_mem in [0, 1.e3]:
+            gg1 = treecorr.GGCorrelation(float_accum=True, max_accum_mem=max_mem, **kwargs)
+            assert gg1.float_accum is True
+            gg1.process(cat, num_threads=4)
+            np.testing.assert_allclose(gg1.npairs, gg0.npairs, rtol=1.e-6)
+            np.testing.assert_allclose(gg1.weight, gg0.weight, rtol=1.e-6)
+            np.testing.assert_allclose(gg1.meanr, gg0.meanr, rtol=1.e-6)
+            np.testing.assert_allclose(gg1.meanlogr, gg0.meanlogr, rtol=1.e-6, atol=1.e-6)
+            np.testing.assert_allclose(gg1.xip, gg0.xip, rtol=1.e-5, atol=1.e-8)
+            np.testing.assert_allclose(gg1.xim, gg0.xim, rtol=1.e-5, atol=1.e-8)
+
+
+@timer
+def test_bin_slop_per_bin():
+    # bin_slop may be given for each bin.
+    ngal = 3000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, g1=g1, g2=g2)
+    kwargs = dict(min_sep=1, max_sep=50, nbins=20)
+
+    # The same value for every bin is the same as a single value.
+    gg0 = treecorr.GGCorrelation(bin_slop=0.5, **kwargs)
+    gg0.process(cat)
+    gg1 = treecorr.GGCorrelation(bin_slop=[0.5]*20, **kwargs)
+    gg1.process(cat)
+    np.testing.assert_array_equal(gg1.bin_slop, 0.5)
+    assert gg1.b == gg0.b
+    np.testing.assert_array_equal(gg1.npairs, gg0.npairs)
+    np.testing.assert_allclose(gg1.xip, gg0.xip, rtol=1.e-12, atol=1.e-14)
+    np.testing.assert_allclose(gg1.xim, gg0.xim, rtol=1.e-12, atol=1.e-14)
+
+    # With bin_slop=0 in the first half, those bins are exact, since each pair of cells uses
+    # the smallest bin_slop of the bins it might fall into.
+    bin_slop = np.zeros(20)
+    bin_slop[10:] = 1
+    gg2 = treecorr.GGCorrelation(bin_slop=bin_slop, **kwargs)
+    gg2.process(cat)
+    assert gg2.b == 0
+    gg3 = treecorr.GGCorrelation(bin_slop=0, **kwargs)
+    gg3.process(cat)
+    np.testing.assert_array_equal(gg2.npairs[:10], gg3.npairs[:10])
+    np.testing.assert_allclose(gg2.xip[:10], gg3.xip[:10], rtol=1.e-10, atol=1.e-12)
+    np.testing.assert_allclose(gg2.xim[:10], gg3.xim[:10], rtol=1.e-10, atol=1.e-12)
+
+    with assert_raises(ValueError):
+        treecorr.GGCorrelation(bin_slop=[0.5]*19, **kwargs)
+    with assert_raises(ValueError):
+        treecorr.GGCorrelation(bin_slop=[-0.5]*20, **kwargs)
+    with assert_raises(ValueError):
+        treecorr.GGCorrelation(bin_slop=[0.5]*400, max_sep=20, nbins=20, bin_type='TwoD')
+
+
+@timer
+def test_process_multi_binning():
+    # Processing several binnings at once with process_multi_binning should give the same
+    # answer as doing them separately.
+    ngal = 3000
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(-5*s, 5*s, (ngal,) )
+    y = rng.uniform(-5*s, 5*s, (ngal,) )
+    w = rng.random_sample(ngal)
+    g1 = rng.normal(0, 0.2, (ngal,) )
+    g2 = rng.normal(0, 0.2, (ngal,) )
+    cat1 = treecorr.Catalog(x=x[:2000], y=y[:2000], w=w[:2000], g1=g1[:2000], g2=g2[:2000])
+    cat2 = treecorr.Catalog(x=x[1000:], y=y[1000:], w=w[1000:], g1=g1[1000:], g2=g2[1000:])
+
+    configs = [ dict(min_sep=1., max_sep=30., nbins=15, bin_slop=0),
+                dict(min_sep=2., max_sep=20., nbins=9, bin_type='Linear', bin_slop=0),
+                dict(max_sep=10., nbins=10, bin_type='TwoD', bin_slop=0),
+                dict(min_sep=0.5, max_sep=50., nbins=40, bin_slop=0) ]
+
+    for cats in [ (cat1,), (cat1, cat2) ]:
+        gg1 = [ treecorr.GGCorrelation(config) for config in configs ]
+        for gg in gg1:
+            gg.process(*cats)
+        gg2 = [ treecorr.GGCorrelation(config) for config in configs ]
+        treecorr.process_multi_binning(gg2, *cats)
+        for gg in gg2:
+            gg.finalize(cat1.varg, cats[-1].varg)
+        for ga, gb in zip(gg1, gg2):
+            np.testing.assert_array_equal(gb.npairs, ga.npairs)
+            np.testing.assert_allclose(gb.weight, ga.weight)
+            np.testing.assert_allclose(gb.meanr, ga.meanr)
+            np.testing.assert_allclose(gb.xip, ga.xip, atol=1.e-12)
+            np.testing.assert_allclose(gb.xim, ga.xim, atol=1.e-12)
+
+    # With bin_slop > 0, the trees are built with the smallest min_size, and each binning
+    # treats the cells below its own min_size as leaves.  If the max_size (max_sep * b) is the
+    # same, this is still exactly the same as doing them separately.
+    configs = [ dict(max_sep=30., bin_size=0.2, nbins=15, bin_slop=0.5),
+                dict(max_sep=30., bin_size=0.2, nbins=6, bin_slop=0.5) ]
+    for cats in [ (cat1,), (cat1, cat2) ]:
+        gg1 = [ treecorr.GGCorrelation(config) for config in configs ]
+        for gg in gg1:
+            gg.process(*cats)
+        gg2 = [ treecorr.GGCorrelation(config) for config in configs ]
+        treecorr.process_multi_binning(gg2, *cats)
+        for gg in gg2:
+            gg.finalize(cat1.varg, cats[-1].varg)
+        assert gg2[0]._get_minmax_size()[0] < gg2[1]._get_minmax_size()[0]
+        for ga, gb in zip(gg1, gg2):
+            np.testing.assert_array_equal(gb.npairs, ga.npairs)
+            np.testing.assert_allclose(gb.weight, ga.weight)
+            np.testing.assert_allclose(gb.xip, ga.xip, atol=1.e-12)
+            np.testing.assert_allclose(gb.xim, ga.xim, atol=1.e-12)
+
+    # Otherwise the top-level cells are smaller than some of them would use, so they are
+    # only the same within the accuracy allowed by bin_slop.
+    configs = [ dict(min_sep=1., max_sep=30., nbins=15, bin_slop=0.5),
+                dict(min_sep=2., max_sep=20., nbins=9, bin_type='Linear', bin_slop=0.5),
+                dict(min_sep=0.5, max_sep=50., nbins=40, bin_slop=0.5) ]
+    for cats in [ (cat1,), (cat1, cat2) ]:
+        gg1 = [ treecorr.GGCorrelation(config) for config in configs ]
+        for gg in gg1:
+            gg.process(*cats)
+        gg2 = [ treecorr.GGCorrelation(config) for config in configs ]
+        treecorr.process_multi_binning(gg2, *cats)
+        for gg in gg2:
+            gg.finalize(cat1.varg, cats[-1].varg)
+        for ga, gb in zip(gg1, gg2):
+            np.testing.assert_allclose(gb.npairs, ga.npairs, rtol=1.e-2)
+            np.testing.assert_allclose(gb.weight, ga.weight, rtol=1.e-2)
+            np.testing.assert_allclose(gb.xip, ga.xip, rtol=1.e-2, atol=2.e-4)
+            np.testing.assert_allclose(gb.xim, ga.xim, rtol=1.e-2, atol=2.e-4)
+
+    # The correlations have to be the same type and use the same tree parameters.
+    with assert_raises(TypeError):
+        treecorr.process_multi_binning([gg2[0], treecorr.KKCorrelation(configs[0])], cat1)
+    with assert_raises(ValueError):
+        treecorr.process_multi_binning([gg2[0], treecorr.GGCorrelation(configs[1], max_top=3)],
+                                       cat1)
+    with assert_raises(ValueError):
+        treecorr.process_multi_binning([], cat1)
+    with assert_raises(ValueError):
+        treecorr.process_multi_binning(gg2 * 17, cat1)
+
+
+@timer
+def test_record_interactions():
+    # Replaying the recorded interactions with new shears should give the same answer as
+    # processing the new shears normally.
+    ngal = 3000
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(-5*s, 5*s, (ngal,) )
+    y = rng.uniform(-5*s, 5*s, (ngal,) )
+    w = rng.random_sample(ngal)
+    g1a, g2a, g1b, g2b = rng.normal(0, 0.2, (4,ngal) )
+    cat1a = treecorr.Catalog(x=x, y=y, w=w, g1=g1a, g2=g2a)
+    cat1b = treecorr.Catalog(x=x, y=y, w=w, g1=g1b, g2=g2b)
+    cat2a = treecorr.Catalog(x=y[:1000], y=x[:1000], g1=g2a[:1000], g2=g1a[:1000])
+    cat2b = treecorr.Catalog(x=y[:1000], y=x[:1000], g1=g2b[:1000], g2=g1b[:1000])
+
+    for config in [ dict(min_sep=1., max_sep=30., nbins=15, bin_slop=1),
+                    dict(max_sep=10., nbins=10, bin_type='TwoD', bin_slop=0.5) ]:
+        for cats_a, cats_b in [ ((cat1a,), (cat1b,)), ((cat1a, cat2a), (cat1b, cat2b)) ]:
+            gga = treecorr.GGCorrelation(config)
+            interactions = gga.record_interactions(*cats_a)
+            gga.finalize(cat1a.varg, cats_a[-1].varg)
+            gg0 = treecorr.GGCorrelation(config)
+            gg0.process(*cats_a)
+            np.testing.assert_array_equal(gga.npairs, gg0.npairs)
+            np.testing.assert_allclose(gga.xip, gg0.xip, rtol=1.e-10, atol=1.e-14)
+            assert interactions.size > 0
+
+            gg1 = treecorr.GGCorrelation(config)
+            gg1.process(*cats_b)
+            gg2 = treecorr.GGCorrelation(config)
+            gg2.replay_interactions(interactions, *cats_b)
+            gg2.finalize(cat1b.varg, cats_b[-1].varg)
+            np.testing.assert_array_equal(gg2.npairs, gg1.npairs)
+            np.testing.assert_allclose(gg2.weight, gg1.weight, rtol=1.e-10)
+            np.testing.assert_allclose(gg2.meanr, gg1.meanr, rtol=1.e-10)
+            np.testing.assert_allclose(gg2.meanlogr, gg1.meanlogr, rtol=1.e-10)
+            np.testing.assert_allclose(gg2.xip, gg1.xip, rtol=1.e-10, atol=1.e-14)
+            np.testing.assert_allclose(gg2.xim, gg1.xim, rtol=1.e-10, atol=1.e-14)
+            np.testing.assert_allclose(gg2.xip_im, gg1.xip_im, rtol=1.e-10, atol=1.e-14)
+
+    # The list can be written to a file and read back.
+    file_name = os.path.join('output','gg_interactions.dat')
+    interactions.write(file_name)
+    interactions2 = treecorr.InteractionList.read(file_name)
+    assert interactions2.size == interactions.size
+    gg3 = treecorr.GGCorrelation(config)
+    gg3.replay_interactions(interactions2, cat1b, cat2b)
+    gg3.finalize(cat1b.varg, cat2b.varg)
+    np.testing.assert_allclose(gg3.xip, gg1.xip, rtol=1.e-10, atol=1.e-14)
+    with assert_raises(OSError):
+        treecorr.InteractionList.read(os.path.join('data','gg_map.out'))
+
+    # Different positions are an error.
+    cat3 = treecorr.Catalog(x=x[:1000], y=y[:1000], g1=g1a[:1000], g2=g2a[:1000])
+    with assert_raises(ValueError):
+        gg3.replay_interactions(interactions, cat3, cat2b)
+    # As is a different binning.
+    with assert_raises(ValueError):
+        treecorr.GGCorrelation(config, nbins=12).replay_interactions(interactions, cat1b, cat2b)
+    # Or the same number of bins over a different range, or a different bin_slop or metric.
+    with assert_raises(ValueError):
+        treecorr.GGCorrelation(config, max_sep=12.).replay_interactions(interactions, cat1b, cat2b)
+    with assert_raises(ValueError):
+        treecorr.GGCorrelation(config, bin_slop=0.3).replay_interactions(interactions,
+                                                                          cat1b, cat2b)
+    with assert_raises(ValueError):
+        treecorr.GGCorrelation(config, period=1000.).replay_interactions(
+                interactions, cat1b, cat2b, metric='Periodic')
+    # NN doesn't have anything to replay.
+    with assert_raises(TypeError):
+        treecorr.NNCorrelation(config).record_interactions(cat1a)
+
+
+@timer
+def test_process_async():
+    # process_async should give the same answer as process, while letting the caller build
+    # the fields for the next catalogs.
+    ngal = 5000
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    cats = []
+    for i in range(3):
+        x = rng.normal(0,s, (ngal,) )
+        y = rng.normal(0,s, (ngal,) )
+        g1 = rng.normal(0,0.2, (ngal,) )
+        g2 = rng.normal(0,0.2, (ngal,) )
+        cats.append(treecorr.Catalog(x=x, y=y, g1=g1, g2=g2))
+
+    config = dict(min_sep=1., max_sep=30., nbins=20, bin_slop=0.5)
+    gg1 = treecorr.GGCorrelation(config)
+    gg1.process(cats[0], cats[1])
+
+    gg2 = treecorr.GGCorrelation(config)
+    future = gg2.process_async(cats[0], cats[1])
+    cats[2].getGField(min_size=gg2._min_sep*gg2.b/2, max_size=gg2._max_sep*gg2.b/2)
+    assert future.result() is None
+    np.testing.assert_array_equal(gg2.npairs, gg1.npairs)
+    np.testing.assert_allclose(gg2.xip, gg1.xip, rtol=1.e-12, atol=1.e-14)
+    np.testing.assert_allclose(gg2.xim, gg1.xim, rtol=1.e-12, atol=1.e-14)
+
+    # With an explicit executor, several can run at once (with different catalogs).
+    import concurrent.futures
+    gg3 = treecorr.GGCorrelation(config)
+    gg4 = treecorr.GGCorrelation(config)
+    with concurrent.futures.ThreadPoolExecutor(max_workers=2) as executor:
+        f3 = gg3.process_async(cats[0], cats[1], executor=executor, num_threads=1)
+        f4 = gg4.process_async(cats[2], executor=executor, num_threads=1)
+        f3.result()
+        f4.result()
+    np.testing.assert_allclose(gg3.xip, gg1.xip, rtol=1.e-12, atol=1.e-14)
+    gg5 = treecorr.GGCorrelation(config)
+    gg5.process(cats[2])
+    np.testing.assert_allclose(gg4.xip, gg5.xip, rtol=1.e-12, atol=1.e-14)
+
+    # Errors are raised by result().
+    gg6 = treecorr.GGCorrelation(config)
+    future = gg6.process_async(cats[0], cats[1], metric='Rperp')
+    with assert_raises(ValueError):
+        future.result()
+
+
+@timer
+def test_fft_min_sep():
+    # With fft_min_sep, the large bins are computed on a grid with FFTs.  The pixel size is
+    # based on bin_slop, so the results should be about as accurate as the tree's.
+    ngal = 20000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    w = rng.uniform(0.5,1.5, (ngal,) )
+    g1 = 0.05 * np.cos((x+y)/15.) + rng.normal(0,0.02, (ngal,) )
+    g2 = 0.05 * np.sin(y/12.) + rng.normal(0,0.02, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, w=w, g1=g1, g2=g2)
+    kwargs = dict(min_sep=1, max_sep=50, nbins=10)
+
+    gg0 = treecorr.GGCorrelation(bin_slop=0, **kwargs)
+    gg0.process(cat)
+    gg1 = treecorr.GGCorrelation(bin_slop=0.2, fft_min_sep=8, **kwargs)
+    assert gg1.fft_min_sep == 8
+    gg1.process(cat)
+    print('gg0.weight = ',gg0.weight)
+    print('gg1.weight = ',gg1.weight)
+    print('gg0.xip = ',gg0.xip)
+    print('gg1.xip = ',gg1.xip)
+    print('gg0.xim = ',gg0.xim)
+    print('gg1.xim = ',gg1.xim)
+    np.testing.assert_allclose(gg1.npairs, gg0.npairs, rtol=0.02)
+    np.testing.assert_allclose(gg1.weight, gg0.weight, rtol=0.02)
+    np.testing.assert_allclose(gg1.meanr, gg0.meanr, rtol=0.01)
+    np.testing.assert_allclose(gg1.xip, gg0.xip, rtol=0.02, atol=1.e-6)
+    np.testing.assert_allclose(gg1.xim, gg0.xim, rtol=0.05, atol=1.e-5)
+
+    # Cross correlations and the NN tot value work too.
+    cat2 = treecorr.Catalog(x=x[::2], y=y[::2], w=w[::2])
+    ng0 = treecorr.NGCorrelation(bin_slop=0, **kwargs)
+    ng0.process(cat2, cat)
+    ng1 = treecorr.NGCorrelation(bin_slop=0.2, fft_min_sep=8, **kwargs)
+    ng1.process(cat2, cat)
+    np.testing.assert_allclose(ng1.weight, ng0.weight, rtol=0.02)
+    np.testing.assert_allclose(ng1.xi, ng0.xi, rtol=0.05, atol=1.e-5)
+    nn0 = treecorr.NNCorrelation(bin_slop=0.2, **kwargs)
+    nn0.process(cat2)
+    nn1 = treecorr.NNCorrelation(bin_slop=0.2, fft_min_sep=8, **kwargs)
+    nn1.process(cat2)
+    assert nn1.tot == nn0.tot
+    np.testing.assert_allclose(nn1.npairs, nn0.npairs, rtol=0.02)
+
+    # If the grid would be too large, e.g. from an outlier, all the bins use the tree.
+    cat3 = treecorr.Catalog(x=np.append(x[::2], 1.e6), y=np.append(y[::2], 0.))
+    nn2 = treecorr.NNCorrelation(bin_slop=0.2, **kwargs)
+    nn2.process(cat3)
+    nn3 = treecorr.NNCorrelation(bin_slop=0.2, fft_min_sep=8, **kwargs)
+    nn3.process(cat3)
+    assert nn3.tot == nn2.tot
+    np.testing.assert_array_equal(nn3.npairs, nn2.npairs)
+
+    # Invalid uses.
+    with assert_raises(ValueError):
+        treecorr.GGCorrelation(bin_slop=0, fft_min_sep=8, **kwargs)
+    with assert_raises(ValueError):
+        treecorr.GGCorrelation(fft_min_sep=0, **kwargs)
+    with assert_raises(ValueError):
+        treecorr.GGCorrelation(max_sep=20, nbins=10, bin_type='TwoD', fft_min_sep=8)
+    scat = treecorr.Catalog(ra=x, dec=y-50, ra_units='deg', dec_units='deg', g1=g1, g2=g2)
+    gg2 = treecorr.GGCorrelation(bin_slop=0.2, fft_min_sep=8, sep_units='arcmin', **kwargs)
+    with assert_raises(ValueError):
+        gg2.process(scat)
+    pcat = treecorr.Catalog(x=x, y=y, w=w, g1=g1, g2=g2, npatch=4)
+    with assert_raises(ValueError):
+        gg1.process(pcat)
+
+
+@timer
+def test_process_delta():
+    # Updating the sums with process_delta for some objects being added and removed should
+    # give the same answer as processing the updated catalog.
+    ngal = 3000
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(0,s, (ngal,) )
+    y = rng.normal(0,s, (ngal,) )
+    g1 = rng.normal(0,0.2, (ngal,) )
+    g2 = rng.normal(0,0.2, (ngal,) )
+    # Objects [0,2500) don't change, [2500,2800) are removed, and [2800,3000) are added.
+    def cat(i1, i2):
+        return treecorr.Catalog(x=x[i1:i2], y=y[i1:i2], g1=g1[i1:i2], g2=g2[i1:i2])
+    same = cat(0,2500)
+    removed = cat(2500,2800)
+    added = cat(2800,3000)
+    old = treecorr.Catalog(x=x[:2800], y=y[:2800], g1=g1[:2800], g2=g2[:2800])
+    new = treecorr.Catalog(x=np.concatenate([x[:2500], x[2800:]]),
+                           y=np.concatenate([y[:2500], y[2800:]]),
+                           g1=np.concatenate([g1[:2500], g1[2800:]]),
+                           g2=np.concatenate([g2[:2500], g2[2800:]]))
+
+    config = dict(min_sep=1., max_sep=30., nbins=20, bin_slop=0)
+    gg1 = treecorr.GGCorrelation(config)
+    gg1.process(new)
+
+    gg = treecorr.GGCorrelation(config)
+    gg.process(old, finalize=False)
+    gg.process_delta(same, added1=added, removed1=removed)
+    gg.finalize(new.varg, new.varg)
+    np.testing.assert_allclose(gg.npairs, gg1.npairs)
+    np.testing.assert_allclose(gg.weight, gg1.weight)
+    np.testing.assert_allclose(gg.meanr, gg1.meanr, rtol=1.e-10)
+    np.testing.assert_allclose(gg.xip, gg1.xip, rtol=1.e-8, atol=1.e-12)
+    np.testing.assert_allclose(gg.xim, gg1.xim, rtol=1.e-8, atol=1.e-12)
+
+    # With bin_slop > 0, it's close, but not exact.
+    config2 = dict(min_sep=1., max_sep=30., nbins=20, bin_slop=0.5)
+    gg2 = treecorr.GGCorrelation(config2)
+    gg2.process(new)
+    gg = treecorr.GGCorrelation(config2)
+    gg.process(old, finalize=False)
+    gg.process_delta(same, added1=added, removed1=removed)
+    gg.finalize(new.varg, new.varg)
+    np.testing.assert_allclose(gg.npairs, gg2.npairs, rtol=1.e-2)
+    np.testing.assert_allclose(gg.xip, gg2.xip, rtol=1.e-2, atol=2.e-4)
+
+    # Cross-correlation, with only the second catalog changing.
+    gg3 = treecorr.GGCorrelation(config)
+    gg3.process(cat(0,1000), new)
+    gg = treecorr.GGCorrelation(config)
+    gg.process(cat(0,1000), old, finalize=False)
+    gg.process_delta(cat(0,1000), same, added2=added, removed2=removed)
+    gg.finalize(new.varg, new.varg)
+    np.testing.assert_allclose(gg.npairs, gg3.npairs)
+    np.testing.assert_allclose(gg.xip, gg3.xip, rtol=1.e-8, atol=1.e-12)
+
+    # And with both changing.
+    gg4 = treecorr.GGCorrelation(config)
+    gg4.process(new, new)
+    gg = treecorr.GGCorrelation(config)
+    gg.process(old, old, finalize=False)
+    gg.process_delta(same, same, added1=added, removed1=removed, added2=added, removed2=removed)
+    gg.finalize(new.varg, new.varg)
+    np.testing.assert_allclose(gg.npairs, gg4.npairs)
+    np.testing.assert_allclose(gg.xip, gg4.xip, rtol=1.e-8, atol=1.e-12)
+
+    # TwoD puts the pairs of an auto-correlation in both mirrored bins.
+    config5 = dict(max_sep=20., nbins=10, bin_slop=0, bin_type='TwoD')
+    gg5 = treecorr.GGCorrelation(config5)
+    gg5.process(new)
+    gg = treecorr.GGCorrelation(config5)
+    gg.process(old, finalize=False)
+    gg.process_delta(same, added1=added, removed1=removed)
+    gg.finalize(new.varg, new.varg)
+    np.testing.assert_allclose(gg.npairs, gg5.npairs)
+    np.testing.assert_allclose(gg.weight, gg5.weight)
+    np.testing.assert_allclose(gg.xip, gg5.xip, rtol=1.e-8, atol=1.e-12)
+    np.testing.assert_allclose(gg.xim, gg5.xim, rtol=1.e-8, atol=1.e-12)
+
+    # NN needs tot updated as well.
+    nn1 = treecorr.NNCorrelation(config)
+    nn1.process(new)
+    nn = treecorr.NNCorrelation(config)
+    nn.process(old, finalize=False)
+    nn.process_delta(same, added1=added, removed1=removed)
+    nn.finalize()
+    np.testing.assert_allclose(nn.npairs, nn1.npairs)
+    np.testing.assert_allclose(nn.tot, nn1.tot)
+
+    with assert_raises(TypeError):
+        gg.process_delta(same, added2=added)
+    with assert_raises(TypeError):
+        treecorr.NGCorrelation(config).process_delta(same, added1=added)
+
+
 if __name__ == '__main__':
     test_direct()
     test_direct_spherical()
@@ -1450,3 +1966,12 @@ if __name__ == '__main__':
     test_haloellip()
     test_varxi()
     test_double()
+    test_dense_cluster()
+    test_max_accum_mem()
+    test_float_accum()
+    test_bin_slop_per_bin()
+    test_process_multi_binning()
+    test_record_interactions()
+    test_process_async()
+    test_fft_min_sep()
+    test_process_delta()
@@ -2324,6 +2324,115 @@ def test_vargam():
     np.testing.assert_allclose(var_map, var_map3, rtol=0.3)
 
 
+@timer
+def test_max_accum_mem():
+    # With max_accum_mem, some threads share the copies of the results, which shouldn't change
+    # the answer.
+    ngal = 2000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, g1=g1, g2=g2)
+
+    kwargs = dict(min_sep=1., max_sep=20., nbins=10, nubins=5, nvbins=5, bin_slop=0.5)
+    ggg0 = treecorr.GGGCorrelation(**kwargs)
+    ggg0.process(cat, num_threads=1)
+    assert ggg0.max_accum_mem == 0
+
+    # Each copy is 18 arrays of 10x5x10 doubles = 72000 bytes.
+    for max_mem in [1.e3, 1.5e5, 1.e9]:
+        ggg1 = treecorr.GGGCorrelation(max_accum_mem=max_mem, **kwargs)
+        assert ggg1.max_accum_mem == max_mem
+        ggg1.process(cat, num_threads=4)
+        np.testing.assert_array_equal(ggg1.ntri, ggg0.ntri)
+        np.testing.assert_allclose(ggg1.weight, ggg0.weight, rtol=1.e-10)
+        np.testing.assert_allclose(ggg1.gam0, ggg0.gam0, rtol=1.e-8, atol=1.e-12)
+        np.testing.assert_allclose(ggg1.gam1, ggg0.gam1, rtol=1.e-8, atol=1.e-12)
+        np.testing.assert_allclose(ggg1.gam2, ggg0.gam2, rtol=1.e-8, atol=1.e-12)
+        np.testing.assert_allclose(ggg1.gam3, ggg0.gam3, rtol=1.e-8, atol=1.e-12)
+
+@timer
+def test_progress():
+    # The progress array is updated while the calculation runs, and should show all the work
+    # as done at the end.
+    ngal = 3000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    g1 = rng.normal(0,0.1, (ngal,) )
+    g2 = rng.normal(0,0.1, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, g1=g1, g2=g2)
+
+    ggg = treecorr.GGGCorrelation(min_sep=1., max_sep=20., nbins=5, nubins=3, nvbins=3)
+    np.testing.assert_array_equal(ggg.progress, [0,0])
+
+    # Poll the progress from another thread while it runs.
+    import threading
+    values = []
+    t = threading.Thread(target=ggg.process, args=(cat,))
+    t.start()
+    while t.is_alive():
+        values.append(ggg.progress.copy())
+        t.join(0.01)
+    values.append(ggg.progress.copy())
+    print('progress values = ',values)
+    done = [v[0] for v in values]
+    assert np.all(np.diff(done) >= 0)
+    assert ggg.progress[1] > 0
+    np.testing.assert_allclose(ggg.progress[0], ggg.progress[1], rtol=1.e-10)
+
+    # Each call to process starts over.
+    total = ggg.progress[1]
+    ggg.process(cat, cat)
+    assert ggg.progress[1] > 0
+    np.testing.assert_allclose(ggg.progress[0], ggg.progress[1], rtol=1.e-10)
+    ggg.process(cat, cat, cat)
+    np.testing.assert_allclose(ggg.progress[0], ggg.progress[1], rtol=1.e-10)
+    ggg.process(cat)
+    np.testing.assert_allclose(ggg.progress, [total, total], rtol=1.e-10)
+
+    # With patches, the progress of all the patches is reported.
+    catp = treecorr.Catalog(x=x, y=y, g1=g1, g2=g2, npatch=4, rng=rng)
+    ggg.process(catp)
+    assert ggg.progress[1] > 0
+    np.testing.assert_allclose(ggg.progress[0], ggg.progress[1], rtol=1.e-10)
+
+@timer
+def test_sample():
+    # With sample_rate, only a random sample of the top-level cells is used, and sample_var
+    # estimates the variance of gam0 from the sampling.  (cf. test_kkk.py:test_sample)
+    ngal = 3000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    w = rng.uniform(0.5,1.5, (ngal,) )
+    g1 = 0.05 * np.cos((x+y)/15.) + rng.normal(0,0.02, (ngal,) )
+    g2 = 0.05 * np.sin(y/12.) + rng.normal(0,0.02, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, w=w, g1=g1, g2=g2)
+
+    config = dict(min_sep=1., max_sep=20., nbins=5, nubins=2, nvbins=2, min_top=8)
+    ggg0 = treecorr.GGGCorrelation(config)
+    ggg0.process(cat)
+    assert ggg0.sample_var is None
+
+    ggg1 = treecorr.GGGCorrelation(config, sample_rate=0.2, sample_groups=8,
+                                   rng=np.random.RandomState(1234))
+    ggg1.process(cat)
+    print('full weight = ',np.sum(ggg0.weight))
+    print('sampled weight = ',np.sum(ggg1.weight))
+    np.testing.assert_allclose(np.sum(ggg1.weight), np.sum(ggg0.weight), rtol=0.1)
+    assert ggg1.sample_var.shape == ggg1.getStat().shape
+
+    # The same rng gives the same sample.
+    ggg2 = treecorr.GGGCorrelation(config, sample_rate=0.2, sample_groups=8,
+                                   rng=np.random.RandomState(1234))
+    ggg2.process(cat)
+    np.testing.assert_array_equal(ggg2.gam0, ggg1.gam0)
+    np.testing.assert_array_equal(ggg2.sample_var, ggg1.sample_var)
+
+
 if __name__ == '__main__':
     test_direct()
     test_direct_spherical()
@@ -2333,3 +2442,6 @@ if __name__ == '__main__':
     test_map3()
     test_grid()
     test_vargam()
+    test_max_accum_mem()
+    test_progress()
+    test_sample()
@@ -398,6 +398,134 @@ def test_get_near():
     np.testing.assert_array_equal(i5, i1)
 
 
+@timer
+def test_near_many():
+
+    nobj = 100000
+    nq = 3000
+    rng = np.random.RandomState(8675309)
+    x = rng.random_sample(nobj)
+    y = rng.random_sample(nobj)
+    z = rng.random_sample(nobj)
+    w = rng.random_sample(nobj)
+    qx = rng.random_sample(nq)
+    qy = rng.random_sample(nq)
+    qz = rng.random_sample(nq)
+    sep = rng.uniform(0.01, 0.05, nq)
+
+    def check(field, qz, sep, **kwargs):
+        counts = np.array([field.count_near(*args, sep=s, **kwargs)
+                           for *args, s in zip(*[q for q in (qx,qy,qz) if q is not None], sep)])
+        for dual_tree in [None, False, True]:
+            c = field.count_near_many(qx, qy, qz, sep=sep, dual_tree=dual_tree, **kwargs)
+            np.testing.assert_array_equal(c, counts)
+            offsets, ind = field.get_near_many(qx, qy, qz, sep=sep, dual_tree=dual_tree,
+                                               **kwargs)
+            np.testing.assert_array_equal(np.diff(offsets), counts)
+            for i in range(0, nq, 97):
+                args = [q[i] for q in (qx,qy,qz) if q is not None]
+                np.testing.assert_array_equal(ind[offsets[i]:offsets[i+1]],
+                                              field.get_near(*args, sep=sep[i], **kwargs))
+
+    cat = treecorr.Catalog(x=x, y=y, w=w)
+    check(cat.getNField(), None, sep)
+    check(cat.getNField(min_size=0.01), None, sep)
+
+    # A scalar sep works too.
+    field = cat.getNField()
+    np.testing.assert_array_equal(field.count_near_many(qx, qy, sep=0.03),
+                                  field.count_near_many(qx, qy, sep=np.full(nq, 0.03)))
+
+    cat = treecorr.Catalog(x=x, y=y, z=z, w=w, k=w)
+    check(cat.getKField(), qz, sep)
+
+    # For spherical coordinates, the query positions are on the unit sphere.
+    ra = rng.uniform(0, 0.3, nobj)
+    dec = rng.uniform(0, 0.3, nobj)
+    cat = treecorr.Catalog(ra=ra, dec=dec, ra_units='rad', dec_units='rad')
+    qcat = treecorr.Catalog(ra=rng.uniform(0, 0.3, nq), dec=rng.uniform(0, 0.3, nq),
+                            ra_units='rad', dec_units='rad')
+    field = cat.getNField()
+    sep_deg = sep * 10
+    counts = np.array([field.count_near(r, d, sep=s, ra_units='rad', dec_units='rad',
+                                        sep_units='deg')
+                       for r, d, s in zip(qcat.ra, qcat.dec, sep_deg)])
+    c = field.count_near_many(qcat.x, qcat.y, qcat.z, sep=sep_deg, sep_units='deg')
+    np.testing.assert_array_equal(c, counts)
+
+    assert_raises(TypeError, field.count_near_many, qcat.x, qcat.y, qcat.z, sep=sep_deg)
+    assert_raises(TypeError, field.count_near_many, qcat.x, qcat.y, sep=sep_deg,
+                  sep_units='deg')
+    assert_raises(ValueError, field.count_near_many, qcat.x, qcat.y[:10], qcat.z, sep=sep_deg,
+                  sep_units='deg')
+
+
+@timer
+def test_nearest_neighbors():
+
+    nobj = 20000
+    nq = 500
+    rng = np.random.RandomState(8675309)
+    x = rng.random_sample(nobj)
+    y = rng.random_sample(nobj)
+    z = rng.random_sample(nobj)
+    qx = rng.random_sample(nq)
+    qy = rng.random_sample(nq)
+    qz = rng.random_sample(nq)
+    k = 5
+
+    def brute(dsq):
+        ind = np.argsort(dsq, axis=1, kind='stable')[:,:k]
+        return np.sqrt(np.take_along_axis(dsq, ind, axis=1)), ind
+
+    # Flat Euclidean
+    field = treecorr.Catalog(x=x, y=y).getNField()
+    dist, ind = field.nearest_neighbors(qx, qy, k=k)
+    dsq = (qx[:,None]-x)**2 + (qy[:,None]-y)**2
+    bdist, bind = brute(dsq)
+    np.testing.assert_allclose(dist, bdist, rtol=1.e-12)
+    np.testing.assert_array_equal(ind, bind)
+
+    # Periodic in 3d
+    field = treecorr.Catalog(x=x, y=y, z=z).getNField()
+    dist, ind = field.nearest_neighbors(qx, qy, qz, k=k, metric='Periodic', period=1)
+    dx = (qx[:,None]-x + 0.5) % 1 - 0.5
+    dy = (qy[:,None]-y + 0.5) % 1 - 0.5
+    dz = (qz[:,None]-z + 0.5) % 1 - 0.5
+    bdist, bind = brute(dx**2 + dy**2 + dz**2)
+    np.testing.assert_allclose(dist, bdist, rtol=1.e-12)
+    np.testing.assert_array_equal(ind, bind)
+
+    # Arc on the sphere
+    ra = rng.uniform(0, 0.5, nobj)
+    dec = rng.uniform(0, 0.5, nobj)
+    cat = treecorr.Catalog(ra=ra, dec=dec, ra_units='rad', dec_units='rad')
+    qcat = treecorr.Catalog(ra=rng.uniform(0, 0.5, nq), dec=rng.uniform(0, 0.5, nq),
+                            ra_units='rad', dec_units='rad')
+    field = cat.getNField()
+    dist, ind = field.nearest_neighbors(qcat.x, qcat.y, qcat.z, k=k, metric='Arc')
+    dsq = (qcat.x[:,None]-cat.x)**2 + (qcat.y[:,None]-cat.y)**2 + (qcat.z[:,None]-cat.z)**2
+    bdist, bind = brute(dsq)
+    np.testing.assert_allclose(dist, 2*np.arcsin(bdist/2), rtol=1.e-10)
+    np.testing.assert_array_equal(ind, bind)
+    # Euclidean gives the chord distances.
+    dist, ind = field.nearest_neighbors(qcat.x, qcat.y, qcat.z, k=k)
+    np.testing.assert_allclose(dist, bdist, rtol=1.e-12)
+    np.testing.assert_array_equal(ind, bind)
+
+    # Fewer than k objects
+    field = treecorr.Catalog(x=x[:3], y=y[:3]).getNField()
+    dist, ind = field.nearest_neighbors(qx, qy, k=k)
+    assert np.all(np.isinf(dist[:,3:]))
+    assert np.all(ind[:,3:] == -1)
+    assert np.all(np.sort(ind[:,:3], axis=1) == [0,1,2])
+
+    assert_raises(ValueError, field.nearest_neighbors, qx, qy, k=0)
+    assert_raises(ValueError, field.nearest_neighbors, qx, qy, metric='Arc')
+    assert_raises(ValueError, field.nearest_neighbors, qx, qy, metric='Periodic')
+    assert_raises(ValueError, field.nearest_neighbors, qx, qy, period=3)
+
+
 @timer
 def test_sample_pairs():
 
@@ -435,7 +563,7 @@ def test_sample_pairs():
     print('npairs = ',nn.npairs.astype(int))
 
     # Start with a bin near the bottom with < 100 pairs
-    # This only exercises case 1 in the sampleFrom function.
+    # This takes all of the pairs without any random selection.
     b = 1
     i1, i2, sep = nn.sample_pairs(100, cat1, cat2,
                                   min_sep=nn.left_edges[b], max_sep=nn.right_edges[b])
@@ -453,7 +581,7 @@ def test_sample_pairs():
     np.testing.assert_array_less(nn.left_edges[b], sep)
 
     # Next one that still isn't too many pairs, but more than 100
-    # This exercises cases 1,2 in the sampleFrom function.
+    # This selects a random subset of the pairs, mostly from leaf-leaf cell pairs.
     b = 10
     i1, i2, sep = nn.sample_pairs(100, cat1, cat2,
                                   min_sep=nn.left_edges[b], max_sep=nn.right_edges[b])
@@ -470,8 +598,8 @@ def test_sample_pairs():
     np.testing.assert_array_less(sep, nn.right_edges[b])
     np.testing.assert_array_less(nn.left_edges[b], sep)
 
-    # To exercise case 3, we need to go to larger separations, so the recursion
-    # more often stops before getting to the leaves.
+    # To select pairs from within larger cell pairs, we need to go to larger separations,
+    # so the recursion more often stops before getting to the leaves.
     # Also switch to 3d coordinates.
 
     cat1 = treecorr.Catalog(x=x1, y=y1, z=z1, w=w1, g1=g11, g2=g21, k=k1, keep_zero_weight=True)
@@ -493,6 +621,8 @@ def test_sample_pairs():
         assert len(i1) == 100
         assert len(i2) == 100
         assert len(sep) == 100
+        # The pairs are selected without replacement.
+        assert len(set(zip(i1, i2))) == 100
         actual_sep = ((x1[i1]-x2[i2])**2 + (y1[i1]-y2[i2])**2 + (z1[i1]-z2[i2])**2)**0.5
         np.testing.assert_allclose(sep, actual_sep, rtol=0.2)
         np.testing.assert_array_less(sep, gg.right_edges[b])
@@ -572,4 +702,6 @@ def test_sample_pairs():
 if __name__ == '__main__':
     test_count_near()
     test_get_near()
+    test_near_many()
+    test_nearest_neighbors()
     test_sample_pairs()
@@ -635,6 +635,91 @@ def test_varxi():
     np.testing.assert_allclose(kk.varxi, var_xi, rtol=0.3)
 
 
+@timer
+def test_process_multi_k():
+    # Processing several scalar fields with the same positions with process_multi_k should
+    # give the same answer as doing each correlation separately.
+    ngal = 2000
+    nk = 3
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(-5*s, 5*s, (ngal,) )
+    y = rng.uniform(-5*s, 5*s, (ngal,) )
+    w = rng.random_sample(ngal)
+    ks = rng.normal(0, 0.2, (nk,ngal) )
+    cats = [treecorr.Catalog(x=x, y=y, w=w, k=k) for k in ks]
+    xl = rng.uniform(-5*s, 5*s, (500,) )
+    yl = rng.uniform(-5*s, 5*s, (500,) )
+    lens_cat = treecorr.Catalog(x=xl, y=yl)
+    x2 = rng.uniform(-5*s, 5*s, (1000,) )
+    y2 = rng.uniform(-5*s, 5*s, (1000,) )
+    cats2 = [treecorr.Catalog(x=x2, y=y2, k=rng.normal(0, 0.2, (1000,))) for i in range(2)]
+
+    for config in [dict(min_sep=1., max_sep=30., nbins=15, bin_slop=0.5),
+                   dict(min_sep=1., max_sep=30., nbins=15, bin_slop=0),
+                   dict(max_sep=20., nbins=10, bin_slop=0, bin_type='TwoD')]:
+        # KK auto- and cross-correlations of cats
+        kk = [[treecorr.KKCorrelation(config) for b in range(nk)] for a in range(nk)]
+        treecorr.process_multi_k(kk, cats)
+        for a in range(nk):
+            for b in range(nk):
+                kk1 = treecorr.KKCorrelation(config)
+                if a == b:
+                    kk1.process(cats[a])
+                else:
+                    kk1.process(cats[a], cats[b])
+                np.testing.assert_allclose(kk[a][b].npairs, kk1.npairs)
+                np.testing.assert_allclose(kk[a][b].weight, kk1.weight)
+                np.testing.assert_allclose(kk[a][b].meanr, kk1.meanr)
+                np.testing.assert_allclose(kk[a][b].xi, kk1.xi, rtol=1.e-5, atol=1.e-10)
+
+        # KK cross-correlations of two lists
+        kk = [[treecorr.KKCorrelation(config) for b in range(2)] for a in range(nk)]
+        treecorr.process_multi_k(kk, cats, cats2)
+        for a in range(nk):
+            for b in range(2):
+                kk1 = treecorr.KKCorrelation(config)
+                kk1.process(cats[a], cats2[b])
+                np.testing.assert_allclose(kk[a][b].weight, kk1.weight)
+                np.testing.assert_allclose(kk[a][b].xi, kk1.xi, rtol=1.e-5, atol=1.e-10)
+
+        # NK
+        nks = [treecorr.NKCorrelation(config) for b in range(nk)]
+        treecorr.process_multi_k(nks, lens_cat, cats)
+        for b in range(nk):
+            nk1 = treecorr.NKCorrelation(config)
+            nk1.process(lens_cat, cats[b])
+            np.testing.assert_allclose(nks[b].npairs, nk1.npairs)
+            np.testing.assert_allclose(nks[b].weight, nk1.weight)
+            np.testing.assert_allclose(nks[b].xi, nk1.xi, rtol=1.e-5, atol=1.e-10)
+
+    # The results accumulate like process does.
+    config = dict(min_sep=1., max_sep=30., nbins=15, bin_slop=0.5)
+    kk = [[treecorr.KKCorrelation(config) for b in range(2)] for a in range(2)]
+    treecorr.process_multi_k(kk, cats[:2])
+    treecorr.process_multi_k(kk, cats[:2])
+    kk1 = treecorr.KKCorrelation(config)
+    kk1.process(cats[0], cats[1])
+    np.testing.assert_allclose(kk[0][1].weight, 2*kk1.weight)
+    np.testing.assert_allclose(kk[0][1].xi, 2*kk1.xi, rtol=1.e-5, atol=1.e-10)
+
+    with assert_raises(ValueError):
+        treecorr.process_multi_k([[kk[0][0]]], [cats[0], cats2[0]])
+    with assert_raises(ValueError):
+        treecorr.process_multi_k([[kk[0][0], kk[0][0]]], [cats[0]], cats[:2])
+    with assert_raises(ValueError):
+        treecorr.process_multi_k([[kk[0][0]]], [cats[0]], [cats[0], cats2[0]])
+    with assert_raises(ValueError):
+        treecorr.process_multi_k([[kk[0][0], treecorr.KKCorrelation(config, bin_slop=0.2)]],
+                                 [cats[0]], cats[:2])
+    with assert_raises(TypeError):
+        treecorr.process_multi_k([[kk[0][0], treecorr.NKCorrelation(config)]],
+                                 [cats[0]], cats[:2])
+    with assert_raises(TypeError):
+        treecorr.process_multi_k([treecorr.NKCorrelation(config)], lens_cat)
+    with assert_raises(ValueError):
+        treecorr.process_multi_k([], cats)
+
 
 if __name__ == '__main__':
     test_direct()
@@ -644,3 +729,4 @@ if __name__ == '__main__':
     test_kk()
     test_large_scale()
     test_varxi()
+    test_process_multi_k()
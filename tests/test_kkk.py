@@ -1288,6 +1288,58 @@ def test_kkk():
         assert kkk2.sep_units == kkk.sep_units
         assert kkk2.bin_type == kkk.bin_type
 
+@timer
+def test_sample():
+    # With sample_rate, only a random sample of the top-level cells is used, and sample_var
+    # estimates the variance from the sampling.
+    ngal = 3000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    w = rng.uniform(0.5,1.5, (ngal,) )
+    k = 0.1 * np.sin(x/7.) * np.cos(y/9.) + rng.normal(0,0.02, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y, w=w, k=k)
+
+    # Use many top-level cells, since those are what get sampled.
+    config = dict(min_sep=1., max_sep=20., nbins=5, nubins=2, nvbins=2, min_top=8)
+    kkk0 = treecorr.KKKCorrelation(config)
+    kkk0.process(cat)
+    assert kkk0.sample_var is None
+
+    kkk1 = treecorr.KKKCorrelation(config, sample_rate=0.2, sample_groups=8,
+                                   rng=np.random.RandomState(1234))
+    kkk1.process(cat)
+    print('full weight = ',np.sum(kkk0.weight))
+    print('sampled weight = ',np.sum(kkk1.weight))
+    np.testing.assert_allclose(np.sum(kkk1.weight), np.sum(kkk0.weight), rtol=0.1)
+    np.testing.assert_allclose(kkk1.progress[0], kkk1.progress[1], rtol=1.e-10)
+    assert kkk1.progress[1] < kkk0.progress[1]
+
+    # The errors should be consistent with sample_var.
+    assert kkk1.sample_var.shape == kkk1.getStat().shape
+    use = (kkk0.weight.ravel() > 0) & (kkk1.sample_var > 0)
+    chisq = (kkk1.zeta.ravel() - kkk0.zeta.ravel())**2 / kkk1.sample_var
+    print('chisq/n = ',np.mean(chisq[use]))
+    assert np.mean(chisq[use]) < 3.
+
+    # The same rng gives the same sample.
+    kkk2 = treecorr.KKKCorrelation(config, sample_rate=0.2, sample_groups=8,
+                                   rng=np.random.RandomState(1234))
+    kkk2.process(cat)
+    np.testing.assert_array_equal(kkk2.zeta, kkk1.zeta)
+    np.testing.assert_array_equal(kkk2.sample_var, kkk1.sample_var)
+
+    # A clear resets sample_var.
+    kkk2.clear()
+    assert kkk2.sample_var is None
+
+    with assert_raises(ValueError):
+        treecorr.KKKCorrelation(config, sample_rate=0.)
+    with assert_raises(ValueError):
+        treecorr.KKKCorrelation(config, sample_rate=1.5)
+    with assert_raises(ValueError):
+        treecorr.KKKCorrelation(config, sample_rate=0.5, sample_groups=1)
+
 if __name__ == '__main__':
     test_direct()
     test_direct_spherical()
@@ -1296,3 +1348,4 @@ if __name__ == '__main__':
     test_direct_cross_3d()
     test_constant()
     test_kkk()
+    test_sample()
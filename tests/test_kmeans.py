@@ -968,6 +968,61 @@ def test_catalog_3d():
     np.testing.assert_array_equal(cat2.patch, cat3.patch)
     np.testing.assert_array_equal(cat2.patch_centers, cat3.patch_centers)
 
+@timer
+def test_batch():
+    # Use calculatePatchCenters to find the centers from several chunks of a catalog.
+    ngal = 100000
+    s = 1.
+    rng = np.random.RandomState(8675309)
+    x = rng.normal(0,s, (ngal,) )
+    y = rng.normal(0,s, (ngal,) )
+    w = rng.random_sample(ngal) + 1
+    xy = np.array([x, y]).T
+    npatch = 111
+
+    # Each chunk is a fair sample of the whole area.
+    nchunk = 4
+    cats = [treecorr.Catalog(x=x[i::nchunk], y=y[i::nchunk], w=w[i::nchunk])
+            for i in range(nchunk)]
+    t0 = time.time()
+    cen = treecorr.calculatePatchCenters(cats, npatch, rng=rng)
+    t1 = time.time()
+    print('time = ',t1-t0)
+    assert cen.shape == (npatch, 2)
+
+    cat = treecorr.Catalog(x=x, y=y, w=w, patch_centers=cen)
+    p = cat.patch
+    assert min(p) == 0
+    assert max(p) == npatch-1
+
+    # The inertia is a bit worse than running k-means on the whole catalog, but not much.
+    inertia = np.array([np.sum(w[p==i][:,None] * (xy[p==i] - cen[i])**2) for i in range(npatch)])
+    print('total inertia = ',np.sum(inertia))
+    print(np.std(inertia)/np.mean(inertia))
+    assert np.sum(inertia) < 6000.
+    assert np.std(inertia) < 0.5 * np.mean(inertia)
+
+    # With a single chunk, this is the same as the normal k-means.
+    field = treecorr.Catalog(x=x, y=y, w=w).getNField(max_top=6)
+    cen1 = field.kmeans_initialize_centers(npatch, rng=np.random.RandomState(1234))
+    field.kmeans_refine_centers(cen1)
+    cen2 = treecorr.calculatePatchCenters(treecorr.Catalog(x=x, y=y, w=w), npatch,
+                                          rng=np.random.RandomState(1234))
+    np.testing.assert_allclose(cen2, cen1, atol=1.e-3)
+
+    # More passes and the alternate algorithm work too.
+    cen = treecorr.calculatePatchCenters(cats, npatch, num_passes=2, alt=True, rng=rng)
+    p = treecorr.Catalog(x=x, y=y, w=w, patch_centers=cen).patch
+    inertia = np.array([np.sum(w[p==i][:,None] * (xy[p==i] - cen[i])**2) for i in range(npatch)])
+    print('alt: total inertia = ',np.sum(inertia))
+    print(np.std(inertia)/np.mean(inertia))
+    assert np.sum(inertia) < 6000.
+    assert np.std(inertia) < 0.5 * np.mean(inertia)
+
+    with assert_raises(ValueError):
+        treecorr.calculatePatchCenters(cats, npatch, num_passes=0)
+    with assert_raises(ValueError):
+        field.kmeans_update_batch(cen, np.zeros(npatch+1))
 
 
 if __name__ == '__main__':
@@ -980,3 +1035,4 @@ if __name__ == '__main__':
     test_zero_weight()
     test_catalog_sphere()
     test_catalog_3d()
+    test_batch()
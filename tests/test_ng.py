@@ -1473,6 +1473,92 @@ def test_double():
     np.testing.assert_allclose(ng2.xi_im, ng1.xi_im, rtol=1.e-3, atol=1.e-6)
 
 
+@timer
+def test_process_multi_cross():
+    # Computing NN, NK, NG together with process_multi_cross should give the same answer
+    # as doing them separately.
+    nlens = 1000
+    nsource = 10000
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    xl = rng.uniform(-5*s, 5*s, (nlens,) )
+    yl = rng.uniform(-5*s, 5*s, (nlens,) )
+    wl = rng.random_sample(nlens)
+    xs = rng.uniform(-5*s, 5*s, (nsource,) )
+    ys = rng.uniform(-5*s, 5*s, (nsource,) )
+    ws = rng.random_sample(nsource)
+    k = rng.normal(0, 0.2, (nsource,) )
+    g1 = rng.normal(0, 0.2, (nsource,) )
+    g2 = rng.normal(0, 0.2, (nsource,) )
+    lens_cat = treecorr.Catalog(x=xl, y=yl, w=wl)
+    source_cat = treecorr.Catalog(x=xs, y=ys, w=ws, k=k, g1=g1, g2=g2)
+
+    config = dict(min_sep=1., max_sep=30., nbins=15, bin_slop=0.5)
+    nn1 = treecorr.NNCorrelation(config)
+    nk1 = treecorr.NKCorrelation(config)
+    ng1 = treecorr.NGCorrelation(config)
+    nn1.process(lens_cat, source_cat)
+    nk1.process(lens_cat, source_cat)
+    ng1.process(lens_cat, source_cat)
+
+    nn2 = treecorr.NNCorrelation(config)
+    nk2 = treecorr.NKCorrelation(config)
+    ng2 = treecorr.NGCorrelation(config)
+    treecorr.process_multi_cross([nn2, nk2, ng2], lens_cat, source_cat)
+    nn2.finalize()
+    nk2.finalize(source_cat.vark)
+    ng2.finalize(source_cat.varg)
+
+    np.testing.assert_allclose(nn2.npairs, nn1.npairs)
+    np.testing.assert_allclose(nn2.weight, nn1.weight)
+    np.testing.assert_allclose(nn2.meanr, nn1.meanr)
+    np.testing.assert_allclose(nn2.meanlogr, nn1.meanlogr)
+    assert nn2.tot == nn1.tot
+    np.testing.assert_allclose(nk2.weight, nk1.weight)
+    np.testing.assert_allclose(nk2.xi, nk1.xi)
+    np.testing.assert_allclose(ng2.weight, ng1.weight)
+    np.testing.assert_allclose(ng2.xi, ng1.xi)
+    np.testing.assert_allclose(ng2.xi_im, ng1.xi_im)
+
+    # Any subset is also fine.
+    ng3 = treecorr.NGCorrelation(config)
+    nk3 = treecorr.NKCorrelation(config)
+    treecorr.process_multi_cross([ng3, nk3], lens_cat, source_cat)
+    ng3.finalize(source_cat.varg)
+    nk3.finalize(source_cat.vark)
+    np.testing.assert_allclose(ng3.xi, ng1.xi)
+    np.testing.assert_allclose(nk3.xi, nk1.xi)
+
+    # With reuse_fields, a finer G field may already be cached.  Then the K field is built to
+    # match it, so the trees can still be walked together.
+    source_cat2 = treecorr.Catalog(x=xs, y=ys, w=ws, k=k, g1=g1, g2=g2, reuse_fields=True)
+    treecorr.NGCorrelation(config, min_sep=0.5, nbins=18).process(lens_cat, source_cat2)
+    ng5 = treecorr.NGCorrelation(config)
+    nk5 = treecorr.NKCorrelation(config)
+    treecorr.process_multi_cross([ng5, nk5], lens_cat, source_cat2)
+    ng5.finalize(source_cat.varg)
+    nk5.finalize(source_cat.vark)
+    np.testing.assert_allclose(ng5.xi, ng1.xi)
+    np.testing.assert_allclose(nk5.xi, nk1.xi)
+
+    # The trees are walked in lockstep, so they can't be built with random splits.
+    with assert_raises(ValueError):
+        treecorr.process_multi_cross([treecorr.NGCorrelation(config, split_method='random'),
+                                      treecorr.NKCorrelation(config, split_method='random')],
+                                     lens_cat, source_cat)
+
+    # The binning has to match.
+    ng4 = treecorr.NGCorrelation(config, bin_slop=0.2)
+    with assert_raises(ValueError):
+        treecorr.process_multi_cross([nn2, ng4], lens_cat, source_cat)
+    with assert_raises(TypeError):
+        treecorr.process_multi_cross([ng2, ng3], lens_cat, source_cat)
+    with assert_raises(TypeError):
+        treecorr.process_multi_cross([treecorr.GGCorrelation(config)], lens_cat, source_cat)
+    with assert_raises(ValueError):
+        treecorr.process_multi_cross([], lens_cat, source_cat)
+
+
 if __name__ == '__main__':
     test_direct()
     test_direct_spherical()
@@ -1486,3 +1572,4 @@ if __name__ == '__main__':
     test_haloellip()
     test_varxi()
     test_double()
+    test_process_multi_cross()
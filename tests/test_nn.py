@@ -2088,6 +2088,275 @@ def test_linear_binslop():
             np.testing.assert_allclose(dd1.npairs, dd0.npairs, rtol=3*bin_slop)
 
 
+@timer
+def test_edges_binning():
+    # Test bin_type='Edges' with arbitrary, non-uniform bin edges.
+
+    ngal = 500
+    s = 10.
+    rng = np.random.RandomState(8675309)
+    x1 = rng.normal(0, s, (ngal,) )
+    y1 = rng.normal(0, s, (ngal,) )
+    x2 = rng.normal(0, s, (ngal,) )
+    y2 = rng.normal(0, s, (ngal,) )
+    cat1 = treecorr.Catalog(x=x1, y=y1)
+    cat2 = treecorr.Catalog(x=x2, y=y2)
+
+    edges = np.array([0.5, 0.6, 1., 1.05, 2., 4.5, 5., 10., 11., 30.])
+    nbins = len(edges)-1
+    dd = treecorr.NNCorrelation(bin_type='Edges', bin_edges=edges, bin_slop=0)
+    np.testing.assert_array_equal(dd.bin_edges, edges)
+    np.testing.assert_array_equal(dd.left_edges, edges[:-1])
+    np.testing.assert_array_equal(dd.right_edges, edges[1:])
+    np.testing.assert_allclose(dd.rnom, np.sqrt(edges[:-1]*edges[1:]))
+    np.testing.assert_allclose(dd.logr, np.log(dd.rnom))
+    assert dd.min_sep == edges[0]
+    assert dd.max_sep == edges[-1]
+    assert dd.nbins == nbins
+    np.testing.assert_allclose(dd.bin_size, np.log(1.05))
+
+    # A list works as well as an array.
+    dd2 = treecorr.NNCorrelation(bin_type='Edges', bin_edges=list(edges), bin_slop=0)
+    np.testing.assert_array_equal(dd2.bin_edges, edges)
+
+    dx = x1[:,None] - x2[None,:]
+    dy = y1[:,None] - y2[None,:]
+    r = np.sqrt(dx**2 + dy**2).ravel()
+    true_npairs = np.histogram(r, bins=edges)[0]
+
+    dd.process(cat1, cat2)
+    print('dd.npairs = ',dd.npairs)
+    print('true_npairs = ',true_npairs)
+    np.testing.assert_array_equal(dd.npairs, true_npairs)
+
+    dd_brute = treecorr.NNCorrelation(bin_type='Edges', bin_edges=edges, brute=True)
+    dd_brute.process(cat1, cat2)
+    np.testing.assert_array_equal(dd_brute.npairs, true_npairs)
+
+    # With a small bin_slop, the result is close.
+    dd_slop = treecorr.NNCorrelation(bin_type='Edges', bin_edges=edges, bin_slop=0.1)
+    dd_slop.process(cat1, cat2)
+    print('dd_slop.npairs = ',dd_slop.npairs)
+    np.testing.assert_allclose(dd_slop.npairs, true_npairs, rtol=0.05)
+
+    # Uniform edges in log(r) match Log binning.
+    log_edges = np.exp(np.linspace(np.log(0.5), np.log(30.), 11))
+    dd_log = treecorr.NNCorrelation(min_sep=0.5, max_sep=30., nbins=10, bin_slop=0)
+    dd_edges = treecorr.NNCorrelation(bin_type='Edges', bin_edges=log_edges, bin_slop=0)
+    dd_log.process(cat1, cat2)
+    dd_edges.process(cat1, cat2)
+    np.testing.assert_array_equal(dd_edges.npairs, dd_log.npairs)
+    np.testing.assert_allclose(dd_edges.meanr, dd_log.meanr)
+
+    # Very narrow bins use a binary search rather than the lookup table.
+    edges2 = np.array([0.5, 1., 1.+1.e-6, 2., 30.])
+    dd3 = treecorr.NNCorrelation(bin_type='Edges', bin_edges=edges2, bin_slop=0)
+    dd3.process(cat1, cat2)
+    np.testing.assert_array_equal(dd3.npairs, np.histogram(r, bins=edges2)[0])
+
+    # Different edges with the same nbins, min_sep and max_sep aren't the same binning.
+    edges4 = edges.copy()
+    edges4[5] = 4.
+    dd4 = treecorr.NNCorrelation(bin_type='Edges', bin_edges=edges4, bin_slop=0)
+    dd5 = treecorr.NNCorrelation(bin_type='Edges', bin_edges=edges, bin_slop=0)
+    assert dd5 == dd2
+    assert dd4 != dd2
+    with assert_raises(ValueError):
+        dd5 += dd4
+
+    with assert_raises(TypeError):
+        treecorr.NNCorrelation(bin_type='Edges')
+    with assert_raises(TypeError):
+        treecorr.NNCorrelation(bin_type='Edges', bin_edges=edges, nbins=9)
+    with assert_raises(TypeError):
+        treecorr.NNCorrelation(bin_type='Edges', bin_edges=edges, min_sep=0.5)
+    with assert_raises(ValueError):
+        treecorr.NNCorrelation(bin_type='Edges', bin_edges=[1.])
+    with assert_raises(ValueError):
+        treecorr.NNCorrelation(bin_type='Edges', bin_edges=[0., 1., 2.])
+    with assert_raises(ValueError):
+        treecorr.NNCorrelation(bin_type='Edges', bin_edges=[1., 3., 2.])
+    with assert_raises(ValueError):
+        treecorr.process_multi_binning([dd, dd_log], cat1, cat2)
+
+@timer
+def test_rr_cache():
+    # With cache_dir, RR is saved to a file, and later runs with the same randoms, binning,
+    # metric and bin_slop read it back, including the patch results for the covariance.
+    import shutil
+    cache_dir = os.path.join('output','rr_cache')
+    if os.path.exists(cache_dir):
+        shutil.rmtree(cache_dir)
+
+    ngal = 2000
+    nrand = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    rx = rng.uniform(0,100, (nrand,) )
+    ry = rng.uniform(0,100, (nrand,) )
+    rcat = treecorr.Catalog(x=rx, y=ry, npatch=8, rng=rng)
+    cat = treecorr.Catalog(x=x, y=y, patch_centers=rcat.patch_centers)
+    kwargs = dict(min_sep=1., max_sep=20., nbins=10, var_method='jackknife')
+
+    rr0 = treecorr.NNCorrelation(**kwargs)
+    rr0.process(rcat)
+    rr1 = treecorr.NNCorrelation(**kwargs)
+    rr1.process(rcat, cache_dir=cache_dir)
+    assert len(os.listdir(cache_dir)) == 2  # The main results and the patch results.
+    rr2 = treecorr.NNCorrelation(**kwargs)
+    rr2.process(rcat, cache_dir=cache_dir)
+    assert len(os.listdir(cache_dir)) == 2
+    for rr in [rr1, rr2]:
+        np.testing.assert_array_equal(rr.npairs, rr0.npairs)
+        np.testing.assert_array_equal(rr.weight, rr0.weight)
+        np.testing.assert_allclose(rr.meanr, rr0.meanr)
+        assert rr.tot == rr0.tot
+        assert rr.npatch1 == rr.npatch2 == 8
+        assert sorted(rr.results.keys()) == sorted(rr0.results.keys())
+
+    # The jackknife covariance is the same with the cached RR.
+    dd = treecorr.NNCorrelation(**kwargs)
+    dd.process(cat)
+    xi0, varxi0 = dd.calculateXi(rr=rr0)
+    cov0 = dd.estimate_cov('jackknife')
+    xi2, varxi2 = dd.calculateXi(rr=rr2)
+    cov2 = dd.estimate_cov('jackknife')
+    np.testing.assert_allclose(xi2, xi0)
+    np.testing.assert_allclose(varxi2, varxi0)
+    np.testing.assert_allclose(cov2, cov0)
+
+    # Different randoms, binning, metric or bin_slop use different files.
+    rr3 = treecorr.NNCorrelation(**kwargs)
+    rr3.process(cat, cache_dir=cache_dir)
+    assert len(os.listdir(cache_dir)) == 4
+    rr3 = treecorr.NNCorrelation(bin_slop=0.5, **kwargs)
+    rr3.process(rcat, cache_dir=cache_dir)
+    assert len(os.listdir(cache_dir)) == 6
+    rr3 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=5, var_method='jackknife')
+    rr3.process(rcat, cache_dir=cache_dir)
+    assert len(os.listdir(cache_dir)) == 8
+
+    # Without patches, there is just the one file.
+    rcat1 = treecorr.Catalog(x=rx, y=ry)
+    rr4 = treecorr.NNCorrelation(**kwargs)
+    rr4.process(rcat1, cache_dir=cache_dir)
+    assert len(os.listdir(cache_dir)) == 9
+    rr5 = treecorr.NNCorrelation(**kwargs)
+    rr5.process(rcat1, cache_dir=cache_dir)
+    np.testing.assert_array_equal(rr5.npairs, rr4.npairs)
+    assert len(rr5.results) == 0
+
+    with assert_raises(ValueError):
+        rr5.process(rcat1, cache_dir=cache_dir, finalize=False)
+
+
+@timer
+def test_prune_stats():
+    # The counters of the traversal are only kept if TreeCorr was built with
+    # TREECORR_PRUNE_STATS=1.  Otherwise get_prune_stats returns None.
+    ngal = 2000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0, 100, ngal)
+    y = rng.uniform(0, 100, ngal)
+    cat = treecorr.Catalog(x=x, y=y)
+
+    nn1 = treecorr.NNCorrelation(min_sep=1., max_sep=10., nbins=10, bin_slop=1.)
+    nn1.process(cat)
+    stats1 = nn1.get_prune_stats()
+    if stats1 is None:
+        # The CI sets TREECORR_PRUNE_STATS when running this test with such a build.
+        assert os.environ.get('TREECORR_PRUNE_STATS', '0') in ['', '0']
+        print('TreeCorr was not built with TREECORR_PRUNE_STATS')
+        return
+    print('stats1 = ',stats1)
+
+    # Each pair of cells that is checked ends up in exactly one outcome, except for the
+    # pairs of leaves accumulated in buckets, which are only counted in leaf.
+    outcomes = ['prune_rpar', 'prune_min_sep', 'prune_max_sep', 'prune_range', 'single_bin',
+                'leaf', 'split1', 'split2', 'split_both']
+    assert stats1['pairs'] == np.sum(stats1['depth'])
+    assert stats1['pairs'] <= sum(stats1[k] for k in outcomes)
+    assert stats1['calls'] > 0
+    assert stats1['prune_rpar'] == 0
+    assert stats1['prune_max_sep'] > 0
+
+    # With a smaller bin_slop, it needs to go deeper in the trees.
+    nn0 = treecorr.NNCorrelation(min_sep=1., max_sep=10., nbins=10, bin_slop=0.)
+    nn0.process(cat)
+    stats0 = nn0.get_prune_stats()
+    print('stats0 = ',stats0)
+    assert stats0['pairs'] > stats1['pairs']
+    assert stats0['prune_range'] == 0
+    assert np.max(np.nonzero(stats0['depth'])) >= np.max(np.nonzero(stats1['depth']))
+
+    # process starts over, so the counts are the same the second time.
+    nn0.process(cat)
+    assert nn0.get_prune_stats()['pairs'] == stats0['pairs']
+    nn0.clear()
+    stats = nn0.get_prune_stats()
+    assert all(stats[k] == 0 for k in outcomes + ['calls', 'pairs'])
+    assert np.all(stats['depth'] == 0)
+
+
+@timer
+def test_tune():
+    # The split_factor only changes how the trees are traversed, so with bin_slop=0, the
+    # results are the same for any value.  So then tuning it shouldn't change them either.
+    ngal = 5000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0, 100, ngal)
+    y = rng.uniform(0, 100, ngal)
+    cat = treecorr.Catalog(x=x, y=y)
+
+    nn0 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10, bin_slop=0.)
+    nn0.process(cat)
+    assert nn0.split_factor == 0.585
+
+    for split_factor in [0.3, 1.]:
+        nn1 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10, bin_slop=0.,
+                                     split_factor=split_factor)
+        nn1.process(cat)
+        np.testing.assert_array_equal(nn1.npairs, nn0.npairs)
+        np.testing.assert_allclose(nn1.meanr, nn0.meanr, rtol=1.e-10)
+
+    nn2 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10, bin_slop=0.)
+    t0 = time.time()
+    tuned = nn2.tune(cat, nsample=2000, split_factors=[0.4, 0.7], min_tops=[3, 5])
+    t1 = time.time()
+    print('tuned = ',tuned,' time = ',t1-t0)
+    assert tuned['split_factor'] in [0.4, 0.7]
+    assert tuned['min_top'] in [3, 5]
+    assert nn2.split_factor == tuned['split_factor']
+    assert nn2.min_top == tuned['min_top']
+    nn2.process(cat)
+    np.testing.assert_array_equal(nn2.npairs, nn0.npairs)
+
+    # The choice is cached, so doing it again is quick.
+    nn3 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10, bin_slop=0.)
+    t0 = time.time()
+    assert nn3.tune(cat, nsample=2000, split_factors=[0.4, 0.7], min_tops=[3, 5]) == tuned
+    t1 = time.time()
+    print('cached time = ',t1-t0)
+
+    # Tuning doesn't change the copies that were made before.
+    nn4 = nn0.copy()
+    nn4.tune(cat, nsample=2000, split_factors=[0.4, 0.7], min_tops=[3, 5])
+    assert nn0.split_factor == 0.585
+
+    # auto_tune does this in process.
+    nn5 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10, bin_slop=0., auto_tune=True)
+    nn5.process(cat)
+    print('auto_tune: split_factor = ',nn5.split_factor,', min_top = ',nn5.min_top)
+    np.testing.assert_array_equal(nn5.npairs, nn0.npairs)
+    nn6 = treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10, bin_slop=0., auto_tune=True)
+    nn6.process(cat, cat)
+    np.testing.assert_array_equal(nn6.npairs, 2*nn0.npairs)
+
+    with assert_raises(ValueError):
+        treecorr.NNCorrelation(min_sep=1., max_sep=20., nbins=10, split_factor=0.)
+
+
 if __name__ == '__main__':
     test_log_binning()
     test_linear_binning()
@@ -2105,3 +2374,7 @@ if __name__ == '__main__':
     test_varxi()
     test_sph_linear()
     test_linear_binslop()
+    test_edges_binning()
+    test_rr_cache()
+    test_prune_stats()
+    test_tune()
@@ -14,6 +14,7 @@
 import numpy as np
 import treecorr
 import os
+import time
 import coord
 
 from test_helper import get_script_name, do_pickle, assert_raises, CaptureLog, timer, assert_warns
@@ -2744,6 +2745,115 @@ def test_list():
     print('diff = ',corr3_output['zeta']-zeta.flatten())
     np.testing.assert_allclose(corr3_output['zeta'], zeta.flatten(), rtol=1.e-3)
 
+@timer
+def test_multipole():
+    # Check that process_multipole gives nearly the same answer as the direct calculation.
+    ngal = 1000
+    L = 58.
+    rng = np.random.RandomState(8675309)
+    x = rng.random_sample(ngal) * L
+    y = rng.random_sample(ngal) * L
+    w = rng.random_sample(ngal) + 0.5
+
+    min_sep = 2.
+    max_sep = 10.
+    nbins = 5
+    nubins = 5
+    nvbins = 5
+
+    for cat in [treecorr.Catalog(x=x, y=y), treecorr.Catalog(x=x, y=y, w=w)]:
+        ddd = treecorr.NNNCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins,
+                                      nubins=nubins, nvbins=nvbins, brute=True)
+        t0 = time.time()
+        ddd.process(cat)
+        t1 = time.time()
+        print('direct time = ',t1-t0)
+
+        mmm = treecorr.NNNCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins,
+                                      nubins=nubins, nvbins=nvbins)
+        t0 = time.time()
+        mmm.process_multipole(cat)
+        t1 = time.time()
+        print('multipole time = ',t1-t0)
+        np.testing.assert_allclose(mmm.tot, ddd.tot)
+
+        # The totals for each r are very close.
+        print('ntri(r) = ',np.sum(ddd.ntri, axis=(1,2)), np.sum(mmm.ntri, axis=(1,2)))
+        np.testing.assert_allclose(np.sum(mmm.ntri, axis=(1,2)), np.sum(ddd.ntri, axis=(1,2)),
+                                   rtol=5.e-3)
+        np.testing.assert_allclose(np.sum(mmm.weight, axis=(1,2)),
+                                   np.sum(ddd.weight, axis=(1,2)), rtol=5.e-3)
+
+        # The individual bins are within a few percent.
+        mask = ddd.ntri > 1000
+        print('ratio = ',mmm.ntri[mask] / ddd.ntri[mask])
+        np.testing.assert_allclose(mmm.ntri[mask], ddd.ntri[mask], rtol=0.1)
+        np.testing.assert_allclose(mmm.weight[mask], ddd.weight[mask], rtol=0.1)
+
+        # And so are the mean values in each bin once they are finalized.
+        ddd.finalize()
+        mmm.finalize()
+        np.testing.assert_allclose(mmm.meand2[mask], ddd.meand2[mask], rtol=0.01)
+        np.testing.assert_allclose(mmm.meanlogd2[mask], ddd.meanlogd2[mask], atol=0.01)
+        np.testing.assert_allclose(mmm.meanu[mask], ddd.meanu[mask], atol=0.02)
+        np.testing.assert_allclose(mmm.meanv[mask], ddd.meanv[mask], atol=0.02)
+
+        # min_u > 0 doesn't need the inner radial bin, so check that case too.
+        ddd = treecorr.NNNCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins,
+                                      min_u=0.5, nubins=nubins, nvbins=nvbins, brute=True)
+        ddd.process(cat)
+        mmm = treecorr.NNNCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins,
+                                      min_u=0.5, nubins=nubins, nvbins=nvbins)
+        mmm.process_multipole(cat)
+        np.testing.assert_allclose(np.sum(mmm.ntri, axis=(1,2)), np.sum(ddd.ntri, axis=(1,2)),
+                                   rtol=5.e-3)
+        mask = ddd.ntri > 1000
+        np.testing.assert_allclose(mmm.ntri[mask], ddd.ntri[mask], rtol=0.1)
+
+    # Only flat coordinates are implemented.
+    ra = x / L * 10.
+    dec = y / L * 10.
+    sphere_cat = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg')
+    mmm = treecorr.NNNCorrelation(min_sep=1., max_sep=10., nbins=nbins, sep_units='arcmin')
+    with assert_raises(ValueError):
+        mmm.process_multipole(sphere_cat)
+    mmm = treecorr.NNNCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins)
+    with assert_raises(ValueError):
+        mmm.process_multipole(cat, max_n=-1)
+    with assert_raises(ValueError):
+        mmm.process_multipole(cat, nsub=0)
+
+@timer
+def test_sample():
+    # With sample_rate, only a random sample of the top-level cells is used.  For NNN, tot
+    # is still the full value, and sample_var is the variance of the weight.
+    # (cf. test_kkk.py:test_sample)
+    ngal = 3000
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0,100, (ngal,) )
+    y = rng.uniform(0,100, (ngal,) )
+    cat = treecorr.Catalog(x=x, y=y)
+
+    config = dict(min_sep=1., max_sep=20., nbins=5, nubins=2, nvbins=2, min_top=8)
+    ddd0 = treecorr.NNNCorrelation(config)
+    ddd0.process(cat)
+    ddd1 = treecorr.NNNCorrelation(config, sample_rate=0.2, sample_groups=8,
+                                   rng=np.random.RandomState(1234))
+    ddd1.process(cat)
+    print('full ntri = ',np.sum(ddd0.ntri))
+    print('sampled ntri = ',np.sum(ddd1.ntri))
+    assert ddd1.tot == ddd0.tot
+    np.testing.assert_allclose(np.sum(ddd1.ntri), np.sum(ddd0.ntri), rtol=0.1)
+    np.testing.assert_allclose(np.sum(ddd1.weight), np.sum(ddd0.weight), rtol=0.1)
+    assert ddd1.sample_var.shape == ddd1.weight.ravel().shape
+
+    # The same rng gives the same sample.
+    ddd2 = treecorr.NNNCorrelation(config, sample_rate=0.2, sample_groups=8,
+                                   rng=np.random.RandomState(1234))
+    ddd2.process(cat)
+    np.testing.assert_array_equal(ddd2.weight, ddd1.weight)
+    np.testing.assert_array_equal(ddd2.sample_var, ddd1.sample_var)
+
 
 if __name__ == '__main__':
     test_log_binning()
@@ -2758,3 +2868,5 @@ if __name__ == '__main__':
     test_nnn()
     test_3d()
     test_list()
+    test_multipole()
+    test_sample()
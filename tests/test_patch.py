@@ -70,6 +70,63 @@ def test_cat_patches():
     assert len(cat2.patches) == npatch
     assert all([c.npatch == npatch for c in cat2.patches])
 
+    # 2b. With kmeans_cache_dir, the patches are saved, and read back rather than running
+    #     kmeans again for another catalog with the same positions.
+    cache_dir = os.path.join('output','kmeans_cache')
+    if os.path.isdir(cache_dir):
+        for f in os.listdir(cache_dir):
+            os.remove(os.path.join(cache_dir, f))
+    cat2a = treecorr.Catalog(ra=ra, dec=dec, ra_units='rad', dec_units='rad', npatch=npatch,
+                             kmeans_cache_dir=cache_dir)
+    np.testing.assert_array_equal(cat2a.patch, cat1.patch)
+    np.testing.assert_array_equal(cat2a.patch_centers, cat1.patch_centers)
+    cache_files = os.listdir(cache_dir)
+    assert len(cache_files) == 1
+    cache_file = os.path.join(cache_dir, cache_files[0])
+    # Change the cached patches to check that they really are the ones used.
+    with np.load(cache_file) as data:
+        assert data['patch'].dtype == np.uint8
+        cache_centers = data['centers']
+        cache_patch = data['patch']
+    np.savez(cache_file, centers=cache_centers, patch=npatch-1-cache_patch)
+    cat2b = treecorr.Catalog(ra=ra, dec=dec, ra_units='rad', dec_units='rad', npatch=npatch,
+                             kmeans_cache_dir=cache_dir)
+    np.testing.assert_array_equal(cat2b.patch, npatch-1-cat1.patch)
+    np.testing.assert_array_equal(cat2b.patch_centers, cat1.patch_centers)
+    # Different parameters or positions use a different cache file.
+    cat2c = treecorr.Catalog(ra=ra, dec=dec, ra_units='rad', dec_units='rad', npatch=npatch,
+                             kmeans_alt=True, kmeans_cache_dir=cache_dir)
+    np.testing.assert_array_equal(cat2c.patch, p3)
+    cat2d = treecorr.Catalog(ra=ra[::2], dec=dec[::2], ra_units='rad', dec_units='rad',
+                             npatch=npatch, kmeans_cache_dir=cache_dir)
+    assert len(os.listdir(cache_dir)) == 3
+    # An invalid cache file is ignored (and replaced).
+    with open(cache_file, 'w') as f:
+        f.write('invalid')
+    with CaptureLog() as cl:
+        cat2e = treecorr.Catalog(ra=ra, dec=dec, ra_units='rad', dec_units='rad',
+                                 npatch=npatch, kmeans_cache_dir=cache_dir, logger=cl.logger)
+    assert 'Invalid kmeans cache file' in cl.output
+    np.testing.assert_array_equal(cat2e.patch, cat1.patch)
+    with np.load(cache_file) as data:
+        np.testing.assert_array_equal(data['patch'], cat1.patch)
+    # Reading from the cache advances the rng the same way as running kmeans.
+    rng1 = np.random.RandomState(1234)
+    rng2 = np.random.RandomState(1234)
+    for f in os.listdir(cache_dir):
+        os.remove(os.path.join(cache_dir, f))
+    cat2f = treecorr.Catalog(ra=ra, dec=dec, ra_units='rad', dec_units='rad', npatch=npatch,
+                             kmeans_cache_dir=cache_dir, rng=rng1)
+    cat2g = treecorr.Catalog(ra=ra, dec=dec, ra_units='rad', dec_units='rad', npatch=npatch,
+                             kmeans_cache_dir=cache_dir, rng=rng2)
+    assert len(os.listdir(cache_dir)) == 1
+    np.testing.assert_array_equal(cat2g.patch, cat2f.patch)
+    assert rng2.random_sample() == rng1.random_sample()
+    # An empty kmeans_cache_dir means no cache.
+    cat2h = treecorr.Catalog(ra=ra, dec=dec, ra_units='rad', dec_units='rad', npatch=npatch,
+                             kmeans_cache_dir='')
+    np.testing.assert_array_equal(cat2h.patch, cat1.patch)
+
     # 3. Optionally can set different init method
     cat3 = treecorr.Catalog(ra=ra, dec=dec, ra_units='rad', dec_units='rad', npatch=npatch,
                             kmeans_init='kmeans++')
@@ -430,6 +487,33 @@ def test_cat_centers():
         assert cat == cat15_patches[i]
         assert cat == cat15.patches[i]
 
+    # With many patch centers, the closest one is found with a kd-tree of the centers.
+    # Check that this gives the same answer as checking all of them.
+    many_centers = np.column_stack([rng.uniform(-30,30,300), rng.uniform(70,130,300)])
+    cat16 = treecorr.Catalog(x=x[:1000], y=y[:1000], patch_centers=many_centers)
+    dsq = (x[:1000,None] - many_centers[:,0])**2 + (y[:1000,None] - many_centers[:,1])**2
+    np.testing.assert_array_equal(cat16.patch, np.argmin(dsq, axis=1))
+    many_centers = np.column_stack([rng.normal(0,s,300), rng.normal(0,s,300)+100,
+                                    rng.normal(0,s,300)])
+    many_centers /= np.sqrt(np.sum(many_centers**2, axis=1))[:,np.newaxis]
+    cat17 = treecorr.Catalog(ra=ra[:1000], dec=dec[:1000], ra_units='rad', dec_units='rad',
+                             patch_centers=many_centers)
+    xyz = np.column_stack([x[:1000], y[:1000], z[:1000]])
+    xyz /= np.sqrt(np.sum(xyz**2, axis=1))[:,np.newaxis]
+    dsq = np.sum((xyz[:,None,:] - many_centers)**2, axis=2)
+    np.testing.assert_array_equal(cat17.patch, np.argmin(dsq, axis=1))
+
+    # With ra, dec in degrees, the units, x,y,z and patches are all done in one pass.
+    # Check that this matches doing them separately.
+    cat18 = treecorr.Catalog(ra=ra[:1000]*180/np.pi, dec=dec[:1000]*180/np.pi,
+                             ra_units='deg', dec_units='deg', patch_centers=many_centers)
+    np.testing.assert_allclose(cat18.ra, cat17.ra, rtol=1.e-12)
+    np.testing.assert_allclose(cat18.x, cat17.x, atol=1.e-12)
+    np.testing.assert_array_equal(cat18.patch, cat17.patch)
+    cat19 = treecorr.Catalog(ra=ra*180/np.pi, dec=dec*180/np.pi,
+                             ra_units='deg', dec_units='deg', patch_centers=centers2)
+    np.testing.assert_array_equal(cat19.patch, cat1.patch)
+
     # Check fits
     try:
         import fitsio
@@ -878,6 +962,37 @@ def test_gg_jk():
     covxip5 = gg5.estimate_cov('jackknife', func=lambda gg: gg.xip)
     np.testing.assert_allclose(covxip5, covxip)
 
+    # And with save_patch_results, which only needs the patch results.
+    file_name = os.path.join('output','test_save_patch_results_gg.npz')
+    gg3.save_patch_results(file_name)
+    gg6 = treecorr.GGCorrelation(bin_size=0.3, min_sep=10., max_sep=50.)
+    gg6.load_patch_results(file_name)
+    assert len(gg6.results) == len(gg3.results)
+    cov6 = gg6.estimate_cov('jackknife')
+    np.testing.assert_allclose(cov6, gg3.cov)
+    covxip6 = gg6.estimate_cov('jackknife', func=lambda gg: gg.xip)
+    np.testing.assert_allclose(covxip6, covxip)
+    for key in list(gg3.results.keys())[:5]:
+        np.testing.assert_array_equal(gg6.results[key].xip, gg3.results[key].xip)
+        np.testing.assert_array_equal(gg6.results[key].npairs, gg3.results[key].npairs)
+
+    # In single precision with compression, the file is smaller and the results are close.
+    file_name2 = os.path.join('output','test_save_patch_results_gg_32.npz')
+    gg3.save_patch_results(file_name2, dtype=np.float32, compress=True)
+    assert os.path.getsize(file_name2) < os.path.getsize(file_name)
+    gg7 = treecorr.GGCorrelation(bin_size=0.3, min_sep=10., max_sep=50.)
+    gg7.load_patch_results(file_name2)
+    cov7 = gg7.estimate_cov('jackknife')
+    np.testing.assert_allclose(cov7, gg3.cov, rtol=1.e-4)
+
+    # The file has to match the class and binning.
+    with assert_raises(ValueError):
+        treecorr.KKCorrelation(bin_size=0.3, min_sep=10., max_sep=50.).load_patch_results(
+            file_name)
+    with assert_raises(ValueError):
+        treecorr.GGCorrelation(bin_size=0.1, min_sep=10., max_sep=50.).load_patch_results(
+            file_name)
+
     # And also try to match the type if HDF
     try:
         import h5py
@@ -1504,6 +1619,17 @@ def test_nn_jk():
     cov5 = nn5.estimate_cov('jackknife')
     np.testing.assert_allclose(cov5, nn3.cov)
 
+    # And with the patch results from save_patch_results.
+    nn3.save_patch_results(os.path.join('output','test_save_patch_results_dd.npz'))
+    rr.save_patch_results(os.path.join('output','test_save_patch_results_rr.npz'))
+    nr3.save_patch_results(os.path.join('output','test_save_patch_results_dr.npz'))
+    nn5.load_patch_results(os.path.join('output','test_save_patch_results_dd.npz'))
+    rr5.load_patch_results(os.path.join('output','test_save_patch_results_rr.npz'))
+    dr5.load_patch_results(os.path.join('output','test_save_patch_results_dr.npz'))
+    nn5.calculateXi(rr=rr5, dr=dr5)
+    cov5 = nn5.estimate_cov('jackknife')
+    np.testing.assert_allclose(cov5, nn3.cov)
+
     # And also try to match the type if HDF
     try:
         import h5py
@@ -3280,6 +3406,362 @@ def test_huge_npatch():
     print('Time to calculate marked_bootstrap covariance = ',t1-t0)
     print('varxi = ',cov.diagonal())
 
+@timer
+def test_patch_pairs():
+    # When processing with patches, all the pairs of patches are done in a single call to the
+    # C layer.  Check that each pair's results are the same as processing it on its own.
+    rng = np.random.RandomState(8675309)
+    ngal = 2000
+    x = rng.uniform(0,100, ngal)
+    y = rng.uniform(0,100, ngal)
+    g1 = rng.normal(0,0.1, ngal)
+    g2 = rng.normal(0,0.1, ngal)
+    cat = treecorr.Catalog(x=x, y=y, g1=g1, g2=g2, npatch=8, rng=rng)
+    patches = cat.get_patches()
+
+    gg = treecorr.GGCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    gg.process(cat)
+    print('npairs of patches = ',len(gg.results))
+    for (i,j), gg_ij in gg.results.items():
+        gg1 = treecorr.GGCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+        if i == j:
+            gg1.process_auto(patches[i])
+        else:
+            gg1.process_cross(patches[i], patches[j])
+        np.testing.assert_allclose(gg_ij.npairs, gg1.npairs)
+        np.testing.assert_allclose(gg_ij.weight, gg1.weight)
+        np.testing.assert_allclose(gg_ij.xip, gg1.xip, atol=1.e-12)
+        np.testing.assert_allclose(gg_ij.xim, gg1.xim, atol=1.e-12)
+
+    # NN cross also needs to get tot right for each pair.
+    x2 = rng.uniform(0,100, ngal)
+    y2 = rng.uniform(0,100, ngal)
+    cat2 = treecorr.Catalog(x=x2, y=y2, patch_centers=cat.patch_centers)
+    patches2 = cat2.get_patches()
+    nn = treecorr.NNCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    nn.process(cat, cat2)
+    assert len(nn.results) == 64
+    np.testing.assert_allclose(nn.tot, cat.sumw * cat2.sumw)
+    for (i,j), nn_ij in nn.results.items():
+        nn1 = treecorr.NNCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+        nn1.process_cross(patches[i], patches2[j])
+        np.testing.assert_allclose(nn_ij.npairs, nn1.npairs)
+        np.testing.assert_allclose(nn_ij.tot, nn1.tot)
+
+    # The same with low_mem, which still processes one pair of patches at a time.
+    nn2 = treecorr.NNCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    nn2.process(cat, cat2, low_mem=True)
+    np.testing.assert_allclose(nn2.npairs, nn.npairs)
+    np.testing.assert_allclose(nn2.tot, nn.tot)
+
+    # The pairs of patches that are too far apart are found with one call to the C layer.
+    # Check that it matches checking each pair on its own.
+    zero = nn._trivially_zero_pairs(patches, patches2)
+    assert zero.shape == (8,8)
+    for i in range(8):
+        for j in range(8):
+            assert zero[i,j] == bool(nn._trivially_zero(patches[i], patches2[j], None))
+
+
+@timer
+def test_cov_design_matrix():
+    # Without func, the design matrices for the statistics that are just ratios to the weight
+    # are built in C++ from the results for each pair of patches.  Check that they match the
+    # Python version, which is used when func is given.
+    rng = np.random.RandomState(8675309)
+    ngal = 3000
+    x = rng.uniform(0,100, ngal)
+    y = rng.uniform(0,100, ngal)
+    g1 = rng.normal(0,0.1, ngal)
+    g2 = rng.normal(0,0.1, ngal)
+    k = rng.normal(0,1, ngal)
+    cat = treecorr.Catalog(x=x, y=y, g1=g1, g2=g2, k=k, npatch=12, rng=rng)
+    lens = treecorr.Catalog(x=x[::10], y=y[::10], patch_centers=cat.patch_centers)
+    lens1 = treecorr.Catalog(x=x[::10], y=y[::10])
+
+    gg = treecorr.GGCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    kk = treecorr.KKCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    ng = treecorr.NGCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    nk = treecorr.NKCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    gg.process(cat)
+    kk.process(cat)
+    ng.process(lens, cat)
+    nk.process(lens1, cat)  # npatch1 = 1
+    default_func = lambda corrs: np.concatenate([c.getStat() for c in corrs])
+
+    for corrs in [[gg], [nk], [gg, kk, ng]]:
+        for method in ['jackknife', 'sample', 'bootstrap', 'marked_bootstrap']:
+            state = corrs[0].rng.get_state()
+            A1, w1 = treecorr.build_multi_cov_design_matrix(corrs, method)
+            corrs[0].rng.set_state(state)
+            A2, w2 = treecorr.build_multi_cov_design_matrix(corrs, method, func=default_func)
+            np.testing.assert_allclose(A1, A2, rtol=1.e-10, atol=1.e-14)
+            np.testing.assert_allclose(w1, w2, rtol=1.e-10)
+            corrs[0].rng.set_state(state)
+            cov1 = treecorr.estimate_multi_cov(corrs, method)
+            corrs[0].rng.set_state(state)
+            cov2 = treecorr.estimate_multi_cov(corrs, method, func=default_func)
+            np.testing.assert_allclose(cov1, cov2, rtol=1.e-8, atol=1.e-16)
+
+    # Also from the results read with load_patch_results.
+    file_name = os.path.join('output','test_cov_design_matrix_gg.npz')
+    gg.save_patch_results(file_name)
+    gg2 = treecorr.GGCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    gg2.load_patch_results(file_name)
+    np.testing.assert_allclose(gg2.estimate_cov('jackknife'), gg.estimate_cov('jackknife'),
+                               rtol=1.e-10, atol=1.e-16)
+
+
+@timer
+def test_patch_triplets():
+    # Likewise, the sets of three different patches in a 3pt calculation are all done in a
+    # single call to the C layer, which skips the ones that are too far apart.  Check that
+    # each set's results are the same as processing it on its own.
+    rng = np.random.RandomState(8675309)
+    ngal = 1000
+    x = rng.uniform(0,100, ngal)
+    y = rng.uniform(0,100, ngal)
+    k = rng.normal(0,0.1, ngal)
+    cat = treecorr.Catalog(x=x, y=y, k=k, npatch=8, rng=rng)
+    patches = cat.get_patches()
+    config = dict(nbins=3, min_sep=5., max_sep=20., nubins=2, nvbins=2, bin_slop=0.5)
+
+    kkk = treecorr.KKKCorrelation(**config)
+    kkk.process(cat)
+    print('nsets of patches = ',len(kkk.results))
+    for (i,j,k), kkk_ijk in kkk.results.items():
+        if i == j or j == k:
+            continue
+        kkk1 = treecorr.KKKCorrelation(**config)
+        kkk1.process_cross(patches[i], patches[j], patches[k])
+        np.testing.assert_allclose(kkk_ijk.ntri, kkk1.ntri)
+        np.testing.assert_allclose(kkk_ijk.weight, kkk1.weight)
+        np.testing.assert_allclose(kkk_ijk.zeta, kkk1.zeta, atol=1.e-12)
+
+    # NNN cross also needs to get tot right for each set, including the skipped ones.
+    x2 = rng.uniform(0,100, ngal)
+    y2 = rng.uniform(0,100, ngal)
+    cat2 = treecorr.Catalog(x=x2, y=y2, patch_centers=cat.patch_centers)
+    patches2 = cat2.get_patches()
+    nnn = treecorr.NNNCrossCorrelation(**config)
+    nnn.process(cat, cat2, cat)
+    assert len(nnn.results) == 512
+    np.testing.assert_allclose(nnn.tot, cat.sumw**2 * cat2.sumw)
+    for (i,j,k), nnn_ijk in nnn.results.items():
+        nnn1 = treecorr.NNNCrossCorrelation(**config)
+        nnn1.process_cross(patches[i], patches2[j], patches[k])
+        np.testing.assert_allclose(nnn_ijk.n1n2n3.ntri, nnn1.n1n2n3.ntri)
+        np.testing.assert_allclose(nnn_ijk.n3n2n1.ntri, nnn1.n3n2n1.ntri)
+        np.testing.assert_allclose(nnn_ijk.tot, nnn1.tot)
+
+    # The same with low_mem, which still processes one set of patches at a time.
+    nnn2 = treecorr.NNNCrossCorrelation(**config)
+    nnn2.process(cat, cat2, cat, low_mem=True)
+    for n2, n in zip(nnn2._all, nnn._all):
+        np.testing.assert_allclose(n2.ntri, n.ntri)
+    np.testing.assert_allclose(nnn2.tot, nnn.tot)
+
+
+@timer
+def test_patch_field():
+    # With patch_field=True, the patches are processed with one field for the whole catalog,
+    # whose top-level cells are grouped by patch.  The results should match the normal way,
+    # which makes a catalog and field for each patch.
+    rng = np.random.RandomState(8675309)
+    ngal = 2000
+    x = rng.uniform(0,100, ngal)
+    y = rng.uniform(0,100, ngal)
+    g1 = rng.normal(0,0.1, ngal)
+    g2 = rng.normal(0,0.1, ngal)
+    cat = treecorr.Catalog(x=x, y=y, g1=g1, g2=g2, npatch=8, rng=rng)
+    pcat = treecorr.Catalog(x=x, y=y, g1=g1, g2=g2, patch_centers=cat.patch_centers,
+                            patch_field=True)
+
+    field = pcat.getGField()
+    assert field.npatch == 8
+    assert cat.getGField().npatch == 1
+    with assert_raises(ValueError):
+        field.insert(cat)
+
+    gg = treecorr.GGCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    gg.process(cat)
+    gg2 = treecorr.GGCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    gg2.process(pcat)
+    # This didn't need the patch catalogs.
+    assert pcat._patches is None
+    assert sorted(gg2.results.keys()) == sorted(gg.results.keys())
+    for key in gg.results:
+        np.testing.assert_allclose(gg2.results[key].npairs, gg.results[key].npairs)
+        np.testing.assert_allclose(gg2.results[key].xip, gg.results[key].xip, atol=1.e-12)
+        np.testing.assert_allclose(gg2.results[key].xim, gg.results[key].xim, atol=1.e-12)
+    np.testing.assert_allclose(gg2.xip, gg.xip)
+    np.testing.assert_allclose(gg2.varxip, gg.varxip)
+    np.testing.assert_allclose(gg2.estimate_cov('jackknife'), gg.estimate_cov('jackknife'))
+
+    # low_mem doesn't matter here.
+    gg2.process(pcat, low_mem=True)
+    np.testing.assert_allclose(gg2.xip, gg.xip)
+
+    # NN cross, including the tot for each pair.
+    x2 = rng.uniform(0,100, ngal)
+    y2 = rng.uniform(0,100, ngal)
+    cat2 = treecorr.Catalog(x=x2, y=y2, patch_centers=cat.patch_centers)
+    pcat2 = treecorr.Catalog(x=x2, y=y2, patch_centers=cat.patch_centers, patch_field=True)
+    nn = treecorr.NNCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    nn.process(cat, cat2)
+    nn2 = treecorr.NNCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    nn2.process(pcat, pcat2)
+    assert len(nn2.results) == 64
+    np.testing.assert_allclose(nn2.npairs, nn.npairs)
+    np.testing.assert_allclose(nn2.tot, nn.tot)
+    for key in nn.results:
+        np.testing.assert_allclose(nn2.results[key].npairs, nn.results[key].npairs)
+        np.testing.assert_allclose(nn2.results[key].tot, nn.results[key].tot)
+
+    # NG cross.  If only one catalog uses patch_field, it goes back to the normal way.
+    ng = treecorr.NGCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    ng.process(cat2, cat)
+    ng2 = treecorr.NGCorrelation(bin_size=0.3, min_sep=1., max_sep=20.)
+    ng2.process(pcat2, pcat)
+    np.testing.assert_allclose(ng2.xi, ng.xi)
+    np.testing.assert_allclose(ng2.estimate_cov('jackknife'), ng.estimate_cov('jackknife'))
+    ng2.process(cat2, pcat)
+    np.testing.assert_allclose(ng2.xi, ng.xi)
+
+
+@timer
+def test_checkpoint():
+    # With checkpoint_file, process saves its progress, so if it is interrupted, it can be
+    # resumed by calling it again.  The interruption is simulated by making one of the methods
+    # of the class raise an exception after a few calls.
+    class Interrupt(Exception):
+        pass
+
+    def run_interrupted(cls, name, ncalls, corr, *args, **kwargs):
+        # Run corr.process(*args, **kwargs), with cls.name raising Interrupt on call ncalls.
+        orig = getattr(cls, name)
+        count = [0]
+        def interrupted(self, *a, **kw):
+            count[0] += 1
+            if count[0] == ncalls:
+                raise Interrupt()
+            return orig(self, *a, **kw)
+        setattr(cls, name, interrupted)
+        try:
+            with assert_raises(Interrupt):
+                corr.process(*args, **kwargs)
+        finally:
+            setattr(cls, name, orig)
+
+    rng = np.random.RandomState(8675309)
+    ngal = 2000
+    x = rng.uniform(0,100, ngal)
+    y = rng.uniform(0,100, ngal)
+    k = rng.normal(0,0.1, ngal)
+    cat = treecorr.Catalog(x=x, y=y, k=k, npatch=16, rng=rng)
+    x2 = rng.uniform(0,100, ngal)
+    y2 = rng.uniform(0,100, ngal)
+    cat2 = treecorr.Catalog(x=x2, y=y2, patch_centers=cat.patch_centers)
+    file_name = os.path.join('output','test_checkpoint.npz')
+    config = dict(bin_size=0.3, min_sep=1., max_sep=20., num_threads=2)
+
+    # NN cross, where all the pairs of patches are done in chunks.
+    nn = treecorr.NNCorrelation(config)
+    nn.process(cat, cat2)
+    for low_mem, name in [(False, '_process_patch_pairs'), (True, 'process_cross')]:
+        if os.path.exists(file_name):
+            os.remove(file_name)
+        nn1 = treecorr.NNCorrelation(config, checkpoint_file=file_name, checkpoint_interval=0)
+        run_interrupted(treecorr.BinnedCorr2 if name[0] == '_' else treecorr.NNCorrelation,
+                        name, 3, nn1, cat, cat2, low_mem=low_mem)
+        assert os.path.exists(file_name)
+        nn2 = treecorr.NNCorrelation(config, checkpoint_file=file_name, checkpoint_interval=0)
+        nn2.process(cat, cat2, low_mem=low_mem)
+        np.testing.assert_allclose(nn2.npairs, nn.npairs)
+        np.testing.assert_allclose(nn2.tot, nn.tot)
+        assert sorted(nn2.results.keys()) == sorted(nn.results.keys())
+        for key in nn.results:
+            np.testing.assert_allclose(nn2.results[key].npairs, nn.results[key].npairs)
+            np.testing.assert_allclose(nn2.results[key].tot, nn.results[key].tot)
+        np.testing.assert_allclose(nn2.estimate_cov('jackknife'), nn.estimate_cov('jackknife'))
+
+        # Once it's all done, running it again only reads the checkpoint.
+        nn3 = treecorr.NNCorrelation(config, checkpoint_file=file_name)
+        orig = treecorr.NNCorrelation.process_cross
+        treecorr.NNCorrelation.process_cross = None
+        try:
+            nn3.process(cat, cat2, low_mem=True)
+        finally:
+            treecorr.NNCorrelation.process_cross = orig
+        np.testing.assert_allclose(nn3.npairs, nn.npairs)
+        np.testing.assert_allclose(nn3.tot, nn.tot)
+
+    # A checkpoint of a different calculation is an error.
+    kk = treecorr.KKCorrelation(config, checkpoint_file=file_name)
+    with assert_raises(ValueError):
+        kk.process(cat)
+    nn4 = treecorr.NNCorrelation(config, checkpoint_file=file_name)
+    with assert_raises(ValueError):
+        nn4.process(cat)
+    # Including the same kind of calculation with other catalogs, e.g. RR after DD, or with
+    # a different bin_slop.
+    rand = treecorr.Catalog(x=y2, y=x2, patch_centers=cat.patch_centers)
+    with assert_raises(ValueError):
+        treecorr.NNCorrelation(config, checkpoint_file=file_name).process(rand, cat2)
+    with assert_raises(ValueError):
+        treecorr.NNCorrelation(config, bin_slop=0.5, checkpoint_file=file_name).process(cat, cat2)
+
+    # KK auto, both ways.
+    os.remove(file_name)
+    kk = treecorr.KKCorrelation(config)
+    kk.process(cat)
+    for low_mem, name in [(False, '_process_patch_pairs'), (True, 'process_cross')]:
+        if os.path.exists(file_name):
+            os.remove(file_name)
+        kk1 = treecorr.KKCorrelation(config, checkpoint_file=file_name, checkpoint_interval=0)
+        run_interrupted(treecorr.BinnedCorr2 if name[0] == '_' else treecorr.KKCorrelation,
+                        name, 3, kk1, cat, low_mem=low_mem)
+        kk2 = treecorr.KKCorrelation(config, checkpoint_file=file_name, checkpoint_interval=0)
+        kk2.process(cat, low_mem=low_mem)
+        np.testing.assert_allclose(kk2.weight, kk.weight)
+        np.testing.assert_allclose(kk2.xi, kk.xi)
+        np.testing.assert_allclose(kk2.estimate_cov('jackknife'), kk.estimate_cov('jackknife'))
+
+    # KKK with patches, where the sets of three patches are done in chunks.
+    config3 = dict(nbins=3, min_sep=5., max_sep=20., nubins=2, nvbins=2, bin_slop=0.5,
+                   num_threads=2)
+    cat3 = treecorr.Catalog(x=x[:500], y=y[:500], k=k[:500], npatch=8, rng=rng)
+    kkk = treecorr.KKKCorrelation(config3)
+    kkk.process(cat3)
+    os.remove(file_name)
+    kkk1 = treecorr.KKKCorrelation(config3, checkpoint_file=file_name, checkpoint_interval=0)
+    run_interrupted(treecorr.BinnedCorr3, '_process_patch_triplets', 2, kkk1, cat3)
+    kkk2 = treecorr.KKKCorrelation(config3, checkpoint_file=file_name, checkpoint_interval=0)
+    kkk2.process(cat3)
+    np.testing.assert_allclose(kkk2.ntri, kkk.ntri)
+    np.testing.assert_allclose(kkk2.zeta, kkk.zeta)
+    assert sorted(kkk2.results.keys()) == sorted(kkk.results.keys())
+
+    # KKK without patches, which is done in chunks of the top-level cells.
+    cat4 = treecorr.Catalog(x=x[:500], y=y[:500], k=k[:500])
+    kkk = treecorr.KKKCorrelation(config3, min_top=6)
+    kkk.process(cat4)
+    os.remove(file_name)
+    kkk1 = treecorr.KKKCorrelation(config3, min_top=6, checkpoint_file=file_name,
+                                   checkpoint_interval=0)
+    run_interrupted(treecorr.KKKCorrelation, 'process_auto', 3, kkk1, cat4)
+    kkk2 = treecorr.KKKCorrelation(config3, min_top=6, checkpoint_file=file_name,
+                                   checkpoint_interval=0)
+    kkk2.process(cat4)
+    np.testing.assert_allclose(kkk2.ntri, kkk.ntri)
+    np.testing.assert_allclose(kkk2.weight, kkk.weight)
+    np.testing.assert_allclose(kkk2.zeta, kkk.zeta, rtol=1.e-8, atol=1.e-12)
+
+    # Not with sample_rate.
+    kkk3 = treecorr.KKKCorrelation(config3, checkpoint_file=file_name, sample_rate=0.5)
+    with assert_raises(NotImplementedError):
+        kkk3.process(cat4)
+
 
 if __name__ == '__main__':
     test_cat_patches()
@@ -3295,3 +3777,8 @@ if __name__ == '__main__':
     test_config()
     test_finalize_false()
     test_empty_patches()
+    test_patch_pairs()
+    test_cov_design_matrix()
+    test_patch_triplets()
+    test_patch_field()
+    test_checkpoint()
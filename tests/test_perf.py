@@ -0,0 +1,213 @@
+# Copyright (c) 2003-2019 by Mike Jarvis
+#
+# TreeCorr is free software: redistribution and use in source and binary forms,
+# with or without modification, are permitted provided that the following
+# conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions, and the disclaimer given in the accompanying LICENSE
+#    file.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions, and the disclaimer given in the documentation
+#    and/or other materials provided with the distribution.
+
+# Performance regression tests.  These run fixed synthetic workloads, which take a few minutes
+# in all, so they are only run if the environment variable TREECORR_PERF_TESTS is set:
+#
+#   TREECORR_PERF_TESTS=1 python test_perf.py       Compare to the baseline
+#   TREECORR_PERF_TESTS=record python test_perf.py  Record a new baseline
+#
+# The baseline is in perf_baseline.json.  A workload that is missing from it fails, unless
+# TREECORR_PERF_TESTS=record, so a new workload needs its baseline recorded along with it.
+#
+# The tests fail if the amount of work in the traversal of the trees goes up significantly
+# from the baseline.  The counts of the pairs or triangles of cells that were checked, split
+# and accumulated don't depend on the machine, so they catch changes that make the pruning
+# worse (e.g. in Metric.h or BinType.h).  They are only kept if TreeCorr was built with
+# TREECORR_PRUNE_STATS=1.  The timings are also compared, but since they depend on the machine
+# and the load on it, a slow one only prints a warning.  (The committed baseline only has the
+# counts, so the timings are only compared to a baseline recorded on the same machine.)
+
+import numpy as np
+import treecorr
+import os
+import json
+import time
+
+from test_helper import timer
+
+perf_tests = os.environ.get('TREECORR_PERF_TESTS', '0')
+baseline_file = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'perf_baseline.json')
+
+# How much the counts may go up before the test fails, and how much slower the time may be
+# before it warns, as fractions of the baseline values.
+count_tol = 0.02
+time_tol = 0.5
+
+# Use a fixed number of threads and min_top, so the trees and the timings are comparable.
+num_threads = 4
+min_top = 4
+
+# The counts from get_prune_stats that measure how much work the traversal did.
+work_counts2 = ['pairs', 'single_bin', 'leaf', 'split1', 'split2', 'split_both',
+                'bucket_leaf_pairs']
+
+def skip():
+    if perf_tests in ['', '0']:
+        print('Skipping performance tests, since TREECORR_PERF_TESTS is not set')
+        return True
+    return False
+
+def prune_stats3(nnn):
+    # The counts for a three-point correlation from GetPruneStats3.  (cf. PruneStats3.h)
+    counts = np.zeros(15, dtype=np.int_)
+    terminal = np.zeros(nnn.ntri.size, dtype=np.int_)
+    depth = np.zeros(1, dtype=float)
+    if not treecorr._lib.GetPruneStats3(nnn.corr, nnn._d1, nnn._d2, nnn._d3, nnn._bintype,
+                                        treecorr._ffi.cast('long*', counts.ctypes.data),
+                                        treecorr._ffi.cast('long*', terminal.ctypes.data),
+                                        treecorr._ffi.cast('double*', depth.ctypes.data)):
+        return None
+    names = ['triangles', 'split1', 'split2', 'split3']
+    stats = { name: int(c) for name, c in zip(names, counts) }
+    stats['accumulated'] = int(counts[14])
+    return stats
+
+def check_baseline(name, elapsed, counts):
+    """Compare the time and counts of a workload to its baseline, or record them.
+
+    counts is a dict of values that should not go up, or None if they weren't kept.
+    """
+    print('%s: time = %.2f'%(name, elapsed))
+    print('%s: counts = %s'%(name, counts))
+    baseline = {}
+    if os.path.exists(baseline_file):
+        with open(baseline_file) as fin:
+            baseline = json.load(fin)
+
+    if perf_tests == 'record':
+        baseline[name] = { 'time': elapsed, 'num_threads': num_threads, 'counts': counts }
+        with open(baseline_file, 'w') as fout:
+            json.dump(baseline, fout, indent=2, sort_keys=True)
+            fout.write('\n')
+        print('%s: recorded baseline in %s'%(name, baseline_file))
+        return
+
+    assert name in baseline, ('%s is not in %s.  Run with TREECORR_PERF_TESTS=record to '
+                              'record it.'%(name, baseline_file))
+    base = baseline[name]
+    if base.get('time') is not None and base['num_threads'] == num_threads:
+        ratio = elapsed / base['time']
+        print('%s: time is %.2f times the baseline'%(name, ratio))
+        if ratio > 1. + time_tol:
+            print('Warning: %s is slower than the baseline (%.2f vs %.2f seconds)'%(
+                  name, elapsed, base['time']))
+
+    if counts is None or base['counts'] is None:
+        print('%s: not comparing counts, since they were not kept'%name)
+        return
+    worse = []
+    for k in counts:
+        if k in base['counts'] and counts[k] > base['counts'][k] * (1. + count_tol):
+            worse.append('%s = %s vs %s'%(k, counts[k], base['counts'][k]))
+    assert not worse, '%s did more work than the baseline: %s'%(name, ', '.join(worse))
+
+
+@timer
+def test_perf_gg_log():
+    if skip(): return
+
+    ngal = 10**6
+    L = 1000.
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0, L, ngal)
+    y = rng.uniform(0, L, ngal)
+    g1 = rng.normal(0, 0.2, ngal)
+    g2 = rng.normal(0, 0.2, ngal)
+    cat = treecorr.Catalog(x=x, y=y, g1=g1, g2=g2)
+
+    gg = treecorr.GGCorrelation(min_sep=1., max_sep=50., nbins=20, bin_type='Log',
+                                min_top=min_top)
+    t0 = time.time()
+    gg.process(cat, num_threads=num_threads)
+    t1 = time.time()
+
+    stats = gg.get_prune_stats()
+    counts = None if stats is None else { k: stats[k] for k in work_counts2 }
+    check_baseline('gg_log', t1-t0, counts)
+
+
+@timer
+def test_perf_nn_rperp():
+    if skip(): return
+
+    ngal = 10**6
+    L = 1000.
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0, L, ngal)
+    y = rng.uniform(0, L, ngal)
+    z = rng.uniform(0, L, ngal) + 2*L   # So the line of sight is mostly along z.
+    cat = treecorr.Catalog(x=x, y=y, z=z)
+
+    nn = treecorr.NNCorrelation(min_sep=1., max_sep=50., nbins=20, min_rpar=-20., max_rpar=20.,
+                                min_top=min_top)
+    t0 = time.time()
+    nn.process(cat, metric='Rperp', num_threads=num_threads)
+    t1 = time.time()
+
+    stats = nn.get_prune_stats()
+    counts = None if stats is None else { k: stats[k] for k in work_counts2 }
+    check_baseline('nn_rperp', t1-t0, counts)
+
+
+@timer
+def test_perf_nnn():
+    if skip(): return
+
+    ngal = 2 * 10**4
+    L = 200.
+    rng = np.random.RandomState(8675309)
+    x = rng.uniform(0, L, ngal)
+    y = rng.uniform(0, L, ngal)
+    cat = treecorr.Catalog(x=x, y=y)
+
+    nnn = treecorr.NNNCorrelation(min_sep=1., max_sep=20., nbins=10, nubins=5, nvbins=5,
+                                  min_top=min_top)
+    t0 = time.time()
+    nnn.process(cat, num_threads=num_threads)
+    t1 = time.time()
+
+    check_baseline('nnn', t1-t0, prune_stats3(nnn))
+
+
+@timer
+def test_perf_kmeans():
+    if skip(): return
+
+    ngal = 10**6
+    npatch = 100
+    rng = np.random.RandomState(8675309)
+    ra = rng.uniform(0, 60, ngal)
+    dec = np.arcsin(rng.uniform(np.sin(-60*np.pi/180), np.sin(-30*np.pi/180), ngal))
+    dec *= 180. / np.pi
+    cat = treecorr.Catalog(ra=ra, dec=dec, ra_units='deg', dec_units='deg')
+
+    treecorr.set_omp_threads(num_threads)
+    field = cat.getNField(min_top=min_top)
+    t0 = time.time()
+    patches, cen = field.run_kmeans(npatch, rng=np.random.RandomState(1234))
+    t1 = time.time()
+    treecorr.set_omp_threads(None)
+
+    # There are no counts of the traversal for kmeans, but the total inertia is also
+    # independent of the machine (up to rounding), and it shouldn't go up.
+    xyz = np.array([cat.x, cat.y, cat.z]).T
+    inertia = np.sum((xyz - cen[patches])**2)
+    check_baseline('kmeans', t1-t0, { 'inertia': float(inertia) })
+
+
+if __name__ == '__main__':
+    test_perf_gg_log()
+    test_perf_nn_rperp()
+    test_perf_nnn()
+    test_perf_kmeans()
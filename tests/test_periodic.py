@@ -479,6 +479,125 @@ def test_3pt():
         ddd.process(cat)
 
 
+@timer
+def test_top_level_cells():
+    # With many top-level cells, most pairs of them don't need any wrapping, so they are
+    # processed with the Euclidean metric.  Check that this still matches the brute force
+    # periodic counts, both for the pairs of cells that straddle the edges and those that don't.
+
+    ngal = 2000
+    L = 100.
+    rng = np.random.RandomState(8675309)
+    x1 = rng.random_sample(ngal) * L
+    y1 = rng.random_sample(ngal) * L
+    z1 = rng.random_sample(ngal) * L
+    x2 = rng.random_sample(ngal) * L
+    y2 = rng.random_sample(ngal) * L
+    z2 = rng.random_sample(ngal) * L
+
+    min_sep = 1.
+    max_sep = 20.
+    nbins = 10
+    bin_size = np.log(max_sep/min_sep) / nbins
+
+    def true_counts(x1, y1, z1, x2, y2, z2, auto):
+        dx = np.abs(x1[:,None] - x2[None,:])
+        dy = np.abs(y1[:,None] - y2[None,:])
+        dsq = np.minimum(dx, L-dx)**2 + np.minimum(dy, L-dy)**2
+        if z1 is not None:
+            dz = np.abs(z1[:,None] - z2[None,:])
+            dsq += np.minimum(dz, L-dz)**2
+        if auto:
+            dsq = dsq[np.triu_indices(len(x1), 1)]
+        k = np.floor((0.5*np.log(dsq[dsq > 0]) - np.log(min_sep)) / bin_size).astype(int)
+        return np.bincount(k[(k >= 0) & (k < nbins)], minlength=nbins)
+
+    for z1_, z2_ in [(None, None), (z1, z2)]:
+        true_auto = true_counts(x1, y1, z1_, x1, y1, z1_, True)
+        true_cross = true_counts(x1, y1, z1_, x2, y2, z2_, False)
+        for use_packed in [False, True]:
+            cat1 = treecorr.Catalog(x=x1, y=y1, z=z1_, use_packed=use_packed)
+            cat2 = treecorr.Catalog(x=x2, y=y2, z=z2_, use_packed=use_packed)
+            dd = treecorr.NNCorrelation(min_sep=min_sep, max_sep=max_sep, nbins=nbins,
+                                        bin_slop=0, period=L, min_top=6)
+            dd.process(cat1, metric='Periodic')
+            np.testing.assert_array_equal(dd.npairs, true_auto)
+            dd.process(cat1, cat2, metric='Periodic')
+            np.testing.assert_array_equal(dd.npairs, true_cross)
+
+@timer
+def test_analytic_randoms():
+    # With uniform randoms in a periodic box, periodic_rr and periodic_rrr give the expected
+    # counts without needing a random catalog.
+    L = 100.
+    rng = np.random.RandomState(8675309)
+
+    for coords in ['flat', '3d']:
+        nrand = 20000
+        x = rng.random_sample(nrand) * L
+        y = rng.random_sample(nrand) * L
+        z = rng.random_sample(nrand) * L if coords == '3d' else None
+        rcat = treecorr.Catalog(x=x, y=y, z=z)
+        for kwargs in [dict(min_sep=2., max_sep=40., nbins=10),
+                       dict(min_sep=2., max_sep=40., nbins=10, bin_type='Linear'),
+                       dict(min_sep=2., max_sep=30., nbins=12, bin_type='TwoD')]:
+            if coords == '3d' and kwargs.get('bin_type', None) == 'TwoD':
+                continue
+            rr0 = treecorr.NNCorrelation(period=L, bin_slop=0.1, **kwargs)
+            rr0.process(rcat, metric='Periodic')
+            rr1 = rr0.periodic_rr()
+            print(coords, kwargs)
+            print('rr0 = ',rr0.weight.ravel() / rr0.tot)
+            print('rr1 = ',rr1.weight.ravel() / rr1.tot)
+            assert rr1.tot == 1.e6 * rr0.tot
+            np.testing.assert_allclose(rr1.weight/rr1.tot, rr0.weight/rr0.tot, rtol=0.05,
+                                       atol=1.e-3 * np.max(rr1.weight/rr1.tot))
+            np.testing.assert_array_equal(rr1.npairs, rr1.weight)
+            if kwargs.get('bin_type', None) != 'TwoD':
+                np.testing.assert_allclose(rr1.meanr, rr0.meanr, rtol=1.e-2)
+                np.testing.assert_allclose(rr1.meanlogr, rr0.meanlogr, atol=1.e-2)
+
+            # It can be used directly as rr in calculateXi.
+            xi0, _ = rr0.calculateXi(rr=rr0)
+            xi1, _ = rr0.calculateXi(rr=rr1)
+            np.testing.assert_allclose(xi0, 0., atol=1.e-10)
+            np.testing.assert_allclose(xi1, 0., atol=0.05)
+
+    # Three-point RRR.
+    nrand = 2000
+    x = rng.random_sample(nrand) * L
+    y = rng.random_sample(nrand) * L
+    rcat = treecorr.Catalog(x=x, y=y)
+    rrr0 = treecorr.NNNCorrelation(min_sep=5., max_sep=20., nbins=2, nubins=2, nvbins=2,
+                                   period=L, bin_slop=0.1)
+    rrr0.process(rcat, metric='Periodic')
+    rrr1 = rrr0.periodic_rrr()
+    print('rrr0 = ',rrr0.weight.ravel() / rrr0.tot)
+    print('rrr1 = ',rrr1.weight.ravel() / rrr1.tot)
+    assert rrr1.tot == 1.e9 * rrr0.tot
+    np.testing.assert_allclose(rrr1.weight/rrr1.tot, rrr0.weight/rrr0.tot, rtol=0.1)
+    np.testing.assert_allclose(rrr1.meand2, rrr0.meand2, rtol=0.02)
+    np.testing.assert_allclose(rrr1.meanu, rrr0.meanu, rtol=0.05)
+    np.testing.assert_allclose(rrr1.meanv, rrr0.meanv, rtol=0.05)
+
+    # Invalid uses.
+    rr = treecorr.NNCorrelation(min_sep=1., max_sep=40., nbins=10, period=L)
+    with assert_raises(ValueError):
+        rr.periodic_rr(coords='flat')  # Not processed, so need tot
+    with assert_raises(ValueError):
+        rr.periodic_rr(coords='spherical', tot=1.)
+    with assert_raises(ValueError):
+        rr.periodic_rr(tot=1.)  # Need coords
+    rr = treecorr.NNCorrelation(min_sep=1., max_sep=60., nbins=10, period=L)
+    with assert_raises(ValueError):
+        rr.periodic_rr(coords='flat', tot=1.)  # max_sep > L/2
+    rr = treecorr.NNCorrelation(min_sep=1., max_sep=40., nbins=10)
+    with assert_raises(ValueError):
+        rr.periodic_rr(coords='flat', tot=1.)  # No period
+    rrr = treecorr.NNNCorrelation(min_sep=5., max_sep=30., nbins=2, period=L)
+    with assert_raises(ValueError):
+        rrr.periodic_rrr(coords='flat', tot=1.)  # max_sep > L/4
+
 
 if __name__ == '__main__':
     test_direct_count()
@@ -486,3 +605,5 @@ if __name__ == '__main__':
     test_periodic_ps()
     test_halotools()
     test_3pt()
+    test_top_level_cells()
+    test_analytic_randoms()
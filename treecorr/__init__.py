@@ -49,15 +49,21 @@ Rperp_alias = 'FisherRperp'
 
 from .config import read_config
 from .util import set_omp_threads, get_omp_threads, set_max_omp_threads
+from .util import set_thread_affinity
+from .util import start_thread_timing, stop_thread_timing, start_tracing, stop_tracing
+from .util import get_isa
 from .catalog import Catalog, read_catalogs, calculateVarG, calculateVarK
+from .catalog import calculatePatchCenters
 from .binnedcorr2 import BinnedCorr2, estimate_multi_cov, build_multi_cov_design_matrix
+from .binnedcorr2 import process_multi_cross, process_multi_binning, process_multi_k
+from .binnedcorr2 import InteractionList
 from .ggcorrelation import GGCorrelation
 from .nncorrelation import NNCorrelation
 from .kkcorrelation import KKCorrelation
 from .ngcorrelation import NGCorrelation
 from .nkcorrelation import NKCorrelation
 from .kgcorrelation import KGCorrelation
-from .field import Field, NField, KField, GField
+from .field import Field, NField, KField, GField, estimate_field_memory, wait_for_release
 from .field import SimpleField, NSimpleField, KSimpleField, GSimpleField
 from .binnedcorr3 import BinnedCorr3
 from .nnncorrelation import NNNCorrelation, NNNCrossCorrelation
@@ -21,15 +21,46 @@ import sys
 import coord
 import itertools
 import collections
+import collections.abc
 
-from . import _lib
+from . import _lib, _ffi
 from .config import merge_config, setup_logger, get
 from .util import parse_metric, metric_enum, coord_enum, set_omp_threads, lazy_property
+from .util import get_omp_threads
 from .util import depr_pos_kwargs
+from .util import trace_span
+from .util import Checkpoint
 
 class Namespace(object):
     pass
 
+# The split_factor that CalcSplit in the C++ layer uses by default.
+_default_split_factor = 0.585
+
+# The choices made by BinnedCorr2.tune for each configuration.
+_tune_cache = {}
+
+def _sample_catalog(cat, nsample, rng):
+    # A Catalog with a random subset of nsample of the objects in cat (or cat itself if it
+    # doesn't have more than that).
+    from .catalog import Catalog
+    if cat.ntot <= nsample:
+        return cat
+    index = np.sort(rng.choice(cat.ntot, nsample, replace=False))
+    if cat.ra is not None:
+        kwargs = dict(ra=cat.ra, dec=cat.dec, r=cat.r, ra_units='rad', dec_units='rad')
+    else:
+        kwargs = dict(x=cat.x, y=cat.y, z=cat.z)
+    kwargs.update(w=cat.w, wpos=cat.wpos, k=cat.k, g1=cat.g1, g2=cat.g2)
+    kwargs = { key: value[index] for key, value in kwargs.items()
+               if isinstance(value, np.ndarray) }
+    return Catalog(**kwargs)
+
+class _PatchWeight(object):
+    # Stands in for a patch Catalog in _add_process_tot and _add_tot, which only use sumw.
+    def __init__(self, sumw):
+        self.sumw = sumw
+
 class BinnedCorr2(object):
     """This class stores the results of a 2-point correlation calculation, along with some
     ancillary data.
@@ -85,6 +116,8 @@ class BinnedCorr2(object):
         - 'TwoD' = 2-dimensional binning from x = (-max_sep .. max_sep) and
           y = (-max_sep .. max_sep).  The bin steps will be uniform in both x and y.
           (i.e. linear in x,y)
+        - 'Edges' - the bins are given explicitly by a list of bin_edges, which need not
+          be uniformly spaced in either r or log(r).
 
     See `Binning` for more information about the different binning options.
 
@@ -113,6 +146,11 @@ class BinnedCorr2(object):
                             three of nbins, bin_size, min_sep, max_sep are required.  If max_sep is
                             not given or set to None, it will be calculated from the values of the
                             other three.)
+        bin_edges (list):   For bin_type='Edges', the edges of the bins in units of sep_units,
+                            which must be positive and increasing.  In this case, none of nbins,
+                            bin_size, min_sep, max_sep may be given.  They are set from the edges,
+                            where bin_size is the width in log(separation) of the narrowest bin,
+                            which is what bin_slop is relative to. (default: None)
 
         sep_units (str):    The units to use for the separation values, given as a string.  This
                             includes both min_sep and max_sep above, as well as the units of the
@@ -122,7 +160,11 @@ class BinnedCorr2(object):
                             x,y[,z] coordinates)
         bin_slop (float):   How much slop to allow in the placement of pairs in the bins.
                             If bin_slop = 1, then the bin into which a particular pair is placed
-                            may be incorrect by at most 1.0 bin widths.  (default: None, which
+                            may be incorrect by at most 1.0 bin widths.  For bin_type='Log' or
+                            'Linear', this may also be a list with a value for each bin, e.g.
+                            to allow more slop in the bins where shape noise dominates.  Each
+                            pair of cells then uses the smallest bin_slop of the bins it might
+                            fall into.  (default: None, which
                             means to use a bin_slop that gives a maximum error of 10% on any bin,
                             which has been found to yield good results for most application.
         brute (bool):       Whether to use the "brute force" algorithm.  (default: False) Options
@@ -167,6 +209,14 @@ class BinnedCorr2(object):
                             The top-level cells are where each calculation job starts. There will
                             typically be of order :math:`2^{\\rm max\\_top}` top-level cells.
                             (default: 10)
+        split_factor (float): When a pair of cells is too large to be accumulated into a single
+                            bin, the larger cell is split, and the smaller one is also split if
+                            its size is more than split_factor times the allowed size of the
+                            pair.  This only affects the speed, not the accuracy.
+                            (default: 0.585)
+        auto_tune (bool):   Whether to choose split_factor and min_top for the data by timing
+                            short calculations on a subsample of the first catalog before
+                            processing.  See `tune`.  (default: False)
         precision (int):    The precision to use for the output values. This specifies how many
                             digits to write. (default: 4)
         pairwise (bool):    Whether to use a different kind of calculation for cross correlations
@@ -208,6 +258,38 @@ class BinnedCorr2(object):
 
                                 This won't work if the system's C compiler cannot use OpenMP
                                 (e.g. clang prior to version 3.7.)
+
+        max_accum_mem (float): The maximum total memory in bytes to use for the copies of the
+                            accumulated results made for each thread.  If one copy per thread
+                            would need more than this, some threads share a copy, locking the
+                            bins they update.  This is mostly relevant for bin_type='TwoD' with
+                            large nbins and many threads.  (default: 0, which means no limit)
+        float_accum (bool): Whether the copies of the accumulated results made for each thread
+                            should use single precision.  Each bin of a copy is added to the
+                            double precision results after every few pairs, so the results
+                            are still accurate to about 1.e-6, but the copies only need half as
+                            much memory, so more threads can have their own copy within
+                            max_accum_mem.  (default: False)
+        fft_min_sep (float): If given, the bins whose left edge is at least this separation are
+                            computed by placing the objects on a grid and correlating the
+                            gridded fields with FFTs, rather than by traversing the trees.
+                            The smaller bins are still done with the trees.  The grid pixels
+                            are chosen to give about the same accuracy as bin_slop does for
+                            the trees, so this is much faster when max_sep is large compared
+                            to fft_min_sep.  This is only valid for flat coordinates with the
+                            Euclidean metric, bin_type='Log' or 'Linear', bin_slop > 0, and a
+                            single catalog without patches for each field.  (default: None)
+        checkpoint_file (str): If given, the progress of `process` through the pairs of patches
+                            is saved in this file every checkpoint_interval seconds.  If the
+                            same process call is made again, e.g. after the job was preempted,
+                            it resumes from the file, skipping the pairs that are already done.
+                            When using MPI, each process uses its own file, with its rank
+                            appended to the name.  The file is left in place at the end, so
+                            remove it to start the calculation over.  Catalogs without patches
+                            are processed in one step, so they are not checkpointed.
+                            (default: None)
+        checkpoint_interval (float): How many seconds to wait between writing the
+                            checkpoint_file.  (default: 600)
     """
     _valid_params = {
         'nbins' : (int, False, None, None,
@@ -221,7 +303,7 @@ class BinnedCorr2(object):
         'sep_units' : (str, False, None, coord.AngleUnit.valid_names,
                 'The units to use for min_sep and max_sep.  '
                 'Also the units of the output distances'),
-        'bin_slop' : (float, False, None, None,
+        'bin_slop' : (float, True, None, None,
                 'The fraction of a bin width by which it is ok to let the pairs miss the correct '
                 'bin.',
                 'The default is to use 1 if bin_size <= 0.1, or 0.1/bin_size if bin_size > 0.1.'),
@@ -242,6 +324,10 @@ class BinnedCorr2(object):
                 'The minimum number of top layers to use when setting up the field.'),
         'max_top' : (int, False, 10, None,
                 'The maximum number of top layers to use when setting up the field.'),
+        'split_factor' : (float, False, 0.585, None,
+                'The size relative to b above which both cells of a pair are split.'),
+        'auto_tune' : (bool, False, False, None,
+                'Whether to tune split_factor and min_top on a subsample before processing.'),
         'precision' : (int, False, 4, None,
                 'The number of digits after the decimal in the output.'),
         'pairwise' : (bool, True, False, None,
@@ -251,8 +337,10 @@ class BinnedCorr2(object):
         'metric': (str, False, 'Euclidean', ['Euclidean', 'Rperp', 'FisherRperp', 'OldRperp',
                                              'Rlens', 'Arc', 'Periodic'],
                 'Which metric to use for the distance measurements'),
-        'bin_type': (str, False, 'Log', ['Log', 'Linear', 'TwoD'],
+        'bin_type': (str, False, 'Log', ['Log', 'Linear', 'TwoD', 'Edges'],
                 'Which type of binning should be used'),
+        'bin_edges': (float, True, None, None,
+                'The edges of the bins for bin_type=Edges'),
         'min_rpar': (float, False, None, None,
                 'The minimum difference in Rparallel for pairs to include'),
         'max_rpar': (float, False, None, None,
@@ -274,11 +362,25 @@ class BinnedCorr2(object):
                 'marked_bootstrap'),
         'num_threads' : (int, False, None, None,
                 'How many threads should be used. num_threads <= 0 means auto based on num cores.'),
+        'max_accum_mem' : (float, False, None, None,
+                'The maximum total memory in bytes for the per-thread copies of the results.'),
+        'float_accum' : (bool, False, False, None,
+                'Whether to use single precision for the per-thread copies of the results.'),
+        'fft_min_sep' : (float, False, None, None,
+                'The minimum separation for bins to compute on a grid with FFTs.'),
+        'checkpoint_file' : (str, False, None, None,
+                'A file in which to save the progress of process, so it can be resumed.'),
+        'checkpoint_interval' : (float, False, 600., None,
+                'How many seconds to wait between writing the checkpoint file.'),
     }
 
     @depr_pos_kwargs
     def __init__(self, config=None, *, logger=None, rng=None, **kwargs):
         self._corr = None  # Do this first to make sure we always have it for __del__
+        if isinstance(kwargs.get('bin_edges', None), np.ndarray):
+            kwargs['bin_edges'] = kwargs['bin_edges'].tolist()
+        if isinstance(kwargs.get('bin_slop', None), np.ndarray):
+            kwargs['bin_slop'] = kwargs['bin_slop'].tolist()
         self.config = merge_config(config,kwargs,BinnedCorr2._valid_params)
         if logger is None:
             self.logger = setup_logger(get(self.config,'verbose',int,1),
@@ -304,7 +406,23 @@ class BinnedCorr2(object):
         self._ro.sep_units = self.config.get('sep_units','')
         self._ro._sep_units = get(self.config,'sep_units',str,'radians')
         self._ro._log_sep_units = math.log(self._sep_units)
-        if self.config.get('nbins', None) is None:
+        if self.bin_type == 'Edges':
+            for key in ['nbins', 'bin_size', 'min_sep', 'max_sep']:
+                if self.config.get(key, None) is not None:
+                    raise TypeError("%s is not allowed for bin_type='Edges'"%key)
+            if self.config.get('bin_edges', None) is None:
+                raise TypeError("Missing required parameter bin_edges")
+            edges = np.array(self.config['bin_edges'], dtype=float).ravel()
+            if len(edges) < 2:
+                raise ValueError("bin_edges must have at least 2 values")
+            if edges[0] <= 0. or np.any(np.diff(edges) <= 0.):
+                raise ValueError("bin_edges must be positive and increasing")
+            self._ro.bin_edges = edges
+            self._ro.min_sep = edges[0]
+            self._ro.max_sep = edges[-1]
+            self._ro.nbins = len(edges) - 1
+            self._ro.bin_size = np.min(np.diff(np.log(edges)))
+        elif self.config.get('nbins', None) is None:
             if self.config.get('max_sep', None) is None:
                 raise TypeError("Missing required parameter max_sep")
             if self.config.get('min_sep', None) is None and self.bin_type != 'TwoD':
@@ -421,8 +539,20 @@ class BinnedCorr2(object):
             self._ro._nbins = self.nbins**2
             self._ro._bintype = _lib.TwoD
             max_good_slop = 0.1
+        elif self.bin_type == 'Edges':
+            self._ro.left_edges = self.bin_edges[:-1]
+            self._ro.right_edges = self.bin_edges[1:]
+            # Like Log, the nominal centers are the geometric means of the edges.
+            self._ro.rnom = np.sqrt(self.left_edges * self.right_edges)
+            self._ro.logr = np.log(self.rnom)
+            self._ro._nbins = self.nbins
+            self._ro._bintype = _lib.Edges
+            max_good_slop = 0.1 / self.bin_size
         else:  # pragma: no cover  (Already checked by config layer)
             raise ValueError("Invalid bin_type %s"%self.bin_type)
+        if not _lib.BinTypeCompiled(self._bintype):
+            raise ValueError("TreeCorr was built without bin_type=%s.  "%self.bin_type +
+                             "(cf. TREECORR_BIN_TYPES)")
 
         if self.sep_units == '':
             self.logger.info("nbins = %d, min,max sep = %g..%g, bin_size = %g",
@@ -438,24 +568,51 @@ class BinnedCorr2(object):
             self._ro._bin_size = self.bin_size * self._sep_units
         else:
             self._ro._bin_size = self.bin_size
+        if self.bin_type == 'Edges':
+            self._ro._bin_edges = self.bin_edges * self._sep_units
+        else:
+            self._ro.bin_edges = self._ro._bin_edges = None
 
         self._ro.split_method = self.config.get('split_method','mean')
         self.logger.debug("Using split_method = %s",self.split_method)
 
         self._ro.min_top = get(self.config,'min_top',int,None)
         self._ro.max_top = get(self.config,'max_top',int,10)
-
-        self._ro.bin_slop = get(self.config,'bin_slop',float,-1.0)
-        if self.bin_slop < 0.0:
-            self._ro.bin_slop = min(max_good_slop, 1.0)
-        self._ro.b = self.bin_size * self.bin_slop
-        if self.bin_slop > max_good_slop + 0.0001:  # Add some numerical slop
+        self._ro.split_factor = get(self.config,'split_factor',float,_default_split_factor)
+        if self.split_factor <= 0.:
+            raise ValueError("split_factor must be > 0")
+        self._ro.auto_tune = get(self.config,'auto_tune',bool,False)
+
+        if isinstance(self.config.get('bin_slop', None), list):
+            if self.bin_type not in ['Log', 'Linear']:
+                raise ValueError("A list of bin_slop values is only valid for bin_type='Log' "
+                                 "or 'Linear'")
+            bin_slop = np.array(self.config['bin_slop'], dtype=float).ravel()
+            if len(bin_slop) != self.nbins:
+                raise ValueError("A list of bin_slop values must have nbins values")
+            if np.any(bin_slop < 0):
+                raise ValueError("bin_slop values must be >= 0")
+            self._ro.bin_slop = bin_slop
+            # b is the smallest one, which is what the field cell sizes are based on.
+            # The C layer gets all of them in _bin_b.
+            self._ro.b = self.bin_size * np.min(bin_slop)
+            self._ro._bin_b = self.bin_size * bin_slop
+            max_slop = np.max(bin_slop)
+        else:
+            self._ro.bin_slop = get(self.config,'bin_slop',float,-1.0)
+            if self.bin_slop < 0.0:
+                self._ro.bin_slop = min(max_good_slop, 1.0)
+            self._ro.b = self.bin_size * self.bin_slop
+            self._ro._bin_b = None
+            max_slop = self.bin_slop
+        if max_slop > max_good_slop + 0.0001:  # Add some numerical slop
             self.logger.warning(
-                "Using bin_slop = %g, bin_size = %g, b = %g\n"%(self.bin_slop,self.bin_size,self.b)+
+                "Using bin_slop = %g, bin_size = %g, b = %g\n"%(
+                    max_slop,self.bin_size,self.bin_size*max_slop)+
                 "It is recommended to use bin_slop <= %s in this case.\n"%max_good_slop+
                 "Larger values of bin_slop (and hence b) may result in significant inaccuracies.")
         else:
-            self.logger.debug("Using bin_slop = %g, b = %g",self.bin_slop,self.b)
+            self.logger.debug("Using bin_slop = %s, b = %g",self.bin_slop,self.b)
 
         self._ro.brute = get(self.config,'brute',bool,False)
         if self.brute:
@@ -473,6 +630,18 @@ class BinnedCorr2(object):
         self._ro.xperiod = get(self.config,'xperiod',float,period)
         self._ro.yperiod = get(self.config,'yperiod',float,period)
         self._ro.zperiod = get(self.config,'zperiod',float,period)
+        self._ro.max_accum_mem = get(self.config,'max_accum_mem',float,0.)
+        self._ro.float_accum = get(self.config,'float_accum',bool,False)
+        self._ro.fft_min_sep = get(self.config,'fft_min_sep',float,None)
+        if self.fft_min_sep is not None:
+            if self.bin_type not in ['Log', 'Linear']:
+                raise ValueError("fft_min_sep is only valid for bin_type='Log' or 'Linear'")
+            if self.fft_min_sep <= 0.:
+                raise ValueError("fft_min_sep must be > 0")
+            if self.b <= 0.:
+                raise ValueError("fft_min_sep requires bin_slop > 0")
+        self._ro.checkpoint_file = get(self.config,'checkpoint_file',str,None)
+        self._ro.checkpoint_interval = get(self.config,'checkpoint_interval',float,600.)
 
         self._ro.var_method = get(self.config,'var_method',str,'shot')
         self._ro.num_bootstrap = get(self.config,'num_bootstrap',int,500)
@@ -518,6 +687,8 @@ class BinnedCorr2(object):
     @property
     def bottom_edges(self): return self._ro.bottom_edges
     @property
+    def bin_edges(self): return self._ro.bin_edges
+    @property
     def dxnom(self): return self._ro.dxnom
     @property
     def dynom(self): return self._ro.dynom
@@ -532,16 +703,24 @@ class BinnedCorr2(object):
     @property
     def _bin_size(self): return self._ro._bin_size
     @property
+    def _bin_edges(self): return self._ro._bin_edges
+    @property
     def split_method(self): return self._ro.split_method
     @property
     def min_top(self): return self._ro.min_top
     @property
     def max_top(self): return self._ro.max_top
     @property
+    def split_factor(self): return self._ro.split_factor
+    @property
+    def auto_tune(self): return self._ro.auto_tune
+    @property
     def bin_slop(self): return self._ro.bin_slop
     @property
     def b(self): return self._ro.b
     @property
+    def _bin_b(self): return self._ro._bin_b
+    @property
     def brute(self): return self._ro.brute
     @property
     def min_rpar(self): return self._ro.min_rpar
@@ -554,6 +733,16 @@ class BinnedCorr2(object):
     @property
     def zperiod(self): return self._ro.zperiod
     @property
+    def max_accum_mem(self): return self._ro.max_accum_mem
+    @property
+    def float_accum(self): return self._ro.float_accum
+    @property
+    def fft_min_sep(self): return self._ro.fft_min_sep
+    @property
+    def checkpoint_file(self): return self._ro.checkpoint_file
+    @property
+    def checkpoint_interval(self): return self._ro.checkpoint_interval
+    @property
     def var_method(self): return self._ro.var_method
     @property
     def num_bootstrap(self): return self._ro.num_bootstrap
@@ -581,10 +770,46 @@ class BinnedCorr2(object):
         self.logger = setup_logger(get(self.config,'verbose',int,1),
                                    self.config.get('log_file',None))
 
+    def process_async(self, *args, executor=None, **kwargs):
+        """Run `process` in a background thread, returning a future for its completion.
+
+        The calls into the C++ layer release the GIL, so the calling thread can do other
+        work while the correlation is computing.  In particular, it can load the next
+        catalogs and build their fields, so that they are ready once this calculation
+        is done::
+
+            >>> future = gg.process_async(cat1, cat2)
+            >>> next_cat.getGField(...)      # Built while gg is processing.
+            >>> future.result()             # Wait for gg to finish.
+
+        The arguments are the same as for `process`.  The results are accumulated into
+        this object as usual, so it should not be used again until the future is done.
+        Nor should the catalogs be used by another thread in the meantime.
+        The future's result() re-raises any exception raised by `process`.
+
+        Parameters:
+            executor:   A concurrent.futures.Executor to use.  If None, a new thread is
+                        started for this call. (default: None)
+
+        Returns:
+            A concurrent.futures.Future whose result is None once `process` is done.
+        """
+        import concurrent.futures
+        if executor is not None:
+            return executor.submit(self.process, *args, **kwargs)
+        executor = concurrent.futures.ThreadPoolExecutor(max_workers=1)
+        future = executor.submit(self.process, *args, **kwargs)
+        # This lets the thread exit once process is done, without waiting for it here.
+        executor.shutdown(wait=False)
+        return future
+
     def clear(self):
         """Clear all data vectors, the results dict, and any related values.
         """
         self._clear()
+        if self._corr is not None:
+            _lib.GetPruneStats2(self._corr, self._d1, self._d2, self._bintype,
+                                _ffi.NULL, _ffi.NULL, 1)
         self.results = {}
         self.npatch1 = self.npatch2 = 1
         self.__dict__.pop('_ok',None)
@@ -607,6 +832,42 @@ class BinnedCorr2(object):
                                   self._metric, self._coords,
                                   x1, y1, z1, s1, x2, y2, z2, s2)
 
+    def _trivially_zero_pairs(self, cats1, cats2):
+        # Returns a boolean array whose [i,j] element is whether the pair cats1[i], cats2[j]
+        # would be trivially zero according to _trivially_zero.  All the pairs are checked
+        # in parallel with a single call to the C layer.
+        cs1 = np.array([c._get_center_size() for c in cats1], dtype=float).reshape(-1,4)
+        cs2 = np.array([c._get_center_size() for c in cats2], dtype=float).reshape(-1,4)
+        x1, y1, z1, s1 = [np.ascontiguousarray(a) for a in cs1.T]
+        x2, y2, z2, s2 = [np.ascontiguousarray(a) for a in cs2.T]
+        zero = np.zeros((len(cats1), len(cats2)), dtype=np.intc)
+        if zero.size > 0:
+            _lib.TriviallyZeroPairs(self.corr, self._d1, self._d2, self._bintype,
+                                    self._metric, self._coords,
+                                    dp(x1), dp(y1), dp(z1), dp(s1), len(cats1),
+                                    dp(x2), dp(y2), dp(z2), dp(s2), len(cats2),
+                                    _ffi.cast('int*', zero.ctypes.data))
+        return zero.astype(bool)
+
+    def _skip_trivially_zero(self, jobs, keep):
+        # Remove the jobs for pairs of patches that are trivially zero from the list of jobs,
+        # adding their tot values directly rather than making a correlation object for each one
+        # that would end up with no pairs.  keep(i,j) says whether a job should be kept anyway.
+        cats1 = list({id(c1): c1 for i,j,c1,c2 in jobs}.values())
+        cats2 = list({id(c2): c2 for i,j,c1,c2 in jobs if c2 is not None}.values())
+        index1 = {id(c): k for k,c in enumerate(cats1)}
+        index2 = {id(c): k for k,c in enumerate(cats2)}
+        zero = self._trivially_zero_pairs(cats1, cats2)
+        new_jobs = []
+        for job in jobs:
+            i,j,c1,c2 = job
+            if c2 is not None and not keep(i,j) and zero[index1[id(c1)], index2[id(c2)]]:
+                self._add_tot(i, j, c1, c2)
+            else:
+                new_jobs.append(job)
+        return new_jobs
+
+    @trace_span('BinnedCorr2.process_all_auto')
     def _process_all_auto(self, cat1, metric, num_threads, comm, low_mem):
 
         def is_my_job(my_indices, i, j, n):
@@ -649,9 +910,16 @@ class BinnedCorr2(object):
                 self.logger.info("Rank %d: Job (%d,%d) is mine.",rank,i,j)
             return ret
 
+        if self.auto_tune:
+            self.tune(cat1[0], metric=metric, num_threads=num_threads)
+
         if len(cat1) == 1 and cat1[0].npatch == 1:
-            self.process_auto(cat1[0], metric=metric, num_threads=num_threads)
+            if self.fft_min_sep is not None:
+                self._process_hybrid(cat1[0], None, metric, num_threads)
+            else:
+                self.process_auto(cat1[0], metric=metric, num_threads=num_threads)
         else:
+            self._check_no_fft()
             # When patch processing, keep track of the pair-wise results.
             if self.npatch1 == 1:
                 self.npatch1 = self.npatch2 = cat1[0].npatch if cat1[0].npatch != 1 else len(cat1)
@@ -667,56 +935,83 @@ class BinnedCorr2(object):
                 my_indices = None
 
             self._set_metric(metric, cat1[0].coords)
-            temp = self.copy()
-            temp.results = {}  # Don't mess up the original results
-            for ii,c1 in enumerate(cat1):
-                i = c1.patch if c1.patch is not None else ii
-                if is_my_job(my_indices, i, i, n):
-                    temp._clear()
-                    self.logger.info('Process patch %d auto',i)
-                    temp.process_auto(c1, metric=metric, num_threads=num_threads)
-                    if (i,i) not in self.results:
-                        self.results[(i,i)] = temp.copy()
-                    else:
-                        self.results[(i,i)] += temp
-                    self += temp
-                for jj,c2 in list(enumerate(cat1))[::-1]:
-                    j = c2.patch if c2.patch is not None else jj
-                    if i < j and is_my_job(my_indices, i, j, n):
-                        temp._clear()
-                        if not self._trivially_zero(c1,c2,metric):
-                            self.logger.info('Process patches %d,%d cross',i,j)
-                            temp.process_cross(c1, c2, metric=metric, num_threads=num_threads)
-                        else:
-                            self.logger.info('Skipping %d,%d pair, which are too far apart ' +
-                                             'for this set of separations',i,j)
-                        if temp.nonzero:
+            ckpt = self._start_checkpoint('auto', cat1, comm)
+            if not low_mem:
+                # Then all the patches can stay loaded, so do all the pairs in one go.
+                jobs = []
+                for ii,c1 in enumerate(cat1):
+                    i = c1.patch if c1.patch is not None else ii
+                    jobs.append((i, i, c1, None))
+                    for jj,c2 in list(enumerate(cat1))[::-1]:
+                        j = c2.patch if c2.patch is not None else jj
+                        if i < j:
+                            jobs.append((i, j, c1, c2))
+                if comm is not None:
+                    jobs = self._balance_jobs(jobs, metric, comm)
+                self._set_num_threads(num_threads)
+                jobs = self._skip_done(jobs, ckpt, lambda i,j: False)
+                for chunk in ckpt.chunks(jobs):
+                    temps = self._process_patch_pairs(chunk, num_threads)
+                    for (i,j,c1,c2), temp in zip(chunk, temps):
+                        if c2 is None or temp.nonzero:
                             if (i,j) not in self.results:
-                                self.results[(i,j)] = temp.copy()
+                                self.results[(i,j)] = temp
                             else:
                                 self.results[(i,j)] += temp
                             self += temp
                         else:
-                            # NNCorrelation needs to add the tot value
                             self._add_tot(i, j, c1, c2)
-                        if low_mem and jj != ii+1:
-                            # Don't unload i+1, since that's the next one we'll need.
-                            c2.unload()
-                if low_mem:
+                        ckpt.done.add((i,j))
+                    ckpt.save_if_due()
+            else:
+                # Only load the patches as they are needed, one pair at a time.
+                temp = self.copy()
+                temp.results = {}  # Don't mess up the original results
+                for ii,c1 in enumerate(cat1):
+                    i = c1.patch if c1.patch is not None else ii
+                    if is_my_job(my_indices, i, i, n) and (i,i) not in ckpt.done:
+                        temp._clear()
+                        self.logger.info('Process patch %d auto',i)
+                        temp.process_auto(c1, metric=metric, num_threads=num_threads)
+                        if (i,i) not in self.results:
+                            self.results[(i,i)] = temp.copy()
+                        else:
+                            self.results[(i,i)] += temp
+                        self += temp
+                        ckpt.finish((i,i))
+                    for jj,c2 in list(enumerate(cat1))[::-1]:
+                        j = c2.patch if c2.patch is not None else jj
+                        if i < j and is_my_job(my_indices, i, j, n) and (i,j) not in ckpt.done:
+                            temp._clear()
+                            if not self._trivially_zero(c1,c2,metric):
+                                self.logger.info('Process patches %d,%d cross',i,j)
+                                temp.process_cross(c1, c2, metric=metric,
+                                                   num_threads=num_threads)
+                            else:
+                                self.logger.info('Skipping %d,%d pair, which are too far ' +
+                                                 'apart for this set of separations',i,j)
+                            if temp.nonzero:
+                                if (i,j) not in self.results:
+                                    self.results[(i,j)] = temp.copy()
+                                else:
+                                    self.results[(i,j)] += temp
+                                self += temp
+                            else:
+                                # NNCorrelation needs to add the tot value
+                                self._add_tot(i, j, c1, c2)
+                            ckpt.finish((i,j))
+                            if jj != ii+1:
+                                # Don't unload i+1, since that's the next one we'll need.
+                                c2.unload()
                     c1.unload()
+            ckpt.save()
             if comm is not None:
                 rank = comm.Get_rank()
-                size = comm.Get_size()
                 self.logger.info("Rank %d: Completed jobs %s",rank,list(self.results.keys()))
-                # Send all the results back to rank 0 process.
-                if rank > 0:
-                    comm.send(self, dest=0)
-                else:
-                    for p in range(1,size):
-                        temp = comm.recv(source=p)
-                        self += temp
-                        self.results.update(temp.results)
+                # Combine the results from all the processes.
+                self._reduce_results(comm)
 
+    @trace_span('BinnedCorr2.process_all_cross')
     def _process_all_cross(self, cat1, cat2, metric, num_threads, comm, low_mem):
 
         def is_my_job(my_indices, i, j, n1, n2):
@@ -739,7 +1034,11 @@ class BinnedCorr2(object):
             else:
                 return False
 
+        if self.auto_tune:
+            self.tune(cat1[0], cat2[0], metric=metric, num_threads=num_threads)
+
         if get(self.config,'pairwise',bool,False):
+            self._check_no_fft()
             import warnings
             warnings.warn("The pairwise option is slated to be removed in a future version. "+
                           "If you are actually using this parameter usefully, please "+
@@ -751,8 +1050,12 @@ class BinnedCorr2(object):
                     raise ValueError("Number of objects must be equal for pairwise.")
                 self.process_pairwise(c1, c2, metric=metric, num_threads=num_threads)
         elif len(cat1) == 1 and len(cat2) == 1 and cat1[0].npatch == 1 and cat2[0].npatch == 1:
-            self.process_cross(cat1[0], cat2[0], metric=metric, num_threads=num_threads)
+            if self.fft_min_sep is not None:
+                self._process_hybrid(cat1[0], cat2[0], metric, num_threads)
+            else:
+                self.process_cross(cat1[0], cat2[0], metric=metric, num_threads=num_threads)
         else:
+            self._check_no_fft()
             # When patch processing, keep track of the pair-wise results.
             if self.npatch1 == 1:
                 self.npatch1 = cat1[0].npatch if cat1[0].npatch != 1 else len(cat1)
@@ -774,45 +1077,846 @@ class BinnedCorr2(object):
                 my_indices = None
 
             self._set_metric(metric, cat1[0].coords, cat2[0].coords)
-            temp = self.copy()
-            temp.results = {}  # Don't mess up the original results
-            for ii,c1 in enumerate(cat1):
-                i = c1.patch if c1.patch is not None else ii
-                for jj,c2 in enumerate(cat2):
-                    j = c2.patch if c2.patch is not None else jj
-                    if is_my_job(my_indices, i, j, n1, n2):
-                        temp._clear()
-                        if not self._trivially_zero(c1,c2,metric):
-                            self.logger.info('Process patches %d,%d cross',i,j)
-                            temp.process_cross(c1, c2, metric=metric, num_threads=num_threads)
-                        else:
-                            self.logger.info('Skipping %d,%d pair, which are too far apart ' +
-                                             'for this set of separations',i,j)
+            ckpt = self._start_checkpoint('cross', cat1 + cat2, comm)
+            if not low_mem:
+                # Then all the patches can stay loaded, so do all the pairs in one go.
+                jobs = []
+                for ii,c1 in enumerate(cat1):
+                    i = c1.patch if c1.patch is not None else ii
+                    for jj,c2 in enumerate(cat2):
+                        j = c2.patch if c2.patch is not None else jj
+                        jobs.append((i, j, c1, c2))
+                if comm is not None:
+                    jobs = self._balance_jobs(jobs, metric, comm)
+                self._set_num_threads(num_threads)
+                jobs = self._skip_done(jobs, ckpt, lambda i,j: i==j or n1==1 or n2==1)
+                for chunk in ckpt.chunks(jobs):
+                    temps = self._process_patch_pairs(chunk, num_threads)
+                    for (i,j,c1,c2), temp in zip(chunk, temps):
                         if temp.nonzero or i==j or n1==1 or n2==1:
                             if (i,j) not in self.results:
-                                self.results[(i,j)] = temp.copy()
+                                self.results[(i,j)] = temp
                             else:
                                 self.results[(i,j)] += temp
                             self += temp
                         else:
-                            # NNCorrelation needs to add the tot value
                             self._add_tot(i, j, c1, c2)
-                        if low_mem:
+                        ckpt.done.add((i,j))
+                    ckpt.save_if_due()
+            else:
+                # Only load the patches as they are needed, one pair at a time.
+                temp = self.copy()
+                temp.results = {}  # Don't mess up the original results
+                for ii,c1 in enumerate(cat1):
+                    i = c1.patch if c1.patch is not None else ii
+                    for jj,c2 in enumerate(cat2):
+                        j = c2.patch if c2.patch is not None else jj
+                        if is_my_job(my_indices, i, j, n1, n2) and (i,j) not in ckpt.done:
+                            temp._clear()
+                            if not self._trivially_zero(c1,c2,metric):
+                                self.logger.info('Process patches %d,%d cross',i,j)
+                                temp.process_cross(c1, c2, metric=metric,
+                                                   num_threads=num_threads)
+                            else:
+                                self.logger.info('Skipping %d,%d pair, which are too far ' +
+                                                 'apart for this set of separations',i,j)
+                            if temp.nonzero or i==j or n1==1 or n2==1:
+                                if (i,j) not in self.results:
+                                    self.results[(i,j)] = temp.copy()
+                                else:
+                                    self.results[(i,j)] += temp
+                                self += temp
+                            else:
+                                # NNCorrelation needs to add the tot value
+                                self._add_tot(i, j, c1, c2)
+                            ckpt.finish((i,j))
                             c2.unload()
-                if low_mem:
                     c1.unload()
+            ckpt.save()
             if comm is not None:
                 rank = comm.Get_rank()
-                size = comm.Get_size()
                 self.logger.info("Rank %d: Completed jobs %s",rank,list(self.results.keys()))
-                # Send all the results back to rank 0 process.
-                if rank > 0:
-                    comm.send(self, dest=0)
+                # Combine the results from all the processes.
+                self._reduce_results(comm)
+
+    def _start_checkpoint(self, kind, cats, comm):
+        # The Checkpoint for a loop over the pairs of patches.  If there is a checkpoint file
+        # from an earlier run of the same calculation, its progress is restored here.
+        ckpt = Checkpoint(self, self.checkpoint_file, self.checkpoint_interval, kind,
+                          [self.npatch1, self.npatch2], cats, comm)
+        ckpt.load()
+        return ckpt
+
+    def _skip_done(self, jobs, ckpt, keep):
+        # Remove the jobs that were done before the checkpoint, and then the ones that are
+        # trivially zero.  The latter are done now, so they count as done for the checkpoint.
+        jobs = [job for job in jobs if job[:2] not in ckpt.done]
+        todo = self._skip_trivially_zero(jobs, keep)
+        ckpt.done.update(set(job[:2] for job in jobs) - set(job[:2] for job in todo))
+        return todo
+
+    def _balance_jobs(self, jobs, metric, comm):
+        # Divide the jobs for the pairs of patches among the MPI processes, giving each job to
+        # the process with the fewest estimated pairs so far, starting with the largest.
+        # The estimate is just the product of the numbers of objects (half the square for an
+        # auto-correlation), or zero for patches that are too far apart to have any pairs.
+        # Every process makes the same assignment, so no communication is needed.
+        size = comm.Get_size()
+        rank = comm.Get_rank()
+        cats1 = list({id(c1): c1 for i,j,c1,c2 in jobs}.values())
+        cats2 = list({id(c2): c2 for i,j,c1,c2 in jobs if c2 is not None}.values())
+        index1 = {id(c): k for k,c in enumerate(cats1)}
+        index2 = {id(c): k for k,c in enumerate(cats2)}
+        zero = self._trivially_zero_pairs(cats1, cats2)
+        cost = np.empty(len(jobs))
+        for k, (i,j,c1,c2) in enumerate(jobs):
+            if c2 is None:
+                cost[k] = 0.5 * float(c1.nobj)**2
+            elif zero[index1[id(c1)], index2[id(c2)]]:
+                cost[k] = 0.
+            else:
+                cost[k] = float(c1.nobj) * float(c2.nobj)
+        # Add 1 to each one, so the jobs with no pairs are also spread around.
+        cost += 1.
+        load = np.zeros(size)
+        mine = []
+        for k in np.argsort(-cost, kind='stable'):
+            p = np.argmin(load)
+            load[p] += cost[k]
+            if p == rank:
+                mine.append(k)
+        self.logger.info("Rank %d: Doing %d of %d jobs, with %.0f%% of the estimated pairs",
+                         rank, len(mine), len(jobs), 100. * load[rank] / np.sum(load))
+        return [jobs[k] for k in sorted(mine)]
+
+    def _accum_names(self):
+        # The names of the accumulated arrays, which are the public arrays with the shape of
+        # the bins.  Arrays that are aliases of an earlier one (e.g. raw_xi) are skipped.
+        names = []
+        ids = set()
+        for name, value in self.__dict__.items():
+            if (not name.startswith('_') and isinstance(value, np.ndarray)
+                    and value.shape == self.logr.shape and id(value) not in ids):
+                names.append(name)
+                ids.add(id(value))
+        return names
+
+    @trace_span('BinnedCorr2.reduce_results')
+    def _reduce_results(self, comm):
+        # Combine the results from all the MPI processes.  Each pair of patches is only done
+        # by one process, so the raw arrays for the pairs that any process has (and the overall
+        # sums) are packed into a single array on each process and summed with one Allreduce,
+        # rather than sending a pickled copy of the correlation object from each process.
+        # The keys are gathered first, so the array only has rows for the pairs that were
+        # actually done, not all npatch1 * npatch2 of them.
+        from mpi4py import MPI
+        all_keys = comm.allgather(list(self.results.keys()))
+        keys = sorted(set(key for k in all_keys for key in k))
+        names = self._accum_names()
+        nbins = self.logr.size
+        has_tot = hasattr(self, 'tot')
+        buf = np.zeros((len(keys)+1, len(names)*nbins + has_tot), dtype=float)
+
+        def pack(corr, row):
+            for n, name in enumerate(names):
+                value = getattr(corr, name, None)
+                if value is not None:
+                    row[n*nbins:(n+1)*nbins] = value.ravel()
+            if has_tot:
+                row[-1] = corr.tot
+
+        def unpack(corr, row):
+            for n, name in enumerate(names):
+                getattr(corr, name)[...] = row[n*nbins:(n+1)*nbins].reshape(self.logr.shape)
+            if has_tot:
+                corr.tot = row[-1]
+
+        for k, key in enumerate(keys):
+            if key in self.results:
+                pack(self.results[key], buf[k])
+        pack(self, buf[-1])
+
+        # Like in _make_cov_design_matrix, use Allreduce, so all processes get the full results.
+        comm.Allreduce(MPI.IN_PLACE, buf)
+
+        empty = self.copy()
+        empty.results = {}
+        empty._clear()
+        for k, key in enumerate(keys):
+            if key not in self.results:
+                self.results[key] = empty.copy()
+            unpack(self.results[key], buf[k])
+        unpack(self, buf[-1])
+
+    def _get_field(self, cat, d, brute):
+        # Get a field the same way the process_auto or process_cross methods of the
+        # subclasses do, but using d (one of _d1, _d2) to pick the kind of field.
+        min_size, max_size = self._get_minmax_size()
+        getField = { 1: cat.getNField, 2: cat.getKField, 3: cat.getGField }[d]
+        return getField(min_size=min_size, max_size=max_size,
+                        split_method=self.split_method, brute=brute,
+                        min_top=self.min_top, max_top=self.max_top,
+                        coords=self.coords)
+
+    def _get_fields(self, cat1, cat2):
+        if cat2 is None:
+            f1 = self._get_field(cat1, self._d1, bool(self.brute))
+            return f1, f1
+        else:
+            f1 = self._get_field(cat1, self._d1, self.brute is True or self.brute == 1)
+            f2 = self._get_field(cat2, self._d2, self.brute is True or self.brute == 2)
+            return f1, f2
+
+    def _add_process_tot(self, c1, c2):
+        # No op for all but NNCorrelation, which needs to add the tot value that process_auto
+        # (if c2 is None) or process_cross would have added.
+        pass
+
+    def _check_no_fft(self):
+        if self.fft_min_sep is not None:
+            raise ValueError("fft_min_sep is only valid for a single catalog without patches "
+                             "for each field")
+
+    def _xi_names(self):
+        # The names of the xi arrays accumulated by the C layer for this kind of correlation.
+        d1, d2 = self._d1, self._d2
+        if d1 == _lib.NData and d2 == _lib.NData:
+            return []
+        elif d2 == _lib.KData:
+            return ['xi']
+        elif d1 != _lib.GData:
+            return ['xi', 'xi_im']
+        else:
+            return ['xip', 'xip_im', 'xim', 'xim_im']
+
+    def _process_hybrid(self, cat1, cat2, metric, num_threads):
+        # Process the bins whose left edges are at least fft_min_sep on a grid using FFTs,
+        # and the smaller bins with the trees, as process_auto (if cat2 is None) or
+        # process_cross would have done for all of them.
+        self._set_metric(metric, cat1.coords, None if cat2 is None else cat2.coords)
+        if self.coords != 'flat' or self.metric != 'Euclidean':
+            raise ValueError("fft_min_sep is only valid with flat coordinates "
+                             "with a Euclidean metric.")
+        names = ['meanr', 'meanlogr', 'weight', 'npairs'] + self._xi_names()
+        k_cross = int(np.searchsorted(self.left_edges, self.fft_min_sep))
+        if k_cross < self.nbins:
+            nx, ny = self._grid_shape(cat1, cat2, k_cross)[4:]
+            if nx * ny > self._max_grid_size:
+                # The pixels are small compared to the area of the catalogs, so the grids (and
+                # their FFTs) would take too much memory.  Use the trees for all the bins.
+                self.logger.warning("fft_min_sep = %g would need a %d x %d grid.  "
+                                    "Using the tree code for all the bins.",
+                                    self.fft_min_sep, nx, ny)
+                k_cross = self.nbins
+
+        if k_cross > 0:
+            # Use a correlation object with just the small bins for the tree part.
+            config = self.config.copy()
+            for key in ['nbins', 'bin_size', 'min_sep', 'max_sep', 'fft_min_sep', 'bin_slop']:
+                config.pop(key, None)
+            bin_slop = self.bin_slop
+            if self._bin_b is not None:
+                bin_slop = list(bin_slop[:k_cross])
+            tree = self.__class__(config, logger=self.logger, nbins=k_cross,
+                                  min_sep=self.min_sep, max_sep=self.right_edges[k_cross-1],
+                                  bin_slop=bin_slop)
+            if cat2 is None:
+                tree.process_auto(cat1, metric=metric, num_threads=num_threads)
+            else:
+                tree.process_cross(cat1, cat2, metric=metric, num_threads=num_threads)
+            for name in names:
+                getattr(self, name)[:k_cross] += getattr(tree, name)
+        self._add_process_tot(cat1, cat2)
+
+        if k_cross < self.nbins:
+            self._process_grid(cat1, cat2, k_cross)
+
+    # The largest number of pixels to use for the grids in _process_grid.  Each grid and its
+    # FFT take 16 bytes per pixel, and there are several of them at once.
+    _max_grid_size = 2**24
+
+    def _grid_shape(self, cat1, cat2, k_cross):
+        # The pixel size, the largest lag in pixels, the lower corner and the shape of the
+        # grids for the bins from k_cross on.
+        # The tree doesn't split a pair of cells once s1+s2 <= b r (or b for Linear binning).
+        # Every object is within h/sqrt(2) of its pixel center, so pixels of size h give
+        # at least that accuracy for all the bins done here.
+        r_cross = self.left_edges[k_cross] * self._sep_units
+        if self.bin_type == 'Log':
+            h = self.b * r_cross / np.sqrt(2.)
+        else:
+            h = self.b * self._sep_units / np.sqrt(2.)
+        max_lag = int(np.ceil(self._max_sep / h))
+        cats = [cat1] if cat2 is None else [cat1, cat2]
+        xmin = min(np.min(c.x) for c in cats)
+        ymin = min(np.min(c.y) for c in cats)
+        xmax = max(np.max(c.x) for c in cats)
+        ymax = max(np.max(c.y) for c in cats)
+        # Pad the grid by max_lag pixels, so the periodic FFT correlation doesn't wrap any
+        # lags that could be in the bins.
+        nx = int((xmax-xmin)/h) + max_lag + 2
+        ny = int((ymax-ymin)/h) + max_lag + 2
+        return h, max_lag, xmin, ymin, nx, ny
+
+    def _process_grid(self, cat1, cat2, k_cross):
+        h, max_lag, xmin, ymin, nx, ny = self._grid_shape(cat1, cat2, k_cross)
+        r_cross = self.left_edges[k_cross] * self._sep_units
+        self.logger.info("Using a %d x %d grid with pixel size %g for separations >= %g",
+                         nx, ny, h, r_cross)
+
+        def grid(cat, values):
+            index = ((cat.y-ymin)/h).astype(int) * nx + ((cat.x-xmin)/h).astype(int)
+            return np.bincount(index, weights=values, minlength=nx*ny).reshape(ny,nx)
+
+        def make_grids(cat, d):
+            grids = {'n': grid(cat, (cat.w != 0).astype(float)), 'w': grid(cat, cat.w)}
+            if d == _lib.KData:
+                grids['k'] = grid(cat, cat.w * cat.k)
+            elif d == _lib.GData:
+                grids['g'] = grid(cat, cat.w * cat.g1) + 1j * grid(cat, cat.w * cat.g2)
+            return grids
+
+        def corr(a, b):
+            # sum_p conj(a[p]) b[p+l] for each lag l.
+            if np.isrealobj(a) and np.isrealobj(b):
+                return np.fft.irfft2(np.conj(np.fft.rfft2(a)) * np.fft.rfft2(b), s=a.shape)
+            else:
+                return np.fft.ifft2(np.conj(np.fft.fft2(a)) * np.fft.fft2(b))
+
+        g1 = make_grids(cat1, self._d1)
+        g2 = g1 if cat2 is None else make_grids(cat2, self._d2)
+
+        # Only keep the lags that might be in the bins.  With the padding, index j is the lag
+        # j if j <= max_lag, or j-n if j >= n-max_lag.
+        lx = np.arange(nx)
+        lx = np.where(lx <= max_lag, lx, lx-nx)
+        ly = np.arange(ny)
+        ly = np.where(ly <= max_lag, ly, ly-ny)
+        lx, ly = np.meshgrid(lx, ly)
+        r = h * np.sqrt(lx**2 + ly**2)
+        edges = np.append(self.left_edges, self.right_edges[-1]) * self._sep_units
+        k = np.searchsorted(edges, r, side='right') - 1
+        use = (k >= k_cross) & (k < self.nbins) & (r > 0)
+        k = k[use]
+        r = r[use]
+        # exp(-2i phi) for the direction of each lag, as in ProjectHelper<Flat>.
+        expm2iphi = ((lx[use] - 1j*ly[use]) / np.abs(lx[use] + 1j*ly[use]))**2
+
+        def add(name, values):
+            # For an auto-correlation, every pair is counted twice, at l and -l.
+            if cat2 is None:
+                values = 0.5 * values
+            getattr(self, name)[:] += np.bincount(k, weights=values, minlength=self.nbins)
+
+        weight = corr(g1['w'], g2['w'])[use]
+        add('npairs', corr(g1['n'], g2['n'])[use])
+        add('weight', weight)
+        add('meanr', weight * r)
+        add('meanlogr', weight * np.log(r))
+        if self._d1 == _lib.NData and self._d2 == _lib.NData:
+            pass
+        elif self._d2 == _lib.KData:
+            a = g1['k'] if self._d1 == _lib.KData else g1['w']
+            add('xi', corr(a, g2['k'])[use])
+        elif self._d1 != _lib.GData:
+            # The minus sign is to accumulate tangential shear, as in the C layer.
+            a = g1['k'] if self._d1 == _lib.KData else g1['w']
+            xi = -corr(a, g2['g'])[use] * expm2iphi
+            add('xi', xi.real)
+            add('xi_im', xi.imag)
+        else:
+            xip = np.conj(corr(g1['g'], g2['g'])[use])
+            xim = corr(np.conj(g1['g']), g2['g'])[use] * expm2iphi**2
+            add('xip', xip.real)
+            add('xip_im', xip.imag)
+            add('xim', xim.real)
+            add('xim_im', xim.imag)
+
+    def _use_patch_field(self, cat1, cat2, comm):
+        # Whether to process the patches using the patch_field option of the catalogs.
+        # This isn't used for lists of catalogs, MPI or pairwise.  For a cross-correlation,
+        # both catalogs need to have it with the same number of patches.
+        def has_patch_field(cat):
+            return (not isinstance(cat, list) and cat.npatch > 1 and cat._single_patch is None
+                    and get(cat.config,'patch_field',bool,False))
+        if comm is not None or not has_patch_field(cat1):
+            return False
+        if cat2 is None:
+            return True
+        return (has_patch_field(cat2) and cat2.npatch == cat1.npatch
+                and not get(self.config,'pairwise',bool,False))
+
+    def _process_patch_field(self, cat1, cat2, metric, num_threads):
+        # Process all the pairs of patches with a single field for each catalog, whose
+        # top-level cells are grouped by patch, so the patches don't need to be made into
+        # separate catalogs and fields.  All the pairs are done in a single call to the C layer.
+        # The results are the same as _process_all_auto or _process_all_cross (without low_mem).
+        self._check_no_fft()
+        n = cat1.npatch
+        if self.npatch1 == 1:
+            self.npatch1 = self.npatch2 = n
+        self._set_num_threads(num_threads)
+
+        # As in get_patches, skip any patches without objects.
+        nobj1 = np.bincount(cat1.patch, minlength=n)
+        sumw1 = np.bincount(cat1.patch, weights=cat1.w, minlength=n)
+        if cat2 is None:
+            self._set_metric(metric, cat1.coords)
+            f1 = self._get_field(cat1, self._d1, bool(self.brute))
+            patches = [i for i in range(n) if nobj1[i] > 0]
+            pairs = [(i,j) for i in patches for j in patches if i <= j]
+            sumw2 = sumw1
+        else:
+            self._set_metric(metric, cat1.coords, cat2.coords)
+            f1 = self._get_field(cat1, self._d1, self.brute is True or self.brute == 1)
+            f2 = self._get_field(cat2, self._d2, self.brute is True or self.brute == 2)
+            nobj2 = np.bincount(cat2.patch, minlength=n)
+            sumw2 = np.bincount(cat2.patch, weights=cat2.w, minlength=n)
+            pairs = [(i,j) for i in range(n) for j in range(n) if nobj1[i] > 0 and nobj2[j] > 0]
+
+        # The keys are the same as in _process_all_auto or _process_all_cross, so either one
+        # can resume from the other's checkpoint.
+        ckpt = self._start_checkpoint('auto' if cat2 is None else 'cross',
+                                      [cat1] if cat2 is None else [cat1, cat2], None)
+        pairs = [ij for ij in pairs if ij not in ckpt.done]
+
+        empty = self.copy()
+        empty.results = {}
+        empty._clear()
+        self.logger.info('Starting %d pairs of patches.',len(pairs))
+        for chunk in ckpt.chunks(pairs):
+            temps = []
+            for i,j in chunk:
+                temp = empty.copy()
+                if cat2 is None and i == j:
+                    temp._add_process_tot(_PatchWeight(sumw1[i]), None)
                 else:
-                    for p in range(1,size):
-                        temp = comm.recv(source=p)
-                        self += temp
-                        self.results.update(temp.results)
+                    temp._add_process_tot(_PatchWeight(sumw1[i]), _PatchWeight(sumw2[j]))
+                temps.append(temp)
+
+            corr_ptrs = _ffi.new("void*[]", [temp.corr for temp in temps])
+            patches1 = _ffi.new("int[]", [i for i,j in chunk])
+            patches2 = _ffi.new("int[]", [j for i,j in chunk])
+            _lib.ProcessPatchPairs2(corr_ptrs, f1.data, _ffi.NULL if cat2 is None else f2.data,
+                                    patches1, patches2, len(chunk), self.output_dots,
+                                    self._d1, self._d2, self._coords, self._bintype,
+                                    self._metric)
+
+            for (i,j), temp in zip(chunk, temps):
+                if i == j or temp.nonzero:
+                    if (i,j) not in self.results:
+                        self.results[(i,j)] = temp
+                    else:
+                        self.results[(i,j)] += temp
+                    self += temp
+                else:
+                    self._add_tot(i, j, _PatchWeight(sumw1[i]), _PatchWeight(sumw2[j]))
+                ckpt.done.add((i,j))
+            ckpt.save_if_due()
+        ckpt.save()
+
+    def _process_patch_pairs(self, jobs, num_threads):
+        # Process all the pairs of patches in jobs with a single call to the C layer, which
+        # runs the pairs in parallel.  Each job is (i, j, c1, c2), where c2 is None for the
+        # auto-correlation of c1.  Returns a list with a new correlation object for each job
+        # holding just the results for that pair.
+        if len(jobs) == 0:
+            return []
+        self._set_num_threads(num_threads)
+        fields = {}
+        def get_field(cat, d, brute):
+            # Most patches are in many jobs, so only get each one's field once.
+            key = (id(cat), d, brute)
+            if key not in fields:
+                fields[key] = self._get_field(cat, d, brute)
+            return fields[key]
+
+        empty = self.copy()
+        empty.results = {}
+        empty._clear()
+        temps = []
+        fields1 = []
+        fields2 = []
+        for i,j,c1,c2 in jobs:
+            temp = empty.copy()
+            temp._add_process_tot(c1, c2)
+            temps.append(temp)
+            if c2 is None:
+                fields1.append(get_field(c1, self._d1, bool(self.brute)).data)
+                fields2.append(_ffi.NULL)
+            else:
+                brute1 = self.brute is True or self.brute == 1
+                brute2 = self.brute is True or self.brute == 2
+                fields1.append(get_field(c1, self._d1, brute1).data)
+                fields2.append(get_field(c2, self._d2, brute2).data)
+
+        self.logger.info('Starting %d pairs of patches.',len(jobs))
+        corr_ptrs = _ffi.new("void*[]", [temp.corr for temp in temps])
+        _lib.ProcessPatches2(corr_ptrs, _ffi.new("void*[]", fields1),
+                             _ffi.new("void*[]", fields2), len(jobs), self.output_dots,
+                             self._d1, self._d2, self._coords, self._bintype, self._metric)
+        return temps
+
+    def record_interactions(self, cat1, cat2=None, *, metric=None, num_threads=None):
+        """Process a catalog or pair of catalogs, and also record the pairs of cells that were
+        accumulated, so other catalogs with the same positions can be processed much faster
+        with `replay_interactions`.
+
+        This accumulates the same values as ``process_auto(cat1)`` (if ``cat2`` is None) or
+        ``process_cross(cat1, cat2)``, and returns an `InteractionList` with the pairs of cells
+        that were accumulated along with their bins.  Which pairs these are only depends on the
+        positions and weights of the objects, not the values being correlated.  So for e.g.
+        many realizations of the shape noise or a suite of mocks with the same positions,
+        you can record the interactions once and then replay them for each realization, which
+        skips all of the work of walking the trees.
+
+        The recording takes about 32 bytes of memory for each pair of cells, and the
+        returned `InteractionList` takes 20 bytes for each one.  So this is most useful for
+        moderate values of bin_slop (or small catalogs).
+
+        This is not available for `NNCorrelation`, since it only depends on the positions
+        anyway.
+
+        Parameters:
+            cat1 (Catalog):     The first catalog to process
+            cat2 (Catalog):     The second catalog to process, if any.  (default: None, which
+                                means to do an auto-correlation of cat1)
+            metric (str):       Which metric to use.  See `Metrics` for details.
+                                (default: 'Euclidean'; this value can also be given in the
+                                constructor in the config dict.)
+            num_threads (int):  How many OpenMP threads to use during the calculation.
+                                (default: use the number of cpu cores; this value can also be given
+                                in the constructor in the config dict.)
+
+        Returns:
+            An `InteractionList` to use with `replay_interactions`.
+        """
+        from .nncorrelation import NNCorrelation
+        if isinstance(self, NNCorrelation):
+            raise TypeError("record_interactions is not available for NNCorrelation")
+        if cat2 is None and self._d1 != self._d2:
+            raise TypeError("record_interactions requires cat2 for %s"%type(self).__name__)
+
+        self.logger.info('Starting record_interactions')
+        if cat2 is None:
+            self._set_metric(metric, cat1.coords)
+        else:
+            self._set_metric(metric, cat1.coords, cat2.coords)
+        self._set_num_threads(num_threads)
+        f1, f2 = self._get_fields(cat1, cat2)
+
+        self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
+        _lib.StartRecord2(self.corr, self._d1, self._d2, self._bintype)
+        if cat2 is None:
+            _lib.ProcessAuto2(self.corr, f1.data, self.output_dots,
+                              f1._d, self._coords, self._bintype, self._metric)
+        else:
+            _lib.ProcessCross2(self.corr, f1.data, f2.data, self.output_dots,
+                               f1._d, f2._d, self._coords, self._bintype, self._metric)
+        data = _lib.FinishRecord2(self.corr, f1.data, f2.data, cat2 is None,
+                                  self._d1, self._d2, self._coords, self._bintype, self._metric)
+        interactions = InteractionList(data)
+        self.logger.info('Recorded %d interactions', interactions.size)
+        return interactions
+
+    def replay_interactions(self, interactions, cat1, cat2=None, *, metric=None,
+                            num_threads=None):
+        """Process a catalog or pair of catalogs using the pairs of cells recorded by
+        `record_interactions`.
+
+        This accumulates the same values as ``process_auto(cat1)`` (if ``cat2`` is None) or
+        ``process_cross(cat1, cat2)`` would, but rather than walking the trees, it just goes
+        through the list of pairs of cells that were recorded, so it is much faster.
+
+        The catalogs must have the same positions and weights as the ones used for recording
+        (only the values being correlated may be different), and the correlation must have
+        the same binning (including min_sep, max_sep and bin_slop), metric and tree
+        parameters.  Also, the number of top-level cells depends on the number of threads
+        unless min_top is set, so use the same num_threads for both, or set min_top explicitly.
+        If any of these don't match the recorded ones, this raises a ValueError.
+
+        Parameters:
+            interactions (InteractionList): The `InteractionList` returned by
+                                `record_interactions` (or read from a file with
+                                `InteractionList.read`).
+            cat1 (Catalog):     The first catalog to process
+            cat2 (Catalog):     The second catalog to process, if any.  (default: None, which
+                                means to do an auto-correlation of cat1)
+            metric (str):       Which metric to use.  This should be the same one used for
+                                recording the interactions.  See `Metrics` for details.
+                                (default: 'Euclidean'; this value can also be given in the
+                                constructor in the config dict.)
+            num_threads (int):  How many OpenMP threads to use during the calculation.
+                                (default: use the number of cpu cores; this value can also be given
+                                in the constructor in the config dict.)
+        """
+        self.logger.info('Starting replay_interactions')
+        if cat2 is None:
+            self._set_metric(metric, cat1.coords)
+        else:
+            self._set_metric(metric, cat1.coords, cat2.coords)
+        self._set_num_threads(num_threads)
+        f1, f2 = self._get_fields(cat1, cat2)
+        if not _lib.Replay2(self.corr, interactions.data, f1.data, f2.data,
+                            self._d1, self._d2, self._coords, self._bintype, self._metric):
+            raise ValueError("The trees, separation range, bin_slop or metric do not match the "
+                             "ones used to record the interactions")
+
+    def process_delta(self, cat1, cat2=None, *, added1=None, removed1=None, added2=None,
+                      removed2=None, metric=None, num_threads=None):
+        """Update the accumulated sums for some objects being added to or removed from the
+        catalogs, by only processing the pairs that involve the changed objects.
+
+        If this correlation currently has the sums for the catalog ``cat1 + removed1``, then
+        afterwards it has the sums for ``cat1 + added1``.  I.e. ``cat1`` has the objects that
+        did not change, and ``added1`` and ``removed1`` are catalogs of the objects that were
+        added and removed.  This processes the pairs within ``added1`` and between ``added1``
+        and ``cat1`` and adds them to the sums, and likewise subtracts the pairs within
+        ``removed1`` and between ``removed1`` and ``cat1``.  When only a small part of a
+        large catalog changes, this is much faster than processing the whole catalog again.
+        Also, the fields of ``cat1`` are kept by the catalog, so its trees are only built
+        the first time.
+
+        For a cross-correlation, give ``cat2`` (along with ``added2`` and ``removed2`` if
+        the second catalog changed too), and the sums for ``(cat1 + removed1)`` x
+        ``(cat2 + removed2)`` are updated to be those for ``(cat1 + added1)`` x
+        ``(cat2 + added2)``.
+
+        The pairs of removed objects are accumulated separately and then subtracted, rather
+        than being accumulated with negative weights, so that npairs (and for `NNCorrelation`,
+        tot) are updated correctly too.
+
+        For an auto-correlation with bin_type='TwoD', the pairs between the changed objects
+        and ``cat1`` are added to both of their mirrored bins, the same as `process_auto` does.
+
+        .. note::
+
+            This must be applied to the raw sums, before `finalize` is called.  E.g. use
+            ``process(cat, finalize=False)`` (or `process_auto`) for the original catalog,
+            then any number of calls to this, and then call `finalize` with the variance of
+            the updated catalog.  The patch results used for the covariance estimates are
+            not updated.
+
+        With bin_slop = 0, the results are the same as processing the updated catalogs
+        directly.  Otherwise, the pairs are grouped into different pairs of cells than they
+        would be in the trees of the full catalogs, so the results can differ slightly, within
+        the accuracy allowed by bin_slop.
+
+        Parameters:
+            cat1 (Catalog):     The objects of the first catalog that did not change.
+            cat2 (Catalog):     The objects of the second catalog that did not change, if any.
+                                (default: None, which means this is an auto-correlation of
+                                cat1)
+            added1 (Catalog):   The objects added to the first catalog. (default: None)
+            removed1 (Catalog): The objects removed from the first catalog. (default: None)
+            added2 (Catalog):   The objects added to the second catalog. (default: None)
+            removed2 (Catalog): The objects removed from the second catalog. (default: None)
+            metric (str):       Which metric to use.  See `Metrics` for details.
+                                (default: 'Euclidean'; this value can also be given in the
+                                constructor in the config dict.)
+            num_threads (int):  How many OpenMP threads to use during the calculation.
+                                (default: use the number of cpu cores; this value can also be given
+                                in the constructor in the config dict.)
+        """
+        if cat2 is None:
+            if not hasattr(self, 'process_auto'):
+                raise TypeError("process_delta requires cat2 for %s"%type(self).__name__)
+            if added2 is not None or removed2 is not None:
+                raise TypeError("added2 and removed2 require cat2")
+        self.logger.info('Starting process_delta')
+
+        def accumulate(corr, c1, c2, n1, n2):
+            # Process the pairs between the new objects n1, n2 and the unchanged c1, c2
+            # as well as among themselves.
+            if c2 is None:
+                if n1 is not None:
+                    corr.process_auto(n1, metric=metric, num_threads=num_threads)
+                    if self.bin_type == 'TwoD':
+                        # The auto-correlation puts each pair in the mirrored bin too, so the
+                        # pairs between c1 and n1 need to go in both (dx,dy) and (-dx,-dy).
+                        cross = corr.copy()
+                        cross.clear()
+                        cross.process_cross(c1, n1, metric=metric, num_threads=num_threads)
+                        for name in cross._accum_names():
+                            a = getattr(cross, name)
+                            getattr(corr, name)[:] += a + a[::-1,::-1]
+                        if hasattr(corr, 'tot'):
+                            corr.tot += cross.tot
+                    else:
+                        corr.process_cross(c1, n1, metric=metric, num_threads=num_threads)
+            else:
+                if n1 is not None:
+                    corr.process_cross(n1, c2, metric=metric, num_threads=num_threads)
+                if n2 is not None:
+                    corr.process_cross(c1, n2, metric=metric, num_threads=num_threads)
+                if n1 is not None and n2 is not None:
+                    corr.process_cross(n1, n2, metric=metric, num_threads=num_threads)
+
+        accumulate(self, cat1, cat2, added1, added2)
+        if removed1 is not None or removed2 is not None:
+            temp = self.copy()
+            temp.clear()
+            accumulate(temp, cat1, cat2, removed1, removed2)
+            for name in self._accum_names():
+                getattr(self, name).ravel()[:] -= getattr(temp, name).ravel()[:]
+            if hasattr(self, 'tot'):
+                self.tot -= temp.tot
+
+    def get_prune_stats(self):
+        """Return counters of how the traversal of the trees went in the calls to
+        `process_auto` and `process_cross` since the last `clear`.
+
+        These show where the calculation spends its effort, which can help to choose
+        bin_slop, min_top and max_top.  They are only kept if TreeCorr was built with the
+        environment variable ``TREECORR_PRUNE_STATS=1``.  Otherwise this returns None.
+
+        The returned dict has the following items:
+
+            - calls: The number of calls to process11, which starts a traversal from a pair
+              of top-level cells, or continues one in a new task.
+            - pairs: The number of pairs of cells that were checked.
+            - prune_rpar, prune_min_sep, prune_max_sep: The number of those that were skipped,
+              since they were entirely outside the range of rpar, below min_sep, or above
+              max_sep, respectively.
+            - prune_range: The number that were small enough to go in a single bin, but whose
+              bin was outside the range.
+            - single_bin: The number of pairs of cells with nonzero size that were
+              accumulated into a single bin.
+            - leaf: The number of pairs of leaves (cells of zero size) that were accumulated.
+            - split1, split2, split_both: The number of pairs of cells that were split by
+              splitting only the first, only the second, or both cells.
+            - bucket: The number of pairs of cells where the leaves of a bucket were
+              processed directly.  (cf. bucket_size)
+            - bucket_leaf_pairs: The number of pairs of leaves checked in those.
+            - depth: An array of the number of pairs of cells checked at each depth of the
+              traversal, i.e. the number of splits since the top-level cells.  The last
+              entry also counts any deeper ones.
+
+        When the catalogs have patches, the pairs of patches are usually processed by the
+        separate objects in ``results``, which keep their own counts.
+
+        Returns:
+            A dict of the counts, or None
+        """
+        counts = np.zeros(13, dtype=np.int_)
+        depth = np.zeros(128, dtype=np.int_)
+        if not _lib.GetPruneStats2(self.corr, self._d1, self._d2, self._bintype,
+                                   _ffi.cast('long*', counts.ctypes.data),
+                                   _ffi.cast('long*', depth.ctypes.data), 0):
+            return None
+        names = ['calls', 'pairs', 'prune_rpar', 'prune_min_sep', 'prune_max_sep',
+                 'prune_range', 'single_bin', 'leaf', 'split1', 'split2', 'split_both',
+                 'bucket', 'bucket_leaf_pairs']
+        stats = { name: int(c) for name, c in zip(names, counts) }
+        stats['depth'] = depth
+        return stats
+
+    def tune(self, cat1, cat2=None, *, metric=None, num_threads=None, nsample=20000,
+             split_factors=None, min_tops=None, rng=None):
+        """Choose split_factor and min_top for these catalogs.
+
+        The best values depend on the data, the binning and the number of threads.  This
+        times the calculation on a random subsample of ``nsample`` objects from each catalog
+        for each combination of the candidate values, and then uses the fastest one for this
+        object.  The result is cached for the configuration (the class, the binning, bin_slop,
+        metric, coordinates, number of threads, and the rough size of the catalogs), so later
+        calls for the same configuration don't repeat the timing.
+
+        With ``auto_tune=True``, this is done automatically by `process` with the first catalog
+        (or patch) of each field.
+
+        Parameters:
+            cat1 (Catalog):     The first catalog to process.
+            cat2 (Catalog):     The second catalog to process, if any. (default: None)
+            metric (str):       Which metric to use.  (default: 'Euclidean'; this value can
+                                also be given in the constructor in the config dict.)
+            num_threads (int):  How many OpenMP threads to use during the calculation.
+                                (default: use the number of cpu cores; this value can also be
+                                given in the constructor in the config dict.)
+            nsample (int):      How many objects to use from each catalog. (default: 20000)
+            split_factors (list): The values of split_factor to try.
+                                (default: [0.4, 0.5, 0.585, 0.7, 0.85])
+            min_tops (list):    The values of min_top to try.  (default: the usual default
+                                value, and two and four more, up to max_top)
+            rng (RandomState):  A RandomState to use for the subsample. (default: None)
+
+        Returns:
+            A dict with the chosen split_factor and min_top.
+        """
+        import time
+        self._set_num_threads(num_threads)
+        if metric is None:
+            metric = get(self.config,'metric',str,'Euclidean')
+        if split_factors is None:
+            split_factors = [0.4, 0.5, _default_split_factor, 0.7, 0.85]
+        if min_tops is None:
+            min_top = max(3, int.bit_length(get_omp_threads()-1))
+            min_tops = sorted(set(min(m, self.max_top) for m in [min_top, min_top+2, min_top+4]))
+        bin_slop = tuple(np.atleast_1d(self.bin_slop))
+        key = (type(self).__name__, self.bin_type, self.min_sep, self.max_sep, self.nbins,
+               self.sep_units, bin_slop, self.brute, self.min_rpar, self.max_rpar,
+               self.xperiod, self.yperiod, self.zperiod, metric, cat1.coords,
+               get_omp_threads(), int(cat1.ntot).bit_length(),
+               None if cat2 is None else int(cat2.ntot).bit_length(),
+               tuple(split_factors), tuple(min_tops))
+
+        if key not in _tune_cache:
+            if rng is None:
+                rng = np.random.RandomState(1234)
+            sub1 = _sample_catalog(cat1, nsample, rng)
+            sub2 = None if cat2 is None else _sample_catalog(cat2, nsample, rng)
+
+            def run(split_factor, min_top):
+                corr = type(self)(self.config, logger=self.logger, auto_tune=False,
+                                  split_factor=split_factor, min_top=min_top)
+                t0 = time.time()
+                if sub2 is None:
+                    corr.process_auto(sub1, metric=metric, num_threads=num_threads)
+                else:
+                    corr.process_cross(sub1, sub2, metric=metric, num_threads=num_threads)
+                return time.time() - t0
+
+            times = {}
+            for min_top in min_tops:
+                # The first run with each min_top also builds the fields, so don't count it.
+                run(split_factors[0], min_top)
+                for split_factor in split_factors:
+                    times[split_factor, min_top] = run(split_factor, min_top)
+            _tune_cache[key] = min(times, key=times.get)
+            self.logger.info("tune: times = %s", times)
+        split_factor, min_top = _tune_cache[key]
+        self.logger.info("tune: using split_factor = %s, min_top = %d", split_factor, min_top)
+
+        # _ro is shared with any copies, so make a new one rather than change it.
+        ro = Namespace()
+        ro.__dict__.update(self._ro.__dict__)
+        ro.split_factor = split_factor
+        ro.min_top = min_top
+        self._ro = ro
+        if self._corr is not None:
+            _lib.SetSplitFactor2(self._corr, self._d1, self._d2, self._bintype, split_factor)
+        return { 'split_factor': split_factor, 'min_top': min_top }
+
+    def thread_copy_memory(self, num_threads=None):
+        """Return how much memory `process_auto` and `process_cross` use for the copies of
+        the accumulated arrays that the threads fill in.
+
+        Each thread makes its own copy, unless that would be more than ``max_accum_mem``,
+        in which case the threads share fewer copies.
+
+        Parameters:
+            num_threads (int):  How many OpenMP threads the calculation would use.  If None,
+                                use the number currently set. (default: None)
+
+        Returns:
+            A tuple (ncopies, nbytes) with the number of copies and the bytes in each.
+        """
+        if num_threads is None:
+            num_threads = get_omp_threads()
+        nbytes = _ffi.new('double*')
+        ncopies = _lib.GetCopyBytes2(self.corr, self._d1, self._d2, self._bintype,
+                                     num_threads, nbytes)
+        return ncopies, int(nbytes[0])
 
     def getStat(self):
         """The standard statistic for the current correlation object as a 1-d array.
@@ -831,7 +1935,31 @@ class BinnedCorr2(object):
         """
         return self.weight.ravel()
 
+    @property
+    def _ratio_stat(self):
+        # The names of the accumulated arrays whose ratios to the weight make up getStat, if
+        # that is all getStat is.  Then the design matrix for the covariance estimates can be
+        # built in C++ from the results for each pair of patches.
+        return None
+
+    def _patch_pair_arrays(self, names):
+        # Return the patch numbers of each pair of patches in results, the given accumulated
+        # arrays for each pair (raveled and concatenated), and the weight for each pair.
+        if isinstance(self.results, _PatchResults):
+            return self.results._pair_arrays(names)
+        keys = list(self.results.keys())
+        nbins = self.weight.size
+        num = np.empty((len(keys), len(names)*nbins), dtype=float)
+        weight = np.empty((len(keys), nbins), dtype=float)
+        for k, key in enumerate(keys):
+            corr = self.results[key]
+            for n, name in enumerate(names):
+                num[k, n*nbins:(n+1)*nbins] = getattr(corr, name).ravel()
+            weight[k] = corr.weight.ravel()
+        return np.array(keys, dtype=int).reshape(-1,2), num, weight
+
     @depr_pos_kwargs
+    @trace_span('BinnedCorr2.estimate_cov')
     def estimate_cov(self, method, *, func=None, comm=None):
         """Estimate the covariance matrix based on the data
 
@@ -970,6 +2098,9 @@ class BinnedCorr2(object):
         if metric is None:
             metric = get(self.config,'metric',str,'Euclidean')
         coords, metric = parse_metric(metric, coords1, coords2)
+        if not _lib.MetricCompiled(metric_enum(metric)):
+            raise ValueError("TreeCorr was built without metric=%s.  "%metric +
+                             "(cf. TREECORR_METRICS)")
         if coords != '3d':
             if self.min_rpar != -sys.float_info.max:
                 raise ValueError("min_rpar is only valid for 3d coordinates")
@@ -1000,6 +2131,8 @@ class BinnedCorr2(object):
         self.metric = metric
         self._coords = coord_enum(coords)  # These are the C++-layer enums
         self._metric = metric_enum(metric)
+        if self._corr is not None:
+            self._set_min_size()
 
     def _apply_units(self, mask):
         if self.coords == 'spherical' and self.metric == 'Euclidean':
@@ -1025,7 +2158,10 @@ class BinnedCorr2(object):
             # The maximum size cell that will be useful is one where a cell of size s will
             # be split at the maximum separation even if the other size = 0.
             # i.e. max_size = max_sep * b
-            max_size = self._max_sep * self.b
+            # (With a b for each bin, self.b is the smallest, which is right for min_size, but
+            # the largest one is enough for max_size.)
+            max_b = self.b if self._bin_b is None else np.max(self._bin_b)
+            max_size = self._max_sep * max_b
             return min_size, max_size
         else:
             # For other metrics, the above calculation doesn't really apply, so just skip
@@ -1033,6 +2169,12 @@ class BinnedCorr2(object):
             # (And for the max_size, always split 10 levels for the top-level cells.)
             return 0., 0.
 
+    def _set_min_size(self):
+        # The C++ layer treats cells smaller than min_size as leaves, so it gets the same
+        # results from a finer tree than the one this binning would build.  (cf. reuse_fields)
+        _lib.SetMinSize2(self._corr, self._d1, self._d2, self._bintype,
+                         self._get_minmax_size()[0])
+
     @depr_pos_kwargs
     def sample_pairs(self, n, cat1, cat2, *, min_sep, max_sep, metric=None):
         """Return a random sample of n pairs whose separations fall between min_sep and max_sep.
@@ -1066,6 +2208,11 @@ class BinnedCorr2(object):
         requirement that this correlation instance has already accumulated pairs via a call
         to process with these catalogs.
 
+        The pairs are chosen at random, but they are not returned in a random order.  They are
+        in the order of the pairs of cells in the trees, i.e. grouped by the top-level cells of
+        cat1 and then by the cells they are in.  So if you only want some of them, you should
+        shuffle them first rather than take the first few.
+
         Parameters:
             n (int):            How many samples to return.
             cat1 (Catalog):     The catalog from which to sample the first object of each pair.
@@ -1152,9 +2299,18 @@ class BinnedCorr2(object):
         # pairs is input as a list of (i,j) values.
 
         # This is the normal calculation.  It needs to be overridden when there are randoms.
-        self._sum([self.results[ij] for ij in pairs])
+        self._sum_results(pairs)
         self._finalize()
 
+    @trace_span('BinnedCorr2.sum_results')
+    def _sum_results(self, pairs):
+        # Set the data vectors to the sum of the results for the given pairs of patches.
+        if isinstance(self.results, _PatchResults):
+            # Sum the arrays from the file directly, without making an object for each pair.
+            self._sum([self.results._sum_pairs(pairs)])
+        else:
+            self._sum([self.results[ij] for ij in pairs])
+
     #########################################################################################
     #                                                                                       #
     # Important note for the following two functions.                                       #
@@ -1353,7 +2509,212 @@ class BinnedCorr2(object):
             key = eval(params['key'])
             self.results[key] = corr
 
+    def save_patch_results(self, file_name, *, dtype=None, compress=False):
+        """Save the results for each pair of patches to a compact binary file.
+
+        This is an alternative to ``write(..., write_patch_results=True)`` for when there are
+        many patches.  The accumulated values of all the pairs are stored in a few columns of
+        a numpy .npz file, and only the range of bins with any pairs is stored for each pair
+        of patches, which is usually a small fraction of them for pairs of patches that are
+        far apart.
+
+        The results can be read back with `load_patch_results` to compute covariance matrices
+        with `estimate_cov` or `estimate_multi_cov`.
+
+        Parameters:
+            file_name (str):    The name of the file to write to.
+            dtype (type):       The type to use for the accumulated values.  Use np.float32
+                                to halve the size of the file at the cost of some precision.
+                                (default: np.float64)
+            compress (bool):    Whether to compress the file. (default: False)
+        """
+        dtype = np.float64 if dtype is None else dtype
+        shape = self.logr.shape
+        keys = list(self.results.keys())
+
+        # The accumulated arrays are all the public arrays with the shape of the bins.
+        names = []
+        for corr in self.results.values():
+            for name, value in corr.__dict__.items():
+                if (not name.startswith('_') and isinstance(value, np.ndarray)
+                        and value.shape == shape and name not in names):
+                    names.append(name)
+
+        # For each pair, store the bins from the first to the last with any pairs.
+        first = np.zeros(len(keys), dtype=np.int64)
+        start = np.zeros(len(keys)+1, dtype=np.int64)
+        for k, key in enumerate(keys):
+            nz = np.flatnonzero(self.results[key].npairs.ravel())
+            if len(nz) > 0:
+                first[k] = nz[0]
+                start[k+1] = start[k] + nz[-1] + 1 - nz[0]
+            else:
+                start[k+1] = start[k]
+        columns = {}
+        for name in names:
+            col = np.empty(start[-1], dtype=dtype)
+            for k, key in enumerate(keys):
+                n = start[k+1] - start[k]
+                if n == 0: continue
+                value = getattr(self.results[key], name, None)
+                if value is None:
+                    col[start[k]:start[k+1]] = 0
+                else:
+                    col[start[k]:start[k+1]] = value.ravel()[first[k]:first[k]+n]
+            columns['col_' + name] = col
+        if len(keys) > 0 and hasattr(self.results[keys[0]], 'tot'):
+            columns['tot'] = np.array([self.results[key].tot for key in keys], dtype=float)
+
+        save = np.savez_compressed if compress else np.savez
+        with open(file_name, 'wb') as fout:
+            save(fout, cls=type(self).__name__, shape=np.array(shape),
+                 npatch=np.array([self.npatch1, self.npatch2]),
+                 keys=np.array(keys, dtype=np.int64).reshape(-1,2),
+                 first=first, start=start, names=np.array(names, dtype=str), **columns)
+
+    def load_patch_results(self, file_name):
+        """Load the results for each pair of patches that were saved with `save_patch_results`.
+
+        This replaces the current results for the pairs of patches (but not the overall data
+        vectors, which can be read with `read`).  The results for each pair are not made into
+        separate correlation objects unless they are accessed individually.  In particular,
+        `estimate_cov` and `estimate_multi_cov` sum the arrays from the file directly.
+
+        Parameters:
+            file_name (str):    The name of the file to read.
+        """
+        with np.load(file_name, allow_pickle=False) as data:
+            data = {key: data[key] for key in data.files}
+        if str(data['cls']) != type(self).__name__:
+            raise ValueError("%s has results for a %s, not a %s"%(
+                             file_name, data['cls'], type(self).__name__))
+        if tuple(data['shape']) != self.logr.shape:
+            raise ValueError("%s has results for a different binning"%file_name)
+        self.npatch1, self.npatch2 = [int(n) for n in data['npatch']]
+        self.results = _PatchResults(self, data)
+        self.__dict__.pop('_ok',None)
+
+class _PatchResults(collections.abc.Mapping):
+    # The results dict read by load_patch_results.  The results for each pair of patches are
+    # only made into a correlation object when accessed by key.  _sum_pairs sums the arrays
+    # for a list of pairs directly.
+    def __init__(self, corr, data):
+        self._corr = corr
+        self._shape = tuple(data['shape'])
+        self._nbins = int(np.prod(self._shape))
+        self._keys = [tuple(int(i) for i in key) for key in data['keys']]
+        self._index = {key: k for k, key in enumerate(self._keys)}
+        self._first = data['first']
+        self._start = data['start']
+        self._names = [str(name) for name in data['names']]
+        self._columns = {name: data['col_' + name] for name in self._names}
+        self._tot = data.get('tot', None)
+
+    def __getitem__(self, key):
+        k = self._index[key]
+        ret = self._corr.copy()
+        ret.results = {}
+        ret.__dict__.pop('_nonzero',None)
+        self._set_values(ret, np.array([k]))
+        return ret
+
+    def __iter__(self):
+        return iter(self._keys)
+
+    def __len__(self):
+        return len(self._keys)
+
+    def __contains__(self, key):
+        return key in self._index
+
+    def _sum_pairs(self, pairs):
+        # Return an object with the sums of the arrays for the given pairs, suitable for
+        # passing to the _sum method of the correlation class.
+        ret = Namespace()
+        rows = np.array([self._index[ij] for ij in pairs], dtype=np.int64)
+        self._set_values(ret, rows)
+        ret._nonzero = bool(np.any(ret.npairs))
+        return ret
+
+    def _pair_arrays(self, names):
+        # The equivalent of BinnedCorr2._patch_pair_arrays, directly from the columns.
+        npair = len(self._keys)
+        lens = self._start[1:] - self._start[:-1]
+        within = np.arange(self._start[-1]) - np.repeat(self._start[:-1], lens)
+        dest = np.repeat(np.arange(npair) * self._nbins + self._first, lens) + within
+        def dense(name):
+            ret = np.zeros(npair * self._nbins, dtype=float)
+            ret[dest] = self._columns[name]
+            return ret.reshape(npair, self._nbins)
+        num = np.concatenate([dense(name) for name in names], axis=1)
+        return np.array(self._keys, dtype=int).reshape(-1,2), num, dense('weight')
+
+    def _set_values(self, obj, rows):
+        # Set the arrays of obj to the sum over the given rows.
+        lens = self._start[rows+1] - self._start[rows]
+        within = np.arange(np.sum(lens)) - np.repeat(np.cumsum(lens) - lens, lens)
+        src = np.repeat(self._start[rows], lens) + within
+        dest = np.repeat(self._first[rows], lens) + within
+        for name in self._names:
+            value = np.bincount(dest, weights=self._columns[name][src], minlength=self._nbins)
+            setattr(obj, name, value.reshape(self._shape))
+        if self._tot is not None:
+            obj.tot = float(np.sum(self._tot[rows]))
+
+class InteractionList(object):
+    """A list of the pairs of cells accumulated by a two-point correlation, which is returned
+    by `BinnedCorr2.record_interactions` and used by `BinnedCorr2.replay_interactions`.
+
+    It can also be saved to a file with `write` and read back with `InteractionList.read`, so
+    the same list can be used in other processes (on the same kind of machine).
+
+    Attributes:
+        size:       The number of pairs of cells in the list.
+    """
+    def __init__(self, data):
+        self.data = data
+
+    @property
+    def size(self):
+        return _lib.InteractionListSize(self.data)
+
+    def write(self, file_name):
+        """Write the list to a file.
+
+        Parameters:
+            file_name (str):    The name of the file to write to.
+        """
+        if not _lib.InteractionListWrite(self.data, file_name.encode()):
+            raise OSError("Unable to write InteractionList to %s"%file_name)
+
+    @classmethod
+    def read(cls, file_name):
+        """Read a list that was written with `write`.
+
+        Parameters:
+            file_name (str):    The name of the file to read.
+
+        Returns:
+            An `InteractionList`
+        """
+        data = _lib.InteractionListRead(file_name.encode())
+        if data == _ffi.NULL:
+            raise OSError("%s is not a valid InteractionList file"%file_name)
+        return cls(data)
+
+    def __del__(self):
+        # Using memory allocated from the C layer means we have to explicitly deallocate it
+        # rather than being able to rely on the Python memory manager.
+
+        # In case __init__ failed to get that far
+        if hasattr(self,'data'):  # pragma: no branch
+            # As for the Fields, don't do this if the ffi lock is already locked.
+            if not _ffi._lock.locked(): # pragma: no branch
+                _lib.DestroyInteractionList(self.data)
+
+
 @depr_pos_kwargs
+@trace_span('estimate_multi_cov')
 def estimate_multi_cov(corrs, method, *, func=None, comm=None):
     """Estimate the covariance matrix of multiple statistics.
 
@@ -1493,6 +2854,421 @@ def build_multi_cov_design_matrix(corrs, method, *, func=None, comm=None):
     else:
         raise ValueError("Invalid method: %s"%method)
 
+def _check_same_binning(corrs, name):
+    # Check that all the corrs use the same binning and tree parameters, so they can share
+    # a single traversal of the trees.
+    c0 = corrs[0]
+    for corr in corrs[1:]:
+        if not (corr.bin_type == c0.bin_type and
+                corr._nbins == c0._nbins and
+                corr._min_sep == c0._min_sep and
+                corr._max_sep == c0._max_sep and
+                corr._bin_size == c0._bin_size and
+                np.array_equal(corr._bin_edges, c0._bin_edges) and
+                corr.b == c0.b and
+                np.array_equal(corr._bin_b, c0._bin_b) and
+                corr.min_rpar == c0.min_rpar and
+                corr.max_rpar == c0.max_rpar and
+                corr.xperiod == c0.xperiod and
+                corr.yperiod == c0.yperiod and
+                corr.zperiod == c0.zperiod and
+                corr.split_method == c0.split_method and
+                corr.min_top == c0.min_top and
+                corr.max_top == c0.max_top and
+                corr.brute == c0.brute):
+            raise ValueError("All corrs must use the same binning for %s"%name)
+
+def process_multi_cross(corrs, cat1, cat2, *, metric=None, num_threads=None):
+    """Process a single pair of catalogs, accumulating several cross-correlations at once.
+
+    This is equivalent to calling ``corr.process_cross(cat1, cat2)`` for each corr in
+    ``corrs``, but all of them are computed in a single traversal of the trees.  So e.g.
+    for galaxy-galaxy lensing, where you want the NN, NK and NG correlations of the same lens
+    and source catalogs, the time spent walking the trees is only paid once rather than three
+    times.
+
+    The items in ``corrs`` may be at most one each of `NNCorrelation`, `NKCorrelation`, and
+    `NGCorrelation`, and they must all use the same binning (including bin_slop, min_rpar,
+    max_rpar, the periods, and the tree building parameters).  The catalogs are used as the
+    first and second catalogs of each of them respectively.  The trees of the second catalog
+    are walked in lockstep, so split_method='random' is not allowed.
+
+    Like `BinnedCorr2.process_cross`, this accumulates the weighted sums into the bins of each
+    correlation, but does not finalize the calculation.
+
+    Parameters:
+        corrs (list):       A list of `BinnedCorr2` instances to accumulate.
+        cat1 (Catalog):     The first catalog to process
+        cat2 (Catalog):     The second catalog to process
+        metric (str):       Which metric to use.  See `Metrics` for details.
+                            (default: 'Euclidean'; this value can also be given in the
+                            constructor in the config dict.)
+        num_threads (int):  How many OpenMP threads to use during the calculation.
+                            (default: use the number of cpu cores; this value can also be given
+                            in the constructor in the config dict.)
+    """
+    from .nncorrelation import NNCorrelation
+    from .nkcorrelation import NKCorrelation
+    from .ngcorrelation import NGCorrelation
+
+    nn = nk = ng = None
+    for corr in corrs:
+        if isinstance(corr, NNCorrelation) and nn is None:
+            nn = corr
+        elif isinstance(corr, NKCorrelation) and nk is None:
+            nk = corr
+        elif isinstance(corr, NGCorrelation) and ng is None:
+            ng = corr
+        else:
+            raise TypeError("corrs may only have one each of NNCorrelation, NKCorrelation, "
+                            "and NGCorrelation")
+    if len(corrs) == 0:
+        raise ValueError("No correlations given")
+
+    c0 = corrs[0]
+    _check_same_binning(corrs, 'process_multi_cross')
+    if c0.split_method == 'random':
+        # Each field would get its own seed, so their trees wouldn't match.
+        raise ValueError("process_multi_cross does not support split_method='random'")
+
+    for corr in corrs:
+        if cat1.name == '' and cat2.name == '':
+            corr.logger.info('Starting process_multi_cross')
+        else:
+            corr.logger.info('Starting process_multi_cross for cats %s, %s.',
+                             cat1.name, cat2.name)
+        corr._set_metric(metric, cat1.coords, cat2.coords)
+        corr._set_num_threads(num_threads)
+    min_size, max_size = c0._get_minmax_size()
+
+    f1 = cat1.getNField(min_size=min_size, max_size=max_size,
+                        split_method=c0.split_method,
+                        brute=c0.brute is True or c0.brute == 1,
+                        min_top=c0.min_top, max_top=c0.max_top,
+                        coords=c0.coords)
+    # These all need to be built the same way, so their trees have the same structure.
+    kwargs = dict(min_size=min_size, max_size=max_size,
+                  split_method=c0.split_method,
+                  brute=c0.brute is True or c0.brute == 2,
+                  min_top=c0.min_top, max_top=c0.max_top,
+                  coords=c0.coords)
+    def get_fields():
+        return (cat2.getNField(**kwargs) if nn is not None else None,
+                cat2.getKField(**kwargs) if nk is not None else None,
+                cat2.getGField(**kwargs) if ng is not None else None)
+    f2n, f2k, f2g = get_fields()
+    fields = [f for f in (f2n, f2k, f2g) if f is not None]
+    # With reuse_fields, some of them may be finer than requested.  Then get all of them that
+    # fine.  (The correlations treat the extra cells below their min_size as leaves.)
+    kwargs['min_size'] = min(f.min_size for f in fields)
+    kwargs['max_size'] = min(f.max_size for f in fields)
+    if any(f.min_size != kwargs['min_size'] or f.max_size != kwargs['max_size']
+           for f in fields):
+        f2n, f2k, f2g = get_fields()
+        fields = [f for f in (f2n, f2k, f2g) if f is not None]
+    f0 = fields[0]
+    for f in fields[1:]:
+        if not (f.min_size == f0.min_size and f.max_size == f0.max_size and
+                f.bucket_size == f0.bucket_size and f.nTopLevelNodes == f0.nTopLevelNodes):
+            raise ValueError("The fields of cat2 must all have the same tree structure for "
+                             "process_multi_cross")
+
+    c0.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
+    _lib.ProcessMultiCross2(nn.corr if nn is not None else _ffi.NULL,
+                            nk.corr if nk is not None else _ffi.NULL,
+                            ng.corr if ng is not None else _ffi.NULL,
+                            f1.data,
+                            f2n.data if f2n is not None else _ffi.NULL,
+                            f2k.data if f2k is not None else _ffi.NULL,
+                            f2g.data if f2g is not None else _ffi.NULL,
+                            c0.output_dots, c0._coords, c0._bintype, c0._metric)
+    if nn is not None:
+        nn.tot += cat1.sumw*cat2.sumw
+
+def process_multi_binning(corrs, cat1, cat2=None, *, metric=None, num_threads=None):
+    """Process a catalog or pair of catalogs, accumulating the same correlation function with
+    several different binnings at once.
+
+    This is equivalent to calling ``corr.process_auto(cat1)`` (if ``cat2`` is None) or
+    ``corr.process_cross(cat1, cat2)`` for each corr in ``corrs``, but all of them are computed
+    in a single traversal of the trees.  The distance calculations for the pairs of cells the
+    binnings have in common are only done once.  So this is mostly helpful when the binnings
+    are similar, e.g. the same range of separations with several different numbers of bins.
+
+    The trees are built with the smallest min_size and max_size of any of the binnings.  Each
+    binning treats the cells below its own min_size as leaves, as they would be in its own tree.
+    But if the binnings have different max_size (which is max_sep * bin_slop * bin_size), some
+    of them start from smaller top-level cells than they would on their own.  So with
+    bin_slop > 0, the results can differ slightly from processing each one separately, within
+    the accuracy allowed by bin_slop.  With bin_slop = 0, or when the max_size is the same for
+    all of them, they are the same.
+
+    The items in ``corrs`` must all be instances of the same class, and they must all use the
+    same min_rpar, max_rpar, periods, and tree building parameters (split_method, min_top,
+    max_top, brute).  The bin_type, nbins, min_sep, max_sep and bin_slop may all be different.
+    At most 64 correlations may be given.
+
+    Like `BinnedCorr2.process_auto` and `BinnedCorr2.process_cross`, this accumulates the
+    weighted sums into the bins of each correlation, but does not finalize the calculation.
+
+    Parameters:
+        corrs (list):       A list of `BinnedCorr2` instances to accumulate.
+        cat1 (Catalog):     The first catalog to process
+        cat2 (Catalog):     The second catalog to process, if any.  (default: None, which
+                            means to do an auto-correlation of cat1)
+        metric (str):       Which metric to use.  See `Metrics` for details.
+                            (default: 'Euclidean'; this value can also be given in the
+                            constructor in the config dict.)
+        num_threads (int):  How many OpenMP threads to use during the calculation.
+                            (default: use the number of cpu cores; this value can also be given
+                            in the constructor in the config dict.)
+    """
+    from .nncorrelation import NNCorrelation
+
+    if len(corrs) == 0:
+        raise ValueError("No correlations given")
+    if len(corrs) > 64:
+        raise ValueError("At most 64 correlations may be given to process_multi_binning")
+
+    c0 = corrs[0]
+    for corr in corrs:
+        if corr.bin_type == 'Edges':
+            raise ValueError("process_multi_binning does not support bin_type='Edges'")
+    for corr in corrs[1:]:
+        if type(corr) is not type(c0):
+            raise TypeError("All corrs must be the same type for process_multi_binning")
+        if not (corr.min_rpar == c0.min_rpar and
+                corr.max_rpar == c0.max_rpar and
+                corr.xperiod == c0.xperiod and
+                corr.yperiod == c0.yperiod and
+                corr.zperiod == c0.zperiod and
+                corr.split_method == c0.split_method and
+                corr.min_top == c0.min_top and
+                corr.max_top == c0.max_top and
+                corr.brute == c0.brute):
+            raise ValueError("All corrs must use the same rpar range, periods and tree "
+                             "parameters for process_multi_binning")
+    if cat2 is None and c0._d1 != c0._d2:
+        raise TypeError("process_multi_binning requires cat2 for %s"%type(c0).__name__)
+
+    for corr in corrs:
+        if cat2 is None:
+            if cat1.name == '':
+                corr.logger.info('Starting process_multi_binning')
+            else:
+                corr.logger.info('Starting process_multi_binning for cat %s.', cat1.name)
+            corr._set_metric(metric, cat1.coords)
+        else:
+            if cat1.name == '' and cat2.name == '':
+                corr.logger.info('Starting process_multi_binning')
+            else:
+                corr.logger.info('Starting process_multi_binning for cats %s, %s.',
+                                 cat1.name, cat2.name)
+            corr._set_metric(metric, cat1.coords, cat2.coords)
+        corr._set_num_threads(num_threads)
+
+    # The trees need to be fine enough for all of the binnings.
+    sizes = [corr._get_minmax_size() for corr in corrs]
+    min_size = min(s[0] for s in sizes)
+    max_size = min(s[1] for s in sizes)
+
+    def get_field(cat, d, brute):
+        getField = { 1: cat.getNField, 2: cat.getKField, 3: cat.getGField }[d]
+        return getField(min_size=min_size, max_size=max_size,
+                        split_method=c0.split_method, brute=brute,
+                        min_top=c0.min_top, max_top=c0.max_top,
+                        coords=c0.coords)
+
+    if cat2 is None:
+        f1 = get_field(cat1, c0._d1, bool(c0.brute))
+        f2 = None
+    else:
+        f1 = get_field(cat1, c0._d1, c0.brute is True or c0.brute == 1)
+        f2 = get_field(cat2, c0._d2, c0.brute is True or c0.brute == 2)
+
+    c0.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
+    corr_ptrs = _ffi.new("void*[]", [corr.corr for corr in corrs])
+    bin_types = _ffi.new("int[]", [corr._bintype for corr in corrs])
+    _lib.ProcessMultiBin2(corr_ptrs, bin_types, len(corrs),
+                          f1.data, f2.data if f2 is not None else _ffi.NULL, c0.output_dots,
+                          c0._d1, c0._d2, c0._coords, c0._metric)
+    if isinstance(c0, NNCorrelation):
+        for corr in corrs:
+            if cat2 is None:
+                corr.tot += 0.5 * cat1.sumw**2
+            else:
+                corr.tot += cat1.sumw*cat2.sumw
+
+def process_multi_k(corrs, cat1, cat2=None, *, metric=None, num_threads=None):
+    """Process several scalar fields with the same positions, accumulating all of their
+    KK or NK correlations at once.
+
+    For example, for tomography you might have 10-20 scalar maps with the same positions and
+    weights, and want all of their auto- and cross-correlations.  Rather than building a tree
+    for each of them and traversing the trees separately for each correlation, this builds
+    one tree for each set of positions and accumulates the sums of w k for every channel in
+    each cell.  Then all the correlations are accumulated in a single traversal.  The cost of
+    each pair of cells that is accumulated goes up with the number of pairs of channels, but
+    the rest of the traversal is only done once.
+
+    There are three ways to call it:
+
+    1. ``process_multi_k(corrs, cats)``, where ``cats`` is a list of n catalogs and ``corrs``
+       is an n x n nested list of `KKCorrelation` instances.  ``corrs[a][b]`` accumulates
+       the same thing as ``corrs[a][b].process_cross(cats[a], cats[b])`` for a != b, and
+       ``corrs[a][a].process_auto(cats[a])``.
+    2. ``process_multi_k(corrs, cats1, cats2)``, where ``cats1`` and ``cats2`` are lists of
+       n1 and n2 catalogs, and ``corrs`` is an n1 x n2 nested list of `KKCorrelation`
+       instances.  ``corrs[a][b]`` accumulates ``process_cross(cats1[a], cats2[b])``.
+    3. ``process_multi_k(corrs, cat1, cats2)``, where ``cat1`` is a single catalog, ``cats2``
+       is a list of n2 catalogs, and ``corrs`` is a list of n2 `NKCorrelation` instances.
+       ``corrs[b]`` accumulates ``process_cross(cat1, cats2[b])``.
+
+    The catalogs in each list must all have the same positions and weights, and only differ
+    in their k values.  The correlations must all use the same binning (including bin_slop,
+    min_rpar, max_rpar, the periods, and the tree building parameters).  The patches of the
+    catalogs are not used, so this is like processing them with a single patch each.
+
+    .. note::
+
+        In the first form, the pairs for ``corrs[a][b]`` with a != b come from the same
+        traversal as the auto-correlations, so with ``bin_type='TwoD'`` or 'Linear' and
+        bin_slop > 0, they can differ slightly from what ``process_cross`` would give, within
+        the accuracy allowed by bin_slop.  With bin_slop = 0, they are the same.
+
+    Like `BinnedCorr2.process_cross`, this accumulates the weighted sums into the bins of each
+    correlation, but does not finalize the calculation.
+
+    Parameters:
+        corrs (list):       A nested list of `KKCorrelation` or a list of `NKCorrelation`
+                            instances to accumulate.
+        cat1 (list):        A list of catalogs with the same positions (or for NK, a single
+                            catalog).
+        cat2 (list):        A list of catalogs with the same positions, if any.  (default: None,
+                            which means to do the auto- and cross-correlations of cat1)
+        metric (str):       Which metric to use.  See `Metrics` for details.
+                            (default: 'Euclidean'; this value can also be given in the
+                            constructor in the config dict.)
+        num_threads (int):  How many OpenMP threads to use during the calculation.
+                            (default: use the number of cpu cores; this value can also be given
+                            in the constructor in the config dict.)
+    """
+    from .kkcorrelation import KKCorrelation
+    from .nkcorrelation import NKCorrelation
+    from .util import double_ptr as dp
+
+    is_nk = len(corrs) > 0 and isinstance(corrs[0], NKCorrelation)
+    if is_nk:
+        if cat2 is None:
+            raise TypeError("process_multi_k requires cat2 for NKCorrelation")
+        cats1 = None
+        cats2 = list(cat2)
+        grid = [list(corrs)]
+        cls = NKCorrelation
+    else:
+        cats1 = list(cat1)
+        cats2 = list(cat2) if cat2 is not None else None
+        grid = [list(row) for row in corrs]
+        cls = KKCorrelation
+    flat = [corr for row in grid for corr in row]
+    if len(flat) == 0:
+        raise ValueError("No correlations given")
+    for corr in flat:
+        if type(corr) is not cls:
+            raise TypeError("corrs must all be KKCorrelation or all be NKCorrelation")
+    if len(set(id(corr) for corr in flat)) != len(flat):
+        raise ValueError("The items in corrs must all be different objects")
+    n1 = len(grid)
+    n2 = len(cats2) if cats2 is not None else len(cats1)
+    if (cats1 is not None and len(cats1) != n1) or any(len(row) != n2 for row in grid):
+        raise ValueError("The shape of corrs does not match the numbers of catalogs")
+
+    def check_same_positions(cats):
+        c0 = cats[0]
+        for c in cats[1:]:
+            if not (c.ntot == c0.ntot and c.coords == c0.coords and
+                    np.array_equal(c.x, c0.x) and np.array_equal(c.y, c0.y) and
+                    (c.z is None or np.array_equal(c.z, c0.z)) and
+                    np.array_equal(c.w, c0.w)):
+                raise ValueError("The catalogs for process_multi_k must all have the same "
+                                 "positions and weights")
+    if cats1 is not None: check_same_positions(cats1)
+    if cats2 is not None: check_same_positions(cats2)
+    _check_same_binning(flat, 'process_multi_k')
+
+    # corr does the traversal, but its own xi is replaced by the one for its channels.
+    corr = flat[0]
+    first1 = cat1 if is_nk else cats1[0]
+    first2 = cats2[0] if cats2 is not None else None
+    for c in flat:
+        if first2 is None:
+            if first1.name == '':
+                c.logger.info('Starting process_multi_k')
+            else:
+                c.logger.info('Starting process_multi_k for cat %s.', first1.name)
+            c._set_metric(metric, first1.coords)
+        else:
+            if first1.name == '' and first2.name == '':
+                c.logger.info('Starting process_multi_k')
+            else:
+                c.logger.info('Starting process_multi_k for cats %s, %s.',
+                              first1.name, first2.name)
+            c._set_metric(metric, first1.coords, first2.coords)
+        c._set_num_threads(num_threads)
+    min_size, max_size = corr._get_minmax_size()
+    kwargs = dict(min_size=min_size, max_size=max_size, split_method=corr.split_method,
+                  min_top=corr.min_top, max_top=corr.max_top, coords=corr.coords)
+
+    if is_nk:
+        f1 = cat1.getNField(brute=corr.brute is True or corr.brute == 1, **kwargs)
+        k1 = w1 = None
+    elif first2 is None:
+        f1 = first1.getKField(brute=bool(corr.brute), **kwargs)
+    else:
+        f1 = first1.getKField(brute=corr.brute is True or corr.brute == 1, **kwargs)
+    if not is_nk:
+        k1 = np.ascontiguousarray([c.k for c in cats1], dtype=float)
+        w1 = np.ascontiguousarray(first1.w, dtype=float)
+    if first2 is not None:
+        f2 = first2.getKField(brute=corr.brute is True or corr.brute == 2, **kwargs)
+        k2 = np.ascontiguousarray([c.k for c in cats2], dtype=float)
+        w2 = np.ascontiguousarray(first2.w, dtype=float)
+    else:
+        f2 = k2 = w2 = None
+
+    saved = [corr.xi.copy(), corr.meanr.copy(), corr.meanlogr.copy(), corr.weight.copy(),
+             corr.npairs.copy()]
+    xi = np.zeros((n1, n2) + corr.xi.shape, dtype=float)
+    corr.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
+    _lib.ProcessMultiK2(corr.corr, f1.data, f2.data if f2 is not None else _ffi.NULL,
+                        dp(k1), dp(w1), n1, dp(k2), dp(w2), n2, dp(xi), corr.output_dots,
+                        corr._d1, corr._coords, corr._bintype, corr._metric)
+
+    # The sums other than xi are the same for all of them, except that in an auto-correlation,
+    # the ones for a != b count both orders of each pair.  (Unless the bin type puts the
+    # reversed pairs in their own bins, as TwoD does, in which case they were all counted.)
+    sums = [corr.meanr - saved[1], corr.meanlogr - saved[2], corr.weight - saved[3],
+            corr.npairs - saved[4]]
+    corr.xi[:] = saved[0]
+    corr.meanr[:] = saved[1]
+    corr.meanlogr[:] = saved[2]
+    corr.weight[:] = saved[3]
+    corr.npairs[:] = saved[4]
+    is_auto = first2 is None
+    both_orders = is_auto and corr.bin_type != 'TwoD'
+    for a in range(n1):
+        for b in range(n2):
+            c = grid[a][b]
+            if both_orders and b < a:
+                c.xi += xi[b,a]
+            else:
+                c.xi += xi[a,b]
+            f = 2. if both_orders and a != b else 1.
+            c.meanr += f * sums[0]
+            c.meanlogr += f * sums[1]
+            c.weight += f * sums[2]
+            c.npairs += f * sums[3]
+
 def _make_cov_design_matrix_core(corrs, plist, func, name, rank=0, size=1):
     # plist has the pairs to use for each row in the design matrix for each correlation fn.
     # It is a list by row, each element is a list by corr fn of tuples (i,j), being the indices
@@ -1542,6 +3318,44 @@ def _make_cov_design_matrix_core(corrs, plist, func, name, rank=0, size=1):
         w[row] = np.sum([np.sum(c.getWeight()) for c in corrs])
     return v,w
 
+def _cov_design_matrix_pairs(corrs, func, comm, method, index=None):
+    # When each statistic is just a ratio of accumulated values to the weight, and func is
+    # the default, build the design matrix in C++ directly from the values for each pair of
+    # patches.  Returns None if this isn't possible, in which case the caller should use
+    # _make_cov_design_matrix instead.
+    from .util import double_ptr as dp
+    from .util import long_ptr as lp
+
+    if func is not None or comm is not None:
+        return None
+    if any(c._ratio_stat is None for c in corrs):
+        return None
+    method_enum = { 'jackknife': 0, 'sample': 1, 'marked_bootstrap': 2, 'bootstrap': 3 }[method]
+    if index is None:
+        nrows = corrs[0]._get_npatch()
+    else:
+        index = np.ascontiguousarray(index, dtype=int)
+        nrows = len(index)
+
+    vsize = sum(len(c._ratio_stat) * c.weight.size for c in corrs)
+    v = np.zeros((nrows,vsize), dtype=float)
+    w = np.zeros(nrows, dtype=float)
+    set_omp_threads(corrs[0].config.get('num_threads',None))
+    offset = 0
+    for c in corrs:
+        names = c._ratio_stat
+        keys, num, weight = c._patch_pair_arrays(names)
+        i1 = np.ascontiguousarray(keys[:,0])
+        i2 = np.ascontiguousarray(keys[:,1])
+        nbins = weight.shape[1]
+        if _lib.CovDesignMatrix(dp(num), dp(weight), len(names), nbins,
+                                lp(i1), lp(i2), len(keys), c.npatch1, c.npatch2,
+                                method_enum, lp(index), nrows, dp(v), vsize, offset, dp(w)):
+            # Some row doesn't have any pairs of patches.  The Python version warns about it.
+            return None
+        offset += len(names) * nbins
+    return v, w
+
 def _make_cov_design_matrix(corrs, plist, func, name, comm=None):
     if comm is not None:
         from mpi4py import MPI
@@ -1593,6 +3407,9 @@ def _check_patch_nums(corrs, name):
 
 def _design_jackknife(corrs, func, comm=None):
     npatch = _check_patch_nums(corrs, 'jackknife')
+    vw = _cov_design_matrix_pairs(corrs, func, comm, 'jackknife')
+    if vw is not None:
+        return vw
     plist = [c._jackknife_pairs() for c in corrs]
     # Swap order of plist.  Right now it's a list for each corr of a list for each row.
     # We want a list by row with a list for each corr.
@@ -1617,6 +3434,9 @@ def _cov_jackknife(corrs, func, comm=None):
 
 def _design_sample(corrs, func, comm=None):
     npatch = _check_patch_nums(corrs, 'sample')
+    vw = _cov_design_matrix_pairs(corrs, func, comm, 'sample')
+    if vw is not None:
+        return vw
     plist = [c._sample_pairs() for c in corrs]
     # Swap order of plist.  Right now it's a list for each corr of a list for each row.
     # We want a list by row with a list for each corr.
@@ -1652,10 +3472,14 @@ def _design_marked(corrs, func, comm=None):
     npatch = _check_patch_nums(corrs, 'marked_bootstrap')
     nboot = np.max([c.num_bootstrap for c in corrs])  # use the maximum if they differ.
 
+    # Select a random set of indices to use for each realization.  (Will have repeats.)
+    indices = [corrs[0].rng.randint(npatch, size=npatch) for k in range(nboot)]
+    vw = _cov_design_matrix_pairs(corrs, func, comm, 'marked_bootstrap', indices)
+    if vw is not None:
+        return vw
+
     plist = []
-    for k in range(nboot):
-        # Select a random set of indices to use.  (Will have repeats.)
-        index = corrs[0].rng.randint(npatch, size=npatch)
+    for index in indices:
         vpairs = [c._marked_pairs(index) for c in corrs]
         plist.append(vpairs)
 
@@ -1689,9 +3513,13 @@ def _design_bootstrap(corrs, func, comm=None):
     npatch = _check_patch_nums(corrs, 'bootstrap')
     nboot = np.max([c.num_bootstrap for c in corrs])  # use the maximum if they differ.
 
+    indices = [corrs[0].rng.randint(npatch, size=npatch) for k in range(nboot)]
+    vw = _cov_design_matrix_pairs(corrs, func, comm, 'bootstrap', indices)
+    if vw is not None:
+        return vw
+
     plist = []
-    for k in range(nboot):
-        index = corrs[0].rng.randint(npatch, size=npatch)
+    for index in indices:
         vpairs = [c._bootstrap_pairs(index) for c in corrs]
         plist.append(vpairs)
 
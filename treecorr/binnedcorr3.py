@@ -20,11 +20,15 @@ import numpy as np
 import sys
 import coord
 
-from . import _lib
+from . import _lib, _ffi
 from .config import merge_config, setup_logger, get
 from .util import parse_metric, metric_enum, coord_enum, set_omp_threads, lazy_property
+from .util import get_omp_threads
 from .util import make_reader
+from .util import double_ptr as dp
 from .util import depr_pos_kwargs
+from .util import trace_span
+from .util import Checkpoint
 from .binnedcorr2 import estimate_multi_cov, build_multi_cov_design_matrix
 
 class Namespace(object):
@@ -204,7 +208,7 @@ class BinnedCorr3(object):
         num_bootstrap (int): How many bootstrap samples to use for the 'bootstrap' and
                             'marked_bootstrap' var_methods.  (default: 500)
         rng (RandomState):  If desired, a numpy.random.RandomState instance to use for bootstrap
-                            random number generation. (default: None)
+                            and sample_rate random number generation. (default: None)
 
         num_threads (int):  How many OpenMP threads to use during the calculation.
                             (default: use the number of cpu cores; this value can also be given in
@@ -214,6 +218,39 @@ class BinnedCorr3(object):
 
                                 This won't work if the system's C compiler cannot use OpenMP
                                 (e.g. clang prior to version 3.7.)
+
+        max_accum_mem (float): The maximum total memory in bytes to use for the copies of the
+                            accumulated results made for each thread.  If one copy per thread
+                            would need more than this, some threads share a copy, locking the
+                            bins they update.  This is mostly relevant for large numbers of
+                            (r,u,v) bins with many threads.  (default: 0, which means no limit)
+
+        sample_rate (float): If given, compute an approximation of the correlation function
+                            using a random sample of the top-level cells of the first catalog,
+                            with this fraction of them being used on average.  The cells are
+                            chosen with a probability proportional to their weight, and their
+                            triangles are weighted by the inverse of that probability, so the
+                            accumulated sums are unbiased estimates of the full ones.  The
+                            variance due to the sampling is estimated too, in ``sample_var``,
+                            which has the same layout as `getStat`.  (For NNNCorrelation, it is
+                            the variance of the weight.)  The sampling is of whole top-level
+                            cells, so this works best when there are many of them.
+                            (default: None, which means to use all the triangles)
+        sample_groups (int): How many groups to split the sampled cells into for estimating
+                            the variance due to the sampling.  (default: 10)
+        checkpoint_file (str): If given, the progress of `process` is saved in this file every
+                            checkpoint_interval seconds.  If the same process call is made
+                            again, e.g. after the job was preempted, it resumes from the file,
+                            skipping the work that is already done.  With patches, this is the
+                            sets of patches that are done.  Otherwise, it is the top-level
+                            cells of the first catalog whose triangles are done, so it requires
+                            that the fields are built the same way each time (i.e. not with
+                            split_method='random').  When using MPI, each process uses its own
+                            file, with its rank appended to the name.  The file is left in place
+                            at the end, so remove it to start the calculation over.  This is
+                            not implemented with sample_rate.  (default: None)
+        checkpoint_interval (float): How many seconds to wait between writing the
+                            checkpoint_file.  (default: 600)
     """
     _valid_params = {
         'nbins' : (int, False, None, None,
@@ -287,6 +324,16 @@ class BinnedCorr3(object):
                 'marked_bootstrap'),
         'num_threads' : (int, False, None, None,
                 'How many threads should be used. num_threads <= 0 means auto based on num cores.'),
+        'max_accum_mem' : (float, False, None, None,
+                'The maximum total memory in bytes for the per-thread copies of the results.'),
+        'sample_rate' : (float, False, None, None,
+                'The fraction of the top-level cells to use for an approximate calculation.'),
+        'sample_groups' : (int, False, 10, None,
+                'How many groups of sampled cells to use for estimating sample_var.'),
+        'checkpoint_file' : (str, False, None, None,
+                'A file in which to save the progress of process, so it can be resumed.'),
+        'checkpoint_interval' : (float, False, 600., None,
+                'How many seconds to wait between writing the checkpoint file.'),
     }
 
     @depr_pos_kwargs
@@ -492,6 +539,15 @@ class BinnedCorr3(object):
         self._ro.xperiod = get(self.config,'xperiod',float,period)
         self._ro.yperiod = get(self.config,'yperiod',float,period)
         self._ro.zperiod = get(self.config,'zperiod',float,period)
+        self._ro.max_accum_mem = get(self.config,'max_accum_mem',float,0.)
+        self._ro.sample_rate = get(self.config,'sample_rate',float,None)
+        self._ro.sample_groups = get(self.config,'sample_groups',int,10)
+        if self.sample_rate is not None and not 0. < self.sample_rate <= 1.:
+            raise ValueError("sample_rate must be in the range (0,1]")
+        if self.sample_groups < 2:
+            raise ValueError("sample_groups must be at least 2")
+        self._ro.checkpoint_file = get(self.config,'checkpoint_file',str,None)
+        self._ro.checkpoint_interval = get(self.config,'checkpoint_interval',float,600.)
         self._ro._nbins = len(self._ro.logr.ravel())
 
         self._ro.var_method = get(self.config,'var_method',str,'shot')
@@ -499,6 +555,10 @@ class BinnedCorr3(object):
         self.results = {}  # for jackknife, etc. store the results of each pair of patches.
         self.npatch1 = self.npatch2 = self.npatch3 = 1
         self._rng = rng
+        self._progress = np.zeros(2)  # [work done, total work], updated by the C++ layer.
+        self._sample_group = None  # Which group of the sampled cells is being processed.
+        self._cell_mask = None  # Which top-level cells to process, when checkpointing.
+        self.sample_var = None
 
     @property
     def rng(self):
@@ -506,6 +566,22 @@ class BinnedCorr3(object):
             self._rng = np.random.RandomState()
         return self._rng
 
+    @property
+    def progress(self):
+        """The progress of the calculation, as an array [work done, total work].
+
+        The total work is an estimate of the number of triangles to be considered, and the
+        work done is updated as each top-level cell of the first catalog is finished.  This
+        is updated in place during the calculation, so it can be read from another Python
+        thread (e.g. by a job scheduler watching for stalled jobs) while the calculation is
+        running.  The ratio progress[0]/progress[1] is the fraction of the work done so far.
+
+        When processing catalogs with patches, each pair or triple of patches adds its own
+        total work when it starts, so the work done only ever increases, but the total may
+        increase too.  It is reset to zero at the start of each call to `process`.
+        """
+        return self._progress
+
     # Properties for all the read-only attributes ("ro" stands for "read-only")
     @property
     def output_dots(self): return self._ro.output_dots
@@ -590,6 +666,16 @@ class BinnedCorr3(object):
     @property
     def zperiod(self): return self._ro.zperiod
     @property
+    def max_accum_mem(self): return self._ro.max_accum_mem
+    @property
+    def sample_rate(self): return self._ro.sample_rate
+    @property
+    def sample_groups(self): return self._ro.sample_groups
+    @property
+    def checkpoint_file(self): return self._ro.checkpoint_file
+    @property
+    def checkpoint_interval(self): return self._ro.checkpoint_interval
+    @property
     def var_method(self): return self._ro.var_method
     @property
     def num_bootstrap(self): return self._ro.num_bootstrap
@@ -613,6 +699,39 @@ class BinnedCorr3(object):
         self.logger = setup_logger(get(self.config,'verbose',int,1),
                                    self.config.get('log_file',None))
 
+    def process_async(self, *args, executor=None, **kwargs):
+        """Run `process` in a background thread, returning a future for its completion.
+
+        The calls into the C++ layer release the GIL, so the calling thread can do other
+        work while the correlation is computing.  In particular, it can load the next
+        catalogs and build their fields, so that they are ready once this calculation
+        is done::
+
+            >>> future = ggg.process_async(cat1, cat2)
+            >>> next_cat.getGField(...)      # Built while ggg is processing.
+            >>> future.result()             # Wait for ggg to finish.
+
+        The arguments are the same as for `process`.  The results are accumulated into
+        this object as usual, so it should not be used again until the future is done.
+        Nor should the catalogs be used by another thread in the meantime.
+        The future's result() re-raises any exception raised by `process`.
+
+        Parameters:
+            executor:   A concurrent.futures.Executor to use.  If None, a new thread is
+                        started for this call. (default: None)
+
+        Returns:
+            A concurrent.futures.Future whose result is None once `process` is done.
+        """
+        import concurrent.futures
+        if executor is not None:
+            return executor.submit(self.process, *args, **kwargs)
+        executor = concurrent.futures.ThreadPoolExecutor(max_workers=1)
+        future = executor.submit(self.process, *args, **kwargs)
+        # This lets the thread exit once process is done, without waiting for it here.
+        executor.shutdown(wait=False)
+        return future
+
     def clear(self):
         """Clear all data vectors, the results dict, and any related values.
         """
@@ -620,6 +739,7 @@ class BinnedCorr3(object):
         self.results = {}
         self.npatch1 = self.npatch2 = self.npatch3 = 1
         self.__dict__.pop('_ok',None)
+        self.sample_var = None
 
     @property
     def nonzero(self):
@@ -642,6 +762,243 @@ class BinnedCorr3(object):
         d3, d2, d1 = sorted([d1,d2,d3])
         return (d2 > s1 + s2 + s3 + 2*self._max_sep)  # The 2* is where we are being conservative.
 
+    def _sample_cells(self, field):
+        # The weights to use for each top-level cell of field in the current group of the
+        # sampled cells, or None if not sampling.  When checkpointing, this is also how the
+        # top-level cells are done a chunk at a time, with a weight of 1 for each cell in it.
+        if self._cell_mask is not None:
+            return self._cell_mask
+        if self._sample_group is None:
+            return None
+        n = field.nTopLevelNodes
+        w = np.empty(n, dtype=float)
+        _lib.FieldGetTopLevelW(field.data, field._d, field._coords, dp(w), n)
+        # All the groups make the same random choices for each field, so between them they
+        # process each sampled cell exactly once.
+        rng = np.random.RandomState(self._sample_seed + self._sample_ncall)
+        self._sample_ncall += 1
+        sumw = np.sum(w)
+        if sumw == 0:
+            # None of the cells have any weight, so there is nothing to sample.
+            return np.zeros(n, dtype=float)
+        prob = np.minimum(self.sample_rate * n * w / sumw, 1.)
+        use = (rng.uniform(size=n) < prob) & (rng.randint(self.sample_groups, size=n) ==
+                                              self._sample_group)
+        sample = np.zeros(n, dtype=float)
+        sample[use] = 1. / prob[use]
+        return sample
+
+    def _process_sampled(self, process_all, cats, metric, num_threads, comm, low_mem):
+        # Process a random sample of the top-level cells, split into sample_groups groups.
+        # Each group is an independent estimate of the full calculation (up to a factor of
+        # sample_groups), so the spread of their statistics gives the variance due to the
+        # sampling, and their sum is the result.
+        if comm is not None:
+            raise NotImplementedError("sample_rate is not implemented with MPI")
+        if self.checkpoint_file is not None:
+            raise NotImplementedError("checkpoint_file is not implemented with sample_rate")
+        seed = self.rng.randint(1 << 30)
+        temp = self.copy()
+        temp._progress = self._progress
+        results = {}
+        stats = []
+        valid = []
+        for g in range(self.sample_groups):
+            temp.clear()
+            temp._sample_group = g
+            temp._sample_seed = seed
+            temp._sample_ncall = 0
+            self.logger.info('Process group %d of the sampled cells',g)
+            getattr(temp, process_all)(*cats, metric, num_threads, low_mem=low_mem)
+            temp._sample_tot(g == 0)
+            self += temp
+            for key, result in temp.results.items():
+                results.setdefault(key, []).append(result)
+            final = temp.copy()
+            final._finalize()
+            stat, ok = final._sample_stat()
+            stats.append(stat)
+            valid.append(ok)
+        self.npatch1, self.npatch2, self.npatch3 = temp.npatch1, temp.npatch2, temp.npatch3
+        for key, group in results.items():
+            self.results[key] = temp.copy()
+            self.results[key].results = {}
+            self.results[key]._sum(group)
+
+        # Bins that are empty in a group have no estimate there, so only use the others.
+        stats = np.array(stats)
+        valid = np.array(valid)
+        n = np.sum(valid, axis=0)
+        mean = np.sum(np.where(valid, stats, 0.), axis=0) / np.maximum(n, 1)
+        dev = np.where(valid, np.abs(stats - mean)**2, 0.)
+        self.sample_var = np.sum(dev, axis=0) / np.maximum(n * (n-1), 1)
+
+    def _sample_tot(self, first):
+        # No op for all but NNNCorrelation, which needs to count the tot value only once
+        # when adding up the groups of the sampled cells.
+        pass
+
+    def _sample_stat(self):
+        # The statistic to use for sample_var from the results of one group, after _finalize,
+        # and whether each value is valid.
+        return self.getStat(), self.getWeight() != 0
+
+    def _get_field(self, cat, d, brute):
+        # Get a field the same way the process_cross methods of the subclasses do, but using
+        # d (one of _d1, _d2, _d3) to pick the kind of field.
+        min_size, max_size = self._get_minmax_size()
+        getField = { 1: cat.getNField, 2: cat.getKField, 3: cat.getGField }[d]
+        return getField(min_size=min_size, max_size=max_size,
+                        split_method=self.split_method, brute=brute,
+                        min_top=self.min_top, max_top=self.max_top,
+                        coords=self.coords)
+
+    def _add_process_tot(self, c1, c2, c3):
+        # No op for all but NNNCorrelation, which needs to add the tot value that process_cross
+        # would have added.
+        pass
+
+    def thread_copy_memory(self, num_threads=None, nsets=1):
+        """Return how much memory `process_auto` and `process_cross` use for the copies of
+        the accumulated arrays that the threads fill in.
+
+        Each thread makes its own copy, unless that would be more than ``max_accum_mem``,
+        in which case the threads share fewer copies.  For a cross-correlation, each copy is
+        of all the permutations of the catalogs that are kept separately (3 for
+        `process_cross12` or 6 for `process_cross`), given by ``nsets``.
+
+        Parameters:
+            num_threads (int):  How many OpenMP threads the calculation would use.  If None,
+                                use the number currently set. (default: None)
+            nsets (int):        How many correlation objects are in each copy. (default: 1)
+
+        Returns:
+            A tuple (ncopies, nbytes) with the number of copies and the bytes of one
+            correlation object in each.
+        """
+        if num_threads is None:
+            num_threads = get_omp_threads()
+        nbytes = _ffi.new('double*')
+        ncopies = _lib.GetCopyBytes3(self._triplet_corrs()[0], self._d1, self._d2, self._d3,
+                                     self._bintype, nsets, num_threads, nbytes)
+        return ncopies, int(nbytes[0])
+
+    def _triplet_corrs(self):
+        # The six C++ correlation objects to pass to ProcessPatches3 for one set of patches,
+        # in the same order as for ProcessCross3.  All but the Cross classes put every
+        # triangle into self.corr.
+        return [self.corr] * 6
+
+    def _process_patch_triplets(self, jobs, metric, num_threads):
+        # Process all the sets of three patches in jobs with a single call to the C layer,
+        # which skips the sets that are too far apart to have any triangles and runs the rest
+        # in parallel.  Each job is (i, j, k, c1, c2, c3).  Returns a list with a correlation
+        # object for each job holding just the results for that set of patches.  The skipped
+        # ones all get the same empty object, which must not be modified.
+        if len(jobs) == 0:
+            return []
+        c1, c2, c3 = jobs[0][3:]
+        self._set_metric(metric, c1.coords, c2.coords, c3.coords)
+        self._set_num_threads(num_threads)
+        fields = {}
+        def get_field(cat, d, brute):
+            # Most patches are in many jobs, so only get each one's field once.
+            key = (id(cat), d, brute)
+            if key not in fields:
+                fields[key] = self._get_field(cat, d, brute)
+            return fields[key].data
+
+        brute1 = self.brute is True or self.brute == 1
+        brute2 = self.brute is True or self.brute == 2
+        brute3 = self.brute is True or self.brute == 3
+        fields1 = _ffi.new("void*[]", [get_field(job[3], self._d1, brute1) for job in jobs])
+        fields2 = _ffi.new("void*[]", [get_field(job[4], self._d2, brute2) for job in jobs])
+        fields3 = _ffi.new("void*[]", [get_field(job[5], self._d3, brute3) for job in jobs])
+        keep = _ffi.new("int[]", len(jobs))
+        _lib.PrunePatches3(self._triplet_corrs()[0], fields1, fields2, fields3, len(jobs), keep,
+                           self._d1, self._d2, self._d3, self._coords, self._bintype, self._metric)
+        keep = [n for n in range(len(jobs)) if keep[n]]
+        self.logger.info('Starting %d sets of patches.  Skipping %d, which are too far apart ' +
+                         'for this set of separations.', len(keep), len(jobs) - len(keep))
+
+        empty = self.copy()
+        empty.results = {}
+        empty._clear()
+        temps = [empty] * len(jobs)
+        corrs = []
+        for n in keep:
+            temp = empty.copy()
+            temp._add_process_tot(*jobs[n][3:])
+            temps[n] = temp
+            corrs.extend(temp._triplet_corrs())
+        if len(keep) > 0:
+            _lib.ProcessPatches3(_ffi.new("void*[]", corrs),
+                                 _ffi.new("void*[]", [fields1[n] for n in keep]),
+                                 _ffi.new("void*[]", [fields2[n] for n in keep]),
+                                 _ffi.new("void*[]", [fields3[n] for n in keep]),
+                                 len(keep), self.output_dots, dp(self._progress),
+                                 self._d1, self._d2, self._d3,
+                                 self._coords, self._bintype, self._metric)
+        return temps
+
+    def _start_checkpoint(self, kind, cats, comm):
+        # The Checkpoint for a loop over the sets of patches.  If there is a checkpoint file
+        # from an earlier run of the same calculation, its progress is restored here.
+        ckpt = Checkpoint(self, self.checkpoint_file, self.checkpoint_interval, kind,
+                          [self.npatch1, self.npatch2, self.npatch3], cats, comm)
+        ckpt.load()
+        return ckpt
+
+    def _process_cells(self, kind, cats, metric, brute, process):
+        # Call process, which does the calculation for catalogs without patches.  When
+        # checkpointing, it is called for a chunk of the top-level cells of the first catalog
+        # at a time, so the progress can be saved in between.  The triangles are assigned to
+        # the cells the same way as for sample_rate, so each one is done in exactly one chunk.
+        if self.checkpoint_file is None:
+            return process()
+        self._set_metric(metric, *[c.coords for c in cats])
+        n = self._get_field(cats[0], self._d1, brute).nTopLevelNodes
+        ckpt = self._start_checkpoint(kind, cats, None)
+        if ckpt.cells is None:
+            ckpt.cells = np.zeros(n, dtype=bool)
+        elif len(ckpt.cells) != n:
+            raise ValueError("Checkpoint file %s is for a different calculation"%ckpt.file_name)
+        for chunk in ckpt.chunks(np.flatnonzero(~ckpt.cells)):
+            self._cell_mask = np.zeros(n, dtype=float)
+            self._cell_mask[chunk] = 1.
+            try:
+                process()
+            finally:
+                self._cell_mask = None
+            ckpt.cells[chunk] = True
+            ckpt.save_if_due()
+        ckpt.save()
+
+    def _skip_done(self, jobs, ckpt):
+        # Remove the jobs for the sets of patches that were done before the checkpoint.
+        return [job for job in jobs if job[:3] not in ckpt.done]
+
+    def _process_triplet_jobs(self, jobs, metric, num_threads, ckpt, keep):
+        # Process the jobs for sets of three patches collected by the loops below, a chunk at
+        # a time when checkpointing.  keep(i,j,k) says whether to keep the results of a set
+        # with no triangles.
+        for chunk in ckpt.chunks(self._skip_done(jobs, ckpt)):
+            for (i,j,k,c1,c2,c3), temp in zip(chunk, self._process_patch_triplets(
+                    chunk, metric, num_threads)):
+                if temp.nonzero or keep(i,j,k):
+                    if (i,j,k) in self.results and self.results[(i,j,k)].nonzero:
+                        self.results[(i,j,k)] += temp
+                    else:
+                        self.results[(i,j,k)] = temp.copy()
+                    self += temp
+                else:
+                    # NNNCorrelation needs to add the tot value
+                    self._add_tot(i, j, k, c1, c2, c3)
+                ckpt.done.add((i,j,k))
+            ckpt.save_if_due()
+        ckpt.save()
+
+    @trace_span('BinnedCorr3.process_all_auto')
     def _process_all_auto(self, cat1, metric, num_threads, comm=None, low_mem=False):
 
         def is_my_job(my_indices, i, j, k, n):
@@ -677,8 +1034,15 @@ class BinnedCorr3(object):
             else:
                 return False
 
+        if self._sample_group is None:
+            self._progress[:] = 0.
+            if self.sample_rate is not None:
+                return self._process_sampled('_process_all_auto', (cat1,), metric, num_threads,
+                                             comm, low_mem)
         if len(cat1) == 1 and cat1[0].npatch == 1:
-            self.process_auto(cat1[0], metric=metric, num_threads=num_threads)
+            self._process_cells('cells_auto', cat1, metric, bool(self.brute),
+                                lambda: self.process_auto(cat1[0], metric=metric,
+                                                          num_threads=num_threads))
 
         else:
             # When patch processing, keep track of the pair-wise results.
@@ -696,10 +1060,16 @@ class BinnedCorr3(object):
             else:
                 my_indices = None
 
+            ckpt = self._start_checkpoint('auto', cat1, comm)
             temp = self.copy()
+            temp._progress = self._progress  # Report the progress of the patches here.
+            # Unless saving memory, collect the sets of three different patches, so they can
+            # all be done in one call to the C layer.  (Sampled runs use the per-patch calls.)
+            by_triplet = not low_mem and self._sample_group is None
+            jobs = []
             for ii,c1 in enumerate(cat1):
                 i = c1.patch if c1.patch is not None else ii
-                if is_my_job(my_indices, i, i, i, n):
+                if is_my_job(my_indices, i, i, i, n) and (i,i,i) not in ckpt.done:
                     temp.clear()
                     self.logger.info('Process patch %d auto',i)
                     temp.process_auto(c1, metric=metric, num_threads=num_threads)
@@ -708,11 +1078,14 @@ class BinnedCorr3(object):
                     else:
                         self.results[(i,i,i)] = temp.copy()
                     self += temp
+                    ckpt.finish((i,i,i))
 
                 for jj,c2 in list(enumerate(cat1))[::-1]:
                     j = c2.patch if c2.patch is not None else jj
                     if i < j:
-                        if is_my_job(my_indices, i, j, j, n):
+                        # The (i,j,j) and (i,i,j) sets are done together, so they are recorded
+                        # as one job, under (i,j,j).
+                        if is_my_job(my_indices, i, j, j, n) and (i,j,j) not in ckpt.done:
                             temp.clear()
                             # One point in c1, 2 in c2.
                             if not self._trivially_zero(c1,c2,c2,metric):
@@ -745,11 +1118,17 @@ class BinnedCorr3(object):
                             else:
                                 # NNNCorrelation needs to add the tot value
                                 self._add_tot(i, i, j, c2, c1, c1)
+                            ckpt.finish((i,j,j))
 
                         # One point in each of c1, c2, c3
                         for kk,c3 in enumerate(cat1):
                             k = c3.patch if c3.patch is not None else kk
                             if j < k and is_my_job(my_indices, i, j, k, n):
+                                if by_triplet:
+                                    jobs.append((i, j, k, c1, c2, c3))
+                                    continue
+                                if (i,j,k) in ckpt.done:
+                                    continue
                                 temp.clear()
 
                                 if not self._trivially_zero(c1,c2,c3,metric):
@@ -768,6 +1147,7 @@ class BinnedCorr3(object):
                                 else:
                                     # NNNCorrelation needs to add the tot value
                                     self._add_tot(i, j, k, c1, c2, c3)
+                                ckpt.finish((i,j,k))
                                 if low_mem:
                                     c3.unload()
 
@@ -776,6 +1156,7 @@ class BinnedCorr3(object):
                             c2.unload()
                 if low_mem:
                     c1.unload()
+            self._process_triplet_jobs(jobs, metric, num_threads, ckpt, lambda i,j,k: False)
             if comm is not None:
                 rank = comm.Get_rank()
                 size = comm.Get_size()
@@ -789,6 +1170,7 @@ class BinnedCorr3(object):
                         self += temp
                         self.results.update(temp.results)
 
+    @trace_span('BinnedCorr3.process_all_cross12')
     def _process_all_cross12(self, cat1, cat2, metric, num_threads, comm=None, low_mem=False):
 
         def is_my_job(my_indices, i, j, k, n1, n2):
@@ -824,8 +1206,16 @@ class BinnedCorr3(object):
                 self.logger.info("Rank %d: Job (%d,%d,%d) is mine.",rank,i,j,k)
             return ret
 
+        if self._sample_group is None:
+            self._progress[:] = 0.
+            if self.sample_rate is not None:
+                return self._process_sampled('_process_all_cross12', (cat1, cat2), metric,
+                                             num_threads, comm, low_mem)
         if len(cat1) == 1 and len(cat2) == 1 and cat1[0].npatch == 1 and cat2[0].npatch == 1:
-            self.process_cross12(cat1[0], cat2[0], metric=metric, num_threads=num_threads)
+            self._process_cells('cells_cross12', cat1 + cat2, metric,
+                                self.brute is True or self.brute == 1,
+                                lambda: self.process_cross12(cat1[0], cat2[0], metric=metric,
+                                                             num_threads=num_threads))
         else:
             # When patch processing, keep track of the pair-wise results.
             if self.npatch1 == 1:
@@ -848,12 +1238,18 @@ class BinnedCorr3(object):
             else:
                 my_indices = None
 
+            ckpt = self._start_checkpoint('cross12', cat1 + cat2, comm)
             temp = self.copy()
+            temp._progress = self._progress  # Report the progress of the patches here.
+            # Unless saving memory, collect the sets of three different patches, so they can
+            # all be done in one call to the C layer.  (Sampled runs use the per-patch calls.)
+            by_triplet = not low_mem and self._sample_group is None
+            jobs = []
             for ii,c1 in enumerate(cat1):
                 i = c1.patch if c1.patch is not None else ii
                 for jj,c2 in enumerate(cat2):
                     j = c2.patch if c2.patch is not None else jj
-                    if is_my_job(my_indices, i, i, j, n1, n2):
+                    if is_my_job(my_indices, i, i, j, n1, n2) and (i,j,j) not in ckpt.done:
                         temp.clear()
                         # One point in c1, 2 in c2.
                         if not self._trivially_zero(c1,c2,c2,metric):
@@ -871,11 +1267,17 @@ class BinnedCorr3(object):
                         else:
                             # NNNCorrelation needs to add the tot value
                             self._add_tot(i, j, j, c1, c2, c2)
+                        ckpt.finish((i,j,j))
 
                     # One point in each of c1, c2, c3
                     for kk,c3 in list(enumerate(cat2))[::-1]:
                         k = c3.patch if c3.patch is not None else kk
                         if j < k and is_my_job(my_indices, i, j, k, n1, n2):
+                            if by_triplet:
+                                jobs.append((i, j, k, c1, c2, c3))
+                                continue
+                            if (i,j,k) in ckpt.done:
+                                continue
                             temp.clear()
 
                             if not self._trivially_zero(c1,c2,c3,metric):
@@ -894,6 +1296,7 @@ class BinnedCorr3(object):
                             else:
                                 # NNNCorrelation needs to add the tot value
                                 self._add_tot(i, j, k, c1, c2, c3)
+                            ckpt.finish((i,j,k))
                             if low_mem:
                                 c3.unload()
 
@@ -902,6 +1305,7 @@ class BinnedCorr3(object):
                         c2.unload()
                 if low_mem:
                     c1.unload()
+            self._process_triplet_jobs(jobs, metric, num_threads, ckpt, lambda i,j,k: False)
             if comm is not None:
                 rank = comm.Get_rank()
                 size = comm.Get_size()
@@ -915,6 +1319,7 @@ class BinnedCorr3(object):
                         self += temp
                         self.results.update(temp.results)
 
+    @trace_span('BinnedCorr3.process_all_cross')
     def _process_all_cross(self, cat1, cat2, cat3, metric, num_threads, comm=None, low_mem=False):
 
         def is_my_job(my_indices, i, j, k, n1, n2, n3):
@@ -939,9 +1344,17 @@ class BinnedCorr3(object):
             else:
                 return False
 
+        if self._sample_group is None:
+            self._progress[:] = 0.
+            if self.sample_rate is not None:
+                return self._process_sampled('_process_all_cross', (cat1, cat2, cat3), metric,
+                                             num_threads, comm, low_mem)
         if (len(cat1) == 1 and len(cat2) == 1 and len(cat3) == 1 and
                 cat1[0].npatch == 1 and cat2[0].npatch == 1 and cat3[0].npatch == 1):
-            self.process_cross(cat1[0], cat2[0], cat3[0], metric=metric, num_threads=num_threads)
+            self._process_cells('cells_cross', cat1 + cat2 + cat3, metric,
+                                self.brute is True or self.brute == 1,
+                                lambda: self.process_cross(cat1[0], cat2[0], cat3[0],
+                                                           metric=metric, num_threads=num_threads))
         else:
             # When patch processing, keep track of the pair-wise results.
             if self.npatch1 == 1:
@@ -968,7 +1381,13 @@ class BinnedCorr3(object):
             else:
                 my_indices = None
 
+            ckpt = self._start_checkpoint('cross', cat1 + cat2 + cat3, comm)
             temp = self.copy()
+            temp._progress = self._progress  # Report the progress of the patches here.
+            # Unless saving memory, collect the sets of three different patches, so they can
+            # all be done in one call to the C layer.  (Sampled runs use the per-patch calls.)
+            by_triplet = not low_mem and self._sample_group is None
+            jobs = []
             for ii,c1 in enumerate(cat1):
                 i = c1.patch if c1.patch is not None else ii
                 for jj,c2 in enumerate(cat2):
@@ -976,6 +1395,11 @@ class BinnedCorr3(object):
                     for kk,c3 in enumerate(cat3):
                         k = c3.patch if c3.patch is not None else kk
                         if is_my_job(my_indices, i, j, k, n1, n2, n3):
+                            if by_triplet:
+                                jobs.append((i, j, k, c1, c2, c3))
+                                continue
+                            if (i,j,k) in ckpt.done:
+                                continue
                             temp.clear()
                             if not self._trivially_zero(c1,c2,c3,metric):
                                 self.logger.info('Process patches %d,%d,%d cross',i,j,k)
@@ -995,6 +1419,7 @@ class BinnedCorr3(object):
                             else:
                                 # NNNCorrelation needs to add the tot value
                                 self._add_tot(i, j, k, c1, c2, c3)
+                            ckpt.finish((i,j,k))
                             if low_mem:
                                 c3.unload()
                     if low_mem and jj != ii+1:
@@ -1002,6 +1427,11 @@ class BinnedCorr3(object):
                         c2.unload()
                 if low_mem:
                     c1.unload()
+            self._process_triplet_jobs(
+                jobs, metric, num_threads, ckpt,
+                lambda i,j,k: ((i==j==k)
+                               or (i==j and n3==1) or (i==k and n2==1) or (j==k and n1==1)
+                               or (n1==n2==1) or (n1==n3==1) or (n2==n3==1)))
             if comm is not None:
                 rank = comm.Get_rank()
                 size = comm.Get_size()
@@ -1035,6 +1465,7 @@ class BinnedCorr3(object):
         return self.weight.ravel()
 
     @depr_pos_kwargs
+    @trace_span('BinnedCorr3.estimate_cov')
     def estimate_cov(self, method, *, func=None, comm=None):
         """Estimate the covariance matrix based on the data
 
@@ -1172,6 +1603,9 @@ class BinnedCorr3(object):
         if metric is None:
             metric = get(self.config,'metric',str,'Euclidean')
         coords, metric = parse_metric(metric, coords1, coords2, coords3)
+        if not _lib.MetricCompiled(metric_enum(metric)):
+            raise ValueError("TreeCorr was built without metric=%s.  "%metric +
+                             "(cf. TREECORR_METRICS)")
         if self.coords is not None or self.metric is not None:
             if coords != self.coords:
                 self.logger.warning("Detected a change in catalog coordinate systems. "+
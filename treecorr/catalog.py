@@ -20,6 +20,7 @@ import coord
 import weakref
 import copy
 import os
+import hashlib
 
 from . import _lib
 from .reader import FitsReader, HdfReader, AsciiReader, PandasReader, ParquetReader
@@ -28,6 +29,7 @@ from .util import parse_file_type, LRU_Cache, make_writer, make_reader, set_omp_
 from .util import double_ptr as dp
 from .util import long_ptr as lp
 from .util import depr_pos_kwargs
+from .util import trace_span
 from .field import NField, KField, GField, NSimpleField, KSimpleField, GSimpleField
 
 class Catalog(object):
@@ -247,6 +249,11 @@ class Catalog(object):
                             cf. `Field.run_kmeans` (default: 'tree')
         kmeans_alt (bool):  If using kmeans to make patches, whether to use the alternate kmeans
                             algorithm. cf. `Field.run_kmeans` (default: False)
+        kmeans_cache_dir (str): If using kmeans to make patches, a directory in which to save the
+                            resulting patch centers and patch numbers.  If kmeans has already
+                            been run with the same parameters on a catalog with the same
+                            positions and weights (in this or a previous session), they are read
+                            from this directory rather than running kmeans again. (default: None)
 
         x_col (str or int): The column to use for the x values. An integer is only allowed for
                             ASCII files. (default: '0', which means not to read in this column.
@@ -362,6 +369,92 @@ class Catalog(object):
                                 - random: Use a random point somewhere in the middle two quartiles
                                   of the range.
 
+        use_arena (bool):   Whether to allocate the trees of the fields built from this catalog
+                            in a few large contiguous blocks of memory rather than separately
+                            for each cell.  For very large catalogs, this makes the fields
+                            faster to build and much faster to delete. (default: False)
+
+        use_packed (bool):  Whether the fields built from this catalog should also make a
+                            packed copy of the tree, which stores the information needed for
+                            the tree traversal in contiguous arrays.  This uses some extra
+                            memory, but is faster for computing correlation functions of large
+                            catalogs. (default: False)
+        zero_copy (bool):   Whether the fields built from this catalog should build their
+                            trees directly from the catalog's arrays, rather than first making
+                            a copy of the data for every object.  This saves a significant
+                            amount of memory while building the fields for very large catalogs.
+                            (default: False)
+        reorder_tree (bool): Whether the fields built from this catalog should copy their trees
+                            once they are built so that each subtree is contiguous in memory.
+                            This makes the tree traversal faster for large catalogs, and it
+                            implies use_arena. (default: False)
+        bucket_size (int): If > 1, the fields built from this catalog store the objects of
+                            any cell with at most this many objects contiguously, and compute
+                            all of their pairs directly when such a cell would need to be split.
+                            This is mostly useful for bin_slop=0, and it implies use_arena.
+                            (default: 0)
+        merge_size (float): If > 0, the fields built from this catalog don't split any cell
+                            smaller than this, so the objects in it are merged into a single
+                            point at their weighted centroid with their total weight.  This is
+                            mostly useful for randoms, which are often much denser than needed
+                            for the smallest separations.  Each pair separation is then off by
+                            at most 2*merge_size, so a small fraction of min_sep (e.g. 0.05)
+                            keeps the bias small, while it greatly reduces the number of leaves
+                            in the trees and hence the time for every correlation using them.
+                            This applies even with bin_slop=0 or brute=True.  (default: 0)
+        merge_size_units (str): The units of merge_size, if the positions are angles.
+                            (default: radians)
+        patch_field (bool): Whether to compute correlation functions using patches with a single
+                            field for the whole catalog, whose top-level cells are grouped by
+                            patch, rather than making a separate catalog and field for each patch.
+                            This avoids copying the data for each patch and, with low_mem,
+                            building the fields of the patches again for each pair.  However, it
+                            needs the whole catalog in memory, and the fields of this catalog are
+                            not cached in field_cache_dir. (default: False)
+        field_cache_dir (str): A directory in which to save the trees of the fields built from
+                            this catalog.  If a field with the same parameters has already been
+                            built for a catalog with the same values (in this or a previous
+                            session), it is read from this directory rather than being built
+                            again. (default: None)
+        field_chunk_size (int): If > 0, and the catalog is read from a file but not yet loaded,
+                            build its fields by reading this many rows at a time and adding
+                            them to the tree, rather than loading the whole catalog first.
+                            This lowers the peak memory, since the full catalog is never in
+                            memory along with the tree.  The catalog itself is only loaded if
+                            its values are needed for something else (e.g. the shear variance
+                            for GG).  This is not used for catalogs with patches, and such fields
+                            are not cached in field_cache_dir. (default: 0)
+        reuse_fields (bool): Whether a cached field with a smaller min_size than is needed
+                            (i.e. a finer tree), but otherwise the same parameters, can be used
+                            rather than building a new one.  E.g. after processing a catalog with
+                            some min_sep, processing it again with a larger min_sep uses the
+                            same field.  The two-point correlations treat the cells smaller than
+                            the min_size they need as leaves, so the results are the same as
+                            with a new field.  A field with a smaller max_size (so more top-level
+                            cells) can also be used, in which case the results may differ
+                            slightly, within the accuracy allowed by bin_slop, as they do for
+                            different numbers of threads.  Three-point correlations traverse the
+                            finer tree all the way down, which is slower, but at least as
+                            accurate. This is not done with split_method='random'.
+                            (default: False)
+        use_mmap (bool):    Whether to read the columns of uncompressed FITS binary tables and
+                            contiguous HDF5 datasets as read-only views of a memory map of the
+                            file, rather than reading them into new arrays.  Columns that are
+                            already native float64 and contiguous (typical for HDF5, but not
+                            FITS, whose columns are stored big-endian row by row) are then used
+                            directly, so with zero_copy the fields are built straight from the
+                            file's pages, which several processes can share.  Such columns are
+                            only copied if they need to be modified (e.g. for units other than
+                            radians or to set NaNs to 0). (default: False)
+        lazy_values (bool): Whether to wait to read the g1, g2 and k columns of a catalog read
+                            from a file until they are first needed, e.g. by `getGField` for
+                            g1 and g2, rather than reading them along with the positions and
+                            weights.  This saves the I/O and memory for these columns when
+                            the catalog is only used for count correlations.  If the columns
+                            have NaNs, the weights of those objects are set to 0 when they are
+                            read, which also clears any fields already built, but the objects
+                            are not removed from the catalog. (default: False)
+
         cat_precision (int): The precision to use when writing a Catalog to an ASCII file. This
                             should be an integer, which specifies how many digits to write.
                             (default: 16)
@@ -480,6 +573,8 @@ class Catalog(object):
                 'Which initialization method to use for kmeans when making patches'),
         'kmeans_alt' : (bool, False, False, None,
                 'Whether to use the alternate kmeans algorithm when making patches'),
+        'kmeans_cache_dir' : (str, False, None, None,
+                'A directory in which to cache the kmeans patches between runs.'),
         'patch_centers' : (str, False, None, None,
                 'File with patch centers to use to determine patches'),
         'save_patch_dir' : (str, False, None, None,
@@ -492,6 +587,32 @@ class Catalog(object):
                 'The default is to write the output to stdout.'),
         'split_method' : (str, False, 'mean', ['mean', 'median', 'middle', 'random'],
                 'Which method to use for splitting cells.'),
+        'use_arena' : (bool, False, False, None,
+                'Whether to allocate the field trees in a few large contiguous blocks.'),
+        'use_packed' : (bool, False, False, None,
+                'Whether to make a packed copy of the field trees for faster traversal.'),
+        'zero_copy' : (bool, False, False, None,
+                'Whether to build the field trees directly from the catalog arrays.'),
+        'reorder_tree' : (bool, False, False, None,
+                'Whether to store each subtree of the field trees contiguously in memory.'),
+        'bucket_size' : (int, False, 0, None,
+                'The maximum number of objects in the bucket leaves of the field trees.'),
+        'merge_size' : (float, False, 0., None,
+                'The size of cells whose objects are merged into single weighted points.'),
+        'merge_size_units' : (str, False, None, coord.AngleUnit.valid_names,
+                'The units of merge_size, if the positions are angles.'),
+        'patch_field' : (bool, False, False, None,
+                'Whether to use one field with the top-level cells grouped by patch.'),
+        'field_cache_dir' : (str, False, None, None,
+                'A directory in which to cache the built field trees between runs.'),
+        'field_chunk_size' : (int, False, 0, None,
+                'The number of rows to read at a time when building fields from a file.'),
+        'reuse_fields' : (bool, False, False, None,
+                'Whether to use a cached field with a finer tree rather than building a new one.'),
+        'use_mmap' : (bool, False, False, None,
+                'Whether to use memory-mapped views of the columns of FITS and HDF5 files.'),
+        'lazy_values' : (bool, False, False, None,
+                'Whether to wait to read the g1, g2, k columns until they are needed.'),
         'cat_precision' : (int, False, 16, None,
                 'The number of digits after the decimal in the output.'),
     }
@@ -546,6 +667,10 @@ class Catalog(object):
         self._k = None
         self._patch = None
         self._field = lambda : None
+        self._lazy_cols = set()
+        self._lazy_rows = None
+        self._radec_units_pending = False
+        self._is_chunk = False
 
         self._nontrivial_w = None
         self._single_patch = None
@@ -622,11 +747,12 @@ class Catalog(object):
             # Figure out which file type the catalog is
             file_type = get_from_list(self.config,'file_type',num)
             file_type = parse_file_type(file_type, file_name, output=False, logger=self.logger)
+            use_mmap = get(self.config,'use_mmap',bool,False)
             if file_type == 'FITS':
-                self.reader = FitsReader(file_name)
+                self.reader = FitsReader(file_name, use_mmap=use_mmap)
                 self._check_file(file_name, self.reader, num, is_rand)
             elif file_type == 'HDF':
-                self.reader = HdfReader(file_name)
+                self.reader = HdfReader(file_name, use_mmap=use_mmap)
                 self._check_file(file_name, self.reader, num, is_rand)
             elif file_type == 'PARQUET':
                 self.reader = ParquetReader(file_name)
@@ -787,16 +913,19 @@ class Catalog(object):
     @property
     def g1(self):
         self.load()
+        self._load_lazy(['g1','g2'])
         return self._g1
 
     @property
     def g2(self):
         self.load()
+        self._load_lazy(['g1','g2'])
         return self._g2
 
     @property
     def k(self):
         self.load()
+        self._load_lazy(['k'])
         return self._k
 
     @property
@@ -895,6 +1024,15 @@ class Catalog(object):
 
     @property
     def coords(self):
+        if self._field_chunk_size:
+            # Get this from the column names, so the fields can be built without loading.
+            ra_col = get_from_list(self.config,'ra_col',self._num,str,'0')
+            r_col = get_from_list(self.config,'r_col',self._num,str,'0')
+            z_col = get_from_list(self.config,'z_col',self._num,str,'0')
+            if ra_col != '0':
+                return 'spherical' if r_col == '0' else '3d'
+            else:
+                return 'flat' if z_col == '0' else '3d'
         if self.ra is not None:
             if self.r is None:
                 return 'spherical'
@@ -919,16 +1057,72 @@ class Catalog(object):
             self._cen_s = (mx, my, mz, s)
         return self._cen_s
 
+    @property
+    def _field_chunk_size(self):
+        # The number of rows to read at a time when building fields directly from the file,
+        # or 0 if the fields should be built from the loaded catalog as usual.
+        chunk_size = get(self.config,'field_chunk_size',int,0)
+        if (chunk_size > 0 and self.file_type is not None and not self.loaded and
+                self._npatch == 1 and self._centers is None and self._single_patch is None):
+            return chunk_size
+        else:
+            return 0
+
+    def _read_chunks(self):
+        # Yield Catalogs for consecutive chunks of the rows of this Catalog's file.
+        # Along the way, accumulate the total weight and number of objects, so the Catalog
+        # doesn't need to be loaded just for these.
+        chunk_size = self._field_chunk_size
+        end = self.end
+        if end is None:
+            x_col = get_from_list(self.config,'x_col',self._num,str,'0')
+            with self.reader:
+                ext = get_from_list(self.config, 'ext', self._num, str, self.reader.default_ext)
+                if x_col != '0':
+                    col = x_col
+                    ext = get_from_list(self.config, 'x_ext', self._num, str, ext)
+                else:
+                    col = get_from_list(self.config,'ra_col',self._num,str,'0')
+                    ext = get_from_list(self.config, 'ra_ext', self._num, str, ext)
+                end = self.reader.row_count(col, ext)
+        sumw = 0.
+        nobj = 0
+        nontrivial_w = False
+        start = self.start
+        while start < end:
+            last_row = min(start + (chunk_size-1) * self.every_nth + 1, end)
+            config = self.config.copy()
+            config.update(first_row=start+1, last_row=last_row, every_nth=self.every_nth,
+                          field_chunk_size=0)
+            chunk = Catalog(self.file_name, config, num=self._num, is_rand=self._is_rand,
+                            logger=self.logger)
+            # A chunk may have no weight, even if the whole catalog does.
+            chunk._is_chunk = True
+            # Share the reader, so an ASCII file is read on from where the last chunk started
+            # rather than from the start of the file each time.
+            chunk.reader = self.reader
+            chunk.load()
+            sumw += chunk.sumw
+            nobj += chunk.nobj
+            nontrivial_w = nontrivial_w or chunk.nontrivial_w
+            yield chunk
+            start += chunk_size * self.every_nth
+        if sumw == 0:
+            raise ValueError("Catalog has invalid sumw == 0")
+        self._sumw = sumw
+        self._nobj = nobj
+        self._nontrivial_w = nontrivial_w
+
     def _finish_input(self):
         # Finish processing the data based on given inputs.
 
         # Apply flips if requested
         flip_g1 = get_from_list(self.config,'flip_g1',self._num,bool,False)
         flip_g2 = get_from_list(self.config,'flip_g2',self._num,bool,False)
-        if flip_g1:
+        if flip_g1 and 'g1' not in self._lazy_cols:
             self.logger.info("   Flipping sign of g1.")
             self._g1 = -self._g1
-        if flip_g2:
+        if flip_g2 and 'g2' not in self._lazy_cols:
             self.logger.info("   Flipping sign of g2.")
             self._g2 = -self._g2
 
@@ -942,23 +1136,25 @@ class Catalog(object):
             # If we don't already have a weight column, make one with all values = 1.
             if self._w is None:
                 self._w = np.ones_like(self._flag, dtype=float)
+            self._w = self._writeable(self._w)
             self._w[(self._flag & ignore_flag)!=0] = 0
             if self._wpos is not None:
+                self._wpos = self._writeable(self._wpos)
                 self._wpos[(self._flag & ignore_flag)!=0] = 0
             self.logger.debug('Applied flag')
 
         # Check for NaN's:
-        self.checkForNaN(self._x,'x')
-        self.checkForNaN(self._y,'y')
-        self.checkForNaN(self._z,'z')
-        self.checkForNaN(self._ra,'ra')
-        self.checkForNaN(self._dec,'dec')
-        self.checkForNaN(self._r,'r')
-        self.checkForNaN(self._g1,'g1')
-        self.checkForNaN(self._g2,'g2')
-        self.checkForNaN(self._k,'k')
-        self.checkForNaN(self._w,'w')
-        self.checkForNaN(self._wpos,'wpos')
+        self._x = self.checkForNaN(self._x,'x')
+        self._y = self.checkForNaN(self._y,'y')
+        self._z = self.checkForNaN(self._z,'z')
+        self._ra = self.checkForNaN(self._ra,'ra')
+        self._dec = self.checkForNaN(self._dec,'dec')
+        self._r = self.checkForNaN(self._r,'r')
+        self._g1 = self.checkForNaN(self._g1,'g1')
+        self._g2 = self.checkForNaN(self._g2,'g2')
+        self._k = self.checkForNaN(self._k,'k')
+        self._w = self.checkForNaN(self._w,'w')
+        self._wpos = self.checkForNaN(self._wpos,'wpos')
 
         # If using ra/dec, generate x,y,z
         # Note: This also makes self.ntot work properly.
@@ -978,12 +1174,13 @@ class Catalog(object):
                     if np.any(self._w[self._wpos == 0.] != 0.):
                         self.logger.error('Some wpos values = 0 but have w!=0. This is invalid.\n'
                                           'Setting w=0 for these points.')
+                    self._w = self._writeable(self._w)
                 self._w[self._wpos == 0.] = 0.
 
         if self._w is not None:
             self._nontrivial_w = True
             self._sumw = np.sum(self._w)
-            if self._sumw == 0:
+            if self._sumw == 0 and not self._is_chunk:
                 raise ValueError("Catalog has invalid sumw == 0")
         else:
             self._nontrivial_w = False
@@ -999,6 +1196,7 @@ class Catalog(object):
 
         if self._single_patch is not None or self._patch is not None:
             # Easier to get these options out of the way first.
+            # (This includes the case where _generate_xyz already assigned the patches.)
             pass
         elif self._centers is not None:
             if ((self.coords == 'flat' and self._centers.shape[1] != 2) or
@@ -1007,20 +1205,89 @@ class Catalog(object):
             self._assign_patches()
             self.logger.info("Assigned patch numbers according %d centers",self._npatch)
         elif self._npatch is not None and self._npatch != 1:
-            init = get(self.config,'kmeans_init',str,'tree')
-            alt = get(self.config,'kmeans_alt',bool,False)
-            max_top = int.bit_length(self._npatch)-1
-            c = 'spherical' if self._ra is not None else self.coords
-            field = self.getNField(max_top=max_top, coords=c)
-            self.logger.info("Finding %d patches using kmeans.",self._npatch)
-            self._patch, self._centers = field.run_kmeans(self._npatch, init=init, alt=alt)
-            # Clear the cached NField, since we will almost certainly not want this
-            # particular one again, even if doing N-based correlations (since max_top, etc.
-            # is almost certainly going to be different).
-            self.nfields.clear()
+            self._run_kmeans()
 
         self.logger.info("   nobj = %d",self.nobj)
 
+    def _run_kmeans(self):
+        init = get(self.config,'kmeans_init',str,'tree')
+        alt = get(self.config,'kmeans_alt',bool,False)
+        max_iter = 200
+        tol = 1.e-5
+        max_top = int.bit_length(self._npatch)-1
+        c = 'spherical' if self._ra is not None else self.coords
+        cache_dir = get(self.config,'kmeans_cache_dir',str,None)
+        if cache_dir:
+            file_name = self._kmeans_cache_file_name(cache_dir, c, max_top, init, alt,
+                                                     max_iter, tol)
+            if self._read_kmeans_cache(file_name):
+                # Advance the rng as building the field would have, so later random numbers
+                # don't depend on whether the cache was used.
+                if self._rng is not None:
+                    self._rng.random_sample()
+                return
+        field = self.getNField(max_top=max_top, coords=c)
+        self.logger.info("Finding %d patches using kmeans.",self._npatch)
+        self._patch, self._centers = field.run_kmeans(self._npatch, init=init, alt=alt,
+                                                      max_iter=max_iter, tol=tol)
+        # Clear the cached NField, since we will almost certainly not want this
+        # particular one again, even if doing N-based correlations (since max_top, etc.
+        # is almost certainly going to be different).
+        self.nfields.clear()
+        if cache_dir:
+            self._write_kmeans_cache(file_name)
+
+    def _kmeans_cache_file_name(self, cache_dir, coords, max_top, init, alt, max_iter, tol):
+        # The file name is a hash of everything that goes into the k-means result: the kmeans
+        # parameters, the parameters of the field it runs on, and the positions and weights.
+        h = hashlib.sha1()
+        h.update(repr(('kmeans', self._npatch, coords, max_top, init, alt, max_iter, tol,
+                       get(self.config,'split_method',str,'mean'),
+                       get(self.config,'bucket_size',int,0))).encode())
+        if self._rng is not None:
+            # The random state plays the role of the seed.
+            state = self._rng.get_state()
+            h.update(repr((state[0],) + tuple(state[2:])).encode())
+            h.update(np.ascontiguousarray(state[1]).data)
+        for col in [self._x, self._y, self._z, self._w, self._wpos]:
+            if col is None:
+                h.update(b'None')
+            else:
+                h.update(np.ascontiguousarray(col).data)
+        return os.path.join(cache_dir, 'kmeans_%s.npz'%h.hexdigest())
+
+    def _read_kmeans_cache(self, file_name):
+        # Read the centers and patches from file_name if it is a valid cache file for this
+        # catalog.  Returns whether this worked.
+        if not os.path.isfile(file_name):
+            return False
+        try:
+            with np.load(file_name) as data:
+                centers = data['centers']
+                patch = data['patch'].astype(int)
+        except Exception:
+            centers = patch = None
+        if (centers is None or len(patch) != self.ntot or len(centers) != self._npatch or
+                np.any(patch >= self._npatch)):
+            self.logger.warning('Invalid kmeans cache file %s.  Running kmeans.',file_name)
+            return False
+        self._centers = centers
+        self._patch = patch
+        self.logger.info('Read %d patch centers and patches from cache file %s',
+                         self._npatch,file_name)
+        return True
+
+    def _write_kmeans_cache(self, file_name):
+        # Store the patch numbers in the smallest unsigned type that holds them.
+        patch = self._patch.astype(np.min_scalar_type(self._npatch-1))
+        # Write to a temporary file and then rename it, so another process reading the
+        # same cache never sees a partially written file.
+        os.makedirs(os.path.dirname(file_name), exist_ok=True)
+        tmp_name = file_name + '.%d.tmp.npz'%os.getpid()
+        np.savez(tmp_name, centers=self._centers, patch=patch)
+        os.replace(tmp_name, file_name)
+        self.logger.info('Wrote patch centers and patches to cache file %s',file_name)
+
     def _assign_patches(self):
         # This is equivalent to the following:
         #   field = self.getNField()
@@ -1068,16 +1335,22 @@ class Catalog(object):
     def _apply_radec_units(self):
         self.ra_units = get_from_list(self.config,'ra_units',self._num)
         self.dec_units = get_from_list(self.config,'dec_units',self._num)
-        self._ra *= self.ra_units
-        self._dec *= self.dec_units
+        # The conversion to radians is done in _generate_xyz, in the same pass as making x,y,z.
+        self._radec_units_pending = True
 
     def _apply_xyz_units(self):
         self.x_units = get_from_list(self.config,'x_units',self._num,str, 'radians')
         self.y_units = get_from_list(self.config,'y_units',self._num,str, 'radians')
-        self._x *= self.x_units
-        self._y *= self.y_units
+        if self.x_units != 1.:
+            self._x = self._writeable(self._x)
+            self._x *= self.x_units
+        if self.y_units != 1.:
+            self._y = self._writeable(self._y)
+            self._y *= self.y_units
 
     def _generate_xyz(self):
+        from .util import double_ptr as dp
+        from .util import long_ptr as lp
         if self._x is None:
             assert self._y is None
             assert self._z is None
@@ -1087,11 +1360,36 @@ class Catalog(object):
             self._x = np.empty(ntot, dtype=float)
             self._y = np.empty(ntot, dtype=float)
             self._z = np.empty(ntot, dtype=float)
-            from .util import double_ptr as dp
+            ra_units = dec_units = 1.
+            if self._radec_units_pending:
+                ra_units = self.ra_units
+                dec_units = self.dec_units
+                self._radec_units_pending = False
+                # The conversion is done in place.
+                if ra_units != 1.:
+                    self._ra = self._writeable(self._ra)
+                if dec_units != 1.:
+                    self._dec = self._writeable(self._dec)
+            # If we will need to assign patches from the given centers, do that at the same
+            # time, while each block of x,y,z values is still in cache.
+            centers = None
+            if (self._centers is not None and self._patch is None and
+                    self._single_patch is None and self._centers.shape[1] == 3):
+                centers = np.ascontiguousarray(self._centers)
+                self._patch = np.empty(ntot, dtype=int)
             set_omp_threads(self.config.get('num_threads',None))
-            _lib.GenerateXYZ(dp(self._x), dp(self._y), dp(self._z),
-                             dp(self._ra), dp(self._dec), dp(self._r), ntot)
+            _lib.GenerateXYZPatches(dp(self._x), dp(self._y), dp(self._z),
+                                    dp(self._ra), dp(self._dec), dp(self._r), ntot,
+                                    ra_units, dec_units,
+                                    dp(centers), self._npatch or 0, lp(self._patch))
             self.x_units = self.y_units = 1.
+            if centers is not None:
+                self.logger.info("Assigned patch numbers according %d centers",self._npatch)
+        elif self._radec_units_pending:
+            # Both x,y,z and ra,dec were given, so just convert ra,dec.
+            self._ra = self._ra * self.ra_units
+            self._dec = self._dec * self.dec_units
+            self._radec_units_pending = False
 
     def _select_patch(self, single_patch):
         # Trim the catalog to only include a single patch
@@ -1122,6 +1420,10 @@ class Catalog(object):
         self._g2 = self._g2[indx] if self._g2 is not None else None
         self._k = self._k[indx] if self._k is not None else None
         self._patch = self._patch[indx] if self._patch is not None else None
+        if self._lazy_cols:
+            # Keep track of the rows to use from the columns that haven't been read yet.
+            s, sel = self._lazy_rows
+            self._lazy_rows = (s, indx if sel is None else sel[indx])
 
     def makeArray(self, col, col_str, dtype=float):
         """Turn the input column into a numpy array if it wasn't already.
@@ -1151,6 +1453,10 @@ class Catalog(object):
         Parameters:
             col (array):    The input column to check.
             col_str (str):  The name of the column.  Used only as information in logging output.
+
+        Returns:
+            The column with any NaNs set to 0.  This is the same array as col unless col is
+            read-only (e.g. a memory-mapped view of the file), in which case it is a copy.
         """
         if col is not None and np.any(np.isnan(col)):
             index = np.where(np.isnan(col))[0]
@@ -1163,8 +1469,24 @@ class Catalog(object):
                                  str(index[:10].tolist()).replace(']',' ...]'))
             if self._w is None:
                 self._w = np.ones_like(col, dtype=float)
+            self._w = self._writeable(self._w)
             self._w[index] = 0
+            col = self._writeable(col)
             col[index] = 0  # Don't leave the nans there.
+        return col
+
+    def _as_float(self, col):
+        # Convert a column read from a file to float64.  Memory-mapped columns that are already
+        # native float64 and contiguous are kept as they are, so they aren't read into memory.
+        if (isinstance(col, np.memmap) and col.dtype == float and
+                col.flags.c_contiguous):
+            return col
+        return col.astype(float)
+
+    @staticmethod
+    def _writeable(col):
+        # Make a copy of a read-only column that is about to be modified in place.
+        return col if col.flags.writeable else col.copy()
 
     def _check_file(self, file_name, reader, num=0, is_rand=False):
         # Just check the consistency of the various column numbers so we can fail fast.
@@ -1313,21 +1635,21 @@ class Catalog(object):
         # Helper functions for things we might do in one of two places.
         def set_pos(data, x_col, y_col, z_col, ra_col, dec_col, r_col):
             if x_col != '0' and x_col in data:
-                self._x = data[x_col].astype(float)
+                self._x = self._as_float(data[x_col])
                 self.logger.debug('read x')
-                self._y = data[y_col].astype(float)
+                self._y = self._as_float(data[y_col])
                 self.logger.debug('read y')
                 if z_col != '0':
-                    self._z = data[z_col].astype(float)
+                    self._z = self._as_float(data[z_col])
                     self.logger.debug('read z')
                 self._apply_xyz_units()
             if ra_col != '0' and ra_col in data:
-                self._ra = data[ra_col].astype(float)
+                self._ra = self._as_float(data[ra_col])
                 self.logger.debug('read ra')
-                self._dec = data[dec_col].astype(float)
+                self._dec = self._as_float(data[dec_col])
                 self.logger.debug('read dec')
                 if r_col != '0':
-                    self._r = data[r_col].astype(float)
+                    self._r = self._as_float(data[r_col])
                     self.logger.debug('read r')
                 self._apply_radec_units()
 
@@ -1449,6 +1771,17 @@ class Catalog(object):
                 if len(all_cols) == 0 or (isinstance(s,np.ndarray) and len(s) == 0):
                     return
 
+            # With lazy_values, leave g1, g2, k to be read by _load_lazy when they are needed.
+            if get(self.config,'lazy_values',bool,False) and not is_rand:
+                if g1_col in reader.names(g1_ext):
+                    self._lazy_cols.update(['g1','g2'])
+                if k_col in reader.names(k_ext):
+                    self._lazy_cols.add('k')
+                lazy_cols = [get_from_list(self.config,name+'_col',num,str,'0')
+                             for name in self._lazy_cols]
+                all_cols = [c for c in all_cols if c not in lazy_cols]
+                self._lazy_rows = (s, None)
+
             # Now read the rest using the updated s
             for ext in all_exts:
                 use_cols1 = [c for c in all_cols
@@ -1467,12 +1800,12 @@ class Catalog(object):
 
             # Set w
             if w_col != '0':
-                self._w = data[w_col].astype(float)
+                self._w = self._as_float(data[w_col])
                 self.logger.debug('read w')
 
             # Set wpos
             if wpos_col != '0':
-                self._wpos = data[wpos_col].astype(float)
+                self._wpos = self._as_float(data[wpos_col])
                 self.logger.debug('read wpos')
 
             # Set flag
@@ -1483,17 +1816,58 @@ class Catalog(object):
             # Skip g1,g2,k if this file is a random catalog
             if not is_rand:
                 # Set g1,g2
-                if g1_col in reader.names(g1_ext):
-                    self._g1 = data[g1_col].astype(float)
+                if g1_col in reader.names(g1_ext) and 'g1' not in self._lazy_cols:
+                    self._g1 = self._as_float(data[g1_col])
                     self.logger.debug('read g1')
-                    self._g2 = data[g2_col].astype(float)
+                    self._g2 = self._as_float(data[g2_col])
                     self.logger.debug('read g2')
 
                 # Set k
-                if k_col in reader.names(k_ext):
-                    self._k = data[k_col].astype(float)
+                if k_col in reader.names(k_ext) and 'k' not in self._lazy_cols:
+                    self._k = self._as_float(data[k_col])
                     self.logger.debug('read k')
 
+    def _load_lazy(self, names):
+        # Read the given columns if they were left unread with the lazy_values option, using
+        # the same rows as the rest of the catalog.
+        names = [name for name in names if name in self._lazy_cols]
+        if len(names) == 0:
+            return
+        self.logger.info("Reading %s from input file %s",', '.join(names),self.name)
+        num = self._num
+        s, sel = self._lazy_rows
+        reader = self.reader
+        with reader:
+            ext = get_from_list(self.config, 'ext', num, str, reader.default_ext)
+            cols = [get_from_list(self.config,name+'_col',num,str,'0') for name in names]
+            exts = [get_from_list(self.config,name+'_ext',num,str,ext) for name in names]
+            data = {}
+            for ext in set(exts):
+                use_cols1 = [c for c, e in zip(cols, exts) if e == ext]
+                data1 = reader.read(use_cols1, s, ext)
+                for c in use_cols1:
+                    data[c] = data1[c]
+
+        any_nan = False
+        for name, col in zip(names, cols):
+            value = self._as_float(data[col])
+            if sel is not None:
+                value = value[sel]
+            if get_from_list(self.config,'flip_'+name,num,bool,False):
+                self.logger.info("   Flipping sign of %s.",name)
+                value = -value
+            any_nan = any_nan or np.any(np.isnan(value))
+            setattr(self, '_'+name, self.checkForNaN(value, name))
+            self.logger.debug('read %s',name)
+            self._lazy_cols.remove(name)
+
+        if any_nan:
+            # Then checkForNaN set some weights to 0, so update the things that depend on them.
+            self._nontrivial_w = True
+            self._sumw = np.sum(self._w)
+            self._nobj = self._sumw2 = self._varg = self._vark = None
+            self.clear_cache()
+
     @property
     def nfields(self):
         if not hasattr(self, '_nfields'):
@@ -1501,11 +1875,15 @@ class Catalog(object):
             # Note: LRU_Cache keys on the args, not kwargs, so everything but logger should
             # be in args for this function.  We convert them to kwargs for the NFields init call.
             def get_nfield(min_size, max_size, split_method, brute, min_top, max_top, coords,
-                           rng, logger=None):
+                           use_arena, use_packed, zero_copy, reorder_tree, bucket_size,
+                           patch_field, cache_dir, rng, logger=None):
                 return NField(self, min_size=min_size, max_size=max_size,
                               split_method=split_method, brute=brute,
                               min_top=min_top, max_top=max_top, coords=coords,
-                              rng=rng, logger=logger)
+                              use_arena=use_arena, use_packed=use_packed, zero_copy=zero_copy,
+                              reorder_tree=reorder_tree, bucket_size=bucket_size,
+                              patch_field=patch_field, cache_dir=cache_dir, rng=rng,
+                              logger=logger)
             # Now wrap these in LRU_Caches with (initially) just 1 element being cached.
             self._nfields = LRU_Cache(get_nfield, 1)
         return self._nfields
@@ -1514,11 +1892,15 @@ class Catalog(object):
     def kfields(self):
         if not hasattr(self, '_kfields'):
             def get_kfield(min_size, max_size, split_method, brute, min_top, max_top, coords,
-                           rng, logger=None):
+                           use_arena, use_packed, zero_copy, reorder_tree, bucket_size,
+                           patch_field, cache_dir, rng, logger=None):
                 return KField(self, min_size=min_size, max_size=max_size,
                               split_method=split_method, brute=brute,
                               min_top=min_top, max_top=max_top, coords=coords,
-                              rng=rng, logger=logger)
+                              use_arena=use_arena, use_packed=use_packed, zero_copy=zero_copy,
+                              reorder_tree=reorder_tree, bucket_size=bucket_size,
+                              patch_field=patch_field, cache_dir=cache_dir, rng=rng,
+                              logger=logger)
             self._kfields = LRU_Cache(get_kfield, 1)
         return self._kfields
 
@@ -1526,11 +1908,15 @@ class Catalog(object):
     def gfields(self):
         if not hasattr(self, '_gfields'):
             def get_gfield(min_size, max_size, split_method, brute, min_top, max_top, coords,
-                           rng, logger=None):
+                           use_arena, use_packed, zero_copy, reorder_tree, bucket_size,
+                           patch_field, cache_dir, rng, logger=None):
                 return GField(self, min_size=min_size, max_size=max_size,
                               split_method=split_method, brute=brute,
                               min_top=min_top, max_top=max_top, coords=coords,
-                              rng=rng, logger=logger)
+                              use_arena=use_arena, use_packed=use_packed, zero_copy=zero_copy,
+                              reorder_tree=reorder_tree, bucket_size=bucket_size,
+                              patch_field=patch_field, cache_dir=cache_dir, rng=rng,
+                              logger=logger)
             self._gfields = LRU_Cache(get_gfield, 1)
         return self._gfields
 
@@ -1656,6 +2042,32 @@ class Catalog(object):
         # But if the weakref is alive, this returns the field we want.
         return self._field()
 
+    def _merge_min_size(self, min_size):
+        # With merge_size, cells smaller than merge_size aren't split, so their objects act
+        # as a single point.
+        merge_size = get(self.config,'merge_size',float,0.)
+        if merge_size > 0:
+            merge_size *= get(self.config,'merge_size_units',str,'radians')
+            min_size = max(min_size, merge_size)
+        return min_size
+
+    def _field_key(self, cache, min_size, max_size, split_method, brute, *args):
+        # The arguments for the field to get from the cache.  With reuse_fields, this may be
+        # a cached field with a finer tree than the one requested.
+        merged = self._merge_min_size(min_size)
+        key = (merged, max_size, split_method, brute) + args
+        # If merge_size made the requested tree coarser, the correlations wouldn't know to
+        # treat the cells below merge_size as leaves, so only reuse fields without that.
+        if (get(self.config,'reuse_fields',bool,False) and merged == min_size and not brute
+                and split_method != 'random'):
+            big = lambda size: np.inf if size is None else size
+            finer = [k for k in cache.keys()
+                     if k[0] <= min_size and big(k[1]) <= big(max_size) and k[2:] == key[2:]]
+            if len(finer) > 0 and key not in finer:
+                # Use the coarsest one, which is the fastest to traverse.
+                key = max(finer, key=lambda k: (k[0], big(k[1])))
+        return key
+
     @depr_pos_kwargs
     def getNField(self, *, min_size=0, max_size=None, split_method=None, brute=False,
                   min_top=None, max_top=10, coords=None, logger=None):
@@ -1685,8 +2097,17 @@ class Catalog(object):
             split_method = get(self.config,'split_method',str,'mean')
         if logger is None:
             logger = self.logger
-        field = self.nfields(min_size, max_size, split_method, brute, min_top, max_top, coords,
-                             rng=self._rng, logger=logger)
+        use_arena = get(self.config,'use_arena',bool,False)
+        use_packed = get(self.config,'use_packed',bool,False)
+        zero_copy = get(self.config,'zero_copy',bool,False)
+        reorder_tree = get(self.config,'reorder_tree',bool,False)
+        bucket_size = get(self.config,'bucket_size',int,0)
+        patch_field = get(self.config,'patch_field',bool,False)
+        cache_dir = get(self.config,'field_cache_dir',str,None)
+        key = self._field_key(self.nfields, min_size, max_size, split_method, brute, min_top,
+                              max_top, coords, use_arena, use_packed, zero_copy, reorder_tree,
+                              bucket_size, patch_field, cache_dir)
+        field = self.nfields(*key, rng=self._rng, logger=logger)
         self._field = weakref.ref(field)
         return field
 
@@ -1722,8 +2143,17 @@ class Catalog(object):
             raise TypeError("k is not defined.")
         if logger is None:
             logger = self.logger
-        field = self.kfields(min_size, max_size, split_method, brute, min_top, max_top, coords,
-                             rng=self._rng, logger=logger)
+        use_arena = get(self.config,'use_arena',bool,False)
+        use_packed = get(self.config,'use_packed',bool,False)
+        zero_copy = get(self.config,'zero_copy',bool,False)
+        reorder_tree = get(self.config,'reorder_tree',bool,False)
+        bucket_size = get(self.config,'bucket_size',int,0)
+        patch_field = get(self.config,'patch_field',bool,False)
+        cache_dir = get(self.config,'field_cache_dir',str,None)
+        key = self._field_key(self.kfields, min_size, max_size, split_method, brute, min_top,
+                              max_top, coords, use_arena, use_packed, zero_copy, reorder_tree,
+                              bucket_size, patch_field, cache_dir)
+        field = self.kfields(*key, rng=self._rng, logger=logger)
         self._field = weakref.ref(field)
         return field
 
@@ -1759,8 +2189,17 @@ class Catalog(object):
             raise TypeError("g1,g2 are not defined.")
         if logger is None:
             logger = self.logger
-        field = self.gfields(min_size, max_size, split_method, brute, min_top, max_top, coords,
-                             rng=self._rng, logger=logger)
+        use_arena = get(self.config,'use_arena',bool,False)
+        use_packed = get(self.config,'use_packed',bool,False)
+        zero_copy = get(self.config,'zero_copy',bool,False)
+        reorder_tree = get(self.config,'reorder_tree',bool,False)
+        bucket_size = get(self.config,'bucket_size',int,0)
+        patch_field = get(self.config,'patch_field',bool,False)
+        cache_dir = get(self.config,'field_cache_dir',str,None)
+        key = self._field_key(self.gfields, min_size, max_size, split_method, brute, min_top,
+                              max_top, coords, use_arena, use_packed, zero_copy, reorder_tree,
+                              bucket_size, patch_field, cache_dir)
+        field = self.gfields(*key, rng=self._rng, logger=logger)
         self._field = weakref.ref(field)
         return field
 
@@ -1934,6 +2373,7 @@ class Catalog(object):
         else:
             return np.column_stack((data['x'],data['y']))
 
+    @trace_span('Catalog.load')
     def load(self):
         """Load the data from a file, if it isn't yet loaded.
 
@@ -1977,6 +2417,8 @@ class Catalog(object):
             self._g2 = None
             self._k = None
             self._patch = None
+            self._lazy_cols = set()
+            self._lazy_rows = None
             if self._patches is not None:
                 for p in self._patches:
                     p.unload()
@@ -2458,6 +2900,71 @@ def calculateVarK(cat_list, *, low_mem=False):
         vark = (vark - meank * sumw2 * (2*meank2 - meank)) / sumw
         return vark
 
+def calculatePatchCenters(cat_list, npatch, *, num_passes=1, init='tree', max_iter=200,
+                          tol=1.e-5, alt=False, rng=None, low_mem=True):
+    """Calculate patch centers for a catalog that is too large to build a single field.
+
+    The normal way to make patches is to set ``npatch`` when making the `Catalog`, which runs
+    k-means on a field built from the whole catalog.  For very large catalogs (e.g. randoms),
+    this may need more memory than is available.  Instead, this function runs a mini-batch
+    version of k-means, which only needs a field for one chunk of the catalog at a time.
+    The chunks are given as a list of catalogs, for instance using ``first_row`` and
+    ``last_row`` to read different parts of the same file.
+
+    The initial centers are found by running the full k-means algorithm on the first catalog
+    in the list.  Then each catalog in turn is used to update the centers with
+    `Field.kmeans_update_batch`.  The resulting centers
+    can be used as ``patch_centers`` for the full catalog (or any of the chunks).
+
+    The catalogs should not have ``npatch`` or ``patch_centers`` set themselves.  For best
+    results, each one should be a fair sample of the whole area, with many more objects than
+    ``npatch``.
+
+    Parameters:
+        cat_list:       A Catalog or a list of Catalogs to use.
+        npatch (int):   How many patches to make.
+        num_passes (int): How many times to go through the list of catalogs. (default: 1)
+        init (str):     Initialization method to use on the first catalog.
+                        cf. `Field.run_kmeans` (default: 'tree')
+        max_iter (int): How many iterations at most to run on the first catalog.
+                        (default: 200)
+        tol (float):    Tolerance in the rms centroid shift to consider as converged on
+                        the first catalog. (default: 1.e-5)
+        alt (bool):     Whether to use the alternate kmeans algorithm.
+                        cf. `Field.run_kmeans` (default: False)
+        rng (RandomState): If desired, a numpy.random.RandomState instance to use for random
+                        number generation. (default: None)
+        low_mem (bool): Whether to unload each catalog after using it, so only one of them
+                        needs to be in memory at a time. (default: True)
+
+    Returns:
+        An array of center coordinates.
+        Shape is (npatch, 2) for flat geometries or (npatch, 3) for 3d or
+        spherical geometries.  In the latter case, the centers represent
+        (x,y,z) coordinates on the unit sphere.
+    """
+    if isinstance(cat_list, Catalog):
+        cat_list = [cat_list]
+    if num_passes < 1:
+        raise ValueError("num_passes must be at least 1")
+    centers = None
+    wsum = np.zeros(npatch, dtype=float)
+    max_top = int.bit_length(npatch)-1
+    for i in range(num_passes):
+        for cat in cat_list:
+            cat.load()
+            c = 'spherical' if cat._ra is not None else cat.coords
+            field = cat.getNField(max_top=max_top, coords=c)
+            if centers is None:
+                centers = field.kmeans_initialize_centers(npatch, init=init, rng=rng)
+                field.kmeans_refine_centers(centers, max_iter=max_iter, tol=tol, alt=alt)
+            field.kmeans_update_batch(centers, wsum, alt=alt)
+            # As in _finish_input, we won't want this particular field again.
+            cat.nfields.clear()
+            if low_mem:
+                cat.unload()
+    return centers
+
 def isGColRequired(config, num):
     """A quick helper function that checks whether we need to bother reading the g1,g2 columns.
 
@@ -17,12 +17,17 @@
 
 import numpy as np
 import weakref
+import hashlib
+import os
+import concurrent.futures
+import coord
 
 from . import _lib, _ffi
-from .util import get_omp_threads, parse_xyzsep, coord_enum
+from .util import get_omp_threads, parse_xyzsep, coord_enum, parse_metric, metric_enum
 from .util import long_ptr as lp
 from .util import double_ptr as dp
 from .util import depr_pos_kwargs
+from .util import trace_span
 
 def _parse_split_method(split_method):
     if split_method == 'middle': return 0
@@ -31,6 +36,96 @@ def _parse_split_method(split_method):
     else: return 3  # random
 
 
+_memory_names = ['cells', 'celldata', 'indices', 'arena', 'mapped', 'build', 'packed', 'other']
+
+def _memory_dict(get_memory):
+    # Call get_memory with a long* for the 8 categories of FieldMemory, and make the dict.
+    nbytes = np.zeros(len(_memory_names), dtype=np.int_)
+    get_memory(_ffi.cast('long*', nbytes.ctypes.data))
+    mem = { name: int(b) for name, b in zip(_memory_names, nbytes) }
+    mem['total'] = int(np.sum(nbytes))
+    return mem
+
+def estimate_field_memory(nobj, field_type='N', *, min_size=0., size=None, coords='flat',
+                          use_arena=False, use_packed=False, reorder_tree=False, bucket_size=0):
+    """Estimate how much memory a `Field` would use, without building it.
+
+    This is useful to decide before making the fields whether a calculation will fit in
+    memory, or if it should instead use ``low_mem=True`` with patches, or fewer patches at
+    once.  The other parameters are the same as for the `Field` constructors.
+
+    The number of leaves of the tree depends on ``min_size`` relative to ``size``, the size of
+    the whole field (the largest distance of any object from the center, in the same units
+    as ``min_size``).  If ``size`` is None, or ``min_size`` is 0, every object is taken to be in
+    its own leaf.  Otherwise the estimate assumes the objects are spread evenly over the field,
+    which is an overestimate for clustered objects.
+
+    The returned dict has the same items as `Field.memory`, where build is the memory that is
+    only used while building the tree.  It also has:
+
+        - peak: The total plus build, which is the most that is used while building it.
+
+    Parameters:
+        nobj (int):             The number of objects in the catalog.
+        field_type (str):       Which kind of field: 'N', 'K' or 'G'. (default: 'N')
+        min_size (float):       The minimum size of the cells in the tree. (default: 0)
+        size (float):           The size of the whole field. (default: None)
+        coords (str):           The kind of coordinates: 'flat', 'spherical' or '3d'.
+                                (default: 'flat')
+        use_arena (bool):       Whether the field uses arenas. (default: False)
+        use_packed (bool):      Whether the field also makes a packed tree. (default: False)
+        reorder_tree (bool):    Whether the field reorders its tree. (default: False)
+        bucket_size (int):      The bucket size of the field. (default: 0)
+
+    Returns:
+        A dict of the estimated bytes.
+    """
+    d = {'N': 1, 'K': 2, 'G': 3}[field_type.upper()]
+    size = 0. if size is None else float(size)
+    # As in the C++ Field constructor, these always use arenas.
+    use_arena = bool(use_arena or reorder_tree or bucket_size > 1)
+    mem = _memory_dict(lambda b: _lib.EstimateFieldMemory(int(nobj), float(min_size), size,
+                                                          use_arena, bool(use_packed), d,
+                                                          coord_enum(coords), b))
+    mem['total'] -= mem['build']
+    mem['peak'] = mem['total'] + mem['build']
+    return mem
+
+
+# Deleting the tree of a large field means deleting each of its cells (unless it was built in
+# arenas), which can take a while.  So the trees are deleted by a separate thread, and e.g. a
+# Catalog that evicts a field from its cache can go on to build the next one right away.
+# (The C++ calls don't hold the GIL, so this really does run in parallel.)
+_release_executor = None
+
+def _release(destroy, data, coords):
+    global _release_executor
+    try:
+        if _release_executor is None:
+            _release_executor = concurrent.futures.ThreadPoolExecutor(max_workers=1)
+        _release_executor.submit(destroy, data, coords)
+    except RuntimeError:
+        # Once the interpreter is shutting down, it can't start new work in other threads.
+        destroy(data, coords)
+
+def wait_for_release():
+    """Wait until the trees of all the fields that have been deleted are released.
+
+    The trees of the fields are deleted by a background thread, so the memory they use may
+    not be released right away when e.g. a `Catalog` drops a field from its cache.  This
+    waits until they are all gone.
+    """
+    if _release_executor is not None:
+        _release_executor.submit(lambda: None).result()
+
+
+class _NoObjects(object):
+    # A stand-in for a catalog with no objects, to build an empty C++ Field.  (A null x tells
+    # the C++ layer that the objects will be added later in chunks.)
+    x = y = z = k = g1 = g2 = w = wpos = None
+    ntot = 0
+
+
 class Field(object):
     r"""A Field in TreeCorr is the object that stores the tree structure we use for efficient
     calculation of the correlation functions.
@@ -98,12 +193,100 @@ class Field(object):
         min_top = min(min_top, max_top)  # If min_top > max_top favor max_top.
         return min_top, max_top
 
+    def _cache_file_name(self, cache_dir, columns):
+        # The file name is a hash of everything that goes into building the tree:
+        # the type of field, the build parameters, and the catalog columns that are used.
+        h = hashlib.sha1()
+        # (bucket_size changes the shape of the tree below min_size, so it is included too.)
+        h.update(repr((self.__class__.__name__, self.coords, self.min_size, self.max_size,
+                       self.split_method, self.brute, self.min_top, self.max_top,
+                       self.bucket_size)).encode())
+        for col in columns:
+            if col is None:
+                h.update(b'None')
+            else:
+                h.update(np.ascontiguousarray(col).data)
+        return os.path.join(cache_dir, 'field_%s.dat'%h.hexdigest())
+
+    def _read_or_build(self, cache_dir, columns, build, logger):
+        # Build the C++ Field using the function build, unless there is already a cached
+        # copy of it in cache_dir, in which case read it from there.  (An empty cache_dir
+        # means no cache, like None.)
+        if not cache_dir:
+            return build()
+        file_name = self._cache_file_name(cache_dir, columns)
+        if os.path.isfile(file_name):
+            data = _lib.FieldRead(file_name.encode(), self.use_packed, self._d, self._coords)
+            if data != _ffi.NULL:
+                if logger:
+                    logger.info('Read field from cache file %s',file_name)
+                return data
+            if logger:
+                logger.warning('Invalid field cache file %s.  Rebuilding.',file_name)
+        data = build()
+        # Write to a temporary file and then rename it, so another process reading the
+        # same cache never sees a partially written file.
+        os.makedirs(cache_dir, exist_ok=True)
+        tmp_name = file_name + '.%d.tmp'%os.getpid()
+        if _lib.FieldWrite(data, tmp_name.encode(), self._d, self._coords):
+            os.replace(tmp_name, file_name)
+            if logger:
+                logger.info('Wrote field to cache file %s',file_name)
+        elif os.path.isfile(tmp_name):
+            os.remove(tmp_name)
+        return data
+
+    def _build_from_chunks(self, cat, logger):
+        # Add the objects to the (initially empty) C++ Field from consecutive chunks of the rows
+        # of the catalog's file, so the full catalog is never in memory along with the tree.
+        self.ntot = 0
+        for chunk in cat._read_chunks():
+            self._add_chunk(chunk)
+            self.ntot += chunk.ntot
+        _lib.FinishFieldData(self.data, self._d, self._coords)
+        if logger:
+            logger.info('Read %d objects for %s in chunks of %d rows',
+                        self.ntot,self.__class__.__name__,cat._field_chunk_size)
+
+    def _get_patch(self, cat, patch_field):
+        # Get the patch numbers to group the top-level cells by, if this is a patch field.
+        # Otherwise, return None.  (A catalog of a single patch doesn't need this.)
+        if patch_field and cat.npatch > 1 and cat._single_patch is None:
+            self.npatch = cat.npatch
+            return np.ascontiguousarray(cat.patch, dtype=int)
+        else:
+            self.npatch = 1
+            return None
+
     @property
     def nTopLevelNodes(self):
         """The number of top-level nodes.
         """
         return _lib.FieldGetNTopLevel(self.data, self._d, self._coords)
 
+    @property
+    def memory(self):
+        """A dict with the number of bytes of memory used by the field.
+
+        This builds the tree first if it hasn't been built yet.  The items are:
+
+            - cells: The nodes of the tree, if not using arenas.
+            - celldata: The data (position, weight, etc.) of each node, if not using arenas.
+            - indices: The indices of the objects in the leaves with more than one object,
+              if not using arenas.
+            - arena: The memory allocated from the arenas, if using them
+              (``use_arena``, ``reorder_tree`` or ``bucket_size``), which then hold all of the
+              above.
+            - mapped: The cache file, if the field was read from ``cache_dir``.
+            - build: The data kept to build the tree, which is released once it is built.
+            - packed: The copy of the tree for ``use_packed``.
+            - other: Everything else, such as the lists of top-level nodes and patches.
+            - total: The sum of all of the above.
+
+        cf. `estimate_field_memory` to estimate these before building a field.
+        """
+        return _memory_dict(lambda b: _lib.FieldGetMemory(self.data, self._d, self._coords, b))
+
     @property
     def cat(self):
         """The catalog from which this field was constructed.
@@ -264,7 +447,211 @@ class Field(object):
         _lib.FieldGetNear(self.data, x, y, z, sep, self._d, self._coords, lp(ind), n)
         return ind
 
+    def count_near_many(self, x, y, z=None, *, sep, sep_units=None, dual_tree=None):
+        """Count how many points are near each of many target coordinates.
+
+        This is a batched version of `count_near`.  The queries are run in parallel, and
+        for large numbers of queries, they are first sorted into their own tree so that the
+        two trees can be traversed together.
+
+        The query positions are given in the same system as the field's catalog positions.
+        For spherical coordinates, this means x,y,z on the unit sphere (e.g. ``cat.x``,
+        ``cat.y``, ``cat.z`` for another catalog), and sep is an angle given with ``sep_units``.
+
+        Parameters:
+            x (array):          The x coordinates of the target locations.
+            y (array):          The y coordinates of the target locations.
+            z (array):          The z coordinates of the target locations, if not flat.
+                                (default: None)
+            sep (float or array): The separation distance for each target location.
+            sep_units (str):    The units of sep for spherical coordinates. (default: None)
+            dual_tree (bool):   Whether to use a dual-tree traversal.  (default: None, which
+                                means to use it for more than 100 queries)
+
+        Returns:
+            counts, an array of the number of points near each target location.
+        """
+        if self.min_size == 0:
+            # If min_size = 0, then regular method is already exact.
+            x, y, z, sep = self._parse_many(x, y, z, sep, sep_units)
+            return self._count_near_many(x, y, z, sep, dual_tree)
+        else:
+            # Otherwise, do the same thing as count_near.
+            offsets, _ = self.get_near_many(x, y, z, sep=sep, sep_units=sep_units,
+                                            dual_tree=dual_tree)
+            return np.diff(offsets)
+
+    def get_near_many(self, x, y, z=None, *, sep, sep_units=None, dual_tree=None):
+        """Get the indices of points near each of many target coordinates.
+
+        This is a batched version of `get_near`.  See `count_near_many` for the parameters.
+
+        The results are returned in CSR format: the indices of the points near target location
+        i are ``indices[offsets[i]:offsets[i+1]]``, sorted within each target location.
+
+        Returns:
+            (offsets, indices)
+        """
+        x, y, z, sep = self._parse_many(x, y, z, sep, sep_units)
+        if self.min_size == 0:
+            # If min_size == 0, then regular method is already exact.
+            return self._get_near_many(x, y, z, sep, dual_tree)
+        else:
+            # Expand the radius by the minimum size of the cells.
+            offsets, ind = self._get_near_many(x, y, z, sep + self.min_size, dual_tree)
+            # Now check the actual radii of these points using the catalog x,y,z values.
+            counts = np.diff(offsets)
+            q = np.repeat(np.arange(len(x)), counts)
+            rsq = (self.cat.x[ind]-x[q])**2 + (self.cat.y[ind]-y[q])**2
+            if self._coords != _lib.Flat:
+                rsq += (self.cat.z[ind]-z[q])**2
+            near = rsq < sep[q]**2
+            offsets = np.zeros_like(offsets)
+            offsets[1:] = np.cumsum(np.bincount(q[near], minlength=len(x)))
+            return offsets, ind[near]
+
+    def _parse_many(self, x, y, z, sep, sep_units):
+        x = np.ascontiguousarray(x, dtype=float)
+        y = np.ascontiguousarray(y, dtype=float)
+        if self._coords == _lib.Flat:
+            if z is not None:
+                raise TypeError("z is invalid for flat coordinates")
+        else:
+            if z is None:
+                raise TypeError("Missing required argument z")
+            z = np.ascontiguousarray(z, dtype=float)
+        if x.shape != y.shape or (z is not None and z.shape != x.shape):
+            raise ValueError("x, y, z must all be the same shape")
+        sep = np.ascontiguousarray(np.broadcast_to(np.asarray(sep, dtype=float), x.shape))
+        if self._coords == _lib.Sphere:
+            if sep_units is None:
+                raise TypeError("Missing required argument sep_units")
+            sep = sep * coord.AngleUnit.from_name(sep_units).value
+            # We actually want the chord distance for this angle.
+            sep = 2. * np.sin(sep/2.)
+        elif sep_units is not None:
+            raise TypeError("sep_units is only valid for spherical coordinates")
+        return x, y, z, sep
+
+    def _use_dual(self, nq, dual_tree):
+        return nq > 100 if dual_tree is None else bool(dual_tree)
+
+    def _count_near_many(self, x, y, z, sep, dual_tree):
+        counts = np.empty(len(x), dtype=int)
+        _lib.FieldCountNearMany(self.data, dp(x), dp(y), dp(z), dp(sep), len(x),
+                                self._use_dual(len(x), dual_tree), self._d, self._coords,
+                                lp(counts))
+        return counts
+
+    def _get_near_many(self, x, y, z, sep, dual_tree):
+        counts = self._count_near_many(x, y, z, sep, dual_tree)
+        offsets = np.zeros(len(x)+1, dtype=int)
+        offsets[1:] = np.cumsum(counts)
+        ind = np.empty(offsets[-1], dtype=int)
+        _lib.FieldGetNearMany(self.data, dp(x), dp(y), dp(z), dp(sep), len(x),
+                              self._use_dual(len(x), dual_tree), self._d, self._coords,
+                              lp(offsets), lp(ind))
+        return offsets, ind
+
+    def nearest_neighbors(self, x, y, z=None, *, k=1, metric='Euclidean', period=None,
+                          xperiod=None, yperiod=None, zperiod=None):
+        """Find the k nearest neighbors of each of many target coordinates.
+
+        The search uses the existing tree, checking the cells in order of their smallest
+        possible distance from each target, and stopping when no remaining cell can have
+        anything closer than the k-th nearest object found so far.  The target locations are
+        run in parallel.
+
+        The target positions are given in the same system as the field's catalog positions.
+        For spherical coordinates, this means x,y,z on the unit sphere (e.g. ``cat.x``,
+        ``cat.y``, ``cat.z`` for another catalog).  The distances are in the units of the
+        metric, so for spherical coordinates, they are chord distances for Euclidean and
+        angles in radians for Arc.
+
+        .. note::
+
+            If the field was built with min_size > 0, the objects in each leaf cell are all
+            taken to be at the cell's centroid.
+
+        Parameters:
+            x (array):          The x coordinates of the target locations.
+            y (array):          The y coordinates of the target locations.
+            z (array):          The z coordinates of the target locations, if not flat.
+                                (default: None)
+            k (int):            The number of neighbors to find. (default: 1)
+            metric (str):       Which metric to use for the distances. (default: 'Euclidean')
+            period (float):     For the Periodic metric, the period to use in all directions.
+                                (default: None)
+            xperiod (float):    For the Periodic metric, the period to use in the x direction.
+                                (default: period)
+            yperiod (float):    For the Periodic metric, the period to use in the y direction.
+                                (default: period)
+            zperiod (float):    For the Periodic metric, the period to use in the z direction.
+                                (default: period)
+
+        Returns:
+            (dist, indices), arrays with shape (len(x), k) of the distances to the neighbors
+            (sorted from nearest to farthest) and their indices in the catalog.  If there are
+            fewer than k objects, the extra entries have dist = inf and index = -1.
+        """
+        coords, metric = parse_metric(metric, self.coords)
+        if not _lib.MetricCompiled(metric_enum(metric)):
+            raise ValueError("TreeCorr was built without metric=%s.  "%metric +
+                             "(cf. TREECORR_METRICS)")
+        k = int(k)
+        if k < 1:
+            raise ValueError("k must be at least 1")
+        xp = xperiod if xperiod is not None else period if period is not None else 0.
+        yp = yperiod if yperiod is not None else period if period is not None else 0.
+        zp = zperiod if zperiod is not None else period if period is not None else 0.
+        if metric == 'Periodic':
+            if xp == 0 or yp == 0 or (coords == '3d' and zp == 0):
+                raise ValueError("Periodic metric requires setting the period to use.")
+        elif xp != 0 or yp != 0 or zp != 0:
+            raise ValueError("period options are not valid for %s metric."%metric)
+        x, y, z, _ = self._parse_many(x, y, z, 0., 'rad' if coords == 'spherical' else None)
+        dist = np.empty((len(x), k), dtype=float)
+        ind = np.empty((len(x), k), dtype=int)
+        _lib.FieldKNN(self.data, dp(x), dp(y), dp(z), len(x), k, self._d, self._coords,
+                      metric_enum(metric), xp, yp, zp, dp(dist), lp(ind))
+        return dist, ind
+
+    def insert(self, cat, *, logger=None):
+        """Add the objects in another catalog to this field.
+
+        The new objects are built into their own trees with the same parameters as this field.
+        Then each of the new top-level cells that lies entirely within one of the current
+        top-level cells is merged into it, and the rest are added as new top-level cells.
+        So this takes time proportional to the number of new objects, rather than the number of
+        objects in the whole field, but the resulting tree is somewhat less efficient than if
+        the field were built from all the objects at once.
+
+        The new objects get indices (e.g. in `get_near`) starting at the previous value of
+        ``self.ntot``.
+
+        .. note::
+
+            The field is modified in place, so this also affects any other uses of it.  E.g.
+            if this field was made by ``cat.getNField()``, then correlation functions using
+            ``cat`` with the same field parameters will use the updated field as well.
+
+        Parameters:
+            cat (Catalog):  The catalog with the new objects to add.  It must use the same
+                            coordinate system as this field.
+            logger (Logger): A logger file if desired. (default: None)
+        """
+        if cat.coords != self.coords:
+            raise ValueError("Cannot insert a catalog with coords=%s into a field with coords=%s"%(
+                             cat.coords, self.coords))
+        if self.npatch > 1:
+            raise ValueError("Cannot insert a catalog into a field made with patch_field=True")
+        if logger:
+            logger.info('Inserting %d objects into %s',cat.ntot,self.__class__.__name__)
+        self._insert(cat)
+        self.ntot += cat.ntot
+
     @depr_pos_kwargs
+    @trace_span('Field.run_kmeans')
     def run_kmeans(self, npatch, *, max_iter=200, tol=1.e-5, init='tree', alt=False, rng=None):
         r"""Use k-means algorithm to set patch labels for a field.
 
@@ -486,6 +873,40 @@ class Field(object):
         _lib.KMeansRun(self.data, dp(centers), npatch, int(max_iter), float(tol),
                        bool(alt), self._d, self._coords)
 
+    def kmeans_update_batch(self, centers, wsum, *, alt=False):
+        """Do one step of the mini-batch K-Means algorithm with the points in this field.
+
+        This is for catalogs that are too large to build a single field for all of them.
+        Instead, one builds a field for each chunk of the catalog in turn and calls this
+        function for each one.  The points in this field are assigned to the current centers,
+        and each center is moved towards the centroid of the points assigned to it.
+
+        The amount each center moves is set by ``wsum``, the total weight of the points
+        assigned to that center in the previous calls.  This makes each center the weighted
+        mean of all the points that were assigned to it along the way.  So the changes get
+        smaller as more chunks are processed.
+
+        Normally, one would use `calculatePatchCenters`, which runs this over a list of
+        catalogs.
+
+        Parameters:
+            centers (array):    An array of center coordinates. (modified by this function)
+                                Shape is (npatch, 2) for flat geometries or (npatch, 3) for 3d or
+                                spherical geometries.  In the latter case, the centers represent
+                                (x,y,z) coordinates on the unit sphere.
+            wsum (array):       The total weight assigned to each center so far.  This should
+                                be zeros before the first call.  (modified by this function)
+            alt (bool):         Use the alternate assignment algorithm to minimize the standard
+                                deviation of the inertia rather than the total inertia (aka WCSS).
+                                The inertia is calculated from just the points in this field.
+                                (default: False)
+        """
+        npatch = centers.shape[0]
+        if wsum.shape != (npatch,):
+            raise ValueError("wsum must have shape (npatch,)")
+        _lib.KMeansUpdateBatch(self.data, dp(centers), npatch, dp(wsum),
+                               bool(alt), self._d, self._coords)
+
     def kmeans_assign_patches(self, centers):
         """Assign patch numbers to each point according to the given centers.
 
@@ -530,13 +951,50 @@ class NField(Field):
         max_top (int):      The maximum number of top layers to use when setting up the field.
                             (default: 10)
         coords (str):       The kind of coordinate system to use. (default: cat.coords)
+        use_arena (bool):   Whether to allocate the tree in a few large contiguous blocks
+                            of memory, rather than one allocation per cell.  This is faster
+                            to build and especially to destroy for very large catalogs.
+                            (default: False)
+        use_packed (bool):  Whether to also make a packed copy of the tree, which stores the
+                            information needed for the tree traversal in contiguous arrays.
+                            This uses some extra memory, but is faster for computing
+                            correlation functions of large catalogs. (default: False)
+        zero_copy (bool):   Whether to build the tree directly from the catalog's arrays,
+                            rather than first making a copy of every object's data.  This
+                            saves a significant amount of memory (and some time) while building
+                            the tree for very large catalogs. (default: False)
+        reorder_tree (bool): Whether to copy the tree once it is built, so that each subtree is
+                            stored contiguously in memory, in depth-first order.  This puts
+                            nearby cells close together in memory, which makes the tree
+                            traversal faster for large catalogs.  This implies use_arena.
+                            (default: False)
+        bucket_size (int): If > 1, build any cell with at most this many objects that would
+                            otherwise be split as a bucket, whose objects are stored
+                            contiguously.  When such a cell needs to be split while computing
+                            a correlation function, all of its pairs are computed directly,
+                            rather than recursing through the rest of the tree.  This is mostly
+                            useful for bin_slop=0.  This implies use_arena. (default: 0)
+        patch_field (bool): Whether to group the top-level cells by the catalog's patch numbers,
+                            so the pairs of patches can all be processed with this one field,
+                            rather than a separate field for each patch.  This is ignored if
+                            the catalog doesn't have patches.  It is not compatible with
+                            zero_copy or cache_dir, which are ignored if this is set.
+                            (default: False)
+        cache_dir (str):    If given, a directory in which to cache the built tree.  If a tree
+                            with the same build parameters for the same catalog values has
+                            already been saved there, it is read back from that file rather
+                            than building it again.  Otherwise, the new tree is saved there.
+                            (default: None)
         rng (RandomState):  If desired, a numpy.random.RandomState instance to use for random
                             number generation. (default: None)
         logger (Logger):    A logger file if desired. (default: None)
     """
     @depr_pos_kwargs
     def __init__(self, cat, *, min_size=0, max_size=None, split_method='mean', brute=False,
-                 min_top=None, max_top=10, coords=None, rng=None, logger=None):
+                 min_top=None, max_top=10, coords=None, use_arena=False,
+                 use_packed=False, zero_copy=False, reorder_tree=False, bucket_size=0,
+                 patch_field=False, cache_dir=None, rng=None,
+                 logger=None):
         if logger:
             if cat.name != '':
                 logger.info('Building NField from cat %s',cat.name)
@@ -544,7 +1002,6 @@ class NField(Field):
                 logger.info('Building NField')
 
         self._cat = weakref.ref(cat)
-        self.ntot = cat.ntot
         self.min_size = float(min_size) if not brute else 0.
         self.max_size = float(max_size) if max_size is not None else np.inf
         self.split_method = split_method
@@ -554,12 +1011,33 @@ class NField(Field):
         self.min_top, self.max_top = self._determine_top(min_top, max_top)
         self.coords = coords if coords is not None else cat.coords
         self._coords = coord_enum(self.coords)  # These are the C++-layer enums
+        self.use_arena = bool(use_arena)
+        self.use_packed = bool(use_packed)
+        self.zero_copy = bool(zero_copy)
+        self.reorder_tree = bool(reorder_tree)
+        self.bucket_size = int(bucket_size)
+        patch = self._get_patch(cat, patch_field)
+        if patch is not None:
+            self.zero_copy = False
+            cache_dir = None
         seed = 0 if rng is None else int(rng.random_sample() * 2**63)
 
-        self.data = _lib.BuildNField(dp(cat.x), dp(cat.y), dp(cat.z),
-                                     dp(cat.w), dp(cat.wpos), cat.ntot,
-                                     self.min_size, self.max_size, self._sm, seed,
-                                     self.brute, self.min_top, self.max_top, self._coords)
+        build = lambda c=cat: _lib.BuildNField(dp(c.x), dp(c.y), dp(c.z),
+                                               dp(c.w), dp(c.wpos), c.ntot,
+                                               self.min_size, self.max_size, self._sm, seed,
+                                               self.brute, self.min_top, self.max_top,
+                                               self.use_arena, self.use_packed, self.zero_copy,
+                                               self.reorder_tree, self.bucket_size,
+                                               lp(patch), self.npatch, self._coords)
+        if cat._field_chunk_size:
+            # The catalog isn't loaded, so read its file a chunk at a time into an empty field.
+            self.zero_copy = False
+            self.data = build(_NoObjects)
+            self._build_from_chunks(cat, logger)
+        else:
+            self.ntot = cat.ntot
+            columns = [cat.x, cat.y, cat.z, cat.w, cat.wpos]
+            self.data = self._read_or_build(cache_dir, columns, build, logger)
         if logger:
             logger.debug('Finished building NField (%s)',self.coords)
 
@@ -573,7 +1051,15 @@ class NField(Field):
             # When that happens, this will freeze in a `with ffi._lock` line in the ffi api.py.
             # So, don't do that, and just accept the memory leak instead.
             if not _ffi._lock.locked(): # pragma: no branch
-                _lib.DestroyNField(self.data, self._coords)
+                _release(_lib.DestroyNField, self.data, self._coords)
+
+    def _insert(self, cat):
+        _lib.InsertNField(self.data, dp(cat.x), dp(cat.y), dp(cat.z),
+                          dp(cat.w), dp(cat.wpos), cat.ntot, self._coords)
+
+    def _add_chunk(self, cat):
+        _lib.AddNFieldData(self.data, dp(cat.x), dp(cat.y), dp(cat.z),
+                           dp(cat.w), dp(cat.wpos), cat.ntot, self._coords)
 
 
 class KField(Field):
@@ -597,13 +1083,50 @@ class KField(Field):
         max_top (int):      The maximum number of top layers to use when setting up the field.
                             (default: 10)
         coords (str):       The kind of coordinate system to use. (default: cat.coords)
+        use_arena (bool):   Whether to allocate the tree in a few large contiguous blocks
+                            of memory, rather than one allocation per cell.  This is faster
+                            to build and especially to destroy for very large catalogs.
+                            (default: False)
+        use_packed (bool):  Whether to also make a packed copy of the tree, which stores the
+                            information needed for the tree traversal in contiguous arrays.
+                            This uses some extra memory, but is faster for computing
+                            correlation functions of large catalogs. (default: False)
+        zero_copy (bool):   Whether to build the tree directly from the catalog's arrays,
+                            rather than first making a copy of every object's data.  This
+                            saves a significant amount of memory (and some time) while building
+                            the tree for very large catalogs. (default: False)
+        reorder_tree (bool): Whether to copy the tree once it is built, so that each subtree is
+                            stored contiguously in memory, in depth-first order.  This puts
+                            nearby cells close together in memory, which makes the tree
+                            traversal faster for large catalogs.  This implies use_arena.
+                            (default: False)
+        bucket_size (int): If > 1, build any cell with at most this many objects that would
+                            otherwise be split as a bucket, whose objects are stored
+                            contiguously.  When such a cell needs to be split while computing
+                            a correlation function, all of its pairs are computed directly,
+                            rather than recursing through the rest of the tree.  This is mostly
+                            useful for bin_slop=0.  This implies use_arena. (default: 0)
+        patch_field (bool): Whether to group the top-level cells by the catalog's patch numbers,
+                            so the pairs of patches can all be processed with this one field,
+                            rather than a separate field for each patch.  This is ignored if
+                            the catalog doesn't have patches.  It is not compatible with
+                            zero_copy or cache_dir, which are ignored if this is set.
+                            (default: False)
+        cache_dir (str):    If given, a directory in which to cache the built tree.  If a tree
+                            with the same build parameters for the same catalog values has
+                            already been saved there, it is read back from that file rather
+                            than building it again.  Otherwise, the new tree is saved there.
+                            (default: None)
         rng (RandomState):  If desired, a numpy.random.RandomState instance to use for random
                             number generation. (default: None)
         logger (Logger):    A logger file if desired. (default: None)
     """
     @depr_pos_kwargs
     def __init__(self, cat, *, min_size=0, max_size=None, split_method='mean', brute=False,
-                 min_top=None, max_top=10, coords=None, rng=None, logger=None):
+                 min_top=None, max_top=10, coords=None, use_arena=False,
+                 use_packed=False, zero_copy=False, reorder_tree=False, bucket_size=0,
+                 patch_field=False, cache_dir=None, rng=None,
+                 logger=None):
         if logger:
             if cat.name != '':
                 logger.info('Building KField from cat %s',cat.name)
@@ -611,7 +1134,6 @@ class KField(Field):
                 logger.info('Building KField')
 
         self._cat = weakref.ref(cat)
-        self.ntot = cat.ntot
         self.min_size = float(min_size) if not brute else 0.
         self.max_size = float(max_size) if max_size is not None else np.inf
         self.split_method = split_method
@@ -621,13 +1143,34 @@ class KField(Field):
         self.min_top, self.max_top = self._determine_top(min_top, max_top)
         self.coords = coords if coords is not None else cat.coords
         self._coords = coord_enum(self.coords)  # These are the C++-layer enums
+        self.use_arena = bool(use_arena)
+        self.use_packed = bool(use_packed)
+        self.zero_copy = bool(zero_copy)
+        self.reorder_tree = bool(reorder_tree)
+        self.bucket_size = int(bucket_size)
+        patch = self._get_patch(cat, patch_field)
+        if patch is not None:
+            self.zero_copy = False
+            cache_dir = None
         seed = 0 if rng is None else int(rng.random_sample() * 2**63)
 
-        self.data = _lib.BuildKField(dp(cat.x), dp(cat.y), dp(cat.z),
-                                     dp(cat.k),
-                                     dp(cat.w), dp(cat.wpos), cat.ntot,
-                                     self.min_size, self.max_size, self._sm, seed,
-                                     self.brute, self.min_top, self.max_top, self._coords)
+        build = lambda c=cat: _lib.BuildKField(dp(c.x), dp(c.y), dp(c.z),
+                                               dp(c.k),
+                                               dp(c.w), dp(c.wpos), c.ntot,
+                                               self.min_size, self.max_size, self._sm, seed,
+                                               self.brute, self.min_top, self.max_top,
+                                               self.use_arena, self.use_packed, self.zero_copy,
+                                               self.reorder_tree, self.bucket_size,
+                                               lp(patch), self.npatch, self._coords)
+        if cat._field_chunk_size:
+            # The catalog isn't loaded, so read its file a chunk at a time into an empty field.
+            self.zero_copy = False
+            self.data = build(_NoObjects)
+            self._build_from_chunks(cat, logger)
+        else:
+            self.ntot = cat.ntot
+            columns = [cat.x, cat.y, cat.z, cat.k, cat.w, cat.wpos]
+            self.data = self._read_or_build(cache_dir, columns, build, logger)
         if logger:
             logger.debug('Finished building KField (%s)',self.coords)
 
@@ -638,7 +1181,15 @@ class KField(Field):
         # In case __init__ failed to get that far
         if hasattr(self,'data'):  # pragma: no branch
             if not _ffi._lock.locked(): # pragma: no branch
-                _lib.DestroyKField(self.data, self._coords)
+                _release(_lib.DestroyKField, self.data, self._coords)
+
+    def _insert(self, cat):
+        _lib.InsertKField(self.data, dp(cat.x), dp(cat.y), dp(cat.z), dp(cat.k),
+                          dp(cat.w), dp(cat.wpos), cat.ntot, self._coords)
+
+    def _add_chunk(self, cat):
+        _lib.AddKFieldData(self.data, dp(cat.x), dp(cat.y), dp(cat.z), dp(cat.k),
+                           dp(cat.w), dp(cat.wpos), cat.ntot, self._coords)
 
 
 class GField(Field):
@@ -662,13 +1213,50 @@ class GField(Field):
         max_top (int):      The maximum number of top layers to use when setting up the field.
                             (default: 10)
         coords (str):       The kind of coordinate system to use. (default: cat.coords)
+        use_arena (bool):   Whether to allocate the tree in a few large contiguous blocks
+                            of memory, rather than one allocation per cell.  This is faster
+                            to build and especially to destroy for very large catalogs.
+                            (default: False)
+        use_packed (bool):  Whether to also make a packed copy of the tree, which stores the
+                            information needed for the tree traversal in contiguous arrays.
+                            This uses some extra memory, but is faster for computing
+                            correlation functions of large catalogs. (default: False)
+        zero_copy (bool):   Whether to build the tree directly from the catalog's arrays,
+                            rather than first making a copy of every object's data.  This
+                            saves a significant amount of memory (and some time) while building
+                            the tree for very large catalogs. (default: False)
+        reorder_tree (bool): Whether to copy the tree once it is built, so that each subtree is
+                            stored contiguously in memory, in depth-first order.  This puts
+                            nearby cells close together in memory, which makes the tree
+                            traversal faster for large catalogs.  This implies use_arena.
+                            (default: False)
+        bucket_size (int): If > 1, build any cell with at most this many objects that would
+                            otherwise be split as a bucket, whose objects are stored
+                            contiguously.  When such a cell needs to be split while computing
+                            a correlation function, all of its pairs are computed directly,
+                            rather than recursing through the rest of the tree.  This is mostly
+                            useful for bin_slop=0.  This implies use_arena. (default: 0)
+        patch_field (bool): Whether to group the top-level cells by the catalog's patch numbers,
+                            so the pairs of patches can all be processed with this one field,
+                            rather than a separate field for each patch.  This is ignored if
+                            the catalog doesn't have patches.  It is not compatible with
+                            zero_copy or cache_dir, which are ignored if this is set.
+                            (default: False)
+        cache_dir (str):    If given, a directory in which to cache the built tree.  If a tree
+                            with the same build parameters for the same catalog values has
+                            already been saved there, it is read back from that file rather
+                            than building it again.  Otherwise, the new tree is saved there.
+                            (default: None)
         rng (RandomState):  If desired, a numpy.random.RandomState instance to use for random
                             number generation. (default: None)
         logger (Logger):    A logger file if desired. (default: None)
     """
     @depr_pos_kwargs
     def __init__(self, cat, *, min_size=0, max_size=None, split_method='mean', brute=False,
-                 min_top=None, max_top=10, coords=None, rng=None, logger=None):
+                 min_top=None, max_top=10, coords=None, use_arena=False,
+                 use_packed=False, zero_copy=False, reorder_tree=False, bucket_size=0,
+                 patch_field=False, cache_dir=None, rng=None,
+                 logger=None):
         if logger:
             if cat.name != '':
                 logger.info('Building GField from cat %s',cat.name)
@@ -676,7 +1264,6 @@ class GField(Field):
                 logger.info('Building GField')
 
         self._cat = weakref.ref(cat)
-        self.ntot = cat.ntot
         self.min_size = float(min_size) if not brute else 0.
         self.max_size = float(max_size) if max_size is not None else np.inf
         self.split_method = split_method
@@ -686,13 +1273,34 @@ class GField(Field):
         self.min_top, self.max_top = self._determine_top(min_top, max_top)
         self.coords = coords if coords is not None else cat.coords
         self._coords = coord_enum(self.coords)  # These are the C++-layer enums
+        self.use_arena = bool(use_arena)
+        self.use_packed = bool(use_packed)
+        self.zero_copy = bool(zero_copy)
+        self.reorder_tree = bool(reorder_tree)
+        self.bucket_size = int(bucket_size)
+        patch = self._get_patch(cat, patch_field)
+        if patch is not None:
+            self.zero_copy = False
+            cache_dir = None
         seed = 0 if rng is None else int(rng.random_sample() * 2**63)
 
-        self.data = _lib.BuildGField(dp(cat.x), dp(cat.y), dp(cat.z),
-                                     dp(cat.g1), dp(cat.g2),
-                                     dp(cat.w), dp(cat.wpos), cat.ntot,
-                                     self.min_size, self.max_size, self._sm, seed,
-                                     self.brute, self.min_top, self.max_top, self._coords)
+        build = lambda c=cat: _lib.BuildGField(dp(c.x), dp(c.y), dp(c.z),
+                                               dp(c.g1), dp(c.g2),
+                                               dp(c.w), dp(c.wpos), c.ntot,
+                                               self.min_size, self.max_size, self._sm, seed,
+                                               self.brute, self.min_top, self.max_top,
+                                               self.use_arena, self.use_packed, self.zero_copy,
+                                               self.reorder_tree, self.bucket_size,
+                                               lp(patch), self.npatch, self._coords)
+        if cat._field_chunk_size:
+            # The catalog isn't loaded, so read its file a chunk at a time into an empty field.
+            self.zero_copy = False
+            self.data = build(_NoObjects)
+            self._build_from_chunks(cat, logger)
+        else:
+            self.ntot = cat.ntot
+            columns = [cat.x, cat.y, cat.z, cat.g1, cat.g2, cat.w, cat.wpos]
+            self.data = self._read_or_build(cache_dir, columns, build, logger)
         if logger:
             logger.debug('Finished building GField (%s)',self.coords)
 
@@ -703,7 +1311,16 @@ class GField(Field):
         # In case __init__ failed to get that far
         if hasattr(self,'data'):  # pragma: no branch
             if not _ffi._lock.locked(): # pragma: no branch
-                _lib.DestroyGField(self.data, self._coords)
+                _release(_lib.DestroyGField, self.data, self._coords)
+
+    def _insert(self, cat):
+        _lib.InsertGField(self.data, dp(cat.x), dp(cat.y), dp(cat.z), dp(cat.g1), dp(cat.g2),
+                          dp(cat.w), dp(cat.wpos), cat.ntot, self._coords)
+
+    def _add_chunk(self, cat):
+        _lib.AddGFieldData(self.data, dp(cat.x), dp(cat.y), dp(cat.z),
+                           dp(cat.g1), dp(cat.g2),
+                           dp(cat.w), dp(cat.wpos), cat.ntot, self._coords)
 
 
 class SimpleField(object):
@@ -201,6 +201,7 @@ class GGGCorrelation(BinnedCorr3):
                     self.min_u,self.max_u,self.nubins,self.ubin_size,self.bu,
                     self.min_v,self.max_v,self.nvbins,self.vbin_size,self.bv,
                     self.xperiod, self.yperiod, self.zperiod,
+                    self.max_accum_mem,
                     dp(self.gam0r), dp(self.gam0i), dp(self.gam1r), dp(self.gam1i),
                     dp(self.gam2r), dp(self.gam2i), dp(self.gam3r), dp(self.gam3i),
                     dp(self.meand1), dp(self.meanlogd1), dp(self.meand2), dp(self.meanlogd2),
@@ -310,8 +311,9 @@ class GGGCorrelation(BinnedCorr3):
                               coords=self.coords)
 
         self.logger.info('Starting %d jobs.',field.nTopLevelNodes)
-        _lib.ProcessAuto3(self.corr, field.data, self.output_dots,
-                                   field._d, self._coords, self._bintype, self._metric)
+        sample = self._sample_cells(field)
+        _lib.ProcessAuto3(self.corr, field.data, self.output_dots, dp(self._progress), dp(sample),
+                          field._d, self._coords, self._bintype, self._metric)
 
     @depr_pos_kwargs
     def process_cross12(self, cat1, cat2, *, metric=None, num_threads=None):
@@ -359,8 +361,9 @@ class GGGCorrelation(BinnedCorr3):
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
         # Note: all 3 correlation objects are the same.  Thus, all triangles will be placed
         # into self.corr, whichever way the three catalogs are permuted for each triangle.
+        sample = self._sample_cells(f1)
         _lib.ProcessCross12(self.corr, self.corr, self.corr,
-                            f1.data, f2.data, self.output_dots,
+                            f1.data, f2.data, self.output_dots, dp(self._progress), dp(sample),
                             f1._d, f2._d, self._coords,
                             self._bintype, self._metric)
 
@@ -413,9 +416,11 @@ class GGGCorrelation(BinnedCorr3):
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
         # Note: all 6 correlation objects are the same.  Thus, all triangles will be placed
         # into self.corr, whichever way the three catalogs are permuted for each triangle.
+        sample = self._sample_cells(f1)
         _lib.ProcessCross3(self.corr, self.corr, self.corr,
                            self.corr, self.corr, self.corr,
                            f1.data, f2.data, f3.data, self.output_dots,
+                           dp(self._progress), dp(sample),
                            f1._d, f2._d, f3._d, self._coords, self._bintype, self._metric)
 
     def _finalize(self):
@@ -1384,8 +1389,9 @@ class GGGCrossCorrelation(BinnedCorr3):
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
         # Note: all 3 correlation objects are the same.  Thus, all triangles will be placed
         # into self.corr, whichever way the three catalogs are permuted for each triangle.
+        sample = self._sample_cells(f1)
         _lib.ProcessCross12(self.g1g2g3.corr, self.g2g1g3.corr, self.g2g3g1.corr,
-                            f1.data, f2.data, self.output_dots,
+                            f1.data, f2.data, self.output_dots, dp(self._progress), dp(sample),
                             f1._d, f2._d, self._coords,
                             self._bintype, self._metric)
 
@@ -1437,10 +1443,12 @@ class GGGCrossCorrelation(BinnedCorr3):
                             coords=self.coords)
 
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
+        sample = self._sample_cells(f1)
         _lib.ProcessCross3(self.g1g2g3.corr, self.g1g3g2.corr,
                            self.g2g1g3.corr, self.g2g3g1.corr,
                            self.g3g1g2.corr, self.g3g2g1.corr,
                            f1.data, f2.data, f3.data, self.output_dots,
+                           dp(self._progress), dp(sample),
                            f1._d, f2._d, f3._d, self._coords, self._bintype, self._metric)
 
     def _finalize(self):
@@ -1506,6 +1514,11 @@ class GGGCrossCorrelation(BinnedCorr3):
         for i, ggg in enumerate(self._all):
             ggg._sum([c._all[i] for c in others])
 
+    def _triplet_corrs(self):
+        for ggg in self._all:
+            ggg._set_metric(self.metric, self.coords)
+        return [ggg.corr for ggg in self._all]
+
     @depr_pos_kwargs
     def process(self, cat1, cat2, cat3=None, *, metric=None, num_threads=None,
                 comm=None, low_mem=False, initialize=True, finalize=True):
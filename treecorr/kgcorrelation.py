@@ -122,9 +122,14 @@ class KGCorrelation(BinnedCorr2):
             self._corr = _lib.BuildCorr2(
                     self._d1, self._d2, self._bintype,
                     self._min_sep,self._max_sep,self._nbins,self._bin_size,self.b,
+                    dp(self._bin_edges), dp(self._bin_b),
                     self.min_rpar, self.max_rpar, self.xperiod, self.yperiod, self.zperiod,
+                    self.max_accum_mem, self.float_accum,
                     dp(self.xi),dp(self.xi_im), dp(None), dp(None),
                     dp(self.meanr),dp(self.meanlogr),dp(self.weight),dp(self.npairs))
+            _lib.SetSplitFactor2(self._corr, self._d1, self._d2, self._bintype,
+                                 self.split_factor)
+            self._set_min_size()
         return self._corr
 
     def __del__(self):
@@ -144,7 +149,8 @@ class KGCorrelation(BinnedCorr2):
                 self.sep_units == other.sep_units and
                 self.coords == other.coords and
                 self.bin_type == other.bin_type and
-                self.bin_slop == other.bin_slop and
+                np.array_equal(self.bin_edges, other.bin_edges) and
+                np.array_equal(self.bin_slop, other.bin_slop) and
                 self.min_rpar == other.min_rpar and
                 self.max_rpar == other.max_rpar and
                 self.xperiod == other.xperiod and
@@ -269,6 +275,10 @@ class KGCorrelation(BinnedCorr2):
         _lib.ProcessPair(self.corr, f1.data, f2.data, self.output_dots,
                          f1._d, f2._d, self._coords, self._bintype, self._metric)
 
+    @property
+    def _ratio_stat(self):
+        return ['xi']
+
     def _finalize(self):
         mask1 = self.weight != 0
         mask2 = self.weight == 0
@@ -331,7 +341,8 @@ class KGCorrelation(BinnedCorr2):
             raise TypeError("Can only add another KGCorrelation object")
         if not (self._nbins == other._nbins and
                 self.min_sep == other.min_sep and
-                self.max_sep == other.max_sep):
+                self.max_sep == other.max_sep and
+                np.array_equal(self.bin_edges, other.bin_edges)):
             raise ValueError("KGCorrelation to be added is not compatible with this one.")
 
         self._set_metric(other.metric, other.coords, other.coords)
@@ -387,12 +398,15 @@ class KGCorrelation(BinnedCorr2):
         if initialize:
             self.clear()
 
-        if not isinstance(cat1,list):
-            cat1 = cat1.get_patches(low_mem=low_mem)
-        if not isinstance(cat2,list):
-            cat2 = cat2.get_patches(low_mem=low_mem)
+        if self._use_patch_field(cat1, cat2, comm):
+            self._process_patch_field(cat1, cat2, metric, num_threads)
+        else:
+            if not isinstance(cat1,list):
+                cat1 = cat1.get_patches(low_mem=low_mem)
+            if not isinstance(cat2,list):
+                cat2 = cat2.get_patches(low_mem=low_mem)
 
-        self._process_all_cross(cat1, cat2, metric, num_threads, comm, low_mem)
+            self._process_all_cross(cat1, cat2, metric, num_threads, comm, low_mem)
 
         if finalize:
             vark = calculateVarK(cat1, low_mem=low_mem)
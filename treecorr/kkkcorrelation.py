@@ -142,6 +142,7 @@ class KKKCorrelation(BinnedCorr3):
                     self.min_u,self.max_u,self.nubins,self.ubin_size,self.bu,
                     self.min_v,self.max_v,self.nvbins,self.vbin_size,self.bv,
                     self.xperiod, self.yperiod, self.zperiod,
+                    self.max_accum_mem,
                     dp(self.zeta), dp(None), dp(None), dp(None),
                     dp(None), dp(None), dp(None), dp(None),
                     dp(self.meand1), dp(self.meanlogd1), dp(self.meand2), dp(self.meanlogd2),
@@ -241,7 +242,8 @@ class KKKCorrelation(BinnedCorr3):
                               coords=self.coords)
 
         self.logger.info('Starting %d jobs.',field.nTopLevelNodes)
-        _lib.ProcessAuto3(self.corr, field.data, self.output_dots,
+        sample = self._sample_cells(field)
+        _lib.ProcessAuto3(self.corr, field.data, self.output_dots, dp(self._progress), dp(sample),
                           field._d, self._coords, self._bintype, self._metric)
 
     @depr_pos_kwargs
@@ -290,8 +292,9 @@ class KKKCorrelation(BinnedCorr3):
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
         # Note: all 3 correlation objects are the same.  Thus, all triangles will be placed
         # into self.corr, whichever way the three catalogs are permuted for each triangle.
+        sample = self._sample_cells(f1)
         _lib.ProcessCross12(self.corr, self.corr, self.corr,
-                            f1.data, f2.data, self.output_dots,
+                            f1.data, f2.data, self.output_dots, dp(self._progress), dp(sample),
                             f1._d, f2._d, self._coords,
                             self._bintype, self._metric)
 
@@ -344,9 +347,11 @@ class KKKCorrelation(BinnedCorr3):
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
         # Note: all 6 correlation objects are the same.  Thus, all triangles will be placed
         # into self.corr, whichever way the three catalogs are permuted for each triangle.
+        sample = self._sample_cells(f1)
         _lib.ProcessCross3(self.corr, self.corr, self.corr,
                            self.corr, self.corr, self.corr,
                            f1.data, f2.data, f3.data, self.output_dots,
+                           dp(self._progress), dp(sample),
                            f1._d, f2._d, f3._d, self._coords, self._bintype, self._metric)
 
     def _finalize(self):
@@ -863,8 +868,9 @@ class KKKCrossCorrelation(BinnedCorr3):
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
         # Note: all 3 correlation objects are the same.  Thus, all triangles will be placed
         # into self.corr, whichever way the three catalogs are permuted for each triangle.
+        sample = self._sample_cells(f1)
         _lib.ProcessCross12(self.k1k2k3.corr, self.k2k1k3.corr, self.k2k3k1.corr,
-                            f1.data, f2.data, self.output_dots,
+                            f1.data, f2.data, self.output_dots, dp(self._progress), dp(sample),
                             f1._d, f2._d, self._coords,
                             self._bintype, self._metric)
 
@@ -916,10 +922,12 @@ class KKKCrossCorrelation(BinnedCorr3):
                             coords=self.coords)
 
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
+        sample = self._sample_cells(f1)
         _lib.ProcessCross3(self.k1k2k3.corr, self.k1k3k2.corr,
                            self.k2k1k3.corr, self.k2k3k1.corr,
                            self.k3k1k2.corr, self.k3k2k1.corr,
                            f1.data, f2.data, f3.data, self.output_dots,
+                           dp(self._progress), dp(sample),
                            f1._d, f2._d, f3._d, self._coords, self._bintype, self._metric)
 
     def _finalize(self):
@@ -985,6 +993,11 @@ class KKKCrossCorrelation(BinnedCorr3):
         for i, kkk in enumerate(self._all):
             kkk._sum([c._all[i] for c in others])
 
+    def _triplet_corrs(self):
+        for kkk in self._all:
+            kkk._set_metric(self.metric, self.coords)
+        return [kkk.corr for kkk in self._all]
+
     @depr_pos_kwargs
     def process(self, cat1, cat2, cat3=None, *, metric=None, num_threads=None,
                 comm=None, low_mem=False, initialize=True, finalize=True):
@@ -16,8 +16,11 @@
 """
 
 import numpy as np
+import os
+import hashlib
 
 from . import _lib, _ffi
+from ._version import __version__
 from .binnedcorr2 import BinnedCorr2
 from .util import double_ptr as dp
 from .util import make_writer, make_reader, lazy_property
@@ -120,9 +123,14 @@ class NNCorrelation(BinnedCorr2):
             self._corr = _lib.BuildCorr2(
                     self._d1, self._d2, self._bintype,
                     self._min_sep,self._max_sep,self._nbins,self._bin_size,self.b,
+                    dp(self._bin_edges), dp(self._bin_b),
                     self.min_rpar, self.max_rpar, self.xperiod, self.yperiod, self.zperiod,
+                    self.max_accum_mem, self.float_accum,
                     dp(None), dp(None), dp(None), dp(None),
                     dp(self.meanr),dp(self.meanlogr),dp(self.weight),dp(self.npairs))
+            _lib.SetSplitFactor2(self._corr, self._d1, self._d2, self._bintype,
+                                 self.split_factor)
+            self._set_min_size()
         return self._corr
 
     def __del__(self):
@@ -142,7 +150,8 @@ class NNCorrelation(BinnedCorr2):
                 self.sep_units == other.sep_units and
                 self.coords == other.coords and
                 self.bin_type == other.bin_type and
-                self.bin_slop == other.bin_slop and
+                np.array_equal(self.bin_edges, other.bin_edges) and
+                np.array_equal(self.bin_slop, other.bin_slop) and
                 self.min_rpar == other.min_rpar and
                 self.max_rpar == other.max_rpar and
                 self.xperiod == other.xperiod and
@@ -385,7 +394,8 @@ class NNCorrelation(BinnedCorr2):
             raise TypeError("Can only add another NNCorrelation object")
         if not (self._nbins == other._nbins and
                 self.min_sep == other.min_sep and
-                self.max_sep == other.max_sep):
+                self.max_sep == other.max_sep and
+                np.array_equal(self.bin_edges, other.bin_edges)):
             raise ValueError("NNCorrelation to be added is not compatible with this one.")
 
         self._set_metric(other.metric, other.coords, other.coords)
@@ -414,6 +424,12 @@ class NNCorrelation(BinnedCorr2):
             np.sum([c.npairs for c in others], axis=0, out=self.npairs)
         self.tot = tot
 
+    def _add_process_tot(self, c1, c2):
+        if c2 is None:
+            self.tot += 0.5 * c1.sumw**2
+        else:
+            self.tot += c1.sumw*c2.sumw
+
     def _add_tot(self, i, j, c1, c2):
         # When storing results from a patch-based run, tot needs to be accumulated even if
         # the total weight being accumulated comes out to be zero.
@@ -428,7 +444,7 @@ class NNCorrelation(BinnedCorr2):
 
     @depr_pos_kwargs
     def process(self, cat1, cat2=None, *, metric=None, num_threads=None, comm=None, low_mem=False,
-                initialize=True, finalize=True):
+                initialize=True, finalize=True, cache_dir=None):
         """Compute the correlation function.
 
         - If only 1 argument is given, then compute an auto-correlation function.
@@ -437,6 +453,13 @@ class NNCorrelation(BinnedCorr2):
         Both arguments may be lists, in which case all items in the list are used
         for that element of the correlation.
 
+        If cache_dir is given, the results (including the results for each pair of patches)
+        are saved in that directory, in a file whose name is a hash of the catalogs' positions,
+        weights and patches, the binning, the metric and bin_slop.  If the same calculation is
+        done again, the results are read from the file rather than recomputed.  This is mostly
+        useful for RR, which is often the most expensive part of the calculation, and is the
+        same for all the data catalogs that use the same randoms.
+
         Parameters:
             cat1 (Catalog):     A catalog or list of catalogs for the first N field.
             cat2 (Catalog):     A catalog or list of catalogs for the second N field, if any.
@@ -456,23 +479,101 @@ class NNCorrelation(BinnedCorr2):
                                 `BinnedCorr2.clear`.  (default: True)
             finalize (bool):    Whether to complete the calculation with a call to `finalize`.
                                 (default: True)
+            cache_dir (str):    A directory in which to save the results, or to read them from
+                                if they were already saved there. (default: None)
         """
+        if cache_dir is not None:
+            if not initialize or not finalize:
+                raise ValueError("cache_dir requires initialize=True and finalize=True")
+            file_name = self._cache_file_name(cache_dir, cat1, cat2, metric)
+            if os.path.exists(file_name):
+                self.logger.info("Reading cached results from %s",file_name)
+                self._read_cache(file_name, cat1, cat2, metric)
+                return
+
         if initialize:
             self.clear()
 
-        if not isinstance(cat1,list):
-            cat1 = cat1.get_patches(low_mem=low_mem)
-        if cat2 is not None and not isinstance(cat2,list):
-            cat2 = cat2.get_patches(low_mem=low_mem)
-
-        if cat2 is None or len(cat2) == 0:
-            self._process_all_auto(cat1, metric, num_threads, comm, low_mem)
+        if self._use_patch_field(cat1, cat2, comm):
+            self._process_patch_field(cat1, cat2, metric, num_threads)
         else:
-            self._process_all_cross(cat1, cat2, metric, num_threads, comm, low_mem)
+            if not isinstance(cat1,list):
+                cat1 = cat1.get_patches(low_mem=low_mem)
+            if cat2 is not None and not isinstance(cat2,list):
+                cat2 = cat2.get_patches(low_mem=low_mem)
+
+            if cat2 is None or len(cat2) == 0:
+                self._process_all_auto(cat1, metric, num_threads, comm, low_mem)
+            else:
+                self._process_all_cross(cat1, cat2, metric, num_threads, comm, low_mem)
 
         if finalize:
             self.finalize()
 
+        if cache_dir is not None and (comm is None or comm.Get_rank() == 0):
+            self.logger.info("Writing cached results to %s",file_name)
+            self._write_cache(file_name)
+
+    def _cache_file_name(self, cache_dir, cat1, cat2, metric):
+        # The cache file name is a hash of everything that determines the results.
+        if metric is None:
+            metric = self.config.get('metric', 'Euclidean')
+        h = hashlib.sha1()
+        def add(value):
+            if isinstance(value, np.ndarray):
+                h.update(str(value.dtype).encode())
+                h.update(np.ascontiguousarray(value).tobytes())
+            else:
+                h.update(repr(value).encode())
+        for value in [__version__, self.bin_type, self._min_sep, self._max_sep, self.nbins,
+                      self._bin_edges, self.bin_slop, self.min_rpar, self.max_rpar,
+                      self.xperiod, self.yperiod, self.zperiod, metric, self.brute,
+                      self.split_method, self.min_top, self.max_top]:
+            add(value)
+        for cat in [cat1, cat2]:
+            cats = cat if isinstance(cat, list) else [cat]
+            add(len(cats))
+            for c in cats:
+                if c is None: continue
+                # These are the things about each catalog that matter for NN.
+                for value in [c.coords, c.x, c.y, c.z, c.w, c.npatch, c.patch]:
+                    add(value)
+        return os.path.join(cache_dir, 'nn_%s.npz'%h.hexdigest())
+
+    def _write_cache(self, file_name):
+        # Write the patch results first, then the main results, since the existence of the
+        # latter is what indicates the cache is complete.  Write to temporary files and rename
+        # them, so other processes using the same cache_dir never see a partial file.
+        base = file_name[:-len('.npz')]
+        os.makedirs(os.path.dirname(file_name) or '.', exist_ok=True)
+        tmp = '%s.%d.tmp'%(base, os.getpid())
+        if len(self.results) > 0:
+            self.save_patch_results(tmp)
+            os.replace(tmp, base + '_patches.npz')
+        with open(tmp, 'wb') as fout:
+            np.savez(fout, meanr=self.meanr, meanlogr=self.meanlogr, weight=self.weight,
+                     npairs=self.npairs, tot=self.tot,
+                     npatch=np.array([self.npatch1, self.npatch2]),
+                     has_patches=len(self.results) > 0)
+        os.replace(tmp, file_name)
+
+    def _read_cache(self, file_name, cat1, cat2, metric):
+        self.clear()
+        c1 = cat1[0] if isinstance(cat1, list) else cat1
+        c2 = cat2[0] if isinstance(cat2, list) else cat2
+        self._set_metric(metric, c1.coords, None if c2 is None else c2.coords)
+        with np.load(file_name, allow_pickle=False) as data:
+            self.meanr[:] = data['meanr']
+            self.meanlogr[:] = data['meanlogr']
+            self.weight[:] = data['weight']
+            self.npairs[:] = data['npairs']
+            self.tot = float(data['tot'])
+            has_patches = bool(data['has_patches'])
+            npatch = [int(n) for n in data['npatch']]
+        if has_patches:
+            self.load_patch_results(file_name[:-len('.npz')] + '_patches.npz')
+        self.npatch1, self.npatch2 = npatch
+
     def _mean_weight(self):
         mean_np = np.mean(self.npairs)
         return 1 if mean_np == 0 else np.mean(self.weight)/mean_np
@@ -497,6 +598,99 @@ class NNCorrelation(BinnedCorr2):
         else:
             return self.tot
 
+    @depr_pos_kwargs
+    def periodic_rr(self, *, coords=None, tot=None):
+        r"""Calculate the expected RR for uniform randoms in a periodic box.
+
+        For the 'Periodic' metric with uniform randoms, RR doesn't need to be computed from a
+        random catalog.  The expected number of pairs in each bin is just the fraction of the
+        box volume (or area for flat coordinates) within the bin's shell (or cell for
+        ``bin_type='TwoD'``) around each point.  The returned object can be used as the rr
+        argument of `calculateXi`.
+
+        The maximum separation must be at most half of the smallest period, so each pair
+        only appears once in the bins.
+
+        Parameters:
+            coords (str):   The kind of coordinates, 'flat' or '3d'. (default: the coordinates
+                            used to process this object)
+            tot (float):    The tot value to use for the returned object.  (default: 1.e6 times
+                            the tot of this object, as though the randoms had 1000 times as
+                            many points as the data, so they add negligibly to the shot noise)
+
+        Returns:
+            rr (NNCorrelation): The expected RR with weight, npairs, meanr and meanlogr set.
+        """
+        if coords is None:
+            coords = self.coords
+        if coords not in ['flat', '3d']:
+            raise ValueError("periodic_rr requires coords='flat' or '3d'")
+        periods = [self.xperiod, self.yperiod]
+        if coords == '3d':
+            periods.append(self.zperiod)
+        if np.any(np.array(periods) == 0):
+            raise ValueError("periodic_rr requires setting the period to use.")
+        if tot is None:
+            if self.tot == 0:
+                raise ValueError("tot is required if this object has not been processed.")
+            tot = 1.e6 * self.tot
+        if self.bin_type == 'TwoD':
+            if coords != 'flat':
+                raise ValueError("TwoD binning is only valid with flat coordinates.")
+            max_r = self._max_sep * np.sqrt(2.)
+        else:
+            max_r = self._max_sep
+        if max_r > 0.5 * np.min(periods):
+            raise ValueError("periodic_rr requires the maximum separation to be at most half "
+                             "of the period.")
+
+        rr = self.copy()
+        rr._clear()
+        rr.results = {}
+        rr.npatch1 = rr.npatch2 = 1
+        rr.coords = coords
+        rr.metric = 'Periodic'
+        rr.tot = tot
+        box = np.prod(periods)
+
+        if self.bin_type == 'TwoD':
+            # The area of each cell outside of the min_sep disk.
+            x1 = self.left_edges * self._sep_units
+            x2 = self.right_edges * self._sep_units
+            y1 = self.bottom_edges * self._sep_units
+            y2 = self.top_edges * self._sep_units
+            area = (x2-x1) * (y2-y1)
+            R = self._min_sep
+            if R > 0:
+                def H(a):
+                    return 0.5 * (a*np.sqrt(R**2-a**2) + R**2*np.arcsin(a/R))
+                def G(x, y):
+                    # The area of the disk with 0 < X < x, 0 < Y < y, signed by quadrant.
+                    ax = np.minimum(np.abs(x), R)
+                    ay = np.minimum(np.abs(y), R)
+                    a = np.minimum(ax, np.sqrt(R**2-ay**2))
+                    return np.sign(x) * np.sign(y) * (ay*a + H(ax) - H(a))
+                area -= G(x2,y2) - G(x1,y2) - G(x2,y1) + G(x1,y1)
+            rr.weight[:] = tot * area / box
+            # Just use the nominal values for the means.
+            rr.meanr[:] = self.rnom
+            rr.meanlogr[:] = self.logr
+        else:
+            # The volume of each shell, and the means of r and log(r) over it.
+            dim = len(periods)
+            r1 = self.left_edges * self._sep_units
+            r2 = self.right_edges * self._sep_units
+            def I(r, n):
+                # int_0^r x^(n-1) log(x) dx
+                logr = np.log(np.where(r > 0, r, 1.))
+                return r**n * (logr - 1./n) / n
+            vol = (r2**dim - r1**dim) / dim
+            rr.weight[:] = tot * (2.*np.pi if dim == 2 else 4.*np.pi) * vol / box
+            rr.meanr[:] = (r2**(dim+1) - r1**(dim+1)) / (dim+1) / vol / self._sep_units
+            rr.meanlogr[:] = (I(r2, dim) - I(r1, dim)) / vol - self._log_sep_units
+        rr.npairs[:] = rr.weight
+        return rr
+
     @depr_pos_kwargs
     def calculateXi(self, *, rr, dr=None, rd=None):
         r"""Calculate the correlation function given another correlation function of random
@@ -654,7 +848,7 @@ class NNCorrelation(BinnedCorr2):
         return self.xi, self.varxi
 
     def _calculate_xi_from_pairs(self, pairs):
-        self._sum([self.results[ij] for ij in pairs])
+        self._sum_results(pairs)
         self._finalize()
         if self._rr is None:
             return
@@ -663,7 +857,7 @@ class NNCorrelation(BinnedCorr2):
             # This is the usual case.  R has patches just like D.
             # Calculate rr and rrf in the normal way based on the same pairs as used for DD.
             pairs1 = [ij for ij in pairs if self._rr._ok[ij[0],ij[1]]]
-            self._rr._sum([self._rr.results[ij] for ij in pairs1])
+            self._rr._sum_results(pairs1)
             dd_tot = self.tot
         else:
             # In this case, R was not run with patches.
@@ -690,7 +884,7 @@ class NNCorrelation(BinnedCorr2):
                 pairs2 = [(ij[0],0) for ij in pairs if ij[0] == ij[1]]
             else:
                 pairs2 = [ij for ij in pairs if self._dr._ok[ij[0],ij[1]]]
-            self._dr._sum([self._dr.results[ij] for ij in pairs2])
+            self._dr._sum_results(pairs2)
             dr = self._dr.weight
             drf = dd_tot / self._dr.tot
         if self._rd is not None:
@@ -699,7 +893,7 @@ class NNCorrelation(BinnedCorr2):
                 pairs3 = [(0,ij[1]) for ij in pairs if ij[0] == ij[1]]
             else:
                 pairs3 = [ij for ij in pairs if self._rd._ok[ij[0],ij[1]]]
-            self._rd._sum([self._rd.results[ij] for ij in pairs3])
+            self._rd._sum_results(pairs3)
             rd = self._rd.weight
             rdf = dd_tot / self._rd.tot
         denom = rr * rrf
@@ -141,6 +141,7 @@ class NNNCorrelation(BinnedCorr3):
                     self.min_u,self.max_u,self.nubins,self.ubin_size,self.bu,
                     self.min_v,self.max_v,self.nvbins,self.vbin_size,self.bv,
                     self.xperiod, self.yperiod, self.zperiod,
+                    self.max_accum_mem,
                     dp(None), dp(None), dp(None), dp(None),
                     dp(None), dp(None), dp(None), dp(None),
                     dp(self.meand1), dp(self.meanlogd1), dp(self.meand2), dp(self.meanlogd2),
@@ -280,7 +281,8 @@ class NNNCorrelation(BinnedCorr3):
                               coords=self.coords)
 
         self.logger.info('Starting %d jobs.',field.nTopLevelNodes)
-        _lib.ProcessAuto3(self.corr, field.data, self.output_dots,
+        sample = self._sample_cells(field)
+        _lib.ProcessAuto3(self.corr, field.data, self.output_dots, dp(self._progress), dp(sample),
                           field._d, self._coords, self._bintype, self._metric)
         self.tot += (1./6.) * cat.sumw**3
 
@@ -330,8 +332,9 @@ class NNNCorrelation(BinnedCorr3):
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
         # Note: all 3 correlation objects are the same.  Thus, all triangles will be placed
         # into self.corr, whichever way the three catalogs are permuted for each triangle.
+        sample = self._sample_cells(f1)
         _lib.ProcessCross12(self.corr, self.corr, self.corr,
-                            f1.data, f2.data, self.output_dots,
+                            f1.data, f2.data, self.output_dots, dp(self._progress), dp(sample),
                             f1._d, f2._d, self._coords,
                             self._bintype, self._metric)
         self.tot += cat1.sumw * cat2.sumw**2 / 2.
@@ -385,12 +388,91 @@ class NNNCorrelation(BinnedCorr3):
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
         # Note: all 6 correlation objects are the same.  Thus, all triangles will be placed
         # into self.corr, whichever way the three catalogs are permuted for each triangle.
+        sample = self._sample_cells(f1)
         _lib.ProcessCross3(self.corr, self.corr, self.corr,
                            self.corr, self.corr, self.corr,
                            f1.data, f2.data, f3.data, self.output_dots,
+                           dp(self._progress), dp(sample),
                            f1._d, f2._d, f3._d, self._coords, self._bintype, self._metric)
         self.tot += cat1.sumw * cat2.sumw * cat3.sumw
 
+    def process_multipole(self, cat, *, max_n=30, nsub=4, metric=None, num_threads=None):
+        """Process a single catalog, accumulating the auto-correlation using the multipole
+        algorithm rather than the usual triangle-tree recursion.
+
+        Each object is taken in turn as the vertex between the two shortest sides of its
+        triangles.  Its neighbors are binned in radius, and each radial bin accumulates the
+        multipoles of the neighbors' position angles around the vertex, up to order ``max_n``.
+        The products of these multipoles for each pair of radial bins are summed over all the
+        vertices, and only at the end are they converted to the distribution of the opening
+        angle, and thus into the usual (r,u,v) bins.  So the cost scales as the number of
+        pairs within max_sep rather than the number of triangles, which is much faster for
+        dense catalogs.
+
+        The result is an approximation to what `process_auto` would calculate.  The radial
+        bins are ``nsub`` times smaller than the r bins (or the u bins if those are smaller),
+        and the triangles with two given radial bins are spread over the values of u they can
+        have.  The opening angle is only resolved to about 2pi/max_n.  With the defaults,
+        the number of triangles in each bin is typically within a few percent of the direct
+        calculation, and the totals over all the u and v bins for each r are much closer
+        than that.
+
+        This is currently only implemented for flat coordinates with the Euclidean metric.
+
+        Like `process_auto`, this accumulates the weighted sums into the bins, but does not
+        finalize the calculation.
+
+        Parameters:
+            cat (Catalog):      The catalog to process
+            max_n (int):        The maximum order of the multipoles. (default: 30)
+            nsub (int):         The number of radial bins for each r (or u) bin. (default: 4)
+            metric (str):       Which metric to use.  See `Metrics` for details.
+                                (default: 'Euclidean'; this value can also be given in the
+                                constructor in the config dict.)
+            num_threads (int):  How many OpenMP threads to use during the calculation.
+                                (default: use the number of cpu cores; this value can also be given
+                                in the constructor in the config dict.)
+        """
+        if cat.name == '':
+            self.logger.info('Starting process NNN multipole auto-correlations')
+        else:
+            self.logger.info('Starting process NNN multipole auto-correlations for cat %s.',
+                             cat.name)
+
+        self._set_metric(metric, cat.coords)
+        if self.coords != 'flat' or self.metric != 'Euclidean':
+            raise ValueError("process_multipole is only implemented for flat coordinates "
+                             "with the Euclidean metric")
+        if max_n < 0:
+            raise ValueError("max_n must be >= 0")
+        if nsub < 1:
+            raise ValueError("nsub must be >= 1")
+        self._set_num_threads(num_threads)
+        min_size, max_size = self._get_minmax_size()
+
+        field = cat.getNField(min_size=min_size, max_size=max_size,
+                              split_method=self.split_method, brute=bool(self.brute),
+                              min_top=self.min_top, max_top=self.max_top,
+                              coords=self.coords)
+
+        # Neighbors are only split into smaller cells if they are larger than b times their
+        # distance from the vertex.
+        b = 0. if self.brute else min(self.b, self.bu, self.bv)
+        mp = _lib.BuildMultipole3(self._min_sep, self._max_sep, self.nbins, self._bin_size, b,
+                                  self.min_u, self.max_u, self.nubins, self.ubin_size,
+                                  self.min_v, self.max_v, self.nvbins, self.vbin_size,
+                                  max_n, nsub, bool(cat.nontrivial_w))
+        try:
+            _lib.ProcessMultipole3(mp, field.data, self.output_dots, self._coords)
+            _lib.Multipole3ToBins(mp, dp(self.meand1), dp(self.meanlogd1),
+                                  dp(self.meand2), dp(self.meanlogd2),
+                                  dp(self.meand3), dp(self.meanlogd3),
+                                  dp(self.meanu), dp(self.meanv),
+                                  dp(self.weight), dp(self.ntri))
+        finally:
+            _lib.DestroyMultipole3(mp)
+        self.tot += (1./6.) * cat.sumw**3
+
     def _finalize(self):
         mask1 = self.weight != 0
         mask2 = self.weight == 0
@@ -470,6 +552,9 @@ class NNNCorrelation(BinnedCorr3):
             np.sum([c.ntri for c in others], axis=0, out=self.ntri)
         self.tot = tot
 
+    def _add_process_tot(self, c1, c2, c3):
+        self.tot += c1.sumw * c2.sumw * c3.sumw
+
     def _add_tot(self, i, j, k, c1, c2, c3):
         # When storing results from a patch-based run, tot needs to be accumulated even if
         # the total weight being accumulated comes out to be zero.
@@ -484,6 +569,18 @@ class NNNCorrelation(BinnedCorr3):
         # the resulting weight is zero.
         self.results[(i,j,k)] = self._zero_copy(tot)
 
+    def _sample_tot(self, first):
+        # Each group of the sampled cells has the full tot, so only keep it for the first one.
+        if not first:
+            self.tot = 0.
+            for c in self.results.values():
+                c.tot = 0.
+
+    def _sample_stat(self):
+        # Without the random catalogs, the statistic for each group is just the weight, scaled
+        # to be an estimate of the full weight.
+        return self.weight.ravel() * self.sample_groups, np.ones(self.weight.size, dtype=bool)
+
     def __iadd__(self, other):
         """Add a second `NNNCorrelation`'s data to this one.
 
@@ -610,6 +707,116 @@ class NNNCorrelation(BinnedCorr3):
         else:
             return self.tot
 
+    @depr_pos_kwargs
+    def periodic_rrr(self, *, coords=None, tot=None):
+        r"""Calculate the expected RRR for uniform randoms in a periodic box.
+
+        For the 'Periodic' metric with uniform randoms, RRR doesn't need to be computed from a
+        random catalog.  With the triangle sides :math:`d_1 \geq d_2 \geq d_3`, the number of
+        configurations of the other two points around each point is
+        :math:`8\pi^2 d_1 d_2 d_3\, dd_1 dd_2 dd_3` in 3d, and
+        :math:`2\pi d_1 d_2 d_3 / A\, dd_1 dd_2 dd_3` in 2d, where :math:`A` is the area of the
+        triangle.  This is integrated over each bin in r, u, v, with the triangles split equally
+        between positive and negative v.  The returned object can be used as the rrr argument
+        of `calculateZeta` for an auto-correlation.
+
+        The maximum separation must be at most a quarter of the smallest period, so the largest
+        side of every triangle is at most half of the period.
+
+        Parameters:
+            coords (str):   The kind of coordinates, 'flat' or '3d'. (default: the coordinates
+                            used to process this object)
+            tot (float):    The tot value to use for the returned object.  (default: 1.e9 times
+                            the tot of this object, as though the randoms had 1000 times as
+                            many points as the data, so they add negligibly to the shot noise)
+
+        Returns:
+            rrr (NNNCorrelation):   The expected RRR with weight, ntri and the means set.
+        """
+        if coords is None:
+            coords = self.coords
+        if coords not in ['flat', '3d']:
+            raise ValueError("periodic_rrr requires coords='flat' or '3d'")
+        periods = [self.xperiod, self.yperiod]
+        if coords == '3d':
+            periods.append(self.zperiod)
+        if np.any(np.array(periods) == 0):
+            raise ValueError("periodic_rrr requires setting the period to use.")
+        if tot is None:
+            if self.tot == 0:
+                raise ValueError("tot is required if this object has not been processed.")
+            tot = 1.e9 * self.tot
+        if self._max_sep > 0.25 * np.min(periods):
+            raise ValueError("periodic_rrr requires max_sep to be at most a quarter of the "
+                             "period.")
+
+        rrr = self.copy()
+        rrr._clear()
+        rrr.results = {}
+        rrr.npatch1 = rrr.npatch2 = rrr.npatch3 = 1
+        rrr.coords = coords
+        rrr.metric = 'Periodic'
+        rrr.tot = tot
+        box = np.prod(periods)
+
+        # The configurations factor into a function of r = d2 times a function of u, v.
+        # The r part is r^(n-1) dr with n = 4 in 2d and 6 in 3d.
+        n = 4 if coords == 'flat' else 6
+        r = self.min_sep * self._sep_units * np.exp(self.bin_size * np.arange(self.nbins+1))
+        logr = np.log(r)
+        r1, r2 = r[:-1], r[1:]
+        wr = (r2**n - r1**n) / n
+        meanr = (r2**(n+1) - r1**(n+1)) / (n+1) / wr
+        meanlogr = (r2**n * (logr[1:] - 1./n) - r1**n * (logr[:-1] - 1./n)) / n / wr
+
+        # The u, v part is done with Gauss-Legendre quadrature in u and t = sqrt(1-v),
+        # which removes the 1/sqrt(1-v) singularity in 2d.
+        x, wx = np.polynomial.legendre.leggauss(8)
+        def nodes(edges):
+            lo = edges[:-1,np.newaxis]
+            hi = edges[1:,np.newaxis]
+            return 0.5*(hi+lo) + 0.5*(hi-lo)*x, 0.5*(hi-lo)*wx
+        u, wu = nodes(self.min_u + self.ubin_size * np.arange(self.nubins+1))
+        t, wt = nodes(np.sqrt(1. - self.min_v - self.vbin_size * np.arange(self.nvbins+1)))
+        u = u[:,:,np.newaxis,np.newaxis]
+        wu = wu[:,:,np.newaxis,np.newaxis]
+        t = t[np.newaxis,np.newaxis,:,:]
+        wt = np.abs(wt[np.newaxis,np.newaxis,:,:])
+        v = 1. - t**2
+        if coords == 'flat':
+            g = 2.*np.pi * 8.*u*(1.+u*v) / np.sqrt((1.+v) * (2.+u+u*v) * (2.-u+u*v))
+        else:
+            g = 8.*np.pi**2 * u**2 * (1.+u*v) * 2.*t
+        g = g * wu * wt
+        wuv = np.sum(g, axis=(1,3))
+        def mean(f):
+            return np.sum(f*g, axis=(1,3)) / wuv
+        meanu = mean(u)
+        meanlogu = mean(np.log(u))
+        meanv = mean(v)
+        mean1uv = mean(1.+u*v)
+        meanlog1uv = mean(np.log(1.+u*v))
+
+        # Each unordered triangle has one labeling with d1 >= d2 >= d3, and tot is N^3/6.
+        # Half of them go to each sign of v.
+        nv = self.nvbins
+        pos = slice(nv, 2*nv)
+        neg = slice(nv-1, None, -1)
+        for vslice, sign in [(pos, 1.), (neg, -1.)]:
+            rrr.weight[:,:,vslice] = 3. * tot * wr[:,None,None] * wuv[None,:,:] / box**2
+            rrr.meand2[:,:,vslice] = meanr[:,None,None] / self._sep_units
+            rrr.meanlogd2[:,:,vslice] = meanlogr[:,None,None] - self._log_sep_units
+            rrr.meand3[:,:,vslice] = (meanr[:,None,None] * meanu[None,:,:]) / self._sep_units
+            rrr.meanlogd3[:,:,vslice] = (meanlogr[:,None,None] + meanlogu[None,:,:]
+                                         - self._log_sep_units)
+            rrr.meand1[:,:,vslice] = (meanr[:,None,None] * mean1uv[None,:,:]) / self._sep_units
+            rrr.meanlogd1[:,:,vslice] = (meanlogr[:,None,None] + meanlog1uv[None,:,:]
+                                         - self._log_sep_units)
+            rrr.meanu[:,:,vslice] = meanu[None,:,:]
+            rrr.meanv[:,:,vslice] = sign * meanv[None,:,:]
+        rrr.ntri[:] = rrr.weight
+        return rrr
+
     @depr_pos_kwargs
     def calculateZeta(self, *, rrr, drr=None, rdd=None):
         r"""Calculate the 3pt function given another 3pt function of random
@@ -1226,8 +1433,9 @@ class NNNCrossCorrelation(BinnedCorr3):
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
         # Note: all 3 correlation objects are the same.  Thus, all triangles will be placed
         # into self.corr, whichever way the three catalogs are permuted for each triangle.
+        sample = self._sample_cells(f1)
         _lib.ProcessCross12(self.n1n2n3.corr, self.n2n1n3.corr, self.n2n3n1.corr,
-                            f1.data, f2.data, self.output_dots,
+                            f1.data, f2.data, self.output_dots, dp(self._progress), dp(sample),
                             f1._d, f2._d, self._coords,
                             self._bintype, self._metric)
         tot = cat1.sumw * cat2.sumw**2 / 2.
@@ -1284,10 +1492,12 @@ class NNNCrossCorrelation(BinnedCorr3):
                             coords=self.coords)
 
         self.logger.info('Starting %d jobs.',f1.nTopLevelNodes)
+        sample = self._sample_cells(f1)
         _lib.ProcessCross3(self.n1n2n3.corr, self.n1n3n2.corr,
                            self.n2n1n3.corr, self.n2n3n1.corr,
                            self.n3n1n2.corr, self.n3n2n1.corr,
                            f1.data, f2.data, f3.data, self.output_dots,
+                           dp(self._progress), dp(sample),
                            f1._d, f2._d, f3._d, self._coords, self._bintype, self._metric)
         tot = cat1.sumw * cat2.sumw * cat3.sumw
         for nnn in self._all:
@@ -1339,6 +1549,12 @@ class NNNCrossCorrelation(BinnedCorr3):
         for nnn,o_nnn in zip(self._all, other_all):
             nnn._sum(o_nnn)
 
+    def _add_process_tot(self, c1, c2, c3):
+        tot = c1.sumw * c2.sumw * c3.sumw
+        for nnn in self._all:
+            nnn.tot += tot
+        self.tot += tot
+
     def _add_tot(self, i, j, k, c1, c2, c3):
         tot = c1.sumw * c2.sumw * c3.sumw
         self.tot += tot
@@ -1346,6 +1562,25 @@ class NNNCrossCorrelation(BinnedCorr3):
             c.tot += tot
         self.results[(i,j,k)] = self._zero_copy(tot)
 
+    def _triplet_corrs(self):
+        for nnn in self._all:
+            nnn._set_metric(self.metric, self.coords)
+        return [nnn.corr for nnn in self._all]
+
+    def _sample_tot(self, first):
+        if not first:
+            self.tot = 0.
+            for c in self._all:
+                c.tot = 0.
+            for r in self.results.values():
+                r.tot = 0.
+                for c in r._all:
+                    c.tot = 0.
+
+    def _sample_stat(self):
+        stat = np.concatenate([nnn.weight.ravel() for nnn in self._all]) * self.sample_groups
+        return stat, np.ones(stat.size, dtype=bool)
+
     def __iadd__(self, other):
         """Add a second `NNNCrossCorrelation`'s data to this one.
 
@@ -26,6 +26,7 @@ read a dictionary of arrays. This does not cause problems here, since both are
 indexed by string, but may prevent usage elsewhere. If so we could convert them to
 both provide dicts.
 """
+import os
 import numpy as np
 
 class AsciiReader(object):
@@ -47,6 +48,9 @@ class AsciiReader(object):
         self.comment_marker = comment_marker
         self.nrows = None
         self._file = None
+        # The file positions of data rows we have already found, keyed by row number.
+        self._row_pos = {}
+        self._row_pos_stat = None
 
     @property
     def file(self):
@@ -54,6 +58,21 @@ class AsciiReader(object):
             raise RuntimeError('Illegal operation when not in a "with" context')
         return self._file
 
+    def _seek_row(self, row):
+        # Position the file at the start of the given data row (not counting the comment rows).
+        # This starts from the nearest earlier row whose position we already know, so reading
+        # a file in consecutive chunks doesn't go back to the start of the file for each one.
+        known = [r for r in self._row_pos if r <= row]
+        if known:
+            r = max(known)
+            self.file.seek(self._row_pos[r])
+        else:
+            r = -self.comment_rows
+            self.file.seek(0)
+        while r < row and self.file.readline():
+            r += 1
+        self._row_pos[row] = self.file.tell()
+
     def __contains__(self, ext):
         """Check if ext is None.
 
@@ -95,7 +114,8 @@ class AsciiReader(object):
 
         # Figure out how many rows to skip at the start
         if isinstance(s, slice) and s.start is not None:
-            skiprows = self.comment_rows + s.start
+            self._seek_row(s.start)
+            skiprows = 0
         else:
             skiprows = self.comment_rows
 
@@ -251,6 +271,12 @@ class AsciiReader(object):
                 raise OSError('Unable to parse the input catalog as a numpy array')
             self.ncols = data.shape[0]
 
+        # The positions we found last time are only still valid if the file hasn't changed.
+        stat = os.stat(self.file_name)
+        if self._row_pos_stat != (stat.st_size, stat.st_mtime):
+            self._row_pos = {}
+            self._row_pos_stat = (stat.st_size, stat.st_mtime)
+
         self._file = open(self.file_name, 'r')
         return self
 
@@ -298,7 +324,8 @@ class PandasReader(AsciiReader):
 
         # Figure out how many rows to skip at the start
         if isinstance(s, slice) and s.start is not None:
-            skiprows = self.comment_rows + s.start
+            self._seek_row(s.start)
+            skiprows = 0
         else:
             skiprows = self.comment_rows
 
@@ -344,7 +371,11 @@ class PandasReader(AsciiReader):
             return {col : df.loc[:,icols[i]].to_numpy() for i,col in enumerate(cols)}
 
 class ParquetReader():
-    """Reader interface for Parquet files using pandas.
+    """Reader interface for Parquet files using pyarrow.
+
+    Only the requested columns and the row groups that overlap the requested rows are read,
+    and pyarrow decodes them in parallel.  Numeric columns without nulls are returned as numpy
+    views of the Arrow buffers, rather than being copied again.
     """
     can_slice = True
     default_ext = None
@@ -353,25 +384,24 @@ class ParquetReader():
         """
         Parameters:
             file_name (str):        The file name
-            delimiter (str):        What delimiter to use between values.  (default: None,
-                                    which means any whitespace)
-            comment_marker (str):   What token indicates a comment line. (default: '#')
+            delimiter (str):        Not used for Parquet files.
+            comment_marker (str):   Not used for Parquet files.
         """
         try:
-            import pandas
+            import pyarrow.parquet  # noqa: F401
         except ImportError:
             if logger:
-                logger.error("Unable to import pandas.  Cannot read %s"%file_name)
+                logger.error("Unable to import pyarrow.  Cannot read %s"%file_name)
             raise
 
         self.file_name = file_name
-        self._df = None
+        self._file = None
 
     @property
-    def df(self):
-        if self._df is None:
+    def file(self):
+        if self._file is None:
             raise RuntimeError('Illegal operation when not in a "with" context')
-        return self._df
+        return self._file
 
     def __contains__(self, ext):
         """Check if ext is None.
@@ -390,7 +420,7 @@ class ParquetReader():
     def check_valid_ext(self, ext):
         """Check if an extension is valid for reading, and raise ValueError if not.
 
-        None is the only valid extension for ASCII files.
+        None is the only valid extension for Parquet files.
 
         Parameters:
             ext (str):  The extension to check
@@ -407,12 +437,46 @@ class ParquetReader():
             ext (str):          The extension (ignored)
 
         Returns:
-            The data as a recarray or simple numpy array as appropriate
+            The data as a dict of numpy arrays or a simple numpy array as appropriate
         """
         if np.isscalar(cols):
-            return self.df[cols][s].to_numpy()
+            return self._read([cols], s)[cols]
         else:
-            return self.df[cols][s].to_records()
+            return self._read(cols, s)
+
+    def _read(self, cols, s):
+        # Find the row groups that overlap the selected rows.
+        meta = self.file.metadata
+        if isinstance(s, slice):
+            start, stop, step = s.indices(meta.num_rows)
+        else:
+            s = np.asarray(s, dtype=int)
+            start = np.min(s) if len(s) > 0 else 0
+            stop = np.max(s)+1 if len(s) > 0 else 0
+        row_groups = []
+        first_row = row = 0
+        for i in range(meta.num_row_groups):
+            n = meta.row_group(i).num_rows
+            if row < stop and row + n > start:
+                if len(row_groups) == 0:
+                    first_row = row
+                row_groups.append(i)
+            row += n
+
+        if len(row_groups) > 0:
+            table = self.file.read_row_groups(row_groups, columns=list(cols), use_threads=True)
+        else:
+            table = self.file.schema_arrow.empty_table().select(list(cols))
+        data = {}
+        for c in cols:
+            # This is a view of the Arrow buffer if the column is a single chunk with no nulls.
+            # Otherwise it makes a copy.
+            a = table.column(c).to_numpy()
+            if isinstance(s, slice):
+                data[c] = a[start-first_row:stop-first_row:step]
+            else:
+                data[c] = a[s-first_row]
+        return data
 
     def row_count(self, col=None, ext=None):
         """Count the number of rows in the named extension and column
@@ -426,7 +490,7 @@ class ParquetReader():
         Returns:
             The number of rows
         """
-        return len(self.df)
+        return self.file.metadata.num_rows
 
     def names(self, ext=None):
         """Return a list of the names of all the columns in an extension
@@ -437,28 +501,38 @@ class ParquetReader():
         Returns:
             A list of string column names
         """
-        return self.df.columns
+        return self.file.schema_arrow.names
 
     def __enter__(self):
-        import pandas
-        self._df = pandas.read_parquet(self.file_name)
+        import pyarrow.parquet
+        # This only reads the metadata.  The columns are read as needed.
+        self._file = pyarrow.parquet.ParquetFile(self.file_name)
         return self
 
     def __exit__(self, exc_type, exc_value, exc_traceback):
-        # free the memory in the dataframe at end of "with" statement
-        self._df = None
+        # Release the file at end of "with" statement
+        self._file = None
 
 
 class FitsReader(object):
     """Reader interface for FITS files.
     Uses fitsio to read columns, etc.
+
+    With use_mmap=True, columns of uncompressed binary tables are returned as read-only
+    views of a memory map of the file rather than being read into new arrays.  Columns that
+    cannot be mapped directly (e.g. scaled or variable-length columns, or compressed files)
+    are read normally.  Note that the columns of a FITS table are stored row by row in
+    big-endian order, so the views are strided and usually need to be converted before use.
     """
     default_ext = 1
 
-    def __init__(self, file_name, logger=None):
+    def __init__(self, file_name, logger=None, use_mmap=False):
         """
         Parameters:
             file_name (str):    The file name
+            logger:             A logger to use for errors (default: None)
+            use_mmap (bool):    Whether to return memory-mapped views of the columns when
+                                possible. (default: False)
         """
         try:
             import fitsio
@@ -471,6 +545,8 @@ class FitsReader(object):
 
         # record file name to know what to open when entering
         self.file_name = file_name
+        self.use_mmap = use_mmap
+        self._tables = {}
 
         # There is a bug in earlier fitsio versions that prevents slicing
         self.can_slice = fitsio.__version__ > '1.0.6'
@@ -539,8 +615,59 @@ class FitsReader(object):
             The data as a recarray or simple numpy array as appropriate
         """
         ext = self._update_ext(ext)
+        if self.use_mmap:
+            table = self._mmap_table(ext)
+            if table is not None:
+                if np.isscalar(cols):
+                    if cols in table.dtype.names:
+                        return table[cols][s]
+                elif all(c in table.dtype.names for c in cols):
+                    return {c : table[c][s] for c in cols}
         return self.file[ext][cols][s]
 
+    def _mmap_table(self, ext):
+        # Return a structured memmap of the rows of the given table with the columns that can
+        # be viewed directly, or None if the table cannot be memory mapped.
+        import fitsio
+
+        if ext in self._tables:
+            return self._tables[ext]
+        table = None
+        hdu = self.file[ext]
+        with open(self.file_name, 'rb') as f:
+            # A compressed (e.g. gzipped) file doesn't start with the primary header.
+            is_plain = f.read(6) == b'SIMPLE'
+        header = hdu.read_header()
+        if (is_plain and isinstance(hdu, fitsio.hdu.TableHDU)
+                and not isinstance(hdu, fitsio.hdu.AsciiTableHDU)
+                and 'ZTABLE' not in header and hdu.get_nrows() > 0):
+            dtype, offsets, isvar = hdu.get_rec_dtype()
+            row_size = header['NAXIS1']
+            # Variable-length columns are stored as descriptors, so the in-memory layout
+            # doesn't match the file.  Likewise if the row size doesn't add up.
+            if not np.any(isvar) and dtype.itemsize == row_size:
+                names = []
+                formats = []
+                col_offsets = []
+                for i, name in enumerate(dtype.names):
+                    n = i+1
+                    col_dtype = dtype.fields[name][0]
+                    # Scaled columns (including unsigned ints) and logicals need conversion.
+                    if ('TSCAL%d'%n in header or 'TZERO%d'%n in header
+                            or col_dtype.base.kind not in 'iuf'):
+                        continue
+                    names.append(name)
+                    formats.append(col_dtype.newbyteorder('>'))
+                    col_offsets.append(dtype.fields[name][1])
+                if len(names) > 0:
+                    row_dtype = np.dtype({'names': names, 'formats': formats,
+                                          'offsets': col_offsets, 'itemsize': row_size})
+                    data_start = hdu.get_offsets()[1]
+                    table = np.memmap(self.file_name, mode='r', dtype=row_dtype,
+                                      offset=data_start, shape=(hdu.get_nrows(),))
+        self._tables[ext] = table
+        return table
+
     def read_params(self, ext=None):
         """Read the params in the given extension, if any.
 
@@ -607,20 +734,30 @@ class FitsReader(object):
         # regardless of the error
         self.file.close()
         self._file = None
+        # Any views returned from the memory maps remain valid after this.
+        self._tables = {}
 
 
 class HdfReader(object):
     """Reader interface for HDF5 files.
     Uses h5py to read columns, etc.
+
+    With use_mmap=True, contiguous (i.e. not chunked or compressed) datasets are returned as
+    read-only views of a memory map of the file rather than being read into new arrays.
+    Several processes reading the same file then share the operating system's cached copy
+    of it.  Other datasets are read normally.
     """
     # h5py can always accept slices as indices
     can_slice = True
     default_ext = '/'
 
-    def __init__(self, file_name, logger=None):
+    def __init__(self, file_name, logger=None, use_mmap=False):
         """
         Parameters:
             file_name (str):    The file name
+            logger:             A logger to use for errors (default: None)
+            use_mmap (bool):    Whether to return memory-mapped views of the datasets when
+                                possible. (default: False)
         """
         try:
             import h5py
@@ -631,6 +768,7 @@ class HdfReader(object):
 
         self._file = None  # Only works inside a with block.
         self.file_name = file_name
+        self.use_mmap = use_mmap
 
     @property
     def file(self):
@@ -685,9 +823,23 @@ class HdfReader(object):
         """
         g = self._group(ext)
         if np.isscalar(cols):
-            return g[cols][s]
+            return self._column(g[cols])[s]
         else:
-            return {col : g[col][s] for col in cols}
+            return {col : self._column(g[col])[s] for col in cols}
+
+    def _column(self, dataset):
+        # Return a memmap of the dataset if possible, else the dataset itself.
+        if not self.use_mmap:
+            return dataset
+        if dataset.chunks is not None or dataset.dtype.hasobject or dataset.size == 0:
+            return dataset
+        if getattr(dataset, 'external', None):
+            return dataset
+        offset = dataset.id.get_offset()
+        if offset is None:
+            return dataset
+        return np.memmap(self.file_name, mode='r', dtype=dataset.dtype,
+                         offset=offset, shape=dataset.shape)
 
     def read_params(self, ext=None):
         """Read the params in the given extension, if any.
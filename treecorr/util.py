@@ -21,6 +21,7 @@ import coord
 import functools
 import inspect
 import warnings
+import time
 
 from . import _lib, _ffi, Rperp_alias
 from .writer import AsciiWriter, FitsWriter, HdfWriter
@@ -86,6 +87,190 @@ def get_omp_threads():
     """
     return _lib.GetOMPThreads()
 
+def set_thread_affinity(policy):
+    """Set how the OpenMP threads in the C++ layer are pinned to the cpus.
+
+    On machines with several sockets, each socket has its own memory (a NUMA node), and
+    reading the memory of another socket is slower.  When the threads are pinned, each
+    top-level cell of a Field is built by the thread that will mostly use it in the
+    calculations, so its memory ends up on that thread's socket.  Each thread then starts on
+    its own cells, and only moves on to the other threads' cells once its own are done.
+
+    The options are:
+
+        - 'none' = Don't pin the threads (the default).  The cells are handed out to the
+          threads in whatever order they are ready for them.
+        - 'compact' = Pin thread t to the t-th cpu the process is allowed to use, so nearby
+          threads, which share their cells when they run out of their own, are usually on the
+          same socket.  This is normally the best choice with several sockets.
+        - 'spread' = Pin the threads to the sockets in turn.  This spreads a small number of
+          threads over all the sockets' memory bandwidth.
+
+    Pinning is only available on Linux with OpenMP.  This applies to the threads set by
+    `set_omp_threads`, and setting that again keeps the policy.
+
+    :param policy:      One of 'none', 'compact', or 'spread'.
+
+    :returns:           Whether the threads are pinned as requested.
+    """
+    policies = ['none', 'compact', 'spread']
+    if policy not in policies:
+        raise ValueError("Invalid thread affinity policy %s. Must be one of %s"%(
+                         policy, policies))
+    return bool(_lib.SetThreadAffinity(policies.index(policy)))
+
+def get_isa():
+    """Get the name of the instruction set used for the vectorized loops in the C++ layer.
+
+    On x86-64, these loops are compiled for several instruction sets, and the best one the
+    cpu supports is chosen when TreeCorr is imported.  This is one of 'avx512', 'avx2',
+    'sse4.2', or 'default' for the baseline of the platform.  To use a lower one, e.g. to get
+    results that are the same to the last digit on different machines, set the environment
+    variable TREECORR_ISA to its name before importing TreeCorr.
+
+    :returns:           The name of the instruction set in use.
+    """
+    return _ffi.string(_lib.GetISA()).decode()
+
+def start_thread_timing():
+    """Start recording how long each OpenMP thread spends in the parallel loops over the
+    top-level cells in the C++ layer.
+
+    This covers the two-point and three-point ``process`` calculations and the patch
+    assignments of the k-means algorithm.  Any times recorded before are discarded.
+    Use `stop_thread_timing` to get them.
+    """
+    _lib.SetThreadTimes(1)
+
+def stop_thread_timing():
+    """Stop recording the thread times started by `start_thread_timing`, and return them.
+
+    The return value is a list with a dict for each parallel loop that ran in the meantime,
+    in the order they finished.  Each dict has the following items:
+
+        - name: The C++ function with the loop, e.g. 'BinnedCorr2::process'.
+        - nthreads: The number of threads used.
+        - wall: The wall time of the whole parallel region in seconds.
+        - busy: An array of the time each thread spent on its top-level cells.
+        - wait: An array of the time each thread spent after its last cell, waiting for the
+          others to finish.  This includes any tasks it picked up from the other threads.
+        - merge: An array of the time each thread spent combining its results into the total.
+        - cost: An array of the time each top-level cell took.
+        - imbalance: max(busy) / mean(busy), which is 1 if the work was perfectly balanced.
+
+    The time of a cell includes any tasks its thread picked up while working on it, and not
+    the tasks it split off, so the costs are only approximate when the work is split into
+    tasks.
+
+    :returns:           A list of dicts with the times of each parallel loop.
+    """
+    report = []
+    for i in range(_lib.GetNThreadTimes()):
+        nthreads = _ffi.new('int*')
+        nitems = _ffi.new('long*')
+        name = _ffi.string(_lib.GetThreadTimesInfo(i, nthreads, nitems)).decode()
+        wall = np.zeros(1, dtype=float)
+        busy = np.zeros(nthreads[0], dtype=float)
+        wait = np.zeros(nthreads[0], dtype=float)
+        merge = np.zeros(nthreads[0], dtype=float)
+        cost = np.zeros(nitems[0], dtype=float)
+        _lib.GetThreadTimes(i, double_ptr(wall), double_ptr(busy), double_ptr(wait),
+                            double_ptr(merge), double_ptr(cost))
+        mean_busy = np.mean(busy)
+        report.append(dict(name=name, nthreads=nthreads[0], wall=wall[0], busy=busy,
+                           wait=wait, merge=merge, cost=cost,
+                           imbalance=np.max(busy)/mean_busy if mean_busy > 0 else 1.))
+    _lib.SetThreadTimes(0)
+    return report
+
+_tracing = False
+
+def start_tracing():
+    """Start recording a trace of the time spent in the main steps of the calculations.
+
+    The trace has a span for each of these steps, on the thread where it ran:
+
+        - Reading a catalog (Catalog.load) and GenerateXYZ, which makes the x, y, z values
+          for ra, dec input.
+        - The initialization and each iteration of the k-means algorithm, and QuickAssign,
+          which assigns the objects to the nearest patch centers.
+        - Setting up the top-level cells of a Field (SetupTopLevelCells) and building each
+          of them (BuildCell).
+        - The python part of processing a correlation over all the pairs of patches, and
+          each call to ProcessAuto2 or ProcessCross2 in it.
+        - Combining the results of the threads (BinnedCorr2::merge), of the pairs of
+          patches (sum_results), and of the MPI processes (reduce_results).
+        - Estimating a covariance matrix (estimate_cov).
+
+    Any trace recorded before is discarded.  Use `stop_tracing` to get it.
+    """
+    global _tracing
+    _lib.SetTrace(1)
+    _tracing = True
+
+def stop_tracing(file_name=None):
+    """Stop recording the trace started by `start_tracing`, and return it.
+
+    The trace is a list of events in the Chrome trace format, which can be viewed as a
+    timeline in chrome://tracing or https://ui.perfetto.dev.  Each one is a dict with the
+    name of the step, ``cat`` = 'python' or 'C++' for where it ran, ``ph`` = 'X', its start
+    ``ts`` and duration ``dur`` in microseconds, and the ``pid`` and ``tid`` of the process
+    and thread.  For some steps, ``args`` has the index of the top-level cell, the patches,
+    the iteration, or the number of objects.
+
+    :param file_name:   If given, also write the trace to this file as JSON.
+                        (default: None)
+
+    :returns:           A list of the events.
+    """
+    global _tracing
+    _tracing = False
+    pid = os.getpid()
+    events = []
+    python_tids = set()
+    tid = _ffi.new('int*')
+    start = _ffi.new('double*')
+    end = _ffi.new('double*')
+    args = _ffi.new('long[2]')
+    python = _ffi.new('int*')
+    for i in range(_lib.GetNTrace()):
+        name = _ffi.string(_lib.GetTrace(i, tid, start, end, args, python)).decode()
+        event = dict(name=name, cat='python' if python[0] else 'C++', ph='X',
+                     ts=start[0]*1.e6, dur=(end[0]-start[0])*1.e6, pid=pid, tid=tid[0])
+        event_args = { k: a for k, a in zip(['i', 'j'], args) if a >= 0 }
+        if event_args:
+            event['args'] = event_args
+        if python[0]:
+            python_tids.add(tid[0])
+        events.append(event)
+    _lib.SetTrace(0)
+    events.sort(key=lambda e: e['ts'])
+
+    if file_name is not None:
+        import json
+        meta = [ dict(name='thread_name', ph='M', pid=pid, tid=t, args=dict(name='python'))
+                 for t in sorted(python_tids) ]
+        with open(file_name, 'w') as fout:
+            json.dump(dict(traceEvents=meta + events, displayTimeUnit='ms'), fout)
+    return events
+
+def trace_span(name):
+    """A decorator that adds a span to the trace for each call of the function while
+    `start_tracing` is on.
+    """
+    def decorator(func):
+        @functools.wraps(func)
+        def wrapper(*args, **kwargs):
+            if not _tracing:
+                return func(*args, **kwargs)
+            start = _lib.GetTraceTime()
+            try:
+                return func(*args, **kwargs)
+            finally:
+                _lib.AddTrace(name.encode(), start, _lib.GetTraceTime())
+        return wrapper
+    return decorator
+
 def parse_file_type(file_type, file_name, output=False, logger=None):
     """Parse the file_type from the file_name if necessary
 
@@ -217,6 +402,10 @@ class LRU_Cache(object):
         """Lists all items stored in the cache"""
         return list([v[3] for v in self.cache.values() if v[3] is not None])
 
+    def keys(self):
+        """Lists the keys of all items stored in the cache"""
+        return list([v[2] for v in self.cache.values() if v[3] is not None])
+
     @property
     def last_value(self):
         """Return the most recently used value"""
@@ -269,6 +458,200 @@ class LRU_Cache(object):
     def size(self):
         return len(self.cache)
 
+class Checkpoint(object):
+    """The saved progress of a long-running `BinnedCorr2.process` or `BinnedCorr3.process`.
+
+    The loops over the pairs (or triplets) of patches record each set of patches once it is
+    done, and for a three-point correlation of a single catalog, the top-level cells whose
+    triangles are done.  Every ``interval`` seconds, these are written to the file along with
+    the arrays accumulated so far, both in the correlation itself and in its results for each
+    set of patches.  Then if the same process call is started again, e.g. after the job was
+    preempted, it reads the file and skips the work that is already done.
+
+    The file is a numpy .npz file, with the results for each set of patches stored like in
+    `BinnedCorr2.save_patch_results`, i.e. only the range of bins with any values.  It is
+    written to a temporary file first, which is then renamed, so an interruption while
+    writing doesn't lose the previous checkpoint.
+
+    Without a file name, nothing is saved, but the loops can use it the same way.
+
+    The file is left in place when the loop is done, so running the same calculation again
+    just reads the results.  To make sure it isn't used for a different calculation, e.g. the
+    RR pairs after the DD pairs with the same checkpoint_file, the file also records the
+    number of objects and the sum of the weights of each catalog, along with min_sep, max_sep
+    and bin_slop, and these must all match when resuming.
+
+    :param corr:        The correlation object being processed.
+    :param file_name:   The name of the checkpoint file, or None.
+    :param interval:    How many seconds to wait between writing the file.
+    :param kind:        A string identifying the loop, which must match when resuming.
+    :param npatch:      The numbers of patches, which must match when resuming.
+    :param cats:        The catalogs being processed, usually one for each patch.
+    :param comm:        If using MPI, each process uses its own file, with the rank appended
+                        to file_name.  [Default: None]
+    """
+    def __init__(self, corr, file_name, interval, kind, npatch, cats, comm=None):
+        self.corr = corr
+        if file_name is not None and comm is not None:
+            file_name = '%s.%d'%(file_name, comm.Get_rank())
+        self.file_name = file_name
+        self.interval = interval
+        self.kind = kind
+        self.npatch = np.array(npatch, dtype=np.int64)
+        # This needs sumw, which may load the catalogs, so only do it when there is a file.
+        self.fingerprint = self._fingerprint(corr, cats) if file_name is not None else None
+        self.done = set()
+        self.cells = None
+        self.last = time.time()
+
+    def load(self):
+        """Read the checkpoint file, if it exists, and restore the progress saved in it.
+        """
+        if self.file_name is None or not os.path.isfile(self.file_name):
+            return
+        with np.load(self.file_name, allow_pickle=False) as data:
+            data = {key: data[key] for key in data.files}
+        if (str(data['cls']) != type(self.corr).__name__ or str(data['kind']) != self.kind
+                or not np.array_equal(data['npatch'], self.npatch)
+                or tuple(data['shape']) != self.corr.logr.shape
+                or 'fingerprint' not in data
+                or not np.array_equal(data['fingerprint'], self.fingerprint)):
+            raise ValueError("Checkpoint file %s is for a different calculation"%self.file_name)
+        self.corr.logger.info('Resuming from checkpoint file %s',self.file_name)
+        self.done = set(tuple(int(i) for i in key) for key in data['done'])
+        if 'cells' in data:
+            self.cells = data['cells']
+        self._set_values(self.corr, data, 'self_', None)
+        empty = self.corr.copy()
+        empty.results = {}
+        empty._clear()
+        self.corr.results = {}
+        for k, key in enumerate(data['keys']):
+            result = empty.copy()
+            self._set_values(result, data, 'col_', k)
+            self.corr.results[tuple(int(i) for i in key)] = result
+
+    def finish(self, key):
+        """Record that the job for the given set of patches is done, and save if it's time.
+        """
+        self.done.add(key)
+        self.save_if_due()
+
+    def chunks(self, jobs):
+        """Split a list of jobs that would be done in one call to the C layer into chunks,
+        so the progress can be saved between them.  Without a file, they are all one chunk.
+        """
+        if len(jobs) == 0:
+            return []
+        if self.file_name is None:
+            return [jobs]
+        # Each chunk is about 1% of the jobs, but enough to keep all the threads busy.
+        n = max(4*get_omp_threads(), (len(jobs)+99)//100)
+        return [jobs[k:k+n] for k in range(0, len(jobs), n)]
+
+    def save_if_due(self):
+        """Save the progress if the last save was at least interval seconds ago.
+        """
+        if self.file_name is not None and time.time() - self.last >= self.interval:
+            self.save()
+
+    def save(self):
+        """Save the progress to the checkpoint file.
+        """
+        if self.file_name is None:
+            return
+        corr = self.corr
+        keys = list(corr.results.keys())
+        values = [self._values(corr.results[key]) for key in keys]
+        names = list(values[0].keys()) if len(values) > 0 else []
+
+        # As in save_patch_results, only store the bins from the first to the last with any
+        # values for each set of patches.  (The tot values are each stored as a single bin.)
+        columns = {}
+        first = np.zeros(len(keys), dtype=np.int64)
+        start = np.zeros(len(keys)+1, dtype=np.int64)
+        for k, v in enumerate(values):
+            nz = np.flatnonzero(np.any([v[name].ravel() != 0 for name in names
+                                        if v[name].ndim > 0], axis=0))
+            if len(nz) > 0:
+                first[k] = nz[0]
+                start[k+1] = start[k] + nz[-1] + 1 - nz[0]
+            else:
+                start[k+1] = start[k]
+        for name in names:
+            if values[0][name].ndim == 0:
+                columns['col_' + name] = np.array([v[name] for v in values])
+            else:
+                columns['col_' + name] = np.concatenate(
+                    [v[name].ravel()[first[k]:first[k]+start[k+1]-start[k]]
+                     for k, v in enumerate(values)])
+        for name, value in self._values(corr).items():
+            columns['self_' + name] = value
+        if self.cells is not None:
+            columns['cells'] = self.cells
+        nkey = len(self.npatch)
+        done = np.array(sorted(self.done), dtype=np.int64).reshape(len(self.done), nkey)
+
+        tmp_name = self.file_name + '.tmp'
+        with open(tmp_name, 'wb') as fout:
+            np.savez(fout, cls=type(corr).__name__, kind=self.kind, npatch=self.npatch,
+                     shape=np.array(corr.logr.shape), fingerprint=self.fingerprint, done=done,
+                     keys=np.array(keys, dtype=np.int64).reshape(len(keys), nkey),
+                     first=first, start=start, **columns)
+        os.replace(tmp_name, self.file_name)
+        corr.logger.info('Wrote checkpoint file %s',self.file_name)
+        self.last = time.time()
+
+    @staticmethod
+    def _fingerprint(corr, cats):
+        # The values that identify the calculation, other than the kind, npatch and the shape
+        # of the bins: min_sep, max_sep and bin_slop (which may be a value for each bin), and
+        # the number of objects and sum of the weights of each catalog.
+        values = [corr.min_sep or 0., corr.max_sep or 0.]
+        values.extend(np.ravel(corr.bin_slop))
+        for c in cats:
+            values.extend([c.ntot, c.sumw])
+        return np.array(values, dtype=float)
+
+    @staticmethod
+    def _values(corr, prefix=''):
+        # The accumulated values of corr by name: the public arrays with the shape of the bins
+        # and tot, if it has one.  For the Cross classes, those of each correlation in _all.
+        values = {}
+        for n, c in enumerate(getattr(corr, '_all', [])):
+            values.update(Checkpoint._values(c, '%s%d.'%(prefix,n)))
+        ids = set()
+        for name, value in corr.__dict__.items():
+            if (not name.startswith('_') and isinstance(value, np.ndarray)
+                    and value.shape == corr.logr.shape and id(value) not in ids):
+                values[prefix + name] = value
+                ids.add(id(value))
+        if hasattr(corr, 'tot'):
+            values[prefix + 'tot'] = np.array(corr.tot, dtype=float)
+        return values
+
+    def _set_values(self, corr, data, col, k):
+        # Set the accumulated values of corr from the columns in data, either the 'self_'
+        # ones (k = None) or row k of the 'col_' ones.
+        for name, value in self._values(corr).items():
+            if col + name not in data:
+                continue  # e.g. an array made by finalize in an earlier calculation.
+            obj = corr
+            *path, attr = name.split('.')
+            for n in path:
+                obj = obj._all[int(n)]
+            column = data[col + name]
+            if value.ndim == 0:
+                setattr(obj, attr, float(column if k is None else column[k]))
+            elif k is None:
+                value[...] = column.reshape(value.shape)
+            else:
+                n = data['start'][k+1] - data['start'][k]
+                flat = value.reshape(-1)
+                flat[...] = 0
+                flat[data['first'][k]:data['first'][k]+n] = column[data['start'][k]:
+                                                                   data['start'][k]+n]
+
 def double_ptr(x):
     """
     Cast x as a double* to pass to library C functions
@@ -293,7 +676,7 @@ def long_ptr(x):
 
     :returns:   A version of the array that can be passed to cffi C functions.
     """
-    if x is None:  # pragma: no cover   (I don't ever have x=None for this one.)
+    if x is None:
         return _ffi.cast('long*', 0)
     else:
         return _ffi.cast('long*', x.ctypes.data)